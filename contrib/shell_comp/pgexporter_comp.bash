@@ -8,7 +8,7 @@ pgexporter_cli_completions()
     if [ "${#COMP_WORDS[@]}" == "2" ]; then
         # main completion: the user has specified nothing at all
         # or a single word, that is a command
-        COMPREPLY=($(compgen -W "ping shutdown status conf clear" "${COMP_WORDS[1]}"))
+        COMPREPLY=($(compgen -W "ping shutdown status conf clear trace" "${COMP_WORDS[1]}"))
     else
         # the user has specified something else
         # subcommand required?
@@ -22,6 +22,9 @@ pgexporter_cli_completions()
             clear)
                 COMPREPLY+=($(compgen -W "prometheus" "${COMP_WORDS[2]}"))
                 ;;
+            trace)
+                COMPREPLY+=($(compgen -W "chrome" "${COMP_WORDS[2]}"))
+                ;;
         esac
     fi
 }
@@ -0,0 +1,2606 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <art.h>
+#include <cmd.h>
+#include <configuration.h>
+#include <deque.h>
+#include <json.h>
+#include <logging.h>
+#include <memory.h>
+#include <network.h>
+#include <prometheus_client.h>
+#include <queries.h>
+#include <shmem.h>
+#include <stats.h>
+#include <utils.h>
+#include <value.h>
+
+/* system */
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define DEFAULT_ITERATIONS 100000
+#define DEFAULT_CLIENTS    8
+#define DEFAULT_REQUESTS   100
+#define DEFAULT_LISTEN     5433
+
+#define MAX_FDS      64
+#define MAX_CLIENTS  256
+#define MAX_SESSIONS 64
+#define MAX_COLUMNS  256
+#define READ_SIZE    65536
+
+#define PROTOCOL_CANCEL_REQUEST 80877102
+#define PROTOCOL_SSL_REQUEST    80877103
+#define PROTOCOL_GSSENC_REQUEST 80877104
+
+#define TEXT_OID 25
+
+/** @struct capture_result
+ * The response of a server to a query, as the messages sent for it
+ */
+struct capture_result
+{
+   char* query;                /**< The query */
+   int number_of_rows;         /**< The number of rows */
+   struct builder description; /**< The RowDescription, empty if there is none */
+   struct builder rows;        /**< The DataRows and the CommandComplete */
+};
+
+/** @struct capture
+ * The responses of a server by query, and its parameters
+ */
+struct capture
+{
+   struct art* results;          /**< query -> capture_result */
+   struct art* parameters;       /**< name -> value, the ParameterStatus of the server */
+   struct capture_result* empty; /**< The response to a statement that isn't known */
+   char* path;                   /**< The file to record into, or NULL when replaying */
+};
+
+/** @struct capture_loader
+ * The state of a capture file while it is parsed
+ */
+struct capture_loader
+{
+   struct capture* capture;        /**< The capture */
+   int depth;                      /**< The number of open containers */
+   bool parameters;                /**< In the parameters */
+   bool queries;                   /**< In the queries */
+   bool columns;                   /**< In the columns of a query */
+   bool rows;                      /**< In the rows of a query */
+   bool row;                       /**< In a row */
+   struct capture_result* result;  /**< The query being read */
+   int number_of_names;            /**< The number of columns */
+   char* names[MAX_COLUMNS];       /**< The columns */
+   int number_of_values;           /**< The number of values of the row */
+   char* values[MAX_COLUMNS];      /**< The values of the row */
+};
+
+/** @struct session
+ * A client of the replaying or the recording server
+ */
+struct session
+{
+   int client;                       /**< The client */
+   int upstream;                     /**< The server when recording, otherwise -1 */
+   bool started;                     /**< Has the startup packet been received */
+   struct builder input;             /**< The data of the client not handled yet */
+   struct builder output;            /**< The data of the server not handled yet */
+   struct art* statements;           /**< The prepared statements, name -> query */
+   char* unnamed;                    /**< The query of the unnamed statement */
+   char* portal;                     /**< The query of the unnamed portal */
+   struct deque* pending;            /**< The queries waiting for their response, when recording */
+   struct capture_result* recording; /**< The response being recorded */
+};
+
+/** @struct load_client
+ * A client of the load generator
+ */
+struct load_client
+{
+   char* host;           /**< The host */
+   int port;             /**< The port */
+   char* path;           /**< The path */
+   int requests;         /**< The number of requests */
+   uint64_t* latencies;  /**< The latency of each request in nanoseconds */
+   int completed;        /**< The number of successful requests */
+   int errors;           /**< The number of failed requests */
+   uint64_t bytes;       /**< The number of bytes received */
+   atomic_int* finished; /**< The number of clients done */
+   pthread_t thread;     /**< The thread */
+};
+
+static volatile sig_atomic_t running = 1;
+
+static int micro(int iterations, char* capture_path, char* payload_path);
+static void bench_art(int n);
+static void bench_deque(int n);
+static void bench_json(int n);
+static void bench_query(struct capture* capture, int rounds);
+static void bench_bridge(char* payload_path, int rounds);
+static int replay(int port, char* capture_path);
+static int record(int port, char* host, int upstream_port, char* capture_path);
+static int load(char* host, int port, char* path, int clients, int requests, pid_t pid);
+static void* load_run(void* arg);
+static int load_request(struct load_client* client, uint64_t* latency);
+static void load_rss(pid_t pid, long* rss, long* peak);
+static int compare_latency(const void* a, const void* b);
+
+static int capture_create(char* path, struct capture** capture);
+static int capture_load(struct capture* capture, char* path);
+static int capture_write(struct capture* capture);
+static struct capture_result* capture_find(struct capture* capture, char* query);
+static void capture_put(struct capture* capture, struct capture_result* result);
+static void capture_startup(struct capture* capture, struct builder* reply);
+static void capture_destroy(struct capture* capture);
+static int loader_begin_object(void* arg, char* key);
+static int loader_end_object(void* arg);
+static int loader_begin_array(void* arg, char* key);
+static int loader_end_array(void* arg);
+static int loader_value(void* arg, char* key, uintptr_t data, enum value_type type);
+
+static struct capture_result* result_create(char* query);
+static void result_columns(struct capture_result* result, int number_of_columns, char** names);
+static void result_row(struct capture_result* result, int number_of_values, char** values);
+static void result_complete(struct capture_result* result);
+static int result_write(struct json_writer* writer, struct capture_result* result);
+static void result_destroy_cb(uintptr_t data);
+
+static int serve(struct capture* capture, int port, char* host, int upstream_port);
+static struct session* session_create(int client, int upstream);
+static int session_client(struct capture* capture, struct session* session, char* data, size_t size);
+static int session_upstream(struct capture* capture, struct session* session, char* data, size_t size);
+static void session_run(struct capture* capture, int fd);
+static void session_destroy(struct session* session);
+static char* session_statement(struct session* session, char* name);
+static void session_prepare(struct session* session, char* name, char* query);
+static int replay_message(struct capture* capture, struct session* session, char kind, char* body, struct builder* reply);
+static int record_client(struct session* session, char kind, char* body);
+static void record_upstream(struct capture* capture, struct session* session, char kind, char* message, size_t size);
+
+static bool next_message(struct builder* buffer, size_t offset, bool startup, char* kind, char** body, size_t* size);
+static void consume(struct builder* buffer, size_t offset);
+static size_t message_begin(struct builder* builder, char kind);
+static void message_end(struct builder* builder, size_t offset);
+static void append_int16(struct builder* builder, int16_t i);
+static void append_int32(struct builder* builder, int32_t i);
+static void append_string(struct builder* builder, char* s);
+static int write_all(int fd, char* data, size_t length);
+static int count_cb(char* data, size_t length, void* arg);
+static uint64_t now_ns(void);
+static void report(char* name, uint64_t operations, uint64_t ns);
+static void stop(int sig);
+
+static void
+version(void)
+{
+   printf("pgexporter-bench %s\n", VERSION);
+   exit(1);
+}
+
+static void
+usage(void)
+{
+   printf("pgexporter-bench %s\n", VERSION);
+   printf("  Benchmark utility for pgexporter\n");
+   printf("\n");
+
+   printf("Usage:\n");
+   printf("  pgexporter-bench [ OPTIONS ] [ COMMAND ] \n");
+   printf("\n");
+   printf("Options:\n");
+   printf("  -n, --iterations N      Set the number of operations of the microbenchmarks\n");
+   printf("  -f, --file FILE         Set the path to a capture file\n");
+   printf("  -b, --bridge FILE       Set the path to a Prometheus response for the bridge microbenchmark\n");
+   printf("  -h, --host HOST         Set the host of the endpoint or of the server to record\n");
+   printf("  -p, --port PORT         Set the port of the endpoint or of the server to record\n");
+   printf("  -l, --listen PORT       Set the port to listen on when replaying or recording\n");
+   printf("  -c, --clients N         Set the number of concurrent clients\n");
+   printf("  -r, --requests N        Set the number of requests of each client\n");
+   printf("  -P, --path PATH         Set the path of the endpoint\n");
+   printf("  -i, --pid PID           Set the process to report the memory of\n");
+   printf("  -V, --version           Display version information\n");
+   printf("  -?, --help              Display help\n");
+   printf("\n");
+   printf("Commands:\n");
+   printf("  micro                   Run the microbenchmarks of the data structures and the parsers\n");
+   printf("  replay                  Serve the result sets of a capture as a PostgreSQL server\n");
+   printf("  record                  Record the result sets of a PostgreSQL server into a capture\n");
+   printf("  load                    Send concurrent requests to an endpoint\n");
+   printf("\n");
+   printf("pgexporter: %s\n", PGEXPORTER_HOMEPAGE);
+   printf("Report bugs: %s\n", PGEXPORTER_ISSUES);
+}
+
+int
+main(int argc, char** argv)
+{
+   int ret = 1;
+   int iterations = DEFAULT_ITERATIONS;
+   int clients = DEFAULT_CLIENTS;
+   int requests = DEFAULT_REQUESTS;
+   int port = 0;
+   int listen_port = DEFAULT_LISTEN;
+   pid_t pid = 0;
+   char* capture_path = NULL;
+   char* payload_path = NULL;
+   char* host = NULL;
+   char* path = "/metrics";
+   char* command = NULL;
+   char* filepath = NULL;
+   int optind = 0;
+   int num_options = 0;
+   int num_results = 0;
+   size_t size;
+   struct configuration* config = NULL;
+
+   // Disable stdout buffering (i.e. write to stdout immediatelly).
+   setbuf(stdout, NULL);
+
+   cli_option options[] = {
+      {"n", "iterations", true},
+      {"f", "file", true},
+      {"b", "bridge", true},
+      {"h", "host", true},
+      {"p", "port", true},
+      {"l", "listen", true},
+      {"c", "clients", true},
+      {"r", "requests", true},
+      {"P", "path", true},
+      {"i", "pid", true},
+      {"V", "version", false},
+      {"?", "help", false},
+   };
+
+   num_options = sizeof(options) / sizeof(cli_option);
+   cli_result results[num_options];
+
+   num_results = cmd_parse(argc, argv, options, num_options, results, num_options, false, &filepath, &optind);
+
+   if (num_results < 0)
+   {
+      errx(1, "Error parsing command line\n");
+      return 1;
+   }
+
+   for (int i = 0; i < num_results; i++)
+   {
+      char* optname = results[i].option_name;
+      char* optarg = results[i].argument;
+
+      if (optname == NULL)
+      {
+         break;
+      }
+      else if (!strcmp(optname, "iterations") || !strcmp(optname, "n"))
+      {
+         iterations = atoi(optarg);
+      }
+      else if (!strcmp(optname, "file") || !strcmp(optname, "f"))
+      {
+         capture_path = optarg;
+      }
+      else if (!strcmp(optname, "bridge") || !strcmp(optname, "b"))
+      {
+         payload_path = optarg;
+      }
+      else if (!strcmp(optname, "host") || !strcmp(optname, "h"))
+      {
+         host = optarg;
+      }
+      else if (!strcmp(optname, "port") || !strcmp(optname, "p"))
+      {
+         port = atoi(optarg);
+      }
+      else if (!strcmp(optname, "listen") || !strcmp(optname, "l"))
+      {
+         listen_port = atoi(optarg);
+      }
+      else if (!strcmp(optname, "clients") || !strcmp(optname, "c"))
+      {
+         clients = atoi(optarg);
+      }
+      else if (!strcmp(optname, "requests") || !strcmp(optname, "r"))
+      {
+         requests = atoi(optarg);
+      }
+      else if (!strcmp(optname, "path") || !strcmp(optname, "P"))
+      {
+         path = optarg;
+      }
+      else if (!strcmp(optname, "pid") || !strcmp(optname, "i"))
+      {
+         pid = (pid_t)atoi(optarg);
+      }
+      else if (!strcmp(optname, "version") || !strcmp(optname, "V"))
+      {
+         version();
+      }
+      else if (!strcmp(optname, "help") || !strcmp(optname, "?"))
+      {
+         usage();
+         exit(1);
+      }
+   }
+
+   if (optind >= argc)
+   {
+      usage();
+      exit(1);
+   }
+
+   command = argv[optind];
+
+   if (iterations <= 0 || clients <= 0 || clients > MAX_CLIENTS || requests <= 0)
+   {
+      errx(1, "pgexporter-bench: Invalid number of iterations, clients or requests");
+   }
+
+   size = sizeof(struct configuration);
+   if (pgexporter_create_shared_memory(size, HUGEPAGE_OFF, &shmem))
+   {
+      errx(1, "pgexporter-bench: Error creating shared memory");
+   }
+   pgexporter_init_configuration(shmem);
+
+   config = (struct configuration*)shmem;
+   config->log_level = PGEXPORTER_LOGGING_LEVEL_ERROR;
+
+   if (pgexporter_start_logging())
+   {
+      errx(1, "pgexporter-bench: Error starting logging");
+   }
+
+   pgexporter_memory_init();
+
+   signal(SIGPIPE, SIG_IGN);
+
+   if (!strcmp(command, "micro"))
+   {
+      ret = micro(iterations, capture_path, payload_path);
+   }
+   else if (!strcmp(command, "replay"))
+   {
+      ret = replay(listen_port, capture_path);
+   }
+   else if (!strcmp(command, "record"))
+   {
+      if (host == NULL || port <= 0 || capture_path == NULL)
+      {
+         errx(1, "pgexporter-bench: record needs -h, -p and -f");
+      }
+
+      ret = record(listen_port, host, port, capture_path);
+   }
+   else if (!strcmp(command, "load"))
+   {
+      if (port <= 0)
+      {
+         errx(1, "pgexporter-bench: load needs -p");
+      }
+
+      ret = load(host != NULL ? host : "localhost", port, path, clients, requests, pid);
+   }
+   else
+   {
+      usage();
+   }
+
+   pgexporter_memory_destroy();
+   pgexporter_stop_logging();
+   pgexporter_destroy_shared_memory(shmem, size);
+
+   return ret;
+}
+
+/**
+ * Run the microbenchmarks
+ * @param iterations The number of operations
+ * @param capture_path The capture to parse the results of, or NULL for a synthetic one
+ * @param payload_path The Prometheus response to parse, or NULL for a synthetic one
+ * @return 0 upon success, otherwise 1
+ */
+static int
+micro(int iterations, char* capture_path, char* payload_path)
+{
+   int rounds = MAX(iterations / 1000, 10);
+   struct capture* capture = NULL;
+
+   if (capture_create(NULL, &capture))
+   {
+      goto error;
+   }
+
+   if (capture_path != NULL)
+   {
+      if (capture_load(capture, capture_path))
+      {
+         warnx("pgexporter-bench: Invalid capture: %s", capture_path);
+         goto error;
+      }
+   }
+   else
+   {
+      char* names[10];
+      char* values[10];
+      char buffer[10][32];
+      struct capture_result* result = NULL;
+
+      /* A result the size of the larger statistics views */
+      result = result_create("SELECT * FROM pgexporter_bench");
+
+      for (int i = 0; i < 10; i++)
+      {
+         snprintf(&buffer[i][0], sizeof(buffer[i]), "column_%d", i);
+         names[i] = &buffer[i][0];
+      }
+      result_columns(result, 10, names);
+
+      for (int row = 0; row < 1000; row++)
+      {
+         for (int i = 0; i < 10; i++)
+         {
+            snprintf(&buffer[i][0], sizeof(buffer[i]), "%d", row * 10 + i);
+            values[i] = &buffer[i][0];
+         }
+         result_row(result, 10, values);
+      }
+      result_complete(result);
+
+      capture_put(capture, result);
+   }
+
+   printf("%-40s %12s %12s %14s\n", "Benchmark", "Operations", "ns/op", "ops/s");
+
+   bench_art(iterations);
+   bench_deque(iterations);
+   bench_json(iterations);
+   bench_query(capture, rounds);
+   bench_bridge(payload_path, rounds);
+
+   capture_destroy(capture);
+
+   return 0;
+
+error:
+
+   capture_destroy(capture);
+
+   return 1;
+}
+
+static void
+bench_art(int n)
+{
+   char** keys = NULL;
+   uint64_t start;
+   uint64_t count = 0;
+   struct art* tree = NULL;
+   struct art_iterator* iter = NULL;
+
+   keys = calloc(n, sizeof(char*));
+   if (keys == NULL || pgexporter_art_create(&tree))
+   {
+      goto done;
+   }
+
+   for (int i = 0; i < n; i++)
+   {
+      keys[i] = pgexporter_append(NULL, "pg_stat_database_blks_hit{server=\"primary\",database=\"");
+      keys[i] = pgexporter_append_int(keys[i], i);
+      keys[i] = pgexporter_append(keys[i], "\"}");
+   }
+
+   start = now_ns();
+   for (int i = 0; i < n; i++)
+   {
+      pgexporter_art_insert(tree, keys[i], (uintptr_t)i, ValueInt64);
+   }
+   report("art insert", n, now_ns() - start);
+
+   start = now_ns();
+   for (int i = 0; i < n; i++)
+   {
+      count += pgexporter_art_search(tree, keys[i]);
+   }
+   report("art search", n, now_ns() - start);
+
+   count = 0;
+   start = now_ns();
+   if (pgexporter_art_iterator_create(tree, &iter) == 0)
+   {
+      while (pgexporter_art_iterator_next(iter))
+      {
+         count++;
+      }
+      pgexporter_art_iterator_destroy(iter);
+   }
+   report("art iterate", count, now_ns() - start);
+
+   start = now_ns();
+   pgexporter_art_destroy(tree);
+   tree = NULL;
+   report("art destroy", n, now_ns() - start);
+
+done:
+
+   pgexporter_art_destroy(tree);
+
+   for (int i = 0; keys != NULL && i < n; i++)
+   {
+      free(keys[i]);
+   }
+   free(keys);
+}
+
+static void
+bench_deque(int n)
+{
+   uint64_t start;
+   uint64_t count = 0;
+   struct deque* deque = NULL;
+   struct deque_iterator* iter = NULL;
+
+   if (pgexporter_deque_create(false, &deque))
+   {
+      return;
+   }
+
+   start = now_ns();
+   for (int i = 0; i < n; i++)
+   {
+      pgexporter_deque_add(deque, NULL, (uintptr_t)i, ValueInt64);
+   }
+   report("deque add", n, now_ns() - start);
+
+   start = now_ns();
+   if (pgexporter_deque_iterator_create(deque, &iter) == 0)
+   {
+      while (pgexporter_deque_iterator_next(iter))
+      {
+         count++;
+      }
+      pgexporter_deque_iterator_destroy(iter);
+   }
+   report("deque iterate", count, now_ns() - start);
+
+   start = now_ns();
+   for (int i = 0; i < n; i++)
+   {
+      pgexporter_deque_poll(deque, NULL);
+   }
+   report("deque poll", n, now_ns() - start);
+
+   pgexporter_deque_destroy(deque);
+}
+
+static void
+bench_json(int n)
+{
+   char key[MISC_LENGTH];
+   char* str = NULL;
+   uint64_t start;
+   struct json* object = NULL;
+   struct json* parsed = NULL;
+   struct json* entry = NULL;
+
+   if (pgexporter_json_create(&object))
+   {
+      return;
+   }
+
+   /* The shape of a management response */
+   start = now_ns();
+   for (int i = 0; i < n; i++)
+   {
+      snprintf(&key[0], sizeof(key), "key_%d", i);
+
+      if (pgexporter_json_create(&entry))
+      {
+         break;
+      }
+      pgexporter_json_put(entry, "name", (uintptr_t)&key[0], ValueString);
+      pgexporter_json_put(entry, "value", (uintptr_t)i, ValueInt64);
+      pgexporter_json_put(object, &key[0], (uintptr_t)entry, ValueJSON);
+   }
+   report("json put", n, now_ns() - start);
+
+   start = now_ns();
+   str = pgexporter_json_to_string(object, FORMAT_JSON_COMPACT, NULL, 0);
+   report("json emit", n, now_ns() - start);
+
+   if (str != NULL)
+   {
+      start = now_ns();
+      if (pgexporter_json_parse_string(str, &parsed) == 0)
+      {
+         report("json parse", n, now_ns() - start);
+      }
+   }
+
+   pgexporter_json_destroy(parsed);
+   pgexporter_json_destroy(object);
+   free(str);
+}
+
+/**
+ * Execute the queries of a capture against a replaying process, such that
+ * the parsing of the results is measured without a server
+ * @param capture The capture
+ * @param rounds The number of executions of each query
+ */
+static void
+bench_query(struct capture* capture, int rounds)
+{
+   int fds[2];
+   pid_t pid;
+   char name[MISC_LENGTH];
+   uint64_t start;
+   struct query* query = NULL;
+   struct capture_result* result = NULL;
+   struct art_iterator* iter = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+   {
+      warn("pgexporter-bench: socketpair");
+      return;
+   }
+
+   pid = fork();
+   if (pid == -1)
+   {
+      warn("pgexporter-bench: fork");
+      close(fds[0]);
+      close(fds[1]);
+      return;
+   }
+   else if (pid == 0)
+   {
+      close(fds[0]);
+      session_run(capture, fds[1]);
+      _exit(0);
+   }
+
+   close(fds[1]);
+
+   config->number_of_servers = 1;
+   config->cache = true;
+   snprintf(&config->servers[0].name[0], MISC_LENGTH, "bench");
+
+   /* The replaying process is the pooled connection of the server */
+   pgexporter_pool_add(0, fds[0]);
+   pgexporter_open_connections();
+
+   if (pgexporter_art_iterator_create(capture->results, &iter) == 0)
+   {
+      while (pgexporter_art_iterator_next(iter))
+      {
+         result = (struct capture_result*)iter->value->data;
+
+         snprintf(&name[0], sizeof(name), "query %.24s (%d rows)", result->query, result->number_of_rows);
+
+         start = now_ns();
+         for (int i = 0; i < rounds; i++)
+         {
+            if (pgexporter_query_execute(0, result->query, "bench", &query))
+            {
+               warnx("pgexporter-bench: Query failed: %s", result->query);
+               break;
+            }
+
+            pgexporter_free_query(query);
+            query = NULL;
+         }
+         report(&name[0], rounds, now_ns() - start);
+      }
+      pgexporter_art_iterator_destroy(iter);
+   }
+
+   pgexporter_close_connections();
+   pgexporter_pool_remove(0);
+   waitpid(pid, NULL, 0);
+}
+
+/**
+ * Parse and render a Prometheus response like the bridge does for an endpoint
+ * @param payload_path The response, or NULL for a synthetic one
+ * @param rounds The number of rounds
+ */
+static void
+bench_bridge(char* payload_path, int rounds)
+{
+   char name[MISC_LENGTH];
+   char* payload = NULL;
+   char* scratch = NULL;
+   size_t length = 0;
+   size_t rendered = 0;
+   uint64_t start;
+   uint64_t parse = 0;
+   uint64_t render = 0;
+   struct builder builder;
+   struct prometheus_bridge* bridge = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   pgexporter_builder_init(&builder, 0);
+
+   if (payload_path != NULL)
+   {
+      FILE* file = fopen(payload_path, "r");
+      char buffer[READ_SIZE];
+      size_t n;
+
+      if (file == NULL)
+      {
+         warn("pgexporter-bench: %s", payload_path);
+         goto done;
+      }
+
+      while ((n = fread(&buffer[0], 1, sizeof(buffer), file)) > 0)
+      {
+         pgexporter_builder_append_length(&builder, &buffer[0], n);
+      }
+      fclose(file);
+   }
+   else
+   {
+      /* A response of a few hundred metrics over a few databases */
+      for (int metric = 0; metric < 200; metric++)
+      {
+         pgexporter_builder_append(&builder, "# HELP pgexporter_bench_");
+         pgexporter_builder_append_int(&builder, metric);
+         pgexporter_builder_append(&builder, " A synthetic metric\n# TYPE pgexporter_bench_");
+         pgexporter_builder_append_int(&builder, metric);
+         pgexporter_builder_append(&builder, " gauge\n");
+
+         for (int sample = 0; sample < 50; sample++)
+         {
+            pgexporter_builder_append(&builder, "pgexporter_bench_");
+            pgexporter_builder_append_int(&builder, metric);
+            pgexporter_builder_append(&builder, "{server=\"primary\",database=\"db");
+            pgexporter_builder_append_int(&builder, sample);
+            pgexporter_builder_append(&builder, "\"} ");
+            pgexporter_builder_append_int(&builder, metric * sample);
+            pgexporter_builder_append(&builder, "\n");
+         }
+      }
+   }
+
+   payload = builder.data;
+   length = builder.length;
+
+   if (payload == NULL || length == 0 || (scratch = malloc(length + 1)) == NULL)
+   {
+      goto done;
+   }
+
+   config->number_of_endpoints = 1;
+   snprintf(&config->endpoints[0].host[0], MISC_LENGTH, "localhost");
+   config->endpoints[0].port = 5002;
+
+   for (int i = 0; i < rounds; i++)
+   {
+      // The parser works in place
+      memcpy(scratch, payload, length);
+      scratch[length] = '\0';
+
+      if (pgexporter_prometheus_client_create_bridge(&bridge))
+      {
+         goto done;
+      }
+
+      start = now_ns();
+      if (pgexporter_prometheus_client_parse(0, scratch, length, bridge))
+      {
+         warnx("pgexporter-bench: Invalid Prometheus response");
+         goto done;
+      }
+      parse += now_ns() - start;
+
+      rendered = 0;
+      start = now_ns();
+      pgexporter_prometheus_client_render(&bridge, 1, count_cb, &rendered, NULL, NULL, NULL);
+      render += now_ns() - start;
+
+      pgexporter_prometheus_client_destroy_bridge(bridge);
+      bridge = NULL;
+   }
+
+   snprintf(&name[0], sizeof(name), "bridge parse (%zu bytes)", length);
+   report(&name[0], rounds, parse);
+   snprintf(&name[0], sizeof(name), "bridge render (%zu bytes)", rendered);
+   report(&name[0], rounds, render);
+
+done:
+
+   pgexporter_prometheus_client_destroy_bridge(bridge);
+   pgexporter_builder_destroy(&builder);
+   free(scratch);
+}
+
+/**
+ * Serve the result sets of a capture, such that pgexporter can be run
+ * against a server of a known shape and size
+ * @param port The port
+ * @param capture_path The capture, or NULL to answer every query with an empty result
+ * @return 0 upon success, otherwise 1
+ */
+static int
+replay(int port, char* capture_path)
+{
+   int ret;
+   struct capture* capture = NULL;
+
+   if (capture_create(NULL, &capture))
+   {
+      return 1;
+   }
+
+   if (capture_path != NULL && capture_load(capture, capture_path))
+   {
+      warnx("pgexporter-bench: Invalid capture: %s", capture_path);
+      capture_destroy(capture);
+      return 1;
+   }
+
+   printf("Replaying %s on port %d\n", capture_path != NULL ? capture_path : "an empty capture", port);
+
+   ret = serve(capture, port, NULL, 0);
+
+   capture_destroy(capture);
+
+   return ret;
+}
+
+/**
+ * Proxy the clients to a server and record the result sets of their queries
+ * @param port The port
+ * @param host The host of the server
+ * @param upstream_port The port of the server
+ * @param capture_path The capture to write
+ * @return 0 upon success, otherwise 1
+ */
+static int
+record(int port, char* host, int upstream_port, char* capture_path)
+{
+   int ret;
+   struct capture* capture = NULL;
+
+   if (capture_create(capture_path, &capture))
+   {
+      return 1;
+   }
+
+   printf("Recording %s:%d on port %d into %s\n", host, upstream_port, port, capture_path);
+
+   ret = serve(capture, port, host, upstream_port);
+
+   if (capture_write(capture))
+   {
+      warnx("pgexporter-bench: Could not write %s", capture_path);
+      ret = 1;
+   }
+
+   capture_destroy(capture);
+
+   return ret;
+}
+
+/**
+ * Send concurrent requests to an endpoint, and report the latencies and
+ * the memory of the process serving them
+ * @param host The host
+ * @param port The port
+ * @param path The path
+ * @param clients The number of clients
+ * @param requests The number of requests of each client
+ * @param pid The process to report the memory of, or 0
+ * @return 0 upon success, otherwise 1
+ */
+static int
+load(char* host, int port, char* path, int clients, int requests, pid_t pid)
+{
+   int completed = 0;
+   int errors = 0;
+   int started = 0;
+   uint64_t bytes = 0;
+   uint64_t start;
+   uint64_t duration;
+   uint64_t* latencies = NULL;
+   long rss = 0;
+   long peak = 0;
+   long max_rss = 0;
+   long hwm = 0;
+   atomic_int finished;
+   struct load_client* client = NULL;
+
+   atomic_init(&finished, 0);
+
+   client = calloc(clients, sizeof(struct load_client));
+   latencies = calloc((size_t)clients * requests, sizeof(uint64_t));
+   if (client == NULL || latencies == NULL)
+   {
+      goto error;
+   }
+
+   start = now_ns();
+
+   for (int i = 0; i < clients; i++)
+   {
+      client[i].host = host;
+      client[i].port = port;
+      client[i].path = path;
+      client[i].requests = requests;
+      client[i].latencies = latencies + (size_t)i * requests;
+      client[i].finished = &finished;
+
+      if (pthread_create(&client[i].thread, NULL, load_run, &client[i]))
+      {
+         warnx("pgexporter-bench: Could not start client %d", i);
+         atomic_fetch_add(&finished, clients - i);
+         break;
+      }
+      started++;
+   }
+
+   while (atomic_load(&finished) < clients)
+   {
+      if (pid > 0)
+      {
+         load_rss(pid, &rss, &peak);
+         max_rss = MAX(max_rss, rss);
+         hwm = MAX(hwm, peak);
+      }
+
+      usleep(100000);
+   }
+
+   for (int i = 0; i < started; i++)
+   {
+      pthread_join(client[i].thread, NULL);
+   }
+
+   duration = now_ns() - start;
+
+   for (int i = 0; i < started; i++)
+   {
+      memmove(latencies + completed, client[i].latencies, client[i].completed * sizeof(uint64_t));
+      completed += client[i].completed;
+      errors += client[i].errors;
+      bytes += client[i].bytes;
+   }
+
+   qsort(latencies, completed, sizeof(uint64_t), compare_latency);
+
+   printf("Requests:   %d (%d errors) from %d clients\n", completed + errors, errors, started);
+   printf("Duration:   %.3f s\n", duration / 1e9);
+   printf("Throughput: %.1f requests/s, %.1f MB/s\n",
+          duration > 0 ? completed * 1e9 / duration : 0.0,
+          duration > 0 ? bytes * 1e9 / duration / (1024 * 1024) : 0.0);
+   printf("Bytes:      %" PRIu64 " (%" PRIu64 " per request)\n", bytes, completed > 0 ? bytes / completed : 0);
+
+   if (completed > 0)
+   {
+      printf("Latency:    p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+             latencies[(completed - 1) * 50 / 100] / 1e6,
+             latencies[(completed - 1) * 90 / 100] / 1e6,
+             latencies[(completed - 1) * 99 / 100] / 1e6,
+             latencies[completed - 1] / 1e6);
+   }
+
+   if (pid > 0)
+   {
+      printf("Memory:     RSS %ld kB, peak RSS %ld kB (process %d)\n", max_rss, hwm, (int)pid);
+   }
+
+   free(client);
+   free(latencies);
+
+   return errors > 0 ? 1 : 0;
+
+error:
+
+   free(client);
+   free(latencies);
+
+   return 1;
+}
+
+static void*
+load_run(void* arg)
+{
+   uint64_t latency;
+   struct load_client* client = (struct load_client*)arg;
+
+   for (int i = 0; i < client->requests && running; i++)
+   {
+      if (load_request(client, &latency))
+      {
+         client->errors++;
+      }
+      else
+      {
+         client->latencies[client->completed++] = latency;
+      }
+   }
+
+   atomic_fetch_add(client->finished, 1);
+
+   return NULL;
+}
+
+static int
+load_request(struct load_client* client, uint64_t* latency)
+{
+   int fd = -1;
+   bool ok = false;
+   ssize_t n;
+   size_t received = 0;
+   uint64_t start;
+   char status[13];
+   char buffer[READ_SIZE];
+   char request[MAX_PATH + MISC_LENGTH + 64];
+   struct pollfd pfd;
+
+   start = now_ns();
+
+   if (pgexporter_connect(client->host, client->port, &fd))
+   {
+      goto error;
+   }
+
+   snprintf(&request[0], sizeof(request), "GET %s HTTP/1.1\r\nHost: %s:%d\r\nConnection: close\r\n\r\n",
+            client->path, client->host, client->port);
+
+   if (write_all(fd, &request[0], strlen(&request[0])))
+   {
+      goto error;
+   }
+
+   memset(&status[0], 0, sizeof(status));
+
+   while (true)
+   {
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+
+      if (poll(&pfd, 1, 30000) <= 0)
+      {
+         goto error;
+      }
+
+      n = read(fd, &buffer[0], sizeof(buffer));
+      if (n < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      else if (n < 0)
+      {
+         goto error;
+      }
+      else if (n == 0)
+      {
+         break;
+      }
+
+      if (received < sizeof(status) - 1)
+      {
+         memcpy(&status[received], &buffer[0], MIN((size_t)n, sizeof(status) - 1 - received));
+      }
+      received += n;
+   }
+
+   ok = !strncmp(&status[0], "HTTP/1.1 200", 12);
+
+   *latency = now_ns() - start;
+   client->bytes += received;
+
+   pgexporter_disconnect(fd);
+
+   return ok ? 0 : 1;
+
+error:
+
+   if (fd != -1)
+   {
+      pgexporter_disconnect(fd);
+   }
+
+   return 1;
+}
+
+static void
+load_rss(pid_t pid, long* rss, long* peak)
+{
+   char path[MISC_LENGTH];
+   char line[MISC_LENGTH];
+   FILE* file = NULL;
+
+   snprintf(&path[0], sizeof(path), "/proc/%d/status", (int)pid);
+
+   file = fopen(&path[0], "r");
+   if (file == NULL)
+   {
+      return;
+   }
+
+   while (fgets(&line[0], sizeof(line), file) != NULL)
+   {
+      if (!strncmp(&line[0], "VmRSS:", 6))
+      {
+         *rss = atol(&line[6]);
+      }
+      else if (!strncmp(&line[0], "VmHWM:", 6))
+      {
+         *peak = atol(&line[6]);
+      }
+   }
+
+   fclose(file);
+}
+
+static int
+compare_latency(const void* a, const void* b)
+{
+   uint64_t x = *(const uint64_t*)a;
+   uint64_t y = *(const uint64_t*)b;
+
+   return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static int
+capture_create(char* path, struct capture** capture)
+{
+   struct capture* c = NULL;
+
+   *capture = NULL;
+
+   c = calloc(1, sizeof(struct capture));
+   if (c == NULL)
+   {
+      goto error;
+   }
+
+   if (pgexporter_art_create(&c->results) || pgexporter_art_create(&c->parameters))
+   {
+      goto error;
+   }
+
+   // An empty query string gets an EmptyQueryResponse
+   c->empty = result_create("");
+   if (c->empty == NULL)
+   {
+      goto error;
+   }
+   message_end(&c->empty->rows, message_begin(&c->empty->rows, 'I'));
+
+   c->path = path;
+
+   *capture = c;
+
+   return 0;
+
+error:
+
+   capture_destroy(c);
+
+   return 1;
+}
+
+static int
+capture_load(struct capture* capture, char* path)
+{
+   int ret;
+   struct capture_loader loader;
+   struct json_handler handler;
+
+   memset(&loader, 0, sizeof(struct capture_loader));
+   loader.capture = capture;
+
+   memset(&handler, 0, sizeof(struct json_handler));
+   handler.arg = &loader;
+   handler.begin_object = loader_begin_object;
+   handler.end_object = loader_end_object;
+   handler.begin_array = loader_begin_array;
+   handler.end_array = loader_end_array;
+   handler.value = loader_value;
+
+   ret = pgexporter_json_read_file_sax(path, &handler);
+
+   // A document that ended early
+   for (int i = 0; i < loader.number_of_names; i++)
+   {
+      free(loader.names[i]);
+   }
+   for (int i = 0; i < loader.number_of_values; i++)
+   {
+      free(loader.values[i]);
+   }
+   if (loader.result != NULL)
+   {
+      result_destroy_cb((uintptr_t)loader.result);
+   }
+
+   return ret;
+}
+
+static int
+capture_write(struct capture* capture)
+{
+   FILE* file = NULL;
+   struct json_writer writer;
+   struct art_iterator* iter = NULL;
+
+   if (capture->path == NULL)
+   {
+      return 0;
+   }
+
+   file = fopen(capture->path, "w");
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   pgexporter_json_writer_init(&writer, FORMAT_JSON, pgexporter_json_sink_file, file);
+
+   pgexporter_json_writer_begin_object(&writer, NULL);
+
+   pgexporter_json_writer_begin_object(&writer, "parameters");
+   if (pgexporter_art_iterator_create(capture->parameters, &iter) == 0)
+   {
+      while (pgexporter_art_iterator_next(iter))
+      {
+         pgexporter_json_writer_value(&writer, iter->key, iter->value->data, ValueString);
+      }
+      pgexporter_art_iterator_destroy(iter);
+      iter = NULL;
+   }
+   pgexporter_json_writer_end_object(&writer);
+
+   pgexporter_json_writer_begin_array(&writer, "queries");
+   if (pgexporter_art_iterator_create(capture->results, &iter) == 0)
+   {
+      while (pgexporter_art_iterator_next(iter))
+      {
+         result_write(&writer, (struct capture_result*)iter->value->data);
+      }
+      pgexporter_art_iterator_destroy(iter);
+      iter = NULL;
+   }
+   pgexporter_json_writer_end_array(&writer);
+
+   pgexporter_json_writer_end_object(&writer);
+
+   if (pgexporter_json_writer_flush(&writer) || writer.error)
+   {
+      goto error;
+   }
+
+   fputc('\n', file);
+   fclose(file);
+
+   return 0;
+
+error:
+
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+
+   return 1;
+}
+
+static struct capture_result*
+capture_find(struct capture* capture, char* query)
+{
+   struct capture_result* result = NULL;
+
+   if (query == NULL || strlen(query) == 0)
+   {
+      return capture->empty;
+   }
+
+   result = (struct capture_result*)pgexporter_art_search(capture->results, query);
+   if (result == NULL)
+   {
+      // Answered with an empty result from now on
+      warnx("pgexporter-bench: Not in the capture: %s", query);
+
+      result = result_create(query);
+      if (result == NULL)
+      {
+         return capture->empty;
+      }
+
+      result_columns(result, 0, NULL);
+      result_complete(result);
+      capture_put(capture, result);
+   }
+
+   return result;
+}
+
+static void
+capture_put(struct capture* capture, struct capture_result* result)
+{
+   struct value_config config = {.destroy_data = result_destroy_cb, .to_string = NULL};
+
+   if (pgexporter_art_insert_with_config(capture->results, result->query, (uintptr_t)result, &config))
+   {
+      result_destroy_cb((uintptr_t)result);
+   }
+}
+
+static void
+capture_startup(struct capture* capture, struct builder* reply)
+{
+   size_t m;
+   char* defaults[][2] = {
+      {"server_version", "17.0"},
+      {"server_encoding", "UTF8"},
+      {"client_encoding", "UTF8"},
+      {"DateStyle", "ISO, MDY"},
+      {"integer_datetimes", "on"},
+      {"standard_conforming_strings", "on"},
+   };
+   struct art_iterator* iter = NULL;
+
+   // AuthenticationOk
+   m = message_begin(reply, 'R');
+   append_int32(reply, 0);
+   message_end(reply, m);
+
+   for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+   {
+      if (!pgexporter_art_contains_key(capture->parameters, defaults[i][0]))
+      {
+         m = message_begin(reply, 'S');
+         append_string(reply, defaults[i][0]);
+         append_string(reply, defaults[i][1]);
+         message_end(reply, m);
+      }
+   }
+
+   if (pgexporter_art_iterator_create(capture->parameters, &iter) == 0)
+   {
+      while (pgexporter_art_iterator_next(iter))
+      {
+         m = message_begin(reply, 'S');
+         append_string(reply, iter->key);
+         append_string(reply, (char*)iter->value->data);
+         message_end(reply, m);
+      }
+      pgexporter_art_iterator_destroy(iter);
+   }
+
+   // BackendKeyData
+   m = message_begin(reply, 'K');
+   append_int32(reply, (int32_t)getpid());
+   append_int32(reply, 0);
+   message_end(reply, m);
+
+   m = message_begin(reply, 'Z');
+   pgexporter_builder_append_char(reply, 'I');
+   message_end(reply, m);
+}
+
+static void
+capture_destroy(struct capture* capture)
+{
+   if (capture == NULL)
+   {
+      return;
+   }
+
+   pgexporter_art_destroy(capture->results);
+   pgexporter_art_destroy(capture->parameters);
+
+   if (capture->empty != NULL)
+   {
+      result_destroy_cb((uintptr_t)capture->empty);
+   }
+
+   free(capture);
+}
+
+/* A capture is {"parameters": {name: value}, "queries": [{"query": ..., "columns": [...], "rows": [[...]]}]} */
+
+static int
+loader_begin_object(void* arg, char* key)
+{
+   struct capture_loader* loader = (struct capture_loader*)arg;
+
+   loader->depth++;
+
+   if (loader->depth == 2 && key != NULL && !strcmp(key, "parameters"))
+   {
+      loader->parameters = true;
+   }
+   else if (loader->depth == 3 && loader->queries)
+   {
+      loader->result = result_create(NULL);
+      if (loader->result == NULL)
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+static int
+loader_end_object(void* arg)
+{
+   struct capture_loader* loader = (struct capture_loader*)arg;
+
+   if (loader->depth == 3 && loader->result != NULL)
+   {
+      if (loader->result->query == NULL)
+      {
+         result_destroy_cb((uintptr_t)loader->result);
+         loader->result = NULL;
+         return 1;
+      }
+
+      result_complete(loader->result);
+      capture_put(loader->capture, loader->result);
+      loader->result = NULL;
+   }
+   else if (loader->depth == 2)
+   {
+      loader->parameters = false;
+   }
+
+   loader->depth--;
+
+   return 0;
+}
+
+static int
+loader_begin_array(void* arg, char* key)
+{
+   struct capture_loader* loader = (struct capture_loader*)arg;
+
+   loader->depth++;
+
+   if (loader->depth == 2 && key != NULL && !strcmp(key, "queries"))
+   {
+      loader->queries = true;
+   }
+   else if (loader->depth == 4 && loader->result != NULL && key != NULL)
+   {
+      loader->columns = !strcmp(key, "columns");
+      loader->rows = !strcmp(key, "rows");
+
+      // The columns come before the rows
+      if (loader->rows && loader->result->description.length == 0)
+      {
+         return 1;
+      }
+   }
+   else if (loader->depth == 5 && loader->rows)
+   {
+      loader->row = true;
+      loader->number_of_values = 0;
+   }
+
+   return 0;
+}
+
+static int
+loader_end_array(void* arg)
+{
+   struct capture_loader* loader = (struct capture_loader*)arg;
+
+   if (loader->depth == 5 && loader->row)
+   {
+      result_row(loader->result, loader->number_of_values, loader->values);
+
+      for (int i = 0; i < loader->number_of_values; i++)
+      {
+         free(loader->values[i]);
+      }
+      loader->number_of_values = 0;
+      loader->row = false;
+   }
+   else if (loader->depth == 4)
+   {
+      if (loader->columns)
+      {
+         result_columns(loader->result, loader->number_of_names, loader->names);
+
+         for (int i = 0; i < loader->number_of_names; i++)
+         {
+            free(loader->names[i]);
+         }
+         loader->number_of_names = 0;
+      }
+
+      loader->columns = false;
+      loader->rows = false;
+   }
+   else if (loader->depth == 2)
+   {
+      loader->queries = false;
+   }
+
+   loader->depth--;
+
+   return 0;
+}
+
+static int
+loader_value(void* arg, char* key, uintptr_t data, enum value_type type)
+{
+   char buf[VALUE_FORMAT_SIZE];
+   char* str = NULL;
+   struct capture_loader* loader = (struct capture_loader*)arg;
+
+   if (type == ValueString)
+   {
+      str = (char*)data;
+   }
+   else if (pgexporter_value_format(type, data, &buf[0]) > 0)
+   {
+      str = &buf[0];
+   }
+   else
+   {
+      return 1;
+   }
+
+   if (loader->depth == 2 && loader->parameters && key != NULL && str != NULL)
+   {
+      pgexporter_art_insert(loader->capture->parameters, key, (uintptr_t)str, ValueString);
+   }
+   else if (loader->depth == 3 && loader->result != NULL && key != NULL && !strcmp(key, "query") && str != NULL)
+   {
+      free(loader->result->query);
+      loader->result->query = strdup(str);
+   }
+   else if (loader->depth == 4 && loader->columns)
+   {
+      if (loader->number_of_names >= MAX_COLUMNS)
+      {
+         return 1;
+      }
+      loader->names[loader->number_of_names++] = strdup(str != NULL ? str : "?column?");
+   }
+   else if (loader->depth == 5 && loader->row)
+   {
+      if (loader->number_of_values >= MAX_COLUMNS)
+      {
+         return 1;
+      }
+      loader->values[loader->number_of_values++] = str != NULL ? strdup(str) : NULL;
+   }
+
+   return 0;
+}
+
+static struct capture_result*
+result_create(char* query)
+{
+   struct capture_result* result = NULL;
+
+   result = calloc(1, sizeof(struct capture_result));
+   if (result == NULL)
+   {
+      return NULL;
+   }
+
+   result->query = query != NULL ? strdup(query) : NULL;
+   pgexporter_builder_init(&result->description, 0);
+   pgexporter_builder_init(&result->rows, 0);
+
+   return result;
+}
+
+static void
+result_columns(struct capture_result* result, int number_of_columns, char** names)
+{
+   size_t m;
+
+   m = message_begin(&result->description, 'T');
+   append_int16(&result->description, (int16_t)number_of_columns);
+
+   for (int i = 0; i < number_of_columns; i++)
+   {
+      append_string(&result->description, names[i]);
+      append_int32(&result->description, 0);
+      append_int16(&result->description, 0);
+      append_int32(&result->description, TEXT_OID);
+      append_int16(&result->description, -1);
+      append_int32(&result->description, -1);
+      append_int16(&result->description, 0);
+   }
+
+   message_end(&result->description, m);
+}
+
+static void
+result_row(struct capture_result* result, int number_of_values, char** values)
+{
+   size_t m;
+
+   m = message_begin(&result->rows, 'D');
+   append_int16(&result->rows, (int16_t)number_of_values);
+
+   for (int i = 0; i < number_of_values; i++)
+   {
+      if (values[i] == NULL)
+      {
+         append_int32(&result->rows, -1);
+      }
+      else
+      {
+         append_int32(&result->rows, (int32_t)strlen(values[i]));
+         pgexporter_builder_append_length(&result->rows, values[i], strlen(values[i]));
+      }
+   }
+
+   message_end(&result->rows, m);
+
+   result->number_of_rows++;
+}
+
+static void
+result_complete(struct capture_result* result)
+{
+   char tag[MISC_LENGTH];
+   size_t m;
+
+   snprintf(&tag[0], sizeof(tag), "SELECT %d", result->number_of_rows);
+
+   m = message_begin(&result->rows, 'C');
+   append_string(&result->rows, &tag[0]);
+   message_end(&result->rows, m);
+}
+
+static int
+result_write(struct json_writer* writer, struct capture_result* result)
+{
+   char* data;
+   char* p;
+   char* value = NULL;
+   int16_t n;
+   int32_t length;
+   size_t offset = 0;
+
+   pgexporter_json_writer_begin_object(writer, NULL);
+   pgexporter_json_writer_value(writer, "query", (uintptr_t)result->query, ValueString);
+
+   pgexporter_json_writer_begin_array(writer, "columns");
+   if (result->description.length > 7)
+   {
+      data = result->description.data;
+      n = pgexporter_read_int16(data + 5);
+      p = data + 7;
+
+      for (int i = 0; i < n; i++)
+      {
+         pgexporter_json_writer_value(writer, NULL, (uintptr_t)p, ValueString);
+         p += strlen(p) + 1 + 18;
+      }
+   }
+   pgexporter_json_writer_end_array(writer);
+
+   pgexporter_json_writer_begin_array(writer, "rows");
+   data = result->rows.data;
+   while (offset + 5 <= result->rows.length)
+   {
+      length = pgexporter_read_int32(data + offset + 1);
+
+      if (data[offset] == 'D')
+      {
+         n = pgexporter_read_int16(data + offset + 5);
+         p = data + offset + 7;
+
+         pgexporter_json_writer_begin_array(writer, NULL);
+         for (int i = 0; i < n; i++)
+         {
+            int32_t l = pgexporter_read_int32(p);
+            p += 4;
+
+            if (l < 0)
+            {
+               pgexporter_json_writer_value(writer, NULL, 0, ValueString);
+            }
+            else
+            {
+               value = strndup(p, l);
+               pgexporter_json_writer_value(writer, NULL, (uintptr_t)value, ValueString);
+               free(value);
+               p += l;
+            }
+         }
+         pgexporter_json_writer_end_array(writer);
+      }
+
+      offset += 1 + length;
+   }
+   pgexporter_json_writer_end_array(writer);
+
+   return pgexporter_json_writer_end_object(writer);
+}
+
+static void
+result_destroy_cb(uintptr_t data)
+{
+   struct capture_result* result = (struct capture_result*)data;
+
+   if (result == NULL)
+   {
+      return;
+   }
+
+   free(result->query);
+   pgexporter_builder_destroy(&result->description);
+   pgexporter_builder_destroy(&result->rows);
+   free(result);
+}
+
+/**
+ * Serve the clients in a single process
+ * @param capture The capture
+ * @param port The port
+ * @param host The host of the server to record, or NULL to replay
+ * @param upstream_port The port of the server to record
+ * @return 0 upon success, otherwise 1
+ */
+static int
+serve(struct capture* capture, int port, char* host, int upstream_port)
+{
+   int* fds = NULL;
+   int length = 0;
+   int number_of_sessions = 0;
+   int nfds;
+   int client;
+   int upstream;
+   ssize_t n;
+   char buffer[READ_SIZE];
+   struct pollfd pfds[MAX_FDS + 2 * MAX_SESSIONS];
+   struct session* sessions[MAX_SESSIONS];
+   struct sigaction action;
+
+   memset(&action, 0, sizeof(struct sigaction));
+   action.sa_handler = stop;
+   sigemptyset(&action.sa_mask);
+   sigaction(SIGINT, &action, NULL);
+   sigaction(SIGTERM, &action, NULL);
+
+   if (pgexporter_bind("localhost", port, &fds, &length))
+   {
+      warnx("pgexporter-bench: Could not bind to localhost:%d", port);
+      return 1;
+   }
+
+   length = MIN(length, MAX_FDS);
+
+   while (running)
+   {
+      nfds = 0;
+
+      for (int i = 0; i < length; i++)
+      {
+         pfds[nfds].fd = fds[i];
+         pfds[nfds].events = POLLIN;
+         pfds[nfds].revents = 0;
+         nfds++;
+      }
+
+      for (int i = 0; i < number_of_sessions; i++)
+      {
+         pfds[nfds].fd = sessions[i]->client;
+         pfds[nfds].events = POLLIN;
+         pfds[nfds].revents = 0;
+         nfds++;
+
+         pfds[nfds].fd = sessions[i]->upstream;
+         pfds[nfds].events = POLLIN;
+         pfds[nfds].revents = 0;
+         nfds++;
+      }
+
+      if (poll(pfds, nfds, 1000) < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         warn("pgexporter-bench: poll");
+         break;
+      }
+
+      for (int i = 0; i < length; i++)
+      {
+         if (!(pfds[i].revents & POLLIN))
+         {
+            continue;
+         }
+
+         client = accept(fds[i], NULL, NULL);
+         if (client == -1)
+         {
+            continue;
+         }
+
+         upstream = -1;
+         if (number_of_sessions >= MAX_SESSIONS ||
+             (host != NULL && pgexporter_connect(host, upstream_port, &upstream)))
+         {
+            warnx("pgexporter-bench: Could not accept a client");
+            close(client);
+            continue;
+         }
+
+         sessions[number_of_sessions] = session_create(client, upstream);
+         if (sessions[number_of_sessions] == NULL)
+         {
+            close(client);
+            if (upstream != -1)
+            {
+               close(upstream);
+            }
+            continue;
+         }
+         number_of_sessions++;
+      }
+
+      // The new sessions have no poll entries yet
+      for (int i = 0, p = length; i < number_of_sessions && p < nfds; i++, p += 2)
+      {
+         bool closed = false;
+
+         if (pfds[p].revents & (POLLIN | POLLHUP | POLLERR))
+         {
+            n = read(pfds[p].fd, &buffer[0], sizeof(buffer));
+            closed = n <= 0 || session_client(capture, sessions[i], &buffer[0], n);
+         }
+
+         if (!closed && pfds[p + 1].revents & (POLLIN | POLLHUP | POLLERR))
+         {
+            n = read(pfds[p + 1].fd, &buffer[0], sizeof(buffer));
+            closed = n <= 0 || session_upstream(capture, sessions[i], &buffer[0], n);
+         }
+
+         if (closed)
+         {
+            session_destroy(sessions[i]);
+            sessions[i] = NULL;
+
+            // Keep the recordings of the session
+            if (capture_write(capture))
+            {
+               warnx("pgexporter-bench: Could not write %s", capture->path);
+            }
+         }
+      }
+
+      for (int i = 0; i < number_of_sessions;)
+      {
+         if (sessions[i] == NULL)
+         {
+            sessions[i] = sessions[number_of_sessions - 1];
+            number_of_sessions--;
+         }
+         else
+         {
+            i++;
+         }
+      }
+   }
+
+   for (int i = 0; i < number_of_sessions; i++)
+   {
+      session_destroy(sessions[i]);
+   }
+
+   for (int i = 0; i < length; i++)
+   {
+      close(fds[i]);
+   }
+   free(fds);
+
+   return 0;
+}
+
+static struct session*
+session_create(int client, int upstream)
+{
+   struct session* session = NULL;
+
+   session = calloc(1, sizeof(struct session));
+   if (session == NULL)
+   {
+      return NULL;
+   }
+
+   session->client = client;
+   session->upstream = upstream;
+
+   pgexporter_builder_init(&session->input, READ_SIZE);
+   pgexporter_builder_init(&session->output, READ_SIZE);
+
+   if (pgexporter_art_create(&session->statements) || pgexporter_deque_create(false, &session->pending))
+   {
+      session_destroy(session);
+      return NULL;
+   }
+
+   return session;
+}
+
+/**
+ * Handle the data of a client
+ * @param capture The capture
+ * @param session The session
+ * @param data The data
+ * @param size The size of the data
+ * @return 0 upon success, otherwise 1 to close the session
+ */
+static int
+session_client(struct capture* capture, struct session* session, char* data, size_t size)
+{
+   int ret = 0;
+   int32_t code;
+   char kind;
+   char* body = NULL;
+   size_t length;
+   size_t offset = 0;
+   struct builder reply;
+   struct builder forward;
+
+   pgexporter_builder_init(&reply, 0);
+   pgexporter_builder_init(&forward, 0);
+
+   pgexporter_builder_append_length(&session->input, data, size);
+
+   while (ret == 0 && next_message(&session->input, offset, !session->started, &kind, &body, &length))
+   {
+      if (!session->started)
+      {
+         code = pgexporter_read_int32(body);
+
+         if (code == PROTOCOL_SSL_REQUEST || code == PROTOCOL_GSSENC_REQUEST)
+         {
+            pgexporter_builder_append_char(&reply, 'N');
+         }
+         else if (code == PROTOCOL_CANCEL_REQUEST)
+         {
+            ret = 1;
+         }
+         else
+         {
+            session->started = true;
+
+            if (session->upstream != -1)
+            {
+               pgexporter_builder_append_length(&forward, session->input.data + offset, length);
+            }
+            else
+            {
+               capture_startup(capture, &reply);
+            }
+         }
+      }
+      else if (session->upstream != -1)
+      {
+         pgexporter_builder_append_length(&forward, session->input.data + offset, length);
+         ret = record_client(session, kind, body);
+      }
+      else
+      {
+         ret = replay_message(capture, session, kind, body, &reply);
+      }
+
+      offset += length;
+   }
+
+   consume(&session->input, offset);
+
+   if (reply.length > 0 && write_all(session->client, reply.data, reply.length))
+   {
+      ret = 1;
+   }
+
+   if (forward.length > 0 && write_all(session->upstream, forward.data, forward.length))
+   {
+      ret = 1;
+   }
+
+   pgexporter_builder_destroy(&reply);
+   pgexporter_builder_destroy(&forward);
+
+   return ret;
+}
+
+/**
+ * Handle the data of the server of a session being recorded
+ * @param capture The capture
+ * @param session The session
+ * @param data The data
+ * @param size The size of the data
+ * @return 0 upon success, otherwise 1 to close the session
+ */
+static int
+session_upstream(struct capture* capture, struct session* session, char* data, size_t size)
+{
+   int ret = 0;
+   char kind;
+   char* body = NULL;
+   size_t length;
+   size_t offset = 0;
+
+   pgexporter_builder_append_length(&session->output, data, size);
+
+   // The reply to an SSLRequest is forwarded by the client as N, so it never gets here
+   while (next_message(&session->output, offset, false, &kind, &body, &length))
+   {
+      record_upstream(capture, session, kind, session->output.data + offset, length);
+      offset += length;
+   }
+
+   if (offset > 0 && write_all(session->client, session->output.data, offset))
+   {
+      ret = 1;
+   }
+
+   consume(&session->output, offset);
+
+   return ret;
+}
+
+/**
+ * Replay a capture on a connection that is past the startup
+ * @param capture The capture
+ * @param fd The connection
+ */
+static void
+session_run(struct capture* capture, int fd)
+{
+   ssize_t n;
+   char buffer[READ_SIZE];
+   struct session* session = NULL;
+
+   session = session_create(fd, -1);
+   if (session == NULL)
+   {
+      return;
+   }
+
+   session->started = true;
+
+   while (true)
+   {
+      n = read(fd, &buffer[0], sizeof(buffer));
+      if (n < 0 && errno == EINTR)
+      {
+         continue;
+      }
+
+      if (n <= 0 || session_client(capture, session, &buffer[0], n))
+      {
+         break;
+      }
+   }
+
+   session_destroy(session);
+}
+
+static void
+session_destroy(struct session* session)
+{
+   char* query = NULL;
+
+   if (session == NULL)
+   {
+      return;
+   }
+
+   if (session->client != -1)
+   {
+      close(session->client);
+   }
+   if (session->upstream != -1)
+   {
+      close(session->upstream);
+   }
+
+   pgexporter_builder_destroy(&session->input);
+   pgexporter_builder_destroy(&session->output);
+   pgexporter_art_destroy(session->statements);
+
+   while ((query = (char*)pgexporter_deque_poll(session->pending, NULL)) != NULL)
+   {
+      free(query);
+   }
+   pgexporter_deque_destroy(session->pending);
+
+   if (session->recording != NULL)
+   {
+      result_destroy_cb((uintptr_t)session->recording);
+   }
+
+   free(session->unnamed);
+   free(session->portal);
+   free(session);
+}
+
+static char*
+session_statement(struct session* session, char* name)
+{
+   if (strlen(name) == 0)
+   {
+      return session->unnamed;
+   }
+
+   return (char*)pgexporter_art_search(session->statements, name);
+}
+
+static void
+session_prepare(struct session* session, char* name, char* query)
+{
+   if (strlen(name) == 0)
+   {
+      free(session->unnamed);
+      session->unnamed = strdup(query);
+   }
+   else
+   {
+      pgexporter_art_insert(session->statements, name, (uintptr_t)query, ValueString);
+   }
+}
+
+/**
+ * Answer a message of a client from the capture
+ * @param capture The capture
+ * @param session The session
+ * @param kind The message type
+ * @param body The message body
+ * @param reply The reply
+ * @return 0 upon success, otherwise 1 to close the session
+ */
+static int
+replay_message(struct capture* capture, struct session* session, char kind, char* body, struct builder* reply)
+{
+   size_t m;
+   char* name = NULL;
+   char* query = NULL;
+   struct capture_result* result = NULL;
+
+   switch (kind)
+   {
+      case 'Q':
+         result = capture_find(capture, body);
+         pgexporter_builder_append_length(reply, result->description.data, result->description.length);
+         pgexporter_builder_append_length(reply, result->rows.data, result->rows.length);
+
+         m = message_begin(reply, 'Z');
+         pgexporter_builder_append_char(reply, 'I');
+         message_end(reply, m);
+         break;
+      case 'P':
+         name = body;
+         query = body + strlen(name) + 1;
+         session_prepare(session, name, query);
+
+         message_end(reply, message_begin(reply, '1'));
+         break;
+      case 'B':
+         name = body + strlen(body) + 1;
+         query = session_statement(session, name);
+
+         free(session->portal);
+         session->portal = query != NULL ? strdup(query) : NULL;
+
+         message_end(reply, message_begin(reply, '2'));
+         break;
+      case 'D':
+         if (body[0] == 'S')
+         {
+            query = session_statement(session, body + 1);
+
+            m = message_begin(reply, 't');
+            append_int16(reply, 0);
+            message_end(reply, m);
+         }
+         else
+         {
+            query = session->portal;
+         }
+
+         result = capture_find(capture, query);
+         if (result->description.length > 0)
+         {
+            pgexporter_builder_append_length(reply, result->description.data, result->description.length);
+         }
+         else
+         {
+            message_end(reply, message_begin(reply, 'n'));
+         }
+         break;
+      case 'E':
+         result = capture_find(capture, session->portal);
+         pgexporter_builder_append_length(reply, result->rows.data, result->rows.length);
+         break;
+      case 'S':
+         m = message_begin(reply, 'Z');
+         pgexporter_builder_append_char(reply, 'I');
+         message_end(reply, m);
+         break;
+      case 'C':
+         if (body[0] == 'S')
+         {
+            if (strlen(body + 1) == 0)
+            {
+               free(session->unnamed);
+               session->unnamed = NULL;
+            }
+            else
+            {
+               pgexporter_art_delete(session->statements, body + 1);
+            }
+         }
+
+         message_end(reply, message_begin(reply, '3'));
+         break;
+      case 'X':
+         return 1;
+      default:
+         break;
+   }
+
+   return 0;
+}
+
+/**
+ * Follow the statements of a client being recorded
+ * @param session The session
+ * @param kind The message type
+ * @param body The message body
+ * @return 0 upon success, otherwise 1 to close the session
+ */
+static int
+record_client(struct session* session, char kind, char* body)
+{
+   char* name = NULL;
+   char* query = NULL;
+
+   switch (kind)
+   {
+      case 'Q':
+         pgexporter_deque_add(session->pending, NULL, (uintptr_t)body, ValueString);
+         break;
+      case 'P':
+         name = body;
+         session_prepare(session, name, body + strlen(name) + 1);
+         break;
+      case 'B':
+         name = body + strlen(body) + 1;
+         query = session_statement(session, name);
+
+         free(session->portal);
+         session->portal = query != NULL ? strdup(query) : NULL;
+         break;
+      case 'D':
+         query = body[0] == 'S' ? session_statement(session, body + 1) : session->portal;
+         if (query != NULL)
+         {
+            pgexporter_deque_add(session->pending, NULL, (uintptr_t)query, ValueString);
+         }
+         break;
+      case 'C':
+         if (body[0] == 'S' && strlen(body + 1) > 0)
+         {
+            pgexporter_art_delete(session->statements, body + 1);
+         }
+         break;
+      case 'X':
+         return 1;
+      default:
+         break;
+   }
+
+   return 0;
+}
+
+/**
+ * Record a message of the server
+ * @param capture The capture
+ * @param session The session
+ * @param kind The message type
+ * @param message The message
+ * @param size The size of the message
+ */
+static void
+record_upstream(struct capture* capture, struct session* session, char kind, char* message, size_t size)
+{
+   char* p = NULL;
+   char* query = NULL;
+   int16_t n;
+
+   switch (kind)
+   {
+      case 'S':
+         p = message + 5;
+         pgexporter_art_insert(capture->parameters, p, (uintptr_t)(p + strlen(p) + 1), ValueString);
+         break;
+      case 'T':
+      case 'n':
+         query = (char*)pgexporter_deque_peek(session->pending, NULL);
+
+         if (session->recording != NULL)
+         {
+            result_destroy_cb((uintptr_t)session->recording);
+            session->recording = NULL;
+         }
+
+         if (query == NULL)
+         {
+            break;
+         }
+
+         session->recording = result_create(query);
+         if (session->recording == NULL || kind == 'n')
+         {
+            break;
+         }
+
+         pgexporter_builder_append_length(&session->recording->description, message, size);
+
+         // The values are replayed as text, whatever the type of the column
+         n = pgexporter_read_int16(session->recording->description.data + 5);
+         p = session->recording->description.data + 7;
+         for (int i = 0; i < n; i++)
+         {
+            p += strlen(p) + 1 + 6;
+            pgexporter_write_int32(p, TEXT_OID);
+            pgexporter_write_int16(p + 4, -1);
+            p += 12;
+         }
+         break;
+      case 'D':
+         if (session->recording != NULL)
+         {
+            pgexporter_builder_append_length(&session->recording->rows, message, size);
+            session->recording->number_of_rows++;
+         }
+         break;
+      case 'C':
+         if (session->recording != NULL)
+         {
+            pgexporter_builder_append_length(&session->recording->rows, message, size);
+            capture_put(capture, session->recording);
+            session->recording = NULL;
+         }
+         free((char*)pgexporter_deque_poll(session->pending, NULL));
+         break;
+      case 'E':
+      case 'I':
+         if (session->recording != NULL)
+         {
+            result_destroy_cb((uintptr_t)session->recording);
+            session->recording = NULL;
+         }
+         free((char*)pgexporter_deque_poll(session->pending, NULL));
+         break;
+      case 'Z':
+         // Nothing is pending once the server is idle
+         while ((query = (char*)pgexporter_deque_poll(session->pending, NULL)) != NULL)
+         {
+            free(query);
+         }
+         break;
+      default:
+         break;
+   }
+}
+
+static bool
+next_message(struct builder* buffer, size_t offset, bool startup, char* kind, char** body, size_t* size)
+{
+   int32_t length;
+   size_t available = buffer->length - offset;
+
+   if (startup)
+   {
+      if (available < 8)
+      {
+         return false;
+      }
+
+      length = pgexporter_read_int32(buffer->data + offset);
+      if (length < 8 || (size_t)length > available)
+      {
+         return false;
+      }
+
+      *kind = 0;
+      *body = buffer->data + offset + 4;
+      *size = length;
+
+      return true;
+   }
+
+   if (available < 5)
+   {
+      return false;
+   }
+
+   length = pgexporter_read_int32(buffer->data + offset + 1);
+   if (length < 4 || (size_t)length + 1 > available)
+   {
+      return false;
+   }
+
+   *kind = buffer->data[offset];
+   *body = buffer->data + offset + 5;
+   *size = 1 + length;
+
+   return true;
+}
+
+static void
+consume(struct builder* buffer, size_t offset)
+{
+   if (offset == 0)
+   {
+      return;
+   }
+
+   memmove(buffer->data, buffer->data + offset, buffer->length - offset);
+   buffer->length -= offset;
+   buffer->data[buffer->length] = '\0';
+}
+
+static size_t
+message_begin(struct builder* builder, char kind)
+{
+   size_t offset = builder->length;
+
+   pgexporter_builder_append_char(builder, kind);
+   append_int32(builder, 0);
+
+   return offset;
+}
+
+static void
+message_end(struct builder* builder, size_t offset)
+{
+   pgexporter_write_int32(builder->data + offset + 1, (int32_t)(builder->length - offset - 1));
+}
+
+static void
+append_int16(struct builder* builder, int16_t i)
+{
+   char buf[2];
+
+   pgexporter_write_int16(&buf[0], i);
+   pgexporter_builder_append_length(builder, &buf[0], 2);
+}
+
+static void
+append_int32(struct builder* builder, int32_t i)
+{
+   char buf[4];
+
+   pgexporter_write_int32(&buf[0], i);
+   pgexporter_builder_append_length(builder, &buf[0], 4);
+}
+
+static void
+append_string(struct builder* builder, char* s)
+{
+   pgexporter_builder_append_length(builder, s, strlen(s) + 1);
+}
+
+static int
+write_all(int fd, char* data, size_t length)
+{
+   ssize_t n;
+   size_t offset = 0;
+
+   while (offset < length)
+   {
+      n = write(fd, data + offset, length - offset);
+      if (n < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      else if (n <= 0)
+      {
+         return 1;
+      }
+      offset += n;
+   }
+
+   return 0;
+}
+
+static int
+count_cb(char* data, size_t length, void* arg)
+{
+   (void)data;
+
+   *(size_t*)arg += length;
+
+   return 0;
+}
+
+static uint64_t
+now_ns(void)
+{
+   return pgexporter_stats_now();
+}
+
+static void
+report(char* name, uint64_t operations, uint64_t ns)
+{
+   if (operations == 0)
+   {
+      return;
+   }
+
+   printf("%-40s %12" PRIu64 " %12.1f %14.0f\n", name, operations, (double)ns / operations,
+          ns > 0 ? operations * 1e9 / ns : 0.0);
+}
+
+static void
+stop(int sig)
+{
+   (void)sig;
+
+   running = 0;
+}
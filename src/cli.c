@@ -63,6 +63,7 @@
 #define COMMAND_STATUS_DETAILS "status-details"
 #define COMMAND_CONF "conf"
 #define COMMAND_CLEAR "clear"
+#define COMMAND_TRACE "trace"
 
 #define OUTPUT_FORMAT_JSON "json"
 #define OUTPUT_FORMAT_TEXT "text"
@@ -74,11 +75,13 @@ static void help_ping(void);
 static void help_status_details(void);
 static void help_conf(void);
 static void help_clear(void);
+static void help_trace(void);
 static void display_helper(char* command);
 
 static int pgexporter_shutdown(SSL* ssl, int socket, uint8_t compression, uint8_t encryption, int32_t output_format);
 static int status(SSL* ssl, int socket, uint8_t compression, uint8_t encryption, int32_t output_format);
 static int details(SSL* ssl, int socket, uint8_t compression, uint8_t encryption, int32_t output_format);
+static int trace(SSL* ssl, int socket, char* file, uint8_t compression, uint8_t encryption, int32_t output_format);
 static int ping(SSL* ssl, int socket, uint8_t compression, uint8_t encryption, int32_t output_format);
 static int reset(SSL* ssl, int socket, uint8_t compression, uint8_t encryption, int32_t output_format);
 static int reload(SSL* ssl, int socket, uint8_t compression, uint8_t encryption, int32_t output_format);
@@ -90,6 +93,7 @@ static int  process_result(SSL* ssl, int socket, int32_t output_format);
 static int process_ls_result(SSL* ssl, int socket, int32_t output_format);
 static int process_get_result(SSL* ssl, int socket, char* config_key, int32_t output_format);
 static int process_set_result(SSL* ssl, int socket, char* config_key, int32_t output_format);
+static int process_trace_result(SSL* ssl, int socket, char* file);
 
 static int get_conf_path_result(struct json* j, uintptr_t* r);
 static int get_config_key_result(char* config_key, struct json* j, uintptr_t* r, int32_t output_format);
@@ -142,6 +146,7 @@ usage(void)
    printf("                           - 'set' to modify a configuration value;\n");
    printf("  clear <what>             Clear data, with:\n");
    printf("                           - 'prometheus' to reset the Prometheus statistics\n");
+   printf("  trace [chrome <file>]    The last scrape traces, with optional export to a Chrome trace file\n");
    printf("\n");
    printf("pgexporter: %s\n", PGEXPORTER_HOMEPAGE);
    printf("Report bugs: %s\n", PGEXPORTER_ISSUES);
@@ -219,6 +224,22 @@ const struct pgexporter_command command_table[] = {
       .action = MANAGEMENT_RESET,
       .deprecated = false,
       .log_message = "<clear prometheus>"
+   },
+   {
+      .command = "trace",
+      .subcommand = "",
+      .accepted_argument_count = {0},
+      .action = MANAGEMENT_TRACE,
+      .deprecated = false,
+      .log_message = "<trace>"
+   },
+   {
+      .command = "trace",
+      .subcommand = "chrome",
+      .accepted_argument_count = {1},
+      .action = MANAGEMENT_TRACE,
+      .deprecated = false,
+      .log_message = "<trace chrome> [%s]"
    }
 };
 
@@ -591,6 +612,10 @@ password:
    {
       exit_code = details(s_ssl, socket, compression, encryption, output_format);
    }
+   else if (parsed.cmd->action == MANAGEMENT_TRACE)
+   {
+      exit_code = trace(s_ssl, socket, parsed.args[0], compression, encryption, output_format);
+   }
    else if (parsed.cmd->action == MANAGEMENT_PING)
    {
       exit_code = ping(s_ssl, socket, compression, encryption, output_format);
@@ -703,6 +728,14 @@ help_clear(void)
    printf("  pgexporter-cli clear [prometheus]\n");
 }
 
+static void
+help_trace(void)
+{
+   printf("The last scrape traces\n");
+   printf("  pgexporter-cli trace\n");
+   printf("  pgexporter-cli trace [chrome] <file>\n");
+}
+
 static void
 display_helper(char* command)
 {
@@ -726,6 +759,10 @@ display_helper(char* command)
    {
       help_clear();
    }
+   else if (!strcmp(command, COMMAND_TRACE))
+   {
+      help_trace();
+   }
    else
    {
       usage();
@@ -792,6 +829,33 @@ error:
    return 1;
 }
 
+static int
+trace(SSL* ssl, int socket, char* file, uint8_t compression, uint8_t encryption, int32_t output_format)
+{
+   if (pgexporter_management_request_trace(ssl, socket, compression, encryption, output_format))
+   {
+      goto error;
+   }
+
+   if (file != NULL)
+   {
+      if (process_trace_result(ssl, socket, file))
+      {
+         goto error;
+      }
+   }
+   else if (process_result(ssl, socket, output_format))
+   {
+      goto error;
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
 static int
 ping(SSL* ssl, int socket, uint8_t compression, uint8_t encryption, int32_t output_format)
 {
@@ -947,6 +1011,124 @@ error:
    return 1;
 }
 
+static int
+process_trace_result(SSL* ssl, int socket, char* file)
+{
+   uint64_t base = 0;
+   int32_t pid;
+   FILE* f = NULL;
+   struct json* read = NULL;
+   struct json* response = NULL;
+   struct json* traces = NULL;
+   struct json* spans = NULL;
+   struct json_iterator* iter = NULL;
+   struct json_iterator* span_iter = NULL;
+   struct json_writer writer;
+
+   if (pgexporter_management_read_json(ssl, socket, NULL, NULL, &read))
+   {
+      goto error;
+   }
+
+   response = (struct json*)pgexporter_json_get(read, MANAGEMENT_CATEGORY_RESPONSE);
+   traces = response != NULL ? (struct json*)pgexporter_json_get(response, MANAGEMENT_ARGUMENT_TRACES) : NULL;
+
+   if (traces == NULL)
+   {
+      warnx("pgexporter-cli: No traces");
+      goto error;
+   }
+
+   f = fopen(file, "w");
+   if (f == NULL)
+   {
+      warnx("pgexporter-cli: Unable to open %s", file);
+      goto error;
+   }
+
+   // The Trace Event Format, see chrome://tracing or https://ui.perfetto.dev
+   pgexporter_json_writer_init(&writer, FORMAT_JSON_COMPACT, pgexporter_json_sink_file, f);
+   pgexporter_json_writer_begin_object(&writer, NULL);
+   pgexporter_json_writer_begin_array(&writer, "traceEvents");
+
+   pgexporter_json_iterator_create(traces, &iter);
+   while (pgexporter_json_iterator_next(iter))
+   {
+      struct json* t = (struct json*)iter->value->data;
+      uint64_t duration = (uint64_t)pgexporter_json_get(t, MANAGEMENT_ARGUMENT_DURATION);
+
+      pid = (int32_t)pgexporter_json_get(t, MANAGEMENT_ARGUMENT_PID);
+
+      // The traces are laid out one after the other, with the scrape as the enclosing event
+      pgexporter_json_writer_begin_object(&writer, NULL);
+      pgexporter_json_writer_value(&writer, "name", pgexporter_json_get(t, MANAGEMENT_ARGUMENT_KIND), ValueString);
+      pgexporter_json_writer_value(&writer, "ph", (uintptr_t)"X", ValueString);
+      pgexporter_json_writer_value(&writer, "ts", (uintptr_t)base, ValueUInt64);
+      pgexporter_json_writer_value(&writer, "dur", (uintptr_t)duration, ValueUInt64);
+      pgexporter_json_writer_value(&writer, "pid", (uintptr_t)pid, ValueInt32);
+      pgexporter_json_writer_value(&writer, "tid", (uintptr_t)0, ValueInt32);
+      pgexporter_json_writer_begin_object(&writer, "args");
+      pgexporter_json_writer_value(&writer, "timestamp", pgexporter_json_get(t, MANAGEMENT_ARGUMENT_TIMESTAMP), ValueString);
+      pgexporter_json_writer_value(&writer, "dropped", pgexporter_json_get(t, MANAGEMENT_ARGUMENT_DROPPED), ValueInt32);
+      pgexporter_json_writer_end_object(&writer);
+      pgexporter_json_writer_end_object(&writer);
+
+      spans = (struct json*)pgexporter_json_get(t, MANAGEMENT_ARGUMENT_SPANS);
+
+      pgexporter_json_iterator_create(spans, &span_iter);
+      while (pgexporter_json_iterator_next(span_iter))
+      {
+         struct json* s = (struct json*)span_iter->value->data;
+
+         pgexporter_json_writer_begin_object(&writer, NULL);
+         pgexporter_json_writer_value(&writer, "name", pgexporter_json_get(s, MANAGEMENT_ARGUMENT_NAME), ValueString);
+         pgexporter_json_writer_value(&writer, "ph", (uintptr_t)"X", ValueString);
+         pgexporter_json_writer_value(&writer, "ts", (uintptr_t)(base + (uint64_t)pgexporter_json_get(s, MANAGEMENT_ARGUMENT_START)), ValueUInt64);
+         pgexporter_json_writer_value(&writer, "dur", pgexporter_json_get(s, MANAGEMENT_ARGUMENT_DURATION), ValueUInt64);
+         pgexporter_json_writer_value(&writer, "pid", (uintptr_t)pid, ValueInt32);
+         pgexporter_json_writer_value(&writer, "tid", pgexporter_json_get(s, MANAGEMENT_ARGUMENT_THREAD), ValueInt32);
+         pgexporter_json_writer_begin_object(&writer, "args");
+         pgexporter_json_writer_value(&writer, "server", pgexporter_json_get(s, MANAGEMENT_ARGUMENT_SERVER), ValueString);
+         pgexporter_json_writer_end_object(&writer);
+         pgexporter_json_writer_end_object(&writer);
+      }
+      pgexporter_json_iterator_destroy(span_iter);
+      span_iter = NULL;
+
+      base += duration + 1000;
+   }
+   pgexporter_json_iterator_destroy(iter);
+   iter = NULL;
+
+   pgexporter_json_writer_end_array(&writer);
+   pgexporter_json_writer_end_object(&writer);
+
+   if (pgexporter_json_writer_flush(&writer))
+   {
+      warnx("pgexporter-cli: Unable to write %s", file);
+      goto error;
+   }
+
+   fclose(f);
+   pgexporter_json_destroy(read);
+
+   return 0;
+
+error:
+
+   pgexporter_json_iterator_destroy(span_iter);
+   pgexporter_json_iterator_destroy(iter);
+
+   if (f != NULL)
+   {
+      fclose(f);
+   }
+
+   pgexporter_json_destroy(read);
+
+   return 1;
+}
+
 static int
 process_ls_result(SSL* ssl, int socket, int32_t output_format)
 {
@@ -1352,6 +1534,9 @@ translate_command(int32_t cmd_code)
       case MANAGEMENT_STATUS_DETAILS:
          command_output = pgexporter_append(command_output, COMMAND_STATUS_DETAILS);
          break;
+      case MANAGEMENT_TRACE:
+         command_output = pgexporter_append(command_output, COMMAND_TRACE);
+         break;
       case MANAGEMENT_PING:
          command_output = pgexporter_append(command_output, COMMAND_PING);
          break;
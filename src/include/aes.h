@@ -35,6 +35,7 @@ extern "C" {
 
 #include <pgexporter.h>
 #include <json.h>
+#include <utils.h>
 
 #include <openssl/ssl.h>
 
@@ -86,6 +87,36 @@ pgexporter_encrypt_buffer(unsigned char* origin_buffer, size_t origin_size, unsi
 int
 pgexporter_decrypt_buffer(unsigned char* origin_buffer, size_t origin_size, unsigned char** dec_buffer, size_t* dec_size, int mode);
 
+
+/**
+ * Create a stream encrypting or decrypting with the master key
+ * @param encrypt True to encrypt, false to decrypt
+ * @param mode The aes mode
+ * @param stream The stream
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_cipher_stream_create(bool encrypt, int mode, void** stream);
+
+/**
+ * Process data through a cipher stream. The output is appended to the builder
+ * @param stream The stream
+ * @param data The data
+ * @param length The length of the data
+ * @param finish True if this is the last data of the stream
+ * @param output The output
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_cipher_stream_update(void* stream, void* data, size_t length, bool finish, struct builder* output);
+
+/**
+ * Destroy a cipher stream
+ * @param stream The stream
+ */
+void
+pgexporter_cipher_stream_destroy(void* stream);
+
 #ifdef __cplusplus
 }
 #endif
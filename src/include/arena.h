@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGEXPORTER_ARENA_H
+#define PGEXPORTER_ARENA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+
+#define ARENA_BLOCK_SIZE 16384
+
+/** @struct arena_block
+ * Defines a block of an arena
+ */
+struct arena_block
+{
+   struct arena_block* next; /**< The next block */
+   size_t size;              /**< The size of the data */
+   size_t used;              /**< The used part of the data */
+   char data[];              /**< The data */
+};
+
+/** @struct arena
+ * Defines an arena, where memory is allocated by bumping an offset
+ * in the current block and released for all allocations at once.
+ * An arena isn't thread safe, so it must only be used by one thread at a time
+ */
+struct arena
+{
+   struct arena_block* blocks; /**< The blocks, the current one first */
+   size_t block_size;          /**< The size of a new block */
+};
+
+/**
+ * Create an arena
+ * @param block_size The size of a block, or 0 for ARENA_BLOCK_SIZE
+ * @param arena The resulting arena
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_arena_create(size_t block_size, struct arena** arena);
+
+/**
+ * Allocate memory from an arena. The memory isn't initialized
+ * @param arena The arena
+ * @param size The size
+ * @param alignment The alignment, a power of 2
+ * @return The memory, or NULL upon failure
+ */
+void*
+pgexporter_arena_alloc(struct arena* arena, size_t size, size_t alignment);
+
+/**
+ * Copy a string into an arena
+ * @param arena The arena
+ * @param s The string
+ * @return The copy, or NULL upon failure
+ */
+char*
+pgexporter_arena_strdup(struct arena* arena, char* s);
+
+/**
+ * Copy a number of bytes into an arena as a zero terminated string
+ * @param arena The arena
+ * @param s The bytes
+ * @param length The number of bytes
+ * @return The copy, or NULL upon failure
+ */
+char*
+pgexporter_arena_strndup(struct arena* arena, char* s, size_t length);
+
+/**
+ * Move the memory of an arena into another arena, and destroy it
+ * @param to The arena taking over the memory
+ * @param from The arena
+ */
+void
+pgexporter_arena_merge(struct arena* to, struct arena* from);
+
+/**
+ * Destroy an arena and all its allocations
+ * @param arena The arena
+ */
+void
+pgexporter_arena_destroy(struct arena* arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
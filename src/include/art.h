@@ -51,6 +51,16 @@ struct art
 {
    struct art_node* root;                 /**< The root node of ART */
    uint64_t size;                         /**< The size of the ART */
+   struct art_pool* pool;                 /**< The memory of the nodes and the leaves */
+};
+
+/** @struct art_entry
+ * Defines a key value pair for a bulk insert
+ */
+struct art_entry
+{
+   char* key;                   /**< The key */
+   uintptr_t value;             /**< The value data */
 };
 
 /** @struct art_iterator
@@ -58,11 +68,14 @@ struct art
  */
 struct art_iterator
 {
-   struct deque* que;           /**< The deque */
    struct art* tree;            /**< The ART */
    uint32_t count;              /**< The count of the iterator */
    char* key;                   /**< The key */
    struct value* value;         /**< The value */
+   struct art_node** stack;     /**< The nodes still to be visited, the next one on top */
+   uint32_t top;                /**< The number of nodes on the stack */
+   uint32_t capacity;           /**< The capacity of the stack */
+   char* end;                   /**< The key ending the range, or NULL */
 };
 
 /**
@@ -95,6 +108,18 @@ pgexporter_art_insert(struct art* t, char* key, uintptr_t value, enum value_type
 int
 pgexporter_art_insert_with_config(struct art* t, char* key, uintptr_t value, struct value_config* config);
 
+/**
+ * Inserts many values into the art tree. When the tree is empty and the keys are sorted and distinct
+ * the tree is built directly, with each node created at its final size, otherwise the keys are inserted one by one
+ * @param t The tree
+ * @param entries The entries
+ * @param number_of_entries The number of entries
+ * @param type The value type
+ * @return 0 if the items were successfully inserted, otherwise 1
+ */
+int
+pgexporter_art_bulk_insert(struct art* t, struct art_entry* entries, int number_of_entries, enum value_type type);
+
 /**
  * Check if a key exists in the ART tree
  * @param t The tree
@@ -155,7 +180,7 @@ void
 pgexporter_art_iterator_remove(struct art_iterator* iter);
 
 /**
- * Create an art iterator
+ * Create an art iterator, which visits the keys in order
  * @param t The tree
  * @param iter [out] The iterator
  * @return 0 if success, otherwise 1
@@ -163,6 +188,27 @@ pgexporter_art_iterator_remove(struct art_iterator* iter);
 int
 pgexporter_art_iterator_create(struct art* t, struct art_iterator** iter);
 
+/**
+ * Create an art iterator over the keys starting with a prefix, which only visits the subtree of the prefix
+ * @param t The tree
+ * @param prefix The prefix
+ * @param iter [out] The iterator
+ * @return 0 if success, otherwise 1
+ */
+int
+pgexporter_art_iterator_create_prefix(struct art* t, char* prefix, struct art_iterator** iter);
+
+/**
+ * Create an art iterator over the keys from start, and before end
+ * @param t The tree
+ * @param start The first key, or NULL for the smallest key
+ * @param end The key ending the range, or NULL for all the remaining keys
+ * @param iter [out] The iterator
+ * @return 0 if success, otherwise 1
+ */
+int
+pgexporter_art_iterator_create_range(struct art* t, char* start, char* end, struct art_iterator** iter);
+
 /**
  * Destroy the iterator
  * @param iter The iterator
@@ -77,6 +77,15 @@ extern "C" {
 void
 pgexporter_bridge(int fd);
 
+/**
+ * Serve a single request to the prometheus bridge.
+ * The caller owns the logging, the memory segment and the client descriptor
+ * @param fd The client descriptor
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_bridge_serve(int fd);
+
 /**
  * Allocates, for the first time, the bridge cache.
  *
@@ -101,6 +110,39 @@ pgexporter_bridge(int fd);
 int
 pgexporter_bridge_init_cache(size_t* p_size, void** p_shmem);
 
+/**
+ * Refresh the endpoints and publish the bridge snapshot.
+ *
+ * The metrics of each endpoint are kept by the calling process between
+ * the invocations, and are replaced when the endpoint has been fetched,
+ * such that an endpoint that fails keeps its last metrics.
+ *
+ * @return The number of seconds until the next refresh
+ */
+int
+pgexporter_bridge_refresh(void);
+
+/**
+ * Release the metrics kept by the refresher
+ */
+void
+pgexporter_bridge_refresh_destroy(void);
+
+/**
+ * Allocates the bridge snapshot used by the refresher.
+ *
+ * Each of the two slots gets the size of the bridge cache.
+ *
+ * @param p_size a pointer to where to store the size of
+ * allocated chunk of memory
+ * @param p_shmem the pointer to the pointer at which the allocated chunk
+ * of shared memory is going to be inserted
+ *
+ * @return 0 on success
+ */
+int
+pgexporter_bridge_init_snapshot(size_t* p_size, void** p_shmem);
+
 /**
  * Create a prometheus JSON bridge
  * @param fd The client descriptor
@@ -108,6 +150,15 @@ pgexporter_bridge_init_cache(size_t* p_size, void** p_shmem);
 void
 pgexporter_bridge_json(int fd);
 
+/**
+ * Serve a single request to the prometheus JSON bridge.
+ * The caller owns the logging, the memory segment and the client descriptor
+ * @param fd The client descriptor
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_bridge_json_serve(int fd);
+
 /**
  * Allocates, for the first time, the bridge JSON cache.
  *
@@ -33,6 +33,9 @@
 extern "C" {
 #endif
 
+#include <utils.h>
+
+#include <stdbool.h>
 #include <stdlib.h>
 
 /**
@@ -55,6 +58,36 @@ pgexporter_bzip2_string(char* s, unsigned char** buffer, size_t* buffer_size);
 int
 pgexporter_bunzip2_string(unsigned char* compressed_buffer, size_t compressed_size, char** output_string);
 
+
+/**
+ * Create a BZip2 stream
+ * @param compress True to compress, false to decompress
+ * @param stream The stream
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_bzip2_stream_create(bool compress, void** stream);
+
+/**
+ * Process data through a BZip2 stream. The output is appended to the
+ * builder, so only the output of the data given is held in memory
+ * @param stream The stream
+ * @param data The data
+ * @param length The length of the data
+ * @param finish True if this is the last data of the stream
+ * @param output The output
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_bzip2_stream_update(void* stream, void* data, size_t length, bool finish, struct builder* output);
+
+/**
+ * Destroy a BZip2 stream
+ * @param stream The stream
+ */
+void
+pgexporter_bzip2_stream_destroy(void* stream);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGEXPORTER_CACHE_H
+#define PGEXPORTER_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pgexporter.h>
+#include <message.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include <openssl/ssl.h>
+
+/**
+ * Create a cache in shared memory
+ * @param size The size of each of the two slots
+ * @param hp Huge page value
+ * @param p_size The size of the segment
+ * @param p_shmem The shared memory segment
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_cache_create(size_t size, unsigned char hp, size_t* p_size, void** p_shmem);
+
+/**
+ * Replace a cache by a larger one when a rebuild didn't fit in it.
+ * The payload being served is carried over, and the processes
+ * still attached to the previous cache keep using it
+ * @param max The largest size of a slot
+ * @param p_size The size of the segment
+ * @param p_shmem The cache
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_cache_grow(size_t max, size_t* p_size, void** p_shmem);
+
+/**
+ * Destroy a cache
+ * @param shmem The shared memory segment
+ * @param size The size of the segment
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_cache_destroy(void* shmem, size_t size);
+
+/**
+ * Get the preferred encoding of a HTTP request from its Accept-Encoding header
+ * @param msg The request
+ * @return The encoding, CACHE_ENCODING_IDENTITY if none is accepted
+ */
+int
+pgexporter_cache_encoding(struct message* msg);
+
+/**
+ * Write the payload being served to a client as a HTTP response, without copying it.
+ * The payload is sent with sendfile(2) where available, in the requested
+ * encoding if the slot holds it and otherwise as is.
+ * A reader never waits for a rebuild, but a rebuild waits
+ * for the writes of the slot it reuses
+ * @param cache The cache
+ * @param valid Only write a payload that is still valid
+ * @param encoding The encoding accepted by the client
+ * @param content_type The content type of the response
+ * @param ssl The SSL structure of the client, or NULL
+ * @param fd The descriptor of the client
+ * @param length The length of the payload
+ * @return MESSAGE_STATUS_OK upon success, MESSAGE_STATUS_ZERO if there is
+ *         no such payload, otherwise MESSAGE_STATUS_ERROR
+ */
+int
+pgexporter_cache_write(struct prometheus_cache* cache, bool valid, int encoding, char* content_type, SSL* ssl, int fd, size_t* length);
+
+/**
+ * Write the payload being rebuilt to a client as a chunked response,
+ * following the rebuild as it produces the payload, such that clients
+ * arriving during a rebuild neither wait for it nor start another one
+ * @param cache The cache
+ * @param content_type The content type of the response
+ * @param ssl The SSL structure of the client, or NULL
+ * @param fd The descriptor of the client
+ * @param length The length of the payload sent
+ * @return MESSAGE_STATUS_OK upon success, MESSAGE_STATUS_ZERO if there is
+ *         no rebuild to follow, otherwise MESSAGE_STATUS_ERROR
+ */
+int
+pgexporter_cache_follow(struct prometheus_cache* cache, char* content_type, SSL* ssl, int fd, size_t* length);
+
+/**
+ * Is there a payload being served
+ * @param cache The cache
+ * @param valid Only a payload that is still valid
+ * @return True if there is such a payload, otherwise false
+ */
+bool
+pgexporter_cache_available(struct prometheus_cache* cache, bool valid);
+
+/**
+ * Try to take the lock for a rebuild of the cache
+ * @param cache The cache
+ * @return True if the lock was taken, otherwise false
+ */
+bool
+pgexporter_cache_lock(struct prometheus_cache* cache);
+
+/**
+ * Release the lock of the cache
+ * @param cache The cache
+ */
+void
+pgexporter_cache_unlock(struct prometheus_cache* cache);
+
+/**
+ * Start a rebuild in the slot that isn't served.
+ * Requires the caller to hold the lock on the cache.
+ * The rebuild won't be served if the slot is still in use
+ * after blocking_timeout
+ * @param cache The cache
+ */
+void
+pgexporter_cache_begin(struct prometheus_cache* cache);
+
+/**
+ * Append data to the rebuild.
+ * Requires the caller to hold the lock on the cache
+ * @param cache The cache
+ * @param data The data
+ * @param length The length of the data
+ * @return True upon success, otherwise false if the rebuild won't be served
+ */
+bool
+pgexporter_cache_append(struct prometheus_cache* cache, char* data, size_t length);
+
+/**
+ * Serve the rebuild from now on, after compressing it
+ * for the encodings requested by the clients.
+ * Requires the caller to hold the lock on the cache
+ * @param cache The cache
+ * @param valid_until When the payload will become not valid
+ * @return True upon success, otherwise false if the rebuild didn't fit,
+ *         or its slot was still in use
+ */
+bool
+pgexporter_cache_publish(struct prometheus_cache* cache, time_t valid_until);
+
+/**
+ * Stop serving the payload of the cache
+ * @param cache The cache
+ */
+void
+pgexporter_cache_invalidate(struct prometheus_cache* cache);
+
+/**
+ * Release the slots read by a process that exited
+ * @param cache The cache
+ * @param pid The process id
+ */
+void
+pgexporter_cache_release_readers(struct prometheus_cache* cache, pid_t pid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGEXPORTER_CATALOG_H
+#define PGEXPORTER_CATALOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pgexporter.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define CATALOG_ALIGNMENT 8
+#define CATALOG_RESERVED  64
+
+#define CATALOG_MAGIC      "PGEXCAT"
+#define CATALOG_FORMAT     3
+#define CATALOG_KEY_LENGTH 32
+
+/** @struct catalog
+ * The metric definitions in a shared memory segment, which is sized
+ * for what is configured.
+ *
+ * The segment holds the metrics, followed by the prepared statements
+ * and the query plans of each server and metric, and by a pool with the
+ * query alternatives, their columns and the strings. The content of the
+ * pool refers to the pool by offset, so a pool built on the heap is
+ * published with a single copy. Only the column names of a query
+ * alternative are filled in as pointers once the pool is published.
+ *
+ * The first CATALOG_RESERVED bytes of the pool are zero, so offset 0
+ * is the empty string, and stands for no node.
+ */
+struct catalog
+{
+   size_t size;                    /**< The size of the segment */
+   int number_of_metrics;          /**< The number of metrics */
+   int number_of_servers;          /**< The number of servers of the prepared statements */
+   size_t prepared;                /**< The offset of the prepared statements */
+   size_t plans;                   /**< The offset of the query plans */
+   size_t pool;                    /**< The offset of the pool */
+   size_t pool_size;               /**< The size of the pool */
+   struct prometheus prometheus[]; /**< The metrics */
+} __attribute__ ((aligned (64)));
+
+/** @struct query_plan
+ * The query alternative of a metric for the version of a server. A plan
+ * is resolved again when the version of the server changes, which only
+ * happens when the connection is established again
+ */
+struct query_plan
+{
+   atomic_int version;           /**< The server version of the plan, or -1 */
+   struct query_alts* query_alt; /**< The query alternative, or NULL if none */
+   char** names;                 /**< The column names, or NULL for a histogram */
+};
+
+/** @struct catalog_builder
+ * The metric definitions while they are loaded, on the heap
+ * of the process loading them
+ */
+struct catalog_builder
+{
+   struct prometheus* prometheus; /**< The metrics */
+   int number_of_metrics;         /**< The number of metrics */
+   int capacity;                  /**< The capacity of the metrics */
+   char* pool;                    /**< The pool */
+   size_t used;                   /**< The used part of the pool */
+   size_t size;                   /**< The size of the pool */
+   bool failed;                   /**< Has an allocation failed */
+};
+
+/** @struct catalog_cache
+ * The header of the file caching the metric definitions. The header is
+ * followed by the metrics and by the pool, as they are built, so the
+ * file holds no pointers.
+ *
+ * The key is a SHA-256 digest over the format, the version, the layout
+ * of the definitions, the internal definitions, and the name, size,
+ * modification time and content of the files they are read from
+ */
+struct catalog_cache
+{
+   char magic[8];                          /**< The magic, CATALOG_MAGIC */
+   int format;                             /**< The format, CATALOG_FORMAT */
+   int prometheus_size;                    /**< The size of a metric */
+   int query_alts_size;                    /**< The size of a query alternative */
+   int column_size;                        /**< The size of a column */
+   unsigned char key[CATALOG_KEY_LENGTH];  /**< The key of the definitions */
+   int number_of_metrics;                  /**< The number of metrics */
+   size_t pool_size;                       /**< The size of the pool */
+};
+
+/**
+ * Start loading the metric definitions of a configuration
+ * @param config The configuration
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_catalog_begin(struct configuration* config);
+
+/**
+ * Get a metric being loaded, and add the metrics up to it.
+ * The metric moves when a metric is added. A failure
+ * makes the publication fail
+ * @param config The configuration
+ * @param index The index of the metric
+ * @return The metric, or NULL upon failure
+ */
+struct prometheus*
+pgexporter_catalog_metric(struct configuration* config, int index);
+
+/**
+ * Allocate zeroed memory in the pool being loaded.
+ * The pool moves when memory is allocated. A failure
+ * makes the publication fail
+ * @param config The configuration
+ * @param size The size
+ * @return The offset, or 0 upon failure
+ */
+size_t
+pgexporter_catalog_alloc(struct configuration* config, size_t size);
+
+/**
+ * Copy a string into the pool being loaded
+ * @param config The configuration
+ * @param s The string
+ * @return The offset, or 0 for an empty string or upon failure
+ */
+size_t
+pgexporter_catalog_strdup(struct configuration* config, char* s);
+
+/**
+ * Load the metric definitions from the cache file of a configuration,
+ * if the definitions haven't changed since it was written
+ * @param config The configuration
+ * @param path The path of the metric definitions, or NULL for the internal ones only
+ * @param json Are the metric definitions in JSON
+ * @param key The key of the definitions, computed before they are read
+ * @return 0 if the definitions are being loaded from the cache, otherwise 1
+ */
+int
+pgexporter_catalog_read_cache(struct configuration* config, char* path, bool json, unsigned char* key);
+
+/**
+ * Write the metric definitions being loaded in the cache
+ * file of a configuration
+ * @param config The configuration
+ * @param key The key of the definitions
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_catalog_write_cache(struct configuration* config, unsigned char* key);
+
+/**
+ * Publish the metric definitions being loaded in a shared memory
+ * segment, and replace the ones of the configuration
+ * @param config The configuration
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_catalog_publish(struct configuration* config);
+
+/**
+ * Get the metric definitions of the generation of this process. A process
+ * keeps the generation it was started with, which was mapped when it was
+ * forked, so a scrape in progress finishes on it across a reload
+ * @param config The configuration
+ * @return The catalog, or NULL if there is none
+ */
+struct catalog*
+pgexporter_catalog_get(struct configuration* config);
+
+/**
+ * Hand over the metric definitions of a reload to the configuration, which
+ * starts a new generation. The prepared statements of the servers keeping
+ * their connection are kept for the metrics whose query didn't change
+ * @param config The configuration
+ * @param reload The configuration being reloaded
+ * @param retain The servers keeping their prepared statements
+ */
+void
+pgexporter_catalog_transfer(struct configuration* config, struct configuration* reload, bool* retain);
+
+/**
+ * Get the pool of a configuration, the one being loaded if any
+ * @param config The configuration
+ * @return The pool, or NULL if there is none
+ */
+char*
+pgexporter_catalog_pool(struct configuration* config);
+
+/**
+ * Get the prepared statement of a metric on the connection to a server
+ * that the main process lends to the scrapes. A process with connections
+ * of its own keeps their prepared statements itself
+ * @param config The configuration
+ * @param server The server
+ * @param metric The metric
+ * @return The prepared statement, or NULL if there is none
+ */
+struct prepared_statement*
+pgexporter_catalog_prepared(struct configuration* config, int server, int metric);
+
+/**
+ * Get the query plan of a metric on a server, and resolve it
+ * for the current version of the server if needed
+ * @param config The configuration
+ * @param server The server
+ * @param metric The metric
+ * @return The query plan, or NULL if there is none
+ */
+struct query_plan*
+pgexporter_catalog_plan(struct configuration* config, int server, int metric);
+
+/**
+ * Destroy the metric definitions of a configuration,
+ * including the ones being loaded
+ * @param config The configuration
+ */
+void
+pgexporter_catalog_destroy(struct configuration* config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
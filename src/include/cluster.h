@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGEXPORTER_CLUSTER_H
+#define PGEXPORTER_CLUSTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pgexporter.h>
+#include <utils.h>
+
+#include <stdbool.h>
+
+/**
+ * Is a server collected by this instance. Without a cluster all the
+ * servers are collected
+ * @param server The server
+ * @return True if collected, otherwise false
+ */
+bool
+pgexporter_cluster_owns(int server);
+
+/**
+ * Get the member collecting a server, the live member with the highest
+ * rendezvous hash of the member and the name of the server
+ * @param server The server
+ * @return The member, or -1 without a cluster
+ */
+int
+pgexporter_cluster_owner(int server);
+
+/**
+ * Is the member of a bridge endpoint alive. An endpoint that isn't
+ * a member is always alive
+ * @param endpoint The endpoint
+ * @return True if alive, otherwise false
+ */
+bool
+pgexporter_cluster_endpoint_alive(int endpoint);
+
+/**
+ * Send a heartbeat to the other members, and rebalance the servers
+ * when a member goes down or comes back
+ * @return The number of seconds until the next heartbeat
+ */
+int
+pgexporter_cluster_heartbeat(void);
+
+/**
+ * Write the view of the cluster of this instance, as served on /cluster
+ * @param builder The builder
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_cluster_status(struct builder* builder);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
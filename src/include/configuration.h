@@ -41,14 +41,39 @@ extern "C" {
 #define CONFIGURATION_ARGUMENT_UNIX_SOCKET_DIR            "unix_socket_dir"
 #define CONFIGURATION_ARGUMENT_METRICS                    "metrics"
 #define CONFIGURATION_ARGUMENT_METRICS_PATH               "metrics_path"
+#define CONFIGURATION_ARGUMENT_METRICS_DEFINITIONS_CACHE  "metrics_definitions_cache"
 #define CONFIGURATION_ARGUMENT_METRICS_CACHE_MAX_AGE      "metrics_cache_max_age"
+#define CONFIGURATION_ARGUMENT_METRICS_PARALLEL           "metrics_parallel"
+#define CONFIGURATION_ARGUMENT_DATABASE_PARALLEL          "database_parallel"
+#define CONFIGURATION_ARGUMENT_ROLE_INTERVAL              "role_interval"
+#define CONFIGURATION_ARGUMENT_METRICS_PIPELINE           "metrics_pipeline"
+#define CONFIGURATION_ARGUMENT_METRICS_BINARY             "metrics_binary"
+#define CONFIGURATION_ARGUMENT_METRICS_SELF               "metrics_self"
+#define CONFIGURATION_ARGUMENT_MEMORY_ACCOUNTING          "memory_accounting"
+#define CONFIGURATION_ARGUMENT_METRICS_NEGOTIATION        "metrics_negotiation"
+#define CONFIGURATION_ARGUMENT_QUERY_TIMEOUT              "query_timeout"
+#define CONFIGURATION_ARGUMENT_COLLECTION_INTERVAL        "collection_interval"
+#define CONFIGURATION_ARGUMENT_REMOTE_WRITE               "remote_write"
+#define CONFIGURATION_ARGUMENT_REMOTE_WRITE_BATCH         "remote_write_batch"
+#define CONFIGURATION_ARGUMENT_REMOTE_WRITE_QUEUE         "remote_write_queue"
+#define CONFIGURATION_ARGUMENT_REMOTE_WRITE_TIMEOUT       "remote_write_timeout"
 #define CONFIGURATION_ARGUMENT_METRICS_CACHE_MAX_SIZE     "metrics_cache_max_size"
 #define CONFIGURATION_ARGUMENT_BRIDGE                     "bridge"
 #define CONFIGURATION_ARGUMENT_BRIDGE_ENDPOINTS           "bridge_endpoints"
 #define CONFIGURATION_ARGUMENT_BRIDGE_CACHE_MAX_AGE       "bridge_cache_max_age"
 #define CONFIGURATION_ARGUMENT_BRIDGE_CACHE_MAX_SIZE      "bridge_cache_max_size"
+#define CONFIGURATION_ARGUMENT_BRIDGE_PARALLEL            "bridge_parallel"
+#define CONFIGURATION_ARGUMENT_BRIDGE_TIMEOUT             "bridge_timeout"
+#define CONFIGURATION_ARGUMENT_BRIDGE_KEEP_ALIVE          "bridge_keep_alive"
+#define CONFIGURATION_ARGUMENT_BRIDGE_INTERVAL            "bridge_interval"
 #define CONFIGURATION_ARGUMENT_BRIDGE_JSON                "bridge_json"
 #define CONFIGURATION_ARGUMENT_BRIDGE_JSON_CACHE_MAX_SIZE "bridge_json_cache_max_size"
+#define CONFIGURATION_ARGUMENT_BRIDGE_AGGREGATE           "bridge_aggregate"
+#define CONFIGURATION_ARGUMENT_CLUSTER                    "cluster"
+#define CONFIGURATION_ARGUMENT_CLUSTER_SELF               "cluster_self"
+#define CONFIGURATION_ARGUMENT_CLUSTER_INTERVAL           "cluster_interval"
+#define CONFIGURATION_ARGUMENT_CLUSTER_TIMEOUT            "cluster_timeout"
+#define CONFIGURATION_ARGUMENT_CLUSTER_FEDERATE           "cluster_federate"
 #define CONFIGURATION_ARGUMENT_MANAGEMENT                 "management"
 #define CONFIGURATION_ARGUMENT_CACHE                      "cache"
 #define CONFIGURATION_ARGUMENT_LOG_TYPE                   "log_type"
@@ -58,6 +83,7 @@ extern "C" {
 #define CONFIGURATION_ARGUMENT_LOG_ROTATION_SIZE          "log_rotation_size"
 #define CONFIGURATION_ARGUMENT_LOG_LINE_PREFIX            "log_line_prefix"
 #define CONFIGURATION_ARGUMENT_LOG_MODE                   "log_mode"
+#define CONFIGURATION_ARGUMENT_LOG_ASYNC                  "log_async"
 #define CONFIGURATION_ARGUMENT_BLOCKING_TIMEOUT           "blocking_timeout"
 #define CONFIGURATION_ARGUMENT_TLS                        "tls"
 #define CONFIGURATION_ARGUMENT_TLS_CERT_FILE              "tls_cert_file"
@@ -71,13 +97,18 @@ extern "C" {
 #define CONFIGURATION_ARGUMENT_NODELAY                    "nodelay"
 #define CONFIGURATION_ARGUMENT_NON_BLOCKING               "non_blocking"
 #define CONFIGURATION_ARGUMENT_BACKLOG                    "backlog"
+#define CONFIGURATION_ARGUMENT_WORKERS                    "workers"
 #define CONFIGURATION_ARGUMENT_HUGEPAGE                   "hugepage"
+#define CONFIGURATION_ARGUMENT_NUMA                       "numa"
+#define CONFIGURATION_ARGUMENT_TRACES                     "traces"
 #define CONFIGURATION_ARGUMENT_PIDFILE                    "pidfile"
 #define CONFIGURATION_ARGUMENT_UPDATE_PROCESS_TITLE       "update_process_title"
 #define CONFIGURATION_ARGUMENT_PORT                       "port"
 #define CONFIGURATION_ARGUMENT_USER                       "user"
 #define CONFIGURATION_ARGUMENT_DATA_DIR                   "data_dir"
 #define CONFIGURATION_ARGUMENT_WAL_DIR                    "wal_dir"
+#define CONFIGURATION_ARGUMENT_MAX_PARALLEL_QUERIES       "max_parallel_queries"
+#define CONFIGURATION_ARGUMENT_DATABASE_CONNECTIONS       "database_connections"
 #define CONFIGURATION_ARGUMENT_MAIN_CONF_PATH             "main_configuration_path"
 #define CONFIGURATION_ARGUMENT_USER_CONF_PATH             "users_configuration_path"
 #define CONFIGURATION_ARGUMENT_ADMIN_CONF_PATH            "admin_configuration_path"
@@ -156,8 +187,9 @@ pgexporter_reload_configuration(bool* reload);
  * @param compression The compress method for wire protocol
  * @param encryption The encrypt method for wire protocol
  * @param payload The payload
+ * @return 0 upon success, otherwise 1
  */
-void
+int
 pgexporter_conf_get(SSL* ssl, int client_fd, uint8_t compression, uint8_t encryption, struct json* payload);
 
 /**
@@ -167,8 +199,9 @@ pgexporter_conf_get(SSL* ssl, int client_fd, uint8_t compression, uint8_t encryp
  * @param compression The compress method for wire protocol
  * @param encryption The encrypt method for wire protocol
  * @param payload The payload
+ * @return 0 upon success, otherwise 1
  */
-void
+int
 pgexporter_conf_set(SSL* ssl, int client_fd, uint8_t compression, uint8_t encryption, struct json* payload);
 
 #ifdef __cplusplus
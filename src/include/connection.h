@@ -41,18 +41,31 @@ extern "C" {
 
 #include <openssl/ssl.h>
 
+/* The slots of the bridge endpoints follow the slots of the servers */
+#define TRANSFER_ENDPOINT NUMBER_OF_SERVERS
+
+/**
+ * Transfer the connection of a server
+ * @param server The server
+ * @param descriptor The descriptor of the connection
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_transfer_connection_write(int server, int descriptor);
+
 /**
- * Transfer a connection
- * @param slot The slot
+ * Transfer the connection of a bridge endpoint
+ * @param endpoint The endpoint
+ * @param descriptor The descriptor of the connection
  * @return 0 upon success, otherwise 1
  */
 int
-pgexporter_transfer_connection_write(int server);
+pgexporter_transfer_endpoint_write(int endpoint, int descriptor);
 
 /**
  * Read the connection
  * @param client_fd The client descriptor
- * @param server The server
+ * @param server The server, or TRANSFER_ENDPOINT plus the endpoint
  * @param fd The file descriptor
  * @return 0 upon success, otherwise 1
  */
@@ -37,8 +37,29 @@ extern "C" {
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#define DEQUE_THREAD_SAFE 0x01 /**< The deque takes its lock for each operation */
+#define DEQUE_POOLED      0x02 /**< The value is kept in the node, and a removed node is reused */
+#define DEQUE_BORROW_TAGS 0x04 /**< The tags aren't copied, and must outlive their nodes */
+
+/**
+ * Get the struct that a link is embedded in
+ * @param link The link
+ * @param type The type of the struct
+ * @param member The name of the link in the struct
+ */
+#define pgexporter_deque_entry(link, type, member) ((type*)((char*)(link) - offsetof(type, member)))
+
+/**
+ * The sort key of an element
+ * @param tag The tag, or NULL
+ * @param value The value
+ * @return The key
+ */
+typedef uint64_t (*deque_key_cb)(char* tag, struct value* value);
+
 /** @struct deque_node
  * Defines a deque node
  */
@@ -48,6 +69,8 @@ struct deque_node
    char* tag;               /**< The tag */
    struct deque_node* next; /**< The next pointer */
    struct deque_node* prev; /**< The previous pointer */
+   struct value value;      /**< The value of a pooled deque */
+   uint64_t key;            /**< The key of the last pgexporter_deque_sort_by_key */
 };
 
 /** @struct deque
@@ -57,9 +80,30 @@ struct deque
 {
    uint32_t size;            /**< The size of the deque */
    bool thread_safe;         /**< If the deque is thread safe */
+   bool pooled;              /**< If the nodes are pooled */
+   bool borrow_tags;         /**< If the tags are borrowed */
    pthread_rwlock_t mutex;   /**< The mutex of the deque */
    struct deque_node* start; /**< The start node */
    struct deque_node* end;   /**< The end node */
+   struct deque_node* pool;  /**< The removed nodes of a pooled deque */
+};
+
+/** @struct deque_link
+ * Defines the link of an intrusive deque, which is embedded in the struct of an element
+ */
+struct deque_link
+{
+   struct deque_link* next; /**< The next link */
+   struct deque_link* prev; /**< The previous link */
+};
+
+/** @struct intrusive_deque
+ * Defines an intrusive deque, which links the elements without allocating
+ */
+struct intrusive_deque
+{
+   struct deque_link head;  /**< The head, which links the first and the last element */
+   uint32_t size;           /**< The size of the deque */
 };
 
 /** @struct deque_iterator
@@ -82,6 +126,15 @@ struct deque_iterator
 int
 pgexporter_deque_create(bool thread_safe, struct deque** deque);
 
+/**
+ * Create a deque
+ * @param flags The flags, DEQUE_THREAD_SAFE, DEQUE_POOLED and DEQUE_BORROW_TAGS
+ * @param deque The deque
+ * @return 0 if success, otherwise 1
+ */
+int
+pgexporter_deque_create_with_flags(int flags, struct deque** deque);
+
 /**
  * Add a node to deque's tail, the tag will be copied
  * This function is thread safe
@@ -256,12 +309,21 @@ void
 pgexporter_deque_list(struct deque* deque);
 
 /**
- * Sort the deque
+ * Sort the deque by tag, where the elements with the same tag keep their order
  * @param deque The deque
  */
 void
 pgexporter_deque_sort(struct deque* deque);
 
+/**
+ * Sort the deque by a key, which is computed once for each element, such as a hash
+ * or the numeric value of the element. The elements with the same key keep their order
+ * @param deque The deque
+ * @param key The key of an element
+ */
+void
+pgexporter_deque_sort_by_key(struct deque* deque, deque_key_cb key);
+
 /**
  * Convert what's inside deque to string
  * @param deque The deque
@@ -280,6 +342,62 @@ pgexporter_deque_to_string(struct deque* deque, int32_t format, char* tag, int i
 void
 pgexporter_deque_destroy(struct deque* deque);
 
+/**
+ * Initialize an intrusive deque
+ * @param deque The deque
+ */
+void
+pgexporter_intrusive_deque_init(struct intrusive_deque* deque);
+
+/**
+ * Add an element to the end of an intrusive deque
+ * @param deque The deque
+ * @param link The link of the element
+ */
+void
+pgexporter_intrusive_deque_add(struct intrusive_deque* deque, struct deque_link* link);
+
+/**
+ * Add an element to the start of an intrusive deque
+ * @param deque The deque
+ * @param link The link of the element
+ */
+void
+pgexporter_intrusive_deque_add_first(struct intrusive_deque* deque, struct deque_link* link);
+
+/**
+ * Remove the first element of an intrusive deque
+ * @param deque The deque
+ * @return The link of the element, or NULL if empty
+ */
+struct deque_link*
+pgexporter_intrusive_deque_poll(struct intrusive_deque* deque);
+
+/**
+ * Remove an element from an intrusive deque
+ * @param deque The deque
+ * @param link The link of the element
+ */
+void
+pgexporter_intrusive_deque_remove(struct intrusive_deque* deque, struct deque_link* link);
+
+/**
+ * Get the next element of an intrusive deque
+ * @param deque The deque
+ * @param link The link of the current element, or NULL for the first element
+ * @return The link of the next element, or NULL at the end
+ */
+struct deque_link*
+pgexporter_intrusive_deque_next(struct intrusive_deque* deque, struct deque_link* link);
+
+/**
+ * Is an intrusive deque empty
+ * @param deque The deque
+ * @return true if empty, otherwise false
+ */
+bool
+pgexporter_intrusive_deque_empty(struct intrusive_deque* deque);
+
 #ifdef __cplusplus
 }
 #endif
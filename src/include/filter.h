@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGEXPORTER_FILTER_H
+#define PGEXPORTER_FILTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pgexporter.h>
+
+#include <stdbool.h>
+
+#define MAX_NUMBER_OF_FILTERS 32
+
+/** @struct metrics_filter
+ * Defines the filter of a metrics request, from its match[] and collector= parameters.
+ * A match[] selector is compiled into the name, or the prefix of the name, of the metrics
+ * it selects
+ */
+struct metrics_filter
+{
+   int number_of_names;                                 /**< The number of names */
+   char names[MAX_NUMBER_OF_FILTERS][MISC_LENGTH];      /**< The names */
+   bool prefix[MAX_NUMBER_OF_FILTERS];                  /**< Is the name a prefix */
+   int number_of_collectors;                            /**< The number of collectors */
+   char collectors[MAX_NUMBER_OF_FILTERS][MISC_LENGTH]; /**< The collectors */
+};
+
+/**
+ * Parse the query string of a request into a filter
+ * @param query The query string, without the '?', or NULL. The string is decoded in place
+ * @param filter The resulting filter
+ * @return 0 upon success, otherwise 1 for a selector that isn't supported
+ */
+int
+pgexporter_filter_parse(char* query, struct metrics_filter* filter);
+
+/**
+ * Does the filter restrict the metrics
+ * @param filter The filter, or NULL
+ * @return True if active, otherwise false
+ */
+bool
+pgexporter_filter_active(struct metrics_filter* filter);
+
+/**
+ * Does the filter select a collector
+ * @param filter The filter, or NULL
+ * @param collector The collector
+ * @return True if selected, otherwise false
+ */
+bool
+pgexporter_filter_collector(struct metrics_filter* filter, const char* collector);
+
+/**
+ * Can the filter select a metric whose name starts with a prefix, such that
+ * a collector is only run if any of its metrics can be selected
+ * @param filter The filter, or NULL
+ * @param prefix The prefix of the names of the metrics
+ * @return True if a metric can be selected, otherwise false
+ */
+bool
+pgexporter_filter_prefix(struct metrics_filter* filter, const char* prefix);
+
+/**
+ * Get the prefixes of the keys that the filter can select, in order and without a prefix
+ * that starts with another one, such that a tree of metrics is only walked where they are
+ * @param filter The filter
+ * @param prefixes [out] The prefixes, pointing into the filter
+ * @return The number of prefixes, or 0 when the filter doesn't select by name
+ */
+int
+pgexporter_filter_prefixes(struct metrics_filter* filter, char* prefixes[MAX_NUMBER_OF_FILTERS]);
+
+/**
+ * Does the filter select a metric
+ * @param filter The filter, or NULL
+ * @param key The name of the metric, optionally followed by its labels
+ * @param length The length of the name, or 0 to stop at the labels
+ * @return True if selected, otherwise false
+ */
+bool
+pgexporter_filter_metric(struct metrics_filter* filter, const char* key, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
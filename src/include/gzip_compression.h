@@ -33,6 +33,9 @@
 extern "C" {
 #endif
 
+#include <utils.h>
+
+#include <stdbool.h>
 #include <stdlib.h>
 
 /**
@@ -45,6 +48,18 @@ extern "C" {
 int
 pgexporter_gzip_string(char* s, unsigned char** buffer, size_t* buffer_size);
 
+/**
+ * GZip a buffer into a buffer of a fixed capacity
+ * @param source The data
+ * @param source_size The size of the data
+ * @param destination The buffer of the compressed data
+ * @param capacity The capacity of the destination
+ * @param size The size of the compressed data
+ * @return 0 upon success, otherwise 1 if it failed or didn't fit
+ */
+int
+pgexporter_gzip_buffer(void* source, size_t source_size, void* destination, size_t capacity, size_t* size);
+
 /**
  * GUNZip a buffer to string
  * @param compressed_buffer The buffer containing the GZIP compressed data
@@ -55,6 +70,35 @@ pgexporter_gzip_string(char* s, unsigned char** buffer, size_t* buffer_size);
 int
 pgexporter_gunzip_string(unsigned char* compressed_buffer, size_t compressed_size, char** output_string);
 
+/**
+ * Create a GZIP stream
+ * @param compress True to compress, false to decompress
+ * @param stream The stream
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_gzip_stream_create(bool compress, void** stream);
+
+/**
+ * Process data through a GZIP stream. The output is appended to the
+ * builder, so only the output of the data given is held in memory
+ * @param stream The stream
+ * @param data The data
+ * @param length The length of the data
+ * @param finish True if this is the last data of the stream
+ * @param output The output
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_gzip_stream_update(void* stream, void* data, size_t length, bool finish, struct builder* output);
+
+/**
+ * Destroy a GZIP stream
+ * @param stream The stream
+ */
+void
+pgexporter_gzip_stream_destroy(void* stream);
+
 #ifdef __cplusplus
 }
 #endif
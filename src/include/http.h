@@ -46,6 +46,15 @@ extern "C" {
 #define PGEXPORTER_HTTP_POST 1
 #define PGEXPORTER_HTTP_PUT  2
 
+/**
+ * The callback of a line of a response body
+ * @param line The line, zero terminated and without its line ending
+ * @param length The length of the line
+ * @param data The data of the callback
+ * @return 0 upon success, otherwise 1 to stop reading the response
+ */
+typedef int (*http_line_cb)(char* line, size_t length, void* data);
+
 /** @struct http
  * Defines a HTTP interaction
  */
@@ -53,6 +62,9 @@ struct http
 {
    int endpoint;            /**< The endpoint */
    int socket;              /**< The socket descriptor */
+   int timeout;             /**< The number of seconds to wait for a response, or 0 to wait forever */
+   bool keep_alive;         /**< Is the connection kept open after the response */
+   int status;              /**< The status code of the last response */
    char* body;              /**< The HTTP response body */
    char* headers;           /**< The HTTP response headers */
    char* request_headers;   /**< The HTTP request headers */
@@ -64,11 +76,30 @@ struct http
  * @param hostname The host to connect to
  * @param port The port number
  * @param secure Use SSL if true
+ * @param timeout The number of seconds to wait for the connection and for a response, or 0 to wait forever
+ * @param result The resulting HTTP structure
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_http_connect(char* hostname, int port, bool secure, int timeout, struct http** result);
+
+/**
+ * Create a HTTP interaction over an established connection
+ * @param socket The socket descriptor
+ * @param timeout The number of seconds to wait for a response, or 0 to wait forever
  * @param result The resulting HTTP structure
  * @return 0 upon success, otherwise 1
  */
 int
-pgexporter_http_connect(char* hostname, int port, bool secure, struct http** result);
+pgexporter_http_create(int socket, int timeout, struct http** result);
+
+/**
+ * Is a persistent connection idle, such that it can be used for the next request
+ * @param socket The socket descriptor
+ * @return True if the connection is idle, otherwise false
+ */
+bool
+pgexporter_http_idle(int socket);
 
 /**
  * Disconnect and clean up HTTP resources
@@ -89,24 +120,28 @@ int
 pgexporter_http_add_header(struct http* http, char* name, char* value);
 
 /**
- * Read response data directly from a socket
- * @param ssl SSL connection (can be NULL for non-secure connections)
- * @param socket The socket to read from
- * @param response_text Pointer to store the response text
- * @return MESSAGE_STATUS_OK on success, MESSAGE_STATUS_ERROR otherwise
+ * Perform HTTP GET request. When keep_alive is set the connection is asked to
+ * stay open, and keep_alive is cleared if the server doesn't keep it open
+ * @param http The HTTP structure
+ * @param hostname The hostname for the Host header
+ * @param path The path for the request
+ * @return 0 upon success, otherwise 1
  */
 int
-pgexporter_http_read(SSL* ssl, int socket, char** response_text);
+pgexporter_http_get(struct http* http, char* hostname, char* path);
 
 /**
- * Perform HTTP GET request
+ * Perform HTTP GET request, and hand out the lines of the response body as
+ * they arrive instead of keeping the body. The chunked encoding is decoded
  * @param http The HTTP structure
  * @param hostname The hostname for the Host header
  * @param path The path for the request
+ * @param callback The callback of each line of the body
+ * @param data The data of the callback
  * @return 0 upon success, otherwise 1
  */
 int
-pgexporter_http_get(struct http* http, char* hostname, char* path);
+pgexporter_http_get_lines(struct http* http, char* hostname, char* path, http_line_cb callback, void* data);
 
 /**
  * Perform HTTP POST request
@@ -120,6 +155,21 @@ pgexporter_http_get(struct http* http, char* hostname, char* path);
 int
 pgexporter_http_post(struct http* http, char* hostname, char* path, char* data, size_t length);
 
+/**
+ * Perform HTTP POST request of binary data. When keep_alive is set the connection
+ * is asked to stay open, and keep_alive is cleared if the server doesn't keep it open.
+ * The status code of the response is in status
+ * @param http The HTTP structure
+ * @param hostname The hostname for the Host header
+ * @param path The path for the request
+ * @param content_type The content type of the data
+ * @param data The data to send
+ * @param length The length of the data
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_http_post_data(struct http* http, char* hostname, char* path, char* content_type, void* data, size_t length);
+
 /**
  * Perform HTTP PUT request
  * @param http The HTTP structure
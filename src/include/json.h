@@ -40,6 +40,11 @@ extern "C" {
 
 /* System */
 #include <stdarg.h>
+#include <stdio.h>
+#include <openssl/ssl.h>
+
+#define JSON_WRITER_BUFFER_SIZE 8192
+#define JSON_MAX_DEPTH          128
 
 enum json_type {
    JSONUnknown,
@@ -69,6 +74,56 @@ struct json_iterator
    struct value* value;   /**< The current value or entry */
 };
 
+/**
+ * The sink of a json writer
+ * @param arg The sink argument
+ * @param data The data
+ * @param length The length of the data
+ * @return 0 on success, otherwise 1
+ */
+typedef int (*json_sink_cb)(void* arg, char* data, size_t length);
+
+/** @struct json_writer
+ * Defines a streaming json writer, which buffers the output and hands it
+ * to a sink, so that a document is never materialized as a whole
+ */
+struct json_writer
+{
+   int32_t format;                   /**< The format, FORMAT_JSON or FORMAT_JSON_COMPACT */
+   json_sink_cb sink;                /**< The sink */
+   void* arg;                        /**< The sink argument */
+   int depth;                        /**< The number of open containers */
+   bool first[JSON_MAX_DEPTH];       /**< Is the container still empty */
+   bool array[JSON_MAX_DEPTH];       /**< Is the container an array */
+   bool error;                       /**< Has the sink failed */
+   size_t length;                    /**< The length of the buffered output */
+   char buffer[JSON_WRITER_BUFFER_SIZE]; /**< The buffered output */
+};
+
+/** @struct json_socket
+ * Defines the argument of the socket sink
+ */
+struct json_socket
+{
+   SSL* ssl;   /**< The SSL structure, or NULL */
+   int socket; /**< The socket */
+};
+
+/** @struct json_handler
+ * Defines the callbacks of the event based parser. The keys and the strings
+ * point into the parsed buffer and are only valid until the buffer is released.
+ * A callback may be NULL
+ */
+struct json_handler
+{
+   void* arg;                                                               /**< The callback argument */
+   int (*begin_object)(void* arg, char* key);                               /**< An object starts, key is NULL in an array */
+   int (*end_object)(void* arg);                                            /**< An object ends */
+   int (*begin_array)(void* arg, char* key);                                /**< An array starts, key is NULL in an array */
+   int (*end_array)(void* arg);                                             /**< An array ends */
+   int (*value)(void* arg, char* key, uintptr_t data, enum value_type type); /**< A string, number, boolean or null */
+};
+
 /**
  * Create a json object
  * @param item [out] The json item
@@ -190,6 +245,29 @@ pgexporter_json_iterator_destroy(struct json_iterator* iter);
 int
 pgexporter_json_parse_string(char* str, struct json** obj);
 
+/**
+ * Parse a string into json item in place. The buffer is used as scratch space
+ * for the unescaped keys and strings, so its content is undefined afterwards
+ * @param str The string
+ * @param length The length of the string
+ * @param obj [out] The json object
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_parse_in_place(char* str, size_t length, struct json** obj);
+
+/**
+ * Parse a string in place and report each element to a handler instead of building a json object.
+ * The strings and numbers are reported as ValueString, ValueInt64, ValueDouble or ValueBool,
+ * and null as a ValueString of 0
+ * @param str The string
+ * @param length The length of the string
+ * @param handler The handler
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_parse_sax(char* str, size_t length, struct json_handler* handler);
+
 /**
  * Clone a json object
  * @param from The from object
@@ -236,6 +314,15 @@ pgexporter_json_destroy(struct json* object);
 int
 pgexporter_json_read_file(char* path, struct json** obj);
 
+/**
+ * Read a json from disk and report each element to a handler
+ * @param path The path
+ * @param handler The handler
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_read_file_sax(char* path, struct json_handler* handler);
+
 /**
  * Write a json file to disk
  * @param path The path
@@ -245,6 +332,110 @@ pgexporter_json_read_file(char* path, struct json** obj);
 int
 pgexporter_json_write_file(char* path, struct json* obj);
 
+/**
+ * Initialize a json writer
+ * @param writer The writer
+ * @param format The format, FORMAT_JSON or FORMAT_JSON_COMPACT
+ * @param sink The sink
+ * @param arg The sink argument
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_writer_init(struct json_writer* writer, int32_t format, json_sink_cb sink, void* arg);
+
+/**
+ * Start an object
+ * @param writer The writer
+ * @param key The key, or NULL in an array or at the top
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_writer_begin_object(struct json_writer* writer, char* key);
+
+/**
+ * End an object
+ * @param writer The writer
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_writer_end_object(struct json_writer* writer);
+
+/**
+ * Start an array
+ * @param writer The writer
+ * @param key The key, or NULL in an array or at the top
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_writer_begin_array(struct json_writer* writer, char* key);
+
+/**
+ * End an array
+ * @param writer The writer
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_writer_end_array(struct json_writer* writer);
+
+/**
+ * Write a value
+ * @param writer The writer
+ * @param key The key, or NULL in an array
+ * @param data The value data
+ * @param type The value type
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_writer_value(struct json_writer* writer, char* key, uintptr_t data, enum value_type type);
+
+/**
+ * Write a json object
+ * @param writer The writer
+ * @param key The key, or NULL in an array or at the top
+ * @param object The json object
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_writer_json(struct json_writer* writer, char* key, struct json* object);
+
+/**
+ * Hand the buffered output to the sink
+ * @param writer The writer
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_writer_flush(struct json_writer* writer);
+
+/**
+ * A sink appending to a string builder
+ * @param arg The struct builder
+ * @param data The data
+ * @param length The length of the data
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_sink_builder(void* arg, char* data, size_t length);
+
+/**
+ * A sink writing to a file
+ * @param arg The FILE
+ * @param data The data
+ * @param length The length of the data
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_sink_file(void* arg, char* data, size_t length);
+
+/**
+ * A sink writing to a socket
+ * @param arg The struct json_socket
+ * @param data The data
+ * @param length The length of the data
+ * @return 0 if success, 1 if otherwise
+ */
+int
+pgexporter_json_sink_socket(void* arg, char* data, size_t length);
+
 #ifdef __cplusplus
 }
 #endif
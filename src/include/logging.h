@@ -85,6 +85,20 @@ pgexporter_start_logging(void);
 int
 pgexporter_stop_logging(void);
 
+/**
+ * Start the log writer. Each process then writes its lines into a ring
+ * in shared memory, and a thread of the calling process writes them out
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_start_log_writer(void);
+
+/**
+ * Stop the log writer, after it has written the remaining lines
+ */
+void
+pgexporter_stop_log_writer(void);
+
 /**
  * Log a line
  * @param level The level
@@ -69,6 +69,7 @@ extern "C" {
 #define MANAGEMENT_CONF_LS             8
 #define MANAGEMENT_CONF_GET            9
 #define MANAGEMENT_CONF_SET            10
+#define MANAGEMENT_TRACE               16
 
 #define MANAGEMENT_MASTER_KEY          11
 #define MANAGEMENT_ADD_USER            12
@@ -88,24 +89,40 @@ extern "C" {
  * Management arguments
  */
 #define MANAGEMENT_ARGUMENT_ACTIVE                "Active"
+#define MANAGEMENT_ARGUMENT_ALLOCATED     "Allocated"
+#define MANAGEMENT_ARGUMENT_ALLOCATIONS   "Allocations"
+#define MANAGEMENT_ARGUMENT_BYTES         "Bytes"
 #define MANAGEMENT_ARGUMENT_CLIENT_VERSION        "ClientVersion"
 #define MANAGEMENT_ARGUMENT_COMMAND               "Command"
 #define MANAGEMENT_ARGUMENT_COMPRESSION           "Compression"
+#define MANAGEMENT_ARGUMENT_DROPPED               "Dropped"
+#define MANAGEMENT_ARGUMENT_DURATION              "Duration"
 #define MANAGEMENT_ARGUMENT_CONFIG_KEY            "ConfigKey"
 #define MANAGEMENT_ARGUMENT_CONFIG_VALUE          "ConfigValue"
 #define MANAGEMENT_ARGUMENT_ENCRYPTION            "Encryption"
 #define MANAGEMENT_ARGUMENT_ERROR                 "Error"
+#define MANAGEMENT_ARGUMENT_KIND                  "Kind"
 #define MANAGEMENT_ARGUMENT_MAJOR_VERSION         "MajorVersion"
+#define MANAGEMENT_ARGUMENT_MEMORY        "Memory"
 #define MANAGEMENT_ARGUMENT_MINOR_VERSION         "MinorVersion"
+#define MANAGEMENT_ARGUMENT_NAME                  "Name"
 #define MANAGEMENT_ARGUMENT_NUMBER_OF_SERVERS     "NumberOfServers"
+#define MANAGEMENT_ARGUMENT_OBJECTS       "Objects"
 #define MANAGEMENT_ARGUMENT_OUTPUT                "Output"
+#define MANAGEMENT_ARGUMENT_PEAK          "Peak"
+#define MANAGEMENT_ARGUMENT_PID                   "Pid"
 #define MANAGEMENT_ARGUMENT_RESTART               "Restart"
 #define MANAGEMENT_ARGUMENT_SERVER                "Server"
 #define MANAGEMENT_ARGUMENT_SERVERS               "Servers"
 #define MANAGEMENT_ARGUMENT_SERVER_VERSION        "ServerVersion"
+#define MANAGEMENT_ARGUMENT_SPANS                 "Spans"
+#define MANAGEMENT_ARGUMENT_START                 "Start"
 #define MANAGEMENT_ARGUMENT_STATUS                "Status"
+#define MANAGEMENT_ARGUMENT_SUBSYSTEM     "Subsystem"
+#define MANAGEMENT_ARGUMENT_THREAD                "Thread"
 #define MANAGEMENT_ARGUMENT_TIME                  "Time"
 #define MANAGEMENT_ARGUMENT_TIMESTAMP             "Timestamp"
+#define MANAGEMENT_ARGUMENT_TRACES                "Traces"
 
 /**
  * Management error
@@ -141,6 +158,8 @@ extern "C" {
 #define MANAGEMENT_ERROR_CONF_SET_NETWORK                   1106
 #define MANAGEMENT_ERROR_CONF_SET_ERROR                     1107
 
+#define MANAGEMENT_ERROR_TRACE_NETWORK 1200
+
 /**
  * Output formats
  */
@@ -226,6 +245,18 @@ pgexporter_management_request_status(SSL* ssl, int socket, uint8_t compression,
 int
 pgexporter_management_request_details(SSL* ssl, int socket, uint8_t compression, uint8_t encryption, int32_t output_format);
 
+/**
+ * Management operation: Trace
+ * @param ssl The SSL connection
+ * @param socket The socket
+ * @param compression The compress method for wire protocol
+ * @param encryption The encrypt method for wire protocol
+ * @param output_format The output format
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_management_request_trace(SSL* ssl, int socket, uint8_t compression, uint8_t encryption, int32_t output_format);
+
 /**
  * Management operation: Ping
  * @param socket The socket
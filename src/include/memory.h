@@ -35,10 +35,22 @@ extern "C" {
 
 #include <pgexporter.h>
 
+#include <stdint.h>
 #include <stdlib.h>
 
+#define MEMORY_ART   0
+#define MEMORY_DEQUE 1
+#define MEMORY_JSON  2
+#define MEMORY_QUERY 3
+#define MEMORY_HTTP  4
+#define MEMORY_CACHE 5
+#define MEMORY_ARENA 6
+#define NUMBER_OF_MEMORY_SUBSYSTEMS 7
+
 /**
- * Initialize a memory segment for the process local message structure
+ * Initialize a memory segment for the process local message structure.
+ * The segment is thread local, so each thread doing network I/O must
+ * call this function before use, and pgexporter_memory_destroy() at exit
  */
 void
 pgexporter_memory_init(void);
@@ -89,6 +101,70 @@ pgexporter_memory_dynamic_append(void* orig, size_t orig_size, void* append, siz
 void
 pgexporter_memory_dynamic_destroy(void* data);
 
+/**
+ * Allocate memory for a subsystem. The accounting is only done when
+ * memory_accounting is enabled, and the memory can be freed with free()
+ * when it isn't accounted
+ * @param subsystem The subsystem
+ * @param size The size
+ * @return The memory, or NULL
+ */
+void*
+pgexporter_memory_alloc(int subsystem, size_t size);
+
+/**
+ * Allocate zeroed memory for a subsystem
+ * @param subsystem The subsystem
+ * @param number The number of elements
+ * @param size The size of an element
+ * @return The memory, or NULL
+ */
+void*
+pgexporter_memory_calloc(int subsystem, size_t number, size_t size);
+
+/**
+ * Reallocate memory of a subsystem
+ * @param subsystem The subsystem
+ * @param ptr The memory, or NULL
+ * @param size The new size
+ * @return The memory, or NULL in which case ptr is still valid
+ */
+void*
+pgexporter_memory_realloc(int subsystem, void* ptr, size_t size);
+
+/**
+ * Allocate aligned memory for a subsystem
+ * @param subsystem The subsystem
+ * @param alignment The alignment
+ * @param size The size, a multiple of the alignment
+ * @return The memory, or NULL
+ */
+void*
+pgexporter_memory_aligned(int subsystem, size_t alignment, size_t size);
+
+/**
+ * Free memory of a subsystem
+ * @param subsystem The subsystem
+ * @param ptr The memory, or NULL
+ */
+void
+pgexporter_memory_release(int subsystem, void* ptr);
+
+/**
+ * Account memory of a subsystem that isn't allocated by the wrappers
+ * @param subsystem The subsystem
+ * @param bytes The change in bytes
+ * @param objects The change in objects
+ */
+void
+pgexporter_memory_account(int subsystem, int64_t bytes, int64_t objects);
+
+/**
+ * Flush the accounting of the thread to the shared memory
+ */
+void
+pgexporter_memory_flush(void);
+
 #ifdef __cplusplus
 }
 #endif
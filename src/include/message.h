@@ -75,6 +75,19 @@ pgexporter_read_block_message(SSL* ssl, int socket, struct message** msg);
 int
 pgexporter_read_timeout_message(SSL* ssl, int socket, int timeout, struct message** msg);
 
+/**
+ * Read in blocking mode directly into a buffer of the caller, such that
+ * the data doesn't have to be copied out of the message memory
+ * @param ssl The SSL struct
+ * @param socket The socket descriptor
+ * @param buffer The buffer
+ * @param size The size of the buffer
+ * @param length The number of bytes read
+ * @return One of MESSAGE_STATUS_ZERO, MESSAGE_STATUS_OK or MESSAGE_STATUS_ERROR
+ */
+int
+pgexporter_read_block_buffer(SSL* ssl, int socket, void* buffer, size_t size, size_t* length);
+
 /**
  * Write a message using a socket
  * @param ssl The SSL struct
@@ -85,6 +98,18 @@ pgexporter_read_timeout_message(SSL* ssl, int socket, int timeout, struct messag
 int
 pgexporter_write_message(SSL* ssl, int socket, struct message* msg);
 
+/**
+ * Write data as a HTTP chunk using a socket. The chunk is framed
+ * without copying the data into a new message
+ * @param ssl The SSL struct
+ * @param socket The socket descriptor
+ * @param data The data
+ * @param length The length of the data
+ * @return One of MESSAGE_STATUS_ZERO, MESSAGE_STATUS_OK or MESSAGE_STATUS_ERROR
+ */
+int
+pgexporter_write_chunk(SSL* ssl, int socket, char* data, size_t length);
+
 /**
  * Clear the current message
  */
@@ -269,6 +294,16 @@ pgexporter_create_ssl_message(struct message** msg);
 int
 pgexporter_create_startup_message(char* username, char* database, struct message** msg);
 
+/**
+ * Create a cancel request message
+ * @param pid The process id of the backend
+ * @param secret The secret key of the backend
+ * @param msg The resulting message
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_create_cancel_request_message(int pid, int secret, struct message** msg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -77,6 +77,17 @@ pgexporter_remove_unix_socket(const char* directory, const char* file);
 int
 pgexporter_connect(const char* hostname, int port, int* fd);
 
+/**
+ * Connect to a host with a timeout
+ * @param hostname The host name
+ * @param port The port number
+ * @param timeout The number of seconds to wait for the connection, or 0 to wait forever
+ * @param fd The resulting descriptor
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_connect_timeout(const char* hostname, int port, int timeout, int* fd);
+
 /**
  * Connect to a Unix Domain Socket
  * @param directory The directory
@@ -95,6 +106,16 @@ pgexporter_connect_unix_socket(const char* directory, const char* file, int* fd)
 bool
 pgexporter_socket_isvalid(int fd);
 
+/**
+ * Is an idle connection still open, without a round trip. The socket is
+ * polled for an error, a hang up or unexpected data, such as the error
+ * sent before the server closes the connection
+ * @param fd The descriptor
+ * @return True if the connection is open, otherwise false
+ */
+bool
+pgexporter_socket_alive(int fd);
+
 /**
  * Disconnect from a descriptor
  * @param fd The descriptor
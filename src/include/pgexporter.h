@@ -40,6 +40,7 @@ extern "C" {
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <time.h>
 #include <openssl/ssl.h>
@@ -55,6 +56,12 @@ extern "C" {
 
 #define MAX_NUMBER_OF_COLUMNS 32
 
+#define MAX_PARALLEL_QUERIES 8
+
+#define MAX_DATABASE_CONNECTIONS     32
+#define DEFAULT_DATABASE_CONNECTIONS  4
+#define MAX_DATABASE_PARALLEL        64
+
 #define MAX_PROCESS_TITLE_LENGTH 256
 
 #define DEFAULT_BUFFER_SIZE 131072
@@ -67,10 +74,14 @@ extern "C" {
 #define NUMBER_OF_SERVERS      64
 #define NUMBER_OF_USERS        64
 #define NUMBER_OF_ADMINS        8
-#define NUMBER_OF_METRICS     256
 #define NUMBER_OF_COLLECTORS  256
+#define NUMBER_OF_WORKERS      64
 #define NUMBER_OF_ENDPOINTS    32
+#define NUMBER_OF_MEMBERS      16
+#define MAX_BRIDGE_RULES       16
+#define MAX_BRIDGE_RULE_LABELS  8
 #define NUMBER_OF_EXTENSIONS   64
+#define NUMBER_OF_CACHE_READERS 128
 
 #define STATE_FREE        0
 #define STATE_IN_USE      1
@@ -84,13 +95,26 @@ extern "C" {
 #define AUTH_ERROR        2
 #define AUTH_TIMEOUT      3
 
+#define CACHE_ENCODING_IDENTITY 0
+#define CACHE_ENCODING_GZIP     1
+#define CACHE_ENCODING_ZSTD     2
+#define NUMBER_OF_ENCODINGS     3
+
 #define HUGEPAGE_OFF 0
 #define HUGEPAGE_TRY 1
 #define HUGEPAGE_ON  2
 
-#define MAX_QUERY_LENGTH      2048
+#define NUMA_OFF        -1
+#define NUMA_INTERLEAVE -2
+
 #define MAX_COLLECTOR_LENGTH  1024
 
+#define SCRAM_KEY_LENGTH       32
+#define MAX_SCRAM_SALT_LENGTH  64
+
+#define TLS_TICKET_KEYS_LENGTH   80
+#define MAX_TLS_SESSION_LENGTH 4096
+
 #define LABEL_TYPE      0
 #define COUNTER_TYPE    1
 #define GAUGE_TYPE      2
@@ -99,9 +123,16 @@ extern "C" {
 #define SORT_NAME  0
 #define SORT_DATA0 1
 
+#define BRIDGE_AGGREGATE_SUM   0
+#define BRIDGE_AGGREGATE_MIN   1
+#define BRIDGE_AGGREGATE_MAX   2
+#define BRIDGE_AGGREGATE_AVG   3
+#define BRIDGE_AGGREGATE_COUNT 4
+
 #define SERVER_QUERY_BOTH    0  /* Default */
 #define SERVER_QUERY_PRIMARY 1
 #define SERVER_QUERY_REPLICA 2
+#define SERVER_QUERY_ANY_REPLICA 3
 
 #define SERVER_UNDERTERMINED_VERSION 0
 
@@ -202,18 +233,58 @@ extern void* shmem;
  */
 extern void* prometheus_cache_shmem;
 
+/**
+ * Shared memory used to contain the Prometheus
+ * snapshot published by the collector.
+ */
+extern void* prometheus_snapshot_shmem;
+
 /**
  * Shared memory used to contain the bridge
  * response cache.
  */
 extern void* bridge_cache_shmem;
 
+/**
+ * Shared memory used to contain the bridge
+ * snapshot published by the refresher.
+ */
+extern void* bridge_snapshot_shmem;
+
 /**
  * Shared memory used to contain the bridge JSON
  * response cache.
  */
 extern void* bridge_json_cache_shmem;
 
+/**
+ * Shared memory used to contain the statistics
+ * of pgexporter itself.
+ */
+extern void* stats_shmem;
+
+/**
+ * Shared memory used to contain the last
+ * scrape traces.
+ */
+extern void* trace_shmem;
+
+/**
+ * Shared memory used to contain the log rings
+ * drained by the log writer.
+ */
+extern void* log_shmem;
+
+/** @struct prepared_statement
+ * Defines the prepared statement of a metric on a server connection
+ */
+struct prepared_statement
+{
+   int version;           /**< The version of the prepared query, or -1 */
+   int number_of_columns; /**< The number of result columns */
+   uint32_t binary;       /**< The result columns that can be sent in the binary format */
+};
+
 /** @struct extension_info
  * Defines information about a PostgreSQL extension
  */
@@ -237,18 +308,62 @@ struct server
    char username[MAX_USERNAME_LENGTH];                          /**< The user name */
    char data[MISC_LENGTH];                                      /**< The data directory */
    char wal[MISC_LENGTH];                                       /**< The WAL directory */
-   SSL* ssl;                                                    /**< The SSL structure */
-   int fd;                                                      /**< The socket descriptor */
-   bool new;                                                    /**< Is the connection new */
-   bool extension;                                              /**< Is the pgexporter_ext extension installed */
-   int state;                                                   /**< The state of the server */
-   int version;                                                 /**< The major version of the server*/
-   int minor_version;                                           /**< The minor version of the server*/
    int number_of_extensions;                                    /**< The number of extensions */
+   int backend_pid;                                             /**< The process id of the backend of the connection lent by the main process */
+   int backend_secret;                                          /**< The secret key of the backend of the connection lent by the main process */
    char tls_cert_file[MAX_PATH];                                /**< TLS certificate path */
    char tls_key_file[MAX_PATH];                                 /**< TLS key path */
    char tls_ca_file[MAX_PATH];                                  /**< TLS CA certificate path */
+   int max_parallel_queries;                                    /**< The number of connections the custom metrics are queried on */
+   int database_connections;                                    /**< The number of connections kept to the databases of the per-database metrics */
    struct extension_info extensions[NUMBER_OF_EXTENSIONS];      /**< The extensions */
+   unsigned int prepared_generation;                            /**< The metrics generation of the prepared statements of the connection lent by the main process */
+} __attribute__ ((aligned (64)));
+
+/** @struct server_state
+ * Defines the connection state of a server. The collectors check it for
+ * each metric and server, so the states are kept in an array of their own
+ * that spans a few cache lines, away from the rest of the server
+ */
+struct server_state
+{
+   int state;           /**< The state of the server */
+   int version;         /**< The major version of the server*/
+   int minor_version;   /**< The minor version of the server*/
+   time_t role_checked; /**< When the state was checked, or 0 to check it again */
+   atomic_int lease;    /**< The process the connection is lent to, or 0 */
+   bool new;            /**< Is the connection new */
+   bool connected;      /**< Is there a connection to the server */
+   bool extension;      /**< Is the pgexporter_ext extension installed */
+};
+
+/** @struct scram_keys
+ * Defines the SCRAM-SHA-256 keys of the user of a server. The keys only depend
+ * on the password, the salt and the iterations, so an authentication with the
+ * same salt doesn't compute the salted password again
+ */
+struct scram_keys
+{
+   atomic_schar lock;                           /**< Is the entry being read or written */
+   bool valid;                                  /**< Are the keys set */
+   char username[MAX_USERNAME_LENGTH];          /**< The user name */
+   unsigned char password[SCRAM_KEY_LENGTH];    /**< The SHA-256 of the password */
+   unsigned char salt[MAX_SCRAM_SALT_LENGTH];   /**< The salt */
+   int salt_length;                             /**< The length of the salt */
+   int iterations;                              /**< The iterations */
+   unsigned char client_key[SCRAM_KEY_LENGTH];  /**< The ClientKey */
+   unsigned char server_key[SCRAM_KEY_LENGTH];  /**< The ServerKey */
+} __attribute__ ((aligned (64)));
+
+/** @struct tls_session
+ * Defines the last TLS session with a server, in DER, such that the next
+ * connection of any process can resume it
+ */
+struct tls_session
+{
+   atomic_schar lock;                          /**< Is the session being read or written */
+   int length;                                 /**< The length of the session, or 0 */
+   unsigned char data[MAX_TLS_SESSION_LENGTH]; /**< The session */
 } __attribute__ ((aligned (64)));
 
 /** @struct user
@@ -266,20 +381,55 @@ struct user
  * response over and over depending on the cache
  * settings.
  *
+ * The cache has two slots of `size` bytes. The `active`
+ * slot holds the last complete payload, and is -1 when
+ * there is none. A rebuild takes the `lock`, fills the other
+ * slot and then switches `active` over, so readers never wait
+ * for a rebuild. A reader registers its process id in `readers`
+ * of the slot while copying it, and a slot isn't reused until its
+ * readers are done, or have exited.
+ *
  * The `valid_until` field stores the result
  * of `time(2)`.
  *
- * The cache is protected by the `lock` field.
+ * The cache is backed by `fd` where available, so a
+ * payload can be sent with `sendfile(2)`.
+ *
+ * A slot holds the plain payload followed by a compressed
+ * copy for each of the encodings `requested` by the clients,
+ * located by `offset` and `encoded`.
  *
- * The `size` field stores the size of the allocated
- * `data` payload.
+ * A rebuild that doesn't fit is counted in `overflows`, and
+ * its length, `built` so far, kept in `wanted`, such that the
+ * main process can replace the cache by a larger one.
+ *
+ * The slot being rebuilt is `building` while its plain payload
+ * is written, and `progress` bytes of it are complete. A client
+ * arriving during the rebuild follows the slot, and is sent the
+ * payload as it is produced, counted in `coalesced`.
  */
 struct prometheus_cache
 {
-   time_t valid_until;   /**< when the cache will become not valid */
-   atomic_schar lock;    /**< lock to protect the cache */
-   size_t size;          /**< size of the cache */
-   char data[];          /**< the payload */
+   atomic_schar lock;          /**< lock held by the rebuild */
+   atomic_int active;          /**< the slot being served */
+   atomic_int readers[2][NUMBER_OF_CACHE_READERS]; /**< the processes reading each slot, 0 if free */
+   atomic_ulong generation;    /**< the number of payloads published */
+   time_t valid_until[2];      /**< when each slot will become not valid */
+   size_t length[2];           /**< the length of each slot */
+   size_t offset[2][NUMBER_OF_ENCODINGS];  /**< the offset of each encoding in a slot */
+   size_t encoded[2][NUMBER_OF_ENCODINGS]; /**< the length of each encoding, 0 if missing */
+   atomic_bool requested[NUMBER_OF_ENCODINGS]; /**< the encodings asked for by the clients */
+   atomic_ulong overflows;     /**< the number of rebuilds that didn't fit */
+   atomic_size_t wanted;       /**< the largest rebuild that didn't fit */
+   atomic_int building;        /**< the slot being rebuilt, or -1 */
+   atomic_size_t progress;     /**< the bytes of the rebuilt slot written so far */
+   atomic_ulong coalesced;     /**< the number of clients that followed a rebuild */
+   int slot;                   /**< the slot being rebuilt */
+   size_t built;               /**< the length of the rebuild, which may not fit in the slot */
+   bool discard;               /**< the rebuild won't be served */
+   size_t size;                /**< size of a slot */
+   int fd;                     /**< the memfd of the cache, or -1 */
+   char data[];                /**< the payload of both slots */
 } __attribute__ ((aligned (64)));
 
 /** @struct column
@@ -287,10 +437,28 @@ struct prometheus_cache
  */
 struct column
 {
-   int type;                        /**< Metrics type 0--label 1--counter 2--gauge 3--histogram*/
-   char name[MISC_LENGTH];          /**< Column name */
-   char description[MISC_LENGTH];   /**< Description of column */
-} __attribute__ ((aligned (64)));
+   int type;           /**< Metrics type 0--label 1--counter 2--gauge 3--histogram*/
+   size_t name;        /**< Column name, an offset in the catalog pool */
+   size_t description; /**< Description of column, an offset in the catalog pool */
+};
+
+/** @struct metric_template
+ * The samples of a query alternative, compiled when the metrics are
+ * published. The names of the samples and of the labels are fixed by the
+ * definition, so a sample is built by copying them, and only the values
+ * of the label columns are escaped
+ */
+struct metric_template
+{
+   int number_of_labels;                         /**< The number of label columns */
+   int number_of_values;                         /**< The number of value columns */
+   int labels[MAX_NUMBER_OF_COLUMNS];            /**< The label columns */
+   int values[MAX_NUMBER_OF_COLUMNS];            /**< The value columns */
+   size_t label_names[MAX_NUMBER_OF_COLUMNS];    /**< The name=" of each label, an offset in the catalog pool */
+   size_t label_lengths[MAX_NUMBER_OF_COLUMNS];  /**< The length of the name=" of each label */
+   size_t prefixes[MAX_NUMBER_OF_COLUMNS];       /**< The name{ of each value, an offset in the catalog pool */
+   size_t prefix_lengths[MAX_NUMBER_OF_COLUMNS]; /**< The length of the name{ of each value */
+};
 
 /**
  * @struct query_alts
@@ -305,21 +473,24 @@ struct column
  * A query alternative node with version 'v' is chosen to provide the query if
  * the requesting server with version 'u' if 'u' >= 'v' and there doesn't exist
  * another node in the same AVL tree with a version 'w' where 'u' >= 'w'.
+ *
+ * The nodes live in the catalog pool, and refer to each other by offset.
  */
 struct query_alts
 {
-   char version;                                   /**< Minimum required version to run query */
-   char query[MAX_QUERY_LENGTH];                   /**< Query String */
-   struct column columns[MAX_NUMBER_OF_COLUMNS];   /**< Columns of query */
-   int n_columns;                                  /**< No. of columns */
-   bool is_histogram;                              /**< Is the query for a histogram metric */
+   char version;      /**< Minimum required version to run query */
+   size_t query;      /**< Query String, an offset in the catalog pool */
+   size_t columns;    /**< Columns of query, an offset in the catalog pool */
+   size_t names;      /**< The column names, an offset of their pointers in the catalog pool */
+   int n_columns;     /**< No. of columns */
+   bool is_histogram; /**< Is the query for a histogram metric */
+   size_t sample;     /**< The template of the samples, an offset in the catalog pool, 0 if none */
 
    /* AVL Tree */
-   unsigned int height;       /**< Node's height, 1 if leaf, 0 if NULL */
-   struct query_alts* left;   /**< Left child node */
-   struct query_alts* right;  /**< Right child node */
-
-} __attribute__ ((aligned (64)));
+   unsigned int height; /**< Node's height, 1 if leaf, 0 if NULL */
+   size_t left;         /**< Left child node, 0 if none */
+   size_t right;        /**< Right child node, 0 if none */
+};
 
 /** @struct prometheus
  * Defines the Prometheus metrics
@@ -328,9 +499,17 @@ struct prometheus
 {
    char tag[MISC_LENGTH];                          /**< The metric name */
    int sort_type;                                  /**< Sorting type of multi queries 0--SORT_NAME 1--SORT_DATA0 */
-   int server_query_type;                          /**< Query type 0--SERVER_QUERY_BOTH 1--SERVER_QUERY_PRIMARY 2--SERVER_QUERY_REPLICA */
-   char collector[MAX_COLLECTOR_LENGTH];           /**< Collector Tag for query */
-   struct query_alts* root;                        /**< Root of the Query Alternatives' AVL Tree */
+   int server_query_type;                          /**< Query type 0--SERVER_QUERY_BOTH 1--SERVER_QUERY_PRIMARY 2--SERVER_QUERY_REPLICA 3--SERVER_QUERY_ANY_REPLICA */
+   int interval;                                   /**< Collection interval in seconds, 0 uses collection_interval */
+   int refresh_interval;                           /**< Collection interval in seconds while the result doesn't change, 0 for interval */
+   int timeout;                                    /**< Query timeout in seconds, 0 uses query_timeout */
+   int max_series;                                 /**< Maximum number of series per server, 0 for no limit */
+   int top_k;                                      /**< Keep only the series with the largest values, 0 for all */
+   bool other;                                     /**< Report the sum of the series left out */
+   bool incremental;                               /**< Render only the rows whose values changed, in the background collector */
+   size_t collector;                               /**< Collector Tag for query, an offset in the catalog pool */
+   size_t databases;                               /**< The databases, "*" or a comma separated list, an offset in the catalog pool, 0 for the postgres database */
+   size_t root;                                    /**< Root of the Query Alternatives' AVL Tree, 0 if none */
 } __attribute__ ((aligned (64)));
 
 /** @struct endpoint
@@ -340,8 +519,34 @@ struct endpoint
 {
    char host[MISC_LENGTH]; /**< The host */
    int port;               /**< The port */
+   atomic_schar lease;     /**< Is the pooled connection lent to a process */
 } __attribute__((aligned(64)));
 
+/** @struct cluster_member
+ * Defines an instance of pgexporter sharing the servers of a cluster
+ */
+struct cluster_member
+{
+   char host[MISC_LENGTH]; /**< The host */
+   int port;               /**< The metrics port */
+   int endpoint;           /**< The bridge endpoint of the member, or -1 */
+   atomic_bool alive;      /**< Is the member alive */
+   atomic_llong seen;      /**< The time of the last heartbeat the member answered */
+} __attribute__((aligned(64)));
+
+/** @struct bridge_rule
+ * Defines an aggregation of the samples of a bridge metric, by or without some of their labels
+ */
+struct bridge_rule
+{
+   char metric[MISC_LENGTH];                         /**< The name of the metric, or the prefix of the names */
+   bool prefix;                                      /**< Is the name a prefix */
+   int aggregation;                                  /**< The aggregation, one of BRIDGE_AGGREGATE_* */
+   bool without;                                     /**< Are the labels removed, or else the only ones kept */
+   int number_of_labels;                             /**< The number of labels */
+   char labels[MAX_BRIDGE_RULE_LABELS][MISC_LENGTH]; /**< The labels */
+};
+
 /** @struct configuration
  * Defines the configuration and state of pgexporter
  */
@@ -355,13 +560,41 @@ struct configuration
    int metrics;                   /**< The metrics port */
    int metrics_cache_max_age;     /**< Number of seconds to cache the Prometheus response */
    size_t metrics_cache_max_size; /**< Number of bytes max to cache the Prometheus response */
+   int metrics_parallel;          /**< Number of servers queried concurrently for custom metrics */
+   int database_parallel;         /**< Number of databases queried concurrently for per-database metrics, over all servers */
+   int role_interval;             /**< Number of seconds the role of a server is kept before it is checked again */
+   bool metrics_pipeline;         /**< Pipeline the custom metric queries of a server */
+   bool metrics_binary;           /**< Receive the numeric columns of the custom metrics in binary */
+   bool metrics_self;             /**< Include the self-instrumentation metrics */
+   bool memory_accounting;        /**< Account the memory of the subsystems */
+   bool metrics_negotiation;      /**< Select the format of a scrape from its Accept header */
+   int query_timeout;             /**< Number of seconds before a query is canceled */
+   unsigned int metrics_generation; /**< The generation of the metrics, changed by a reload */
+   int collection_interval;       /**< Number of seconds between background collections */
+   char remote_write[MAX_PATH];   /**< The URL of the remote write receiver */
+   int remote_write_batch;        /**< The maximum number of samples in a remote write request */
+   int remote_write_queue;        /**< The maximum number of remote write requests waiting to be sent */
+   int remote_write_timeout;      /**< Number of seconds to wait for the remote write receiver */
    int management;                /**< The management port */
 
    int bridge;                        /**< The bridge port */
    int bridge_cache_max_age;          /**< Number of seconds to cache the bridge response */
    size_t bridge_cache_max_size;      /**< Number of bytes max to cache the bridge response */
+   int bridge_parallel;               /**< Number of bridge endpoints fetched concurrently */
+   int bridge_timeout;                /**< Number of seconds to wait for a bridge endpoint */
+   bool bridge_keep_alive;            /**< Keep the connections to the bridge endpoints open */
+   int bridge_interval;               /**< Number of seconds between background refreshes of the bridge */
    int bridge_json;                   /**< The bridge port */
    size_t bridge_json_cache_max_size; /**< Number of bytes max to cache the bridge response */
+   char bridge_aggregate[MAX_PATH];   /**< The aggregation rules of the bridge metrics */
+   int number_of_bridge_rules;        /**< The number of aggregation rules */
+
+   char cluster[MAX_PATH];          /**< The members of the cluster, as host:port of their metrics port */
+   char cluster_self[MISC_LENGTH];  /**< The member of this instance, as host:port */
+   int cluster_interval;            /**< Number of seconds between the heartbeats to the members */
+   int cluster_timeout;             /**< Number of seconds without a heartbeat before a member is down */
+   bool cluster_federate;           /**< Serve the metrics of all the members from the bridge */
+   int cluster_member;              /**< The member of this instance, or -1 without a cluster */
 
    bool cache;  /**< Cache connection */
 
@@ -372,6 +605,7 @@ struct configuration
    size_t log_rotation_size;          /**< bytes to force log rotation */
    int log_rotation_age;              /**< minutes for log rotation */
    char log_line_prefix[MISC_LENGTH]; /**< The logging prefix */
+   bool log_async;                    /**< Write the log lines from a log writer thread */
    atomic_schar log_lock;             /**< The logging lock */
 
    bool tls;                     /**< Is TLS enabled */
@@ -394,7 +628,10 @@ struct configuration
    bool nodelay;            /**< Use NODELAY */
    bool non_blocking;       /**< Use non blocking */
    int backlog;             /**< The backlog for listen */
+   int workers;             /**< The number of pre-forked workers */
    unsigned char hugepage;  /**< Huge page support */
+   int numa;                /**< The NUMA placement of the shared memory, a node or NUMA_OFF / NUMA_INTERLEAVE */
+   int traces;              /**< The number of scrape traces kept, 0 disables tracing */
 
    char unix_socket_dir[MISC_LENGTH]; /**< The directory for the Unix Domain Socket */
 
@@ -404,8 +641,10 @@ struct configuration
    int number_of_metrics;        /**< The number of metrics*/
    int number_of_collectors;     /**< Number of total collectors */
    int number_of_endpoints;      /**< The number of endpoints */
+   int number_of_members;        /**< The number of members of the cluster */
 
    char metrics_path[MAX_PATH]; /**< The metrics path */
+   char metrics_definitions_cache[MAX_PATH]; /**< The file caching the compiled metric definitions */
 
    atomic_ulong logging_info;  /**< Logging: INFO */
    atomic_ulong logging_warn;  /**< Logging: WARN */
@@ -413,11 +652,18 @@ struct configuration
    atomic_ulong logging_fatal; /**< Logging: FATAL */
 
    char collectors[NUMBER_OF_COLLECTORS][MAX_COLLECTOR_LENGTH]; /**< List of collectors in total */
+   struct server_state server_states[NUMBER_OF_SERVERS];        /**< The connection state of the servers */
    struct server servers[NUMBER_OF_SERVERS];                    /**< The servers */
+   struct scram_keys scram_keys[NUMBER_OF_SERVERS];             /**< The SCRAM-SHA-256 keys of the servers */
+   struct tls_session tls_sessions[NUMBER_OF_SERVERS];          /**< The TLS sessions with the servers */
+   unsigned char tls_ticket_keys[TLS_TICKET_KEYS_LENGTH];       /**< The keys of the TLS session tickets of pgexporter */
    struct user users[NUMBER_OF_USERS];                          /**< The users */
    struct user admins[NUMBER_OF_ADMINS];                        /**< The admins */
-   struct prometheus prometheus[NUMBER_OF_METRICS];             /**< The Prometheus metrics */
+   struct catalog* catalog;                                     /**< The Prometheus metrics */
+   struct catalog_builder* catalog_builder;                     /**< The Prometheus metrics being loaded */
    struct endpoint endpoints[NUMBER_OF_ENDPOINTS];              /**< The Prometheus metrics */
+   struct bridge_rule bridge_rules[MAX_BRIDGE_RULES];           /**< The aggregation rules of the bridge metrics */
+   struct cluster_member members[NUMBER_OF_MEMBERS];            /**< The members of the cluster */
 } __attribute__((aligned(64)));
 
 #ifdef __cplusplus
@@ -58,6 +58,12 @@ extern "C" {
  */
 #define PROMETHEUS_DEFAULT_CACHE_SIZE (256 * 1024)
 
+/**
+ * Max size the cache (in bytes) can grow to
+ * when a response doesn't fit in it.
+ */
+#define PROMETHEUS_MAX_GROWN_CACHE_SIZE (64 * 1024 * 1024)
+
 /**
  * Create a prometheus instance
  * @param client_ssl The client SSL structure
@@ -66,6 +72,16 @@ extern "C" {
 void
 pgexporter_prometheus(SSL* client_ssl, int fd);
 
+/**
+ * Serve a single request to the prometheus instance.
+ * The caller owns the logging, the memory segment and the client descriptor
+ * @param client_ssl The client SSL structure
+ * @param fd The client descriptor
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_prometheus_serve(SSL* client_ssl, int fd);
+
 /**
  * Reset the counters and histograms
  */
@@ -103,6 +119,38 @@ pgexporter_prometheus_logging(int logging);
 int
 pgexporter_init_prometheus_cache(size_t* p_size, void** p_shmem);
 
+/**
+ * Allocates the Prometheus snapshot used by the background collector.
+ *
+ * Each of the two slots gets the size of the Prometheus cache.
+ *
+ * @param p_size a pointer to where to store the size of
+ * allocated chunk of memory
+ * @param p_shmem the pointer to the pointer at which the allocated chunk
+ * of shared memory is going to be inserted
+ *
+ * @return 0 on success
+ */
+int
+pgexporter_init_prometheus_snapshot(size_t* p_size, void** p_shmem);
+
+/**
+ * Run the metrics that are due and publish them in the Prometheus snapshot.
+ *
+ * The collected values are kept by the calling process between the
+ * invocations, so metrics with a longer interval keep their last values.
+ *
+ * @return The number of seconds until the next metric is due
+ */
+int
+pgexporter_prometheus_collect(void);
+
+/**
+ * Release the state kept by the background collector
+ */
+void
+pgexporter_prometheus_collect_destroy(void);
+
 #ifdef __cplusplus
 }
 #endif
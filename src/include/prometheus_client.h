@@ -34,41 +34,69 @@ extern "C" {
 #endif
 
 #include <pgexporter.h>
+#include <arena.h>
 #include <art.h>
+#include <filter.h>
 #include <http.h>
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 /**
- * @struct prometheus_bridge
- * Prometheus metrics from multiple endpoints
+ * @struct prometheus_intern
+ * An interned entry
  */
-struct prometheus_bridge
+struct prometheus_intern
 {
-   struct art* metrics; /**< prometheus_metric::name -> ValueRef<prometheus_metric> */
+   uint64_t hash;  /**< The hash of the data */
+   size_t length;  /**< The length of the data */
+   void* data;     /**< The data, in the arena of the bridge */
 };
 
 /**
- * @struct prometheus_metric
- * Description
+ * @struct prometheus_intern_table
+ * The interned entries, by open addressing
  */
-struct prometheus_metric
+struct prometheus_intern_table
 {
-   char* name;                /**< The name of the metric */
-   char* help;                /**< The HELP of the metric */
-   char* type;                /**< The TYPE of the metric */
-   struct deque* definitions; /**< The attributes of the metric - ValueRef<prometheus_attributes> */
+   struct prometheus_intern* entries; /**< The entries */
+   size_t size;                       /**< The number of entries */
+   size_t capacity;                   /**< The capacity, a power of 2 */
 };
 
 /**
- * @struct prometheus_attributes
- * The definition of the attributes for a metric
+ * @struct prometheus_bridge
+ * Prometheus metrics from an endpoint
  */
-struct prometheus_attributes
+struct prometheus_bridge
+{
+   struct art* metrics;                    /**< prometheus_metric::name -> ValueRef<prometheus_metric> */
+   struct arena* arena;                    /**< The memory of the metrics */
+   struct prometheus_intern_table strings; /**< The interned names, keys and label values */
+   struct prometheus_intern_table labels;  /**< The interned label sets */
+};
+
+/**
+ * @struct prometheus_metric
+ * Description
+ */
+struct prometheus_metric
 {
-   struct deque* attributes; /**< Each attribute - ValueRef<prometheus_attribute> */
-   struct deque* values;     /**< The values - ValueRef<prometheus_value> */
+   char* name;                                 /**< The name of the metric, interned */
+   char* help;                                 /**< The HELP of the metric */
+   char* type;                                 /**< The TYPE of the metric, interned */
+   int number_of_definitions;                  /**< The number of definitions */
+   size_t capacity;                            /**< The capacity of the definitions, a power of 2 */
+   struct prometheus_attributes** definitions; /**< The definitions by hash, by open addressing */
+   struct prometheus_attributes* first;        /**< The first definition */
+   struct prometheus_attributes* last;         /**< The last definition */
+   char* text;                                 /**< The rendered definitions, once rendered */
+   size_t length;                              /**< The length of the rendered definitions */
+   char* json;                                 /**< The definitions as JSON, once rendered */
+   size_t json_length;                         /**< The length of the definitions as JSON */
+   int rule;                                   /**< The aggregation rule of the metric, its index + 1, or 0 if none */
 };
 
 /**
@@ -77,8 +105,8 @@ struct prometheus_attributes
  */
 struct prometheus_attribute
 {
-   char* key;   /**< The key */
-   char* value; /**< The value */
+   char* key;   /**< The key, interned */
+   char* value; /**< The value, interned */
 };
 
 /**
@@ -91,6 +119,31 @@ struct prometheus_value
    char* value;      /**< The value */
 };
 
+/**
+ * @struct prometheus_attributes
+ * The definition of the attributes for a metric, where the attributes are sorted on their keys
+ */
+struct prometheus_attributes
+{
+   struct prometheus_attributes* next;      /**< The next definition of the metric */
+   uint64_t hash;                           /**< The hash of the name and the sorted label set */
+   char* name;                              /**< The name of the sample, interned */
+   int number_of_attributes;                /**< The number of attributes */
+   struct prometheus_attribute* attributes; /**< The attributes, an interned label set */
+   struct prometheus_value value;           /**< The latest value, or NULL when aggregated */
+   double aggregate;                        /**< The aggregated value of the samples, with an aggregation rule */
+   uint64_t count;                          /**< The number of samples aggregated, 0 if none */
+};
+
+/**
+ * The callback for the text of a metric
+ * @param data The text
+ * @param length The length of the text
+ * @param arg The argument of the callback
+ * @return 0 if success, otherwise 1
+ */
+typedef int (*prometheus_render_cb)(char* data, size_t length, void* arg);
+
 /**
  * Create the bridge
  * @param bridge The resulting bridge
@@ -109,13 +162,72 @@ pgexporter_prometheus_client_destroy_bridge(struct prometheus_bridge* bridge);
 
 /**
  * Get a response from a Prometheus endpoint and parse its metrics.
+ * Each endpoint has a bridge of its own, such that the endpoints can be
+ * fetched concurrently, and the connection is kept for the next request
+ * when bridge_keep_alive is set.
  * @param endpoint The prometheus endpoint
- * @param bridge The ART containing all bridge metrics.
+ * @param bridge The bridge of the endpoint
  * @return 0 if success, otherwise 1
  */
 int
 pgexporter_prometheus_client_get(int endpoint, struct prometheus_bridge* bridge);
 
+/**
+ * Parse the metrics of a response body of an endpoint, as they are parsed
+ * when they arrive from the endpoint. The data is modified
+ * @param endpoint The prometheus endpoint
+ * @param data The body, zero terminated
+ * @param length The length of the body
+ * @param bridge The bridge of the endpoint
+ * @return 0 if success, otherwise 1
+ */
+int
+pgexporter_prometheus_client_parse(int endpoint, char* data, size_t length, struct prometheus_bridge* bridge);
+
+/**
+ * Make this process the owner of its endpoint connections, such that
+ * the connections kept alive stay in the process
+ */
+void
+pgexporter_prometheus_client_pool_connections(void);
+
+/**
+ * Add an endpoint connection transferred to the main process to the pool,
+ * and release its lease
+ * @param endpoint The endpoint
+ * @param fd The descriptor
+ */
+void
+pgexporter_prometheus_client_pool_add(int endpoint, int fd);
+
+/**
+ * Close the pooled endpoint connections
+ */
+void
+pgexporter_prometheus_client_pool_destroy(void);
+
+/**
+ * Render the metrics of the endpoints in the text format and as JSON,
+ * one metric at a time, from a single walk of the metrics.
+ * A metric has the samples of all the endpoints, and the samples of an endpoint
+ * are rendered once for the lifetime of its bridge. The samples of a metric
+ * with an aggregation rule without the endpoint label are aggregated over
+ * the endpoints
+ * @param bridges The bridges of the endpoints, where a bridge may be NULL
+ * @param number_of_bridges The number of bridges
+ * @param text_callback The callback for the text of each metric, or NULL
+ * @param text_arg The argument of the text callback
+ * @param json_callback The callback for each part of the JSON document, or NULL
+ * @param json_arg The argument of the JSON callback
+ * @param filter The filter of the metrics, or NULL for all
+ * @return 0 if success, otherwise 1
+ */
+int
+pgexporter_prometheus_client_render(struct prometheus_bridge** bridges, int number_of_bridges,
+                                    prometheus_render_cb text_callback, void* text_arg,
+                                    prometheus_render_cb json_callback, void* json_arg,
+                                    struct metrics_filter* filter);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGEXPORTER_PROTOBUF_H
+#define PGEXPORTER_PROTOBUF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <utils.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define PROTOBUF_WIRE_VARINT 0
+#define PROTOBUF_WIRE_64BIT  1
+#define PROTOBUF_WIRE_LENGTH 2
+
+/**
+ * The size of a varint
+ * @param value The value
+ * @return The size in bytes
+ */
+size_t
+pgexporter_protobuf_varint_size(uint64_t value);
+
+/**
+ * Append a varint
+ * @param builder The builder
+ * @param value The value
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_protobuf_varint(struct builder* builder, uint64_t value);
+
+/**
+ * Append the tag of a field
+ * @param builder The builder
+ * @param field The number of the field
+ * @param wire The wire type
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_protobuf_tag(struct builder* builder, int field, int wire);
+
+/**
+ * Append a bytes or string field
+ * @param builder The builder
+ * @param field The number of the field
+ * @param data The data
+ * @param length The length of the data
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_protobuf_bytes(struct builder* builder, int field, char* data, size_t length);
+
+/**
+ * Append a varint field
+ * @param builder The builder
+ * @param field The number of the field
+ * @param value The value
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_protobuf_uint64(struct builder* builder, int field, uint64_t value);
+
+/**
+ * Append a double field
+ * @param builder The builder
+ * @param field The number of the field
+ * @param value The value
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_protobuf_double(struct builder* builder, int field, double value);
+
+/**
+ * Append a LabelPair field, with the name as field 1 and the value as field 2
+ * @param builder The builder
+ * @param field The number of the field
+ * @param name The name
+ * @param name_length The length of the name
+ * @param value The value, escaped as in the text format
+ * @param value_length The length of the escaped value
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_protobuf_label(struct builder* builder, int field, char* name, size_t name_length, char* value, size_t value_length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -34,9 +34,13 @@ extern "C" {
 #endif
 
 #include <pgexporter.h>
+#include <arena.h>
+#include <utils.h>
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 /** @struct tuple
  * Defines a tuple
@@ -48,6 +52,34 @@ struct tuple
    struct tuple* next;            /**< The next tuple */
 } __attribute__ ((aligned (64)));
 
+/** @struct columns
+ * Defines a query result stored by column. The values are kept zero terminated
+ * in one payload, and each column has the offsets of its values and a null bitmap
+ */
+struct columns
+{
+   int number_of_rows;                       /**< The number of rows */
+   int capacity;                             /**< The number of rows with room in the offsets */
+   size_t* offsets[MAX_NUMBER_OF_COLUMNS];   /**< The payload offset of the value of each row, per column */
+   uint8_t* nulls[MAX_NUMBER_OF_COLUMNS];    /**< The null bitmap of each column, a set bit for a NULL or empty value */
+   struct builder payload;                   /**< The values */
+   int omitted;                              /**< The number of rows left out by the row limit */
+   double other;                             /**< The sum of the values of the rows left out */
+   size_t accounted;                         /**< The size of the payload in the memory accounting */
+};
+
+/** @struct row_limit
+ * Defines a bound on the rows kept of a result stored by column. The rows are
+ * selected while they are received, so the memory doesn't depend on the
+ * number of rows returned by the server
+ */
+struct row_limit
+{
+   int max_rows; /**< The maximum number of rows, or 0 for all of them */
+   int column;   /**< The value column, summed for the rows left out */
+   bool top;     /**< Keep the rows with the largest values instead of the first rows */
+};
+
 /** @struct query
  * Defines a query
  */
@@ -58,20 +90,183 @@ struct query
    int number_of_columns;                          /**< The number of columns */
 
    struct tuple* tuples;                           /**< The tuples */
+   struct arena* arena;                            /**< The memory of the tuples */
+   struct columns* columns;                        /**< The result by column, or NULL when the result is in tuples */
+   int number_of_rows;                             /**< The number of rows */
+   size_t bytes;                                   /**< The number of bytes received for the result */
+   uint64_t fingerprint;                           /**< A hash of the DataRows received for the result */
 } __attribute__ ((aligned (64)));
 
+/** @struct query_lane
+ * Defines a connection of this process to a server, the pooled one or an additional one
+ */
+struct query_lane
+{
+   SSL* ssl;           /**< The SSL structure */
+   int fd;             /**< The socket descriptor, or -1 */
+   int backend_pid;    /**< The process id of the backend of the connection */
+   int backend_secret; /**< The secret key of the backend of the connection */
+};
+
+/** @struct database_connection
+ * Defines a connection to a database of a server, other than the postgres database
+ */
+struct database_connection
+{
+   char database[MISC_LENGTH]; /**< The database, empty if none */
+   struct query_lane lane;     /**< The connection */
+   bool used;                  /**< Is a thread running queries on it */
+   uint64_t last;              /**< When it was last used */
+};
+
+/** @struct query_request
+ * Defines a query sent as part of a pipeline
+ */
+struct query_request
+{
+   char* query;          /**< The query string */
+   char* tag;            /**< The tag */
+   int columns;          /**< The number of columns, or -1 to use the row description */
+   char** names;         /**< The column names, or NULL to use the row description */
+   bool columnar;        /**< Store the result by column */
+   int statement;        /**< The metric of the prepared statement, or -1 to use the unnamed statement */
+   int version;          /**< The version of the query of the prepared statement */
+   int timeout;          /**< The timeout in seconds, after which the query is canceled, or 0 for none */
+   size_t size;          /**< The expected size of the result in bytes, or 0 if unknown */
+   struct row_limit limit; /**< The bound on the rows of the result */
+   uint64_t duration;    /**< The time until the result was received, in nanoseconds */
+   bool error;           /**< Did the query fail */
+   struct query* result; /**< The resulting query */
+};
+
+/** @struct query_batch
+ * Defines the requests of a server run together with those of other servers
+ */
+struct query_batch
+{
+   int server;                     /**< The server */
+   struct query_request* requests; /**< The requests */
+   int number_of_requests;         /**< The number of requests */
+};
+
 /**
- * Open database connections
+ * Open database connections.
+ * Takes the lease of each server connection, reusing the pooled
+ * connection of the main process when it is still valid
  */
 void
 pgexporter_open_connections(void);
 
 /**
- * Close database connections
+ * Close database connections.
+ * New connections are transferred to the main process when
+ * caching connections, or kept by a process owning its pool,
+ * and the leases are released
  */
 void
 pgexporter_close_connections(void);
 
+/**
+ * Make this process the owner of its pool, keep the connections
+ * opened by the process in the pool, and release their leases.
+ * A child of the owner closes the connections it inherited, and
+ * makes connections of its own
+ */
+void
+pgexporter_pool_connections(void);
+
+/**
+ * Add a connection transferred to the main process to the pool,
+ * and release its lease
+ * @param server The server
+ * @param fd The descriptor
+ */
+void
+pgexporter_pool_add(int server, int fd);
+
+/**
+ * Close the pooled connections of this process
+ */
+void
+pgexporter_pool_destroy(void);
+
+/**
+ * Release the leases held by a process with connections of its own
+ * that exited
+ * @param pid The process id
+ */
+void
+pgexporter_pool_reclaim(pid_t pid);
+
+/**
+ * Close the pooled connection to a server, like when its
+ * connection parameters changed on a reload
+ * @param server The server
+ */
+void
+pgexporter_pool_remove(int server);
+
+/**
+ * Is there a pooled connection to a server in this process
+ * @param server The server
+ * @return True if there is one, otherwise false
+ */
+bool
+pgexporter_pool_connected(int server);
+
+/**
+ * Is there a usable connection to a server in this process
+ * @param server The server
+ * @return True if connected, otherwise false
+ */
+bool
+pgexporter_connection_active(int server);
+
+/**
+ * Open the lanes of a server, the additional connections of this process
+ * that run queries of the server next to its pooled connection, up to
+ * max_parallel_queries connections in all. The lanes are kept until they
+ * are closed, and as they authenticate they are only opened by one thread
+ * @param server The server
+ * @return The number of connections, the pooled connection included
+ */
+int
+pgexporter_open_lanes(int server);
+
+/**
+ * Close the lanes of all the servers
+ */
+void
+pgexporter_close_lanes(void);
+
+/**
+ * Select the connection the queries of the calling thread run on
+ * @param server The server
+ * @param lane The lane, or 0 for the pooled connection
+ */
+void
+pgexporter_select_lane(int server, int lane);
+
+/**
+ * Run requests on a connection of a server to a database. The connections to
+ * the databases of a server are kept up to its database_connections, and when
+ * all of them are open the one used least recently is closed for another
+ * database. A thread waits while all of them are used by other threads
+ * @param server The server
+ * @param database The database
+ * @param requests The requests
+ * @param number_of_requests The number of requests
+ * @return 0 upon success, otherwise 1 if no connection could be made
+ */
+int
+pgexporter_database_query(int server, char* database, struct query_request* requests, int number_of_requests);
+
+/**
+ * Close the connections to the databases of all the servers
+ */
+void
+pgexporter_close_databases(void);
+
 /**
  * Get functions
  * @param server The server
@@ -122,6 +317,19 @@ pgexporter_query_free_disk_space(int server, bool data, struct query** query);
 int
 pgexporter_query_total_disk_space(int server, bool data, struct query** query);
 
+/**
+ * Query for the used, free and total disk space of the data and WAL directories
+ * in a single statement. The columns are the used, free and total space of the
+ * data directory followed by those of the WAL directory
+ * @param server The server
+ * @param data Include the data directory
+ * @param wal Include the WAL directory
+ * @param query The resulting query
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_query_disk_space(int server, bool data, bool wal, struct query** query);
+
 /**
  * Query PostgreSQL version
  * @param server The server
@@ -158,6 +366,15 @@ pgexporter_query_primary(int server, struct query** query);
 int
 pgexporter_query_database_size(int server, struct query** query);
 
+/**
+ * Query pg_database for the databases that allow connections
+ * @param server The server
+ * @param query The resulting query
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_query_databases(int server, struct query** query);
+
 /**
  * Query for installed extensions
  * @param server The server
@@ -222,20 +439,43 @@ int
 pgexporter_query_settings(int server, struct query** query);
 
 /**
- * Query custom metrics
+ * Query a custom metric. The result and error of the request are set
  * @param server The server
- * @param qs Query string
- * @param tag
- * @param columns
- * @param names
- * @param query The resulting query
+ * @param request The request
  * @return 0 upon success, otherwise 1
  */
 int
-pgexporter_custom_query(int server, char* qs, char* tag, int columns, char** names, struct query** query);
+pgexporter_custom_query(int server, struct query_request* request);
+
+/**
+ * Query custom metrics using a pipeline of extended protocol messages, such that
+ * all the queries are sent to the server in a single round trip.
+ * Each query is followed by its own Sync, so a failing query only sets error on its request.
+ * A request with a statement is prepared once for the connection, and later only executed
+ * @param server The server
+ * @param requests The requests
+ * @param number_of_requests The number of requests
+ * @return 0 upon success, otherwise 1 if the connection failed
+ */
+int
+pgexporter_custom_query_pipeline(int server, struct query_request* requests, int number_of_requests);
+
+/**
+ * Query custom metrics of several servers from the current thread. The requests of
+ * each server are pipelined on its pooled connection as by pgexporter_custom_query_pipeline(),
+ * and the connections are made non-blocking and written and read as they are ready,
+ * so the round trips to the servers overlap. Each running query keeps its own timeout.
+ * A server whose connection is lost before any result is queried again on a new connection
+ * @param batches The requests of each server
+ * @param number_of_batches The number of servers
+ * @return 0 upon success, otherwise 1 if the connection of a server failed
+ */
+int
+pgexporter_custom_query_servers(struct query_batch* batches, int number_of_batches);
 
 /**
- * Merge queries
+ * Merge queries. The first query takes over the memory of the second query.
+ * Only results stored in tuples can be merged
  * @param q1 The first query
  * @param q2 The second query
  * @param sort The sort key
@@ -245,15 +485,20 @@ struct query*
 pgexporter_merge_queries(struct query* q1, struct query* q2, int sort);
 
 /**
- * Free allocated memory for tuples linked list
- * @param query The query
- * @return 0 upon success, otherwise 1
+ * Merge a number of queries in a single pass. The first query takes over the memory
+ * of the other queries, and all the queries are consumed. With SORT_DATA0 the tuples
+ * are grouped on their first column, in order of first appearance and then by query.
+ * Only results stored in tuples can be merged
+ * @param queries The queries, where an entry may be NULL
+ * @param number_of_queries The number of queries
+ * @param sort The sort key
+ * @return The resulting query, or NULL if there are no queries
  */
-int
-pgexporter_free_tuples(struct tuple** tuples, int n_columns);
+struct query*
+pgexporter_merge_all_queries(struct query** queries, int number_of_queries, int sort);
 
 /**
- * Free query
+ * Free query, releasing the memory of all its tuples at once
  * @param query The query
  * @return 0 upon success, otherwise 1
  */
@@ -286,6 +531,25 @@ pgexporter_query_debug(struct query* query);
 char*
 pgexporter_get_column_by_name(char* name, struct query* query, struct tuple* tuple);
 
+/**
+ * Get the index of a column by name, such that it is only resolved once for all rows
+ * @param name The column name
+ * @param query The query
+ * @return The index, or -1 if not found
+ */
+int
+pgexporter_get_column_index(char* name, struct query* query);
+
+/**
+ * Get a value from a result stored by column
+ * @param col The column
+ * @param row The row
+ * @param query The query
+ * @return The value, or NULL for a NULL or empty value
+ */
+char*
+pgexporter_get_value(int col, int row, struct query* query);
+
 #ifdef __cplusplus
 }
 #endif
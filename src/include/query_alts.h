@@ -39,45 +39,26 @@
  * This allows sending that query to the server that has the highest support.
  *
  * To support fast insert as well as fetch (finding lower bound) of query to
- * send to server, query_alts is an AVL tree by design.
+ * send to server, query_alts is an AVL tree by design. The nodes are
+ * kept in the catalog pool, see catalog.h.
  */
 
 /**
  * @brief Get the query alternative for a given server version
- * @param root Root of the AVL tree
+ * @param pool The catalog pool of the tree
+ * @param root Root of the AVL tree, 0 if empty
  * @param server Server's major version
  * @return query_alts* NULL if not supported, otherwise a valid pointer
  */
 struct query_alts*
-pgexporter_get_query_alt(struct query_alts* root, int server);
+pgexporter_get_query_alt(char* pool, size_t root, int server);
 
 /**
  * @brief Insert a node `new_node` into the AVL tree `root`
- * @param root Root of the AVL tree
- * @param new_node New node to add (Memory is free'd if node is not used)
- * @return query_alts* Returns root of AVL Tree. Can ignore.
+ * @param pool The catalog pool of the tree
+ * @param root Root of the AVL tree, 0 if empty
+ * @param new_node New node to add (Left out if its version is in the tree already)
+ * @return size_t Returns root of AVL Tree.
  */
-struct query_alts*
-pgexporter_insert_node_avl (struct query_alts* root, struct query_alts** new_node);
-
-/**
- * @brief Copy query alternative from `src` to `dst`
- * @param dst Destination
- * @param src Source
- */
-void
-pgexporter_copy_query_alts(struct query_alts** dst, struct query_alts* src);
-
-/**
- * @brief Free the Query Alternatives of a configuration
- * @param configuration The configuration
- */
-void
-pgexporter_free_query_alts(struct configuration* config);
-
-/**
- * @brief Free allocated memory for an AVL Tree Node for Query Alternatives given its root
- * @param root Root of the AVL tree
- */
-void
-pgexporter_free_node_avl(struct query_alts** root);
+size_t
+pgexporter_insert_node_avl(char* pool, size_t root, size_t new_node);
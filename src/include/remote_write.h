@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGEXPORTER_REMOTE_WRITE_H
+#define PGEXPORTER_REMOTE_WRITE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pgexporter.h>
+
+#include <stdbool.h>
+#include <time.h>
+
+/**
+ * Start the sender of the remote write requests, when remote_write is set.
+ * The requests are sent by a thread of the collector, from a bounded queue
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_remote_write_start(void);
+
+/**
+ * Is the remote write sender running
+ * @return True if running, otherwise false
+ */
+bool
+pgexporter_remote_write_active(void);
+
+/**
+ * Add a sample to the current request, which is queued once it holds
+ * remote_write_batch samples
+ * @param key The key of the metric, which is its name optionally followed by its labels
+ * @param value The value
+ * @param timestamp The timestamp
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_remote_write_add(char* key, char* value, time_t timestamp);
+
+/**
+ * Queue the current request
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_remote_write_flush(void);
+
+/**
+ * Stop the sender, where the requests still queued are dropped
+ */
+void
+pgexporter_remote_write_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
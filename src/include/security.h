@@ -104,6 +104,26 @@ pgexporter_close_ssl(SSL* ssl);
 int
 pgexporter_extract_server_parameters(struct deque** server_parameters);
 
+/**
+ * Extract the backend key data recevied during the latest authentication
+ * @param pid The process id of the backend
+ * @param secret The secret key of the backend
+ * @return 0 on success, otherwise 1
+ */
+int
+pgexporter_extract_backend_key_data(int* pid, int* secret);
+
+/**
+ * Cancel the query running on a connection of a server, using a
+ * CancelRequest on a new connection
+ * @param server The server
+ * @param pid The process id of the backend of the connection
+ * @param secret The secret key of the backend of the connection
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_server_cancel(int server, int pid, int secret);
+
 /**
  * Create a SSL context
  * @param client True if client, false if server
@@ -126,6 +146,35 @@ pgexporter_create_ssl_ctx(bool client, SSL_CTX** ctx);
 int
 pgexporter_create_ssl_server(SSL_CTX* ctx, char* key, char* cert, char* root, int socket, SSL** ssl);
 
+/**
+ * Create a SSL server structure from an already initialized context,
+ * such that the context can be shared between connections
+ * @param ctx The SSL context
+ * @param socket The socket
+ * @param ssl The SSL structure
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_create_ssl_server_from_ctx(SSL_CTX* ctx, int socket, SSL** ssl);
+
+/**
+ * Load the certificate, the key and the CA of a SSL server context
+ * @param ctx The SSL context
+ * @param key The key file path
+ * @param cert The certificate file path
+ * @param root The root file path
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_init_ssl_server_ctx(SSL_CTX* ctx, char* key, char* cert, char* root);
+
+/**
+ * Create the keys of the TLS session tickets, shared by all processes
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_create_ssl_ticket_keys(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -35,13 +35,17 @@ extern "C" {
 
 #include <stdlib.h>
 
+#include <openssl/ssl.h>
+
 /**
  * Get the information for a server
  * @param srv The server index
+ * @param ssl The SSL structure of the connection, or NULL
+ * @param socket The descriptor of the connection
  * @return 0 upon success, otherwise 1
  */
 int
-pgexporter_server_info(int srv);
+pgexporter_server_info(int srv, SSL* ssl, int socket);
 
 #ifdef __cplusplus
 }
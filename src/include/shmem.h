@@ -45,6 +45,16 @@ extern "C" {
 int
 pgexporter_create_shared_memory(size_t size, unsigned char hp, void** shmem);
 
+/**
+ * Set the NUMA placement of a shared memory segment. Linux only
+ * @param shmem The shared memory segment
+ * @param size The size of the segment
+ * @param numa The node to bind to, NUMA_INTERLEAVE or NUMA_OFF
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_numa_shared_memory(void* shmem, size_t size, int numa);
+
 /**
  * Resize a shared memory segment
  * @param size The size of the segment
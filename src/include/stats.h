@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGEXPORTER_STATS_H
+#define PGEXPORTER_STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pgexporter.h>
+#include <json.h>
+#include <memory.h>
+#include <utils.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define STATS_PHASE_CONNECT 0
+#define STATS_PHASE_AUTH    1
+#define STATS_PHASE_COLLECT 2
+#define STATS_PHASE_RENDER  3
+#define STATS_PHASE_SEND    4
+#define NUMBER_OF_STATS_PHASES 5
+
+#define STATS_COLLECTOR_VERSION   0
+#define STATS_COLLECTOR_UPTIME    1
+#define STATS_COLLECTOR_PRIMARY   2
+#define STATS_COLLECTOR_SETTINGS  3
+#define STATS_COLLECTOR_EXTENSION 4
+#define NUMBER_OF_STATS_COLLECTORS 5
+
+#define NUMBER_OF_STATS_BUCKETS 13
+
+/** @struct stats_histogram
+ * Defines a histogram of durations
+ */
+struct stats_histogram
+{
+   atomic_ullong buckets[NUMBER_OF_STATS_BUCKETS]; /**< The observations of each bucket, the last one is +Inf */
+   atomic_ullong count;                            /**< The number of observations */
+   atomic_ullong sum;                              /**< The sum of the observations in nanoseconds */
+};
+
+/** @struct stats_query
+ * Defines the statistics of the queries of a collector on a server
+ */
+struct stats_query
+{
+   struct stats_histogram duration; /**< The durations */
+   atomic_ullong rows;              /**< The number of rows returned */
+   atomic_ullong bytes;             /**< The number of bytes received */
+   atomic_ullong errors;            /**< The number of failed queries */
+   atomic_ullong size;              /**< The number of bytes of the last result */
+   atomic_ullong last;              /**< The duration of the last query in nanoseconds */
+};
+
+/** @struct stats_memory
+ * Defines the memory accounting of a subsystem over all processes
+ */
+struct stats_memory
+{
+   atomic_llong allocations;     /**< The number of allocations */
+   atomic_llong frees;           /**< The number of frees */
+   atomic_llong allocated_bytes; /**< The number of bytes allocated */
+   atomic_llong freed_bytes;     /**< The number of bytes freed */
+   atomic_llong peak;            /**< The highest number of bytes in use seen by a flush */
+};
+
+/** @struct stats
+ * Defines the statistics of pgexporter itself. The queries are kept for each
+ * server, first for the built-in collectors and then for the custom metrics
+ */
+struct stats
+{
+   int number_of_servers;                                   /**< The number of servers */
+   int number_of_queries;                                   /**< The number of queries of a server */
+   struct stats_histogram phases[NUMBER_OF_STATS_PHASES];   /**< The durations of the phases of a scrape */
+   atomic_ullong cache_hits;                                /**< The responses served from a cache */
+   atomic_ullong cache_misses;                              /**< The responses built by a scrape */
+   struct stats_memory memory[NUMBER_OF_MEMORY_SUBSYSTEMS]; /**< The memory accounting of the subsystems */
+   struct stats_query queries[];                            /**< The queries */
+};
+
+/**
+ * Create the shared memory segment of the statistics, sized for
+ * the servers and metrics of the configuration
+ * @param size The size of the segment
+ * @param segment The segment
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_stats_init(size_t* size, void** segment);
+
+/**
+ * Get the time of the monotonic clock
+ * @return The time in nanoseconds
+ */
+uint64_t
+pgexporter_stats_now(void);
+
+/**
+ * Record the duration of a phase of a scrape
+ * @param phase The phase
+ * @param start The start of the phase from pgexporter_stats_now()
+ */
+void
+pgexporter_stats_phase(int phase, uint64_t start);
+
+/**
+ * Record a query of a built-in collector
+ * @param server The server
+ * @param collector The collector
+ * @param duration The duration in nanoseconds
+ * @param rows The number of rows
+ * @param bytes The number of bytes received
+ * @param error Did the query fail
+ */
+void
+pgexporter_stats_collector(int server, int collector, uint64_t duration, int rows, size_t bytes, bool error);
+
+/**
+ * Record the query of a custom metric
+ * @param server The server
+ * @param metric The metric
+ * @param duration The duration in nanoseconds
+ * @param rows The number of rows
+ * @param bytes The number of bytes received
+ * @param error Did the query fail
+ */
+void
+pgexporter_stats_metric(int server, int metric, uint64_t duration, int rows, size_t bytes, bool error);
+
+/**
+ * Get the size of the last result of the query of a custom metric
+ * @param server The server
+ * @param metric The metric
+ * @return The number of bytes, or 0 if unknown
+ */
+size_t
+pgexporter_stats_metric_size(int server, int metric);
+
+/**
+ * Get the duration of the last query of a custom metric
+ * @param server The server
+ * @param metric The metric
+ * @return The duration in nanoseconds, or 0 if unknown
+ */
+uint64_t
+pgexporter_stats_metric_duration(int server, int metric);
+
+/**
+ * Record a response
+ * @param hit Was the response served from a cache
+ */
+void
+pgexporter_stats_cache(bool hit);
+
+/**
+ * Write the statistics in the Prometheus text format
+ * @param builder The builder
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_stats_output(struct builder* builder);
+
+/**
+ * Add the memory accounting of a subsystem
+ * @param subsystem The subsystem
+ * @param allocations The number of allocations
+ * @param frees The number of frees
+ * @param allocated The number of bytes allocated
+ * @param freed The number of bytes freed
+ */
+void
+pgexporter_stats_memory(int subsystem, int64_t allocations, int64_t frees, int64_t allocated, int64_t freed);
+
+/**
+ * Write the memory accounting in the Prometheus text format
+ * @param builder The builder
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_stats_memory_output(struct builder* builder);
+
+/**
+ * Add the memory accounting to a JSON object
+ * @param json The JSON object
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_stats_memory_json(struct json* json);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
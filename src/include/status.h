@@ -38,25 +38,27 @@ extern "C" {
 #include <stdlib.h>
 
 /**
- * Create an status
+ * Create an status, and send it to the client
  * @param ssl The SSL connection
  * @param client_fd The client
  * @param compression The compress method for wire protocol
  * @param encryption The encrypt method for wire protocol
  * @param payload The payload
+ * @return 0 upon success, otherwise 1
  */
-void
+int
 pgexporter_status(SSL* ssl, int client_fd, uint8_t compression, uint8_t encryption, struct json* payload);
 
 /**
- * Create an status details
+ * Create an status details, and send it to the client
  * @param ssl The SSL connection
  * @param client_fd The client
  * @param compression The compress method for wire protocol
  * @param encryption The encrypt method for wire protocol
  * @param payload The payload
+ * @return 0 upon success, otherwise 1
  */
-void
+int
 pgexporter_status_details(SSL* ssl, int client_fd, uint8_t compression, uint8_t encryption, struct json* payload);
 
 #ifdef __cplusplus
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PGEXPORTER_TRACE_H
+#define PGEXPORTER_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pgexporter.h>
+#include <json.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define TRACE_MAX_TRACES     256
+#define TRACE_MAX_SPANS      512
+#define TRACE_NAME_LENGTH    40
+
+#define TRACE_KIND_METRICS   0
+#define TRACE_KIND_COLLECTOR 1
+#define TRACE_KIND_BRIDGE    2
+#define NUMBER_OF_TRACE_KINDS 3
+
+/** @struct trace_span
+ * Defines a span of a trace
+ */
+struct trace_span
+{
+   char name[TRACE_NAME_LENGTH]; /**< The name */
+   int16_t server;               /**< The server or the endpoint, or -1 */
+   int16_t thread;               /**< The thread of the process */
+   uint64_t start;               /**< The start in nanoseconds since the start of the trace */
+   uint64_t duration;            /**< The duration in nanoseconds */
+};
+
+/** @struct trace
+ * Defines the trace of a scrape. The sequence is 0 while the trace is written
+ */
+struct trace
+{
+   atomic_ulong sequence;                    /**< The number of the trace, 0 if none */
+   int kind;                                 /**< The kind of scrape */
+   pid_t pid;                                /**< The process */
+   time_t timestamp;                         /**< When the scrape started */
+   uint64_t duration;                        /**< The duration in nanoseconds */
+   int number_of_spans;                      /**< The number of spans */
+   int dropped;                              /**< The number of spans that didn't fit */
+   struct trace_span spans[TRACE_MAX_SPANS]; /**< The spans, oldest first */
+};
+
+/** @struct traces
+ * Defines the last traces of the scrapes, as a ring shared by the processes
+ */
+struct traces
+{
+   int number_of_traces;  /**< The number of traces kept */
+   atomic_ulong next;     /**< The number of traces published */
+   struct trace traces[]; /**< The traces */
+};
+
+/**
+ * Create the shared memory segment of the traces, if they are enabled
+ * @param size The size of the segment
+ * @param segment The segment, or NULL if the traces are disabled
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_trace_init(size_t* size, void** segment);
+
+/**
+ * Start the trace of a scrape of the process
+ * @param kind The kind of scrape
+ * @return True if the trace was started, false if the traces are disabled or a trace is already running
+ */
+bool
+pgexporter_trace_start(int kind);
+
+/**
+ * Start a span
+ * @return The start of the span, or 0 if no trace is running
+ */
+uint64_t
+pgexporter_trace_begin(void);
+
+/**
+ * End a span. The spans are kept in a ring of the process,
+ * so the oldest ones are dropped from a long trace
+ * @param name The name
+ * @param server The server or the endpoint, or -1
+ * @param start The start of the span from pgexporter_trace_begin()
+ */
+void
+pgexporter_trace_end(char* name, int server, uint64_t start);
+
+/**
+ * Publish the trace of the process into the shared ring
+ */
+void
+pgexporter_trace_finish(void);
+
+/**
+ * Send the last traces to a management client, newest first
+ * @param ssl The SSL connection
+ * @param client_fd The client
+ * @param compression The compress method for wire protocol
+ * @param encryption The encrypt method for wire protocol
+ * @param payload The payload
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_trace(SSL* ssl, int client_fd, uint8_t compression, uint8_t encryption, struct json* payload);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef PGEXPORTER_URING_H
+#define PGEXPORTER_URING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES 8
+
+/**
+ * Enable io_uring for the socket I/O of the process and its children.
+ * io_uring is only used when the libev engine is 'iouring', and the
+ * kernel supports it
+ * @param engine The libev engine
+ * @return True if enabled, otherwise false
+ */
+bool
+pgexporter_uring_enable(char* engine);
+
+/**
+ * Create the io_uring of the thread, and register the buffer.
+ * Does nothing if io_uring isn't enabled
+ * @param buffer The message buffer of the thread
+ * @param size The size of the buffer
+ */
+void
+pgexporter_uring_init(void* buffer, size_t size);
+
+/**
+ * Is io_uring available for the thread
+ * @return True if available, otherwise false
+ */
+bool
+pgexporter_uring_available(void);
+
+/**
+ * Read from a socket with a linked timeout in one submission.
+ * The registered buffer is used when the buffer is inside it
+ * @param fd The descriptor
+ * @param buffer The buffer
+ * @param size The size of the buffer
+ * @param timeout The timeout in seconds
+ * @return The number of bytes read, or -1 with errno set (EAGAIN on timeout)
+ */
+ssize_t
+pgexporter_uring_read(int fd, void* buffer, size_t size, int timeout);
+
+/**
+ * Write the segments to a socket as linked writes in one submission
+ * @param fd The descriptor
+ * @param iov The segments
+ * @param iovcnt The number of segments
+ * @return The number of bytes written in order, or -1 with errno set
+ */
+ssize_t
+pgexporter_uring_write(int fd, struct iovec* iov, int iovcnt);
+
+/**
+ * Destroy the io_uring of the thread
+ */
+void
+pgexporter_uring_destroy(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
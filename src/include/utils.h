@@ -37,6 +37,8 @@ extern "C" {
 #include <pgexporter.h>
 #include <message.h>
 
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 /** @struct signal_info
@@ -97,6 +99,18 @@ struct pgexporter_parsed_command
    char* args[MISC_LENGTH];            /**< The arguments */
 };
 
+/** @struct builder
+ * Defines a string builder, which tracks the length of
+ * the string and grows its buffer geometrically.
+ * The data is always zero terminated
+ */
+struct builder
+{
+   char* data;       /**< The string */
+   size_t length;    /**< The length of the string */
+   size_t capacity;  /**< The size of the buffer */
+};
+
 /**
  * Utility function to parse the command line
  * and search for a command.
@@ -249,6 +263,14 @@ pgexporter_write_byte(void* data, signed char b);
 void
 pgexporter_write_uint8(void* data, uint8_t b);
 
+/**
+ * Write an int16
+ * @param data Pointer to the data
+ * @param i The int16
+ */
+void
+pgexporter_write_int16(void* data, int16_t i);
+
 /**
  * Write an int32
  * @param data Pointer to the data
@@ -369,6 +391,34 @@ pgexporter_base64_encode(void* raw, size_t raw_length, char** encoded, size_t* e
 int
 pgexporter_base64_decode(char* encoded, size_t encoded_length, void** raw, size_t* raw_length);
 
+/**
+ * Create a BASE64 stream
+ * @param encode True to encode, false to decode
+ * @param stream The stream
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_base64_stream_create(bool encode, void** stream);
+
+/**
+ * Process data through a BASE64 stream. The output is appended to the builder
+ * @param stream The stream
+ * @param data The data
+ * @param length The length of the data
+ * @param finish True if this is the last data of the stream
+ * @param output The output
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_base64_stream_update(void* stream, void* data, size_t length, bool finish, struct builder* output);
+
+/**
+ * Destroy a BASE64 stream
+ * @param stream The stream
+ */
+void
+pgexporter_base64_stream_destroy(void* stream);
+
 /**
  * Set process title.
  *
@@ -466,6 +516,104 @@ pgexporter_append_bool(char* orig, bool b);
 char*
 pgexporter_append_char(char* orig, char c);
 
+/**
+ * Initialize a string builder
+ * @param builder The builder
+ * @param capacity The initial capacity, or 0
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_builder_init(struct builder* builder, size_t capacity);
+
+/**
+ * Make room for appending to a string builder
+ * @param builder The builder
+ * @param length The length to append
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_builder_reserve(struct builder* builder, size_t length);
+
+/**
+ * Append a string to a string builder
+ * @param builder The builder
+ * @param s The string
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_builder_append(struct builder* builder, char* s);
+
+/**
+ * Append data of a known length to a string builder
+ * @param builder The builder
+ * @param s The data
+ * @param length The length of the data
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_builder_append_length(struct builder* builder, char* s, size_t length);
+
+/**
+ * Append a char to a string builder
+ * @param builder The builder
+ * @param c The char
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_builder_append_char(struct builder* builder, char c);
+
+/**
+ * Append a signed integer to a string builder
+ * @param builder The builder
+ * @param i The integer
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_builder_append_int(struct builder* builder, int64_t i);
+
+/**
+ * Append an unsigned integer to a string builder
+ * @param builder The builder
+ * @param l The integer
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_builder_append_ulong(struct builder* builder, uint64_t l);
+
+/**
+ * Append a double to a string builder, like "%f" does
+ * @param builder The builder
+ * @param d The double
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_builder_append_double(struct builder* builder, double d);
+
+/**
+ * Append spaces, and optionally a tag, to a string builder
+ * @param builder The builder
+ * @param tag [Optional] The tag, which will be applied after indentation if not NULL
+ * @param indent The indent
+ * @return 0 upon success, otherwise 1
+ */
+int
+pgexporter_builder_indent(struct builder* builder, char* tag, int indent);
+
+/**
+ * Take the string out of a string builder, which is empty afterwards
+ * @param builder The builder
+ * @return The string, which the caller must free, or NULL if nothing was allocated
+ */
+char*
+pgexporter_builder_detach(struct builder* builder);
+
+/**
+ * Release the memory of a string builder
+ * @param builder The builder
+ */
+void
+pgexporter_builder_destroy(struct builder* builder);
+
 /**
  * Indent a string
  * @param str The string
@@ -840,6 +988,17 @@ pgexporter_backtrace(void);
 int
 pgexporter_os_kernel_version(char** os, int* kernel_major, int* kernel_minor, int* kernel_patch);
 
+/**
+ * Create a thread, and log the error if it can't be created
+ * @param thread The thread
+ * @param routine The function run by the thread
+ * @param arg The argument of the function
+ * @param name The name of the thread in the log
+ * @return 0 upon success, otherwise the error returned by pthread_create
+ */
+int
+pgexporter_thread_create(pthread_t* thread, void* (*routine)(void*), void* arg, char* name);
+
 #ifdef __cplusplus
 }
 #endif
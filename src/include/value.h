@@ -35,6 +35,9 @@ extern "C" {
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+#define VALUE_FORMAT_SIZE 32
 
 typedef void (*data_destroy_cb)(uintptr_t data);
 typedef char* (*data_to_string_cb)(uintptr_t data, int32_t format, char* tag, int indent);
@@ -100,6 +103,15 @@ struct value_config
 int
 pgexporter_value_create(enum value_type type, uintptr_t data, struct value** value);
 
+/**
+ * Initialize a value which is embedded in another struct, see pgexporter_value_create
+ * @param type The value type
+ * @param data The value data, type cast it to uintptr_t before passing into function
+ * @param value The value
+ */
+void
+pgexporter_value_init(enum value_type type, uintptr_t data, struct value* value);
+
 /**
  * Create a value with a config for customized destroy or to_string callback,
  * the type will default to ValueRef
@@ -111,6 +123,13 @@ pgexporter_value_create(enum value_type type, uintptr_t data, struct value** val
 int
 pgexporter_value_create_with_config(uintptr_t data, struct value_config* config, struct value** value);
 
+/**
+ * Destroy the data of a value initialized with pgexporter_value_init, but not the value itself
+ * @param value The value
+ */
+void
+pgexporter_value_release(struct value* value);
+
 /**
  * Destroy a value along with the data within
  * @param value The value
@@ -138,6 +157,26 @@ pgexporter_value_data(struct value* value);
 char*
 pgexporter_value_to_string(struct value* value, int32_t format, char* tag, int indent);
 
+/**
+ * Format a number, a boolean or a character like pgexporter_value_to_string does,
+ * without allocating
+ * @param type The value type
+ * @param data The value data
+ * @param buf The buffer of VALUE_FORMAT_SIZE bytes
+ * @return The length of the string, or 0 if the type is not a scalar or the value doesn't fit
+ */
+size_t
+pgexporter_value_format(enum value_type type, uintptr_t data, char* buf);
+
+/**
+ * Format a double like the %f format of printf, for the values below 2^53
+ * @param d The value
+ * @param buf The buffer of VALUE_FORMAT_SIZE bytes
+ * @return The length of the string, or 0 if the value must be formatted by printf
+ */
+size_t
+pgexporter_value_format_double(double d, char* buf);
+
 /**
  * Convert a double value to value data, since straight type cast discards the decimal part
  * @param val The value
@@ -50,7 +50,7 @@ pgexporter_read_metrics_configuration(void* shmem);
  * metrics in the config.
  *
  * @param config The configuration where it will be loaded
- * @param start true if it will reset the `number_of_metrics` in `config` to 0 and start counting from there
+ * @param start true if it will start over with the metrics in `config`, and reset `number_of_metrics` to 0
  * @return 0 upon success, otherwise 1
  */
 int
@@ -58,14 +58,14 @@ pgexporter_read_internal_yaml_metrics(struct configuration* config, bool start);
 
 /**
  * Read and load YAML configuration from file pointer.
- * @param prometheus The array of data structures where the YAML configuration is loaded
- * @param prometheus_idx The index of the data structure in the array
+ * @param config The configuration, where the metrics are loaded in the catalog
+ * @param prometheus_idx The index of the first metric
  * @param number_of_metrics The number of metrics the configuration has. This value will be set by the function.
  * @param file File pointer
  * @return 0 upon success, otherwise 1
  */
 int
-pgexporter_read_yaml_from_file_pointer(struct prometheus* prometheus, int prometheus_idx, int* number_of_metrics, FILE* file);
+pgexporter_read_yaml_from_file_pointer(struct configuration* config, int prometheus_idx, int* number_of_metrics, FILE* file);
 
 #ifdef __cplusplus
 }
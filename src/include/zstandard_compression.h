@@ -45,6 +45,18 @@ extern "C" {
 int
 pgexporter_zstdc_string(char* s, unsigned char** buffer, size_t* buffer_size);
 
+/**
+ * ZSTD compress a buffer into a buffer of a fixed capacity
+ * @param source The data
+ * @param source_size The size of the data
+ * @param destination The buffer of the compressed data
+ * @param capacity The capacity of the destination
+ * @param size The size of the compressed data
+ * @return 0 upon success, otherwise 1 if it failed or didn't fit
+ */
+int
+pgexporter_zstdc_buffer(void* source, size_t source_size, void* destination, size_t capacity, size_t* size);
+
 /**
  * ZSTD decompress a buffer to string
  * @param compressed_buffer The buffer containing the GZIP compressed data
@@ -31,6 +31,8 @@
 #include <logging.h>
 #include <security.h>
 
+#include <limits.h>
+
 static int derive_key_iv(char* password, unsigned char* key, unsigned char* iv, int mode);
 static int aes_encrypt(char* plaintext, unsigned char* key, unsigned char* iv, char** ciphertext, int* ciphertext_length, int mode);
 static int aes_decrypt(char* ciphertext, int ciphertext_length, unsigned char* key, unsigned char* iv, char** plaintext, int mode);
@@ -360,3 +362,145 @@ error:
 
    return 1;
 }
+
+struct cipher_stream
+{
+   EVP_CIPHER_CTX* ctx;  /**< The cipher context */
+   int block_size;       /**< The block size of the cipher */
+};
+
+int
+pgexporter_cipher_stream_create(bool encrypt, int mode, void** stream)
+{
+   unsigned char key[EVP_MAX_KEY_LENGTH];
+   unsigned char iv[EVP_MAX_IV_LENGTH];
+   char* master_key = NULL;
+   const EVP_CIPHER* (*cipher_fp)(void) = NULL;
+   struct cipher_stream* s = NULL;
+
+   *stream = NULL;
+
+   cipher_fp = get_cipher(mode);
+
+   s = (struct cipher_stream*)calloc(1, sizeof(struct cipher_stream));
+   if (s == NULL)
+   {
+      pgexporter_log_error("pgexporter_cipher_stream_create: Allocation failure");
+      goto error;
+   }
+
+   if (pgexporter_get_master_key(&master_key))
+   {
+      pgexporter_log_error("pgexporter_get_master_key: Invalid master key");
+      goto error;
+   }
+
+   memset(&key, 0, sizeof(key));
+   memset(&iv, 0, sizeof(iv));
+
+   if (derive_key_iv(master_key, key, iv, mode) != 0)
+   {
+      pgexporter_log_error("derive_key_iv: Failed to derive key and iv");
+      goto error;
+   }
+
+   if (!(s->ctx = EVP_CIPHER_CTX_new()))
+   {
+      pgexporter_log_error("EVP_CIPHER_CTX_new: Failed to create context");
+      goto error;
+   }
+
+   if (EVP_CipherInit_ex(s->ctx, cipher_fp(), NULL, key, iv, encrypt ? 1 : 0) == 0)
+   {
+      pgexporter_log_error("EVP_CipherInit_ex: Failed to initialize cipher context");
+      goto error;
+   }
+
+   s->block_size = EVP_CIPHER_block_size(cipher_fp());
+
+   *stream = s;
+
+   free(master_key);
+
+   return 0;
+
+error:
+
+   pgexporter_cipher_stream_destroy(s);
+
+   free(master_key);
+
+   return 1;
+}
+
+int
+pgexporter_cipher_stream_update(void* stream, void* data, size_t length, bool finish, struct builder* output)
+{
+   int outl = 0;
+   size_t size;
+   unsigned char* in = (unsigned char*)data;
+   struct cipher_stream* s = (struct cipher_stream*)stream;
+
+   while (length > 0)
+   {
+      size = MIN(length, (size_t)INT_MAX / 2);
+
+      if (pgexporter_builder_reserve(output, size + s->block_size))
+      {
+         goto error;
+      }
+
+      if (EVP_CipherUpdate(s->ctx, (unsigned char*)output->data + output->length, &outl, in, (int)size) == 0)
+      {
+         pgexporter_log_error("EVP_CipherUpdate: Failed to process data");
+         goto error;
+      }
+
+      output->length += outl;
+      output->data[output->length] = '\0';
+
+      in += size;
+      length -= size;
+   }
+
+   if (finish)
+   {
+      if (pgexporter_builder_reserve(output, s->block_size))
+      {
+         goto error;
+      }
+
+      if (EVP_CipherFinal_ex(s->ctx, (unsigned char*)output->data + output->length, &outl) == 0)
+      {
+         pgexporter_log_error("EVP_CipherFinal_ex: Failed to finalize operation");
+         goto error;
+      }
+
+      output->length += outl;
+      output->data[output->length] = '\0';
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+void
+pgexporter_cipher_stream_destroy(void* stream)
+{
+   struct cipher_stream* s = (struct cipher_stream*)stream;
+
+   if (s == NULL)
+   {
+      return;
+   }
+
+   if (s->ctx != NULL)
+   {
+      EVP_CIPHER_CTX_free(s->ctx);
+   }
+
+   free(s);
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <arena.h>
+#include <memory.h>
+
+/* system */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct arena_block* arena_block_create(size_t size);
+
+int
+pgexporter_arena_create(size_t block_size, struct arena** arena)
+{
+   struct arena* a = NULL;
+
+   *arena = NULL;
+
+   a = (struct arena*)pgexporter_memory_alloc(MEMORY_ARENA, sizeof(struct arena));
+   if (a == NULL)
+   {
+      goto error;
+   }
+
+   a->block_size = block_size > 0 ? block_size : ARENA_BLOCK_SIZE;
+   a->blocks = arena_block_create(a->block_size);
+
+   if (a->blocks == NULL)
+   {
+      goto error;
+   }
+
+   *arena = a;
+
+   return 0;
+
+error:
+
+   pgexporter_memory_release(MEMORY_ARENA, a);
+
+   return 1;
+}
+
+void*
+pgexporter_arena_alloc(struct arena* arena, size_t size, size_t alignment)
+{
+   size_t padding;
+   struct arena_block* block = NULL;
+
+   if (arena == NULL)
+   {
+      return NULL;
+   }
+
+   if (alignment == 0)
+   {
+      alignment = 1;
+   }
+
+   block = arena->blocks;
+
+   if (block != NULL)
+   {
+      padding = -((uintptr_t)(block->data + block->used)) & (alignment - 1);
+
+      if (block->used + padding + size <= block->size)
+      {
+         block->used += padding;
+         block->used += size;
+         return block->data + block->used - size;
+      }
+   }
+
+   // A request larger than a block gets a block of its own
+   block = arena_block_create(MAX(arena->block_size, size + alignment));
+   if (block == NULL)
+   {
+      return NULL;
+   }
+
+   block->next = arena->blocks;
+   arena->blocks = block;
+
+   padding = -((uintptr_t)block->data) & (alignment - 1);
+   block->used = padding + size;
+
+   return block->data + padding;
+}
+
+char*
+pgexporter_arena_strdup(struct arena* arena, char* s)
+{
+   if (s == NULL)
+   {
+      return NULL;
+   }
+
+   return pgexporter_arena_strndup(arena, s, strlen(s));
+}
+
+char*
+pgexporter_arena_strndup(struct arena* arena, char* s, size_t length)
+{
+   char* result = NULL;
+
+   result = (char*)pgexporter_arena_alloc(arena, length + 1, 1);
+   if (result == NULL)
+   {
+      return NULL;
+   }
+
+   memcpy(result, s, length);
+   result[length] = '\0';
+
+   return result;
+}
+
+void
+pgexporter_arena_merge(struct arena* to, struct arena* from)
+{
+   struct arena_block* last = NULL;
+
+   if (from == NULL)
+   {
+      return;
+   }
+
+   if (to == NULL)
+   {
+      pgexporter_arena_destroy(from);
+      return;
+   }
+
+   if (from->blocks != NULL)
+   {
+      last = from->blocks;
+      while (last->next != NULL)
+      {
+         last = last->next;
+      }
+
+      // Keep the current block of the arena first, as it is the one being filled
+      if (to->blocks != NULL)
+      {
+         last->next = to->blocks->next;
+         to->blocks->next = from->blocks;
+      }
+      else
+      {
+         to->blocks = from->blocks;
+      }
+   }
+
+   pgexporter_memory_release(MEMORY_ARENA, from);
+}
+
+void
+pgexporter_arena_destroy(struct arena* arena)
+{
+   struct arena_block* block = NULL;
+   struct arena_block* next = NULL;
+
+   if (arena == NULL)
+   {
+      return;
+   }
+
+   block = arena->blocks;
+   while (block != NULL)
+   {
+      next = block->next;
+      pgexporter_memory_release(MEMORY_ARENA, block);
+      block = next;
+   }
+
+   pgexporter_memory_release(MEMORY_ARENA, arena);
+}
+
+static struct arena_block*
+arena_block_create(size_t size)
+{
+   struct arena_block* block = NULL;
+
+   block = (struct arena_block*)pgexporter_memory_alloc(MEMORY_ARENA, sizeof(struct arena_block) + size);
+   if (block == NULL)
+   {
+      return NULL;
+   }
+
+   block->next = NULL;
+   block->size = size;
+   block->used = 0;
+
+   return block;
+}
@@ -28,16 +28,28 @@
 
 #include <art.h>
 #include <json.h>
+#include <memory.h>
 #include <utils.h>
 
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define IS_LEAF(x) (((uintptr_t)(x) & 1))
 #define SET_LEAF(x) ((void*)((uintptr_t)(x) | 1))
 #define GET_LEAF(x) ((struct art_leaf*)((void*)((uintptr_t)(x) & ~1)))
 
+#define ART_ALIGNMENT    64
+#define ART_SLAB_SIZE    (64 * 1024)
+#define ART_LEAF_CLASSES 16
+#define ART_CLASSES      (4 + ART_LEAF_CLASSES)
+
 enum art_node_type {
    Node4,
    Node16,
@@ -117,9 +129,28 @@ struct art_node256
    struct art_node* children[256];
 } __attribute__ ((aligned (64)));
 
+/**
+ * A block of memory from which the nodes and the leaves of a tree are carved
+ */
+struct art_slab
+{
+   struct art_slab* next;                    /**< The next slab */
+   size_t used;                              /**< The number of bytes handed out */
+} __attribute__ ((aligned (64)));
+
+/**
+ * The memory of a tree. A node or a leaf that is freed goes onto the free list of its size class,
+ * and all of the slabs are released at once with the tree
+ */
+struct art_pool
+{
+   struct art_slab* slabs;                   /**< The slabs, the newest first */
+   void* free[ART_CLASSES];                  /**< The free lists of the size classes */
+};
+
 struct to_string_param
 {
-   char* str;
+   struct builder str;
    int indent;
    uint64_t cnt;
    char* tag;
@@ -134,26 +165,76 @@ static struct art_leaf*
 node_get_minimum(struct art_node* node);
 
 static void
-create_art_leaf(struct art_leaf** leaf, unsigned char* key, uint32_t key_len, uintptr_t value, enum value_type type, struct value_config* config);
+create_art_leaf(struct art* t, struct art_leaf** leaf, unsigned char* key, uint32_t key_len, uintptr_t value, enum value_type type, struct value_config* config);
 
 static void
-create_art_node(struct art_node** node, enum art_node_type type);
+create_art_node(struct art* t, struct art_node** node, enum art_node_type type);
 
 static void
-create_art_node4(struct art_node4** node);
+create_art_node4(struct art* t, struct art_node4** node);
 
 static void
-create_art_node16(struct art_node16** node);
+create_art_node16(struct art* t, struct art_node16** node);
 
 static void
-create_art_node48(struct art_node48** node);
+create_art_node48(struct art* t, struct art_node48** node);
 
 static void
-create_art_node256(struct art_node256** node);
+create_art_node256(struct art* t, struct art_node256** node);
 
 // Destroy ART nodes/leaves recursively
 static void
-destroy_art_node(struct art_node* node);
+destroy_art_node(struct art* t, struct art_node* node);
+
+/**
+ * Allocate a block of a size class of the pool of a tree
+ * @param t The tree
+ * @param size_class The size class
+ * @param size The size of the block
+ * @return The block, or NULL
+ */
+static void*
+art_alloc(struct art* t, int size_class, size_t size);
+
+/**
+ * Return a block to the free list of its size class
+ * @param t The tree
+ * @param size_class The size class
+ * @param block The block
+ */
+static void
+art_free(struct art* t, int size_class, void* block);
+
+/**
+ * Return an inner node to the pool of a tree
+ * @param t The tree
+ * @param node The node
+ */
+static void
+art_free_node(struct art* t, struct art_node* node);
+
+/**
+ * Return a leaf to the pool of a tree, or free it when it is too large for the pool
+ * @param t The tree
+ * @param leaf The leaf
+ */
+static void
+art_free_leaf(struct art* t, struct art_leaf* leaf);
+
+/**
+ * Get the size class of a leaf
+ * @param key_len The length of the key
+ * @return The size class, or -1 when the leaf is too large for the pool
+ */
+static int
+art_leaf_class(uint32_t key_len);
+
+/**
+ * Release all of the slabs of a tree
+ * @param t The tree
+ */
+static void
+art_pool_release(struct art* t);
 
 static int
 art_iterate(struct art* t, art_callback cb, void* data);
@@ -204,6 +285,35 @@ leaf_match(struct art_leaf* leaf, unsigned char* key, uint32_t key_len);
 static int
 find_index(unsigned char ch, const unsigned char* keys, int length);
 
+/**
+ * Find the position of a key byte in a node4
+ * @param node The node
+ * @param ch The key byte
+ * @return The index of the child, or -1 if it doesn't exist
+ */
+static int
+node4_find_child(struct art_node4* node, unsigned char ch);
+
+/**
+ * Find the position of a key byte in a node16, comparing all the keys at once when SSE2 or NEON is available
+ * @param node The node
+ * @param ch The key byte
+ * @return The index of the child, or -1 if it doesn't exist
+ */
+static int
+node16_find_child(struct art_node16* node, unsigned char ch);
+
+/**
+ * Build a subtree from a range of sorted and distinct keys
+ * @param entries The entries
+ * @param number_of_entries The number of entries
+ * @param depth The depth of the subtree
+ * @param type The value type
+ * @return The subtree
+ */
+static struct art_node*
+art_build(struct art* t, struct art_entry* entries, int number_of_entries, uint32_t depth, enum value_type type);
+
 /**
  * Insert a value into a node recursively, adopting lazy expansion and path compression --
  * Expand the leaf, or split inner node should keys diverge within node's prefix range
@@ -219,7 +329,7 @@ find_index(unsigned char ch, const unsigned char* keys, int length);
  * @return Old value if the key exists, otherwise NULL
  */
 static struct value*
-art_node_insert(struct art_node* node, struct art_node** node_ref, uint32_t depth, unsigned char* key, uint32_t key_len, uintptr_t value, enum value_type type, struct value_config* config, bool* new);
+art_node_insert(struct art* t, struct art_node* node, struct art_node** node_ref, uint32_t depth, unsigned char* key, uint32_t key_len, uintptr_t value, enum value_type type, struct value_config* config, bool* new);
 
 /**
  * Delete a value from a node recursively.
@@ -231,13 +341,64 @@ art_node_insert(struct art_node* node, struct art_node** node_ref, uint32_t dept
  * @return Deleted value if the key exists, otherwise NULL
  */
 static struct art_leaf*
-art_node_delete(struct art_node* node, struct art_node** node_ref, uint32_t depth, unsigned char* key, uint32_t key_len);
+art_node_delete(struct art* t, struct art_node* node, struct art_node** node_ref, uint32_t depth, unsigned char* key, uint32_t key_len);
+
+/**
+ * Push a node onto the stack of an iterator
+ * @param iter The iterator
+ * @param node The node
+ * @return 0 upon success, otherwise 1
+ */
+static int
+iterator_push(struct art_iterator* iter, struct art_node* node);
 
+/**
+ * Push the children of a node onto the stack of an iterator, the largest first,
+ * such that the smallest is visited first
+ * @param iter The iterator
+ * @param node The node
+ * @param above Only push the children with a key byte above this one, or -1 for all of them
+ * @return 0 upon success, otherwise 1
+ */
 static int
-art_node_iterate(struct art_node* node, art_callback cb, void* data);
+iterator_push_children(struct art_iterator* iter, struct art_node* node, int above);
+
+/**
+ * Expand the top of the stack of an iterator until it is the next leaf
+ * @param iter The iterator
+ */
+static void
+iterator_descend(struct art_iterator* iter);
+
+/**
+ * Push the subtree of the keys starting with a prefix
+ * @param iter The iterator
+ * @param prefix The prefix
+ * @param length The length of the prefix
+ */
+static void
+iterator_seek_prefix(struct art_iterator* iter, unsigned char* prefix, uint32_t length);
+
+/**
+ * Push the subtrees of the keys from a key onwards
+ * @param iter The iterator
+ * @param start The key
+ */
+static void
+iterator_seek_start(struct art_iterator* iter, unsigned char* start);
+
+/**
+ * Get a byte of the prefix of a node, also beyond the part stored in the node
+ * @param node The node
+ * @param depth The depth of the node
+ * @param i The index in the prefix
+ * @return The byte
+ */
+static unsigned char
+node_prefix_byte(struct art_node* node, uint32_t depth, uint32_t i);
 
 static void
-node_add_child(struct art_node* node, struct art_node** node_ref, unsigned char ch, void* child);
+node_add_child(struct art* t, struct art_node* node, struct art_node** node_ref, unsigned char ch, void* child);
 
 /**
  * Add a child to the node. The function assumes node is not NULL,
@@ -250,13 +411,13 @@ node_add_child(struct art_node* node, struct art_node** node_ref, unsigned char
  * @param child The child
  */
 static void
-node4_add_child(struct art_node4* node, struct art_node** node_ref, unsigned char ch, void* child);
+node4_add_child(struct art* t, struct art_node4* node, struct art_node** node_ref, unsigned char ch, void* child);
 
 static void
-node16_add_child(struct art_node16* node, struct art_node** node_ref, unsigned char ch, void* child);
+node16_add_child(struct art* t, struct art_node16* node, struct art_node** node_ref, unsigned char ch, void* child);
 
 static void
-node48_add_child(struct art_node48* node, struct art_node** node_ref, unsigned char ch, void* child);
+node48_add_child(struct art* t, struct art_node48* node, struct art_node** node_ref, unsigned char ch, void* child);
 
 static void
 node256_add_child(struct art_node256* node, unsigned char ch, void* child);
@@ -265,19 +426,19 @@ node256_add_child(struct art_node256* node, unsigned char ch, void* child);
 // They also do not free the leaf node for bookkeeping purpose. The key insight is that due to path compression,
 // no node will have only one child, if node has only one child after deletion, it merges with this child
 static void
-node_remove_child(struct art_node* node, struct art_node** node_ref, unsigned char ch);
+node_remove_child(struct art* t, struct art_node* node, struct art_node** node_ref, unsigned char ch);
 
 static void
-node4_remove_child(struct art_node4* node, struct art_node** node_ref, unsigned char ch);
+node4_remove_child(struct art* t, struct art_node4* node, struct art_node** node_ref, unsigned char ch);
 
 static void
-node16_remove_child(struct art_node16* node, struct art_node** node_ref, unsigned char ch);
+node16_remove_child(struct art* t, struct art_node16* node, struct art_node** node_ref, unsigned char ch);
 
 static void
-node48_remove_child(struct art_node48* node, struct art_node** node_ref, unsigned char ch);
+node48_remove_child(struct art* t, struct art_node48* node, struct art_node** node_ref, unsigned char ch);
 
 static void
-node256_remove_child(struct art_node256* node, struct art_node** node_ref, unsigned char ch);
+node256_remove_child(struct art* t, struct art_node256* node, struct art_node** node_ref, unsigned char ch);
 
 static void
 copy_header(struct art_node* dest, struct art_node* src);
@@ -310,9 +471,20 @@ int
 pgexporter_art_create(struct art** tree)
 {
    struct art* t = NULL;
-   t = malloc(sizeof(struct art));
+   *tree = NULL;
+   t = pgexporter_memory_alloc(MEMORY_ART, sizeof(struct art));
+   if (t == NULL)
+   {
+      return 1;
+   }
    t->size = 0;
    t->root = NULL;
+   t->pool = pgexporter_memory_calloc(MEMORY_ART, 1, sizeof(struct art_pool));
+   if (t->pool == NULL)
+   {
+      pgexporter_memory_release(MEMORY_ART, t);
+      return 1;
+   }
    *tree = t;
    return 0;
 }
@@ -324,8 +496,10 @@ pgexporter_art_destroy(struct art* tree)
    {
       return 0;
    }
-   destroy_art_node(tree->root);
-   free(tree);
+   destroy_art_node(tree, tree->root);
+   art_pool_release(tree);
+   pgexporter_memory_release(MEMORY_ART, tree->pool);
+   pgexporter_memory_release(MEMORY_ART, tree);
    return 0;
 }
 
@@ -361,7 +535,7 @@ pgexporter_art_insert(struct art* t, char* key, uintptr_t value, enum value_type
       // c'mon, at least create a tree first...
       goto error;
    }
-   old_val = art_node_insert(t->root, &t->root, 0, (unsigned char*)key, strlen(key) + 1, value, type, NULL, &new);
+   old_val = art_node_insert(t, t->root, &t->root, 0, (unsigned char*)key, strlen(key) + 1, value, type, NULL, &new);
    pgexporter_value_destroy(old_val);
    if (new)
    {
@@ -381,7 +555,7 @@ pgexporter_art_insert_with_config(struct art* t, char* key, uintptr_t value, str
    {
       goto error;
    }
-   old_val = art_node_insert(t->root, &t->root, 0, (unsigned char*)key, strlen(key) + 1, value, ValueRef, config, &new);
+   old_val = art_node_insert(t, t->root, &t->root, 0, (unsigned char*)key, strlen(key) + 1, value, ValueRef, config, &new);
    pgexporter_value_destroy(old_val);
    if (new)
    {
@@ -392,6 +566,48 @@ error:
    return 1;
 }
 
+int
+pgexporter_art_bulk_insert(struct art* t, struct art_entry* entries, int number_of_entries, enum value_type type)
+{
+   bool sorted = true;
+
+   if (t == NULL || (entries == NULL && number_of_entries > 0))
+   {
+      goto error;
+   }
+
+   for (int i = 1; sorted && i < number_of_entries; i++)
+   {
+      if (strcmp(entries[i - 1].key, entries[i].key) >= 0)
+      {
+         sorted = false;
+      }
+   }
+
+   // Only an empty tree can be built directly, anything else takes the keys one by one
+   if (t->root != NULL || !sorted)
+   {
+      for (int i = 0; i < number_of_entries; i++)
+      {
+         if (pgexporter_art_insert(t, entries[i].key, entries[i].value, type))
+         {
+            goto error;
+         }
+      }
+      return 0;
+   }
+
+   if (number_of_entries > 0)
+   {
+      t->root = art_build(t, entries, number_of_entries, 0, type);
+      t->size = number_of_entries;
+   }
+
+   return 0;
+error:
+   return 1;
+}
+
 int
 pgexporter_art_delete(struct art* t, char* key)
 {
@@ -400,10 +616,14 @@ pgexporter_art_delete(struct art* t, char* key)
    {
       return 1;
    }
-   l = art_node_delete(t->root, &t->root, 0, (unsigned char*)key, strlen(key) + 1);
+   l = art_node_delete(t, t->root, &t->root, 0, (unsigned char*)key, strlen(key) + 1);
+   if (l == NULL)
+   {
+      return 0;
+   }
    t->size--;
    pgexporter_value_destroy(l->value);
-   free(l);
+   art_free_leaf(t, l);
    return 0;
 }
 
@@ -414,7 +634,8 @@ pgexporter_art_clear(struct art* t)
    {
       return 0;
    }
-   destroy_art_node(t->root);
+   destroy_art_node(t, t->root);
+   art_pool_release(t);
    t->root = NULL;
    t->size = 0;
    return 0;
@@ -449,10 +670,10 @@ min(uint32_t a, uint32_t b)
 }
 
 static void
-create_art_leaf(struct art_leaf** leaf, unsigned char* key, uint32_t key_len, uintptr_t value, enum value_type type, struct value_config* config)
+create_art_leaf(struct art* t, struct art_leaf** leaf, unsigned char* key, uint32_t key_len, uintptr_t value, enum value_type type, struct value_config* config)
 {
    struct art_leaf* l = NULL;
-   l = malloc(sizeof(struct art_leaf) + key_len);
+   l = art_alloc(t, art_leaf_class(key_len), sizeof(struct art_leaf) + key_len);
    memset(l, 0, sizeof(struct art_leaf) + key_len);
    if (config != NULL)
    {
@@ -469,14 +690,14 @@ create_art_leaf(struct art_leaf** leaf, unsigned char* key, uint32_t key_len, ui
 }
 
 static void
-create_art_node(struct art_node** node, enum art_node_type type)
+create_art_node(struct art* t, struct art_node** node, enum art_node_type type)
 {
    struct art_node* n = NULL;
    switch (type)
    {
       case Node4:
       {
-         struct art_node4* n4 = malloc(sizeof(struct art_node4));
+         struct art_node4* n4 = art_alloc(t, Node4, sizeof(struct art_node4));
          memset(n4, 0, sizeof(struct art_node4));
          n4->node.type = Node4;
          n = (struct art_node*) n4;
@@ -484,7 +705,7 @@ create_art_node(struct art_node** node, enum art_node_type type)
       }
       case Node16:
       {
-         struct art_node16* n16 = malloc(sizeof(struct art_node16));
+         struct art_node16* n16 = art_alloc(t, Node16, sizeof(struct art_node16));
          memset(n16, 0, sizeof(struct art_node16));
          n16->node.type = Node16;
          n = (struct art_node*) n16;
@@ -492,7 +713,7 @@ create_art_node(struct art_node** node, enum art_node_type type)
       }
       case Node48:
       {
-         struct art_node48* n48 = malloc(sizeof(struct art_node48));
+         struct art_node48* n48 = art_alloc(t, Node48, sizeof(struct art_node48));
          memset(n48, 0, sizeof(struct art_node48));
          n48->node.type = Node48;
          n = (struct art_node*) n48;
@@ -500,7 +721,7 @@ create_art_node(struct art_node** node, enum art_node_type type)
       }
       case Node256:
       {
-         struct art_node256* n256 = malloc(sizeof(struct art_node256));
+         struct art_node256* n256 = art_alloc(t, Node256, sizeof(struct art_node256));
          memset(n256, 0, sizeof(struct art_node256));
          n256->node.type = Node256;
          n = (struct art_node*) n256;
@@ -511,48 +732,53 @@ create_art_node(struct art_node** node, enum art_node_type type)
 }
 
 static void
-create_art_node4(struct art_node4** node)
+create_art_node4(struct art* t, struct art_node4** node)
 {
    struct art_node* n = NULL;
-   create_art_node(&n, Node4);
+   create_art_node(t, &n, Node4);
    *node = (struct art_node4*)n;
 }
 
 static void
-create_art_node16(struct art_node16** node)
+create_art_node16(struct art* t, struct art_node16** node)
 {
    struct art_node* n = NULL;
-   create_art_node(&n, Node16);
+   create_art_node(t, &n, Node16);
    *node = (struct art_node16*)n;
 }
 
 static void
-create_art_node48(struct art_node48** node)
+create_art_node48(struct art* t, struct art_node48** node)
 {
    struct art_node* n = NULL;
-   create_art_node(&n, Node48);
+   create_art_node(t, &n, Node48);
    *node = (struct art_node48*)n;
 }
 
 static void
-create_art_node256(struct art_node256** node)
+create_art_node256(struct art* t, struct art_node256** node)
 {
    struct art_node* n = NULL;
-   create_art_node(&n, Node256);
+   create_art_node(t, &n, Node256);
    *node = (struct art_node256*)n;
 }
 
 static void
-destroy_art_node(struct art_node* node)
+destroy_art_node(struct art* t, struct art_node* node)
 {
    if (node == NULL)
    {
       return;
    }
+   // The nodes and the pooled leaves are released with their slabs, so only the values
+   // and the leaves too large for the pool are freed one by one
    if (IS_LEAF(node))
    {
       pgexporter_value_destroy(GET_LEAF(node)->value);
-      free(GET_LEAF(node));
+      if (art_leaf_class(GET_LEAF(node)->key_len) == -1)
+      {
+         pgexporter_memory_release(MEMORY_ART, GET_LEAF(node));
+      }
       return;
    }
    switch (node->type)
@@ -562,7 +788,7 @@ destroy_art_node(struct art_node* node)
          struct art_node4* n = (struct art_node4*) node;
          for (int i = 0; i < node->num_children; i++)
          {
-            destroy_art_node(n->children[i]);
+            destroy_art_node(t, n->children[i]);
          }
          break;
       }
@@ -571,7 +797,7 @@ destroy_art_node(struct art_node* node)
          struct art_node16* n = (struct art_node16*) node;
          for (int i = 0; i < node->num_children; i++)
          {
-            destroy_art_node(n->children[i]);
+            destroy_art_node(t, n->children[i]);
          }
          break;
       }
@@ -585,7 +811,7 @@ destroy_art_node(struct art_node* node)
             {
                continue;
             }
-            destroy_art_node(n->children[idx - 1]);
+            destroy_art_node(t, n->children[idx - 1]);
          }
          break;
       }
@@ -599,12 +825,109 @@ destroy_art_node(struct art_node* node)
             {
                continue;
             }
-            destroy_art_node(n->children[i]);
+            destroy_art_node(t, n->children[i]);
          }
          break;
       }
    }
-   free(node);
+}
+
+static void*
+art_alloc(struct art* t, int size_class, size_t size)
+{
+   void* block = NULL;
+   struct art_slab* slab = NULL;
+   struct art_pool* pool = t->pool;
+
+   if (size_class == -1)
+   {
+      return pgexporter_memory_aligned(MEMORY_ART, ART_ALIGNMENT, (size + ART_ALIGNMENT - 1) & ~(size_t)(ART_ALIGNMENT - 1));
+   }
+
+   if (pool->free[size_class] != NULL)
+   {
+      block = pool->free[size_class];
+      pool->free[size_class] = *(void**)block;
+      return block;
+   }
+
+   size = (size + ART_ALIGNMENT - 1) & ~(size_t)(ART_ALIGNMENT - 1);
+
+   slab = pool->slabs;
+   if (slab == NULL || slab->used + size > ART_SLAB_SIZE)
+   {
+      slab = pgexporter_memory_aligned(MEMORY_ART, ART_ALIGNMENT, ART_SLAB_SIZE);
+      if (slab == NULL)
+      {
+         return NULL;
+      }
+      slab->next = pool->slabs;
+      slab->used = sizeof(struct art_slab);
+      pool->slabs = slab;
+   }
+
+   block = (char*)slab + slab->used;
+   slab->used += size;
+
+   return block;
+}
+
+static void
+art_free(struct art* t, int size_class, void* block)
+{
+   struct art_pool* pool = t->pool;
+
+   if (size_class == -1)
+   {
+      pgexporter_memory_release(MEMORY_ART, block);
+      return;
+   }
+
+   *(void**)block = pool->free[size_class];
+   pool->free[size_class] = block;
+}
+
+static void
+art_free_node(struct art* t, struct art_node* node)
+{
+   art_free(t, node->type, node);
+}
+
+static void
+art_free_leaf(struct art* t, struct art_leaf* leaf)
+{
+   art_free(t, art_leaf_class(leaf->key_len), leaf);
+}
+
+static int
+art_leaf_class(uint32_t key_len)
+{
+   size_t blocks = (sizeof(struct art_leaf) + key_len + ART_ALIGNMENT - 1) / ART_ALIGNMENT;
+
+   if (blocks > ART_LEAF_CLASSES)
+   {
+      return -1;
+   }
+
+   return 4 + (int)blocks - 1;
+}
+
+static void
+art_pool_release(struct art* t)
+{
+   struct art_slab* slab = NULL;
+   struct art_slab* next = NULL;
+   struct art_pool* pool = t->pool;
+
+   slab = pool->slabs;
+   while (slab != NULL)
+   {
+      next = slab->next;
+      pgexporter_memory_release(MEMORY_ART, slab);
+      slab = next;
+   }
+
+   memset(pool, 0, sizeof(struct art_pool));
 }
 
 static struct art_node**
@@ -615,8 +938,8 @@ node_get_child(struct art_node* node, unsigned char ch)
       case Node4:
       {
          struct art_node4* n = (struct art_node4*)node;
-         int idx = find_index(ch, n->keys, n->node.num_children);
-         if (idx == -1 || n->keys[idx] != ch)
+         int idx = node4_find_child(n, ch);
+         if (idx == -1)
          {
             goto error;
          }
@@ -625,8 +948,8 @@ node_get_child(struct art_node* node, unsigned char ch)
       case Node16:
       {
          struct art_node16* n = (struct art_node16*)node;
-         int idx = find_index(ch, n->keys, n->node.num_children);
-         if (idx == -1 || n->keys[idx] != ch)
+         int idx = node16_find_child(n, ch);
+         if (idx == -1)
          {
             goto error;
          }
@@ -652,7 +975,7 @@ error:
 }
 
 static struct value*
-art_node_insert(struct art_node* node, struct art_node** node_ref, uint32_t depth, unsigned char* key, uint32_t key_len, uintptr_t value, enum value_type type, struct value_config* config, bool* new)
+art_node_insert(struct art* t, struct art_node* node, struct art_node** node_ref, uint32_t depth, unsigned char* key, uint32_t key_len, uintptr_t value, enum value_type type, struct value_config* config, bool* new)
 {
    struct art_leaf* leaf = NULL;
    struct art_leaf* min_leaf = NULL;
@@ -666,7 +989,7 @@ art_node_insert(struct art_node* node, struct art_node** node_ref, uint32_t dept
    {
       // Lazy expansion, skip creating an inner node since it currently will have only this one leaf.
       // We will compare keys when reach leaf anyway, the path doesn't need to 100% match the key along the way
-      create_art_leaf(&leaf, key, key_len, value, type, config);
+      create_art_leaf(t, &leaf, key, key_len, value, type, config);
       *node_ref = SET_LEAF(leaf);
       *new = true;
       return NULL;
@@ -688,8 +1011,8 @@ art_node_insert(struct art_node* node, struct art_node** node_ref, uint32_t dept
       // we compare with the existing key in the left most leaf and find an exact diverging point to split the node (see details below).
       // This way we inductively guarantee that all children to a parent share the same prefix even if it's only partially stored
       leaf_key = GET_LEAF(node)->key;
-      create_art_node(&new_node, Node4);
-      create_art_leaf(&leaf, key, key_len, value, type, config);
+      create_art_node(t, &new_node, Node4);
+      create_art_leaf(t, &leaf, key, key_len, value, type, config);
       // Get the diverging index after point of depth
       for (idx = depth; idx < min(key_len, GET_LEAF(node)->key_len); idx++)
       {
@@ -704,8 +1027,8 @@ art_node_insert(struct art_node* node, struct art_node** node_ref, uint32_t dept
       }
       new_node->prefix_len = idx - depth;
       depth += new_node->prefix_len;
-      node_add_child(new_node, &new_node, key[depth], SET_LEAF(leaf));
-      node_add_child(new_node, &new_node, leaf_key[depth], (void*)node);
+      node_add_child(t, new_node, &new_node, key[depth], SET_LEAF(leaf));
+      node_add_child(t, new_node, &new_node, leaf_key[depth], (void*)node);
       // replace with new node
       *node_ref = new_node;
       *new = true;
@@ -730,8 +1053,8 @@ art_node_insert(struct art_node* node, struct art_node** node_ref, uint32_t dept
    if (diff_len < node->prefix_len)
    {
       // case 2, split the node
-      create_art_node(&new_node, Node4);
-      create_art_leaf(&leaf, key, key_len, value, type, config);
+      create_art_node(t, &new_node, Node4);
+      create_art_leaf(t, &leaf, key, key_len, value, type, config);
       new_node->prefix_len = diff_len;
       memcpy(new_node->prefix, node->prefix, min(MAX_PREFIX_LEN, diff_len));
       // We need to know if new bytes that were once outside the partial prefix range will now come into the range
@@ -740,8 +1063,8 @@ art_node_insert(struct art_node* node, struct art_node** node_ref, uint32_t dept
       if (node->prefix_len <= MAX_PREFIX_LEN)
       {
          node->prefix_len = node->prefix_len - (diff_len + 1);
-         node_add_child(new_node, &new_node, key[depth + diff_len], SET_LEAF(leaf));
-         node_add_child(new_node, &new_node, node->prefix[diff_len], node);
+         node_add_child(t, new_node, &new_node, key[depth + diff_len], SET_LEAF(leaf));
+         node_add_child(t, new_node, &new_node, node->prefix[diff_len], node);
          // Update node's prefix info since we move it downwards
          // The first diverging character serves as the key byte in keys array,
          // so we don't duplicate store it in the prefix.
@@ -755,8 +1078,8 @@ art_node_insert(struct art_node* node, struct art_node** node_ref, uint32_t dept
       {
          node->prefix_len = node->prefix_len - (diff_len + 1);
          min_leaf = node_get_minimum(node);
-         node_add_child(new_node, &new_node, key[depth + diff_len], SET_LEAF(leaf));
-         node_add_child(new_node, &new_node, min_leaf->key[depth + diff_len], node);
+         node_add_child(t, new_node, &new_node, key[depth + diff_len], SET_LEAF(leaf));
+         node_add_child(t, new_node, &new_node, min_leaf->key[depth + diff_len], node);
          // node is moved downwards
          memmove(node->prefix, min_leaf->key + depth + diff_len + 1, min(MAX_PREFIX_LEN, node->prefix_len));
       }
@@ -777,13 +1100,13 @@ art_node_insert(struct art_node* node, struct art_node** node_ref, uint32_t dept
          {
             node->num_children++;
          }
-         return art_node_insert(*next, next, depth + 1, key, key_len, value, type, config, new);
+         return art_node_insert(t, *next, next, depth + 1, key, key_len, value, type, config, new);
       }
       else
       {
          // add a child to current node since the spot is available
-         create_art_leaf(&leaf, key, key_len, value, type, config);
-         node_add_child(node, node_ref, key[depth], SET_LEAF(leaf));
+         create_art_leaf(t, &leaf, key, key_len, value, type, config);
+         node_add_child(t, node, node_ref, key[depth], SET_LEAF(leaf));
          *new = true;
          return NULL;
       }
@@ -791,7 +1114,7 @@ art_node_insert(struct art_node* node, struct art_node** node_ref, uint32_t dept
 }
 
 static struct art_leaf*
-art_node_delete(struct art_node* node, struct art_node** node_ref, uint32_t depth, unsigned char* key, uint32_t key_len)
+art_node_delete(struct art* t, struct art_node* node, struct art_node** node_ref, uint32_t depth, unsigned char* key, uint32_t key_len)
 {
    struct art_leaf* l = NULL;
    struct art_node** child = NULL;
@@ -834,7 +1157,7 @@ art_node_delete(struct art_node* node, struct art_node** node_ref, uint32_t dept
          if (leaf_match(GET_LEAF(*child), key, key_len))
          {
             l = GET_LEAF(*child);
-            node_remove_child(node, node_ref, key[depth]);
+            node_remove_child(t, node, node_ref, key[depth]);
             return l;
          }
          else
@@ -844,111 +1167,24 @@ art_node_delete(struct art_node* node, struct art_node** node_ref, uint32_t dept
       }
       else
       {
-         return art_node_delete(*child, child, depth + 1, key, key_len);
-      }
-   }
-}
-
-static int
-art_node_iterate(struct art_node* node, art_callback cb, void* data)
-{
-   struct art_leaf* l = NULL;
-   struct art_node* child = NULL;
-   int idx = 0;
-   int res = 0;
-   if (node == NULL)
-   {
-      return 0;
-   }
-   if (IS_LEAF(node))
-   {
-      l = GET_LEAF(node);
-      return cb(data, (char*)l->key, l->value);
-   }
-   switch (node->type)
-   {
-      case Node4:
-      {
-         struct art_node4* n = (struct art_node4*) node;
-         for (int i = 0; i < node->num_children; i++)
-         {
-            child = n->children[i];
-            res = art_node_iterate(child, cb, data);
-            if (res)
-            {
-               return res;
-            }
-         }
-         break;
-      }
-      case Node16:
-      {
-         struct art_node16* n = (struct art_node16*) node;
-         for (int i = 0; i < node->num_children; i++)
-         {
-            child = n->children[i];
-            res = art_node_iterate(child, cb, data);
-            if (res)
-            {
-               return res;
-            }
-         }
-         break;
-      }
-      case Node48:
-      {
-         struct art_node48* n = (struct art_node48*) node;
-         for (int i = 0; i < 256; i++)
-         {
-            idx = n->keys[i];
-            if (idx == 0)
-            {
-               continue;
-            }
-            child = n->children[idx - 1];
-            res = art_node_iterate(child, cb, data);
-            if (res)
-            {
-               return res;
-            }
-         }
-         break;
-      }
-      case Node256:
-      {
-         struct art_node256* n = (struct art_node256*) node;
-         for (int i = 0; i < 256; i++)
-         {
-            if (n->children[i] == NULL)
-            {
-               continue;
-            }
-            child = n->children[i];
-            res = art_node_iterate(child, cb, data);
-            if (res)
-            {
-               return res;
-            }
-         }
-         break;
+         return art_node_delete(t, *child, child, depth + 1, key, key_len);
       }
    }
-   return 0;
 }
 
 static void
-node_add_child(struct art_node* node, struct art_node** node_ref, unsigned char ch, void* child)
+node_add_child(struct art* t, struct art_node* node, struct art_node** node_ref, unsigned char ch, void* child)
 {
    switch (node->type)
    {
       case Node4:
-         node4_add_child((struct art_node4*) node, node_ref, ch, child);
+         node4_add_child(t, (struct art_node4*) node, node_ref, ch, child);
          break;
       case Node16:
-         node16_add_child((struct art_node16*) node, node_ref, ch, child);
+         node16_add_child(t, (struct art_node16*) node, node_ref, ch, child);
          break;
       case Node48:
-         node48_add_child((struct art_node48*) node, node_ref, ch, child);
+         node48_add_child(t, (struct art_node48*) node, node_ref, ch, child);
          break;
       case Node256:
          node256_add_child((struct art_node256*) node, ch, child);
@@ -957,7 +1193,7 @@ node_add_child(struct art_node* node, struct art_node** node_ref, unsigned char
 }
 
 static void
-node4_add_child(struct art_node4* node, struct art_node** node_ref, unsigned char ch, void* child)
+node4_add_child(struct art* t, struct art_node4* node, struct art_node** node_ref, unsigned char ch, void* child)
 {
    if (node->node.num_children < 4)
    {
@@ -974,20 +1210,20 @@ node4_add_child(struct art_node4* node, struct art_node** node_ref, unsigned cha
    {
       // expand
       struct art_node16* new_node = NULL;
-      create_art_node16(&new_node);
+      create_art_node16(t, &new_node);
       copy_header((struct art_node*)new_node, (struct art_node*)node);
       memcpy(new_node->children, node->children, node->node.num_children * sizeof(void*));
       memcpy(new_node->keys, node->keys, node->node.num_children);
       // replace the node through node reference
       *node_ref = (struct art_node*)new_node;
-      free(node);
+      art_free_node(t, (struct art_node*)node);
 
-      node16_add_child(new_node, node_ref, ch, child);
+      node16_add_child(t, new_node, node_ref, ch, child);
    }
 }
 
 static void
-node16_add_child(struct art_node16* node, struct art_node** node_ref, unsigned char ch, void* child)
+node16_add_child(struct art* t, struct art_node16* node, struct art_node** node_ref, unsigned char ch, void* child)
 {
    if (node->node.num_children < 16)
    {
@@ -1004,7 +1240,7 @@ node16_add_child(struct art_node16* node, struct art_node** node_ref, unsigned c
    {
       // expand
       struct art_node48* new_node = NULL;
-      create_art_node48(&new_node);
+      create_art_node48(t, &new_node);
       copy_header((struct art_node*)new_node, (struct art_node*)node);
       memcpy(new_node->children, node->children, node->node.num_children * sizeof(void*));
       for (int i = 0; i < node->node.num_children; i++)
@@ -1013,13 +1249,13 @@ node16_add_child(struct art_node16* node, struct art_node** node_ref, unsigned c
       }
       // replace the node through node reference
       *node_ref = (struct art_node*)new_node;
-      free(node);
-      node48_add_child(new_node, node_ref, ch, child);
+      art_free_node(t, (struct art_node*)node);
+      node48_add_child(t, new_node, node_ref, ch, child);
    }
 }
 
 static void
-node48_add_child(struct art_node48* node, struct art_node** node_ref, unsigned char ch, void* child)
+node48_add_child(struct art* t, struct art_node48* node, struct art_node** node_ref, unsigned char ch, void* child)
 {
    if (node->node.num_children < 48)
    {
@@ -1037,7 +1273,7 @@ node48_add_child(struct art_node48* node, struct art_node** node_ref, unsigned c
    {
       // expand
       struct art_node256* new_node = NULL;
-      create_art_node256(&new_node);
+      create_art_node256(t, &new_node);
       copy_header((struct art_node*)new_node, (struct art_node*)node);
       for (int i = 0; i < 256; i++)
       {
@@ -1049,7 +1285,7 @@ node48_add_child(struct art_node48* node, struct art_node** node_ref, unsigned c
       }
       // replace the node through node reference
       *node_ref = (struct art_node*)new_node;
-      free(node);
+      art_free_node(t, (struct art_node*)node);
       node256_add_child(new_node, ch, child);
    }
 }
@@ -1098,25 +1334,183 @@ find_index(unsigned char ch, const unsigned char* keys, int length)
    return -1;
 }
 
-static void
-copy_header(struct art_node* dest, struct art_node* src)
+static int
+node4_find_child(struct art_node4* node, unsigned char ch)
 {
-   dest->num_children = src->num_children;
-   dest->prefix_len = src->prefix_len;
-   memcpy(dest->prefix, src->prefix, min(MAX_PREFIX_LEN, src->prefix_len));
+   for (int i = 0; i < node->node.num_children; i++)
+   {
+      if (node->keys[i] == ch)
+      {
+         return i;
+      }
+   }
+   return -1;
 }
 
-static uint32_t
-check_prefix_partial(struct art_node* node, unsigned char* key, uint32_t depth, uint32_t key_len)
+static int
+node16_find_child(struct art_node16* node, unsigned char ch)
 {
-   uint32_t len = 0;
-   uint32_t max_cmp = min(min(node->prefix_len, MAX_PREFIX_LEN), key_len - depth);
-   while (len < max_cmp && key[depth + len] == node->prefix[len])
+#if defined(__SSE2__)
+   __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char)ch), _mm_loadu_si128((__m128i*)node->keys));
+   // The keys after num_children are left over from removed children
+   int mask = _mm_movemask_epi8(cmp) & ((1 << node->node.num_children) - 1);
+   if (mask == 0)
    {
-      len++;
+      return -1;
    }
-   return len;
-}
+   return __builtin_ctz(mask);
+#elif defined(__ARM_NEON)
+   uint8x16_t cmp = vceqq_u8(vdupq_n_u8(ch), vld1q_u8(node->keys));
+   // NEON has no movemask, so narrow each byte of the comparison to 4 bits
+   uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4)), 0);
+   if (node->node.num_children < 16)
+   {
+      mask &= (1ULL << (node->node.num_children * 4)) - 1;
+   }
+   if (mask == 0)
+   {
+      return -1;
+   }
+   return __builtin_ctzll(mask) >> 2;
+#else
+   int idx = find_index(ch, node->keys, node->node.num_children);
+   if (idx == -1 || node->keys[idx] != ch)
+   {
+      return -1;
+   }
+   return idx;
+#endif
+}
+
+static struct art_node*
+art_build(struct art* t, struct art_entry* entries, int number_of_entries, uint32_t depth, enum value_type type)
+{
+   int groups = 0;
+   int start = 0;
+   uint32_t prefix_len = 0;
+   uint32_t first_len = 0;
+   uint32_t last_len = 0;
+   unsigned char* first = NULL;
+   unsigned char* last = NULL;
+   struct art_leaf* leaf = NULL;
+   struct art_node* node = NULL;
+   struct art_node* child = NULL;
+
+   first = (unsigned char*)entries[0].key;
+   first_len = strlen(entries[0].key) + 1;
+
+   if (number_of_entries == 1)
+   {
+      create_art_leaf(t, &leaf, first, first_len, entries[0].value, type, NULL);
+      return SET_LEAF(leaf);
+   }
+
+   // The keys are sorted, so the prefix of the first and the last key is shared by all of them.
+   // They are distinct and include their terminator, so they diverge before either one ends
+   last = (unsigned char*)entries[number_of_entries - 1].key;
+   last_len = strlen(entries[number_of_entries - 1].key) + 1;
+   while (depth + prefix_len < min(first_len, last_len) && first[depth + prefix_len] == last[depth + prefix_len])
+   {
+      prefix_len++;
+   }
+
+   for (int i = 0; i < number_of_entries; i++)
+   {
+      if (i == 0 || entries[i].key[depth + prefix_len] != entries[i - 1].key[depth + prefix_len])
+      {
+         groups++;
+      }
+   }
+
+   // The node is created with its final size, so it never grows
+   if (groups <= 4)
+   {
+      create_art_node(t, &node, Node4);
+   }
+   else if (groups <= 16)
+   {
+      create_art_node(t, &node, Node16);
+   }
+   else if (groups <= 48)
+   {
+      create_art_node(t, &node, Node48);
+   }
+   else
+   {
+      create_art_node(t, &node, Node256);
+   }
+
+   node->prefix_len = prefix_len;
+   memcpy(node->prefix, first + depth, min(MAX_PREFIX_LEN, prefix_len));
+
+   for (int i = 1; i <= number_of_entries; i++)
+   {
+      unsigned char ch = (unsigned char)entries[start].key[depth + prefix_len];
+
+      if (i < number_of_entries && (unsigned char)entries[i].key[depth + prefix_len] == ch)
+      {
+         continue;
+      }
+
+      child = art_build(t, entries + start, i - start, depth + prefix_len + 1, type);
+
+      switch (node->type)
+      {
+         case Node4:
+         {
+            struct art_node4* n = (struct art_node4*)node;
+            n->keys[node->num_children] = ch;
+            n->children[node->num_children] = child;
+            break;
+         }
+         case Node16:
+         {
+            struct art_node16* n = (struct art_node16*)node;
+            n->keys[node->num_children] = ch;
+            n->children[node->num_children] = child;
+            break;
+         }
+         case Node48:
+         {
+            struct art_node48* n = (struct art_node48*)node;
+            n->keys[ch] = node->num_children + 1;
+            n->children[node->num_children] = child;
+            break;
+         }
+         case Node256:
+         {
+            struct art_node256* n = (struct art_node256*)node;
+            n->children[ch] = child;
+            break;
+         }
+      }
+      node->num_children++;
+
+      start = i;
+   }
+
+   return node;
+}
+
+static void
+copy_header(struct art_node* dest, struct art_node* src)
+{
+   dest->num_children = src->num_children;
+   dest->prefix_len = src->prefix_len;
+   memcpy(dest->prefix, src->prefix, min(MAX_PREFIX_LEN, src->prefix_len));
+}
+
+static uint32_t
+check_prefix_partial(struct art_node* node, unsigned char* key, uint32_t depth, uint32_t key_len)
+{
+   uint32_t len = 0;
+   uint32_t max_cmp = min(min(node->prefix_len, MAX_PREFIX_LEN), key_len - depth);
+   while (len < max_cmp && key[depth + len] == node->prefix[len])
+   {
+      len++;
+   }
+   return len;
+}
 
 static uint32_t
 check_prefix(struct art_node* node, unsigned char* key, uint32_t depth, uint32_t key_len)
@@ -1209,27 +1603,27 @@ node_get_minimum(struct art_node* node)
 }
 
 static void
-node_remove_child(struct art_node* node, struct art_node** node_ref, unsigned char ch)
+node_remove_child(struct art* t, struct art_node* node, struct art_node** node_ref, unsigned char ch)
 {
    switch (node->type)
    {
       case Node4:
-         node4_remove_child((struct art_node4*)node, node_ref, ch);
+         node4_remove_child(t, (struct art_node4*)node, node_ref, ch);
          break;
       case Node16:
-         node16_remove_child((struct art_node16*)node, node_ref, ch);
+         node16_remove_child(t, (struct art_node16*)node, node_ref, ch);
          break;
       case Node48:
-         node48_remove_child((struct art_node48*)node, node_ref, ch);
+         node48_remove_child(t, (struct art_node48*)node, node_ref, ch);
          break;
       case Node256:
-         node256_remove_child((struct art_node256*)node, node_ref, ch);
+         node256_remove_child(t, (struct art_node256*)node, node_ref, ch);
          break;
    }
 }
 
 static void
-node4_remove_child(struct art_node4* node, struct art_node** node_ref, unsigned char ch)
+node4_remove_child(struct art* t, struct art_node4* node, struct art_node** node_ref, unsigned char ch)
 {
    int idx = 0;
    uint32_t len = 0;
@@ -1246,6 +1640,7 @@ node4_remove_child(struct art_node4* node, struct art_node** node_ref, unsigned
       {
          // replace directly
          *node_ref = child;
+         art_free_node(t, (struct art_node*)node);
          return;
       }
       // parent prefix bytes + byte index to child + child prefix bytes
@@ -1262,14 +1657,14 @@ node4_remove_child(struct art_node4* node, struct art_node** node_ref, unsigned
       }
       child->prefix_len = node->node.prefix_len + 1 + child->prefix_len;
       memcpy(child->prefix, node->node.prefix, min(child->prefix_len, MAX_PREFIX_LEN));
-      free(node);
+      art_free_node(t, (struct art_node*)node);
       // replace
       *node_ref = child;
    }
 }
 
 static void
-node16_remove_child(struct art_node16* node, struct art_node** node_ref, unsigned char ch)
+node16_remove_child(struct art* t, struct art_node16* node, struct art_node** node_ref, unsigned char ch)
 {
    int idx = 0;
    struct art_node4* new_node = NULL;
@@ -1281,17 +1676,17 @@ node16_remove_child(struct art_node16* node, struct art_node** node_ref, unsigne
    // Trick from libart, do not downgrade immediately to avoid jumping on 4/5 boundary
    if (node->node.num_children <= 3)
    {
-      create_art_node4(&new_node);
+      create_art_node4(t, &new_node);
       copy_header((struct art_node*)new_node, (struct art_node*)node);
       memcpy(new_node->keys, node->keys, node->node.num_children);
       memcpy(new_node->children, node->children, node->node.num_children * sizeof(void*));
-      free(node);
+      art_free_node(t, (struct art_node*)node);
       *node_ref = (struct art_node*)new_node;
    }
 }
 
 static void
-node48_remove_child(struct art_node48* node, struct art_node** node_ref, unsigned char ch)
+node48_remove_child(struct art* t, struct art_node48* node, struct art_node** node_ref, unsigned char ch)
 {
    int idx = node->keys[ch];
    int cnt = 0;
@@ -1302,7 +1697,7 @@ node48_remove_child(struct art_node48* node, struct art_node** node_ref, unsigne
 
    if (node->node.num_children <= 12)
    {
-      create_art_node16(&new_node);
+      create_art_node16(t, &new_node);
       copy_header((struct art_node*)new_node, (struct art_node*)node);
       for (int i = 0; i < 256; i++)
       {
@@ -1313,13 +1708,13 @@ node48_remove_child(struct art_node48* node, struct art_node** node_ref, unsigne
             cnt++;
          }
       }
-      free(node);
+      art_free_node(t, (struct art_node*)node);
       *node_ref = (struct art_node*)new_node;
    }
 }
 
 static void
-node256_remove_child(struct art_node256* node, struct art_node** node_ref, unsigned char ch)
+node256_remove_child(struct art* t, struct art_node256* node, struct art_node** node_ref, unsigned char ch)
 {
    int num = 0;
    for (int i = 0; i < 48; i++)
@@ -1340,7 +1735,7 @@ node256_remove_child(struct art_node256* node, struct art_node** node_ref, unsig
 
    if (node->node.num_children <= 37)
    {
-      create_art_node48(&new_node);
+      create_art_node48(t, &new_node);
       copy_header((struct art_node*)new_node, (struct art_node*)node);
       for (int i = 0; i < 256; i++)
       {
@@ -1351,25 +1746,62 @@ node256_remove_child(struct art_node256* node, struct art_node** node_ref, unsig
             cnt++;
          }
       }
-      free(node);
+      art_free_node(t, (struct art_node*)node);
       *node_ref = (struct art_node*)new_node;
    }
 }
 
 int
 pgexporter_art_iterator_create(struct art* t, struct art_iterator** iter)
+{
+   return pgexporter_art_iterator_create_range(t, NULL, NULL, iter);
+}
+
+int
+pgexporter_art_iterator_create_prefix(struct art* t, char* prefix, struct art_iterator** iter)
+{
+   struct art_iterator* i = NULL;
+   if (t == NULL || prefix == NULL)
+   {
+      return 1;
+   }
+   i = pgexporter_memory_calloc(MEMORY_ART, 1, sizeof(struct art_iterator));
+   if (i == NULL)
+   {
+      return 1;
+   }
+   i->tree = t;
+   iterator_seek_prefix(i, (unsigned char*)prefix, strlen(prefix));
+   *iter = i;
+   return 0;
+}
+
+int
+pgexporter_art_iterator_create_range(struct art* t, char* start, char* end, struct art_iterator** iter)
 {
    struct art_iterator* i = NULL;
    if (t == NULL)
    {
       return 1;
    }
-   i = malloc(sizeof(struct art_iterator));
-   i->count = 0;
+   i = pgexporter_memory_calloc(MEMORY_ART, 1, sizeof(struct art_iterator));
+   if (i == NULL)
+   {
+      return 1;
+   }
    i->tree = t;
-   i->key = NULL;
-   i->value = NULL;
-   pgexporter_deque_create(false, &i->que);
+   if (end != NULL)
+   {
+      i->end = strdup(end);
+   }
+   if (start != NULL)
+   {
+      iterator_seek_start(i, (unsigned char*)start);
+   }
+   else if (t->root != NULL)
+   {
+      iterator_push(i, t->root);
+   }
    *iter = i;
    return 0;
 }
@@ -1377,120 +1809,257 @@ pgexporter_art_iterator_create(struct art* t, struct art_iterator** iter)
 bool
 pgexporter_art_iterator_next(struct art_iterator* iter)
 {
-   struct deque* que = NULL;
-   struct art* tree = NULL;
-   struct art_node* node = NULL;
-   struct art_node* child = NULL;
-   int idx = 0;
-   if (iter == NULL || iter->que == NULL || iter->tree == NULL || iter->count == iter->tree->size)
+   struct art_leaf* leaf = NULL;
+   if (!pgexporter_art_iterator_has_next(iter))
    {
       return false;
    }
-   que = iter->que;
-   tree = iter->tree;
-   if (iter->count == 0)
+   leaf = GET_LEAF(iter->stack[--iter->top]);
+   // The next subtree is loaded while the caller works on this leaf
+   if (iter->top > 0)
    {
-      pgexporter_deque_add(que, NULL, (uintptr_t)tree->root, ValueRef);
+      __builtin_prefetch(GET_LEAF(iter->stack[iter->top - 1]));
    }
-   while (!pgexporter_deque_empty(que))
+   iter->count++;
+   iter->key = (char*)leaf->key;
+   iter->value = leaf->value;
+   return true;
+}
+
+bool
+pgexporter_art_iterator_has_next(struct art_iterator* iter)
+{
+   if (iter == NULL || iter->tree == NULL)
    {
-      node = (struct art_node*)pgexporter_deque_poll(que, NULL);
-      if (IS_LEAF(node))
+      return false;
+   }
+   iterator_descend(iter);
+   if (iter->top == 0)
+   {
+      return false;
+   }
+   if (iter->end != NULL && strcmp((char*)GET_LEAF(iter->stack[iter->top - 1])->key, iter->end) >= 0)
+   {
+      iter->top = 0;
+      return false;
+   }
+   return true;
+}
+
+void
+pgexporter_art_iterator_remove(struct art_iterator* iter)
+{
+   if (iter == NULL || iter->tree == NULL || iter->key == NULL)
+   {
+      return;
+   }
+
+   // The stack only holds nodes that haven't been visited, which a delete doesn't move
+   pgexporter_art_delete(iter->tree, iter->key);
+   iter->key = NULL;
+   iter->value = NULL;
+   iter->count--;
+}
+
+void
+pgexporter_art_iterator_destroy(struct art_iterator* iter)
+{
+   if (iter == NULL)
+   {
+      return;
+   }
+   pgexporter_memory_release(MEMORY_ART, iter->stack);
+   free(iter->end);
+   pgexporter_memory_release(MEMORY_ART, iter);
+}
+
+static int
+iterator_push(struct art_iterator* iter, struct art_node* node)
+{
+   struct art_node** stack = NULL;
+   if (iter->top == iter->capacity)
+   {
+      stack = pgexporter_memory_realloc(MEMORY_ART, iter->stack, (iter->capacity == 0 ? 64 : iter->capacity * 2) * sizeof(struct art_node*));
+      if (stack == NULL)
       {
-         iter->count++;
-         iter->key = (char*)GET_LEAF(node)->key;
-         iter->value = GET_LEAF(node)->value;
-         return true;
+         return 1;
       }
-      switch (node->type)
+      iter->stack = stack;
+      iter->capacity = iter->capacity == 0 ? 64 : iter->capacity * 2;
+   }
+   iter->stack[iter->top++] = node;
+   return 0;
+}
+
+static int
+iterator_push_children(struct art_iterator* iter, struct art_node* node, int above)
+{
+   switch (node->type)
+   {
+      case Node4:
       {
-         case Node4:
+         struct art_node4* n = (struct art_node4*) node;
+         for (int i = node->num_children - 1; i >= 0 && n->keys[i] > above; i--)
          {
-            struct art_node4* n = (struct art_node4*) node;
-            for (int i = 0; i < node->num_children; i++)
+            if (iterator_push(iter, n->children[i]))
             {
-               child = n->children[i];
-               pgexporter_deque_add(que, NULL, (uintptr_t)child, ValueRef);
+               return 1;
             }
-            break;
          }
-         case Node16:
+         break;
+      }
+      case Node16:
+      {
+         struct art_node16* n = (struct art_node16*) node;
+         for (int i = node->num_children - 1; i >= 0 && n->keys[i] > above; i--)
          {
-            struct art_node16* n = (struct art_node16*) node;
-            for (int i = 0; i < node->num_children; i++)
+            if (iterator_push(iter, n->children[i]))
             {
-               child = n->children[i];
-               pgexporter_deque_add(que, NULL, (uintptr_t)child, ValueRef);
+               return 1;
             }
-            break;
          }
-         case Node48:
+         break;
+      }
+      case Node48:
+      {
+         struct art_node48* n = (struct art_node48*) node;
+         for (int i = 255; i > above; i--)
          {
-            struct art_node48* n = (struct art_node48*) node;
-            for (int i = 0; i < 256; i++)
+            if (n->keys[i] != 0 && iterator_push(iter, n->children[n->keys[i] - 1]))
             {
-               idx = n->keys[i];
-               if (idx == 0)
-               {
-                  continue;
-               }
-               child = n->children[idx - 1];
-               pgexporter_deque_add(que, NULL, (uintptr_t)child, ValueRef);
+               return 1;
             }
-            break;
          }
-         case Node256:
+         break;
+      }
+      case Node256:
+      {
+         struct art_node256* n = (struct art_node256*) node;
+         for (int i = 255; i > above; i--)
          {
-            struct art_node256* n = (struct art_node256*) node;
-            for (int i = 0; i < 256; i++)
+            if (n->children[i] != NULL && iterator_push(iter, n->children[i]))
             {
-               if (n->children[i] == NULL)
-               {
-                  continue;
-               }
-               child = n->children[i];
-               pgexporter_deque_add(que, NULL, (uintptr_t)child, ValueRef);
+               return 1;
             }
-            break;
          }
+         break;
       }
    }
-   return false;
+   return 0;
 }
 
-bool
-pgexporter_art_iterator_has_next(struct art_iterator* iter)
+static void
+iterator_descend(struct art_iterator* iter)
 {
-   if (iter == NULL || iter->tree == NULL)
+   struct art_node* node = NULL;
+   while (iter->top > 0 && !IS_LEAF(iter->stack[iter->top - 1]))
    {
-      return false;
+      node = iter->stack[--iter->top];
+      if (iterator_push_children(iter, node, -1))
+      {
+         iter->top = 0;
+         return;
+      }
    }
-   return iter->count < iter->tree->size;
 }
 
-void
-pgexporter_art_iterator_remove(struct art_iterator* iter)
+static void
+iterator_seek_prefix(struct art_iterator* iter, unsigned char* prefix, uint32_t length)
 {
-   if (iter == NULL || iter->tree == NULL || iter->key == NULL)
+   uint32_t depth = 0;
+   struct art_leaf* leaf = NULL;
+   struct art_node* node = iter->tree->root;
+   struct art_node** child = NULL;
+   while (node != NULL)
    {
-      return;
+      if (IS_LEAF(node))
+      {
+         leaf = GET_LEAF(node);
+         if (leaf->key_len > length && memcmp(leaf->key, prefix, length) == 0)
+         {
+            iterator_push(iter, node);
+         }
+         return;
+      }
+      for (uint32_t i = 0; i < node->prefix_len && depth + i < length; i++)
+      {
+         if (node_prefix_byte(node, depth, i) != prefix[depth + i])
+         {
+            return;
+         }
+      }
+      // The prefix ends within the node, so all of its keys match
+      if (depth + node->prefix_len >= length)
+      {
+         iterator_push(iter, node);
+         return;
+      }
+      depth += node->prefix_len;
+      child = node_get_child(node, prefix[depth]);
+      if (child == NULL)
+      {
+         return;
+      }
+      node = *child;
+      depth++;
    }
+}
 
-   pgexporter_art_delete(iter->tree, iter->key);
-   iter->key = NULL;
-   iter->value = NULL;
-   iter->count--;
+static void
+iterator_seek_start(struct art_iterator* iter, unsigned char* start)
+{
+   uint32_t depth = 0;
+   unsigned char b;
+   struct art_node* node = iter->tree->root;
+   struct art_node** child = NULL;
+   while (node != NULL)
+   {
+      if (IS_LEAF(node))
+      {
+         if (strcmp((char*)GET_LEAF(node)->key, (char*)start) >= 0)
+         {
+            iterator_push(iter, node);
+         }
+         return;
+      }
+      // A prefix byte is never the terminator, so the walk stops before the end of the key
+      for (uint32_t i = 0; i < node->prefix_len; i++)
+      {
+         b = node_prefix_byte(node, depth, i);
+         if (b > start[depth + i])
+         {
+            iterator_push(iter, node);
+            return;
+         }
+         if (b < start[depth + i])
+         {
+            return;
+         }
+      }
+      depth += node->prefix_len;
+      // The larger children are visited after the subtree of the key byte
+      if (iterator_push_children(iter, node, start[depth]))
+      {
+         return;
+      }
+      child = node_get_child(node, start[depth]);
+      if (child == NULL)
+      {
+         return;
+      }
+      node = *child;
+      depth++;
+   }
 }
 
-void
-pgexporter_art_iterator_destroy(struct art_iterator* iter)
+static unsigned char
+node_prefix_byte(struct art_node* node, uint32_t depth, uint32_t i)
 {
-   if (iter == NULL)
+   if (i < MAX_PREFIX_LEN)
    {
-      return;
+      return node->prefix[i];
    }
-   pgexporter_deque_destroy(iter->que);
-   free(iter);
+   return node_get_minimum(node)->key[depth + i];
 }
 
 void
@@ -1563,8 +2132,8 @@ art_to_json_string_cb(void* param, const char* key, struct value* value)
    tag = pgexporter_append(tag, ": ");
    str = pgexporter_value_to_string(value, FORMAT_JSON, tag, p->indent);
    free(tag);
-   p->str = pgexporter_append(p->str, str);
-   p->str = pgexporter_append(p->str, has_next ? ",\n" : "\n");
+   pgexporter_builder_append(&p->str, str);
+   pgexporter_builder_append(&p->str, has_next ? ",\n" : "\n");
 
    free(str);
    return 0;
@@ -1587,8 +2156,8 @@ art_to_compact_json_string_cb(void* param, const char* key, struct value* value)
    tag = pgexporter_append(tag, ":");
    str = pgexporter_value_to_string(value, FORMAT_JSON_COMPACT, tag, p->indent);
    free(tag);
-   p->str = pgexporter_append(p->str, str);
-   p->str = pgexporter_append(p->str, has_next ? "," : "");
+   pgexporter_builder_append(&p->str, str);
+   pgexporter_builder_append(&p->str, has_next ? "," : "");
 
    free(str);
    return 0;
@@ -1622,7 +2191,7 @@ art_to_text_string_cb(void* param, const char* key, struct value* value)
          }
          else
          {
-            p->str = pgexporter_indent(p->str, tag, 0);
+            pgexporter_builder_indent(&p->str, tag, 0);
             str = pgexporter_value_to_string(value, FORMAT_TEXT, NULL, p->indent + INDENT_PER_LEVEL);
          }
       }
@@ -1636,8 +2205,8 @@ art_to_text_string_cb(void* param, const char* key, struct value* value)
       str = pgexporter_value_to_string(value, FORMAT_TEXT, tag, p->indent);
    }
    free(tag);
-   p->str = pgexporter_append(p->str, str);
-   p->str = pgexporter_append(p->str, has_next ? "\n" : "");
+   pgexporter_builder_append(&p->str, str);
+   pgexporter_builder_append(&p->str, has_next ? "\n" : "");
 
    free(str);
    return 0;
@@ -1646,79 +2215,84 @@ art_to_text_string_cb(void* param, const char* key, struct value* value)
 static char*
 to_json_string(struct art* t, char* tag, int indent)
 {
-   char* ret = NULL;
-   ret = pgexporter_indent(ret, tag, indent);
-   if (t == NULL || t->size == 0)
-   {
-      ret = pgexporter_append(ret, "{}");
-      return ret;
-   }
-   ret = pgexporter_append(ret, "{\n");
    struct to_string_param param = {
       .indent = indent + INDENT_PER_LEVEL,
-      .str = ret,
       .t = t,
       .cnt = 0,
    };
+   pgexporter_builder_init(&param.str, 0);
+   pgexporter_builder_indent(&param.str, tag, indent);
+   if (t == NULL || t->size == 0)
+   {
+      pgexporter_builder_append(&param.str, "{}");
+      return pgexporter_builder_detach(&param.str);
+   }
+   pgexporter_builder_append(&param.str, "{\n");
    art_iterate(t, art_to_json_string_cb, &param);
-   ret = param.str;
-   ret = pgexporter_indent(ret, NULL, indent);
-   ret = pgexporter_append(ret, "}");
-   return ret;
+   pgexporter_builder_indent(&param.str, NULL, indent);
+   pgexporter_builder_append(&param.str, "}");
+   return pgexporter_builder_detach(&param.str);
 }
 
 static char*
 to_compact_json_string(struct art* t, char* tag, int indent)
 {
-   char* ret = NULL;
-   ret = pgexporter_indent(ret, tag, indent);
-   if (t == NULL || t->size == 0)
-   {
-      ret = pgexporter_append(ret, "{}");
-      return ret;
-   }
-   ret = pgexporter_append(ret, "{");
    struct to_string_param param = {
       .indent = indent,
-      .str = ret,
       .t = t,
       .cnt = 0,
    };
+   pgexporter_builder_init(&param.str, 0);
+   pgexporter_builder_indent(&param.str, tag, indent);
+   if (t == NULL || t->size == 0)
+   {
+      pgexporter_builder_append(&param.str, "{}");
+      return pgexporter_builder_detach(&param.str);
+   }
+   pgexporter_builder_append(&param.str, "{");
    art_iterate(t, art_to_compact_json_string_cb, &param);
-   ret = param.str;
-   ret = pgexporter_append(ret, "}");
-   return ret;
+   pgexporter_builder_append(&param.str, "}");
+   return pgexporter_builder_detach(&param.str);
 }
 
 static char*
 to_text_string(struct art* t, char* tag, int indent)
 {
-   char* ret = NULL;
    int next_indent = indent;
+   struct to_string_param param = {
+      .t = t,
+      .cnt = 0,
+      .tag = tag
+   };
+   pgexporter_builder_init(&param.str, 0);
    if (tag != NULL && !pgexporter_compare_string(tag, BULLET_POINT))
    {
-      ret = pgexporter_indent(ret, tag, indent);
+      pgexporter_builder_indent(&param.str, tag, indent);
       next_indent += INDENT_PER_LEVEL;
    }
    if (t == NULL || t->size == 0)
    {
-      ret = pgexporter_append(ret, "{}");
-      return ret;
+      pgexporter_builder_append(&param.str, "{}");
+      return pgexporter_builder_detach(&param.str);
    }
-   struct to_string_param param = {
-      .indent = next_indent,
-      .str = ret,
-      .t = t,
-      .cnt = 0,
-      .tag = tag
-   };
+   param.indent = next_indent;
    art_iterate(t, art_to_text_string_cb, &param);
-   ret = param.str;
-   return ret;
+   return pgexporter_builder_detach(&param.str);
 }
 
 static int
 art_iterate(struct art* t, art_callback cb, void* data)
 {
-   return art_node_iterate(t->root, cb, data);
+   int res = 0;
+   struct art_iterator* iter = NULL;
+   if (pgexporter_art_iterator_create(t, &iter))
+   {
+      return 1;
+   }
+   while (res == 0 && pgexporter_art_iterator_next(iter))
+   {
+      res = cb(data, iter->key, iter->value);
+   }
+   pgexporter_art_iterator_destroy(iter);
+   return res;
 }
@@ -30,7 +30,10 @@
 #include <pgexporter.h>
 #include <art.h>
 #include <bridge.h>
+#include <cache.h>
+#include <cluster.h>
 #include <deque.h>
+#include <filter.h>
 #include <logging.h>
 #include <memory.h>
 #include <message.h>
@@ -40,10 +43,15 @@
 #include <security.h>
 #include <shmem.h>
 #include <stddef.h>
+#include <trace.h>
 #include <utils.h>
 
 /* system */
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -51,45 +59,98 @@
 
 #define CHUNK_SIZE 32768
 
+#define BRIDGE_CONTENT_TYPE "text/plain; charset=utf-8"
+
 #define PAGE_UNKNOWN 0
 #define PAGE_HOME    1
 #define PAGE_METRICS 2
 #define BAD_REQUEST  3
 
-static int resolve_page(struct message* msg);
+/**
+ * The shared state of the threads fetching the endpoints.
+ * Endpoints are handed out one at a time, and each endpoint
+ * is parsed into a bridge of its own
+ **/
+typedef struct bridge_task
+{
+   atomic_int next;
+   int number_of_endpoints;
+   struct prometheus_bridge** bridges;
+} bridge_task_t;
+
+/**
+ * The destinations of the JSON document while it is rendered
+ **/
+typedef struct bridge_json_output
+{
+   int client_fd; /* The client, or -1 */
+   bool cache;    /* The JSON cache is being rebuilt */
+} bridge_json_output_t;
+
+/* The bridges of the endpoints kept by the refresher */
+static struct prometheus_bridge* refresh_bridges[NUMBER_OF_ENDPOINTS];
+
+static int resolve_page(struct message* msg, struct metrics_filter* filter);
 static int badrequest_page(int client_fd);
 static int unknown_page(int client_fd);
 static int home_page(int client_fd);
-static int metrics_page(int client_fd);
+static int metrics_page(int client_fd, int encoding, struct metrics_filter* filter);
+static int filtered_page(int client_fd, struct metrics_filter* filter);
 static int bad_request(int client_fd);
 
 static int send_chunk(int client_fd, char* data);
 
 static bool is_bridge_cache_configured(void);
-static bool is_bridge_cache_valid(void);
-static bool bridge_cache_append(char* data);
+static bool bridge_cache_append(char* data, size_t length);
 static bool bridge_cache_finalize(void);
 static size_t bridge_cache_size_to_alloc(void);
-static void bridge_cache_invalidate(void);
 
 static bool is_bridge_json_cache_configured(void);
-static bool bridge_json_cache_set(char* data);
+static bool bridge_json_cache_begin(void);
+static void bridge_json_cache_finalize(bool complete);
+static int bridge_json_cb(char* data, size_t length, void* arg);
 static size_t bridge_json_cache_size_to_alloc(void);
 
+static int snapshot_page(int client_fd, int encoding);
+static void snapshot_publish(void);
+static int snapshot_append_cb(char* data, size_t length, void* arg);
+
 static void bridge_metrics(int client_fd);
-static void bridge_json_metrics(int client_fd);
+static int bridge_filtered_cb(char* data, size_t length, void* arg);
+static int bridge_metrics_cb(char* data, size_t length, void* arg);
+static void bridge_fetch(struct prometheus_bridge** bridges);
+static void* bridge_fetch_worker(void* arg);
+static void bridge_fetch_run(bridge_task_t* task);
+static void bridge_json_metrics(int client_fd, int encoding);
+static int bridge_json_live(int client_fd);
 
 void
 pgexporter_bridge(int client_fd)
 {
    int status;
-   int page;
-   struct message* msg = NULL;
-   struct configuration* config;
 
    pgexporter_start_logging();
    pgexporter_memory_init();
 
+   status = pgexporter_bridge_serve(client_fd);
+
+   pgexporter_disconnect(client_fd);
+
+   pgexporter_memory_destroy();
+   pgexporter_stop_logging();
+
+   exit(status);
+}
+
+int
+pgexporter_bridge_serve(int client_fd)
+{
+   int status;
+   int page;
+   struct message* msg = NULL;
+   struct metrics_filter filter;
+   struct configuration* config;
+
    config = (struct configuration*)shmem;
 
    status = pgexporter_read_timeout_message(
@@ -100,7 +161,7 @@ pgexporter_bridge(int client_fd)
       goto error;
    }
 
-   page = resolve_page(msg);
+   page = resolve_page(msg, &filter);
 
    if (page == PAGE_HOME)
    {
@@ -108,7 +169,7 @@ pgexporter_bridge(int client_fd)
    }
    else if (page == PAGE_METRICS)
    {
-      metrics_page(client_fd);
+      metrics_page(client_fd, pgexporter_cache_encoding(msg), &filter);
    }
    else if (page == PAGE_UNKNOWN)
    {
@@ -119,36 +180,42 @@ pgexporter_bridge(int client_fd)
       bad_request(client_fd);
    }
 
-   pgexporter_disconnect(client_fd);
-
-   pgexporter_memory_destroy();
-   pgexporter_stop_logging();
-
-   exit(0);
+   return 0;
 
 error:
 
    badrequest_page(client_fd);
 
+   return 1;
+}
+
+void
+pgexporter_bridge_json(int client_fd)
+{
+   int status;
+
+   pgexporter_start_logging();
+   pgexporter_memory_init();
+
+   status = pgexporter_bridge_json_serve(client_fd);
+
    pgexporter_disconnect(client_fd);
 
    pgexporter_memory_destroy();
    pgexporter_stop_logging();
 
-   exit(1);
+   exit(status);
 }
 
-void
-pgexporter_bridge_json(int client_fd)
+int
+pgexporter_bridge_json_serve(int client_fd)
 {
    int status;
    int page;
    struct message* msg = NULL;
+   struct metrics_filter filter;
    struct configuration* config;
 
-   pgexporter_start_logging();
-   pgexporter_memory_init();
-
    config = (struct configuration*)shmem;
 
    status = pgexporter_read_timeout_message(NULL, client_fd, config->authentication_timeout, &msg);
@@ -158,11 +225,12 @@ pgexporter_bridge_json(int client_fd)
       goto error;
    }
 
-   page = resolve_page(msg);
+   // The JSON document isn't filtered
+   page = resolve_page(msg, &filter);
 
    if (page == PAGE_HOME || page == PAGE_METRICS)
    {
-      bridge_json_metrics(client_fd);
+      bridge_json_metrics(client_fd, pgexporter_cache_encoding(msg));
    }
    else if (page == PAGE_UNKNOWN)
    {
@@ -173,31 +241,105 @@ pgexporter_bridge_json(int client_fd)
       bad_request(client_fd);
    }
 
-   pgexporter_disconnect(client_fd);
-
-   pgexporter_memory_destroy();
-   pgexporter_stop_logging();
-
-   exit(0);
+   return 0;
 
 error:
 
    badrequest_page(client_fd);
 
-   pgexporter_disconnect(client_fd);
+   return 1;
+}
 
-   pgexporter_memory_destroy();
-   pgexporter_stop_logging();
+int
+pgexporter_bridge_refresh(void)
+{
+   int next;
+   time_t start;
+   bool changed = false;
+   struct prometheus_bridge* bridges[NUMBER_OF_ENDPOINTS];
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+
+   start = time(NULL);
+
+   memset(bridges, 0, sizeof(bridges));
+
+   bridge_fetch(bridges);
+
+   for (int i = 0; i < config->number_of_endpoints; i++)
+   {
+      if (bridges[i] != NULL)
+      {
+         // The metrics of an endpoint are replaced as a whole
+         pgexporter_prometheus_client_destroy_bridge(refresh_bridges[i]);
+         refresh_bridges[i] = bridges[i];
+         changed = true;
+      }
+      else if (refresh_bridges[i] != NULL)
+      {
+         pgexporter_log_debug("Bridge: Keeping the last metrics of %s:%d",
+                              config->endpoints[i].host,
+                              config->endpoints[i].port);
+      }
+   }
+
+   if (changed)
+   {
+      snapshot_publish();
+   }
+
+   next = config->bridge_interval - (int)difftime(time(NULL), start);
+
+   return MAX(next, 1);
+}
+
+void
+pgexporter_bridge_refresh_destroy(void)
+{
+   for (int i = 0; i < NUMBER_OF_ENDPOINTS; i++)
+   {
+      pgexporter_prometheus_client_destroy_bridge(refresh_bridges[i]);
+      refresh_bridges[i] = NULL;
+   }
+}
+
+int
+pgexporter_bridge_init_snapshot(size_t* p_size, void** p_shmem)
+{
+   struct configuration* config;
+   size_t slot_size = 0;
+
+   config = (struct configuration*)shmem;
 
-   exit(1);
+   slot_size = config->bridge_cache_max_size > 0
+         ? MIN(config->bridge_cache_max_size, PROMETHEUS_MAX_BRIDGE_CACHE_SIZE)
+         : PROMETHEUS_DEFAULT_BRIDGE_CACHE_SIZE;
+
+   if (pgexporter_cache_create(slot_size, config->hugepage, p_size, p_shmem))
+   {
+      goto error;
+   }
+
+   return 0;
+
+error:
+   pgexporter_log_error("Cannot allocate shared memory for the bridge snapshot!");
+   *p_size = 0;
+   *p_shmem = NULL;
+
+   return 1;
 }
 
 static int
-resolve_page(struct message* msg)
+resolve_page(struct message* msg, struct metrics_filter* filter)
 {
    char* from = NULL;
+   char* query = NULL;
    int index;
 
+   memset(filter, 0, sizeof(struct metrics_filter));
+
    if (msg->length < 3 || strncmp((char*)msg->data, "GET", 3) != 0)
    {
       pgexporter_log_debug("Bridge: Not a GET request");
@@ -214,12 +356,24 @@ resolve_page(struct message* msg)
 
    pgexporter_write_byte(msg->data + index, '\0');
 
+   query = strchr(from, '?');
+   if (query != NULL)
+   {
+      *query = '\0';
+      query++;
+   }
+
    if (strcmp(from, "/") == 0 || strcmp(from, "/index.html") == 0)
    {
       return PAGE_HOME;
    }
    else if (strcmp(from, "/metrics") == 0)
    {
+      if (pgexporter_filter_parse(query, filter))
+      {
+         return BAD_REQUEST;
+      }
+
       return PAGE_METRICS;
    }
 
@@ -372,21 +526,34 @@ error:
 }
 
 static int
-metrics_page(int client_fd)
+metrics_page(int client_fd, int encoding, struct metrics_filter* filter)
 {
    char* data = NULL;
+   size_t length = 0;
+   bool locked = false;
    time_t start_time;
    int dt;
    char time_buf[32];
    int status;
    struct message msg;
    struct prometheus_cache* cache;
-   signed char cache_is_free;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
    cache = (struct prometheus_cache*)bridge_cache_shmem;
 
+   // The endpoints have no collectors, so only the names filter the bridge
+   if (filter->number_of_names > 0)
+   {
+      return filtered_page(client_fd, filter);
+   }
+
+   if (config->bridge_interval > 0 && bridge_snapshot_shmem != NULL &&
+       pgexporter_cache_available((struct prometheus_cache*)bridge_snapshot_shmem, false))
+   {
+      return snapshot_page(client_fd, encoding);
+   }
+
    memset(&msg, 0, sizeof(struct message));
 
    start_time = time(NULL);
@@ -395,138 +562,145 @@ metrics_page(int client_fd)
    ctime_r(&start_time, &time_buf[0]);
    time_buf[strlen(time_buf) - 1] = 0;
 
-retry_cache_locking:
-   cache_is_free = STATE_FREE;
-   if (atomic_compare_exchange_strong(&cache->lock, &cache_is_free, STATE_IN_USE))
+   if (is_bridge_cache_configured())
    {
       // Can we serve the message out of cache?
-      if (is_bridge_cache_configured() && is_bridge_cache_valid())
+      if (pgexporter_cache_available(cache, true))
+      {
+         goto cached;
+      }
+
+retry_cache_locking:
+      if (!pgexporter_cache_lock(cache))
       {
-         // serve the message directly out of the cache
-         pgexporter_log_debug("Serving bridge out of cache (%d/%d bytes valid until %lld)",
-                              strlen(cache->data),
-                              cache->size,
-                              cache->valid_until);
-
-         /* Header */
-         data = pgexporter_vappend(data, 7,
-                                   "HTTP/1.1 200 OK\r\n",
-                                   "Content-Type: text/plain; charset=utf-8\r\n",
-                                   "Date: ", &time_buf[0], "\r\n",
-                                   "Transfer-Encoding: chunked\r\n", "\r\n");
-
-         msg.kind = 0;
-         msg.length = strlen(data);
-         msg.data = data;
-
-         status = pgexporter_write_message(NULL, client_fd, &msg);
-         if (status != MESSAGE_STATUS_OK)
+         // Serve the last complete payload rather than waiting for the rebuild
+         if (pgexporter_cache_available(cache, false))
          {
-            goto error;
+            goto cached;
          }
 
-         free(data);
-         data = NULL;
-
-         /* Cache */
-         send_chunk(client_fd, cache->data);
-
-         /* Footer */
-         data = pgexporter_append(data, "0\r\n\r\n");
-
-         msg.kind = 0;
-         msg.length = strlen(data);
-         msg.data = data;
-
-         status = pgexporter_write_message(NULL, client_fd, &msg);
-         if (status != MESSAGE_STATUS_OK)
+         dt = (int)difftime(time(NULL), start_time);
+         if (dt >= (config->blocking_timeout > 0 ? config->blocking_timeout : 30))
          {
             goto error;
          }
 
-         free(data);
-         data = NULL;
+         /* Sleep for 10ms */
+         SLEEP_AND_GOTO(10000000L, retry_cache_locking);
       }
-      else
+
+      locked = true;
+
+      // Another scrape may have rebuilt the cache in the meantime
+      if (pgexporter_cache_available(cache, true))
       {
-         pgexporter_log_debug("Serving bridge fresh");
+         pgexporter_cache_unlock(cache);
+         locked = false;
+         goto cached;
+      }
 
-         bridge_cache_invalidate();
+      pgexporter_cache_begin(cache);
+   }
 
-         data = pgexporter_vappend(data, 7,
-                                   "HTTP/1.1 200 OK\r\n",
-                                   "Content-Type: text/plain; version=0.0.1; charset=utf-8\r\n",
-                                   "Date: ", &time_buf[0], "\r\n",
-                                   "Transfer-Encoding: chunked\r\n",
-                                   "\r\n");
+   pgexporter_log_debug("Serving bridge fresh");
 
-         msg.kind = 0;
-         msg.length = strlen(data);
-         msg.data = data;
+   data = pgexporter_vappend(data, 7,
+                             "HTTP/1.1 200 OK\r\n",
+                             "Content-Type: text/plain; version=0.0.1; charset=utf-8\r\n",
+                             "Date: ", &time_buf[0], "\r\n",
+                             "Transfer-Encoding: chunked\r\n",
+                             "\r\n");
 
-         status = pgexporter_write_message(NULL, client_fd, &msg);
-         if (status != MESSAGE_STATUS_OK)
-         {
-            goto error;
-         }
+   msg.kind = 0;
+   msg.length = strlen(data);
+   msg.data = data;
 
-         free(data);
-         data = NULL;
+   status = pgexporter_write_message(NULL, client_fd, &msg);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      goto error;
+   }
 
-         /* Metrics */
-         bridge_metrics(client_fd);
+   free(data);
+   data = NULL;
 
-         /* Footer */
-         data = pgexporter_append(data, "0\r\n\r\n");
+   /* Metrics */
+   bridge_metrics(client_fd);
 
-         msg.kind = 0;
-         msg.length = strlen(data);
-         msg.data = data;
+   /* Footer */
+   data = pgexporter_append(data, "0\r\n\r\n");
 
-         status = pgexporter_write_message(NULL, client_fd, &msg);
-         if (status != MESSAGE_STATUS_OK)
-         {
-            goto error;
-         }
-      }
+   msg.kind = 0;
+   msg.length = strlen(data);
+   msg.data = data;
 
-      // free the cache
-      atomic_store(&cache->lock, STATE_FREE);
+   status = pgexporter_write_message(NULL, client_fd, &msg);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      goto error;
    }
-   else
+
+   if (locked)
    {
-      dt = (int)difftime(time(NULL), start_time);
-      if (dt >= (config->blocking_timeout > 0 ? config->blocking_timeout : 30))
-      {
-         goto error;
-      }
+      // free the cache
+      pgexporter_cache_unlock(cache);
+   }
 
-      /* Sleep for 10ms */
-      SLEEP_AND_GOTO(10000000L, retry_cache_locking);
+   free(data);
+
+   return 0;
+
+cached:
+
+   status = pgexporter_cache_write(cache, false, encoding, BRIDGE_CONTENT_TYPE, NULL, client_fd, &length);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      goto error;
    }
 
+   pgexporter_log_debug("Served bridge out of cache (%zu/%zu bytes, generation %lu)",
+                        length,
+                        cache->size,
+                        atomic_load(&cache->generation));
+
    free(data);
 
    return 0;
 
 error:
 
+   if (locked)
+   {
+      pgexporter_cache_unlock(cache);
+   }
+
    free(data);
 
    return 1;
 }
 
+/**
+ * Fetch the endpoints, and send the metrics selected by a filter.
+ * The response is neither served from nor added to the cache and the snapshot
+ * @param client_fd The client descriptor
+ * @param filter The filter
+ * @return 0 upon success, otherwise 1
+ */
 static int
-bad_request(int client_fd)
+filtered_page(int client_fd, struct metrics_filter* filter)
 {
    char* data = NULL;
    time_t now;
    char time_buf[32];
    int status;
    struct message msg;
+   struct prometheus_bridge* bridges[NUMBER_OF_ENDPOINTS];
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
 
    memset(&msg, 0, sizeof(struct message));
-   memset(&data, 0, sizeof(data));
+   memset(bridges, 0, sizeof(bridges));
 
    now = time(NULL);
 
@@ -534,139 +708,140 @@ bad_request(int client_fd)
    ctime_r(&now, &time_buf[0]);
    time_buf[strlen(time_buf) - 1] = 0;
 
-   data = pgexporter_vappend(data, 4,
-                             "HTTP/1.1 400 Bad Request\r\n",
-                             "Date: ",
-                             &time_buf[0],
-                             "\r\n"
-                             );
+   data = pgexporter_vappend(data, 7,
+                             "HTTP/1.1 200 OK\r\n",
+                             "Content-Type: text/plain; version=0.0.1; charset=utf-8\r\n",
+                             "Date: ", &time_buf[0], "\r\n",
+                             "Transfer-Encoding: chunked\r\n",
+                             "\r\n");
 
    msg.kind = 0;
    msg.length = strlen(data);
    msg.data = data;
 
    status = pgexporter_write_message(NULL, client_fd, &msg);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      goto error;
+   }
 
    free(data);
+   data = NULL;
 
-   return status;
-}
-
-static int
-send_chunk(int client_fd, char* data)
-{
-   int status;
-   char* m = NULL;
-   struct message msg;
-
-   memset(&msg, 0, sizeof(struct message));
+   bridge_fetch(bridges);
 
-   m = malloc(20);
+   pgexporter_prometheus_client_render(bridges, config->number_of_endpoints,
+                                       bridge_filtered_cb, &client_fd,
+                                       NULL, NULL, filter);
 
-   if (m == NULL)
+   for (int i = 0; i < config->number_of_endpoints; i++)
    {
-      goto error;
+      pgexporter_prometheus_client_destroy_bridge(bridges[i]);
    }
 
-   memset(m, 0, 20);
-
-   sprintf(m, "%zX\r\n", strlen(data));
-
-   m = pgexporter_vappend(m, 2, data, "\r\n");
+   /* Footer */
+   data = pgexporter_append(data, "0\r\n\r\n");
 
    msg.kind = 0;
-   msg.length = strlen(m);
-   msg.data = m;
+   msg.length = strlen(data);
+   msg.data = data;
 
    status = pgexporter_write_message(NULL, client_fd, &msg);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      goto error;
+   }
 
-   free(m);
+   free(data);
 
-   return status;
+   return 0;
 
 error:
 
-   return MESSAGE_STATUS_ERROR;
+   free(data);
+
+   return 1;
 }
 
-/**
- * Checks if the Prometheus cache configuration setting
- * (`bridge_cache`) has a non-zero value, that means there
- * are seconds to cache the response.
- *
- * @return true if there is a cache configuration,
- *         false if no cache is active
- */
-static bool
-is_bridge_cache_configured(void)
+static int
+bad_request(int client_fd)
 {
-   struct configuration* config;
-
-   config = (struct configuration*)shmem;
+   char* data = NULL;
+   time_t now;
+   char time_buf[32];
+   int status;
+   struct message msg;
 
-   // cannot have caching if not set bridge!
-   if (config->bridge <= 0)
-   {
-      return false;
-   }
+   memset(&msg, 0, sizeof(struct message));
+   memset(&data, 0, sizeof(data));
 
-   return config->bridge_cache_max_age != PROMETHEUS_BRIDGE_CACHE_DISABLED &&
-          config->bridge_cache_max_size != PROMETHEUS_BRIDGE_CACHE_DISABLED;
+   now = time(NULL);
+
+   memset(&time_buf, 0, sizeof(time_buf));
+   ctime_r(&now, &time_buf[0]);
+   time_buf[strlen(time_buf) - 1] = 0;
+
+   data = pgexporter_vappend(data, 4,
+                             "HTTP/1.1 400 Bad Request\r\n",
+                             "Date: ",
+                             &time_buf[0],
+                             "\r\n"
+                             );
+
+   msg.kind = 0;
+   msg.length = strlen(data);
+   msg.data = data;
+
+   status = pgexporter_write_message(NULL, client_fd, &msg);
+
+   free(data);
+
+   return status;
+}
+
+static int
+send_chunk(int client_fd, char* data)
+{
+   return pgexporter_write_chunk(NULL, client_fd, data, strlen(data));
 }
 
 /**
- * Checks if the cache is still valid, and therefore can be
- * used to serve as a response.
- * A cache is considred valid if it has non-empty payload and
- * a timestamp in the future.
+ * Checks if the Prometheus cache configuration setting
+ * (`bridge_cache`) has a non-zero value, that means there
+ * are seconds to cache the response.
  *
- * @return true if the cache is still valid
+ * @return true if there is a cache configuration,
+ *         false if no cache is active
  */
 static bool
-is_bridge_cache_valid(void)
+is_bridge_cache_configured(void)
 {
-   time_t now;
-
-   struct prometheus_cache* cache;
+   struct configuration* config;
 
-   cache = (struct prometheus_cache*)bridge_cache_shmem;
+   config = (struct configuration*)shmem;
 
-   if (cache->valid_until == 0 || strlen(cache->data) == 0)
+   // cannot have caching if not set bridge!
+   if (config->bridge <= 0)
    {
       return false;
    }
 
-   now = time(NULL);
-   return now <= cache->valid_until;
+   return config->bridge_cache_max_age != PROMETHEUS_BRIDGE_CACHE_DISABLED &&
+          config->bridge_cache_max_size != PROMETHEUS_BRIDGE_CACHE_DISABLED;
 }
 
 int
 pgexporter_bridge_init_cache(size_t* p_size, void** p_shmem)
 {
-   struct prometheus_cache* cache;
    struct configuration* config;
-   size_t cache_size = 0;
-   size_t struct_size = 0;
 
    config = (struct configuration*)shmem;
 
-   // first of all, allocate the overall cache structure
-   cache_size = bridge_cache_size_to_alloc();
-   struct_size = sizeof(struct prometheus_cache);
-
-   if (pgexporter_create_shared_memory(struct_size + cache_size, config->hugepage, (void*) &cache))
+   if (pgexporter_cache_create(bridge_cache_size_to_alloc(), config->hugepage, p_size, p_shmem))
    {
       goto error;
    }
 
-   memset(cache, 0, struct_size + cache_size);
-   cache->valid_until = 0;
-   cache->size = cache_size;
-   atomic_init(&cache->lock, STATE_FREE);
-
-   // success! do the memory swap
-   *p_shmem = cache;
-   *p_size = cache_size + struct_size;
    return 0;
 
 error:
@@ -713,47 +888,25 @@ bridge_cache_size_to_alloc(void)
    return cache_size;
 }
 
-/**
- * Invalidates the cache.
- *
- * Requires the caller to hold the lock on the cache!
- *
- * Invalidating the cache means that the payload is zero-filled
- * and that the valid_until field is set to zero too.
- */
-static void
-bridge_cache_invalidate(void)
-{
-   struct prometheus_cache* cache;
-
-   cache = (struct prometheus_cache*)bridge_cache_shmem;
-
-   memset(cache->data, 0, cache->size);
-   cache->valid_until = 0;
-}
-
 /**
  * Appends data to the cache.
  *
  * Requires the caller to hold the lock on the cache!
  *
- * If the input data is empty, nothing happens.
  * The data is appended only if the cache does not overflows, that
  * means the current size of the cache plus the size of the data
  * to append does not exceed the current cache size.
- * If the cache overflows, the cache is flushed and marked
- * as invalid.
+ * If the cache overflows, the rebuild won't be served.
  * This makes safe to call this method along the workflow of
  * building the Prometheus response.
  *
- * @param data the string to append to the cache
+ * @param data the data to append to the cache
+ * @param length the length of the data
  * @return true on success
  */
 static bool
-bridge_cache_append(char* data)
+bridge_cache_append(char* data, size_t length)
 {
-   size_t origin_length = 0;
-   size_t append_length = 0;
    struct prometheus_cache* cache;
 
    cache = (struct prometheus_cache*)bridge_cache_shmem;
@@ -763,24 +916,7 @@ bridge_cache_append(char* data)
       return false;
    }
 
-   origin_length = strlen(cache->data);
-   append_length = strlen(data);
-   // need to append the data to the cache
-   if (origin_length + append_length >= cache->size)
-   {
-      // cannot append new data, so invalidate cache
-      pgexporter_log_warn("Cannot append %d bytes to the Prometheus cache because it will overflow the size of %d bytes (currently at %d bytes). HINT: try adjusting `bridge_cache_max_size`",
-                          append_length,
-                          cache->size,
-                          origin_length);
-      bridge_cache_invalidate();
-      return false;
-   }
-
-   // append the data to the data field
-   memcpy(cache->data + origin_length, data, append_length);
-   cache->data[origin_length + append_length + 1] = '\0';
-   return true;
+   return pgexporter_cache_append(cache, data, length);
 }
 
 /**
@@ -809,8 +945,19 @@ bridge_cache_finalize(void)
    }
 
    now = time(NULL);
-   cache->valid_until = now + config->bridge_cache_max_age;
-   return cache->valid_until > now;
+
+   if (!pgexporter_cache_publish(cache, now + config->bridge_cache_max_age))
+   {
+      if (cache->built > cache->size)
+      {
+         pgexporter_log_warn("Cannot cache %zu bytes because it will overflow the size of %zu bytes. The cache will grow for the next responses",
+                             cache->built,
+                             cache->size);
+      }
+      return false;
+   }
+
+   return true;
 }
 
 /**
@@ -840,30 +987,15 @@ is_bridge_json_cache_configured(void)
 int
 pgexporter_bridge_json_init_cache(size_t* p_size, void** p_shmem)
 {
-   struct prometheus_cache* cache;
    struct configuration* config;
-   size_t cache_size = 0;
-   size_t struct_size = 0;
 
    config = (struct configuration*)shmem;
 
-   // first of all, allocate the overall cache structure
-   cache_size = bridge_json_cache_size_to_alloc();
-   struct_size = sizeof(struct prometheus_cache);
-
-   if (pgexporter_create_shared_memory(struct_size + cache_size, config->hugepage, (void*) &cache))
+   if (pgexporter_cache_create(bridge_json_cache_size_to_alloc(), config->hugepage, p_size, p_shmem))
    {
       goto error;
    }
 
-   memset(cache, 0, struct_size + cache_size);
-   cache->valid_until = 0;
-   cache->size = cache_size;
-   atomic_init(&cache->lock, STATE_FREE);
-
-   // success! do the memory swap
-   *p_shmem = cache;
-   *p_size = cache_size + struct_size;
    return 0;
 
 error:
@@ -911,267 +1043,380 @@ bridge_json_cache_size_to_alloc(void)
 }
 
 /**
- * Set data to the cache.
+ * Starts a rebuild of the JSON cache.
  *
- * Requires the caller to hold the lock on the cache!
+ * If another rebuild holds the lock, it publishes
+ * data that is as recent, so nothing is done.
  *
- * @param data the string to append to the cache
- * @return true on success
+ * @return true if the cache is being rebuilt
  */
 static bool
-bridge_json_cache_set(char* data)
+bridge_json_cache_begin(void)
 {
    struct prometheus_cache* cache;
 
    cache = (struct prometheus_cache*)bridge_json_cache_shmem;
 
-   if (!is_bridge_json_cache_configured())
+   if (!is_bridge_json_cache_configured() || !pgexporter_cache_lock(cache))
    {
       return false;
    }
 
-   memset(cache->data, 0, cache->size);
+   pgexporter_cache_begin(cache);
 
-   if (strlen(data) < cache->size)
+   return true;
+}
+
+/**
+ * Ends a rebuild of the JSON cache, and publishes it if it is complete.
+ *
+ * @param complete true if the whole document has been appended
+ */
+static void
+bridge_json_cache_finalize(bool complete)
+{
+   struct prometheus_cache* cache;
+
+   cache = (struct prometheus_cache*)bridge_json_cache_shmem;
+
+   if (complete && !pgexporter_cache_publish(cache, 0) && cache->built > cache->size)
    {
-      memcpy(cache->data, data, strlen(data));
+      pgexporter_log_warn("Bridge/JSON: The data won't fit - %zu > %zu", cache->built, cache->size);
    }
-   else
+
+   pgexporter_cache_unlock(cache);
+}
+
+static int
+bridge_json_cb(char* data, size_t length, void* arg)
+{
+   bridge_json_output_t* output = (bridge_json_output_t*)arg;
+
+   if (output->cache)
    {
-      pgexporter_log_warn("Bridge/JSON: The data won't fit - %lld > %lld", strlen(data), cache->size);
+      pgexporter_cache_append((struct prometheus_cache*)bridge_json_cache_shmem, data, length);
    }
 
-   return true;
+   if (output->client_fd != -1 && send_chunk(output->client_fd, data) != MESSAGE_STATUS_OK)
+   {
+      return 1;
+   }
+
+   return 0;
 }
 
+static int
+snapshot_page(int client_fd, int encoding)
+{
+   size_t length = 0;
+   int status;
+   struct prometheus_cache* snapshot;
+
+   snapshot = (struct prometheus_cache*)bridge_snapshot_shmem;
+
+   status = pgexporter_cache_write(snapshot, false, encoding, BRIDGE_CONTENT_TYPE, NULL, client_fd, &length);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      return 1;
+   }
+
+   pgexporter_log_debug("Served bridge out of snapshot (%zu/%zu bytes, generation %lu)",
+                        length,
+                        snapshot->size,
+                        atomic_load(&snapshot->generation));
+
+   return 0;
+}
+
+/**
+ * Renders the bridges of the refresher into the slot of the snapshot
+ * that isn't served, and makes it the served one.
+ *
+ * Only the metrics of the endpoints refreshed since the last publish are
+ * rendered, the others are concatenated as they were.
+ * If the metrics don't fit, the previous snapshot is still served.
+ */
 static void
-bridge_metrics(int client_fd)
+snapshot_publish(void)
 {
-   time_t start_time;
-   int dt;
-   signed char cache_is_free;
-   signed char cache_json_is_free;
-   char* data = NULL;
-   struct prometheus_bridge* bridge = NULL;
-   struct art_iterator* metrics_iterator = NULL;
-   struct prometheus_cache* cache;
-   struct prometheus_cache* cache_json;
-   struct configuration* config = NULL;
+   bool locked = false;
+   bool complete = false;
+   bridge_json_output_t json;
+   struct prometheus_cache* snapshot;
+   struct configuration* config;
 
    config = (struct configuration*)shmem;
-   cache = (struct prometheus_cache*)bridge_cache_shmem;
-   cache_json = (struct prometheus_cache*)bridge_json_cache_shmem;
+   snapshot = (struct prometheus_cache*)bridge_snapshot_shmem;
+
+   json.client_fd = -1;
+   json.cache = bridge_json_cache_begin();
 
-   if (pgexporter_prometheus_client_create_bridge(&bridge))
+   if (snapshot != NULL && pgexporter_cache_lock(snapshot))
    {
-      goto error;
+      locked = true;
+      pgexporter_cache_begin(snapshot);
    }
 
-   for (int i = 0; i < config->number_of_endpoints; i++)
+   if (locked || json.cache)
    {
-      pgexporter_log_trace("Start: %s:%d",
-                           config->endpoints[i].host,
-                           config->endpoints[i].port);
-      pgexporter_prometheus_client_get(i, bridge);
-      pgexporter_log_trace("Done: %s:%d",
-                           config->endpoints[i].host,
-                           config->endpoints[i].port);
+      complete = !pgexporter_prometheus_client_render(refresh_bridges, config->number_of_endpoints,
+                                                      locked ? snapshot_append_cb : NULL, snapshot,
+                                                      json.cache ? bridge_json_cb : NULL, &json, NULL);
    }
 
-   if (pgexporter_art_iterator_create(bridge->metrics, &metrics_iterator))
+   if (locked)
+   {
+      if (complete && !pgexporter_cache_publish(snapshot, 0) && snapshot->length[snapshot->slot] > snapshot->size)
+      {
+         pgexporter_log_warn("Cannot publish %zu bytes in the bridge snapshot of %zu bytes. HINT: try adjusting `bridge_cache_max_size`",
+                             snapshot->length[snapshot->slot],
+                             snapshot->size);
+      }
+
+      pgexporter_cache_unlock(snapshot);
+   }
+
+   if (json.cache)
+   {
+      bridge_json_cache_finalize(complete);
+   }
+}
+
+static int
+snapshot_append_cb(char* data, size_t length, void* arg)
+{
+   pgexporter_cache_append((struct prometheus_cache*)arg, data, length);
+
+   return 0;
+}
+
+static void
+bridge_metrics(int client_fd)
+{
+   bridge_json_output_t json;
+   struct prometheus_bridge* bridges[NUMBER_OF_ENDPOINTS];
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+
+   memset(bridges, 0, sizeof(bridges));
+
+   bridge_fetch(bridges);
+
+   // The JSON cache is rebuilt from the same walk as the text
+   json.client_fd = -1;
+   json.cache = bridge_json_cache_begin();
+
+   if (pgexporter_prometheus_client_render(bridges, config->number_of_endpoints,
+                                           bridge_metrics_cb, &client_fd,
+                                           json.cache ? bridge_json_cb : NULL, &json, NULL))
    {
       goto error;
    }
 
-   cache_is_free = STATE_FREE;
-   cache_json_is_free = STATE_FREE;
+   if (json.cache)
+   {
+      bridge_json_cache_finalize(true);
+   }
 
-   start_time = time(NULL);
+   // The caller holds the lock on the cache
+   bridge_cache_finalize();
 
-retry_cache_locking:
-   if (is_bridge_cache_configured())
+   for (int i = 0; i < config->number_of_endpoints; i++)
    {
-      if (atomic_compare_exchange_strong(&cache->lock, &cache_is_free, STATE_IN_USE))
-      {
-         bridge_cache_invalidate();
+      pgexporter_prometheus_client_destroy_bridge(bridges[i]);
+   }
 
-         if (is_bridge_json_cache_configured())
-         {
-retry_cache_json_locking:
-            if (!atomic_compare_exchange_strong(&cache_json->lock, &cache_json_is_free, STATE_IN_USE))
-            {
-               dt = (int)difftime(time(NULL), start_time);
-               if (dt >= (config->blocking_timeout > 0 ? config->blocking_timeout : 30))
-               {
-                  goto error;
-               }
-
-               /* Sleep for 10ms */
-               SLEEP_AND_GOTO(10000000L, retry_cache_json_locking);
-            }
-         }
-      }
-      else
-      {
-         dt = (int)difftime(time(NULL), start_time);
-         if (dt >= (config->blocking_timeout > 0 ? config->blocking_timeout : 30))
-         {
-            goto error;
-         }
+   return;
 
-         /* Sleep for 10ms */
-         SLEEP_AND_GOTO(10000000L, retry_cache_locking);
-      }
+error:
+
+   if (json.cache)
+   {
+      bridge_json_cache_finalize(false);
    }
 
-   while (pgexporter_art_iterator_next(metrics_iterator))
+   for (int i = 0; i < config->number_of_endpoints; i++)
    {
-      struct prometheus_metric* metric_data = (struct prometheus_metric*)metrics_iterator->value->data;
-      struct deque_iterator* definition_iterator = NULL;
-
-      data = pgexporter_append(data, "#HELP ");
-      data = pgexporter_append(data, metric_data->name);
-      data = pgexporter_append_char(data, ' ');
-      data = pgexporter_append(data, metric_data->help);
-      data = pgexporter_append_char(data, '\n');
-
-      data = pgexporter_append(data, "#TYPE ");
-      data = pgexporter_append(data, metric_data->name);
-      data = pgexporter_append_char(data, ' ');
-      data = pgexporter_append(data, metric_data->type);
-      data = pgexporter_append_char(data, '\n');
-
-      if (pgexporter_deque_iterator_create(metric_data->definitions, &definition_iterator))
-      {
-         goto error;
-      }
+      pgexporter_prometheus_client_destroy_bridge(bridges[i]);
+   }
+}
 
-      while (pgexporter_deque_iterator_next(definition_iterator))
-      {
-         struct deque_iterator* attributes_iterator = NULL;
-         struct prometheus_attributes* attrs_data = (struct prometheus_attributes*)definition_iterator->value->data;
-         struct prometheus_value* value_data = NULL;
+static int
+bridge_filtered_cb(char* data, size_t length, void* arg)
+{
+   (void)length;
 
-         if (pgexporter_deque_iterator_create(attrs_data->attributes, &attributes_iterator))
-         {
-            goto error;
-         }
+   send_chunk(*(int*)arg, data);
 
-         value_data = (struct prometheus_value*)pgexporter_deque_peek_last(attrs_data->values, NULL);
+   return 0;
+}
 
-         data = pgexporter_append(data, metric_data->name);
-         data = pgexporter_append_char(data, '{');
+static int
+bridge_metrics_cb(char* data, size_t length, void* arg)
+{
+   int client_fd = *(int*)arg;
 
-         while (pgexporter_deque_iterator_next(attributes_iterator))
-         {
-            struct prometheus_attribute* attr_data = (struct prometheus_attribute*)attributes_iterator->value->data;
+   if (is_bridge_cache_configured())
+   {
+      bridge_cache_append(data, length);
+   }
 
-            data = pgexporter_append(data, attr_data->key);
-            data = pgexporter_append(data, "=\"");
-            data = pgexporter_append(data, attr_data->value);
-            data = pgexporter_append_char(data, '\"');
+   send_chunk(client_fd, data);
 
-            if (pgexporter_deque_iterator_has_next(attributes_iterator))
-            {
-               data = pgexporter_append(data, ", ");
-            }
-         }
+   return 0;
+}
 
-         data = pgexporter_append(data, "} ");
-         data = pgexporter_append(data, value_data->value);
+static void
+bridge_fetch(struct prometheus_bridge** bridges)
+{
+   int number_of_threads = 0;
+   bool traced = false;
+   pthread_t threads[NUMBER_OF_ENDPOINTS];
+   bridge_task_t task;
+   struct sigaction sa;
+   struct configuration* config = NULL;
 
-         data = pgexporter_append_char(data, '\n');
+   config = (struct configuration*)shmem;
 
-         pgexporter_deque_iterator_destroy(attributes_iterator);
-      }
+   // An endpoint may close a kept connection at any time, which has to fail
+   // the write of the request instead of the process
+   if (config->bridge_keep_alive)
+   {
+      memset(&sa, 0, sizeof(struct sigaction));
+      sa.sa_handler = SIG_IGN;
+      sigemptyset(&sa.sa_mask);
+      sigaction(SIGPIPE, &sa, NULL);
+   }
 
-      data = pgexporter_append_char(data, '\n');
+   traced = pgexporter_trace_start(TRACE_KIND_BRIDGE);
 
-      if (is_bridge_cache_configured())
+   memset(&task, 0, sizeof(bridge_task_t));
+   atomic_init(&task.next, 0);
+   task.number_of_endpoints = config->number_of_endpoints;
+   task.bridges = bridges;
+
+   // Each endpoint is a unit of work, so at most bridge_parallel endpoints are
+   // in flight. The current thread always takes part, so the endpoints are
+   // fetched even if no additional thread could be started.
+   for (int i = 0; i < MIN(config->bridge_parallel, config->number_of_endpoints) - 1; i++)
+   {
+      if (pgexporter_thread_create(&threads[number_of_threads], bridge_fetch_worker, &task, "bridge worker"))
       {
-         bridge_cache_append(data);
+         break;
       }
+      number_of_threads++;
+   }
 
-      send_chunk(client_fd, data);
-
-      pgexporter_deque_iterator_destroy(definition_iterator);
+   bridge_fetch_run(&task);
 
-      free(data);
-      data = NULL;
+   for (int i = 0; i < number_of_threads; i++)
+   {
+      pthread_join(threads[i], NULL);
    }
 
-   if (is_bridge_json_cache_configured())
+   if (traced)
    {
-      char* arts = pgexporter_art_to_string(bridge->metrics, FORMAT_JSON, NULL, 0);
-      bridge_json_cache_set(arts);
-      pgexporter_log_trace("%s", arts);
-      free(arts);
+      pgexporter_trace_finish();
    }
+}
 
-   if (is_bridge_cache_configured())
-   {
-      bridge_cache_finalize();
-      atomic_store(&cache->lock, STATE_FREE);
+static void*
+bridge_fetch_worker(void* arg)
+{
+   pgexporter_memory_init();
+
+   bridge_fetch_run((bridge_task_t*)arg);
+
+   pgexporter_memory_destroy();
+
+   return NULL;
+}
+
+static void
+bridge_fetch_run(bridge_task_t* task)
+{
+   int endpoint;
+   uint64_t span;
+   char name[TRACE_NAME_LENGTH];
+   struct prometheus_bridge* bridge = NULL;
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
 
-      if (is_bridge_json_cache_configured())
+   while ((endpoint = atomic_fetch_add(&task->next, 1)) < task->number_of_endpoints)
+   {
+      // A member of the cluster that is down is left out without waiting for it
+      if (!pgexporter_cluster_endpoint_alive(endpoint))
       {
-         atomic_store(&cache_json->lock, STATE_FREE);
+         task->bridges[endpoint] = NULL;
+         continue;
       }
-   }
 
-   pgexporter_art_iterator_destroy(metrics_iterator);
+      pgexporter_log_trace("Start: %s:%d",
+                           config->endpoints[endpoint].host,
+                           config->endpoints[endpoint].port);
 
-   pgexporter_prometheus_client_destroy_bridge(bridge);
+      span = pgexporter_trace_begin();
 
-   return;
+      // An endpoint that fails is left out as a whole
+      if (!pgexporter_prometheus_client_create_bridge(&bridge) &&
+          pgexporter_prometheus_client_get(endpoint, bridge))
+      {
+         pgexporter_prometheus_client_destroy_bridge(bridge);
+         bridge = NULL;
+      }
 
-error:
+      task->bridges[endpoint] = bridge;
+      bridge = NULL;
 
-   pgexporter_art_iterator_destroy(metrics_iterator);
+      if (span != 0)
+      {
+         snprintf(&name[0], sizeof(name), "bridge %s:%d",
+                  config->endpoints[endpoint].host,
+                  config->endpoints[endpoint].port);
+         pgexporter_trace_end(&name[0], -1, span);
+      }
 
-   pgexporter_prometheus_client_destroy_bridge(bridge);
+      pgexporter_log_trace("Done: %s:%d",
+                           config->endpoints[endpoint].host,
+                           config->endpoints[endpoint].port);
+   }
 }
 
 static void
-bridge_json_metrics(int client_fd)
+bridge_json_metrics(int client_fd, int encoding)
 {
    char* data = NULL;
-   time_t start_time;
-   int dt;
+   size_t length = 0;
+   time_t now;
    char time_buf[32];
    int status;
    struct message msg;
    struct prometheus_cache* cache;
-   signed char cache_is_free;
-   struct configuration* config = NULL;
 
-   config = (struct configuration*)shmem;
    cache = (struct prometheus_cache*)bridge_json_cache_shmem;
 
-   cache_is_free = STATE_FREE;
-
-   start_time = time(NULL);
+   now = time(NULL);
 
    memset(&msg, 0, sizeof(struct message));
    memset(&data, 0, sizeof(data));
 
    memset(&time_buf, 0, sizeof(time_buf));
-   ctime_r(&start_time, &time_buf[0]);
+   ctime_r(&now, &time_buf[0]);
    time_buf[strlen(time_buf) - 1] = 0;
 
-retry_cache_locking:
    if (is_bridge_json_cache_configured())
    {
-      if (!atomic_compare_exchange_strong(&cache->lock, &cache_is_free, STATE_IN_USE))
+      /* The last complete payload without waiting for a rebuild */
+      status = pgexporter_cache_write(cache, false, encoding, BRIDGE_CONTENT_TYPE, NULL, client_fd, &length);
+      if (status == MESSAGE_STATUS_OK)
       {
-         dt = (int)difftime(time(NULL), start_time);
-         if (dt >= (config->blocking_timeout > 0 ? config->blocking_timeout : 30))
-         {
-            goto error;
-         }
-
-         /* Sleep for 10ms */
-         SLEEP_AND_GOTO(10000000L, retry_cache_locking);
+         return;
+      }
+      else if (status != MESSAGE_STATUS_ZERO)
+      {
+         goto error;
       }
 
       /* Header */
@@ -1194,14 +1439,10 @@ retry_cache_locking:
       free(data);
       data = NULL;
 
-      /* Cache */
-      if (strlen(cache->data) > 0)
+      /* Nothing collected yet, so the endpoints are fetched and the document is sent as it is rendered */
+      if (bridge_json_live(client_fd))
       {
-         send_chunk(client_fd, cache->data);
-      }
-      else
-      {
-         send_chunk(client_fd, "{\n}\n");
+         goto error;
       }
 
       /* Footer */
@@ -1218,9 +1459,6 @@ retry_cache_locking:
       }
 
       free(data);
-      data = NULL;
-
-      atomic_store(&cache->lock, STATE_FREE);
    }
    else
    {
@@ -1231,5 +1469,39 @@ retry_cache_locking:
 
 error:
 
+   free(data);
+
    pgexporter_log_error("bridge_json_metrics called");
 }
+
+static int
+bridge_json_live(int client_fd)
+{
+   int status;
+   bridge_json_output_t json;
+   struct prometheus_bridge* bridges[NUMBER_OF_ENDPOINTS];
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+
+   memset(bridges, 0, sizeof(bridges));
+
+   bridge_fetch(bridges);
+
+   json.client_fd = client_fd;
+   json.cache = bridge_json_cache_begin();
+
+   status = pgexporter_prometheus_client_render(bridges, config->number_of_endpoints, NULL, NULL, bridge_json_cb, &json, NULL);
+
+   if (json.cache)
+   {
+      bridge_json_cache_finalize(status == 0);
+   }
+
+   for (int i = 0; i < config->number_of_endpoints; i++)
+   {
+      pgexporter_prometheus_client_destroy_bridge(bridges[i]);
+   }
+
+   return status;
+}
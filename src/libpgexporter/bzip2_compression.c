@@ -122,3 +122,136 @@ pgexporter_bunzip2_string(unsigned char* compressed_buffer, size_t compressed_si
 
    return 0;
 }
+
+struct bzip2_stream
+{
+   bool compress;     /**< Compress or decompress */
+   bool end;          /**< Has the end of the stream been reached */
+   bz_stream stream;  /**< The bzip2 stream */
+};
+
+int
+pgexporter_bzip2_stream_create(bool compress, void** stream)
+{
+   int ret;
+   struct bzip2_stream* s = NULL;
+
+   *stream = NULL;
+
+   s = (struct bzip2_stream*)calloc(1, sizeof(struct bzip2_stream));
+   if (s == NULL)
+   {
+      pgexporter_log_error("Bzip2: Allocation failed");
+      goto error;
+   }
+
+   s->compress = compress;
+
+   if (compress)
+   {
+      ret = BZ2_bzCompressInit(&s->stream, 9, 0, 0);
+   }
+   else
+   {
+      ret = BZ2_bzDecompressInit(&s->stream, 0, 0);
+   }
+
+   if (ret != BZ_OK)
+   {
+      pgexporter_log_error("Bzip2: Initialization failed");
+      free(s);
+      goto error;
+   }
+
+   *stream = s;
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+int
+pgexporter_bzip2_stream_update(void* stream, void* data, size_t length, bool finish, struct builder* output)
+{
+   int ret;
+   size_t available;
+   struct bzip2_stream* s = (struct bzip2_stream*)stream;
+
+   s->stream.next_in = (char*)data;
+   s->stream.avail_in = length;
+
+   while (!s->end)
+   {
+      if (pgexporter_builder_reserve(output, BUFFER_LENGTH))
+      {
+         goto error;
+      }
+
+      available = output->capacity - output->length - 1;
+
+      s->stream.next_out = output->data + output->length;
+      s->stream.avail_out = available;
+
+      if (s->compress)
+      {
+         ret = BZ2_bzCompress(&s->stream, finish ? BZ_FINISH : BZ_RUN);
+      }
+      else
+      {
+         ret = BZ2_bzDecompress(&s->stream);
+      }
+
+      output->length += available - s->stream.avail_out;
+      output->data[output->length] = '\0';
+
+      if (ret == BZ_STREAM_END)
+      {
+         s->end = true;
+      }
+      else if (ret != BZ_OK && ret != BZ_RUN_OK && ret != BZ_FINISH_OK)
+      {
+         pgexporter_log_error("Bzip2: Stream failed");
+         goto error;
+      }
+      else if (s->stream.avail_in == 0 && s->stream.avail_out > 0 && !(s->compress && finish))
+      {
+         break;
+      }
+   }
+
+   if (finish && !s->end)
+   {
+      pgexporter_log_error("Bzip2: Stream not complete");
+      goto error;
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+void
+pgexporter_bzip2_stream_destroy(void* stream)
+{
+   struct bzip2_stream* s = (struct bzip2_stream*)stream;
+
+   if (s == NULL)
+   {
+      return;
+   }
+
+   if (s->compress)
+   {
+      BZ2_bzCompressEnd(&s->stream);
+   }
+   else
+   {
+      BZ2_bzDecompressEnd(&s->stream);
+   }
+
+   free(s);
+}
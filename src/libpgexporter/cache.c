@@ -0,0 +1,1012 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <cache.h>
+#include <gzip_compression.h>
+#include <logging.h>
+#include <memory.h>
+#include <message.h>
+#include <shmem.h>
+#include <utils.h>
+#include <zstandard_compression.h>
+
+/* system */
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef HAVE_LINUX
+#include <sys/sendfile.h>
+#endif
+
+static bool accepts(char* header, size_t length, char* encoding);
+static void encode(struct prometheus_cache* cache);
+static int acquire_slot(struct prometheus_cache* cache, bool valid, int* reader);
+static int register_reader(struct prometheus_cache* cache, int slot);
+static void release_slot(struct prometheus_cache* cache, int slot, int reader);
+static bool slot_in_use(struct prometheus_cache* cache, int slot);
+static bool wait_writable(int socket);
+static int send_file(int socket, int in_fd, off_t offset, size_t length);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ssl_send_file(SSL* ssl, int in_fd, off_t offset, size_t length);
+#endif
+
+int
+pgexporter_cache_create(size_t size, unsigned char hp, size_t* p_size, void** p_shmem)
+{
+   int fd = -1;
+   size_t segment_size = 0;
+   struct prometheus_cache* cache = NULL;
+
+   segment_size = sizeof(struct prometheus_cache) + 2 * size;
+
+#ifdef HAVE_LINUX
+   /* A memfd lets the payload be sent without copying it through user space */
+   fd = memfd_create("pgexporter_cache", 0);
+
+   if (fd != -1)
+   {
+      void* s = NULL;
+
+      if (ftruncate(fd, segment_size) == 0)
+      {
+         s = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      }
+
+      if (s == NULL || s == MAP_FAILED)
+      {
+         pgexporter_log_debug("Cache: memfd: %s", strerror(errno));
+         close(fd);
+         fd = -1;
+      }
+      else
+      {
+         cache = (struct prometheus_cache*)s;
+      }
+   }
+
+   errno = 0;
+#endif
+
+   if (cache == NULL && pgexporter_create_shared_memory(segment_size, hp, (void*) &cache))
+   {
+      goto error;
+   }
+
+   /* Before the pages are touched */
+   pgexporter_numa_shared_memory(cache, segment_size, ((struct configuration*)shmem)->numa);
+
+   memset(cache, 0, segment_size);
+   atomic_init(&cache->lock, STATE_FREE);
+   atomic_init(&cache->active, -1);
+   for (int i = 0; i < NUMBER_OF_CACHE_READERS; i++)
+   {
+      atomic_init(&cache->readers[0][i], 0);
+      atomic_init(&cache->readers[1][i], 0);
+   }
+   atomic_init(&cache->generation, 0);
+   atomic_init(&cache->overflows, 0);
+   atomic_init(&cache->wanted, 0);
+   atomic_init(&cache->building, -1);
+   atomic_init(&cache->progress, 0);
+   atomic_init(&cache->coalesced, 0);
+   cache->size = size;
+   cache->fd = fd;
+
+   /* The caches are created and destroyed rarely, so they are flushed right away */
+   pgexporter_memory_account(MEMORY_CACHE, (int64_t)segment_size, 1);
+   pgexporter_memory_flush();
+
+   *p_shmem = cache;
+   *p_size = segment_size;
+
+   return 0;
+
+error:
+
+   *p_shmem = NULL;
+   *p_size = 0;
+
+   return 1;
+}
+
+int
+pgexporter_cache_grow(size_t max, size_t* p_size, void** p_shmem)
+{
+   int slot;
+   size_t wanted;
+   size_t size;
+   size_t grown_size = 0;
+   struct configuration* config;
+   struct prometheus_cache* cache = (struct prometheus_cache*)*p_shmem;
+   struct prometheus_cache* grown = NULL;
+
+   config = (struct configuration*)shmem;
+
+   if (cache == NULL)
+   {
+      return 0;
+   }
+
+   wanted = atomic_load(&cache->wanted);
+
+   if (wanted <= cache->size || cache->size >= max)
+   {
+      return 0;
+   }
+
+   /* Room for the compressed copies, and for the payload to keep growing */
+   size = MAX(wanted + wanted / 2, cache->size * 2);
+   size = (size + 4095) & ~((size_t)4095);
+   size = MIN(size, max);
+
+   if (pgexporter_cache_create(size, config->hugepage, &grown_size, (void**)&grown))
+   {
+      pgexporter_log_warn("Cache: Cannot grow from %zu to %zu bytes", cache->size, size);
+      atomic_store(&cache->wanted, 0);
+      goto error;
+   }
+
+   atomic_store(&grown->overflows, atomic_load(&cache->overflows));
+   atomic_store(&grown->coalesced, atomic_load(&cache->coalesced));
+   atomic_store(&grown->generation, atomic_load(&cache->generation) + 1);
+   for (int encoding = 0; encoding < NUMBER_OF_ENCODINGS; encoding++)
+   {
+      atomic_store(&grown->requested[encoding], atomic_load(&cache->requested[encoding]));
+   }
+
+   /* The lock is kept, so the processes still attached don't rebuild the previous cache */
+   if (pgexporter_cache_lock(cache))
+   {
+      slot = atomic_load(&cache->active);
+
+      if (slot != -1)
+      {
+         memcpy(grown->data, cache->data + slot * cache->size, cache->size);
+         memcpy(&grown->offset[0], &cache->offset[slot], sizeof(grown->offset[0]));
+         memcpy(&grown->encoded[0], &cache->encoded[slot], sizeof(grown->encoded[0]));
+         grown->length[0] = cache->length[slot];
+         grown->valid_until[0] = cache->valid_until[slot];
+         atomic_store(&grown->active, 0);
+      }
+   }
+
+   pgexporter_log_info("Cache: Grown from %zu to %zu bytes", cache->size, size);
+
+   pgexporter_cache_destroy(cache, *p_size);
+
+   *p_shmem = grown;
+   *p_size = grown_size;
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+int
+pgexporter_cache_destroy(void* shmem, size_t size)
+{
+   struct prometheus_cache* cache = (struct prometheus_cache*)shmem;
+
+   if (cache == NULL)
+   {
+      return 0;
+   }
+
+   if (cache->fd != -1)
+   {
+      close(cache->fd);
+   }
+
+   pgexporter_memory_account(MEMORY_CACHE, -(int64_t)size, -1);
+   pgexporter_memory_flush();
+
+   return pgexporter_destroy_shared_memory(shmem, size);
+}
+
+int
+pgexporter_cache_encoding(struct message* msg)
+{
+   char* data = (char*)msg->data;
+   size_t length = (size_t)msg->length;
+   size_t start = 0;
+   size_t end;
+   int encoding = CACHE_ENCODING_IDENTITY;
+
+   while (start < length)
+   {
+      end = start;
+      while (end < length && data[end] != '\n')
+      {
+         end++;
+      }
+
+      size_t n = end - start;
+      if (n > 0 && data[start + n - 1] == '\r')
+      {
+         n--;
+      }
+
+      if (n == 0)
+      {
+         /* The end of the headers */
+         break;
+      }
+
+      if (n > 16 && strncasecmp(data + start, "Accept-Encoding:", 16) == 0)
+      {
+         if (accepts(data + start + 16, n - 16, "zstd"))
+         {
+            encoding = CACHE_ENCODING_ZSTD;
+         }
+         else if (accepts(data + start + 16, n - 16, "gzip"))
+         {
+            encoding = CACHE_ENCODING_GZIP;
+         }
+      }
+
+      start = end + 1;
+   }
+
+   return encoding;
+}
+
+int
+pgexporter_cache_write(struct prometheus_cache* cache, bool valid, int encoding, char* content_type, SSL* ssl, int fd, size_t* length)
+{
+   int slot;
+   int reader = -1;
+   int status;
+   off_t offset;
+   time_t now;
+   char time_buf[32];
+   char* header = NULL;
+   struct message msg;
+
+   *length = 0;
+
+   if (encoding != CACHE_ENCODING_IDENTITY && !atomic_load(&cache->requested[encoding]))
+   {
+      /* The following rebuilds will be compressed for the encoding */
+      atomic_store(&cache->requested[encoding], true);
+   }
+
+   slot = acquire_slot(cache, valid, &reader);
+
+   if (slot == -1)
+   {
+      return MESSAGE_STATUS_ZERO;
+   }
+
+   if (cache->encoded[slot][encoding] == 0)
+   {
+      encoding = CACHE_ENCODING_IDENTITY;
+   }
+
+   *length = cache->encoded[slot][encoding];
+   offset = offsetof(struct prometheus_cache, data) + slot * cache->size + cache->offset[slot][encoding];
+
+   now = time(NULL);
+
+   memset(&time_buf, 0, sizeof(time_buf));
+   ctime_r(&now, &time_buf[0]);
+   time_buf[strlen(time_buf) - 1] = 0;
+
+   header = pgexporter_format_and_append(header,
+                                         "HTTP/1.1 200 OK\r\n"
+                                         "Content-Type: %s\r\n"
+                                         "Date: %s\r\n"
+                                         "%s"
+                                         "Content-Length: %zu\r\n"
+                                         "Vary: Accept-Encoding\r\n"
+                                         "\r\n",
+                                         content_type,
+                                         &time_buf[0],
+                                         encoding == CACHE_ENCODING_GZIP ? "Content-Encoding: gzip\r\n" :
+                                         encoding == CACHE_ENCODING_ZSTD ? "Content-Encoding: zstd\r\n" : "",
+                                         *length);
+
+   memset(&msg, 0, sizeof(struct message));
+
+   msg.kind = 0;
+   msg.length = strlen(header);
+   msg.data = header;
+
+   status = pgexporter_write_message(ssl, fd, &msg);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      goto done;
+   }
+
+   if (*length == 0)
+   {
+      goto done;
+   }
+
+   if (ssl == NULL && cache->fd != -1)
+   {
+      status = send_file(fd, cache->fd, offset, *length);
+   }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+   else if (ssl != NULL && cache->fd != -1 && BIO_get_ktls_send(SSL_get_wbio(ssl)))
+   {
+      status = ssl_send_file(ssl, cache->fd, offset, *length);
+   }
+#endif
+   else
+   {
+      msg.kind = 0;
+      msg.length = *length;
+      msg.data = cache->data + slot * cache->size + cache->offset[slot][encoding];
+
+      status = pgexporter_write_message(ssl, fd, &msg);
+   }
+
+done:
+
+   release_slot(cache, slot, reader);
+
+   free(header);
+
+   return status;
+}
+
+int
+pgexporter_cache_follow(struct prometheus_cache* cache, char* content_type, SSL* ssl, int fd, size_t* length)
+{
+   int slot;
+   int reader = -1;
+   int status;
+   unsigned long generation;
+   size_t progress;
+   size_t sent = 0;
+   time_t now;
+   time_t last;
+   char time_buf[32];
+   char* header = NULL;
+   struct message msg;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *length = 0;
+
+   generation = atomic_load(&cache->generation);
+   slot = atomic_load(&cache->building);
+
+   if (slot == -1)
+   {
+      return MESSAGE_STATUS_ZERO;
+   }
+
+   /* The slot can't be reused by another rebuild while it is followed */
+   reader = register_reader(cache, slot);
+   if (reader == -1)
+   {
+      return MESSAGE_STATUS_ZERO;
+   }
+
+   if (atomic_load(&cache->building) != slot || atomic_load(&cache->generation) != generation || cache->discard)
+   {
+      /* The rebuild ended in between */
+      release_slot(cache, slot, reader);
+      return MESSAGE_STATUS_ZERO;
+   }
+
+   atomic_fetch_add(&cache->coalesced, 1);
+
+   now = time(NULL);
+
+   memset(&time_buf, 0, sizeof(time_buf));
+   ctime_r(&now, &time_buf[0]);
+   time_buf[strlen(time_buf) - 1] = 0;
+
+   header = pgexporter_format_and_append(header,
+                                         "HTTP/1.1 200 OK\r\n"
+                                         "Content-Type: %s\r\n"
+                                         "Date: %s\r\n"
+                                         "Transfer-Encoding: chunked\r\n"
+                                         "\r\n",
+                                         content_type,
+                                         &time_buf[0]);
+
+   memset(&msg, 0, sizeof(struct message));
+
+   msg.kind = 0;
+   msg.length = strlen(header);
+   msg.data = header;
+
+   status = pgexporter_write_message(ssl, fd, &msg);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      goto done;
+   }
+
+   last = now;
+
+   while (true)
+   {
+      if (atomic_load(&cache->building) == slot)
+      {
+         progress = atomic_load(&cache->progress);
+
+         /* The progress may already be the one of the next rebuild */
+         if (atomic_load(&cache->building) != slot)
+         {
+            continue;
+         }
+      }
+      else if (atomic_load(&cache->generation) != generation)
+      {
+         /* Published, and nothing is written to the payload anymore */
+         progress = cache->length[slot];
+      }
+      else
+      {
+         pgexporter_log_debug("Cache: The followed rebuild of slot %d failed", slot);
+         status = MESSAGE_STATUS_ERROR;
+         goto done;
+      }
+
+      if (progress > sent)
+      {
+         status = pgexporter_write_chunk(ssl, fd, cache->data + slot * cache->size + sent, progress - sent);
+         if (status != MESSAGE_STATUS_OK)
+         {
+            goto done;
+         }
+
+         sent = progress;
+         last = time(NULL);
+      }
+      else if (atomic_load(&cache->building) != slot)
+      {
+         break;
+      }
+      else if ((int)difftime(time(NULL), last) >= (config->blocking_timeout > 0 ? config->blocking_timeout : 30))
+      {
+         pgexporter_log_debug("Cache: The followed rebuild of slot %d is stuck", slot);
+         status = MESSAGE_STATUS_ERROR;
+         goto done;
+      }
+      else
+      {
+         /* Sleep for 1ms */
+         SLEEP(1000000L);
+      }
+   }
+
+   msg.kind = 0;
+   msg.length = 5;
+   msg.data = "0\r\n\r\n";
+
+   status = pgexporter_write_message(ssl, fd, &msg);
+
+done:
+
+   *length = sent;
+
+   release_slot(cache, slot, reader);
+
+   free(header);
+
+   return status;
+}
+
+bool
+pgexporter_cache_available(struct prometheus_cache* cache, bool valid)
+{
+   int slot;
+
+   slot = atomic_load(&cache->active);
+
+   if (slot == -1)
+   {
+      return false;
+   }
+
+   return !valid || time(NULL) <= cache->valid_until[slot];
+}
+
+bool
+pgexporter_cache_lock(struct prometheus_cache* cache)
+{
+   signed char cache_is_free = STATE_FREE;
+
+   return atomic_compare_exchange_strong(&cache->lock, &cache_is_free, STATE_IN_USE);
+}
+
+void
+pgexporter_cache_unlock(struct prometheus_cache* cache)
+{
+   /* A rebuild that wasn't published ends for its followers too */
+   atomic_store(&cache->building, -1);
+   atomic_store(&cache->lock, STATE_FREE);
+}
+
+void
+pgexporter_cache_begin(struct prometheus_cache* cache)
+{
+   time_t start_time;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   cache->slot = atomic_load(&cache->active) == 0 ? 1 : 0;
+   cache->built = 0;
+   cache->discard = false;
+
+   start_time = time(NULL);
+
+   /* Wait for the clients still being sent the slot */
+   while (slot_in_use(cache, cache->slot))
+   {
+      if ((int)difftime(time(NULL), start_time) >= (config->blocking_timeout > 0 ? config->blocking_timeout : 30))
+      {
+         /* The previous payload keeps being served */
+         pgexporter_log_warn("Cache: Slot %d is still in use", cache->slot);
+         cache->discard = true;
+         return;
+      }
+
+      /* Sleep for 1ms */
+      SLEEP(1000000L);
+   }
+
+   /* Nobody reads the slot anymore */
+   cache->length[cache->slot] = 0;
+   cache->valid_until[cache->slot] = 0;
+
+   atomic_store(&cache->progress, 0);
+   atomic_store(&cache->building, cache->slot);
+}
+
+bool
+pgexporter_cache_append(struct prometheus_cache* cache, char* data, size_t length)
+{
+   size_t offset = cache->built;
+
+   /* The length keeps growing, so an overflow can report the size needed */
+   cache->built += length;
+
+   /* A discarded rebuild leaves the slot alone, it may still be read */
+   if (cache->discard || offset + length > cache->size)
+   {
+      cache->discard = true;
+      return false;
+   }
+
+   memcpy(cache->data + cache->slot * cache->size + offset, data, length);
+   cache->length[cache->slot] = offset + length;
+
+   /* The followers may send the data from now on */
+   atomic_store(&cache->progress, offset + length);
+
+   return true;
+}
+
+bool
+pgexporter_cache_publish(struct prometheus_cache* cache, time_t valid_until)
+{
+   size_t length = cache->built;
+
+   if (length > cache->size)
+   {
+      atomic_fetch_add(&cache->overflows, 1);
+
+      if (length > atomic_load(&cache->wanted))
+      {
+         atomic_store(&cache->wanted, length);
+      }
+   }
+
+   if (cache->discard)
+   {
+      return false;
+   }
+
+   encode(cache);
+
+   cache->valid_until[cache->slot] = valid_until;
+
+   atomic_store(&cache->active, cache->slot);
+   atomic_fetch_add(&cache->generation, 1);
+   atomic_store(&cache->building, -1);
+
+   return true;
+}
+
+void
+pgexporter_cache_invalidate(struct prometheus_cache* cache)
+{
+   atomic_store(&cache->active, -1);
+}
+
+void
+pgexporter_cache_release_readers(struct prometheus_cache* cache, pid_t pid)
+{
+   int reader;
+
+   if (cache == NULL)
+   {
+      return;
+   }
+
+   for (int slot = 0; slot < 2; slot++)
+   {
+      for (int i = 0; i < NUMBER_OF_CACHE_READERS; i++)
+      {
+         reader = pid;
+         atomic_compare_exchange_strong(&cache->readers[slot][i], &reader, 0);
+      }
+   }
+}
+
+/**
+ * Is an encoding accepted by the value of an Accept-Encoding header
+ * @param header The value of the header
+ * @param length The length of the value
+ * @param encoding The encoding
+ * @return True if accepted, otherwise false
+ */
+static bool
+accepts(char* header, size_t length, char* encoding)
+{
+   size_t i = 0;
+   size_t n = strlen(encoding);
+
+   while (i < length)
+   {
+      size_t start;
+      size_t end;
+
+      while (i < length && (header[i] == ' ' || header[i] == '\t' || header[i] == ','))
+      {
+         i++;
+      }
+
+      start = i;
+      while (i < length && header[i] != ',' && header[i] != ';' && header[i] != ' ')
+      {
+         i++;
+      }
+      end = i;
+
+      /* The parameters, where only q=0 matters */
+      bool disabled = false;
+      while (i < length && header[i] != ',')
+      {
+         if (header[i] == 'q' && i + 2 < length && header[i + 1] == '=')
+         {
+            disabled = true;
+            for (size_t j = i + 2; j < length && header[j] != ',' && header[j] != ';'; j++)
+            {
+               if (header[j] >= '1' && header[j] <= '9')
+               {
+                  disabled = false;
+               }
+            }
+         }
+         i++;
+      }
+
+      if (!disabled &&
+          ((end - start == n && strncasecmp(header + start, encoding, n) == 0) ||
+           (end - start == 1 && header[start] == '*')))
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+/**
+ * Compress the rebuild for the encodings requested by the clients,
+ * into the room left in its slot
+ * @param cache The cache
+ */
+static void
+encode(struct prometheus_cache* cache)
+{
+   int slot = cache->slot;
+   char* base = cache->data + slot * cache->size;
+   size_t used = cache->length[slot];
+   size_t n = 0;
+   int ret;
+
+   cache->offset[slot][CACHE_ENCODING_IDENTITY] = 0;
+   cache->encoded[slot][CACHE_ENCODING_IDENTITY] = cache->length[slot];
+
+   for (int encoding = CACHE_ENCODING_GZIP; encoding < NUMBER_OF_ENCODINGS; encoding++)
+   {
+      cache->offset[slot][encoding] = 0;
+      cache->encoded[slot][encoding] = 0;
+
+      if (cache->length[slot] == 0 || !atomic_load(&cache->requested[encoding]))
+      {
+         continue;
+      }
+
+      if (encoding == CACHE_ENCODING_GZIP)
+      {
+         ret = pgexporter_gzip_buffer(base, cache->length[slot], base + used, cache->size - used, &n);
+      }
+      else
+      {
+         ret = pgexporter_zstdc_buffer(base, cache->length[slot], base + used, cache->size - used, &n);
+      }
+
+      if (ret)
+      {
+         pgexporter_log_debug("Cache: No room to compress %zu bytes (encoding %d)", cache->length[slot], encoding);
+         continue;
+      }
+
+      cache->offset[slot][encoding] = used;
+      cache->encoded[slot][encoding] = n;
+      used += n;
+   }
+}
+
+/**
+ * Register as a reader of the slot being served
+ * @param cache The cache
+ * @param valid Only a slot that is still valid
+ * @param reader The entry of the reader
+ * @return The slot, or -1 if there is no such slot
+ */
+static int
+acquire_slot(struct prometheus_cache* cache, bool valid, int* reader)
+{
+   int slot;
+
+retry:
+   slot = atomic_load(&cache->active);
+
+   if (slot == -1)
+   {
+      return -1;
+   }
+
+   *reader = register_reader(cache, slot);
+
+   if (*reader == -1)
+   {
+      return -1;
+   }
+
+   if (atomic_load(&cache->active) != slot)
+   {
+      /* A rebuild was published in between, so the slot may be reused */
+      release_slot(cache, slot, *reader);
+      goto retry;
+   }
+
+   if (valid && time(NULL) > cache->valid_until[slot])
+   {
+      release_slot(cache, slot, *reader);
+      return -1;
+   }
+
+   return slot;
+}
+
+/**
+ * Take a free entry in the readers of a slot
+ * @param cache The cache
+ * @param slot The slot
+ * @return The entry, or -1 if all of them are taken
+ */
+static int
+register_reader(struct prometheus_cache* cache, int slot)
+{
+   int free_entry;
+
+   for (int i = 0; i < NUMBER_OF_CACHE_READERS; i++)
+   {
+      free_entry = 0;
+      if (atomic_compare_exchange_strong(&cache->readers[slot][i], &free_entry, (int)getpid()))
+      {
+         return i;
+      }
+   }
+
+   pgexporter_log_debug("Cache: Too many readers of slot %d", slot);
+
+   return -1;
+}
+
+static void
+release_slot(struct prometheus_cache* cache, int slot, int reader)
+{
+   atomic_store(&cache->readers[slot][reader], 0);
+}
+
+/**
+ * Is a slot being read. The entries of the readers that exited
+ * without releasing the slot are released
+ * @param cache The cache
+ * @param slot The slot
+ * @return True if a process reads the slot, otherwise false
+ */
+static bool
+slot_in_use(struct prometheus_cache* cache, int slot)
+{
+   int pid;
+   bool used = false;
+
+   for (int i = 0; i < NUMBER_OF_CACHE_READERS; i++)
+   {
+      pid = atomic_load(&cache->readers[slot][i]);
+
+      if (pid == 0)
+      {
+         continue;
+      }
+
+      if (kill(pid, 0) == -1 && errno == ESRCH)
+      {
+         pgexporter_log_debug("Cache: Reader %d of slot %d is gone", pid, slot);
+         atomic_compare_exchange_strong(&cache->readers[slot][i], &pid, 0);
+         errno = 0;
+         continue;
+      }
+
+      used = true;
+   }
+
+   return used;
+}
+
+/**
+ * Wait until a socket that is full can be written again
+ * @param socket The socket
+ * @return True if it can be written, false after blocking_timeout
+ */
+static bool
+wait_writable(int socket)
+{
+   int r;
+   struct pollfd pfd;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   pfd.fd = socket;
+   pfd.events = POLLOUT;
+   pfd.revents = 0;
+
+   do
+   {
+      r = poll(&pfd, 1, (config->blocking_timeout > 0 ? config->blocking_timeout : 30) * 1000);
+   }
+   while (r == -1 && errno == EINTR);
+
+   errno = 0;
+
+   return r == 1 && !(pfd.revents & (POLLERR | POLLHUP | POLLNVAL));
+}
+
+static int
+send_file(int socket, int in_fd, off_t offset, size_t length)
+{
+#ifdef HAVE_LINUX
+   ssize_t numbytes;
+
+   while (length > 0)
+   {
+      numbytes = sendfile(socket, in_fd, &offset, length);
+
+      if (numbytes == -1)
+      {
+         if (errno == EINTR)
+         {
+            errno = 0;
+            continue;
+         }
+
+         if (errno == EAGAIN)
+         {
+            errno = 0;
+
+            if (wait_writable(socket))
+            {
+               continue;
+            }
+
+            pgexporter_log_debug("Error %d - sendfile - The client doesn't read", socket);
+            return MESSAGE_STATUS_ERROR;
+         }
+
+         pgexporter_log_debug("Error %d - sendfile - %d/%s", socket, errno, strerror(errno));
+         errno = 0;
+         return MESSAGE_STATUS_ERROR;
+      }
+      else if (numbytes == 0)
+      {
+         return MESSAGE_STATUS_ERROR;
+      }
+
+      length -= numbytes;
+   }
+
+   return MESSAGE_STATUS_OK;
+#else
+   (void)socket;
+   (void)in_fd;
+   (void)offset;
+   (void)length;
+
+   return MESSAGE_STATUS_ERROR;
+#endif
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int
+ssl_send_file(SSL* ssl, int in_fd, off_t offset, size_t length)
+{
+   ossl_ssize_t numbytes;
+
+   while (length > 0)
+   {
+      numbytes = SSL_sendfile(ssl, in_fd, offset, length, 0);
+
+      if (numbytes <= 0)
+      {
+         int err = SSL_get_error(ssl, numbytes);
+
+         if (err == SSL_ERROR_WANT_WRITE && wait_writable(SSL_get_fd(ssl)))
+         {
+            continue;
+         }
+
+         pgexporter_log_debug("Error - SSL_sendfile - %d", err);
+         return MESSAGE_STATUS_ERROR;
+      }
+
+      offset += numbytes;
+      length -= numbytes;
+   }
+
+   return MESSAGE_STATUS_OK;
+}
+#endif
@@ -0,0 +1,1033 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <catalog.h>
+#include <internal.h>
+#include <logging.h>
+#include <query_alts.h>
+#include <shmem.h>
+#include <utils.h>
+
+/* system */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CATALOG_POOL_SIZE 65536
+#define CATALOG_METRICS   64
+
+/* The catalog of the generation of this process, inherited by its children */
+static struct catalog* generation = NULL;
+
+static size_t align_size(size_t size, size_t alignment);
+static int cache_key(char* path, bool json, unsigned char* key);
+static int compile_templates(struct configuration* config, int metric, size_t node);
+static int digest_file(EVP_MD_CTX* ctx, char* path, char* name);
+static int write_all(int fd, void* buffer, size_t size);
+static void destroy_builder(struct configuration* config);
+static void publish_names(char* pool, size_t node);
+
+int
+pgexporter_catalog_begin(struct configuration* config)
+{
+   struct catalog_builder* builder = NULL;
+
+   destroy_builder(config);
+
+   builder = (struct catalog_builder*)calloc(1, sizeof(struct catalog_builder));
+   if (builder == NULL)
+   {
+      goto error;
+   }
+
+   builder->pool = (char*)calloc(1, CATALOG_POOL_SIZE);
+   if (builder->pool == NULL)
+   {
+      goto error;
+   }
+
+   builder->size = CATALOG_POOL_SIZE;
+   builder->used = CATALOG_RESERVED;
+
+   config->catalog_builder = builder;
+
+   return 0;
+
+error:
+
+   free(builder);
+
+   return 1;
+}
+
+struct prometheus*
+pgexporter_catalog_metric(struct configuration* config, int index)
+{
+   int capacity;
+   struct prometheus* prometheus = NULL;
+   struct catalog_builder* builder = config->catalog_builder;
+
+   if (builder == NULL || index < 0)
+   {
+      return NULL;
+   }
+
+   if (index >= builder->capacity)
+   {
+      capacity = builder->capacity > 0 ? builder->capacity : CATALOG_METRICS;
+      while (capacity <= index)
+      {
+         capacity *= 2;
+      }
+
+      // The metrics are 64 byte aligned, which realloc() doesn't keep
+      prometheus = (struct prometheus*)aligned_alloc(64, capacity * sizeof(struct prometheus));
+      if (prometheus == NULL)
+      {
+         builder->failed = true;
+         return NULL;
+      }
+
+      if (builder->number_of_metrics > 0)
+      {
+         memcpy(prometheus, builder->prometheus, builder->number_of_metrics * sizeof(struct prometheus));
+      }
+
+      free(builder->prometheus);
+      builder->prometheus = prometheus;
+      builder->capacity = capacity;
+   }
+
+   while (builder->number_of_metrics <= index)
+   {
+      prometheus = &builder->prometheus[builder->number_of_metrics++];
+
+      memset(prometheus, 0, sizeof(struct prometheus));
+      prometheus->sort_type = SORT_NAME;
+      prometheus->server_query_type = SERVER_QUERY_BOTH;
+   }
+
+   return &builder->prometheus[index];
+}
+
+size_t
+pgexporter_catalog_alloc(struct configuration* config, size_t size)
+{
+   size_t offset;
+   size_t needed;
+   char* pool = NULL;
+   struct catalog_builder* builder = config->catalog_builder;
+
+   if (builder == NULL || builder->failed)
+   {
+      return 0;
+   }
+
+   offset = align_size(builder->used, CATALOG_ALIGNMENT);
+   needed = offset + size;
+
+   if (needed > builder->size)
+   {
+      size_t new_size = builder->size;
+
+      while (new_size < needed)
+      {
+         new_size *= 2;
+      }
+
+      pool = (char*)realloc(builder->pool, new_size);
+      if (pool == NULL)
+      {
+         builder->failed = true;
+         return 0;
+      }
+
+      memset(pool + builder->size, 0, new_size - builder->size);
+
+      builder->pool = pool;
+      builder->size = new_size;
+   }
+
+   builder->used = needed;
+
+   return offset;
+}
+
+size_t
+pgexporter_catalog_strdup(struct configuration* config, char* s)
+{
+   size_t length;
+   size_t offset;
+
+   if (s == NULL || *s == '\0')
+   {
+      return 0;
+   }
+
+   length = strlen(s);
+
+   offset = pgexporter_catalog_alloc(config, length + 1);
+   if (offset == 0)
+   {
+      return 0;
+   }
+
+   memcpy(config->catalog_builder->pool + offset, s, length);
+
+   return offset;
+}
+
+int
+pgexporter_catalog_read_cache(struct configuration* config, char* path, bool json, unsigned char* key)
+{
+   int fd = -1;
+   size_t size = 0;
+   size_t expected;
+   void* map = MAP_FAILED;
+   struct stat st;
+   struct catalog_cache* header = NULL;
+   struct catalog_builder* builder = NULL;
+
+   memset(key, 0, CATALOG_KEY_LENGTH);
+
+   if (strlen(config->metrics_definitions_cache) == 0)
+   {
+      return 1;
+   }
+
+   if (cache_key(path, json, key))
+   {
+      pgexporter_log_warn("Unable to compute the key of the metric definitions");
+      goto error;
+   }
+
+   fd = open(config->metrics_definitions_cache, O_RDONLY | O_CLOEXEC);
+   if (fd == -1)
+   {
+      if (errno != ENOENT)
+      {
+         pgexporter_log_warn("Unable to open %s: %s", config->metrics_definitions_cache, strerror(errno));
+      }
+      goto error;
+   }
+
+   if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct catalog_cache))
+   {
+      goto invalid;
+   }
+
+   size = (size_t)st.st_size;
+
+   map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (map == MAP_FAILED)
+   {
+      goto invalid;
+   }
+
+   header = (struct catalog_cache*)map;
+
+   if (memcmp(header->magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) ||
+       header->format != CATALOG_FORMAT ||
+       header->prometheus_size != (int)sizeof(struct prometheus) ||
+       header->query_alts_size != (int)sizeof(struct query_alts) ||
+       header->column_size != (int)sizeof(struct column) ||
+       header->number_of_metrics < 0 ||
+       header->pool_size < CATALOG_RESERVED)
+   {
+      goto invalid;
+   }
+
+   expected = sizeof(struct catalog_cache) + (size_t)header->number_of_metrics * sizeof(struct prometheus) + header->pool_size;
+   if (expected != size)
+   {
+      goto invalid;
+   }
+
+   if (memcmp(header->key, key, CATALOG_KEY_LENGTH))
+   {
+      pgexporter_log_debug("The metric definitions changed since %s was written", config->metrics_definitions_cache);
+      goto error;
+   }
+
+   if (pgexporter_catalog_begin(config))
+   {
+      goto error;
+   }
+
+   builder = config->catalog_builder;
+
+   if (header->number_of_metrics > 0 &&
+       pgexporter_catalog_metric(config, header->number_of_metrics - 1) == NULL)
+   {
+      goto error;
+   }
+
+   if (header->pool_size > builder->size)
+   {
+      char* pool = (char*)realloc(builder->pool, header->pool_size);
+
+      if (pool == NULL)
+      {
+         goto error;
+      }
+
+      builder->pool = pool;
+      builder->size = header->pool_size;
+   }
+
+   if (header->number_of_metrics > 0)
+   {
+      memcpy(builder->prometheus, (char*)map + sizeof(struct catalog_cache),
+             (size_t)header->number_of_metrics * sizeof(struct prometheus));
+   }
+   memcpy(builder->pool, (char*)map + sizeof(struct catalog_cache) + (size_t)header->number_of_metrics * sizeof(struct prometheus),
+          header->pool_size);
+   builder->used = header->pool_size;
+
+   config->number_of_metrics = header->number_of_metrics;
+
+   pgexporter_log_debug("Catalog: %d metrics from %s", header->number_of_metrics, config->metrics_definitions_cache);
+
+   munmap(map, size);
+   close(fd);
+
+   return 0;
+
+invalid:
+
+   pgexporter_log_warn("Ignoring the invalid metric definitions cache %s", config->metrics_definitions_cache);
+
+error:
+
+   destroy_builder(config);
+
+   if (map != MAP_FAILED)
+   {
+      munmap(map, size);
+   }
+
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   return 1;
+}
+
+int
+pgexporter_catalog_write_cache(struct configuration* config, unsigned char* key)
+{
+   int fd = -1;
+   char* temp = NULL;
+   struct catalog_cache header;
+   struct catalog_builder* builder = config->catalog_builder;
+
+   if (strlen(config->metrics_definitions_cache) == 0)
+   {
+      return 0;
+   }
+
+   if (builder == NULL || builder->failed)
+   {
+      return 1;
+   }
+
+   memset(&header, 0, sizeof(struct catalog_cache));
+   memcpy(header.magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+   header.format = CATALOG_FORMAT;
+   header.prometheus_size = (int)sizeof(struct prometheus);
+   header.query_alts_size = (int)sizeof(struct query_alts);
+   header.column_size = (int)sizeof(struct column);
+   memcpy(header.key, key, CATALOG_KEY_LENGTH);
+   header.number_of_metrics = MIN(config->number_of_metrics, builder->number_of_metrics);
+   header.pool_size = builder->used;
+
+   temp = pgexporter_vappend(temp, 2, config->metrics_definitions_cache, ".XXXXXX");
+   if (temp == NULL)
+   {
+      goto error;
+   }
+
+   // mkstemp() creates the file with mode 0600
+   fd = mkstemp(temp);
+   if (fd == -1)
+   {
+      goto error;
+   }
+
+   if (write_all(fd, &header, sizeof(struct catalog_cache)) ||
+       (header.number_of_metrics > 0 && write_all(fd, builder->prometheus, (size_t)header.number_of_metrics * sizeof(struct prometheus))) ||
+       write_all(fd, builder->pool, builder->used))
+   {
+      goto error;
+   }
+
+   if (fsync(fd) == -1)
+   {
+      goto error;
+   }
+
+   close(fd);
+   fd = -1;
+
+   // Readers see either the previous file or this one
+   if (rename(temp, config->metrics_definitions_cache) == -1)
+   {
+      goto error;
+   }
+
+   pgexporter_log_debug("Catalog: %d metrics to %s", header.number_of_metrics, config->metrics_definitions_cache);
+
+   free(temp);
+
+   return 0;
+
+error:
+
+   pgexporter_log_warn("Unable to write the metric definitions cache %s: %s", config->metrics_definitions_cache, strerror(errno));
+
+   if (fd != -1)
+   {
+      close(fd);
+   }
+
+   if (temp != NULL)
+   {
+      unlink(temp);
+   }
+
+   free(temp);
+
+   return 1;
+}
+
+int
+pgexporter_catalog_publish(struct configuration* config)
+{
+   int number_of_metrics;
+   int number_of_servers;
+   size_t prepared;
+   size_t plans;
+   size_t pool;
+   size_t size;
+   void* shmem = NULL;
+   struct catalog* catalog = NULL;
+   struct prepared_statement* statements = NULL;
+   struct query_plan* query_plans = NULL;
+   struct catalog_builder* builder = config->catalog_builder;
+
+   if (builder == NULL || builder->failed)
+   {
+      pgexporter_log_error("Unable to allocate the metric definitions");
+      goto error;
+   }
+
+   number_of_metrics = MIN(config->number_of_metrics, builder->number_of_metrics);
+
+   for (int i = 0; i < number_of_metrics; i++)
+   {
+      if (compile_templates(config, i, builder->prometheus[i].root))
+      {
+         pgexporter_log_error("Unable to compile the samples of the metric '%s'", builder->prometheus[i].tag);
+         goto error;
+      }
+   }
+   number_of_servers = config->number_of_servers;
+
+   prepared = sizeof(struct catalog) + (size_t)number_of_metrics * sizeof(struct prometheus);
+   plans = align_size(prepared + (size_t)number_of_servers * number_of_metrics * sizeof(struct prepared_statement), 64);
+   pool = align_size(plans + (size_t)number_of_servers * number_of_metrics * sizeof(struct query_plan), 64);
+   size = pool + builder->used;
+
+   if (pgexporter_create_shared_memory(size, HUGEPAGE_OFF, &shmem))
+   {
+      pgexporter_log_error("Unable to allocate %zu bytes for the metric definitions", size);
+      goto error;
+   }
+
+   catalog = (struct catalog*)shmem;
+   catalog->size = size;
+   catalog->number_of_metrics = number_of_metrics;
+   catalog->number_of_servers = number_of_servers;
+   catalog->prepared = prepared;
+   catalog->plans = plans;
+   catalog->pool = pool;
+   catalog->pool_size = builder->used;
+
+   if (number_of_metrics > 0)
+   {
+      memcpy(&catalog->prometheus[0], builder->prometheus, number_of_metrics * sizeof(struct prometheus));
+   }
+
+   statements = (struct prepared_statement*)((char*)catalog + prepared);
+   for (int i = 0; i < number_of_servers * number_of_metrics; i++)
+   {
+      statements[i].version = -1;
+   }
+
+   query_plans = (struct query_plan*)((char*)catalog + plans);
+   for (int i = 0; i < number_of_servers * number_of_metrics; i++)
+   {
+      atomic_init(&query_plans[i].version, -1);
+   }
+
+   memcpy((char*)catalog + pool, builder->pool, builder->used);
+
+   // The segment doesn't move from now on, so the names can be pointers
+   for (int i = 0; i < number_of_metrics; i++)
+   {
+      publish_names((char*)catalog + pool, catalog->prometheus[i].root);
+   }
+
+   if (config->catalog != NULL)
+   {
+      pgexporter_destroy_shared_memory(config->catalog, config->catalog->size);
+   }
+
+   config->catalog = catalog;
+   config->number_of_metrics = number_of_metrics;
+
+   if (config == (struct configuration*)shmem)
+   {
+      generation = catalog;
+   }
+
+   destroy_builder(config);
+
+   pgexporter_log_debug("Catalog: %d metrics in %zu bytes", number_of_metrics, size);
+
+   return 0;
+
+error:
+
+   destroy_builder(config);
+
+   return 1;
+}
+
+struct catalog*
+pgexporter_catalog_get(struct configuration* config)
+{
+   if (config == (struct configuration*)shmem && generation != NULL)
+   {
+      return generation;
+   }
+
+   return config->catalog;
+}
+
+void
+pgexporter_catalog_transfer(struct configuration* config, struct configuration* reload, bool* retain)
+{
+   int kept = 0;
+   char* old_pool = NULL;
+   char* new_pool = NULL;
+   struct catalog* old = config->catalog;
+   struct catalog* new = reload->catalog;
+   struct query_alts* old_alt = NULL;
+   struct query_alts* new_alt = NULL;
+   struct prepared_statement* old_statement = NULL;
+   struct prepared_statement* new_statement = NULL;
+
+   if (old != NULL && new != NULL)
+   {
+      old_pool = (char*)old + old->pool;
+      new_pool = (char*)new + new->pool;
+
+      for (int server = 0; server < MIN(old->number_of_servers, new->number_of_servers); server++)
+      {
+         if (!retain[server])
+         {
+            continue;
+         }
+
+         // The statements are named after the index of the metric
+         for (int i = 0; i < MIN(old->number_of_metrics, new->number_of_metrics); i++)
+         {
+            old_statement = (struct prepared_statement*)((char*)old + old->prepared) + (size_t)server * old->number_of_metrics + i;
+            new_statement = (struct prepared_statement*)((char*)new + new->prepared) + (size_t)server * new->number_of_metrics + i;
+
+            if (old_statement->version == -1 || strcmp(old->prometheus[i].tag, new->prometheus[i].tag))
+            {
+               continue;
+            }
+
+            old_alt = pgexporter_get_query_alt(old_pool, old->prometheus[i].root, server);
+            new_alt = pgexporter_get_query_alt(new_pool, new->prometheus[i].root, server);
+
+            if (old_alt == NULL || new_alt == NULL ||
+                old_alt->version != new_alt->version ||
+                old_statement->version != new_alt->version ||
+                old_alt->n_columns != new_alt->n_columns ||
+                old_alt->is_histogram != new_alt->is_histogram ||
+                strcmp(old_pool + old_alt->query, new_pool + new_alt->query))
+            {
+               continue;
+            }
+
+            memcpy(new_statement, old_statement, sizeof(struct prepared_statement));
+            kept++;
+         }
+      }
+   }
+
+   config->catalog = new;
+   reload->catalog = old;
+   config->number_of_metrics = reload->number_of_metrics;
+
+   // The old generation stays mapped in the processes started with it
+   generation = config->catalog;
+
+   pgexporter_log_debug("Catalog: %d prepared statements kept", kept);
+}
+
+char*
+pgexporter_catalog_pool(struct configuration* config)
+{
+   struct catalog* catalog = NULL;
+
+   if (config->catalog_builder != NULL)
+   {
+      return config->catalog_builder->pool;
+   }
+
+   catalog = pgexporter_catalog_get(config);
+   if (catalog != NULL)
+   {
+      return (char*)catalog + catalog->pool;
+   }
+
+   return NULL;
+}
+
+struct prepared_statement*
+pgexporter_catalog_prepared(struct configuration* config, int server, int metric)
+{
+   struct catalog* catalog = pgexporter_catalog_get(config);
+
+   if (catalog == NULL ||
+       server < 0 || server >= catalog->number_of_servers ||
+       metric < 0 || metric >= catalog->number_of_metrics)
+   {
+      return NULL;
+   }
+
+   return (struct prepared_statement*)((char*)catalog + catalog->prepared) +
+          (size_t)server * catalog->number_of_metrics + metric;
+}
+
+struct query_plan*
+pgexporter_catalog_plan(struct configuration* config, int server, int metric)
+{
+   int version;
+   char* pool = NULL;
+   struct query_alts* query_alt = NULL;
+   struct query_plan* plan = NULL;
+   struct catalog* catalog = pgexporter_catalog_get(config);
+
+   if (catalog == NULL ||
+       server < 0 || server >= catalog->number_of_servers ||
+       metric < 0 || metric >= catalog->number_of_metrics)
+   {
+      return NULL;
+   }
+
+   plan = (struct query_plan*)((char*)catalog + catalog->plans) +
+          (size_t)server * catalog->number_of_metrics + metric;
+   version = config->server_states[server].version;
+
+   if (atomic_load_explicit(&plan->version, memory_order_acquire) != version)
+   {
+      // Every process resolves a plan to the same values, so they may race
+      pool = (char*)catalog + catalog->pool;
+      query_alt = pgexporter_get_query_alt(pool, catalog->prometheus[metric].root, server);
+
+      plan->query_alt = query_alt;
+      plan->names = query_alt != NULL && !query_alt->is_histogram ? (char**)(pool + query_alt->names) : NULL;
+
+      atomic_store_explicit(&plan->version, version, memory_order_release);
+   }
+
+   return plan;
+}
+
+void
+pgexporter_catalog_destroy(struct configuration* config)
+{
+   destroy_builder(config);
+
+   if (config->catalog != NULL)
+   {
+      if (generation == config->catalog)
+      {
+         generation = NULL;
+      }
+
+      pgexporter_destroy_shared_memory(config->catalog, config->catalog->size);
+      config->catalog = NULL;
+   }
+}
+
+static size_t
+align_size(size_t size, size_t alignment)
+{
+   return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static int
+compile_templates(struct configuration* config, int metric, size_t node)
+{
+   int type;
+   size_t left;
+   size_t right;
+   size_t sample;
+   size_t offset;
+   size_t name;
+   int n_columns;
+   char buffer[MISC_LENGTH * 2 + 16];
+   char* pool = NULL;
+   struct column* columns = NULL;
+   struct query_alts* query_alt = NULL;
+   struct metric_template* template = NULL;
+
+   if (node == 0)
+   {
+      return 0;
+   }
+
+   // The pool moves as it grows, so the nodes are found again by offset
+   pool = pgexporter_catalog_pool(config);
+   query_alt = (struct query_alts*)(pool + node);
+   left = query_alt->left;
+   right = query_alt->right;
+   n_columns = MIN(query_alt->n_columns, MAX_NUMBER_OF_COLUMNS);
+
+   if (!query_alt->is_histogram && query_alt->sample == 0)
+   {
+      sample = pgexporter_catalog_alloc(config, sizeof(struct metric_template));
+      if (sample == 0)
+      {
+         return 1;
+      }
+
+      for (int k = 0; k < n_columns; k++)
+      {
+         pool = pgexporter_catalog_pool(config);
+         query_alt = (struct query_alts*)(pool + node);
+         columns = (struct column*)(pool + query_alt->columns);
+         type = columns[k].type;
+         name = columns[k].name;
+
+         if (type == LABEL_TYPE && name != 0)
+         {
+            snprintf(buffer, sizeof(buffer), "%s=\"", pool + name);
+         }
+         else if (type == COUNTER_TYPE || type == GAUGE_TYPE)
+         {
+            snprintf(buffer, sizeof(buffer), "pgexporter_%s%s%s{", config->catalog_builder->prometheus[metric].tag,
+                     name != 0 ? "_" : "", pool + name);
+         }
+         else
+         {
+            continue;
+         }
+
+         offset = pgexporter_catalog_strdup(config, buffer);
+         if (offset == 0)
+         {
+            return 1;
+         }
+
+         template = (struct metric_template*)(pgexporter_catalog_pool(config) + sample);
+         if (type == LABEL_TYPE)
+         {
+            template->labels[template->number_of_labels] = k;
+            template->label_names[template->number_of_labels] = offset;
+            template->label_lengths[template->number_of_labels] = strlen(buffer);
+            template->number_of_labels++;
+         }
+         else
+         {
+            template->values[template->number_of_values] = k;
+            template->prefixes[template->number_of_values] = offset;
+            template->prefix_lengths[template->number_of_values] = strlen(buffer);
+            template->number_of_values++;
+         }
+      }
+
+      // Without a value column the first column is reported, as it always was
+      template = (struct metric_template*)(pgexporter_catalog_pool(config) + sample);
+      if (template->number_of_values == 0 && n_columns > 0)
+      {
+         snprintf(buffer, sizeof(buffer), "pgexporter_%s{", config->catalog_builder->prometheus[metric].tag);
+
+         offset = pgexporter_catalog_strdup(config, buffer);
+         if (offset == 0)
+         {
+            return 1;
+         }
+
+         template = (struct metric_template*)(pgexporter_catalog_pool(config) + sample);
+         template->values[0] = 0;
+         template->prefixes[0] = offset;
+         template->prefix_lengths[0] = strlen(buffer);
+         template->number_of_values = 1;
+      }
+
+      query_alt = (struct query_alts*)(pgexporter_catalog_pool(config) + node);
+      query_alt->sample = sample;
+   }
+
+   if (compile_templates(config, metric, left))
+   {
+      return 1;
+   }
+
+   return compile_templates(config, metric, right);
+}
+
+static int
+cache_key(char* path, bool json, unsigned char* key)
+{
+   int format = CATALOG_FORMAT;
+   int sizes[3];
+   unsigned int length = 0;
+   int number_of_files = 0;
+   char** files = NULL;
+   EVP_MD_CTX* ctx = NULL;
+
+   sizes[0] = (int)sizeof(struct prometheus);
+   sizes[1] = (int)sizeof(struct query_alts);
+   sizes[2] = (int)sizeof(struct column);
+
+   ctx = EVP_MD_CTX_new();
+   if (ctx == NULL)
+   {
+      goto error;
+   }
+
+   if (EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1)
+   {
+      goto error;
+   }
+
+   if (EVP_DigestUpdate(ctx, &format, sizeof(format)) != 1 ||
+       EVP_DigestUpdate(ctx, VERSION, strlen(VERSION) + 1) != 1 ||
+       EVP_DigestUpdate(ctx, sizes, sizeof(sizes)) != 1 ||
+       EVP_DigestUpdate(ctx, &json, sizeof(json)) != 1 ||
+       EVP_DigestUpdate(ctx, INTERNAL_YAML, strlen(INTERNAL_YAML) + 1) != 1)
+   {
+      goto error;
+   }
+
+   if (path != NULL)
+   {
+      if (EVP_DigestUpdate(ctx, path, strlen(path) + 1) != 1)
+      {
+         goto error;
+      }
+
+      if (pgexporter_is_file(path))
+      {
+         if (digest_file(ctx, path, ""))
+         {
+            goto error;
+         }
+      }
+      else if (pgexporter_is_directory(path))
+      {
+         // The files are sorted by name, like the loaders read them
+         if (pgexporter_get_files(path, &number_of_files, &files))
+         {
+            goto error;
+         }
+
+         for (int i = 0; i < number_of_files; i++)
+         {
+            char* p = NULL;
+
+            p = pgexporter_vappend(p, 3, path, "/", files[i]);
+            if (p == NULL || digest_file(ctx, p, files[i]))
+            {
+               free(p);
+               goto error;
+            }
+
+            free(p);
+         }
+      }
+   }
+
+   if (EVP_DigestFinal_ex(ctx, key, &length) != 1 || length != CATALOG_KEY_LENGTH)
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+
+   EVP_MD_CTX_free(ctx);
+
+   return 0;
+
+error:
+
+   for (int i = 0; i < number_of_files; i++)
+   {
+      free(files[i]);
+   }
+   free(files);
+
+   EVP_MD_CTX_free(ctx);
+
+   return 1;
+}
+
+static int
+digest_file(EVP_MD_CTX* ctx, char* path, char* name)
+{
+   size_t n;
+   char buffer[8192];
+   FILE* file = NULL;
+   struct stat st;
+
+   file = fopen(path, "r");
+   if (file == NULL)
+   {
+      goto error;
+   }
+
+   if (fstat(fileno(file), &st) == -1)
+   {
+      goto error;
+   }
+
+   if (EVP_DigestUpdate(ctx, name, strlen(name) + 1) != 1 ||
+       EVP_DigestUpdate(ctx, &st.st_size, sizeof(st.st_size)) != 1 ||
+       EVP_DigestUpdate(ctx, &st.st_mtim, sizeof(st.st_mtim)) != 1)
+   {
+      goto error;
+   }
+
+   while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+   {
+      if (EVP_DigestUpdate(ctx, buffer, n) != 1)
+      {
+         goto error;
+      }
+   }
+
+   if (ferror(file))
+   {
+      goto error;
+   }
+
+   fclose(file);
+
+   return 0;
+
+error:
+
+   if (file != NULL)
+   {
+      fclose(file);
+   }
+
+   return 1;
+}
+
+static int
+write_all(int fd, void* buffer, size_t size)
+{
+   ssize_t n;
+   size_t written = 0;
+
+   while (written < size)
+   {
+      n = write(fd, (char*)buffer + written, size - written);
+      if (n == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return 1;
+      }
+      written += (size_t)n;
+   }
+
+   return 0;
+}
+
+static void
+publish_names(char* pool, size_t node)
+{
+   char** names = NULL;
+   struct column* columns = NULL;
+   struct query_alts* query_alt = NULL;
+
+   if (node == 0)
+   {
+      return;
+   }
+
+   query_alt = (struct query_alts*)(pool + node);
+   columns = (struct column*)(pool + query_alt->columns);
+   names = (char**)(pool + query_alt->names);
+
+   for (int i = 0; i < query_alt->n_columns; i++)
+   {
+      names[i] = pool + columns[i].name;
+   }
+
+   publish_names(pool, query_alt->left);
+   publish_names(pool, query_alt->right);
+}
+
+static void
+destroy_builder(struct configuration* config)
+{
+   if (config->catalog_builder != NULL)
+   {
+      free(config->catalog_builder->prometheus);
+      free(config->catalog_builder->pool);
+      free(config->catalog_builder);
+      config->catalog_builder = NULL;
+   }
+}
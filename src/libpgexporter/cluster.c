@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <cache.h>
+#include <cluster.h>
+#include <http.h>
+#include <logging.h>
+#include <utils.h>
+
+/* system */
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t weight(struct cluster_member* member, char* server);
+static bool heartbeat(struct cluster_member* member);
+static int owned(int member);
+
+bool
+pgexporter_cluster_owns(int server)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->cluster_member == -1)
+   {
+      return true;
+   }
+
+   return pgexporter_cluster_owner(server) == config->cluster_member;
+}
+
+int
+pgexporter_cluster_owner(int server)
+{
+   int owner = -1;
+   uint64_t best = 0;
+   uint64_t w;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->cluster_member == -1)
+   {
+      return -1;
+   }
+
+   // A member going down only moves its own servers, each to the member next in its order
+   for (int m = 0; m < config->number_of_members; m++)
+   {
+      if (m != config->cluster_member && !atomic_load(&config->members[m].alive))
+      {
+         continue;
+      }
+
+      w = weight(&config->members[m], config->servers[server].name);
+
+      if (owner == -1 || w > best)
+      {
+         owner = m;
+         best = w;
+      }
+   }
+
+   return owner;
+}
+
+bool
+pgexporter_cluster_endpoint_alive(int endpoint)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   for (int m = 0; m < config->number_of_members; m++)
+   {
+      if (config->members[m].endpoint == endpoint)
+      {
+         return m == config->cluster_member || atomic_load(&config->members[m].alive);
+      }
+   }
+
+   return true;
+}
+
+int
+pgexporter_cluster_heartbeat(void)
+{
+   bool alive;
+   bool changed = false;
+   time_t now;
+   struct cluster_member* member = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->cluster_member == -1)
+   {
+      return 60;
+   }
+
+   for (int m = 0; m < config->number_of_members; m++)
+   {
+      member = &config->members[m];
+
+      if (m == config->cluster_member)
+      {
+         atomic_store(&member->seen, (long long)time(NULL));
+         continue;
+      }
+
+      if (heartbeat(member))
+      {
+         atomic_store(&member->seen, (long long)time(NULL));
+      }
+
+      now = time(NULL);
+      alive = now - (time_t)atomic_load(&member->seen) < config->cluster_timeout;
+
+      if (alive != atomic_load(&member->alive))
+      {
+         atomic_store(&member->alive, alive);
+         changed = true;
+
+         if (alive)
+         {
+            pgexporter_log_info("Cluster: %s:%d is up", member->host, member->port);
+         }
+         else
+         {
+            pgexporter_log_warn("Cluster: %s:%d is down", member->host, member->port);
+         }
+      }
+   }
+
+   if (changed)
+   {
+      pgexporter_log_info("Cluster: %d of %d servers collected by %s", owned(config->cluster_member),
+                          config->number_of_servers, config->cluster_self);
+
+      // A cached response may leave out the servers just taken over
+      pgexporter_cache_invalidate((struct prometheus_cache*)prometheus_cache_shmem);
+   }
+
+   return config->cluster_interval;
+}
+
+int
+pgexporter_cluster_status(struct builder* builder)
+{
+   char line[MISC_LENGTH * 2];
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->cluster_member == -1)
+   {
+      return 1;
+   }
+
+   snprintf(&line[0], sizeof(line), "self %s\n", config->cluster_self);
+
+   if (pgexporter_builder_append(builder, &line[0]))
+   {
+      return 1;
+   }
+
+   for (int m = 0; m < config->number_of_members; m++)
+   {
+      bool alive = m == config->cluster_member || atomic_load(&config->members[m].alive);
+
+      snprintf(&line[0], sizeof(line), "member %s:%d %s %d\n", config->members[m].host, config->members[m].port,
+               alive ? "up" : "down", alive ? owned(m) : 0);
+
+      if (pgexporter_builder_append(builder, &line[0]))
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+static uint64_t
+weight(struct cluster_member* member, char* server)
+{
+   char key[MISC_LENGTH * 3];
+   uint64_t hash = 14695981039346656037ULL;
+   int length;
+
+   length = snprintf(&key[0], sizeof(key), "%s:%d/%s", member->host, member->port, server);
+   length = MIN(length, (int)sizeof(key) - 1);
+
+   // FNV-1a, and a finalizer so that similar names don't have similar weights
+   for (int i = 0; i < length; i++)
+   {
+      hash ^= (unsigned char)key[i];
+      hash *= 1099511628211ULL;
+   }
+
+   hash ^= hash >> 33;
+   hash *= 0xff51afd7ed558ccdULL;
+   hash ^= hash >> 33;
+   hash *= 0xc4ceb9fe1a85ec53ULL;
+   hash ^= hash >> 33;
+
+   return hash;
+}
+
+static bool
+heartbeat(struct cluster_member* member)
+{
+   bool alive = false;
+   char expected[MISC_LENGTH * 2];
+   struct http* http = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   // The members are expected to share the TLS setup of the metrics port
+   if (pgexporter_http_connect(member->host, member->port, strlen(config->metrics_cert_file) > 0,
+                               config->cluster_interval, &http))
+   {
+      pgexporter_log_debug("Cluster: No connection to %s:%d", member->host, member->port);
+      return false;
+   }
+
+   if (!pgexporter_http_get(http, member->host, "/cluster") && http->status == 200 && http->body != NULL)
+   {
+      // The member has to answer as itself, so a wrong address isn't taken as alive
+      snprintf(&expected[0], sizeof(expected), "self %s:%d\n", member->host, member->port);
+      alive = pgexporter_starts_with(http->body, &expected[0]);
+
+      if (!alive)
+      {
+         pgexporter_log_debug("Cluster: %s:%d answered as another member", member->host, member->port);
+      }
+   }
+
+   pgexporter_http_disconnect(http);
+
+   return alive;
+}
+
+static int
+owned(int member)
+{
+   int count = 0;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   for (int server = 0; server < config->number_of_servers; server++)
+   {
+      if (pgexporter_cluster_owner(server) == member)
+      {
+         count++;
+      }
+   }
+
+   return count;
+}
@@ -30,14 +30,16 @@
 #include <pgexporter.h>
 #include <aes.h>
 #include <bridge.h>
+#include <catalog.h>
 #include <configuration.h>
 #include <logging.h>
 #include <management.h>
 #include <network.h>
 #include <prometheus.h>
-#include <query_alts.h>
+#include <queries.h>
 #include <security.h>
 #include <shmem.h>
+#include <trace.h>
 #include <utils.h>
 #include <value.h>
 #include <yaml_configuration.h>
@@ -71,16 +73,21 @@ static int as_logging_type(char* str);
 static int as_logging_level(char* str);
 static int as_logging_mode(char* str);
 static int as_hugepage(char* str);
+static int as_numa(char* str);
 static unsigned int as_update_process_title(char* str, unsigned int default_policy);
 static int as_logging_rotation_size(char* str, size_t* size);
 static int as_logging_rotation_age(char* str, int* age);
 static int as_seconds(char* str, int* age, int default_age);
 static int as_bytes(char* str, long* bytes, long default_bytes);
 static int as_endpoints(char* str, struct configuration* config, bool reload);
+static int as_bridge_rules(char* str, struct configuration* config, bool append);
+static int as_cluster(char* str, struct configuration* config);
+static bool rule_word(char** p, char* word);
 static bool transfer_configuration(struct configuration* config, struct configuration* reload);
 static void copy_server(struct server* dst, struct server* src);
+static bool same_connection(struct server* e, struct server* n);
+static void init_server_state(struct server_state* state);
 static void copy_user(struct user* dst, struct user* src);
-static void copy_promethus(struct prometheus* dst, struct prometheus* src);
 static void copy_endpoint(struct endpoint* dst, struct endpoint* src);
 static int restart_int(char* name, int e, int n);
 static int restart_string(char* name, char* e, char* n);
@@ -101,14 +108,35 @@ pgexporter_init_configuration(void* shm)
    config = (struct configuration*)shm;
 
    config->metrics = -1;
+   config->metrics_parallel = 1;
+   config->database_parallel = 4;
+   config->role_interval = 30;
+   config->metrics_pipeline = false;
+   config->metrics_binary = false;
+   config->metrics_self = true;
+   config->memory_accounting = false;
+   config->metrics_negotiation = false;
+   config->query_timeout = 0;
+   config->metrics_generation = 1;
    config->cache = true;
 
    config->bridge = -1;
    config->bridge_cache_max_age = 300;
    config->bridge_cache_max_size = PROMETHEUS_DEFAULT_BRIDGE_CACHE_SIZE;
+   config->remote_write_batch = 2000;
+   config->remote_write_queue = 64;
+   config->remote_write_timeout = 10;
+   config->bridge_parallel = 4;
+   config->bridge_timeout = 10;
+   config->bridge_keep_alive = true;
    config->bridge_json = -1;
    config->bridge_json_cache_max_size = PROMETHEUS_DEFAULT_BRIDGE_JSON_CACHE_SIZE;
 
+   config->cluster_interval = 5;
+   config->cluster_timeout = 15;
+   config->cluster_federate = false;
+   config->cluster_member = -1;
+
    config->tls = false;
 
    config->blocking_timeout = 30;
@@ -118,13 +146,17 @@ pgexporter_init_configuration(void* shm)
    config->nodelay = true;
    config->non_blocking = true;
    config->backlog = 16;
+   config->workers = 0;
    config->hugepage = HUGEPAGE_TRY;
+   config->numa = NUMA_OFF;
+   config->traces = 0;
 
    config->update_process_title = UPDATE_PROCESS_TITLE_VERBOSE;
 
    config->log_type = PGEXPORTER_LOGGING_TYPE_CONSOLE;
    config->log_level = PGEXPORTER_LOGGING_LEVEL_INFO;
    config->log_mode = PGEXPORTER_LOGGING_MODE_APPEND;
+   config->log_async = true;
    atomic_init(&config->log_lock, STATE_FREE);
 
    atomic_init(&config->logging_info, 0);
@@ -132,10 +164,9 @@ pgexporter_init_configuration(void* shm)
    atomic_init(&config->logging_error, 0);
    atomic_init(&config->logging_fatal, 0);
 
-   for (int i = 0; i < NUMBER_OF_METRICS; i++)
+   for (int i = 0; i < NUMBER_OF_SERVERS; i++)
    {
-      config->prometheus[i].sort_type = SORT_NAME;
-      config->prometheus[i].server_query_type = SERVER_QUERY_BOTH;
+      init_server_state(&config->server_states[i]);
    }
 
    return 0;
@@ -207,10 +238,7 @@ pgexporter_read_configuration(void* shm, char* filename)
 
                   memset(&srv, 0, sizeof(struct server));
                   memcpy(&srv.name, &section, strlen(section));
-                  srv.fd = -1;
-                  srv.extension = true;
-                  srv.state = SERVER_UNKNOWN;
-                  srv.version = SERVER_UNDERTERMINED_VERSION;
+                  srv.database_connections = DEFAULT_DATABASE_CONNECTIONS;
 
                   idx_server++;
                }
@@ -223,10 +251,11 @@ pgexporter_read_configuration(void* shm, char* filename)
          else
          {
             if (pgexporter_starts_with(line, "unix_socket_dir") || pgexporter_starts_with(line, "metrics_path")
+                || pgexporter_starts_with(line, "metrics_definitions_cache")
                 || pgexporter_starts_with(line, "log_path") || pgexporter_starts_with(line, "tls_cert_file")
                 || pgexporter_starts_with(line, "tls_key_file") || pgexporter_starts_with(line, "tls_ca_file")
                 || pgexporter_starts_with(line, "metrics_cert_file") || pgexporter_starts_with(line, "metrics_key_file")
-                || pgexporter_starts_with(line, "metrics_ca_file"))
+                || pgexporter_starts_with(line, "metrics_ca_file") || pgexporter_starts_with(line, "remote_write"))
             {
                extract_syskey_value(line, &key, &value);
             }
@@ -357,6 +386,204 @@ pgexporter_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "metrics_parallel"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_int(value, &config->metrics_parallel))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "database_parallel"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_int(value, &config->database_parallel))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "role_interval"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_seconds(value, &config->role_interval, 30))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "metrics_pipeline"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_bool(value, &config->metrics_pipeline))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "metrics_binary"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_bool(value, &config->metrics_binary))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "metrics_self"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_bool(value, &config->metrics_self))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "memory_accounting"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_bool(value, &config->memory_accounting))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "metrics_negotiation"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_bool(value, &config->metrics_negotiation))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "query_timeout"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_seconds(value, &config->query_timeout, 0))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "collection_interval"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_seconds(value, &config->collection_interval, 0))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "remote_write"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     max = strlen(value);
+                     if (max > MAX_PATH - 1)
+                     {
+                        max = MAX_PATH - 1;
+                     }
+                     memcpy(config->remote_write, value, max);
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "remote_write_batch"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_int(value, &config->remote_write_batch))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "remote_write_queue"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_int(value, &config->remote_write_queue))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "remote_write_timeout"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_seconds(value, &config->remote_write_timeout, 0))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "bridge"))
                {
                   if (!strcmp(section, "pgexporter"))
@@ -408,6 +635,62 @@ pgexporter_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "bridge_parallel"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_int(value, &config->bridge_parallel))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "bridge_timeout"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_seconds(value, &config->bridge_timeout, 0))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "bridge_keep_alive"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_bool(value, &config->bridge_keep_alive))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "bridge_interval"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_seconds(value, &config->bridge_interval, 0))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "bridge_cache_max_age"))
                {
                   if (!strcmp(section, "pgexporter"))
@@ -436,6 +719,93 @@ pgexporter_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "bridge_aggregate"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     // Each line adds its rules to those of the lines before
+                     if (as_bridge_rules(value, config, true))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "cluster"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_cluster(value, config))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "cluster_self"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     max = strlen(value);
+                     if (max > MISC_LENGTH - 1)
+                     {
+                        max = MISC_LENGTH - 1;
+                     }
+                     memcpy(config->cluster_self, value, max);
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "cluster_interval"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_seconds(value, &config->cluster_interval, 5))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "cluster_timeout"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_seconds(value, &config->cluster_timeout, 15))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "cluster_federate"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_bool(value, &config->cluster_federate))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "bridge_json_cache_max_size"))
                {
                   if (!strcmp(section, "pgexporter"))
@@ -776,6 +1146,20 @@ pgexporter_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "log_async"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_bool(value, &config->log_async))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "unix_socket_dir"))
                {
                   if (!strcmp(section, "pgexporter"))
@@ -864,6 +1248,20 @@ pgexporter_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "workers"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_int(value, &config->workers))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "hugepage"))
                {
                   if (!strcmp(section, "pgexporter"))
@@ -876,6 +1274,31 @@ pgexporter_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "numa"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     config->numa = as_numa(value);
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "traces"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     if (as_int(value, &config->traces))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "data_dir"))
                {
                   if (strlen(section) > 0)
@@ -920,6 +1343,34 @@ pgexporter_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "max_parallel_queries"))
+               {
+                  if (strlen(section) > 0 && strcmp(section, "pgexporter"))
+                  {
+                     if (as_int(value, &srv.max_parallel_queries))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
+               else if (!strcmp(key, "database_connections"))
+               {
+                  if (strlen(section) > 0 && strcmp(section, "pgexporter"))
+                  {
+                     if (as_int(value, &srv.database_connections))
+                     {
+                        unknown = true;
+                     }
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else if (!strcmp(key, "metrics_path"))
                {
                   if (!strcmp(section, "pgexporter"))
@@ -936,6 +1387,22 @@ pgexporter_read_configuration(void* shm, char* filename)
                      unknown = true;
                   }
                }
+               else if (!strcmp(key, "metrics_definitions_cache"))
+               {
+                  if (!strcmp(section, "pgexporter"))
+                  {
+                     max = strlen(value);
+                     if (max > MAX_PATH - 1)
+                     {
+                        max = MAX_PATH - 1;
+                     }
+                     memcpy(config->metrics_definitions_cache, value, max);
+                  }
+                  else
+                  {
+                     unknown = true;
+                  }
+               }
                else
                {
                   unknown = true;
@@ -1019,27 +1486,167 @@ pgexporter_validate_configuration(void* shm)
       return 1;
    }
 
-   if (config->metrics == -1 && config->bridge == -1)
+   if (config->metrics == -1 && config->bridge == -1)
+   {
+      pgexporter_log_fatal("pgexporter: No metrics nor bridge defined");
+      return 1;
+   }
+
+   if (config->bridge == -1 && config->bridge_json != -1)
+   {
+      pgexporter_log_fatal("pgexporter: Bridge JSON defined, but bridge isn't enabled");
+      return 1;
+   }
+
+   if (config->bridge_json != -1 && config->bridge_json_cache_max_size <= 0)
+   {
+      pgexporter_log_fatal("pgexporter: Bridge JSON requires a cache");
+      return 1;
+   }
+
+   if (config->backlog < 16)
+   {
+      config->backlog = 16;
+   }
+
+   if (config->workers < 0)
+   {
+      config->workers = 0;
+   }
+   else if (config->workers > NUMBER_OF_WORKERS)
+   {
+      config->workers = NUMBER_OF_WORKERS;
+   }
+
+   if (config->metrics_parallel < 1)
+   {
+      config->metrics_parallel = 1;
+   }
+   else if (config->metrics_parallel > NUMBER_OF_SERVERS)
+   {
+      config->metrics_parallel = NUMBER_OF_SERVERS;
+   }
+
+   if (config->database_parallel < 1)
+   {
+      config->database_parallel = 1;
+   }
+   else if (config->database_parallel > MAX_DATABASE_PARALLEL)
+   {
+      config->database_parallel = MAX_DATABASE_PARALLEL;
+   }
+
+   if (config->remote_write_batch < 1)
+   {
+      config->remote_write_batch = 1;
+   }
+
+   if (config->remote_write_queue < 1)
+   {
+      config->remote_write_queue = 1;
+   }
+
+   if (strlen(config->remote_write) > 0 && config->collection_interval <= 0)
    {
-      pgexporter_log_fatal("pgexporter: No metrics nor bridge defined");
-      return 1;
+      pgexporter_log_warn("pgexporter: remote_write requires collection_interval");
    }
 
-   if (config->bridge == -1 && config->bridge_json != -1)
+   if (config->traces < 0)
    {
-      pgexporter_log_fatal("pgexporter: Bridge JSON defined, but bridge isn't enabled");
-      return 1;
+      config->traces = 0;
+   }
+   else if (config->traces > TRACE_MAX_TRACES)
+   {
+      config->traces = TRACE_MAX_TRACES;
    }
 
-   if (config->bridge_json != -1 && config->bridge_json_cache_max_size <= 0)
+   if (config->bridge_parallel < 1)
    {
-      pgexporter_log_fatal("pgexporter: Bridge JSON requires a cache");
-      return 1;
+      config->bridge_parallel = 1;
+   }
+   else if (config->bridge_parallel > NUMBER_OF_ENDPOINTS)
+   {
+      config->bridge_parallel = NUMBER_OF_ENDPOINTS;
    }
 
-   if (config->backlog < 16)
+   config->cluster_member = -1;
+
+   if (config->number_of_members > 0)
    {
-      config->backlog = 16;
+      char member[MISC_LENGTH * 2];
+
+      if (config->metrics == -1)
+      {
+         pgexporter_log_fatal("pgexporter: cluster requires metrics");
+         return 1;
+      }
+
+      for (int i = 0; i < config->number_of_members; i++)
+      {
+         snprintf(&member[0], sizeof(member), "%s:%d", config->members[i].host, config->members[i].port);
+
+         if (!strcmp(&member[0], config->cluster_self))
+         {
+            config->cluster_member = i;
+         }
+
+         // All the members are alive until they miss their heartbeats
+         config->members[i].endpoint = -1;
+         atomic_init(&config->members[i].alive, true);
+         atomic_init(&config->members[i].seen, (long long)time(NULL));
+      }
+
+      if (config->cluster_member == -1)
+      {
+         pgexporter_log_fatal("pgexporter: cluster_self '%s' isn't a member of cluster", config->cluster_self);
+         return 1;
+      }
+
+      if (config->cluster_interval < 1)
+      {
+         config->cluster_interval = 1;
+      }
+
+      if (config->cluster_timeout < config->cluster_interval)
+      {
+         config->cluster_timeout = config->cluster_interval;
+      }
+
+      if (config->cluster_federate && config->bridge == -1)
+      {
+         pgexporter_log_warn("pgexporter: cluster_federate requires bridge");
+      }
+      else if (config->cluster_federate)
+      {
+         // The members are fetched by the bridge like any endpoint
+         for (int i = 0; i < config->number_of_members; i++)
+         {
+            for (int e = 0; e < config->number_of_endpoints; e++)
+            {
+               if (!strcmp(config->endpoints[e].host, config->members[i].host) &&
+                   config->endpoints[e].port == config->members[i].port)
+               {
+                  config->members[i].endpoint = e;
+               }
+            }
+
+            if (config->members[i].endpoint == -1)
+            {
+               if (config->number_of_endpoints >= NUMBER_OF_ENDPOINTS)
+               {
+                  pgexporter_log_warn("pgexporter: No bridge endpoint left for %s:%d", config->members[i].host,
+                                      config->members[i].port);
+                  continue;
+               }
+
+               memset(&config->endpoints[config->number_of_endpoints], 0, sizeof(struct endpoint));
+               memcpy(config->endpoints[config->number_of_endpoints].host, config->members[i].host, MISC_LENGTH);
+               config->endpoints[config->number_of_endpoints].port = config->members[i].port;
+               config->members[i].endpoint = config->number_of_endpoints;
+               config->number_of_endpoints++;
+            }
+         }
+      }
    }
 
    if (strlen(config->metrics_cert_file) > 0)
@@ -1112,6 +1719,24 @@ pgexporter_validate_configuration(void* shm)
          pgexporter_log_fatal("pgexporter: No user defined for %s", config->servers[i].name);
          return 1;
       }
+
+      if (config->servers[i].max_parallel_queries < 1)
+      {
+         config->servers[i].max_parallel_queries = 1;
+      }
+      else if (config->servers[i].max_parallel_queries > MAX_PARALLEL_QUERIES)
+      {
+         config->servers[i].max_parallel_queries = MAX_PARALLEL_QUERIES;
+      }
+
+      if (config->servers[i].database_connections < 1)
+      {
+         config->servers[i].database_connections = 1;
+      }
+      else if (config->servers[i].database_connections > MAX_DATABASE_CONNECTIONS)
+      {
+         config->servers[i].database_connections = MAX_DATABASE_CONNECTIONS;
+      }
    }
 
    return 0;
@@ -1459,6 +2084,7 @@ int
 pgexporter_reload_configuration(bool* r)
 {
    size_t reload_size;
+   unsigned char catalog_key[CATALOG_KEY_LENGTH];
    struct configuration* reload = NULL;
    struct configuration* config;
 
@@ -1497,17 +2123,27 @@ pgexporter_reload_configuration(bool* r)
       }
    }
 
-   if (pgexporter_read_internal_yaml_metrics(reload, true))
-   {
-      goto error;
-   }
-
-   if (strlen(reload->metrics_path) > 0)
+   if (pgexporter_catalog_read_cache(reload, strlen(reload->metrics_path) > 0 ? reload->metrics_path : NULL, false, catalog_key))
    {
-      if (pgexporter_read_metrics_configuration((void*)reload))
+      if (pgexporter_read_internal_yaml_metrics(reload, true))
       {
          goto error;
       }
+
+      if (strlen(reload->metrics_path) > 0)
+      {
+         if (pgexporter_read_metrics_configuration((void*)reload))
+         {
+            goto error;
+         }
+      }
+
+      pgexporter_catalog_write_cache(reload, catalog_key);
+   }
+
+   if (pgexporter_catalog_publish(reload))
+   {
+      goto error;
    }
 
    if (pgexporter_validate_configuration(reload))
@@ -1527,11 +2163,8 @@ pgexporter_reload_configuration(bool* r)
 
    *r = transfer_configuration(config, reload);
 
-   /* Free Old Query Alts AVL Tree */
-   for (int i = 0; reload != NULL && i < reload->number_of_metrics; i++)
-   {
-      pgexporter_free_query_alts(reload);
-   }
+   /* The old metric definitions were handed over to the reload */
+   pgexporter_catalog_destroy(reload);
 
    pgexporter_destroy_shared_memory((void*)reload, reload_size);
 
@@ -1541,10 +2174,9 @@ pgexporter_reload_configuration(bool* r)
 
 error:
 
-   /* Free Old Query Alts AVL Tree */
-   for (int i = 0; reload != NULL && i < reload->number_of_metrics; i++)
+   if (reload != NULL)
    {
-      pgexporter_free_query_alts(reload);
+      pgexporter_catalog_destroy(reload);
    }
 
    pgexporter_destroy_shared_memory((void*)reload, reload_size);
@@ -1554,7 +2186,7 @@ error:
    return 1;
 }
 
-void
+int
 pgexporter_conf_get(SSL* ssl __attribute__((unused)), int client_fd, uint8_t compression, uint8_t encryption, struct json* payload)
 {
    struct json* response = NULL;
@@ -1563,8 +2195,6 @@ pgexporter_conf_get(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
    time_t end_time;
    int total_seconds;
 
-   pgexporter_start_logging();
-
    start_time = time(NULL);
 
    if (pgexporter_management_create_response(payload, -1, &response))
@@ -1591,26 +2221,16 @@ pgexporter_conf_get(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
 
    pgexporter_log_info("Conf Get (Elapsed: %s)", elapsed);
 
-   pgexporter_json_destroy(payload);
+   free(elapsed);
 
-   pgexporter_disconnect(client_fd);
-
-   pgexporter_stop_logging();
+   return 0;
 
-   exit(0);
 error:
 
-   pgexporter_json_destroy(payload);
-
-   pgexporter_disconnect(client_fd);
-
-   pgexporter_stop_logging();
-
-   exit(1);
-
+   return 1;
 }
 
-void
+int
 pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t compression, uint8_t encryption, struct json* payload)
 {
    struct json* response = NULL;
@@ -1629,8 +2249,6 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
    int server_index = -1;
    int begin = -1, end = -1;
 
-   pgexporter_start_logging();
-
    start_time = time(NULL);
 
    config = (struct configuration*)shmem;
@@ -1809,6 +2427,121 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
          }
          pgexporter_json_put(response, key, (uintptr_t)config->metrics_cache_max_age, ValueInt64);
       }
+      else if (!strcmp(key, "metrics_parallel"))
+      {
+         if (as_int(config_value, &config->metrics_parallel))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->metrics_parallel, ValueInt64);
+      }
+      else if (!strcmp(key, "database_parallel"))
+      {
+         if (as_int(config_value, &config->database_parallel))
+         {
+            unknown = true;
+         }
+         config->database_parallel = MAX(1, MIN(config->database_parallel, MAX_DATABASE_PARALLEL));
+         pgexporter_json_put(response, key, (uintptr_t)config->database_parallel, ValueInt64);
+      }
+      else if (!strcmp(key, "role_interval"))
+      {
+         if (as_seconds(config_value, &config->role_interval, 30))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->role_interval, ValueInt64);
+      }
+      else if (!strcmp(key, "metrics_pipeline"))
+      {
+         if (as_bool(config_value, &config->metrics_pipeline))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->metrics_pipeline, ValueBool);
+      }
+      else if (!strcmp(key, "metrics_binary"))
+      {
+         if (as_bool(config_value, &config->metrics_binary))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->metrics_binary, ValueBool);
+      }
+      else if (!strcmp(key, "metrics_self"))
+      {
+         if (as_bool(config_value, &config->metrics_self))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->metrics_self, ValueBool);
+      }
+      else if (!strcmp(key, "memory_accounting"))
+      {
+         if (as_bool(config_value, &config->memory_accounting))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->memory_accounting, ValueBool);
+      }
+      else if (!strcmp(key, "metrics_negotiation"))
+      {
+         if (as_bool(config_value, &config->metrics_negotiation))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->metrics_negotiation, ValueBool);
+      }
+      else if (!strcmp(key, "query_timeout"))
+      {
+         if (as_seconds(config_value, &config->query_timeout, 0))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->query_timeout, ValueInt64);
+      }
+      else if (!strcmp(key, "collection_interval"))
+      {
+         if (as_seconds(config_value, &config->collection_interval, 0))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->collection_interval, ValueInt64);
+      }
+      else if (!strcmp(key, "remote_write"))
+      {
+         max = strlen(config_value);
+         if (max > MAX_PATH - 1)
+         {
+            max = MAX_PATH - 1;
+         }
+         memcpy(config->remote_write, config_value, max);
+         pgexporter_json_put(response, key, (uintptr_t)config->remote_write, ValueString);
+      }
+      else if (!strcmp(key, "remote_write_batch"))
+      {
+         if (as_int(config_value, &config->remote_write_batch))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->remote_write_batch, ValueInt64);
+      }
+      else if (!strcmp(key, "remote_write_queue"))
+      {
+         if (as_int(config_value, &config->remote_write_queue))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->remote_write_queue, ValueInt64);
+      }
+      else if (!strcmp(key, "remote_write_timeout"))
+      {
+         if (as_seconds(config_value, &config->remote_write_timeout, 0))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->remote_write_timeout, ValueInt64);
+      }
       else if (!strcmp(key, "metrics_path"))
       {
          max = strlen(config_value);
@@ -1819,6 +2552,16 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
          memcpy(config->metrics_path, config_value, max);
          pgexporter_json_put(response, key, (uintptr_t)config->metrics_path, ValueString);
       }
+      else if (!strcmp(key, "metrics_definitions_cache"))
+      {
+         max = strlen(config_value);
+         if (max > MAX_PATH - 1)
+         {
+            max = MAX_PATH - 1;
+         }
+         memcpy(config->metrics_definitions_cache, config_value, max);
+         pgexporter_json_put(response, key, (uintptr_t)config->metrics_definitions_cache, ValueString);
+      }
       else if (!strcmp(key, "bridge"))
       {
          if (as_int(config_value, &config->bridge))
@@ -1848,6 +2591,38 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
 
          pgexporter_json_put(response, key, (uintptr_t)config->bridge_cache_max_size, ValueInt64);
       }
+      else if (!strcmp(key, "bridge_parallel"))
+      {
+         if (as_int(config_value, &config->bridge_parallel))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->bridge_parallel, ValueInt64);
+      }
+      else if (!strcmp(key, "bridge_timeout"))
+      {
+         if (as_seconds(config_value, &config->bridge_timeout, 0))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->bridge_timeout, ValueInt64);
+      }
+      else if (!strcmp(key, "bridge_keep_alive"))
+      {
+         if (as_bool(config_value, &config->bridge_keep_alive))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->bridge_keep_alive, ValueBool);
+      }
+      else if (!strcmp(key, "bridge_interval"))
+      {
+         if (as_seconds(config_value, &config->bridge_interval, 0))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->bridge_interval, ValueInt64);
+      }
       else if (!strcmp(key, "bridge_cache_max_age"))
       {
          if (as_seconds(config_value, &config->bridge_cache_max_age, 0))
@@ -1880,6 +2655,30 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
                              (uintptr_t)config->bridge_json_cache_max_size,
                              ValueInt64);
       }
+      else if (!strcmp(key, "bridge_aggregate"))
+      {
+         if (as_bridge_rules(config_value, config, false))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->bridge_aggregate, ValueString);
+      }
+      else if (!strcmp(key, "cluster_interval"))
+      {
+         if (as_seconds(config_value, &config->cluster_interval, 5))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->cluster_interval, ValueInt64);
+      }
+      else if (!strcmp(key, "cluster_timeout"))
+      {
+         if (as_seconds(config_value, &config->cluster_timeout, 15))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->cluster_timeout, ValueInt64);
+      }
       else if (!strcmp(key, "management"))
       {
          if (as_int(config_value, &config->management))
@@ -2080,6 +2879,14 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
          config->log_mode = as_logging_mode(config_value);
          pgexporter_json_put(response, key, (uintptr_t)config->log_mode, ValueInt32);
       }
+      else if (!strcmp(key, "log_async"))
+      {
+         if (as_bool(config_value, &config->log_async))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->log_async, ValueBool);
+      }
       else if (!strcmp(key, "unix_socket_dir"))
       {
          max = strlen(config_value);
@@ -2132,11 +2939,32 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
          }
          pgexporter_json_put(response, key, (uintptr_t)config->backlog, ValueInt32);
       }
+      else if (!strcmp(key, "workers"))
+      {
+         if (as_int(config_value, &config->workers))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->workers, ValueInt64);
+      }
       else if (!strcmp(key, "hugepage"))
       {
          config->hugepage = as_hugepage(config_value);
          pgexporter_json_put(response, key, (uintptr_t)config->hugepage, ValueChar);
       }
+      else if (!strcmp(key, "numa"))
+      {
+         config->numa = as_numa(config_value);
+         pgexporter_json_put(response, key, (uintptr_t)config->numa, ValueInt32);
+      }
+      else if (!strcmp(key, "traces"))
+      {
+         if (as_int(config_value, &config->traces))
+         {
+            unknown = true;
+         }
+         pgexporter_json_put(response, key, (uintptr_t)config->traces, ValueInt64);
+      }
       else if (!strcmp(key, "data_dir"))
       {
          if (strlen(section) > 0)
@@ -2146,8 +2974,44 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
             {
                max = MAX_USERNAME_LENGTH - 1;
             }
-            memcpy(&config->servers[server_index].data, config_value, max);
-            pgexporter_json_put(server_j, key, (uintptr_t)config->servers[server_index].data, ValueString);
+            memcpy(&config->servers[server_index].data, config_value, max);
+            pgexporter_json_put(server_j, key, (uintptr_t)config->servers[server_index].data, ValueString);
+            pgexporter_json_put(response, config->servers[server_index].name, (uintptr_t)server_j, ValueJSON);
+         }
+         else
+         {
+            unknown = true;
+         }
+      }
+      else if (!strcmp(key, "wal_dir"))
+      {
+         if (strlen(section) > 0)
+         {
+            max = strlen(config_value);
+            if (max > MAX_USERNAME_LENGTH - 1)
+            {
+               max = MAX_USERNAME_LENGTH - 1;
+            }
+            memcpy(&config->servers[server_index].wal, config_value, max);
+            pgexporter_json_put(server_j, key, (uintptr_t)config->servers[server_index].wal, ValueString);
+            pgexporter_json_put(response, config->servers[server_index].name, (uintptr_t)server_j, ValueJSON);
+         }
+         else
+         {
+            unknown = true;
+         }
+      }
+      else if (!strcmp(key, "max_parallel_queries"))
+      {
+         if (strlen(section) > 0)
+         {
+            if (as_int(config_value, &config->servers[server_index].max_parallel_queries))
+            {
+               unknown = true;
+            }
+            config->servers[server_index].max_parallel_queries = MAX(1, MIN(config->servers[server_index].max_parallel_queries,
+                                                                             MAX_PARALLEL_QUERIES));
+            pgexporter_json_put(server_j, key, (uintptr_t)config->servers[server_index].max_parallel_queries, ValueInt64);
             pgexporter_json_put(response, config->servers[server_index].name, (uintptr_t)server_j, ValueJSON);
          }
          else
@@ -2155,17 +3019,17 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
             unknown = true;
          }
       }
-      else if (!strcmp(key, "wal_dir"))
+      else if (!strcmp(key, "database_connections"))
       {
          if (strlen(section) > 0)
          {
-            max = strlen(config_value);
-            if (max > MAX_USERNAME_LENGTH - 1)
+            if (as_int(config_value, &config->servers[server_index].database_connections))
             {
-               max = MAX_USERNAME_LENGTH - 1;
+               unknown = true;
             }
-            memcpy(&config->servers[server_index].wal, config_value, max);
-            pgexporter_json_put(server_j, key, (uintptr_t)config->servers[server_index].wal, ValueString);
+            config->servers[server_index].database_connections = MAX(1, MIN(config->servers[server_index].database_connections,
+                                                                             MAX_DATABASE_CONNECTIONS));
+            pgexporter_json_put(server_j, key, (uintptr_t)config->servers[server_index].database_connections, ValueInt64);
             pgexporter_json_put(response, config->servers[server_index].name, (uintptr_t)server_j, ValueJSON);
          }
          else
@@ -2199,23 +3063,20 @@ pgexporter_conf_set(SSL* ssl __attribute__((unused)), int client_fd, uint8_t com
 
    pgexporter_log_info("Conf Set (Elapsed: %s)", elapsed);
 
-   pgexporter_json_destroy(payload);
+   free(elapsed);
 
-   pgexporter_disconnect(client_fd);
-
-   pgexporter_stop_logging();
+   return 0;
 
-   exit(0);
 error:
 
-   pgexporter_json_destroy(payload);
-
-   pgexporter_disconnect(client_fd);
-
-   pgexporter_stop_logging();
-
-   exit(1);
+   if (server_j != NULL &&
+       (server_index == -1 || response == NULL ||
+        (struct json*)pgexporter_json_get(response, config->servers[server_index].name) != server_j))
+   {
+      pgexporter_json_destroy(server_j);
+   }
 
+   return 1;
 }
 
 static void
@@ -2230,7 +3091,22 @@ add_configuration_response(struct json* res)
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_UNIX_SOCKET_DIR, (uintptr_t)config->unix_socket_dir, ValueString);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_METRICS, (uintptr_t)config->metrics, ValueInt64);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_METRICS_PATH, (uintptr_t)config->metrics_path, ValueString);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_METRICS_DEFINITIONS_CACHE, (uintptr_t)config->metrics_definitions_cache, ValueString);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_METRICS_CACHE_MAX_AGE, (uintptr_t)config->metrics_cache_max_age, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_METRICS_PARALLEL, (uintptr_t)config->metrics_parallel, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_DATABASE_PARALLEL, (uintptr_t)config->database_parallel, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_ROLE_INTERVAL, (uintptr_t)config->role_interval, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_METRICS_PIPELINE, (uintptr_t)config->metrics_pipeline, ValueBool);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_METRICS_BINARY, (uintptr_t)config->metrics_binary, ValueBool);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_METRICS_SELF, (uintptr_t)config->metrics_self, ValueBool);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_MEMORY_ACCOUNTING, (uintptr_t)config->memory_accounting, ValueBool);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_METRICS_NEGOTIATION, (uintptr_t)config->metrics_negotiation, ValueBool);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_QUERY_TIMEOUT, (uintptr_t)config->query_timeout, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_COLLECTION_INTERVAL, (uintptr_t)config->collection_interval, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_REMOTE_WRITE, (uintptr_t)config->remote_write, ValueString);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_REMOTE_WRITE_BATCH, (uintptr_t)config->remote_write_batch, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_REMOTE_WRITE_QUEUE, (uintptr_t)config->remote_write_queue, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_REMOTE_WRITE_TIMEOUT, (uintptr_t)config->remote_write_timeout, ValueInt64);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_METRICS_CACHE_MAX_SIZE, (uintptr_t)config->metrics_cache_max_size, ValueInt64);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE, (uintptr_t)config->bridge, ValueInt64);
 
@@ -2256,8 +3132,18 @@ add_configuration_response(struct json* res)
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE_ENDPOINTS, (uintptr_t)data, ValueString);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE_CACHE_MAX_AGE, (uintptr_t)config->bridge_cache_max_age, ValueInt64);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE_CACHE_MAX_SIZE, (uintptr_t)config->bridge_cache_max_size, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE_PARALLEL, (uintptr_t)config->bridge_parallel, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE_TIMEOUT, (uintptr_t)config->bridge_timeout, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE_KEEP_ALIVE, (uintptr_t)config->bridge_keep_alive, ValueBool);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE_INTERVAL, (uintptr_t)config->bridge_interval, ValueInt64);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE_JSON, (uintptr_t)config->bridge_json, ValueInt64);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE_JSON_CACHE_MAX_SIZE, (uintptr_t)config->bridge_json_cache_max_size, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BRIDGE_AGGREGATE, (uintptr_t)config->bridge_aggregate, ValueString);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_CLUSTER, (uintptr_t)config->cluster, ValueString);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_CLUSTER_SELF, (uintptr_t)config->cluster_self, ValueString);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_CLUSTER_INTERVAL, (uintptr_t)config->cluster_interval, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_CLUSTER_TIMEOUT, (uintptr_t)config->cluster_timeout, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_CLUSTER_FEDERATE, (uintptr_t)config->cluster_federate, ValueBool);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_MANAGEMENT, (uintptr_t)config->management, ValueInt64);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_CACHE, (uintptr_t)config->cache, ValueBool);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_LOG_TYPE, (uintptr_t)config->log_type, ValueInt32);
@@ -2267,6 +3153,7 @@ add_configuration_response(struct json* res)
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_LOG_ROTATION_SIZE, (uintptr_t)config->log_rotation_size, ValueInt64);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_LOG_LINE_PREFIX, (uintptr_t)config->log_line_prefix, ValueString);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_LOG_MODE, (uintptr_t)config->log_mode, ValueInt32);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_LOG_ASYNC, (uintptr_t)config->log_async, ValueBool);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BLOCKING_TIMEOUT, (uintptr_t)config->blocking_timeout, ValueInt64);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_TLS, (uintptr_t)config->tls, ValueBool);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_TLS_CERT_FILE, (uintptr_t)config->tls_cert_file, ValueString);
@@ -2280,7 +3167,10 @@ add_configuration_response(struct json* res)
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_NODELAY, (uintptr_t)config->nodelay, ValueBool);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_NON_BLOCKING, (uintptr_t)config->non_blocking, ValueBool);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_BACKLOG, (uintptr_t)config->backlog, ValueInt64);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_WORKERS, (uintptr_t)config->workers, ValueInt64);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_HUGEPAGE, (uintptr_t)config->hugepage, ValueChar);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_NUMA, (uintptr_t)config->numa, ValueInt32);
+   pgexporter_json_put(res, CONFIGURATION_ARGUMENT_TRACES, (uintptr_t)config->traces, ValueInt64);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_PIDFILE, (uintptr_t)config->pidfile, ValueString);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_UPDATE_PROCESS_TITLE, (uintptr_t)config->update_process_title, ValueUInt64);
    pgexporter_json_put(res, CONFIGURATION_ARGUMENT_MAIN_CONF_PATH, (uintptr_t)config->configuration_path, ValueString);
@@ -2312,6 +3202,8 @@ add_servers_configuration_response(struct json* res)
       pgexporter_json_put(server_conf, CONFIGURATION_ARGUMENT_USER, (uintptr_t)config->servers[i].username, ValueString);
       pgexporter_json_put(server_conf, CONFIGURATION_ARGUMENT_DATA_DIR, (uintptr_t)config->servers[i].data, ValueString);
       pgexporter_json_put(server_conf, CONFIGURATION_ARGUMENT_WAL_DIR, (uintptr_t)config->servers[i].wal, ValueString);
+      pgexporter_json_put(server_conf, CONFIGURATION_ARGUMENT_MAX_PARALLEL_QUERIES, (uintptr_t)config->servers[i].max_parallel_queries, ValueInt64);
+      pgexporter_json_put(server_conf, CONFIGURATION_ARGUMENT_DATABASE_CONNECTIONS, (uintptr_t)config->servers[i].database_connections, ValueInt64);
       pgexporter_json_put(server_conf, CONFIGURATION_ARGUMENT_TLS_CERT_FILE, (uintptr_t)config->servers[i].tls_cert_file, ValueString);
       pgexporter_json_put(server_conf, CONFIGURATION_ARGUMENT_TLS_CA_FILE, (uintptr_t)config->servers[i].tls_ca_file, ValueString);
       pgexporter_json_put(server_conf, CONFIGURATION_ARGUMENT_TLS_KEY_FILE, (uintptr_t)config->servers[i].tls_key_file, ValueString);
@@ -2395,7 +3287,7 @@ extract_key_value(char* str, char** key, char** value)
 
             if (start_right)
             {
-               if (c != '#')
+               if (c != '#' && idx < MISC_LENGTH - 1)
                {
                   right[idx] = c;
                   idx++;
@@ -2768,6 +3660,29 @@ as_hugepage(char* str)
    return HUGEPAGE_OFF;
 }
 
+static int
+as_numa(char* str)
+{
+   int node = 0;
+
+   if (!strcasecmp(str, "off"))
+   {
+      return NUMA_OFF;
+   }
+
+   if (!strcasecmp(str, "interleave"))
+   {
+      return NUMA_INTERLEAVE;
+   }
+
+   if (!as_int(str, &node) && node >= 0)
+   {
+      return node;
+   }
+
+   return NUMA_OFF;
+}
+
 /**
  * Utility function to understand the setting for updating
  * the process title.
@@ -3151,11 +4066,307 @@ error:
    return 1;
 }
 
+static int
+as_cluster(char* str, struct configuration* config)
+{
+   int idx = 0;
+   int p;
+   size_t max;
+   char* token = NULL;
+   char* t = NULL;
+   char host[MISC_LENGTH] = {0};
+   char port[6] = {0};
+
+   memset(config->cluster, 0, sizeof(config->cluster));
+   memset(config->members, 0, sizeof(config->members));
+   config->number_of_members = 0;
+
+   max = strlen(str);
+   if (max > MAX_PATH - 1)
+   {
+      max = MAX_PATH - 1;
+   }
+   memcpy(config->cluster, str, max);
+
+   token = strtok(str, ",");
+
+   while (token != NULL)
+   {
+      bool found = false;
+
+      t = pgexporter_remove_whitespace(token);
+
+      /* Each member is host:port of its metrics port */
+      if (t == NULL || sscanf(t, "%127[^:]:%5s", host, port) != 2 || (p = atoi(port)) <= 0 || p > 65535)
+      {
+         pgexporter_log_error("Error parsing cluster member: %s", token);
+         goto error;
+      }
+
+      for (int i = 0; i < idx; i++)
+      {
+         if (!strcmp(config->members[i].host, host) && config->members[i].port == p)
+         {
+            found = true;
+         }
+      }
+
+      if (found)
+      {
+         pgexporter_log_warn("Duplicated cluster member: %s:%d", host, p);
+      }
+      else if (idx >= NUMBER_OF_MEMBERS)
+      {
+         pgexporter_log_error("Too many cluster members, the maximum is %d", NUMBER_OF_MEMBERS);
+         goto error;
+      }
+      else
+      {
+         memcpy(config->members[idx].host, host, MISC_LENGTH);
+         config->members[idx].port = p;
+         config->members[idx].endpoint = -1;
+         idx++;
+      }
+
+      free(t);
+      t = NULL;
+
+      memset(host, 0, sizeof(host));
+      memset(port, 0, sizeof(port));
+
+      token = strtok(NULL, ",");
+   }
+
+   config->number_of_members = idx;
+
+   return 0;
+
+error:
+
+   free(t);
+
+   memset(config->cluster, 0, sizeof(config->cluster));
+   memset(config->members, 0, sizeof(config->members));
+   config->number_of_members = 0;
+
+   return 1;
+}
+
+static int
+as_bridge_rules(char* str, struct configuration* config, bool append)
+{
+   int idx;
+   size_t length;
+   char* p = NULL;
+   char* rule = NULL;
+   char* saveptr = NULL;
+   char word[MISC_LENGTH];
+   struct bridge_rule* r = NULL;
+
+   if (!append)
+   {
+      memset(config->bridge_aggregate, 0, sizeof(config->bridge_aggregate));
+      memset(config->bridge_rules, 0, sizeof(config->bridge_rules));
+      config->number_of_bridge_rules = 0;
+   }
+
+   length = strlen(config->bridge_aggregate);
+   snprintf(config->bridge_aggregate + length, sizeof(config->bridge_aggregate) - length, "%s%s",
+            length > 0 && strlen(str) > 0 ? "; " : "", str);
+
+   idx = config->number_of_bridge_rules;
+
+   /*
+    * Each rule is <aggregation> by|without (<label>, ...) <metric>, where the
+    * aggregation is sum, min, max, avg or count, and the metric may end with
+    * a '*' for all the metrics with the prefix. Rules are separated by a ';'
+    */
+   rule = strtok_r(str, ";", &saveptr);
+
+   while (rule != NULL)
+   {
+      p = rule;
+      while (*p == ' ' || *p == '\t')
+      {
+         p++;
+      }
+
+      if (*p == '\0')
+      {
+         rule = strtok_r(NULL, ";", &saveptr);
+         continue;
+      }
+
+      if (idx >= MAX_BRIDGE_RULES)
+      {
+         pgexporter_log_warn("Too many bridge aggregation rules, at most %d", MAX_BRIDGE_RULES);
+         break;
+      }
+
+      r = &config->bridge_rules[idx];
+      memset(r, 0, sizeof(struct bridge_rule));
+
+      if (!rule_word(&p, word))
+      {
+         goto error;
+      }
+
+      if (!strcmp(word, "sum"))
+      {
+         r->aggregation = BRIDGE_AGGREGATE_SUM;
+      }
+      else if (!strcmp(word, "min"))
+      {
+         r->aggregation = BRIDGE_AGGREGATE_MIN;
+      }
+      else if (!strcmp(word, "max"))
+      {
+         r->aggregation = BRIDGE_AGGREGATE_MAX;
+      }
+      else if (!strcmp(word, "avg"))
+      {
+         r->aggregation = BRIDGE_AGGREGATE_AVG;
+      }
+      else if (!strcmp(word, "count"))
+      {
+         r->aggregation = BRIDGE_AGGREGATE_COUNT;
+      }
+      else
+      {
+         goto error;
+      }
+
+      if (!rule_word(&p, word) || (strcmp(word, "by") && strcmp(word, "without")))
+      {
+         goto error;
+      }
+      r->without = !strcmp(word, "without");
+
+      while (*p == ' ' || *p == '\t')
+      {
+         p++;
+      }
+
+      if (*p != '(')
+      {
+         goto error;
+      }
+      p++;
+
+      while (rule_word(&p, word))
+      {
+         if (r->number_of_labels >= MAX_BRIDGE_RULE_LABELS)
+         {
+            goto error;
+         }
+
+         memcpy(r->labels[r->number_of_labels], word, strlen(word) + 1);
+         r->number_of_labels++;
+
+         while (*p == ' ' || *p == '\t')
+         {
+            p++;
+         }
+
+         if (*p == ',')
+         {
+            p++;
+         }
+      }
+
+      while (*p == ' ' || *p == '\t')
+      {
+         p++;
+      }
+
+      if (*p != ')')
+      {
+         goto error;
+      }
+      p++;
+
+      // The metric, which may be in parentheses
+      while (*p == ' ' || *p == '\t' || *p == '(')
+      {
+         p++;
+      }
+
+      if (!rule_word(&p, word))
+      {
+         goto error;
+      }
+
+      while (*p == ' ' || *p == '\t' || *p == ')')
+      {
+         p++;
+      }
+
+      if (*p != '\0')
+      {
+         goto error;
+      }
+
+      length = strlen(word);
+      r->prefix = word[length - 1] == '*';
+      memcpy(r->metric, word, r->prefix ? length - 1 : length);
+
+      pgexporter_log_trace("Bridge rule %d | Metric: %s%s, Labels: %d", idx, r->metric, r->prefix ? "*" : "",
+                           r->number_of_labels);
+
+      idx++;
+
+      rule = strtok_r(NULL, ";", &saveptr);
+   }
+
+   config->number_of_bridge_rules = idx;
+
+   return 0;
+
+error:
+
+   pgexporter_log_error("Error parsing bridge aggregation rule: %s", rule);
+
+   memset(&config->bridge_rules[config->number_of_bridge_rules], 0,
+          (MAX_BRIDGE_RULES - config->number_of_bridge_rules) * sizeof(struct bridge_rule));
+
+   return 1;
+}
+
+/**
+ * Read a name of a bridge aggregation rule, skipping the spaces before it
+ * @param p The position, which is moved past the name
+ * @param word The name
+ * @return True if there is a name, otherwise false
+ */
+static bool
+rule_word(char** p, char* word)
+{
+   size_t length = 0;
+   char* s = *p;
+
+   while (*s == ' ' || *s == '\t')
+   {
+      s++;
+   }
+
+   while ((isalnum((unsigned char)*s) || *s == '_' || *s == ':' || *s == '*') && length < MISC_LENGTH - 1)
+   {
+      word[length++] = *s++;
+   }
+   word[length] = '\0';
+
+   *p = s;
+
+   return length > 0;
+}
+
 static bool
 transfer_configuration(struct configuration* config, struct configuration* reload)
 {
    char* old_endpoints = NULL;
    char* new_endpoints = NULL;
+   bool kept[NUMBER_OF_SERVERS];
+   bool retain[NUMBER_OF_SERVERS];
    bool changed = false;
 
 #ifdef HAVE_SYSTEMD
@@ -3165,6 +4376,26 @@ transfer_configuration(struct configuration* config, struct configuration* reloa
    memcpy(config->host, reload->host, MISC_LENGTH);
    config->metrics = reload->metrics;
    config->metrics_cache_max_age = reload->metrics_cache_max_age;
+   config->metrics_parallel = reload->metrics_parallel;
+   config->database_parallel = reload->database_parallel;
+   config->role_interval = reload->role_interval;
+   config->metrics_pipeline = reload->metrics_pipeline;
+   config->metrics_binary = reload->metrics_binary;
+   config->metrics_self = reload->metrics_self;
+   if (restart_int("memory_accounting", config->memory_accounting, reload->memory_accounting))
+   {
+      changed = true;
+   }
+   config->metrics_negotiation = reload->metrics_negotiation;
+   config->query_timeout = reload->query_timeout;
+   if (restart_int("collection_interval", config->collection_interval, reload->collection_interval))
+   {
+      changed = true;
+   }
+   memcpy(config->remote_write, reload->remote_write, MAX_PATH);
+   config->remote_write_batch = reload->remote_write_batch;
+   config->remote_write_queue = reload->remote_write_queue;
+   config->remote_write_timeout = reload->remote_write_timeout;
    if (restart_int("metrics_cache_max_size", config->metrics_cache_max_size, reload->metrics_cache_max_size))
    {
       changed = true;
@@ -3222,6 +4453,31 @@ transfer_configuration(struct configuration* config, struct configuration* reloa
    {
       changed = true;
    }
+   config->bridge_parallel = reload->bridge_parallel;
+   config->bridge_timeout = reload->bridge_timeout;
+   config->bridge_keep_alive = reload->bridge_keep_alive;
+   memcpy(config->bridge_aggregate, reload->bridge_aggregate, MAX_PATH);
+   memcpy(config->bridge_rules, reload->bridge_rules, sizeof(config->bridge_rules));
+   config->number_of_bridge_rules = reload->number_of_bridge_rules;
+   /* The membership and the liveness of the members are kept until a restart */
+   if (restart_string("cluster", config->cluster, reload->cluster))
+   {
+      changed = true;
+   }
+   if (restart_string("cluster_self", config->cluster_self, reload->cluster_self))
+   {
+      changed = true;
+   }
+   if (restart_int("cluster_federate", config->cluster_federate, reload->cluster_federate))
+   {
+      changed = true;
+   }
+   config->cluster_interval = reload->cluster_interval;
+   config->cluster_timeout = reload->cluster_timeout;
+   if (restart_int("bridge_interval", config->bridge_interval, reload->bridge_interval))
+   {
+      changed = true;
+   }
    if (restart_int("bridge_json", config->bridge_json, reload->bridge_json))
    {
       changed = true;
@@ -3255,6 +4511,10 @@ transfer_configuration(struct configuration* config, struct configuration* reloa
       memcpy(config->log_path, reload->log_path, MISC_LENGTH);
       pgexporter_start_logging();
    }
+   if (restart_int("log_async", config->log_async, reload->log_async))
+   {
+      changed = true;
+   }
    /* log_lock */
 
    config->tls = reload->tls;
@@ -3279,11 +4539,27 @@ transfer_configuration(struct configuration* config, struct configuration* reloa
    config->nodelay = reload->nodelay;
    config->non_blocking = reload->non_blocking;
    config->backlog = reload->backlog;
+   /* workers */
+   if (restart_int("workers", config->workers, reload->workers))
+   {
+      changed = true;
+   }
    /* hugepage */
    if (restart_int("hugepage", config->hugepage, reload->hugepage))
    {
       changed = true;
    }
+   /* numa */
+   if (restart_int("numa", config->numa, reload->numa))
+   {
+      changed = true;
+   }
+
+   /* traces */
+   if (restart_int("traces", config->traces, reload->traces))
+   {
+      changed = true;
+   }
 
    /* update_process_title */
    if (restart_int("update_process_title", config->update_process_title, reload->update_process_title))
@@ -3297,10 +4573,37 @@ transfer_configuration(struct configuration* config, struct configuration* reloa
       changed = true;
    }
 
-   memset(&config->servers[0], 0, sizeof(struct server) * NUMBER_OF_SERVERS);
-   for (int i = 0; i < reload->number_of_servers; i++)
+   /* Only the servers whose connection changed are connected again */
+   for (int i = 0; i < NUMBER_OF_SERVERS; i++)
+   {
+      kept[i] = i < config->number_of_servers && i < reload->number_of_servers &&
+                same_connection(&config->servers[i], &reload->servers[i]);
+      /* The prepared statements are the ones of the connection lent by this process */
+      retain[i] = kept[i] && pgexporter_pool_connected(i) &&
+                  config->servers[i].prepared_generation == config->metrics_generation;
+
+      if (i < config->number_of_servers && !kept[i])
+      {
+         pgexporter_log_debug("Server '%s' connects again", config->servers[i].name);
+         pgexporter_pool_remove(i);
+      }
+   }
+   for (int i = 0; i < NUMBER_OF_SERVERS; i++)
    {
-      copy_server(&config->servers[i], &reload->servers[i]);
+      if (kept[i])
+      {
+         copy_server(&config->servers[i], &reload->servers[i]);
+      }
+      else
+      {
+         memset(&config->servers[i], 0, sizeof(struct server));
+         init_server_state(&config->server_states[i]);
+
+         if (i < reload->number_of_servers)
+         {
+            copy_server(&config->servers[i], &reload->servers[i]);
+         }
+      }
    }
    config->number_of_servers = reload->number_of_servers;
 
@@ -3319,12 +4622,16 @@ transfer_configuration(struct configuration* config, struct configuration* reloa
    config->number_of_admins = reload->number_of_admins;
 
    /* prometheus */
-   memcpy(config->metrics_path, reload->metrics_path, MAX_PATH);
-   for (int i = 0; i < reload->number_of_metrics; i++)
+   /* The prepared statements of the metrics are invalid from now on, */
+   /* except the ones kept by the servers that keep their connection */
+   pgexporter_catalog_transfer(config, reload, &retain[0]);
+   config->metrics_generation++;
+   for (int i = 0; i < config->number_of_servers; i++)
    {
-      copy_promethus(&config->prometheus[i], &reload->prometheus[i]);
+      config->servers[i].prepared_generation = retain[i] ? config->metrics_generation : 0;
    }
-   config->number_of_metrics = reload->number_of_metrics;
+   memcpy(config->metrics_path, reload->metrics_path, MAX_PATH);
+   memcpy(config->metrics_definitions_cache, reload->metrics_definitions_cache, MAX_PATH);
 
    /* endpoint */
    for (int i = 0; i < reload->number_of_endpoints; i++)
@@ -3352,26 +4659,40 @@ copy_server(struct server* dst, struct server* src)
    memcpy(&dst->username[0], &src->username[0], MAX_USERNAME_LENGTH);
    memcpy(&dst->data[0], &src->data[0], MISC_LENGTH);
    memcpy(&dst->wal[0], &src->wal[0], MISC_LENGTH);
-   dst->fd = src->fd;
-   dst->extension = true;
+   memcpy(&dst->tls_cert_file[0], &src->tls_cert_file[0], MAX_PATH);
+   memcpy(&dst->tls_key_file[0], &src->tls_key_file[0], MAX_PATH);
+   memcpy(&dst->tls_ca_file[0], &src->tls_ca_file[0], MAX_PATH);
+   dst->max_parallel_queries = src->max_parallel_queries;
+   dst->database_connections = src->database_connections;
 }
 
-static void
-copy_user(struct user* dst, struct user* src)
+static bool
+same_connection(struct server* e, struct server* n)
 {
-   memcpy(&dst->username[0], &src->username[0], MAX_USERNAME_LENGTH);
-   memcpy(&dst->password[0], &src->password[0], MAX_PASSWORD_LENGTH);
+   return !strcmp(e->name, n->name) &&
+          !strcmp(e->host, n->host) &&
+          e->port == n->port &&
+          !strcmp(e->username, n->username) &&
+          !strcmp(e->tls_cert_file, n->tls_cert_file) &&
+          !strcmp(e->tls_key_file, n->tls_key_file) &&
+          !strcmp(e->tls_ca_file, n->tls_ca_file);
 }
 
 static void
-copy_promethus(struct prometheus* dst, struct prometheus* src)
+init_server_state(struct server_state* state)
 {
-   memcpy(dst->tag, src->tag, MISC_LENGTH);
-   memcpy(dst->collector, src->collector, MAX_COLLECTOR_LENGTH);
-   dst->sort_type = src->sort_type;
-   dst->server_query_type = src->server_query_type;
+   memset(state, 0, sizeof(struct server_state));
+   state->extension = true;
+   state->state = SERVER_UNKNOWN;
+   state->version = SERVER_UNDERTERMINED_VERSION;
+   atomic_init(&state->lease, STATE_FREE);
+}
 
-   pgexporter_copy_query_alts(&dst->root, src->root);
+static void
+copy_user(struct user* dst, struct user* src)
+{
+   memcpy(&dst->username[0], &src->username[0], MAX_USERNAME_LENGTH);
+   memcpy(&dst->password[0], &src->password[0], MAX_PASSWORD_LENGTH);
 }
 
 static void
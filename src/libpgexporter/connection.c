@@ -48,13 +48,26 @@
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 
+static int transfer_write(int slot, int descriptor);
 static int read_complete(SSL* ssl, int socket, void* buf, size_t size);
 static int write_complete(SSL* ssl, int socket, void* buf, size_t size);
 static int write_socket(int socket, void* buf, size_t size);
 static int write_ssl(SSL* ssl, void* buf, size_t size);
 
 int
-pgexporter_transfer_connection_write(int server)
+pgexporter_transfer_connection_write(int server, int descriptor)
+{
+   return transfer_write(server, descriptor);
+}
+
+int
+pgexporter_transfer_endpoint_write(int endpoint, int descriptor)
+{
+   return transfer_write(TRANSFER_ENDPOINT + endpoint, descriptor);
+}
+
+static int
+transfer_write(int slot, int descriptor)
 {
    int fd;
    struct cmsghdr* cmptr = NULL;
@@ -74,7 +87,7 @@ pgexporter_transfer_connection_write(int server)
    }
 
    memset(&buf4[0], 0, sizeof(buf4));
-   pgexporter_write_int32(&buf4, server);
+   pgexporter_write_int32(&buf4, slot);
 
    if (write_complete(NULL, fd, &buf4, sizeof(buf4)))
    {
@@ -102,7 +115,7 @@ pgexporter_transfer_connection_write(int server)
    msg.msg_control = cmptr;
    msg.msg_controllen = CMSG_SPACE(sizeof(int));
    msg.msg_flags = 0;
-   *(int*)CMSG_DATA(cmptr) = config->servers[server].fd;
+   *(int*)CMSG_DATA(cmptr) = descriptor;
 
    if (sendmsg(fd, &msg, 0) != 2)
    {
@@ -29,6 +29,7 @@
 #include <pgexporter.h>
 #include <deque.h>
 #include <logging.h>
+#include <memory.h>
 #include <utils.h>
 #include "value.h"
 
@@ -39,13 +40,17 @@
 static void
 deque_offer(struct deque* deque, char* tag, uintptr_t data, enum value_type type, struct value_config* config);
 
-// tag is copied if not NULL
+// tag is copied if not NULL, unless the tags are borrowed
 static void
-deque_node_create(uintptr_t data, enum value_type type, char* tag, struct value_config* config, struct deque_node** node);
+deque_node_create(struct deque* deque, uintptr_t data, enum value_type type, char* tag, struct value_config* config, struct deque_node** node);
 
-// tag will always be freed
+// tag will always be freed, unless the tags are borrowed
 static void
-deque_node_destroy(struct deque_node* node);
+deque_node_destroy(struct deque* deque, struct deque_node* node);
+
+// the data and the tag are kept, as they are handed to the caller
+static uintptr_t
+deque_node_recycle(struct deque* deque, struct deque_node* node);
 
 static void
 deque_read_lock(struct deque* deque);
@@ -74,31 +79,37 @@ to_text_string(struct deque* deque, char* tag, int indent);
 static struct deque_node*
 deque_remove(struct deque* deque, struct deque_node* node);
 
-static struct deque_node*
-get_middle(struct deque_node* node);
-
-static struct deque_node*
-deque_sort(struct deque_node* node);
+static void
+deque_sort_nodes(struct deque* deque, deque_key_cb key);
 
 static struct deque_node*
-deque_merge(struct deque_node* node1, struct deque_node* node2);
+deque_sort(struct deque_node* first, bool by_key);
 
 static int
 tag_compare(char* tag1, char* tag2);
 
 int
 pgexporter_deque_create(bool thread_safe, struct deque** deque)
+{
+   return pgexporter_deque_create_with_flags(thread_safe ? DEQUE_THREAD_SAFE : 0, deque);
+}
+
+int
+pgexporter_deque_create_with_flags(int flags, struct deque** deque)
 {
    struct deque* q = NULL;
-   q = malloc(sizeof(struct deque));
+   q = pgexporter_memory_alloc(MEMORY_DEQUE, sizeof(struct deque));
    q->size = 0;
-   q->thread_safe = thread_safe;
-   if (thread_safe)
+   q->thread_safe = (flags & DEQUE_THREAD_SAFE) != 0;
+   q->pooled = (flags & DEQUE_POOLED) != 0;
+   q->borrow_tags = (flags & DEQUE_BORROW_TAGS) != 0;
+   q->pool = NULL;
+   if (q->thread_safe)
    {
       pthread_rwlock_init(&q->mutex, NULL);
    }
-   deque_node_create(0, ValueInt32, NULL, NULL, &q->start);
-   deque_node_create(0, ValueInt32, NULL, NULL, &q->end);
+   deque_node_create(q, 0, ValueInt32, NULL, NULL, &q->start);
+   deque_node_create(q, 0, ValueInt32, NULL, NULL, &q->end);
    q->start->next = q->end;
    q->end->prev = q->start;
    *deque = q;
@@ -162,7 +173,6 @@ uintptr_t
 pgexporter_deque_poll(struct deque* deque, char** tag)
 {
    struct deque_node* head = NULL;
-   struct value* val = NULL;
    uintptr_t data = 0;
    if (deque == NULL || pgexporter_deque_size(deque) == 0)
    {
@@ -180,15 +190,12 @@ pgexporter_deque_poll(struct deque* deque, char** tag)
    deque->start->next = head->next;
    head->next->prev = deque->start;
    deque->size--;
-   val = head->data;
    if (tag != NULL)
    {
       *tag = head->tag;
    }
-   free(head);
 
-   data = pgexporter_value_data(val);
-   free(val);
+   data = deque_node_recycle(deque, head);
 
    deque_unlock(deque);
    return data;
@@ -198,7 +205,6 @@ uintptr_t
 pgexporter_deque_poll_last(struct deque* deque, char** tag)
 {
    struct deque_node* tail = NULL;
-   struct value* val = NULL;
    uintptr_t data = 0;
    if (deque == NULL || pgexporter_deque_size(deque) == 0)
    {
@@ -216,15 +222,12 @@ pgexporter_deque_poll_last(struct deque* deque, char** tag)
    tail->prev->next = deque->end;
    deque->size--;
 
-   val = tail->data;
    if (tag != NULL)
    {
       *tag = tail->tag;
    }
-   free(tail);
 
-   data = pgexporter_value_data(val);
-   free(val);
+   data = deque_node_recycle(deque, tail);
 
    deque_unlock(deque);
    return data;
@@ -346,30 +349,13 @@ pgexporter_deque_list(struct deque* deque)
 void
 pgexporter_deque_sort(struct deque* deque)
 {
-   deque_write_lock(deque);
-   if (deque == NULL || deque->start == NULL || deque->end == NULL || deque->size <= 1)
-   {
-      deque_unlock(deque);
-      return;
-   }
-   // break the connection to start and end node since we are going to move nodes around
-   struct deque_node* first = deque->start->next;
-   struct deque_node* last = deque->end->prev;
-   struct deque_node* node = NULL;
-   first->prev = NULL;
-   last->next = NULL;
-   deque->start->next = NULL;
-   deque->end->prev = NULL;
-   node = deque_sort(first);
-   deque->start->next = node;
-   node->prev = deque->start;
-   while (node->next != NULL)
-   {
-      node = node->next;
-   }
-   deque->end->prev = node;
-   node->next = deque->end;
-   deque_unlock(deque);
+   deque_sort_nodes(deque, NULL);
+}
+
+void
+pgexporter_deque_sort_by_key(struct deque* deque, deque_key_cb key)
+{
+   deque_sort_nodes(deque, key);
 }
 
 void
@@ -385,14 +371,21 @@ pgexporter_deque_destroy(struct deque* deque)
    while (n != NULL)
    {
       next = n->next;
-      deque_node_destroy(n);
+      deque_node_destroy(deque, n);
+      n = next;
+   }
+   n = deque->pool;
+   while (n != NULL)
+   {
+      next = n->next;
+      pgexporter_memory_release(MEMORY_DEQUE, n);
       n = next;
    }
    if (deque->thread_safe)
    {
       pthread_rwlock_destroy(&deque->mutex);
    }
-   free(deque);
+   pgexporter_memory_release(MEMORY_DEQUE, deque);
 }
 
 char*
@@ -435,7 +428,7 @@ pgexporter_deque_iterator_create(struct deque* deque, struct deque_iterator** it
    {
       return 1;
    }
-   i = malloc(sizeof(struct deque_iterator));
+   i = pgexporter_memory_alloc(MEMORY_DEQUE, sizeof(struct deque_iterator));
    i->deque = deque;
    i->cur = deque->start;
    i->tag = NULL;
@@ -471,7 +464,7 @@ pgexporter_deque_iterator_destroy(struct deque_iterator* iter)
    {
       return;
    }
-   free(iter);
+   pgexporter_memory_release(MEMORY_DEQUE, iter);
 }
 
 bool
@@ -507,8 +500,9 @@ deque_offer(struct deque* deque, char* tag, uintptr_t data, enum value_type type
    struct deque_node* n = NULL;
    struct deque_node* last = NULL;
 
-   deque_node_create(data, type, tag, config, &n);
+   // The pool of the deque is shared, so the node is taken under the lock
    deque_write_lock(deque);
+   deque_node_create(deque, data, type, tag, config, &n);
    deque->size++;
    last = deque->end->prev;
    last->next = n;
@@ -519,12 +513,33 @@ deque_offer(struct deque* deque, char* tag, uintptr_t data, enum value_type type
 }
 
 static void
-deque_node_create(uintptr_t data, enum value_type type, char* tag, struct value_config* config, struct deque_node** node)
+deque_node_create(struct deque* deque, uintptr_t data, enum value_type type, char* tag, struct value_config* config, struct deque_node** node)
 {
    struct deque_node* n = NULL;
-   n = malloc(sizeof(struct deque_node));
+   if (deque->pooled && deque->pool != NULL)
+   {
+      n = deque->pool;
+      deque->pool = n->next;
+   }
+   else
+   {
+      n = pgexporter_memory_alloc(MEMORY_DEQUE, sizeof(struct deque_node));
+   }
    memset(n, 0, sizeof(struct deque_node));
-   if (config != NULL)
+   if (deque->pooled)
+   {
+      pgexporter_value_init(config != NULL ? ValueRef : type, data, &n->value);
+      if (config != NULL && config->destroy_data != NULL)
+      {
+         n->value.destroy_data = config->destroy_data;
+      }
+      if (config != NULL && config->to_string != NULL)
+      {
+         n->value.to_string = config->to_string;
+      }
+      n->data = &n->value;
+   }
+   else if (config != NULL)
    {
       pgexporter_value_create_with_config(data, config, &n->data);
    }
@@ -534,7 +549,7 @@ deque_node_create(uintptr_t data, enum value_type type, char* tag, struct value_
    }
    if (tag != NULL)
    {
-      n->tag = pgexporter_append(NULL, tag);
+      n->tag = deque->borrow_tags ? tag : pgexporter_append(NULL, tag);
    }
    else
    {
@@ -544,15 +559,40 @@ deque_node_create(uintptr_t data, enum value_type type, char* tag, struct value_
 }
 
 static void
-deque_node_destroy(struct deque_node* node)
+deque_node_destroy(struct deque* deque, struct deque_node* node)
 {
    if (node == NULL)
    {
       return;
    }
+   if (!deque->borrow_tags)
+   {
+      free(node->tag);
+   }
+   if (deque->pooled)
+   {
+      pgexporter_value_release(node->data);
+      node->next = deque->pool;
+      deque->pool = node;
+      return;
+   }
    pgexporter_value_destroy(node->data);
-   free(node->tag);
-   free(node);
+   pgexporter_memory_release(MEMORY_DEQUE, node);
+}
+
+static uintptr_t
+deque_node_recycle(struct deque* deque, struct deque_node* node)
+{
+   uintptr_t data = pgexporter_value_data(node->data);
+   if (deque->pooled)
+   {
+      node->next = deque->pool;
+      deque->pool = node;
+      return data;
+   }
+   free(node->data);
+   pgexporter_memory_release(MEMORY_DEQUE, node);
+   return data;
 }
 
 static void
@@ -626,16 +666,17 @@ deque_find(struct deque* deque, char* tag)
 static char*
 to_json_string(struct deque* deque, char* tag, int indent)
 {
-   char* ret = NULL;
-   ret = pgexporter_indent(ret, tag, indent);
+   struct builder ret;
+   pgexporter_builder_init(&ret, 0);
+   pgexporter_builder_indent(&ret, tag, indent);
    struct deque_node* cur = NULL;
    if (deque == NULL || pgexporter_deque_empty(deque))
    {
-      ret = pgexporter_append(ret, "[]");
-      return ret;
+      pgexporter_builder_append(&ret, "[]");
+      return pgexporter_builder_detach(&ret);
    }
    deque_read_lock(deque);
-   ret = pgexporter_append(ret, "[\n");
+   pgexporter_builder_append(&ret, "[\n");
    cur = deque_next(deque, deque->start);
    while (cur != NULL)
    {
@@ -649,30 +690,31 @@ to_json_string(struct deque* deque, char* tag, int indent)
       }
       str = pgexporter_value_to_string(cur->data, FORMAT_JSON, t, indent + INDENT_PER_LEVEL);
       free(t);
-      ret = pgexporter_append(ret, str);
-      ret = pgexporter_append(ret, has_next ? ",\n" : "\n");
+      pgexporter_builder_append(&ret, str);
+      pgexporter_builder_append(&ret, has_next ? ",\n" : "\n");
       free(str);
       cur = deque_next(deque, cur);
    }
-   ret = pgexporter_indent(ret, NULL, indent);
-   ret = pgexporter_append(ret, "]");
+   pgexporter_builder_indent(&ret, NULL, indent);
+   pgexporter_builder_append(&ret, "]");
    deque_unlock(deque);
-   return ret;
+   return pgexporter_builder_detach(&ret);
 }
 
 static char*
 to_compact_json_string(struct deque* deque, char* tag, int indent)
 {
-   char* ret = NULL;
-   ret = pgexporter_indent(ret, tag, indent);
+   struct builder ret;
+   pgexporter_builder_init(&ret, 0);
+   pgexporter_builder_indent(&ret, tag, indent);
    struct deque_node* cur = NULL;
    if (deque == NULL || pgexporter_deque_empty(deque))
    {
-      ret = pgexporter_append(ret, "[]");
-      return ret;
+      pgexporter_builder_append(&ret, "[]");
+      return pgexporter_builder_detach(&ret);
    }
    deque_read_lock(deque);
-   ret = pgexporter_append(ret, "[");
+   pgexporter_builder_append(&ret, "[");
    cur = deque_next(deque, deque->start);
    while (cur != NULL)
    {
@@ -686,33 +728,34 @@ to_compact_json_string(struct deque* deque, char* tag, int indent)
       }
       str = pgexporter_value_to_string(cur->data, FORMAT_JSON_COMPACT, t, indent);
       free(t);
-      ret = pgexporter_append(ret, str);
-      ret = pgexporter_append(ret, has_next ? "," : "");
+      pgexporter_builder_append(&ret, str);
+      pgexporter_builder_append(&ret, has_next ? "," : "");
       free(str);
       cur = deque_next(deque, cur);
    }
-   ret = pgexporter_append(ret, "]");
+   pgexporter_builder_append(&ret, "]");
    deque_unlock(deque);
-   return ret;
+   return pgexporter_builder_detach(&ret);
 }
 
 static char*
 to_text_string(struct deque* deque, char* tag, int indent)
 {
-   char* ret = NULL;
+   struct builder ret;
    int cnt = 0;
    int next_indent = pgexporter_compare_string(tag, BULLET_POINT) ? 0 : indent;
+   pgexporter_builder_init(&ret, 0);
    // we have a tag and it's not the bullet point, so that means another line
    if (tag != NULL && !pgexporter_compare_string(tag, BULLET_POINT))
    {
-      ret = pgexporter_indent(ret, tag, indent);
+      pgexporter_builder_indent(&ret, tag, indent);
       next_indent += INDENT_PER_LEVEL;
    }
    struct deque_node* cur = NULL;
    if (deque == NULL || pgexporter_deque_empty(deque))
    {
-      ret = pgexporter_append(ret, "[]");
-      return ret;
+      pgexporter_builder_append(&ret, "[]");
+      return pgexporter_builder_detach(&ret);
    }
    deque_read_lock(deque);
    cur = deque_next(deque, deque->start);
@@ -731,15 +774,79 @@ to_text_string(struct deque* deque, char* tag, int indent)
       }
       if (cur->data->type == ValueJSON)
       {
-         ret = pgexporter_indent(ret, BULLET_POINT, next_indent);
+         pgexporter_builder_indent(&ret, BULLET_POINT, next_indent);
       }
-      ret = pgexporter_append(ret, str);
-      ret = pgexporter_append(ret, has_next ? "\n" : "");
+      pgexporter_builder_append(&ret, str);
+      pgexporter_builder_append(&ret, has_next ? "\n" : "");
       free(str);
       cur = deque_next(deque, cur);
    }
    deque_unlock(deque);
-   return ret;
+   return pgexporter_builder_detach(&ret);
+}
+
+void
+pgexporter_intrusive_deque_init(struct intrusive_deque* deque)
+{
+   deque->head.next = &deque->head;
+   deque->head.prev = &deque->head;
+   deque->size = 0;
+}
+
+void
+pgexporter_intrusive_deque_add(struct intrusive_deque* deque, struct deque_link* link)
+{
+   link->prev = deque->head.prev;
+   link->next = &deque->head;
+   deque->head.prev->next = link;
+   deque->head.prev = link;
+   deque->size++;
+}
+
+void
+pgexporter_intrusive_deque_add_first(struct intrusive_deque* deque, struct deque_link* link)
+{
+   link->next = deque->head.next;
+   link->prev = &deque->head;
+   deque->head.next->prev = link;
+   deque->head.next = link;
+   deque->size++;
+}
+
+struct deque_link*
+pgexporter_intrusive_deque_poll(struct intrusive_deque* deque)
+{
+   struct deque_link* link = NULL;
+   if (deque->head.next == &deque->head)
+   {
+      return NULL;
+   }
+   link = deque->head.next;
+   pgexporter_intrusive_deque_remove(deque, link);
+   return link;
+}
+
+void
+pgexporter_intrusive_deque_remove(struct intrusive_deque* deque, struct deque_link* link)
+{
+   link->prev->next = link->next;
+   link->next->prev = link->prev;
+   link->next = NULL;
+   link->prev = NULL;
+   deque->size--;
+}
+
+struct deque_link*
+pgexporter_intrusive_deque_next(struct intrusive_deque* deque, struct deque_link* link)
+{
+   struct deque_link* next = link == NULL ? deque->head.next : link->next;
+   return next == &deque->head ? NULL : next;
+}
+
+bool
+pgexporter_intrusive_deque_empty(struct intrusive_deque* deque)
+{
+   return deque->head.next == &deque->head;
 }
 
 static struct deque_node*
@@ -753,119 +860,132 @@ deque_remove(struct deque* deque, struct deque_node* node)
    struct deque_node* next = node->next;
    prev->next = next;
    next->prev = prev;
-   deque_node_destroy(node);
+   deque_node_destroy(deque, node);
    deque->size--;
    return prev;
 }
 
-static struct deque_node*
-get_middle(struct deque_node* node)
+static void
+deque_sort_nodes(struct deque* deque, deque_key_cb key)
 {
-   struct deque_node* slow = node;
-   struct deque_node* fast = node;
-   while (fast != NULL && fast->next != NULL)
-   {
-      slow = slow->next;
-      fast = fast->next->next;
-   }
-   return slow;
-}
+   struct deque_node* first = NULL;
+   struct deque_node* node = NULL;
+   struct deque_node* prev = NULL;
 
-static struct deque_node*
-deque_sort(struct deque_node* node)
-{
-   struct deque_node* mid = NULL;
-   struct deque_node* prevmid = NULL;
-   struct deque_node* node1 = NULL;
-   struct deque_node* node2 = NULL;
-   if (node == NULL || node->next == NULL)
+   deque_write_lock(deque);
+   if (deque == NULL || deque->start == NULL || deque->end == NULL || deque->size <= 1)
    {
-      return node;
+      deque_unlock(deque);
+      return;
    }
-   mid = get_middle(node);
-   prevmid = mid->prev;
-   mid->prev = NULL;
-   prevmid->next = NULL;
-   node1 = deque_sort(node);
-   node2 = deque_sort(mid);
-   return deque_merge(node1, node2);
-}
 
-static struct deque_node*
-deque_merge(struct deque_node* node1, struct deque_node* node2)
-{
-   struct deque_node* node = NULL;
-   struct deque_node* left = node1;
-   struct deque_node* right = node2;
-   struct deque_node* next = NULL;
-   struct deque_node* start = NULL;
-   if (node1 == NULL)
+   // The keys are computed once, instead of for each comparison
+   if (key != NULL)
    {
-      return node2;
+      for (node = deque->start->next; node != deque->end; node = node->next)
+      {
+         node->key = key(node->tag, node->data);
+      }
    }
-   if (node2 == NULL)
+
+   // break the connection to start and end node since we are going to move nodes around
+   first = deque->start->next;
+   deque->end->prev->next = NULL;
+
+   first = deque_sort(first, key != NULL);
+
+   // The merges only follow the next pointers, so the previous pointers are set afterwards
+   prev = deque->start;
+   for (node = first; node != NULL; node = node->next)
    {
-      return node1;
+      prev->next = node;
+      node->prev = prev;
+      prev = node;
    }
-   while (left != NULL && right != NULL)
+   prev->next = deque->end;
+   deque->end->prev = prev;
+
+   deque_unlock(deque);
+}
+
+static struct deque_node*
+deque_sort(struct deque_node* first, bool by_key)
+{
+   int merges = 0;
+   int p_size = 0;
+   int q_size = 0;
+   uint32_t size = 1;
+   struct deque_node* list = first;
+   struct deque_node* p = NULL;
+   struct deque_node* q = NULL;
+   struct deque_node* e = NULL;
+   struct deque_node* tail = NULL;
+
+   // Bottom-up, the runs of size 1, 2, 4, ... are merged pairwise until one run is left
+   do
    {
-      if (tag_compare(left->tag, right->tag) <= 0)
-      {
-         next = left->next;
-         if (node == NULL)
-         {
-            start = left;
-            node = left;
-            node->prev = NULL;
-            node->next = NULL;
-         }
-         else
-         {
-            node->next = left;
-            left->prev = node;
-            left->next = NULL;
-            node = node->next;
-         }
-         left = next;
-      }
-      else
+      p = list;
+      list = NULL;
+      tail = NULL;
+      merges = 0;
+
+      while (p != NULL)
       {
-         next = right->next;
-         if (node == NULL)
+         merges++;
+         q = p;
+         p_size = 0;
+         for (uint32_t i = 0; i < size && q != NULL; i++)
          {
-            start = right;
-            node = right;
-            node->prev = NULL;
-            node->next = NULL;
+            p_size++;
+            q = q->next;
          }
-         else
+         q_size = size;
+
+         while (p_size > 0 || (q_size > 0 && q != NULL))
          {
-            node->next = right;
-            right->prev = node;
-            right->next = NULL;
-            node = node->next;
+            // Equal nodes are taken from the left run first, which keeps the sort stable
+            if (p_size == 0)
+            {
+               e = q;
+               q = q->next;
+               q_size--;
+            }
+            else if (q_size == 0 || q == NULL ||
+                     (by_key ? p->key <= q->key : tag_compare(p->tag, q->tag) <= 0))
+            {
+               e = p;
+               p = p->next;
+               p_size--;
+            }
+            else
+            {
+               e = q;
+               q = q->next;
+               q_size--;
+            }
+
+            if (tail != NULL)
+            {
+               tail->next = e;
+            }
+            else
+            {
+               list = e;
+            }
+            tail = e;
          }
-         right = next;
+
+         p = q;
       }
+
+      tail->next = NULL;
+      size *= 2;
    }
-   while (left != NULL)
-   {
-      next = left->next;
-      node->next = left;
-      left->prev = node;
-      left = next;
-      node = node->next;
-   }
-   while (right != NULL)
-   {
-      next = right->next;
-      node->next = right;
-      right->prev = node;
-      right = next;
-      node = node->next;
-   }
-   return start;
+   while (merges > 1);
+
+   return list;
 }
+
 static int
 tag_compare(char* tag1, char* tag2)
 {
@@ -0,0 +1,440 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <filter.h>
+#include <logging.h>
+
+/* system */
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void url_decode(char* s);
+static bool is_name(const char* s, size_t length);
+static int filter_compile(struct metrics_filter* filter, char* selector);
+static int filter_add(struct metrics_filter* filter, const char* name, size_t length, bool prefix);
+
+int
+pgexporter_filter_parse(char* query, struct metrics_filter* filter)
+{
+   char* parameter = NULL;
+   char* value = NULL;
+   char* saveptr = NULL;
+
+   memset(filter, 0, sizeof(struct metrics_filter));
+
+   if (query == NULL)
+   {
+      return 0;
+   }
+
+   parameter = strtok_r(query, "&", &saveptr);
+   while (parameter != NULL)
+   {
+      value = strchr(parameter, '=');
+      if (value != NULL)
+      {
+         *value = '\0';
+         value++;
+
+         url_decode(parameter);
+         url_decode(value);
+
+         if (!strcmp(parameter, "match[]"))
+         {
+            if (filter_compile(filter, value))
+            {
+               pgexporter_log_debug("Filter: Unsupported selector: %s", value);
+               goto error;
+            }
+         }
+         else if (!strcmp(parameter, "collector") || !strcmp(parameter, "collector[]"))
+         {
+            if (filter->number_of_collectors >= MAX_NUMBER_OF_FILTERS || strlen(value) >= MISC_LENGTH)
+            {
+               pgexporter_log_debug("Filter: Unsupported collector: %s", value);
+               goto error;
+            }
+
+            strcpy(filter->collectors[filter->number_of_collectors], value);
+            filter->number_of_collectors++;
+         }
+      }
+
+      parameter = strtok_r(NULL, "&", &saveptr);
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+bool
+pgexporter_filter_active(struct metrics_filter* filter)
+{
+   return filter != NULL && (filter->number_of_names > 0 || filter->number_of_collectors > 0);
+}
+
+bool
+pgexporter_filter_collector(struct metrics_filter* filter, const char* collector)
+{
+   if (filter == NULL || filter->number_of_collectors == 0)
+   {
+      return true;
+   }
+
+   for (int i = 0; i < filter->number_of_collectors; i++)
+   {
+      if (!strcmp(filter->collectors[i], collector))
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+bool
+pgexporter_filter_prefix(struct metrics_filter* filter, const char* prefix)
+{
+   size_t length;
+   size_t name_length;
+
+   if (filter == NULL || filter->number_of_names == 0)
+   {
+      return true;
+   }
+
+   length = strlen(prefix);
+
+   for (int i = 0; i < filter->number_of_names; i++)
+   {
+      name_length = strlen(filter->names[i]);
+
+      // A name is selected from the prefix, or a prefix selects a part of it
+      if (!strncmp(filter->names[i], prefix, MIN(length, name_length)) &&
+          (filter->prefix[i] || name_length >= length))
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+int
+pgexporter_filter_prefixes(struct metrics_filter* filter, char* prefixes[MAX_NUMBER_OF_FILTERS])
+{
+   int n = 0;
+   int j;
+   char* name = NULL;
+
+   if (filter == NULL)
+   {
+      return 0;
+   }
+
+   for (int i = 0; i < filter->number_of_names; i++)
+   {
+      name = filter->names[i];
+      j = n - 1;
+
+      while (j >= 0 && strcmp(prefixes[j], name) > 0)
+      {
+         prefixes[j + 1] = prefixes[j];
+         j--;
+      }
+
+      prefixes[j + 1] = name;
+      n++;
+   }
+
+   // A name also selects the keys of the names it is a prefix of, so those are walked with it
+   j = 0;
+   for (int i = 0; i < n; i++)
+   {
+      if (j == 0 || strncmp(prefixes[i], prefixes[j - 1], strlen(prefixes[j - 1])))
+      {
+         prefixes[j++] = prefixes[i];
+      }
+   }
+
+   return j;
+}
+
+bool
+pgexporter_filter_metric(struct metrics_filter* filter, const char* key, size_t length)
+{
+   size_t name_length;
+
+   if (filter == NULL || filter->number_of_names == 0)
+   {
+      return true;
+   }
+
+   if (length == 0)
+   {
+      length = strcspn(key, "{");
+   }
+
+   for (int i = 0; i < filter->number_of_names; i++)
+   {
+      name_length = strlen(filter->names[i]);
+
+      if (filter->prefix[i])
+      {
+         if (length >= name_length && !strncmp(key, filter->names[i], name_length))
+         {
+            return true;
+         }
+      }
+      else if (length == name_length && !strncmp(key, filter->names[i], name_length))
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+/**
+ * Decode a URL encoded string in place
+ * @param s The string
+ */
+static void
+url_decode(char* s)
+{
+   char* w = s;
+   char hex[3];
+
+   while (*s != '\0')
+   {
+      if (*s == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2]))
+      {
+         hex[0] = s[1];
+         hex[1] = s[2];
+         hex[2] = '\0';
+         *w++ = (char)strtol(&hex[0], NULL, 16);
+         s += 3;
+      }
+      else if (*s == '+')
+      {
+         *w++ = ' ';
+         s++;
+      }
+      else
+      {
+         *w++ = *s++;
+      }
+   }
+
+   *w = '\0';
+}
+
+/**
+ * Is a string a metric name
+ * @param s The string
+ * @param length The length of the string
+ * @return True if a name, otherwise false
+ */
+static bool
+is_name(const char* s, size_t length)
+{
+   if (length == 0 || isdigit((unsigned char)s[0]))
+   {
+      return false;
+   }
+
+   for (size_t i = 0; i < length; i++)
+   {
+      if (!isalnum((unsigned char)s[i]) && s[i] != '_' && s[i] != ':')
+      {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+/**
+ * Compile a match[] selector. The supported selectors are a name, {__name__="name"}
+ * and {__name__=~"prefix.*"}, since label matchers would require the labels of the
+ * metrics before they are collected
+ * @param filter The filter
+ * @param selector The selector
+ * @return 0 upon success, otherwise 1
+ */
+static int
+filter_compile(struct metrics_filter* filter, char* selector)
+{
+   char* p = selector;
+   char* value = NULL;
+   size_t length;
+   bool regex = false;
+
+   while (*p == ' ')
+   {
+      p++;
+   }
+
+   if (*p != '{')
+   {
+      length = strlen(p);
+      while (length > 0 && p[length - 1] == ' ')
+      {
+         length--;
+      }
+
+      if (!is_name(p, length))
+      {
+         goto error;
+      }
+
+      return filter_add(filter, p, length, false);
+   }
+
+   p++;
+   while (*p == ' ')
+   {
+      p++;
+   }
+
+   if (strncmp(p, "__name__", 8))
+   {
+      goto error;
+   }
+   p += 8;
+
+   while (*p == ' ')
+   {
+      p++;
+   }
+
+   if (*p != '=')
+   {
+      goto error;
+   }
+   p++;
+
+   if (*p == '~')
+   {
+      regex = true;
+      p++;
+   }
+
+   while (*p == ' ')
+   {
+      p++;
+   }
+
+   if (*p != '"')
+   {
+      goto error;
+   }
+   p++;
+
+   value = p;
+   while (*p != '\0' && *p != '"')
+   {
+      p++;
+   }
+
+   if (*p != '"')
+   {
+      goto error;
+   }
+
+   length = p - value;
+   p++;
+
+   while (*p == ' ')
+   {
+      p++;
+   }
+
+   if (strcmp(p, "}"))
+   {
+      goto error;
+   }
+
+   // A regular expression matches the whole name, so only a trailing .* makes a prefix
+   if (regex && length >= 2 && !strncmp(value + length - 2, ".*", 2))
+   {
+      if (length == 2)
+      {
+         return filter_add(filter, "", 0, true);
+      }
+
+      if (!is_name(value, length - 2))
+      {
+         goto error;
+      }
+
+      return filter_add(filter, value, length - 2, true);
+   }
+
+   if (!is_name(value, length))
+   {
+      goto error;
+   }
+
+   return filter_add(filter, value, length, false);
+
+error:
+
+   return 1;
+}
+
+/**
+ * Add a name to a filter
+ * @param filter The filter
+ * @param name The name
+ * @param length The length of the name
+ * @param prefix Is the name a prefix
+ * @return 0 upon success, otherwise 1
+ */
+static int
+filter_add(struct metrics_filter* filter, const char* name, size_t length, bool prefix)
+{
+   if (filter->number_of_names >= MAX_NUMBER_OF_FILTERS || length >= MISC_LENGTH)
+   {
+      return 1;
+   }
+
+   memcpy(filter->names[filter->number_of_names], name, length);
+   filter->names[filter->number_of_names][length] = '\0';
+   filter->prefix[filter->number_of_names] = prefix;
+   filter->number_of_names++;
+
+   return 0;
+}
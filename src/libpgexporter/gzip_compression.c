@@ -126,6 +126,43 @@ pgexporter_gzip_string(char* s, unsigned char** buffer, size_t* buffer_size)
    return 0;
 }
 
+int
+pgexporter_gzip_buffer(void* source, size_t source_size, void* destination, size_t capacity, size_t* size)
+{
+   int ret;
+   z_stream stream;
+
+   *size = 0;
+
+   memset(&stream, 0, sizeof(stream));
+   stream.next_in = (unsigned char*)source;
+   stream.avail_in = source_size;
+   stream.next_out = (unsigned char*)destination;
+   stream.avail_out = capacity;
+
+   ret = deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+   if (ret != Z_OK)
+   {
+      pgexporter_log_error("Gzip: Initialization failed");
+      return 1;
+   }
+
+   ret = deflate(&stream, Z_FINISH);
+
+   if (ret != Z_STREAM_END)
+   {
+      /* The destination is too small */
+      deflateEnd(&stream);
+      return 1;
+   }
+
+   *size = stream.total_out;
+
+   deflateEnd(&stream);
+
+   return 0;
+}
+
 int
 pgexporter_gunzip_string(unsigned char* compressed_buffer, size_t compressed_size, char** output_string)
 {
@@ -206,3 +243,137 @@ pgexporter_gunzip_string(unsigned char* compressed_buffer, size_t compressed_siz
 
    return 0;
 }
+
+struct gzip_stream
+{
+   bool compress;    /**< Compress or decompress */
+   bool end;         /**< Has the end of the stream been reached */
+   z_stream stream;  /**< The zlib stream */
+};
+
+int
+pgexporter_gzip_stream_create(bool compress, void** stream)
+{
+   int ret;
+   struct gzip_stream* s = NULL;
+
+   *stream = NULL;
+
+   s = (struct gzip_stream*)calloc(1, sizeof(struct gzip_stream));
+   if (s == NULL)
+   {
+      pgexporter_log_error("Gzip: Allocation error");
+      goto error;
+   }
+
+   s->compress = compress;
+
+   if (compress)
+   {
+      ret = deflateInit2(&s->stream, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+   }
+   else
+   {
+      ret = inflateInit2(&s->stream, MAX_WBITS + 16);
+   }
+
+   if (ret != Z_OK)
+   {
+      pgexporter_log_error("Gzip: Initialization failed");
+      goto error;
+   }
+
+   *stream = s;
+
+   return 0;
+
+error:
+
+   free(s);
+
+   return 1;
+}
+
+int
+pgexporter_gzip_stream_update(void* stream, void* data, size_t length, bool finish, struct builder* output)
+{
+   int ret;
+   size_t available;
+   struct gzip_stream* s = (struct gzip_stream*)stream;
+
+   s->stream.next_in = (unsigned char*)data;
+   s->stream.avail_in = length;
+
+   while (!s->end)
+   {
+      if (pgexporter_builder_reserve(output, BUFFER_LENGTH))
+      {
+         goto error;
+      }
+
+      available = output->capacity - output->length - 1;
+
+      s->stream.next_out = (unsigned char*)output->data + output->length;
+      s->stream.avail_out = available;
+
+      if (s->compress)
+      {
+         ret = deflate(&s->stream, finish ? Z_FINISH : Z_NO_FLUSH);
+      }
+      else
+      {
+         ret = inflate(&s->stream, Z_NO_FLUSH);
+      }
+
+      output->length += available - s->stream.avail_out;
+      output->data[output->length] = '\0';
+
+      if (ret == Z_STREAM_END)
+      {
+         s->end = true;
+      }
+      else if (ret != Z_OK && ret != Z_BUF_ERROR)
+      {
+         pgexporter_log_error("Gzip: Stream failed");
+         goto error;
+      }
+      else if (s->stream.avail_in == 0 && s->stream.avail_out > 0 && !(s->compress && finish))
+      {
+         break;
+      }
+   }
+
+   if (finish && !s->end)
+   {
+      pgexporter_log_error("Gzip: Stream not complete");
+      goto error;
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+void
+pgexporter_gzip_stream_destroy(void* stream)
+{
+   struct gzip_stream* s = (struct gzip_stream*)stream;
+
+   if (s == NULL)
+   {
+      return;
+   }
+
+   if (s->compress)
+   {
+      deflateEnd(&s->stream);
+   }
+   else
+   {
+      inflateEnd(&s->stream);
+   }
+
+   free(s);
+}
@@ -30,17 +30,60 @@
 #include <pgexporter.h>
 #include <http.h>
 #include <logging.h>
+#include <memory.h>
 #include <network.h>
 #include <security.h>
+#include <stats.h>
 #include <utils.h>
 
 /* system */
 #include <errno.h>
+#include <poll.h>
+#include <strings.h>
 #include <unistd.h>
 #include <openssl/err.h>
 
+#define HTTP_BUFFER_SIZE 65536
+
+#define HTTP_STATE_STATUS     0
+#define HTTP_STATE_HEADER     1
+#define HTTP_STATE_CHUNK_SIZE 2
+#define HTTP_STATE_CHUNK_DATA 3
+#define HTTP_STATE_CHUNK_END  4
+#define HTTP_STATE_TRAILER    5
+#define HTTP_STATE_BODY       6
+#define HTTP_STATE_DONE       7
+
+/** @struct http_response
+ * The state of a response while it is read. The framing of the
+ * response is decoded as the data arrives, and the body is handed
+ * out line by line
+ */
+struct http_response
+{
+   int state;               /**< The part of the response being read */
+   int code;                /**< The status code */
+   bool chunked;            /**< Is the body chunked */
+   bool close;              /**< Does the connection end with the response */
+   long content_length;     /**< The length of the body, or -1 if it ends with the connection */
+   size_t remaining;        /**< The bytes left in the body or the current chunk */
+   struct builder framing;  /**< A status, header or chunk line split between reads */
+   struct builder line;     /**< A body line split between reads */
+   struct builder headers;  /**< The headers */
+   http_line_cb callback;   /**< The callback of the body lines */
+   void* data;              /**< The data of the callback */
+};
+
 static int http_build_header(int method, char* path, char** request);
-static int http_extract_headers_body(char* response, struct http* http);
+static int http_wait(struct http* http, uint64_t deadline);
+static bool http_header_contains(char* value, char* end, char* token);
+static int http_read_response(struct http* http, uint64_t deadline, http_line_cb callback, void* data);
+static int http_read_body(struct http* http, uint64_t deadline);
+static int http_body_cb(char* line, size_t length, void* data);
+static int http_response_feed(struct http_response* response, char* buffer, size_t length);
+static int http_response_framing(struct http_response* response, char* line, size_t length);
+static int http_response_body(struct http_response* response, char* buffer, size_t length);
+static int http_response_line(struct http_response* response, char* line, size_t length);
 
 int
 pgexporter_http_add_header(struct http* http, char* name, char* value)
@@ -110,73 +153,39 @@ http_build_header(int method, char* path, char** request)
    return 0;
 }
 
-static int
-http_extract_headers_body(char* response, struct http* http)
+int
+pgexporter_http_get(struct http* http, char* hostname, char* path)
 {
-   bool header = true;
-   char* p = NULL;
-   char* response_copy = NULL;
+   struct builder body;
 
-   if (response == NULL)
-   {
-      pgexporter_log_error("Response is NULL");
-      goto error;
-   }
+   pgexporter_builder_init(&body, 0);
 
-   response_copy = strdup(response);
-   if (response_copy == NULL)
+   if (pgexporter_http_get_lines(http, hostname, path, http_body_cb, &body))
    {
-      pgexporter_log_error("Failed to duplicate response string");
-      goto error;
+      pgexporter_builder_destroy(&body);
+      return 1;
    }
 
-   p = strtok(response_copy, "\n");
-   while (p != NULL)
-   {
-      if (*p == '\r')
-      {
-         header = false;
-      }
-      else
-      {
-         if (!pgexporter_is_number(p, 16))
-         {
-            if (header)
-            {
-               http->headers = pgexporter_append(http->headers, p);
-               http->headers = pgexporter_append_char(http->headers, '\n');
-            }
-            else
-            {
-               http->body = pgexporter_append(http->body, p);
-               http->body = pgexporter_append_char(http->body, '\n');
-            }
-         }
-      }
+   free(http->body);
+   http->body = pgexporter_builder_detach(&body);
 
-      p = strtok(NULL, "\n");
-   }
+   pgexporter_log_debug("HTTP Headers: %s", http->headers != NULL ? http->headers : "NULL");
+   pgexporter_log_debug("HTTP Body: %s", http->body != NULL ? http->body : "NULL");
 
-   free(response_copy);
    return 0;
-
-error:
-   free(response_copy);
-   return 1;
 }
 
 int
-pgexporter_http_get(struct http* http, char* hostname, char* path)
+pgexporter_http_get_lines(struct http* http, char* hostname, char* path, http_line_cb callback, void* data)
 {
    struct message msg_request;
-   struct message* msg_response = NULL;
    int error = 0;
    int status;
    char* request = NULL;
    char* full_request = NULL;
-   char* response = NULL;
    char* user_agent = NULL;
    char* endpoint = (path != NULL) ? path : "/metrics";
+   uint64_t deadline = 0;
 
    memset(&msg_request, 0, sizeof(struct message));
 
@@ -192,14 +201,15 @@ pgexporter_http_get(struct http* http, char* hostname, char* path)
    user_agent = pgexporter_append(user_agent, VERSION);
    pgexporter_http_add_header(http, "User-Agent", user_agent);
    pgexporter_http_add_header(http, "Accept", "text/*");
-   pgexporter_http_add_header(http, "Connection", "close");
+   pgexporter_http_add_header(http, "Connection", http->keep_alive ? "keep-alive" : "close");
 
    full_request = pgexporter_append(NULL, request);
    full_request = pgexporter_append(full_request, http->request_headers);
    full_request = pgexporter_append(full_request, "\r\n");
 
+   // Anything after the request would be read as the next request on a persistent connection
    msg_request.data = full_request;
-   msg_request.length = strlen(full_request) + 1;
+   msg_request.length = strlen(full_request);
 
    error = 0;
 req:
@@ -219,45 +229,19 @@ req:
       goto error;
    }
 
-res:
-   // Get a pointer to the global message structure
-   status = pgexporter_read_block_message(http->ssl, http->socket, &msg_response);
-   if (status != MESSAGE_STATUS_ZERO)
+   if (http->timeout > 0)
    {
-      if (status == MESSAGE_STATUS_OK)
-      {
-         // Get data from the response message
-         if (msg_response != NULL && msg_response->data != NULL)
-         {
-            response = pgexporter_append(response, (char*)msg_response->data);
-         }
-         pgexporter_clear_message();
-         goto res;
-      }
-      else
-      {
-         pgexporter_log_error("Error reading response");
-         goto error;
-      }
+      deadline = pgexporter_stats_now() + (uint64_t)http->timeout * 1000000000ULL;
    }
 
-   if (msg_response != NULL && msg_response->length > 0 && msg_response->data != NULL)
+   if (http_read_response(http, deadline, callback, data))
    {
-      response = pgexporter_append(response, (char*)msg_response->data);
-   }
-
-   if (http_extract_headers_body(response, http))
-   {
-      pgexporter_log_error("Failed to extract headers and body");
+      pgexporter_log_error("Failed to read the response of %s", hostname);
       goto error;
    }
 
-   pgexporter_log_debug("HTTP Headers: %s", http->headers != NULL ? http->headers : "NULL");
-   pgexporter_log_debug("HTTP Body: %s", http->body != NULL ? http->body : "NULL");
-
    free(request);
    free(full_request);
-   free(response);
    free(user_agent);
 
    free(http->request_headers);
@@ -268,15 +252,65 @@ res:
 error:
    free(request);
    free(full_request);
-   free(response);
    free(user_agent);
    free(http->request_headers);
    http->request_headers = NULL;
+   http->keep_alive = false;
    return 1;
 }
 
 int
-pgexporter_http_connect(char* hostname, int port, bool secure, struct http** result)
+pgexporter_http_create(int socket, int timeout, struct http** result)
+{
+   struct http* h = NULL;
+
+   *result = NULL;
+
+   h = (struct http*)pgexporter_memory_alloc(MEMORY_HTTP, sizeof(struct http));
+   if (h == NULL)
+   {
+      pgexporter_log_error("Failed to allocate HTTP structure");
+      return 1;
+   }
+
+   memset(h, 0, sizeof(struct http));
+
+   h->socket = socket;
+   h->timeout = timeout;
+
+   *result = h;
+
+   return 0;
+}
+
+bool
+pgexporter_http_idle(int socket)
+{
+   int ret;
+   struct pollfd pfd;
+
+   // An idle connection has nothing to read, so a pending end of file
+   // or the remains of an earlier response mean it can't be used
+   pfd.fd = socket;
+   pfd.events = POLLIN;
+   pfd.revents = 0;
+
+   do
+   {
+      ret = poll(&pfd, 1, 0);
+   }
+   while (ret == -1 && errno == EINTR);
+
+   if (ret == -1)
+   {
+      errno = 0;
+   }
+
+   return ret == 0;
+}
+
+int
+pgexporter_http_connect(char* hostname, int port, bool secure, int timeout, struct http** result)
 {
    struct http* h = NULL;
    int socket_fd = -1;
@@ -284,7 +318,7 @@ pgexporter_http_connect(char* hostname, int port, bool secure, struct http** res
    SSL_CTX* ctx = NULL;
 
    pgexporter_log_debug("Connecting to %s:%d (secure: %d)", hostname, port, secure);
-   h = (struct http*) malloc(sizeof(struct http));
+   h = (struct http*)pgexporter_memory_alloc(MEMORY_HTTP, sizeof(struct http));
    if (h == NULL)
    {
       pgexporter_log_error("Failed to allocate HTTP structure");
@@ -293,13 +327,14 @@ pgexporter_http_connect(char* hostname, int port, bool secure, struct http** res
 
    memset(h, 0, sizeof(struct http));
 
-   if (pgexporter_connect(hostname, port, &socket_fd))
+   if (pgexporter_connect_timeout(hostname, port, timeout, &socket_fd))
    {
       pgexporter_log_error("Failed to connect to %s:%d", hostname, port);
       goto error;
    }
 
    h->socket = socket_fd;
+   h->timeout = timeout;
 
    if (secure)
    {
@@ -369,7 +404,7 @@ error:
    {
       pgexporter_disconnect(socket_fd);
    }
-   free(h);
+   pgexporter_memory_release(MEMORY_HTTP, h);
    return 1;
 }
 
@@ -382,7 +417,6 @@ pgexporter_http_post(struct http* http, char* hostname, char* path, char* data,
    int status;
    char* request = NULL;
    char* full_request = NULL;
-   char* response = NULL;
    char* user_agent = NULL;
    char content_length[32];
 
@@ -444,25 +478,108 @@ req:
       goto error;
    }
 
-   status = pgexporter_http_read(http->ssl, http->socket, &response);
+   if (http_read_body(http, 0))
+   {
+      pgexporter_log_error("Failed to read the response");
+      goto error;
+   }
+
+   free(request);
+   free(full_request);
+   free(msg_request_ptr);
+   free(user_agent);
+
+   free(http->request_headers);
+   http->request_headers = NULL;
+
+   return 0;
+
+error:
+   free(request);
+   free(full_request);
+   free(msg_request_ptr);
+   free(user_agent);
+   free(http->request_headers);
+   http->request_headers = NULL;
+   return 1;
+}
+
+int
+pgexporter_http_post_data(struct http* http, char* hostname, char* path, char* content_type, void* data, size_t length)
+{
+   struct message msg_request;
+   int error = 0;
+   int status;
+   char* request = NULL;
+   char* user_agent = NULL;
+   char content_length[32];
+   uint64_t deadline = 0;
+   struct builder full_request;
 
-   if (response == NULL)
+   memset(&msg_request, 0, sizeof(struct message));
+   pgexporter_builder_init(&full_request, 0);
+
+   pgexporter_log_trace("Starting pgexporter_http_post_data");
+   if (http_build_header(PGEXPORTER_HTTP_POST, path, &request))
+   {
+      pgexporter_log_error("Failed to build HTTP header");
+      goto error;
+   }
+
+   pgexporter_http_add_header(http, "Host", hostname);
+   user_agent = pgexporter_append(user_agent, "pgexporter/");
+   user_agent = pgexporter_append(user_agent, VERSION);
+   pgexporter_http_add_header(http, "User-Agent", user_agent);
+   pgexporter_http_add_header(http, "Connection", http->keep_alive ? "keep-alive" : "close");
+
+   sprintf(content_length, "%zu", length);
+   pgexporter_http_add_header(http, "Content-Length", content_length);
+   pgexporter_http_add_header(http, "Content-Type", content_type);
+
+   // The data is binary, so it is sent as is after the headers
+   if (pgexporter_builder_append(&full_request, request) ||
+       pgexporter_builder_append(&full_request, http->request_headers) ||
+       pgexporter_builder_append(&full_request, "\r\n") ||
+       pgexporter_builder_append_length(&full_request, (char*)data, length))
+   {
+      goto error;
+   }
+
+   msg_request.data = full_request.data;
+   msg_request.length = full_request.length;
+
+   error = 0;
+req:
+   if (error < 5)
+   {
+      status = pgexporter_write_message(http->ssl, http->socket, &msg_request);
+      if (status != MESSAGE_STATUS_OK)
+      {
+         error++;
+         pgexporter_log_debug("Write failed, retrying (%d/5)", error);
+         goto req;
+      }
+   }
+   else
    {
-      pgexporter_log_error("No response data collected");
+      pgexporter_log_error("Failed to write after 5 attempts");
       goto error;
    }
 
-   if (http_extract_headers_body(response, http))
+   if (http->timeout > 0)
+   {
+      deadline = pgexporter_stats_now() + (uint64_t)http->timeout * 1000000000ULL;
+   }
+
+   if (http_read_body(http, deadline))
    {
-      pgexporter_log_error("Failed to extract headers and body");
+      pgexporter_log_error("Failed to read the response of %s", hostname);
       goto error;
    }
 
    free(request);
-   free(full_request);
-   free(response);
-   free(msg_request_ptr);
    free(user_agent);
+   pgexporter_builder_destroy(&full_request);
 
    free(http->request_headers);
    http->request_headers = NULL;
@@ -471,12 +588,11 @@ req:
 
 error:
    free(request);
-   free(full_request);
-   free(response);
-   free(msg_request_ptr);
    free(user_agent);
+   pgexporter_builder_destroy(&full_request);
    free(http->request_headers);
    http->request_headers = NULL;
+   http->keep_alive = false;
    return 1;
 }
 
@@ -489,7 +605,6 @@ pgexporter_http_put(struct http* http, char* hostname, char* path, const void* d
    int status;
    char* request = NULL;
    char* full_request = NULL;
-   char* response = NULL;
    char* user_agent = NULL;
    char* complete_request = NULL;
    char content_length[32];
@@ -566,23 +681,14 @@ req:
       goto error;
    }
 
-   status = pgexporter_http_read(http->ssl, http->socket, &response);
-
-   if (response == NULL)
+   if (http_read_body(http, 0))
    {
-      pgexporter_log_error("No response data collected");
-      goto error;
-   }
-
-   if (http_extract_headers_body(response, http))
-   {
-      pgexporter_log_error("Failed to extract headers and body");
+      pgexporter_log_error("Failed to read the response");
       goto error;
    }
 
    free(request);
    free(full_request);
-   free(response);
    free(msg_request_ptr->data);
    free(msg_request_ptr);
    free(user_agent);
@@ -595,7 +701,6 @@ req:
 error:
    free(request);
    free(full_request);
-   free(response);
    free(complete_request);
    free(msg_request_ptr);
    free(user_agent);
@@ -614,7 +719,6 @@ pgexporter_http_put_file(struct http* http, char* hostname, char* path, FILE* fi
    int status;
    char* request = NULL;
    char* header_part = NULL;
-   char* response = NULL;
    char* user_agent = NULL;
    char* full_request = NULL;
    char content_length[32];
@@ -719,17 +823,9 @@ req:
       goto error;
    }
 
-   status = pgexporter_http_read(http->ssl, http->socket, &response);
-
-   if (response == NULL)
+   if (http_read_body(http, 0))
    {
-      pgexporter_log_error("No response data collected");
-      goto error;
-   }
-
-   if (http_extract_headers_body(response, http))
-   {
-      pgexporter_log_error("Failed to extract headers and body");
+      pgexporter_log_error("Failed to read the response");
       goto error;
    }
 
@@ -749,7 +845,6 @@ req:
 
    free(request);
    free(header_part);
-   free(response);
    free(file_buffer);
    free(full_request);
    free(msg_request_ptr);
@@ -763,7 +858,6 @@ req:
 error:
    free(request);
    free(header_part);
-   free(response);
    free(file_buffer);
    free(full_request);
    free(msg_request_ptr);
@@ -775,152 +869,470 @@ error:
 }
 
 int
-pgexporter_http_read(SSL* ssl, int socket, char** response_text)
+pgexporter_http_disconnect(struct http* http)
 {
-   char buffer[8192];
-   ssize_t bytes_read;
-   int total_bytes = 0;
-   bool headers_complete = false;
-   bool chunked_encoding = false;
-
-   *response_text = NULL;
+   int status = 0;
 
-   while (1)
+   if (http != NULL)
    {
-      if (ssl != NULL)
+      if (http->ssl != NULL)
       {
-         bytes_read = SSL_read(ssl, buffer, sizeof(buffer) - 1);
-         if (bytes_read <= 0)
-         {
-            int err = SSL_get_error(ssl, bytes_read);
-            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
-            {
-               continue;
-            }
-            break;
-         }
+         pgexporter_close_ssl(http->ssl);
+         http->ssl = NULL;
       }
-      else
+
+      if (http->socket != -1)
       {
-         bytes_read = read(socket, buffer, sizeof(buffer) - 1);
-         if (bytes_read < 0)
-         {
-            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
-            {
-               continue;
-            }
-            break;
-         }
-         else if (bytes_read == 0)
+         if (pgexporter_disconnect(http->socket))
          {
-            break;
+            pgexporter_log_error("Failed to disconnect socket in pgexporter_http_disconnect");
+            status = 1;
          }
+         http->socket = -1;
       }
 
-      buffer[bytes_read] = '\0';
+      if (http->headers != NULL)
+      {
+         free(http->headers);
+         http->headers = NULL;
+      }
 
-      if (*response_text == NULL)
+      if (http->body != NULL)
       {
-         *response_text = malloc(bytes_read + 1);
-         if (*response_text == NULL)
-         {
-            return MESSAGE_STATUS_ERROR;
-         }
-         memcpy(*response_text, buffer, bytes_read + 1);
+         free(http->body);
+         http->body = NULL;
       }
-      else
+
+      if (http->request_headers != NULL)
       {
-         size_t current_len = strlen(*response_text);
-         char* new_response = realloc(*response_text, current_len + bytes_read + 1);
-         if (new_response == NULL)
-         {
-            free(*response_text);
-            *response_text = NULL;
-            return MESSAGE_STATUS_ERROR;
-         }
-         *response_text = new_response;
-         memcpy(*response_text + current_len, buffer, bytes_read + 1);
+         free(http->request_headers);
+         http->request_headers = NULL;
       }
 
-      total_bytes += bytes_read;
+      pgexporter_memory_release(MEMORY_HTTP, http);
+   }
 
-      if (!headers_complete)
+   if (status != 0)
+   {
+      goto error;
+   }
+
+   return 0;
+
+error:
+   return 1;
+}
+
+static int
+http_wait(struct http* http, uint64_t deadline)
+{
+   int ret;
+   uint64_t now;
+   struct pollfd pfd;
+
+   // Data already decrypted by the TLS layer doesn't show up on the socket
+   if (deadline == 0 || (http->ssl != NULL && SSL_pending(http->ssl) > 0))
+   {
+      return 0;
+   }
+
+   do
+   {
+      now = pgexporter_stats_now();
+      if (now >= deadline)
       {
-         if (strstr(*response_text, "\r\n\r\n") != NULL)
-         {
-            headers_complete = true;
-            if (strstr(*response_text, "Transfer-Encoding: chunked") != NULL)
-            {
-               chunked_encoding = true;
-            }
-         }
+         return 1;
       }
 
-      if (!chunked_encoding && bytes_read < sizeof(buffer) - 1)
+      pfd.fd = http->socket;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+
+      ret = poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+   }
+   while (ret == 0 || (ret == -1 && errno == EINTR));
+
+   if (ret == -1)
+   {
+      errno = 0;
+      return 1;
+   }
+
+   return 0;
+}
+
+static bool
+http_header_contains(char* value, char* end, char* token)
+{
+   size_t length = strlen(token);
+
+   for (char* p = value; p + length <= end; p++)
+   {
+      if (!strncasecmp(p, token, length))
       {
-         break;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static int
+http_read_response(struct http* http, uint64_t deadline, http_line_cb callback, void* data)
+{
+   int status;
+   size_t length = 0;
+   char* buffer = NULL;
+   struct http_response response;
+
+   memset(&response, 0, sizeof(struct http_response));
+   response.state = HTTP_STATE_STATUS;
+   response.content_length = -1;
+   response.callback = callback;
+   response.data = data;
+
+   pgexporter_builder_init(&response.framing, 0);
+   pgexporter_builder_init(&response.line, 0);
+   pgexporter_builder_init(&response.headers, 0);
+
+   buffer = pgexporter_memory_alloc(MEMORY_HTTP, HTTP_BUFFER_SIZE);
+   if (buffer == NULL)
+   {
+      pgexporter_log_error("Failed to allocate the response buffer");
+      goto error;
+   }
+
+   while (response.state != HTTP_STATE_DONE)
+   {
+      if (http_wait(http, deadline))
+      {
+         pgexporter_log_error("Timed out waiting for the response");
+         goto error;
       }
 
-      if (chunked_encoding && strstr(*response_text, "\r\n0\r\n\r\n") != NULL)
+      status = pgexporter_read_block_buffer(http->ssl, http->socket, buffer, HTTP_BUFFER_SIZE, &length);
+
+      if (status == MESSAGE_STATUS_ZERO)
       {
          break;
       }
+      else if (status != MESSAGE_STATUS_OK)
+      {
+         pgexporter_log_error("Error reading response");
+         goto error;
+      }
+
+      if (http_response_feed(&response, buffer, length))
+      {
+         goto error;
+      }
+   }
+
+   if (response.state != HTTP_STATE_DONE)
+   {
+      // Only a body without a length ends with the connection
+      if (response.state != HTTP_STATE_BODY || response.content_length >= 0)
+      {
+         pgexporter_log_error("Incomplete response");
+         goto error;
+      }
+
+      response.close = true;
+   }
+
+   // The last line of the body may not be terminated
+   if (response.line.length > 0)
+   {
+      if (http_response_line(&response, response.line.data, response.line.length))
+      {
+         goto error;
+      }
    }
 
-   pgexporter_log_debug("Read %d bytes from socket", total_bytes);
+   http->keep_alive = http->keep_alive && !response.close;
+   http->status = response.code;
+
+   free(http->headers);
+   http->headers = pgexporter_builder_detach(&response.headers);
+
+   pgexporter_memory_release(MEMORY_HTTP, buffer);
+   pgexporter_builder_destroy(&response.framing);
+   pgexporter_builder_destroy(&response.line);
+
+   return 0;
+
+error:
+
+   http->keep_alive = false;
+
+   pgexporter_memory_release(MEMORY_HTTP, buffer);
+   pgexporter_builder_destroy(&response.framing);
+   pgexporter_builder_destroy(&response.line);
+   pgexporter_builder_destroy(&response.headers);
 
-   return total_bytes > 0 ? MESSAGE_STATUS_OK : MESSAGE_STATUS_ERROR;
+   return 1;
 }
 
-int
-pgexporter_http_disconnect(struct http* http)
+static int
+http_read_body(struct http* http, uint64_t deadline)
 {
-   int status = 0;
+   struct builder body;
 
-   if (http != NULL)
+   pgexporter_builder_init(&body, 0);
+
+   if (http_read_response(http, deadline, http_body_cb, &body))
    {
-      if (http->ssl != NULL)
+      pgexporter_builder_destroy(&body);
+      return 1;
+   }
+
+   free(http->body);
+   http->body = pgexporter_builder_detach(&body);
+
+   return 0;
+}
+
+static int
+http_body_cb(char* line, size_t length, void* data)
+{
+   struct builder* body = (struct builder*)data;
+
+   if (pgexporter_builder_append_length(body, line, length) ||
+       pgexporter_builder_append_char(body, '\n'))
+   {
+      return 1;
+   }
+
+   return 0;
+}
+
+static int
+http_response_feed(struct http_response* response, char* buffer, size_t length)
+{
+   size_t offset = 0;
+   size_t size;
+   char* eol = NULL;
+
+   while (offset < length && response->state != HTTP_STATE_DONE)
+   {
+      if (response->state == HTTP_STATE_CHUNK_DATA ||
+          (response->state == HTTP_STATE_BODY && response->content_length >= 0))
       {
-         pgexporter_close_ssl(http->ssl);
-         http->ssl = NULL;
+         size = MIN(response->remaining, length - offset);
+
+         if (http_response_body(response, buffer + offset, size))
+         {
+            return 1;
+         }
+
+         offset += size;
+         response->remaining -= size;
+
+         if (response->remaining == 0)
+         {
+            response->state = response->state == HTTP_STATE_CHUNK_DATA ? HTTP_STATE_CHUNK_END : HTTP_STATE_DONE;
+         }
       }
+      else if (response->state == HTTP_STATE_BODY)
+      {
+         if (http_response_body(response, buffer + offset, length - offset))
+         {
+            return 1;
+         }
 
-      if (http->socket != -1)
+         offset = length;
+      }
+      else
       {
-         if (pgexporter_disconnect(http->socket))
+         // The status, the headers and the chunk sizes are lines
+         eol = memchr(buffer + offset, '\n', length - offset);
+
+         if (eol == NULL)
          {
-            pgexporter_log_error("Failed to disconnect socket in pgexporter_http_disconnect");
-            status = 1;
+            pgexporter_builder_append_length(&response->framing, buffer + offset, length - offset);
+            offset = length;
+         }
+         else
+         {
+            size = eol - (buffer + offset);
+            pgexporter_builder_append_length(&response->framing, buffer + offset, size);
+            offset += size + 1;
+
+            size = response->framing.length;
+            if (size > 0 && response->framing.data[size - 1] == '\r')
+            {
+               size--;
+            }
+
+            if (http_response_framing(response, response->framing.data, size))
+            {
+               return 1;
+            }
+
+            response->framing.length = 0;
          }
-         http->socket = -1;
       }
+   }
 
-      if (http->headers != NULL)
+   return 0;
+}
+
+static int
+http_response_framing(struct http_response* response, char* line, size_t length)
+{
+   char* end = line + length;
+
+   switch (response->state)
+   {
+      case HTTP_STATE_STATUS:
+         if (length < 12 || strncmp(line, "HTTP/1.", 7))
+         {
+            pgexporter_log_error("Invalid HTTP status line");
+            return 1;
+         }
+
+         // Only a HTTP/1.1 connection stays open by default
+         response->close = line[7] != '1';
+         response->code = atoi(line + 9);
+
+         pgexporter_builder_append_length(&response->headers, line, length);
+         pgexporter_builder_append_char(&response->headers, '\n');
+         response->state = HTTP_STATE_HEADER;
+         break;
+      case HTTP_STATE_HEADER:
+         if (length == 0)
+         {
+            if (response->chunked)
+            {
+               response->state = HTTP_STATE_CHUNK_SIZE;
+            }
+            else if (response->content_length > 0)
+            {
+               response->remaining = (size_t)response->content_length;
+               response->state = HTTP_STATE_BODY;
+            }
+            else if (response->content_length == 0)
+            {
+               response->state = HTTP_STATE_DONE;
+            }
+            else
+            {
+               response->state = HTTP_STATE_BODY;
+            }
+            break;
+         }
+
+         if (!strncasecmp(line, "Content-Length:", 15))
+         {
+            response->content_length = strtol(line + 15, NULL, 10);
+         }
+         else if (!strncasecmp(line, "Transfer-Encoding:", 18))
+         {
+            response->chunked = http_header_contains(line + 18, end, "chunked");
+         }
+         else if (!strncasecmp(line, "Connection:", 11))
+         {
+            if (http_header_contains(line + 11, end, "close"))
+            {
+               response->close = true;
+            }
+            else if (http_header_contains(line + 11, end, "keep-alive"))
+            {
+               response->close = false;
+            }
+         }
+
+         pgexporter_builder_append_length(&response->headers, line, length);
+         pgexporter_builder_append_char(&response->headers, '\n');
+         break;
+      case HTTP_STATE_CHUNK_SIZE:
+         // A chunk extension follows the size
+         response->remaining = strtoul(line, NULL, 16);
+         response->state = response->remaining > 0 ? HTTP_STATE_CHUNK_DATA : HTTP_STATE_TRAILER;
+         break;
+      case HTTP_STATE_CHUNK_END:
+         if (length != 0)
+         {
+            pgexporter_log_error("Invalid HTTP chunk");
+            return 1;
+         }
+         response->state = HTTP_STATE_CHUNK_SIZE;
+         break;
+      case HTTP_STATE_TRAILER:
+         if (length == 0)
+         {
+            response->state = HTTP_STATE_DONE;
+         }
+         break;
+      default:
+         break;
+   }
+
+   return 0;
+}
+
+static int
+http_response_body(struct http_response* response, char* buffer, size_t length)
+{
+   char* eol = NULL;
+   size_t size;
+
+   while (length > 0)
+   {
+      eol = memchr(buffer, '\n', length);
+
+      if (eol == NULL)
       {
-         free(http->headers);
-         http->headers = NULL;
+         pgexporter_builder_append_length(&response->line, buffer, length);
+         return 0;
       }
 
-      if (http->body != NULL)
+      size = eol - buffer;
+
+      if (response->line.length > 0)
       {
-         free(http->body);
-         http->body = NULL;
-      }
+         pgexporter_builder_append_length(&response->line, buffer, size);
 
-      if (http->request_headers != NULL)
+         if (http_response_line(response, response->line.data, response->line.length))
+         {
+            return 1;
+         }
+
+         response->line.length = 0;
+         response->line.data[0] = '\0';
+      }
+      else
       {
-         free(http->request_headers);
-         http->request_headers = NULL;
+         // The line is handed out from the read buffer in place of its line feed
+         *eol = '\0';
+
+         if (http_response_line(response, buffer, size))
+         {
+            return 1;
+         }
       }
+
+      buffer = eol + 1;
+      length -= size + 1;
    }
 
-   if (status != 0)
+   return 0;
+}
+
+static int
+http_response_line(struct http_response* response, char* line, size_t length)
+{
+   if (length > 0 && line[length - 1] == '\r')
    {
-      goto error;
+      length--;
    }
 
-   return 0;
+   line[length] = '\0';
 
-error:
-   return 1;
+   if (response->callback != NULL)
+   {
+      return response->callback(line, length, response->data);
+   }
+
+   return 0;
 }
@@ -31,6 +31,7 @@
 #include <art.h>
 #include <json.h>
 #include <logging.h>
+#include <memory.h>
 #include <message.h>
 #include <utils.h>
 
@@ -43,11 +44,51 @@
 static bool type_allowed(enum value_type type);
 static char* item_to_string(struct json* item, int32_t format, char* tag, int indent);
 static char* array_to_string(struct json* array, int32_t format, char* tag, int indent);
-static int parse_string(char* str, uint64_t* index, struct json** obj);
 static int json_add(struct json* obj, char* key, uintptr_t val, enum value_type type);
-static int fill_value(char* str, char* key, uint64_t* index, struct json* o);
-static bool value_start(char ch);
-static int handle_escape_char(char* str, uint64_t* index, uint64_t len, char* ch);
+static int read_file(char* path, struct builder* str);
+
+static int writer_write(struct json_writer* writer, char* data, size_t length);
+static int writer_indent(struct json_writer* writer, int depth);
+static int writer_string(struct json_writer* writer, char* str);
+static int writer_element(struct json_writer* writer, char* key);
+static int writer_begin(struct json_writer* writer, char* key, bool array);
+static int writer_end(struct json_writer* writer, bool array);
+
+/** @struct sax
+ * Defines the state of the event based parser
+ */
+struct sax
+{
+   char* str;                     /**< The string */
+   size_t length;                 /**< The length of the string */
+   size_t index;                  /**< The current position */
+   int depth;                     /**< The number of open containers */
+   struct json_handler* handler;  /**< The handler */
+};
+
+static void sax_skip(struct sax* sax);
+static int sax_value(struct sax* sax, char* key);
+static int sax_container(struct sax* sax, char* key, bool array);
+static int sax_string(struct sax* sax, char** str);
+static int sax_number(struct sax* sax, char* key);
+static int sax_literal(struct sax* sax, char* key);
+static int sax_escape(struct sax* sax, char** out);
+static int sax_hex(struct sax* sax, uint32_t* cp);
+
+/** @struct json_tree
+ * Defines the handler state building a json object
+ */
+struct json_tree
+{
+   struct json* root;    /**< The root */
+   struct json** stack;  /**< The open containers */
+   size_t top;           /**< The number of open containers */
+   size_t capacity;      /**< The capacity of the stack */
+};
+
+static int tree_begin(void* arg, char* key);
+static int tree_end(void* arg);
+static int tree_value(void* arg, char* key, uintptr_t data, enum value_type type);
 
 int
 pgexporter_json_append(struct json* array, uintptr_t entry, enum value_type type)
@@ -55,7 +96,7 @@ pgexporter_json_append(struct json* array, uintptr_t entry, enum value_type type
    if (array != NULL && array->type == JSONUnknown)
    {
       array->type = JSONArray;
-      pgexporter_deque_create(false, (struct deque**)&array->elements);
+      pgexporter_deque_create_with_flags(DEQUE_POOLED, (struct deque**)&array->elements);
    }
    if (array == NULL || array->type != JSONArray || !type_allowed(type))
    {
@@ -141,7 +182,7 @@ pgexporter_json_clear(struct json* obj)
 int
 pgexporter_json_create(struct json** object)
 {
-   struct json* o = malloc(sizeof(struct json));
+   struct json* o = pgexporter_memory_alloc(MEMORY_JSON, sizeof(struct json));
    memset(o, 0, sizeof(struct json));
    o->type = JSONUnknown;
    *object = o;
@@ -163,7 +204,7 @@ pgexporter_json_destroy(struct json* object)
    {
       pgexporter_art_destroy(object->elements);
    }
-   free(object);
+   pgexporter_memory_release(MEMORY_JSON, object);
    return 0;
 }
 
@@ -235,7 +276,7 @@ pgexporter_json_iterator_create(struct json* object, struct json_iterator** iter
    {
       return 1;
    }
-   i = malloc(sizeof (struct json_iterator));
+   i = pgexporter_memory_alloc(MEMORY_JSON, sizeof (struct json_iterator));
    memset(i, 0, sizeof (struct json_iterator));
    i->obj = object;
    if (object->type == JSONItem)
@@ -265,7 +306,7 @@ pgexporter_json_iterator_destroy(struct json_iterator* iter)
    {
       pgexporter_art_iterator_destroy((struct art_iterator*)iter->iter);
    }
-   free(iter);
+   pgexporter_memory_release(MEMORY_JSON, iter);
 }
 
 bool
@@ -318,429 +359,180 @@ pgexporter_json_iterator_has_next(struct json_iterator* iter)
 int
 pgexporter_json_parse_string(char* str, struct json** obj)
 {
-   uint64_t idx = 0;
-   if (str == NULL || strlen(str) < 2)
+   int ret = 1;
+   size_t length = 0;
+   char* copy = NULL;
+
+   *obj = NULL;
+
+   if (str == NULL || (length = strlen(str)) < 2)
    {
       return 1;
    }
 
-   return parse_string(str, &idx, obj);
-}
-
-int
-pgexporter_json_clone(struct json* from, struct json** to)
-{
-   struct json* o = NULL;
-   char* str = NULL;
-   str = pgexporter_json_to_string(from, FORMAT_JSON, NULL, 0);
-   if (pgexporter_json_parse_string(str, &o))
+   copy = malloc(length + 1);
+   if (copy == NULL)
    {
-      goto error;
+      return 1;
    }
-   *to = o;
-   free(str);
-   return 0;
-error:
-   free(str);
-   return 1;
+   memcpy(copy, str, length + 1);
+
+   ret = pgexporter_json_parse_in_place(copy, length, obj);
+
+   free(copy);
+
+   return ret;
 }
 
-static int
-parse_string(char* str, uint64_t* index, struct json** obj)
+int
+pgexporter_json_parse_in_place(char* str, size_t length, struct json** obj)
 {
-   enum json_type type;
-   struct json* o = NULL;
-   uint64_t idx = *index;
-   char ch = str[idx];
-   char* key = NULL;
-   uint64_t len = strlen(str);
+   struct json_tree tree;
+   struct json_handler handler;
 
-   if (ch == '{')
-   {
-      type = JSONItem;
-   }
-   else if (ch == '[')
-   {
-      type = JSONArray;
-   }
-   else
+   *obj = NULL;
+
+   memset(&tree, 0, sizeof(struct json_tree));
+   memset(&handler, 0, sizeof(struct json_handler));
+
+   handler.arg = &tree;
+   handler.begin_object = tree_begin;
+   handler.end_object = tree_end;
+   handler.begin_array = tree_begin;
+   handler.end_array = tree_end;
+   handler.value = tree_value;
+
+   if (pgexporter_json_parse_sax(str, length, &handler))
    {
       goto error;
    }
-   idx++;
-   pgexporter_json_create(&o);
-   if (type == JSONItem)
-   {
-      while (idx < len)
-      {
-         // pre key
-         while (idx < len && isspace(str[idx]))
-         {
-            idx++;
-         }
-         if (idx == len)
-         {
-            goto error;
-         }
-         if (str[idx] == ',')
-         {
-            idx++;
-         }
-         else if (str[idx] == '}')
-         {
-            idx++;
-            break;
-         }
-         else if (!(str[idx] == '"' && o->type == JSONUnknown))
-         {
-            // if it's first key we won't see comma, otherwise we must see comma
-            goto error;
-         }
-         while (idx < len && str[idx] != '"')
-         {
-            idx++;
-         }
-         if (idx == len)
-         {
-            goto error;
-         }
-         idx++;
-         // The key
-         while (idx < len && str[idx] != '"')
-         {
-            char ec_ch;
-            // handle escape character
-            if (str[idx] == '\\')
-            {
-               if (handle_escape_char(str, &idx, len, &ec_ch))
-               {
-                  goto error;
-               }
-               key = pgexporter_append_char(key, ec_ch);
-               continue;
-            }
 
-            key = pgexporter_append_char(key, str[idx++]);
-         }
-         if (idx == len || key == NULL)
-         {
-            goto error;
-         }
-         // The lands between
-         while (idx < len && (str[idx] == '"' || isspace(str[idx])))
-         {
-            idx++;
-         }
-         if (idx == len || str[idx] != ':')
-         {
-            goto error;
-         }
-         while (idx < len && (str[idx] == ':' || isspace(str[idx])))
-         {
-            idx++;
-         }
-         if (idx == len)
-         {
-            goto error;
-         }
-         // The value
-         if (fill_value(str, key, &idx, o))
-         {
-            goto error;
-         }
-         free(key);
-         key = NULL;
-      }
-   }
-   else
-   {
-      while (idx < len)
-      {
-         while (idx < len && isspace(str[idx]))
-         {
-            idx++;
-         }
-         if (idx == len)
-         {
-            goto error;
-         }
-         if (str[idx] == ',')
-         {
-            idx++;
-         }
-         else if (str[idx] == ']')
-         {
-            idx++;
-            break;
-         }
-         else if (!(value_start(str[idx]) && o->type == JSONUnknown))
-         {
-            // if it's first key we won't see comma, otherwise we must see comma
-            goto error;
-         }
-         while (idx < len && !value_start(str[idx]))
-         {
-            idx++;
-         }
-         if (idx == len)
-         {
-            goto error;
-         }
+   *obj = tree.root;
 
-         if (fill_value(str, key, &idx, o))
-         {
-            goto error;
-         }
-      }
-   }
+   pgexporter_memory_release(MEMORY_JSON, tree.stack);
 
-   *index = idx;
-   *obj = o;
    return 0;
+
 error:
-   pgexporter_json_destroy(o);
-   free(key);
+
+   pgexporter_json_destroy(tree.root);
+   pgexporter_memory_release(MEMORY_JSON, tree.stack);
+
    return 1;
 }
 
-static int
-json_add(struct json* obj, char* key, uintptr_t val, enum value_type type)
+int
+pgexporter_json_parse_sax(char* str, size_t length, struct json_handler* handler)
 {
-   if (obj == NULL)
+   struct sax sax;
+
+   if (str == NULL || length < 2 || handler == NULL)
    {
       return 1;
    }
-   if (key == NULL)
+
+   memset(&sax, 0, sizeof(struct sax));
+   sax.str = str;
+   sax.length = length;
+   sax.handler = handler;
+
+   sax_skip(&sax);
+
+   // The document is an object or an array
+   if (sax.index == sax.length || (str[sax.index] != '{' && str[sax.index] != '['))
    {
-      return pgexporter_json_append(obj, val, type);
+      return 1;
    }
-   return pgexporter_json_put(obj, key, val, type);
-}
 
-static bool
-value_start(char ch)
-{
-   return (isdigit(ch) || ch == '-' || ch == '+') || // number
-          (ch == '[') || // array
-          (ch == '{') || // item
-          (ch == '"' || ch == 'n') || // string or null string
-          (ch == 't' || ch == 'f'); // potential boolean value
+   return sax_value(&sax, NULL);
 }
 
-static int
-fill_value(char* str, char* key, uint64_t* index, struct json* o)
+int
+pgexporter_json_clone(struct json* from, struct json** to)
 {
-   uint64_t idx = *index;
-   uint64_t len = strlen(str);
-   if (str[idx] == '"')
-   {
-      char* val = NULL;
-      idx++;
-      while (idx < len && str[idx] != '"')
-      {
-         char ec_ch;
-         if (str[idx] == '\\')
-         {
-            if (handle_escape_char(str, &idx, len, &ec_ch))
-            {
-               goto error;
-            }
-            val = pgexporter_append_char(val, ec_ch);
-            continue;
-         }
+   struct json* o = NULL;
+   struct builder str;
+   struct json_writer writer;
 
-         val = pgexporter_append_char(val, str[idx++]);
-      }
-      if (idx == len)
-      {
-         goto error;
-      }
-      if (val == NULL)
-      {
-         json_add(o, key, (uintptr_t)"", ValueString);
-      }
-      else
-      {
-         json_add(o, key, (uintptr_t)val, ValueString);
-      }
-      idx++;
-      free(val);
-   }
-   else if (str[idx] == '-' || str[idx] == '+' || isdigit(str[idx]))
-   {
-      bool has_digit = false;
-      char* val_str = NULL;
-      while (idx < len && (isdigit(str[idx]) || str[idx] == '.' || str[idx] == '-' || str[idx] == '+'))
-      {
-         if (str[idx] == '.')
-         {
-            has_digit = true;
-         }
-         val_str = pgexporter_append_char(val_str, str[idx++]);
-      }
-      if (has_digit)
-      {
-         double val = 0.;
-         if (sscanf(val_str, "%lf", &val) != 1)
-         {
-            free(val_str);
-            goto error;
-         }
-         json_add(o, key, pgexporter_value_from_double(val), ValueDouble);
-         free(val_str);
-      }
-      else
-      {
-         int64_t val = 0;
-         if (sscanf(val_str, "%" PRId64, &val) != 1)
-         {
-            free(val_str);
-            goto error;
-         }
-         json_add(o, key, (uintptr_t)val, ValueInt64);
-         free(val_str);
-      }
-   }
-   else if (str[idx] == '{')
-   {
-      struct json* val = NULL;
-      if (parse_string(str, &idx, &val))
-      {
-         goto error;
-      }
-      json_add(o, key, (uintptr_t)val, ValueJSON);
-   }
-   else if (str[idx] == '[')
-   {
-      struct json* val = NULL;
-      if (parse_string(str, &idx, &val))
-      {
-         goto error;
-      }
-      json_add(o, key, (uintptr_t)val, ValueJSON);
-   }
-   else if (str[idx] == 'n' || str[idx] == 't' || str[idx] == 'f')
+   pgexporter_builder_init(&str, 0);
+
+   if (pgexporter_json_writer_init(&writer, FORMAT_JSON_COMPACT, pgexporter_json_sink_builder, &str) ||
+       pgexporter_json_writer_json(&writer, NULL, from) ||
+       pgexporter_json_writer_flush(&writer))
    {
-      char* val = NULL;
-      while (idx < len && str[idx] >= 'a' && str[idx] <= 'z')
-      {
-         val = pgexporter_append_char(val, str[idx++]);
-      }
-      if (pgexporter_compare_string(val, "null"))
-      {
-         json_add(o, key, 0, ValueString);
-      }
-      else if (pgexporter_compare_string(val, "true"))
-      {
-         json_add(o, key, true, ValueBool);
-      }
-      else if (pgexporter_compare_string(val, "false"))
-      {
-         json_add(o, key, false, ValueBool);
-      }
-      else
-      {
-         free(val);
-         goto error;
-      }
-      free(val);
+      goto error;
    }
-   else
+
+   if (pgexporter_json_parse_in_place(str.data, str.length, &o))
    {
       goto error;
    }
-   *index = idx;
+   *to = o;
+   pgexporter_builder_destroy(&str);
    return 0;
 error:
+   pgexporter_builder_destroy(&str);
    return 1;
 }
 
-static int
-handle_escape_char(char* str, uint64_t* index, uint64_t len, char* ch)
-{
-   uint64_t idx = *index;
-   idx++;
-   if (idx == len)   // security check
-   {
-      return 1;
-   }
-   // Check the next character after checking '\' character
-   switch (str[idx])
-   {
-      case '\"':
-      case '\\':
-         *ch = str[idx];
-         break;
-      case 'n':
-         *ch = '\n';
-         break;
-      case 't':
-         *ch = '\t';
-         break;
-      case 'r':
-         *ch = '\r';
-         break;
-      default:
-         return 1;
-   }
-   *index = idx + 1;
-   return 0;
-}
-
 int
 pgexporter_json_read_file(char* path, struct json** obj)
 {
-   FILE* file = NULL;
-   char buf[DEFAULT_BUFFER_SIZE];
-   char* str = NULL;
+   struct builder str;
    struct json* j = NULL;
 
    *obj = NULL;
 
-   if (path == NULL)
+   pgexporter_builder_init(&str, 0);
+
+   if (read_file(path, &str))
    {
       goto error;
    }
 
-   file = fopen(path, "r");
-
-   if (file == NULL)
+   // The file content is only needed for the parse, so it is parsed in place
+   if (pgexporter_json_parse_in_place(str.data, str.length, &j))
    {
-      pgexporter_log_error("Failed to open json file %s", path);
+      pgexporter_log_error("Failed to parse json file %s", path);
       goto error;
    }
 
-   memset(buf, 0, sizeof(buf));
+   *obj = j;
+
+   pgexporter_builder_destroy(&str);
+   return 0;
+
+error:
+
+   pgexporter_builder_destroy(&str);
+
+   return 1;
+}
+
+int
+pgexporter_json_read_file_sax(char* path, struct json_handler* handler)
+{
+   struct builder str;
 
-   // save the last one for ending so that we get to use append
-   while (fread(buf, 1, DEFAULT_BUFFER_SIZE - 1, file) > 0)
+   pgexporter_builder_init(&str, 0);
+
+   if (read_file(path, &str))
    {
-      str = pgexporter_append(str, buf);
-      memset(buf, 0, sizeof(buf));
+      goto error;
    }
 
-   if (pgexporter_json_parse_string(str, &j))
+   if (pgexporter_json_parse_sax(str.data, str.length, handler))
    {
       pgexporter_log_error("Failed to parse json file %s", path);
       goto error;
    }
 
-   *obj = j;
-
-   fclose(file);
-   free(str);
+   pgexporter_builder_destroy(&str);
    return 0;
 
 error:
 
-   pgexporter_json_destroy(j);
-
-   if (file != NULL)
-   {
-      fclose(file);
-   }
-
-   free(str);
+   pgexporter_builder_destroy(&str);
 
    return 1;
 }
@@ -749,7 +541,7 @@ int
 pgexporter_json_write_file(char* path, struct json* obj)
 {
    FILE* file = NULL;
-   char* str = NULL;
+   struct json_writer writer;
 
    if (path == NULL || obj == NULL)
    {
@@ -763,24 +555,18 @@ pgexporter_json_write_file(char* path, struct json* obj)
       goto error;
    }
 
-   str = pgexporter_json_to_string(obj, FORMAT_JSON, NULL, 0);
-   if (str == NULL)
-   {
-      goto error;
-   }
-
-   if (fputs(str, file) == EOF)
+   if (pgexporter_json_writer_init(&writer, FORMAT_JSON, pgexporter_json_sink_file, file) ||
+       pgexporter_json_writer_json(&writer, NULL, obj) ||
+       pgexporter_json_writer_flush(&writer))
    {
       pgexporter_log_error("Failed to write json file %s", path);
       goto error;
    }
 
-   free(str);
    fclose(file);
    return 0;
 
 error:
-   free(str);
    if (file != NULL)
    {
       fclose(file);
@@ -788,6 +574,881 @@ error:
    return 1;
 }
 
+int
+pgexporter_json_writer_init(struct json_writer* writer, int32_t format, json_sink_cb sink, void* arg)
+{
+   if (writer == NULL || sink == NULL || (format != FORMAT_JSON && format != FORMAT_JSON_COMPACT))
+   {
+      return 1;
+   }
+
+   writer->format = format;
+   writer->sink = sink;
+   writer->arg = arg;
+   writer->depth = 0;
+   writer->error = false;
+   writer->length = 0;
+
+   return 0;
+}
+
+int
+pgexporter_json_writer_begin_object(struct json_writer* writer, char* key)
+{
+   return writer_begin(writer, key, false);
+}
+
+int
+pgexporter_json_writer_end_object(struct json_writer* writer)
+{
+   return writer_end(writer, false);
+}
+
+int
+pgexporter_json_writer_begin_array(struct json_writer* writer, char* key)
+{
+   return writer_begin(writer, key, true);
+}
+
+int
+pgexporter_json_writer_end_array(struct json_writer* writer)
+{
+   return writer_end(writer, true);
+}
+
+int
+pgexporter_json_writer_value(struct json_writer* writer, char* key, uintptr_t data, enum value_type type)
+{
+   char buf[VALUE_FORMAT_SIZE];
+   size_t length = 0;
+   char* str = NULL;
+   struct value value;
+
+   if (type == ValueJSON || type == ValueJSONRef)
+   {
+      return pgexporter_json_writer_json(writer, key, (struct json*)data);
+   }
+
+   if (!type_allowed(type) && type != ValueStringRef && type != ValueBASE64Ref)
+   {
+      return 1;
+   }
+
+   if (writer_element(writer, key))
+   {
+      return 1;
+   }
+
+   switch (type)
+   {
+      case ValueString:
+      case ValueStringRef:
+      case ValueBASE64:
+      case ValueBASE64Ref:
+         if (data == 0)
+         {
+            return writer_write(writer, "null", 4);
+         }
+         return writer_string(writer, (char*)data);
+      case ValueBool:
+         return data ? writer_write(writer, "true", 4) : writer_write(writer, "false", 5);
+      default:
+         break;
+   }
+
+   length = pgexporter_value_format(type, data, buf);
+   if (length > 0)
+   {
+      return writer_write(writer, buf, length);
+   }
+
+   // The numbers have no data to own, so the formatting of the value is reused
+   pgexporter_value_init(type, data, &value);
+   str = pgexporter_value_to_string(&value, writer->format, NULL, 0);
+   if (str == NULL)
+   {
+      return 1;
+   }
+
+   if (writer_write(writer, str, strlen(str)))
+   {
+      free(str);
+      return 1;
+   }
+
+   free(str);
+
+   return 0;
+}
+
+int
+pgexporter_json_writer_json(struct json_writer* writer, char* key, struct json* object)
+{
+   bool array = false;
+   struct json_iterator* iter = NULL;
+
+   if (object == NULL || object->type == JSONUnknown || object->elements == NULL)
+   {
+      if (writer_element(writer, key))
+      {
+         return 1;
+      }
+      return writer_write(writer, "{}", 2);
+   }
+
+   array = object->type == JSONArray;
+
+   if (writer_begin(writer, key, array))
+   {
+      return 1;
+   }
+
+   if (pgexporter_json_iterator_create(object, &iter))
+   {
+      return 1;
+   }
+
+   while (pgexporter_json_iterator_next(iter))
+   {
+      if (pgexporter_json_writer_value(writer, array ? NULL : iter->key, iter->value->data, iter->value->type))
+      {
+         pgexporter_json_iterator_destroy(iter);
+         return 1;
+      }
+   }
+
+   pgexporter_json_iterator_destroy(iter);
+
+   return writer_end(writer, array);
+}
+
+int
+pgexporter_json_writer_flush(struct json_writer* writer)
+{
+   if (writer == NULL || writer->error)
+   {
+      return 1;
+   }
+
+   if (writer->length > 0)
+   {
+      if (writer->sink(writer->arg, writer->buffer, writer->length))
+      {
+         writer->error = true;
+         return 1;
+      }
+      writer->length = 0;
+   }
+
+   return 0;
+}
+
+int
+pgexporter_json_sink_builder(void* arg, char* data, size_t length)
+{
+   return pgexporter_builder_append_length((struct builder*)arg, data, length);
+}
+
+int
+pgexporter_json_sink_file(void* arg, char* data, size_t length)
+{
+   return fwrite(data, 1, length, (FILE*)arg) != length;
+}
+
+int
+pgexporter_json_sink_socket(void* arg, char* data, size_t length)
+{
+   struct json_socket* s = (struct json_socket*)arg;
+   struct message msg;
+
+   memset(&msg, 0, sizeof(struct message));
+
+   msg.kind = 0;
+   msg.length = length;
+   msg.data = data;
+
+   return pgexporter_write_message(s->ssl, s->socket, &msg) != MESSAGE_STATUS_OK;
+}
+
+static int
+json_add(struct json* obj, char* key, uintptr_t val, enum value_type type)
+{
+   if (obj == NULL)
+   {
+      return 1;
+   }
+   if (key == NULL)
+   {
+      return pgexporter_json_append(obj, val, type);
+   }
+   return pgexporter_json_put(obj, key, val, type);
+}
+
+static int
+read_file(char* path, struct builder* str)
+{
+   FILE* file = NULL;
+   char buf[DEFAULT_BUFFER_SIZE];
+   size_t n;
+
+   if (path == NULL)
+   {
+      goto error;
+   }
+
+   file = fopen(path, "r");
+
+   if (file == NULL)
+   {
+      pgexporter_log_error("Failed to open json file %s", path);
+      goto error;
+   }
+
+   while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+   {
+      pgexporter_builder_append_length(str, buf, n);
+   }
+
+   fclose(file);
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+static int
+writer_write(struct json_writer* writer, char* data, size_t length)
+{
+   if (writer->error)
+   {
+      return 1;
+   }
+
+   if (writer->length + length > sizeof(writer->buffer))
+   {
+      if (pgexporter_json_writer_flush(writer))
+      {
+         return 1;
+      }
+
+      // Large strings bypass the buffer
+      if (length > sizeof(writer->buffer))
+      {
+         if (writer->sink(writer->arg, data, length))
+         {
+            writer->error = true;
+            return 1;
+         }
+         return 0;
+      }
+   }
+
+   memcpy(writer->buffer + writer->length, data, length);
+   writer->length += length;
+
+   return 0;
+}
+
+static int
+writer_indent(struct json_writer* writer, int depth)
+{
+   static char spaces[] = "                                ";
+   size_t indent = (size_t)depth * INDENT_PER_LEVEL;
+   size_t n = 0;
+
+   if (writer_write(writer, "\n", 1))
+   {
+      return 1;
+   }
+
+   while (indent > 0)
+   {
+      n = MIN(indent, sizeof(spaces) - 1);
+      if (writer_write(writer, spaces, n))
+      {
+         return 1;
+      }
+      indent -= n;
+   }
+
+   return 0;
+}
+
+static int
+writer_string(struct json_writer* writer, char* str)
+{
+   char esc[7];
+   char* start = str;
+   char* p = str;
+
+   if (writer_write(writer, "\"", 1))
+   {
+      return 1;
+   }
+
+   // The runs without characters to escape are written at once
+   for (; *p != '\0'; p++)
+   {
+      unsigned char c = (unsigned char)*p;
+
+      if (c != '"' && c != '\\' && c >= 0x20)
+      {
+         continue;
+      }
+
+      if (writer_write(writer, start, p - start))
+      {
+         return 1;
+      }
+
+      switch (c)
+      {
+         case '"':
+         case '\\':
+            esc[0] = '\\';
+            esc[1] = c;
+            esc[2] = '\0';
+            break;
+         case '\n':
+            memcpy(esc, "\\n", 3);
+            break;
+         case '\t':
+            memcpy(esc, "\\t", 3);
+            break;
+         case '\r':
+            memcpy(esc, "\\r", 3);
+            break;
+         default:
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            break;
+      }
+
+      if (writer_write(writer, esc, strlen(esc)))
+      {
+         return 1;
+      }
+
+      start = p + 1;
+   }
+
+   if (writer_write(writer, start, p - start))
+   {
+      return 1;
+   }
+
+   return writer_write(writer, "\"", 1);
+}
+
+static int
+writer_element(struct json_writer* writer, char* key)
+{
+   if (writer == NULL || writer->error)
+   {
+      return 1;
+   }
+
+   if (writer->depth > 0)
+   {
+      if (!writer->first[writer->depth - 1] && writer_write(writer, ",", 1))
+      {
+         return 1;
+      }
+      writer->first[writer->depth - 1] = false;
+
+      if (writer->format == FORMAT_JSON && writer_indent(writer, writer->depth))
+      {
+         return 1;
+      }
+
+      // The members of an object have a key, the elements of an array don't
+      if (writer->array[writer->depth - 1] != (key == NULL))
+      {
+         return 1;
+      }
+   }
+
+   if (key != NULL)
+   {
+      if (writer_string(writer, key))
+      {
+         return 1;
+      }
+      if (writer_write(writer, ": ", writer->format == FORMAT_JSON ? 2 : 1))
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+static int
+writer_begin(struct json_writer* writer, char* key, bool array)
+{
+   if (writer_element(writer, key))
+   {
+      return 1;
+   }
+
+   if (writer->depth == JSON_MAX_DEPTH)
+   {
+      return 1;
+   }
+
+   writer->first[writer->depth] = true;
+   writer->array[writer->depth] = array;
+   writer->depth++;
+
+   return writer_write(writer, array ? "[" : "{", 1);
+}
+
+static int
+writer_end(struct json_writer* writer, bool array)
+{
+   if (writer == NULL || writer->depth == 0 || writer->array[writer->depth - 1] != array)
+   {
+      return 1;
+   }
+
+   writer->depth--;
+
+   if (!writer->first[writer->depth] && writer->format == FORMAT_JSON && writer_indent(writer, writer->depth))
+   {
+      return 1;
+   }
+
+   return writer_write(writer, array ? "]" : "}", 1);
+}
+
+static void
+sax_skip(struct sax* sax)
+{
+   while (sax->index < sax->length && isspace((unsigned char)sax->str[sax->index]))
+   {
+      sax->index++;
+   }
+}
+
+static int
+sax_value(struct sax* sax, char* key)
+{
+   char* str = NULL;
+   struct json_handler* h = sax->handler;
+
+   sax_skip(sax);
+
+   if (sax->index == sax->length)
+   {
+      return 1;
+   }
+
+   switch (sax->str[sax->index])
+   {
+      case '{':
+         return sax_container(sax, key, false);
+      case '[':
+         return sax_container(sax, key, true);
+      case '"':
+         if (sax_string(sax, &str))
+         {
+            return 1;
+         }
+         return h->value != NULL ? h->value(h->arg, key, (uintptr_t)str, ValueString) : 0;
+      case 't':
+      case 'f':
+      case 'n':
+         return sax_literal(sax, key);
+      default:
+         return sax_number(sax, key);
+   }
+}
+
+static int
+sax_container(struct sax* sax, char* key, bool array)
+{
+   char close = array ? ']' : '}';
+   char* k = NULL;
+   struct json_handler* h = sax->handler;
+   int (*begin)(void* arg, char* key) = array ? h->begin_array : h->begin_object;
+   int (*end)(void* arg) = array ? h->end_array : h->end_object;
+
+   // The nesting is bounded, since the parser recurses for each level
+   if (sax->depth == JSON_MAX_DEPTH)
+   {
+      return 1;
+   }
+
+   if (begin != NULL && begin(h->arg, key))
+   {
+      return 1;
+   }
+
+   sax->depth++;
+   sax->index++;
+   sax_skip(sax);
+
+   if (sax->index < sax->length && sax->str[sax->index] == close)
+   {
+      sax->index++;
+      sax->depth--;
+      return end != NULL ? end(h->arg) : 0;
+   }
+
+   while (sax->index < sax->length)
+   {
+      if (!array)
+      {
+         sax_skip(sax);
+         if (sax->index == sax->length || sax->str[sax->index] != '"' || sax_string(sax, &k) || k[0] == '\0')
+         {
+            return 1;
+         }
+
+         sax_skip(sax);
+         if (sax->index == sax->length || sax->str[sax->index] != ':')
+         {
+            return 1;
+         }
+         sax->index++;
+      }
+
+      if (sax_value(sax, k))
+      {
+         return 1;
+      }
+
+      sax_skip(sax);
+      if (sax->index == sax->length)
+      {
+         return 1;
+      }
+
+      if (sax->str[sax->index] == ',')
+      {
+         sax->index++;
+      }
+      else if (sax->str[sax->index] == close)
+      {
+         sax->index++;
+         sax->depth--;
+         return end != NULL ? end(h->arg) : 0;
+      }
+      else
+      {
+         return 1;
+      }
+   }
+
+   return 1;
+}
+
+static int
+sax_string(struct sax* sax, char** str)
+{
+   char* out = NULL;
+
+   // The unescaped string is never longer than the escaped one, so it is written over it
+   sax->index++;
+   *str = out = sax->str + sax->index;
+
+   while (sax->index < sax->length && sax->str[sax->index] != '"')
+   {
+      if (sax->str[sax->index] == '\\')
+      {
+         if (sax_escape(sax, &out))
+         {
+            return 1;
+         }
+         continue;
+      }
+
+      *out++ = sax->str[sax->index++];
+   }
+
+   if (sax->index == sax->length)
+   {
+      return 1;
+   }
+
+   *out = '\0';
+   sax->index++;
+
+   return 0;
+}
+
+static int
+sax_escape(struct sax* sax, char** out)
+{
+   uint32_t cp = 0;
+   uint32_t low = 0;
+   char* o = *out;
+
+   sax->index++;
+   if (sax->index == sax->length)
+   {
+      return 1;
+   }
+
+   switch (sax->str[sax->index++])
+   {
+      case '"':
+         *o++ = '"';
+         break;
+      case '\\':
+         *o++ = '\\';
+         break;
+      case '/':
+         *o++ = '/';
+         break;
+      case 'b':
+         *o++ = '\b';
+         break;
+      case 'f':
+         *o++ = '\f';
+         break;
+      case 'n':
+         *o++ = '\n';
+         break;
+      case 't':
+         *o++ = '\t';
+         break;
+      case 'r':
+         *o++ = '\r';
+         break;
+      case 'u':
+         if (sax_hex(sax, &cp))
+         {
+            return 1;
+         }
+         if (cp >= 0xD800 && cp <= 0xDBFF)
+         {
+            if (sax->index + 1 >= sax->length || sax->str[sax->index] != '\\' || sax->str[sax->index + 1] != 'u')
+            {
+               return 1;
+            }
+            sax->index += 2;
+            if (sax_hex(sax, &low) || low < 0xDC00 || low > 0xDFFF)
+            {
+               return 1;
+            }
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+         }
+
+         if (cp < 0x80)
+         {
+            *o++ = (char)cp;
+         }
+         else if (cp < 0x800)
+         {
+            *o++ = (char)(0xC0 | (cp >> 6));
+            *o++ = (char)(0x80 | (cp & 0x3F));
+         }
+         else if (cp < 0x10000)
+         {
+            *o++ = (char)(0xE0 | (cp >> 12));
+            *o++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+            *o++ = (char)(0x80 | (cp & 0x3F));
+         }
+         else
+         {
+            *o++ = (char)(0xF0 | (cp >> 18));
+            *o++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+            *o++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+            *o++ = (char)(0x80 | (cp & 0x3F));
+         }
+         break;
+      default:
+         return 1;
+   }
+
+   *out = o;
+
+   return 0;
+}
+
+static int
+sax_hex(struct sax* sax, uint32_t* cp)
+{
+   uint32_t v = 0;
+
+   if (sax->index + 4 > sax->length)
+   {
+      return 1;
+   }
+
+   for (int i = 0; i < 4; i++)
+   {
+      char c = sax->str[sax->index++];
+
+      v <<= 4;
+      if (c >= '0' && c <= '9')
+      {
+         v |= c - '0';
+      }
+      else if (c >= 'a' && c <= 'f')
+      {
+         v |= c - 'a' + 10;
+      }
+      else if (c >= 'A' && c <= 'F')
+      {
+         v |= c - 'A' + 10;
+      }
+      else
+      {
+         return 1;
+      }
+   }
+
+   *cp = v;
+
+   return 0;
+}
+
+static int
+sax_number(struct sax* sax, char* key)
+{
+   bool is_double = false;
+   char buf[MISC_LENGTH];
+   char* end = NULL;
+   size_t n = 0;
+   struct json_handler* h = sax->handler;
+
+   // The number is copied out, since the buffer isn't terminated after it
+   while (sax->index < sax->length && n < sizeof(buf) - 1)
+   {
+      char c = sax->str[sax->index];
+
+      if (c == '.' || c == 'e' || c == 'E')
+      {
+         is_double = true;
+      }
+      else if (!isdigit((unsigned char)c) && c != '-' && c != '+')
+      {
+         break;
+      }
+
+      buf[n++] = c;
+      sax->index++;
+   }
+   buf[n] = '\0';
+
+   if (n == 0 || n == sizeof(buf) - 1)
+   {
+      return 1;
+   }
+
+   errno = 0;
+   if (is_double)
+   {
+      double d = strtod(buf, &end);
+
+      if (*end != '\0' || errno != 0)
+      {
+         errno = 0;
+         return 1;
+      }
+      return h->value != NULL ? h->value(h->arg, key, pgexporter_value_from_double(d), ValueDouble) : 0;
+   }
+   else
+   {
+      int64_t l = strtoll(buf, &end, 10);
+
+      if (*end != '\0' || errno != 0)
+      {
+         errno = 0;
+         return 1;
+      }
+      return h->value != NULL ? h->value(h->arg, key, (uintptr_t)l, ValueInt64) : 0;
+   }
+}
+
+static int
+sax_literal(struct sax* sax, char* key)
+{
+   size_t left = sax->length - sax->index;
+   char* s = sax->str + sax->index;
+   struct json_handler* h = sax->handler;
+
+   if (left >= 4 && !strncmp(s, "true", 4))
+   {
+      sax->index += 4;
+      return h->value != NULL ? h->value(h->arg, key, true, ValueBool) : 0;
+   }
+   else if (left >= 5 && !strncmp(s, "false", 5))
+   {
+      sax->index += 5;
+      return h->value != NULL ? h->value(h->arg, key, false, ValueBool) : 0;
+   }
+   else if (left >= 4 && !strncmp(s, "null", 4))
+   {
+      sax->index += 4;
+      return h->value != NULL ? h->value(h->arg, key, 0, ValueString) : 0;
+   }
+
+   return 1;
+}
+
+static int
+tree_begin(void* arg, char* key)
+{
+   struct json_tree* tree = (struct json_tree*)arg;
+   struct json* o = NULL;
+   struct json** stack = NULL;
+
+   if (tree->top == 0 && tree->root != NULL)
+   {
+      return 1;
+   }
+
+   if (tree->top == tree->capacity)
+   {
+      stack = pgexporter_memory_realloc(MEMORY_JSON, tree->stack, (tree->capacity + 16) * sizeof(struct json*));
+      if (stack == NULL)
+      {
+         return 1;
+      }
+      tree->stack = stack;
+      tree->capacity += 16;
+   }
+
+   pgexporter_json_create(&o);
+
+   // The container is owned by its parent as soon as it starts, so an error only destroys the root
+   if (tree->top == 0)
+   {
+      tree->root = o;
+   }
+   else if (json_add(tree->stack[tree->top - 1], key, (uintptr_t)o, ValueJSON))
+   {
+      pgexporter_json_destroy(o);
+      return 1;
+   }
+
+   tree->stack[tree->top++] = o;
+
+   return 0;
+}
+
+static int
+tree_end(void* arg)
+{
+   struct json_tree* tree = (struct json_tree*)arg;
+
+   tree->top--;
+
+   return 0;
+}
+
+static int
+tree_value(void* arg, char* key, uintptr_t data, enum value_type type)
+{
+   struct json_tree* tree = (struct json_tree*)arg;
+
+   return json_add(tree->stack[tree->top - 1], key, data, type);
+}
+
 static bool
 type_allowed(enum value_type type)
 {
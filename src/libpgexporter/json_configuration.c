@@ -28,6 +28,7 @@
 
 /* pgexporter */
 #include <pgexporter.h>
+#include <catalog.h>
 #include <internal.h>
 #include <logging.h>
 #include <query_alts.h>
@@ -70,6 +71,14 @@ typedef struct json_metric
    char* sort;
    char* collector;
    char* server;
+   int interval;
+   int refresh_interval;
+   int timeout;
+   int max_series;
+   int top_k;
+   bool other;
+   bool incremental;
+   char* database;
 } __attribute__ ((aligned (64))) json_metric_t;
 
 // Config's Structure
@@ -101,11 +110,11 @@ static void free_json_metrics(json_metric_t** metrics, size_t n_metrics);
 // Free allocated memory for JSON config
 static void free_json_config(json_config_t* config);
 
-// Extract the meaning of the `json_config` and load the metrics into `prometheus`
-static int semantics_json(struct prometheus* prometheus, int prometheus_idx, json_config_t* json_config);
+// Extract the meaning of the `json_config` and load the metrics into the catalog of `config`
+static int semantics_json(struct configuration* config, int prometheus_idx, json_config_t* json_config);
 
-// Read and parse a single JSON file into the prometheus metrics structure
-int pgexporter_read_json(struct prometheus* prometheus, int prometheus_idx, char* filename, int* number_of_metrics);
+// Read and parse a single JSON file into the catalog of `config`
+int pgexporter_read_json(struct configuration* config, int prometheus_idx, char* filename, int* number_of_metrics);
 
 // Get all JSON files from a directory
 int get_json_files(char* base, int* number_of_json_files, char*** files);
@@ -129,7 +138,7 @@ pgexporter_read_json_metrics_configuration(void* shmem)
    if (pgexporter_is_file(config->metrics_path))
    {
       number_of_metrics = 0;
-      if (pgexporter_read_json(config->prometheus, idx_metrics, config->metrics_path, &number_of_metrics))
+      if (pgexporter_read_json(config, idx_metrics, config->metrics_path, &number_of_metrics))
       {
          pgexporter_log_error("pgexporter_read_json_metrics_configuration error JSON metrics file: %s", config->metrics_path);
          return 1;
@@ -149,7 +158,7 @@ pgexporter_read_json_metrics_configuration(void* shmem)
                                         json_files[i]
                                         );
 
-         if (pgexporter_read_json(config->prometheus, idx_metrics, json_path, &number_of_metrics))
+         if (pgexporter_read_json(config, idx_metrics, json_path, &number_of_metrics))
          {
             free(json_path);
             json_path = NULL;
@@ -178,7 +187,7 @@ pgexporter_read_json_metrics_configuration(void* shmem)
 }
 
 int
-pgexporter_read_json(struct prometheus* prometheus, int prometheus_idx, char* filename, int* number_of_metrics)
+pgexporter_read_json(struct configuration* config, int prometheus_idx, char* filename, int* number_of_metrics)
 {
    struct json* root = NULL;
    json_config_t json_config;
@@ -215,7 +224,7 @@ pgexporter_read_json(struct prometheus* prometheus, int prometheus_idx, char* fi
 
    *number_of_metrics += json_config.n_metrics;
 
-   ret = semantics_json(prometheus, prometheus_idx, &json_config);
+   ret = semantics_json(config, prometheus_idx, &json_config);
 
    pgexporter_json_destroy(root);
    free_json_config(&json_config);
@@ -386,6 +395,46 @@ parse_metrics(struct json* metrics_array, json_config_t* config)
          current_metric->server = strdup("both");     // default
       }
 
+      if (pgexporter_json_contains_key(metric, "interval"))
+      {
+         current_metric->interval = (int)pgexporter_json_get(metric, "interval");
+      }
+
+      if (pgexporter_json_contains_key(metric, "refresh_interval"))
+      {
+         current_metric->refresh_interval = (int)pgexporter_json_get(metric, "refresh_interval");
+      }
+
+      if (pgexporter_json_contains_key(metric, "timeout"))
+      {
+         current_metric->timeout = (int)pgexporter_json_get(metric, "timeout");
+      }
+
+      if (pgexporter_json_contains_key(metric, "max_series"))
+      {
+         current_metric->max_series = (int)pgexporter_json_get(metric, "max_series");
+      }
+
+      if (pgexporter_json_contains_key(metric, "top_k"))
+      {
+         current_metric->top_k = (int)pgexporter_json_get(metric, "top_k");
+      }
+
+      if (pgexporter_json_contains_key(metric, "other"))
+      {
+         current_metric->other = (bool)pgexporter_json_get(metric, "other");
+      }
+
+      if (pgexporter_json_contains_key(metric, "incremental"))
+      {
+         current_metric->incremental = (bool)pgexporter_json_get(metric, "incremental");
+      }
+
+      if (pgexporter_json_contains_key(metric, "database"))
+      {
+         current_metric->database = strdup((char*)pgexporter_json_get(metric, "database"));
+      }
+
       if (pgexporter_json_contains_key(metric, "queries"))
       {
          struct json* queries = (struct json*)pgexporter_json_get(metric, "queries");
@@ -524,6 +573,10 @@ free_json_metrics(json_metric_t** metrics, size_t n_metrics)
       {
          free((*metrics)[i].server);
       }
+      if ((*metrics)[i].database)
+      {
+         free((*metrics)[i].database);
+      }
       if ((*metrics)[i].queries)
       {
          free_json_queries(&(*metrics)[i].queries, (*metrics)[i].n_queries);
@@ -544,18 +597,12 @@ free_json_config(json_config_t* config)
 }
 
 static int
-semantics_json(struct prometheus* prometheus, int prometheus_idx, json_config_t* json_config)
+semantics_json(struct configuration* config, int prometheus_idx, json_config_t* json_config)
 {
    struct prometheus* prom = NULL;
 
    for (int i = 0; i < json_config->n_metrics; i++)
    {
-      if (prometheus_idx + i >= NUMBER_OF_METRICS)
-      {
-         pgexporter_log_error("The number of metrics exceed the maximum limit of %d.", NUMBER_OF_METRICS);
-         return 1;
-      }
-
       if (json_config->metrics[i].tag == NULL)
       {
          pgexporter_log_error("No tag defined for '%s' (%d)",
@@ -572,10 +619,52 @@ semantics_json(struct prometheus* prometheus, int prometheus_idx, json_config_t*
          return 1;
       }
 
-      prom = &prometheus[prometheus_idx + i];
+      prom = pgexporter_catalog_metric(config, prometheus_idx + i);
+      if (prom == NULL)
+      {
+         pgexporter_log_error("Unable to allocate the metric '%s'", json_config->metrics[i].tag);
+         return 1;
+      }
 
       memcpy(prom->tag, json_config->metrics[i].tag, MIN(MISC_LENGTH - 1, strlen(json_config->metrics[i].tag)));
-      memcpy(prom->collector, json_config->metrics[i].collector, MIN(MAX_COLLECTOR_LENGTH - 1, strlen(json_config->metrics[i].collector)));
+      prom->collector = pgexporter_catalog_strdup(config, json_config->metrics[i].collector);
+      prom->databases = pgexporter_catalog_strdup(config, json_config->metrics[i].database);
+
+      // Interval
+      if (json_config->metrics[i].interval < 0)
+      {
+         pgexporter_log_error("pgexporter: unexpected interval %d", json_config->metrics[i].interval);
+         return 1;
+      }
+      prom->interval = json_config->metrics[i].interval;
+
+      // Refresh interval
+      if (json_config->metrics[i].refresh_interval < 0)
+      {
+         pgexporter_log_error("pgexporter: unexpected refresh_interval %d", json_config->metrics[i].refresh_interval);
+         return 1;
+      }
+      prom->refresh_interval = json_config->metrics[i].refresh_interval;
+
+      // Timeout
+      if (json_config->metrics[i].timeout < 0)
+      {
+         pgexporter_log_error("pgexporter: unexpected timeout %d", json_config->metrics[i].timeout);
+         return 1;
+      }
+      prom->timeout = json_config->metrics[i].timeout;
+
+      // Series limit
+      if (json_config->metrics[i].max_series < 0 || json_config->metrics[i].top_k < 0)
+      {
+         pgexporter_log_error("pgexporter: unexpected max_series %d or top_k %d",
+                              json_config->metrics[i].max_series, json_config->metrics[i].top_k);
+         return 1;
+      }
+      prom->max_series = json_config->metrics[i].max_series;
+      prom->top_k = json_config->metrics[i].top_k;
+      prom->other = json_config->metrics[i].other;
+      prom->incremental = json_config->metrics[i].incremental;
 
       // Sort Type
       if (!json_config->metrics[i].sort || !strcmp(json_config->metrics[i].sort, "name"))
@@ -605,6 +694,10 @@ semantics_json(struct prometheus* prometheus, int prometheus_idx, json_config_t*
       {
          prom->server_query_type = SERVER_QUERY_REPLICA;
       }
+      else if (!strcmp(json_config->metrics[i].server, "any_replica"))
+      {
+         prom->server_query_type = SERVER_QUERY_ANY_REPLICA;
+      }
       else
       {
          pgexporter_log_error("pgexporter: unexpected server %s", json_config->metrics[i].server);
@@ -614,63 +707,86 @@ semantics_json(struct prometheus* prometheus, int prometheus_idx, json_config_t*
       // Queries
       for (int j = 0; j < json_config->metrics[i].n_queries; j++)
       {
+         int n_columns;
+         int type;
+         bool is_histogram = false;
+         size_t node;
+         size_t columns;
+         size_t names;
+         size_t query;
          struct query_alts* new_query = NULL;
-         void* new_query_shmem = NULL;
+         struct column* column = NULL;
 
-         pgexporter_create_shared_memory(sizeof(struct query_alts), HUGEPAGE_OFF, &new_query_shmem);
-         new_query = (struct query_alts*) new_query_shmem;
+         n_columns = MIN(json_config->metrics[i].queries[j].n_columns, MAX_NUMBER_OF_COLUMNS);
 
-         new_query->n_columns = MIN(json_config->metrics[i].queries[j].n_columns, MAX_NUMBER_OF_COLUMNS);
+         // The pool moves as it grows, so the node is filled in at the end
+         node = pgexporter_catalog_alloc(config, sizeof(struct query_alts));
+         columns = pgexporter_catalog_alloc(config, n_columns * sizeof(struct column));
+         names = pgexporter_catalog_alloc(config, n_columns * sizeof(char*));
+         query = pgexporter_catalog_strdup(config, json_config->metrics[i].queries[j].query);
 
-         memcpy(new_query->query, json_config->metrics[i].queries[j].query, MIN(MAX_QUERY_LENGTH - 1, strlen(json_config->metrics[i].queries[j].query)));
-         new_query->version = json_config->metrics[i].queries[j].version;
+         if (node == 0 || columns == 0 || names == 0)
+         {
+            pgexporter_log_error("Unable to allocate the queries of the metric '%s'", json_config->metrics[i].tag);
+            return 1;
+         }
 
          // Columns
-         for (int k = 0; k < new_query->n_columns; k++)
+         for (int k = 0; k < n_columns; k++)
          {
+            size_t name;
+            size_t description;
+
             // Name
-            if (json_config->metrics[i].queries[j].columns[k].name)
-            {
-               memcpy(new_query->columns[k].name, json_config->metrics[i].queries[j].columns[k].name, MIN(MISC_LENGTH - 1, strlen(json_config->metrics[i].queries[j].columns[k].name)));
-            }
+            name = pgexporter_catalog_strdup(config, json_config->metrics[i].queries[j].columns[k].name);
 
             // Description
-            if (json_config->metrics[i].queries[j].columns[k].description)
-            {
-               memcpy(new_query->columns[k].description, json_config->metrics[i].queries[j].columns[k].description, MIN(MISC_LENGTH - 1, strlen(json_config->metrics[i].queries[j].columns[k].description)));
-            }
+            description = pgexporter_catalog_strdup(config, json_config->metrics[i].queries[j].columns[k].description);
 
             // Type
             if (!strcmp(json_config->metrics[i].queries[j].columns[k].type, "label"))
             {
-               new_query->columns[k].type = LABEL_TYPE;
+               type = LABEL_TYPE;
             }
             else if (!strcmp(json_config->metrics[i].queries[j].columns[k].type, "counter"))
             {
-               new_query->columns[k].type = COUNTER_TYPE;
+               type = COUNTER_TYPE;
             }
             else if (!strcmp(json_config->metrics[i].queries[j].columns[k].type, "gauge"))
             {
-               new_query->columns[k].type = GAUGE_TYPE;
+               type = GAUGE_TYPE;
             }
             else if (!strcmp(json_config->metrics[i].queries[j].columns[k].type, "histogram"))
             {
-               new_query->columns[k].type = HISTOGRAM_TYPE;
-               new_query->is_histogram = true;
+               type = HISTOGRAM_TYPE;
+               is_histogram = true;
             }
             else
             {
                pgexporter_log_error("pgexporter: unexpected type %s", json_config->metrics[i].queries[j].columns[k].type);
                return 1;
             }
+
+            column = (struct column*)(pgexporter_catalog_pool(config) + columns) + k;
+            column->type = type;
+            column->name = name;
+            column->description = description;
          }
 
+         new_query = (struct query_alts*)(pgexporter_catalog_pool(config) + node);
+         new_query->n_columns = n_columns;
+         new_query->columns = columns;
+         new_query->names = names;
+         new_query->query = query;
+         new_query->is_histogram = is_histogram;
+         new_query->version = json_config->metrics[i].queries[j].version;
+
          if (json_config->metrics[i].queries[j].version == 0)
          {
             new_query->version = json_config->default_version;
          }
 
-         prom->root = pgexporter_insert_node_avl(prom->root, &new_query);
+         prom->root = pgexporter_insert_node_avl(pgexporter_catalog_pool(config), prom->root, node);
       }
    }
 
@@ -30,9 +30,13 @@
 #include <pgexporter.h>
 #include <logging.h>
 #include <prometheus.h>
+#include <shmem.h>
 
 /* system */
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,6 +48,42 @@
 
 #define LINE_LENGTH 32
 
+#define LOG_RINGS         64
+#define LOG_RING_SIZE     32768
+#define LOG_RECORD_SIZE   4096
+#define LOG_DROP_INTERVAL 10
+
+/** @struct log_ring
+ * Defines a ring of log records, written by one thread and drained by the log writer
+ */
+struct log_ring
+{
+   atomic_int pid;                                        /**< The owning process, 0 if free */
+   atomic_bool released;                                  /**< Has the owning thread exited */
+   atomic_uint_fast64_t dropped;                          /**< The number of records dropped since the last drain */
+   atomic_uint_fast64_t head __attribute__ ((aligned(64))); /**< The write position */
+   atomic_uint_fast64_t tail __attribute__ ((aligned(64))); /**< The read position */
+   char data[LOG_RING_SIZE] __attribute__ ((aligned(64)));  /**< The records */
+};
+
+/** @struct log_buffer
+ * Defines the shared memory of the asynchronous logging
+ */
+struct log_buffer
+{
+   atomic_bool active;                /**< Is the log writer running */
+   struct log_ring rings[LOG_RINGS];  /**< The rings */
+};
+
+/** @struct log_record
+ * Defines the header of a record in a ring
+ */
+struct log_record
+{
+   uint32_t length; /**< The length of the line */
+   int32_t level;   /**< The level */
+};
+
 FILE* log_file;
 
 time_t next_log_rotation_age;  /* number of seconds at which the next location will happen */
@@ -70,6 +110,31 @@ static const char* colors[] =
    "\x1b[35m"
 };
 
+static pid_t writer_pid = 0;
+static pthread_t writer;
+static atomic_bool writer_running = false;
+static uint64_t writer_dropped = 0;
+static time_t writer_reported = 0;
+
+static __thread struct log_ring* thread_ring = NULL;
+static __thread pid_t thread_pid = 0;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+static void log_lock(struct configuration* config);
+static void log_unlock(struct configuration* config);
+static int log_priority(int level);
+static int log_header(struct configuration* config, int level, char* filename, int line, char* buf, size_t size);
+static void log_output(struct configuration* config, int level, char* str, size_t length);
+static struct log_ring* log_ring_claim(void);
+static void log_ring_key(void);
+static void log_ring_release(void* r);
+static void log_ring_copy(struct log_ring* ring, uint64_t position, void* data, size_t length, bool write);
+static int log_enqueue(struct configuration* config, int level, char* filename, int line, char* fmt, va_list vl);
+static int log_drain(void);
+static void* log_writer(void* arg);
+static void log_writer_exit(void);
+
 bool
 log_rotation_enabled(void)
 {
@@ -199,7 +264,10 @@ pgexporter_start_logging(void)
 
    if (config->log_type == PGEXPORTER_LOGGING_TYPE_FILE && !log_file)
    {
+      // The log writer may be writing to the file
+      log_lock(config);
       log_file_open();
+      log_unlock(config);
 
       if (!log_file)
       {
@@ -287,10 +355,12 @@ pgexporter_stop_logging(void)
    {
       if (log_file != NULL)
       {
+         log_lock(config);
          int ret = fclose(log_file);
          if(ret == 0) {
             log_file = NULL;
          }
+         log_unlock(config);
          return ret;
       }
       else
@@ -306,11 +376,92 @@ pgexporter_stop_logging(void)
    return 0;
 }
 
+int
+pgexporter_start_log_writer(void)
+{
+   struct log_buffer* buffer = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (!config->log_async || log_shmem != NULL)
+   {
+      return 0;
+   }
+
+   if (pgexporter_create_shared_memory(sizeof(struct log_buffer), config->hugepage, &log_shmem))
+   {
+      goto error;
+   }
+
+   pgexporter_numa_shared_memory(log_shmem, sizeof(struct log_buffer), config->numa);
+
+   buffer = (struct log_buffer*)log_shmem;
+
+   for (int i = 0; i < LOG_RINGS; i++)
+   {
+      atomic_init(&buffer->rings[i].pid, 0);
+      atomic_init(&buffer->rings[i].released, false);
+      atomic_init(&buffer->rings[i].dropped, 0);
+      atomic_init(&buffer->rings[i].head, 0);
+      atomic_init(&buffer->rings[i].tail, 0);
+   }
+
+   writer_pid = getpid();
+   atomic_store(&writer_running, true);
+
+   if (pthread_create(&writer, NULL, log_writer, NULL))
+   {
+      atomic_store(&writer_running, false);
+      goto error;
+   }
+
+   atomic_store(&buffer->active, true);
+
+   // The last lines are written if the process exits without stopping the writer
+   atexit(log_writer_exit);
+
+   return 0;
+
+error:
+
+   if (log_shmem != NULL)
+   {
+      pgexporter_destroy_shared_memory(log_shmem, sizeof(struct log_buffer));
+      log_shmem = NULL;
+   }
+   writer_pid = 0;
+
+   return 1;
+}
+
+void
+pgexporter_stop_log_writer(void)
+{
+   struct log_buffer* buffer = (struct log_buffer*)log_shmem;
+
+   if (buffer == NULL || writer_pid != getpid())
+   {
+      return;
+   }
+
+   // The processes log synchronously from now on, and the writer drains the rest before it exits
+   atomic_store(&buffer->active, false);
+   atomic_store(&writer_running, false);
+   pthread_join(writer, NULL);
+
+   log_shmem = NULL;
+   writer_pid = 0;
+   pgexporter_destroy_shared_memory(buffer, sizeof(struct log_buffer));
+}
+
 void
 pgexporter_log_line(int level, char* file, int line, char* fmt, ...)
 {
-   signed char isfree;
    struct configuration* config;
+   va_list vl;
+   char buf[256];
+   char* filename;
 
    config = (struct configuration*)shmem;
 
@@ -339,102 +490,72 @@ pgexporter_log_line(int level, char* file, int line, char* fmt, ...)
             break;
       }
 
-retry:
-      isfree = STATE_FREE;
-
-      if (atomic_compare_exchange_strong(&config->log_lock, &isfree, STATE_IN_USE))
+      filename = strrchr(file, '/');
+      if (filename != NULL)
+      {
+         filename = filename + 1;
+      }
+      else
       {
-         char buf[256];
-         va_list vl;
-         struct tm* tm;
-         time_t t;
-         char* filename;
+         filename = file;
+      }
 
-         t = time(NULL);
-         tm = localtime(&t);
+      if (strlen(config->log_line_prefix) == 0)
+      {
+         memcpy(config->log_line_prefix, PGEXPORTER_LOGGING_DEFAULT_LOG_LINE_PREFIX, strlen(PGEXPORTER_LOGGING_DEFAULT_LOG_LINE_PREFIX));
+      }
 
-         filename = strrchr(file, '/');
-         if (filename != NULL)
-         {
-            filename = filename + 1;
-         }
-         else
+      // A fatal line is written before the process goes away
+      if (level != PGEXPORTER_LOGGING_LEVEL_FATAL)
+      {
+         va_start(vl, fmt);
+         if (!log_enqueue(config, level, filename, line, fmt, vl))
          {
-            filename = file;
+            va_end(vl);
+            return;
          }
+         va_end(vl);
+      }
 
-         if (strlen(config->log_line_prefix) == 0)
-         {
-            memcpy(config->log_line_prefix, PGEXPORTER_LOGGING_DEFAULT_LOG_LINE_PREFIX, strlen(PGEXPORTER_LOGGING_DEFAULT_LOG_LINE_PREFIX));
-         }
+      log_lock(config);
 
-         va_start(vl, fmt);
+      va_start(vl, fmt);
 
-         if (config->log_type == PGEXPORTER_LOGGING_TYPE_CONSOLE)
-         {
-            buf[strftime(buf, sizeof(buf), config->log_line_prefix, tm)] = '\0';
-            fprintf(stdout, "%s %s%-5s\x1b[0m \x1b[90m%s:%d\x1b[0m ",
-                    buf, colors[level - 1], levels[level - 1],
-                    filename, line);
-            vfprintf(stdout, fmt, vl);
-            fprintf(stdout, "\n");
-            fflush(stdout);
-         }
-         else if (config->log_type == PGEXPORTER_LOGGING_TYPE_FILE)
-         {
-            buf[strftime(buf, sizeof(buf), config->log_line_prefix, tm)] = '\0';
-            fprintf(log_file, "%s %-5s %s:%d ",
-                    buf, levels[level - 1], filename, line);
-            vfprintf(log_file, fmt, vl);
-            fprintf(log_file, "\n");
-            fflush(log_file);
+      if (config->log_type == PGEXPORTER_LOGGING_TYPE_CONSOLE)
+      {
+         log_header(config, level, filename, line, buf, sizeof(buf));
+         fprintf(stdout, "%s", buf);
+         vfprintf(stdout, fmt, vl);
+         fprintf(stdout, "\n");
+         fflush(stdout);
+      }
+      else if (config->log_type == PGEXPORTER_LOGGING_TYPE_FILE && log_file != NULL)
+      {
+         log_header(config, level, filename, line, buf, sizeof(buf));
+         fprintf(log_file, "%s", buf);
+         vfprintf(log_file, fmt, vl);
+         fprintf(log_file, "\n");
+         fflush(log_file);
 
-            if (log_rotation_required())
-            {
-               log_file_rotate();
-            }
-         }
-         else if (config->log_type == PGEXPORTER_LOGGING_TYPE_SYSLOG)
+         if (log_rotation_required())
          {
-            switch (level)
-            {
-               case PGEXPORTER_LOGGING_LEVEL_DEBUG5:
-                  vsyslog(LOG_DEBUG, fmt, vl);
-                  break;
-               case PGEXPORTER_LOGGING_LEVEL_DEBUG1:
-                  vsyslog(LOG_DEBUG, fmt, vl);
-                  break;
-               case PGEXPORTER_LOGGING_LEVEL_INFO:
-                  vsyslog(LOG_INFO, fmt, vl);
-                  break;
-               case PGEXPORTER_LOGGING_LEVEL_WARN:
-                  vsyslog(LOG_WARNING, fmt, vl);
-                  break;
-               case PGEXPORTER_LOGGING_LEVEL_ERROR:
-                  vsyslog(LOG_ERR, fmt, vl);
-                  break;
-               case PGEXPORTER_LOGGING_LEVEL_FATAL:
-                  vsyslog(LOG_CRIT, fmt, vl);
-                  break;
-               default:
-                  vsyslog(LOG_INFO, fmt, vl);
-                  break;
-            }
+            log_file_rotate();
          }
+      }
+      else if (config->log_type == PGEXPORTER_LOGGING_TYPE_SYSLOG)
+      {
+         vsyslog(log_priority(level), fmt, vl);
+      }
 
-         va_end(vl);
+      va_end(vl);
 
-         atomic_store(&config->log_lock, STATE_FREE);
-      }
-      else
-        SLEEP_AND_GOTO(1000000L,retry)
+      log_unlock(config);
    }
 }
 
 void
 pgexporter_log_mem(void* data, size_t size)
 {
-   signed char isfree;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
@@ -448,10 +569,7 @@ pgexporter_log_mem(void* data, size_t size)
        size > 0 &&
        (config->log_type == PGEXPORTER_LOGGING_TYPE_CONSOLE || config->log_type == PGEXPORTER_LOGGING_TYPE_FILE))
    {
-retry:
-      isfree = STATE_FREE;
-
-      if (atomic_compare_exchange_strong(&config->log_lock, &isfree, STATE_IN_USE))
+      log_lock(config);
       {
          char buf[(3 * size) + (2 * ((size / LINE_LENGTH) + 1)) + 1 + 1];
          int j = 0;
@@ -503,17 +621,14 @@ retry:
             fprintf(stdout, "\n");
             fflush(stdout);
          }
-         else if (config->log_type == PGEXPORTER_LOGGING_TYPE_FILE)
+         else if (config->log_type == PGEXPORTER_LOGGING_TYPE_FILE && log_file != NULL)
          {
             fprintf(log_file, "%s", buf);
             fprintf(log_file, "\n");
             fflush(log_file);
          }
-
-         atomic_store(&config->log_lock, STATE_FREE);
       }
-      else
-        SLEEP_AND_GOTO(1000000L,retry)
+      log_unlock(config);
    }
 }
 
@@ -531,3 +646,349 @@ pgexporter_log_is_enabled(int level)
 
    return false;
 }
+
+static void
+log_lock(struct configuration* config)
+{
+   signed char isfree;
+
+retry:
+   isfree = STATE_FREE;
+
+   if (!atomic_compare_exchange_strong(&config->log_lock, &isfree, STATE_IN_USE))
+   {
+      SLEEP_AND_GOTO(1000000L, retry)
+   }
+}
+
+static void
+log_unlock(struct configuration* config)
+{
+   atomic_store(&config->log_lock, STATE_FREE);
+}
+
+static int
+log_priority(int level)
+{
+   switch (level)
+   {
+      case PGEXPORTER_LOGGING_LEVEL_DEBUG5:
+      case PGEXPORTER_LOGGING_LEVEL_DEBUG1:
+         return LOG_DEBUG;
+      case PGEXPORTER_LOGGING_LEVEL_INFO:
+         return LOG_INFO;
+      case PGEXPORTER_LOGGING_LEVEL_WARN:
+         return LOG_WARNING;
+      case PGEXPORTER_LOGGING_LEVEL_ERROR:
+         return LOG_ERR;
+      case PGEXPORTER_LOGGING_LEVEL_FATAL:
+         return LOG_CRIT;
+      default:
+         return LOG_INFO;
+   }
+}
+
+static int
+log_header(struct configuration* config, int level, char* filename, int line, char* buf, size_t size)
+{
+   char prefix[256];
+   struct tm tm;
+   time_t t;
+   int n = 0;
+
+   if (config->log_type == PGEXPORTER_LOGGING_TYPE_SYSLOG)
+   {
+      buf[0] = '\0';
+      return 0;
+   }
+
+   t = time(NULL);
+   localtime_r(&t, &tm);
+
+   prefix[strftime(prefix, sizeof(prefix), config->log_line_prefix, &tm)] = '\0';
+
+   if (config->log_type == PGEXPORTER_LOGGING_TYPE_CONSOLE)
+   {
+      n = snprintf(buf, size, "%s %s%-5s\x1b[0m \x1b[90m%s:%d\x1b[0m ",
+                   prefix, colors[level - 1], levels[level - 1],
+                   filename, line);
+   }
+   else
+   {
+      n = snprintf(buf, size, "%s %-5s %s:%d ",
+                   prefix, levels[level - 1], filename, line);
+   }
+
+   return n < 0 ? 0 : MIN((size_t)n, size - 1);
+}
+
+static void
+log_output(struct configuration* config, int level, char* str, size_t length)
+{
+   if (config->log_type == PGEXPORTER_LOGGING_TYPE_CONSOLE)
+   {
+      fwrite(str, 1, length, stdout);
+      fputc('\n', stdout);
+   }
+   else if (config->log_type == PGEXPORTER_LOGGING_TYPE_FILE)
+   {
+      fwrite(str, 1, length, log_file);
+      fputc('\n', log_file);
+   }
+   else if (config->log_type == PGEXPORTER_LOGGING_TYPE_SYSLOG)
+   {
+      syslog(log_priority(level), "%.*s", (int)length, str);
+   }
+}
+
+static struct log_ring*
+log_ring_claim(void)
+{
+   int free_pid;
+   pid_t pid;
+   struct log_buffer* buffer = (struct log_buffer*)log_shmem;
+
+   if (buffer == NULL || !atomic_load(&buffer->active))
+   {
+      return NULL;
+   }
+
+   pid = getpid();
+
+   // A forked process inherits the ring of its parent, so it claims its own
+   if (thread_ring != NULL && thread_pid == pid)
+   {
+      return thread_ring;
+   }
+
+   thread_ring = NULL;
+   thread_pid = pid;
+
+   pthread_once(&ring_once, log_ring_key);
+
+   for (int i = 0; i < LOG_RINGS; i++)
+   {
+      free_pid = 0;
+      if (atomic_compare_exchange_strong(&buffer->rings[i].pid, &free_pid, pid))
+      {
+         thread_ring = &buffer->rings[i];
+         // The ring is released when the thread exits
+         pthread_setspecific(ring_key, thread_ring);
+         break;
+      }
+   }
+
+   return thread_ring;
+}
+
+static void
+log_ring_key(void)
+{
+   pthread_key_create(&ring_key, log_ring_release);
+}
+
+static void
+log_ring_release(void* r)
+{
+   struct log_ring* ring = (struct log_ring*)r;
+
+   // The writer frees the ring once it has drained the last lines of the thread
+   if (log_shmem != NULL && atomic_load(&ring->pid) == getpid())
+   {
+      atomic_store(&ring->released, true);
+   }
+}
+
+static void
+log_ring_copy(struct log_ring* ring, uint64_t position, void* data, size_t length, bool write)
+{
+   size_t offset = position & (LOG_RING_SIZE - 1);
+   size_t first = MIN(length, LOG_RING_SIZE - offset);
+
+   if (write)
+   {
+      memcpy(ring->data + offset, data, first);
+      memcpy(ring->data, (char*)data + first, length - first);
+   }
+   else
+   {
+      memcpy(data, ring->data + offset, first);
+      memcpy((char*)data + first, ring->data, length - first);
+   }
+}
+
+static int
+log_enqueue(struct configuration* config, int level, char* filename, int line, char* fmt, va_list vl)
+{
+   char str[LOG_RECORD_SIZE];
+   int n = 0;
+   int m = 0;
+   uint64_t head;
+   uint64_t tail;
+   uint64_t size;
+   struct log_record record;
+   struct log_ring* ring = NULL;
+
+   ring = log_ring_claim();
+   if (ring == NULL)
+   {
+      return 1;
+   }
+
+   n = log_header(config, level, filename, line, str, sizeof(str));
+   m = vsnprintf(str + n, sizeof(str) - n, fmt, vl);
+
+   // The long lines are written directly
+   if (m < 0 || (size_t)(n + m) >= sizeof(str))
+   {
+      return 1;
+   }
+
+   record.length = n + m;
+   record.level = level;
+   size = (sizeof(struct log_record) + record.length + 7) & ~((uint64_t)7);
+
+   head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+   tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+   if (LOG_RING_SIZE - (head - tail) < size)
+   {
+      atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+      return 0;
+   }
+
+   log_ring_copy(ring, head, &record, sizeof(struct log_record), true);
+   log_ring_copy(ring, head + sizeof(struct log_record), str, record.length, true);
+
+   atomic_store_explicit(&ring->head, head + size, memory_order_release);
+
+   return 0;
+}
+
+static int
+log_drain(void)
+{
+   int count = 0;
+   int pid = 0;
+   bool released;
+   uint64_t head;
+   uint64_t tail;
+   uint64_t dropped = 0;
+   char str[LOG_RECORD_SIZE];
+   char header[256];
+   time_t now;
+   struct log_record record;
+   struct log_ring* ring = NULL;
+   struct log_buffer* buffer = (struct log_buffer*)log_shmem;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   log_lock(config);
+
+   // The log file is reopened during a reload, so the records wait for it
+   if (config->log_type == PGEXPORTER_LOGGING_TYPE_FILE && log_file == NULL)
+   {
+      log_unlock(config);
+      return 0;
+   }
+
+   for (int i = 0; i < LOG_RINGS; i++)
+   {
+      ring = &buffer->rings[i];
+      pid = atomic_load(&ring->pid);
+
+      if (pid == 0)
+      {
+         continue;
+      }
+
+      tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+      while (tail < head)
+      {
+         log_ring_copy(ring, tail, &record, sizeof(struct log_record), false);
+         log_ring_copy(ring, tail + sizeof(struct log_record), str, record.length, false);
+         log_output(config, record.level, str, record.length);
+         tail += (sizeof(struct log_record) + record.length + 7) & ~((uint64_t)7);
+         count++;
+      }
+
+      atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+      writer_dropped += atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+
+      // The ring of a thread or a process that has exited is free once it is empty
+      released = atomic_load(&ring->released);
+      if (!released && pid != writer_pid && kill(pid, 0) == -1 && errno == ESRCH)
+      {
+         errno = 0;
+         released = true;
+      }
+
+      if (released && atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+      {
+         atomic_store(&ring->released, false);
+         atomic_store(&ring->pid, 0);
+      }
+   }
+
+   now = time(NULL);
+   if (writer_dropped > 0 && now - writer_reported >= LOG_DROP_INTERVAL)
+   {
+      dropped = writer_dropped;
+      writer_dropped = 0;
+      writer_reported = now;
+
+      log_header(config, PGEXPORTER_LOGGING_LEVEL_WARN, "logging.c", __LINE__, header, sizeof(header));
+      snprintf(str, sizeof(str), "%sDropped %" PRIu64 " log lines since the log buffers were full", header, dropped);
+      log_output(config, PGEXPORTER_LOGGING_LEVEL_WARN, str, strlen(str));
+      count++;
+   }
+
+   if (count > 0)
+   {
+      if (config->log_type == PGEXPORTER_LOGGING_TYPE_CONSOLE)
+      {
+         fflush(stdout);
+      }
+      else if (config->log_type == PGEXPORTER_LOGGING_TYPE_FILE)
+      {
+         fflush(log_file);
+
+         if (log_rotation_required())
+         {
+            log_file_rotate();
+         }
+      }
+   }
+
+   log_unlock(config);
+
+   return count;
+}
+
+static void*
+log_writer(void* arg __attribute__((unused)))
+{
+   while (atomic_load(&writer_running))
+   {
+      if (log_drain() == 0)
+      {
+         SLEEP(10000000L);
+      }
+   }
+
+   while (log_drain() > 0)
+   {
+   }
+
+   return NULL;
+}
+
+static void
+log_writer_exit(void)
+{
+   pgexporter_stop_log_writer();
+}
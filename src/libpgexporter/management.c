@@ -64,6 +64,37 @@ static int write_complete(SSL* ssl, int socket, void* buf, size_t size);
 static int write_socket(int socket, void* buf, size_t size);
 static int write_ssl(SSL* ssl, void* buf, size_t size);
 
+#define TRANSFER_STAGES 3
+
+/** @struct transfer_stage
+ * Defines a stage of the transfer encoding
+ */
+struct transfer_stage
+{
+   void* stream;                                                                         /**< The stream */
+   int (*update)(void* stream, void* data, size_t length, bool finish, struct builder* output); /**< The update function */
+   void (*destroy)(void* stream);                                                        /**< The destroy function */
+   struct builder buffer;                                                                /**< The output of the stage */
+};
+
+/** @struct transfer
+ * Defines the transfer encoding, e.g. compress, encrypt and BASE64
+ */
+struct transfer
+{
+   int number_of_stages;                           /**< The number of stages */
+   struct transfer_stage stages[TRANSFER_STAGES];  /**< The stages */
+   struct builder* output;                         /**< The output of the last stage */
+};
+
+static int transfer_stage(struct transfer* transfer, void* stream,
+                          int (*update)(void* stream, void* data, size_t length, bool finish, struct builder* output),
+                          void (*destroy)(void* stream));
+static int transfer_create(bool encode, uint8_t compression, uint8_t encryption, struct builder* output, struct transfer* transfer);
+static int transfer_update(struct transfer* transfer, void* data, size_t length, bool finish);
+static int transfer_sink(void* arg, char* data, size_t length);
+static void transfer_destroy(struct transfer* transfer);
+
 int
 pgexporter_management_request_shutdown(SSL* ssl, int socket, uint8_t compression, uint8_t encryption, int32_t output_format)
 {
@@ -160,6 +191,38 @@ error:
    return 1;
 }
 
+int
+pgexporter_management_request_trace(SSL* ssl, int socket, uint8_t compression, uint8_t encryption, int32_t output_format)
+{
+   struct json* j = NULL;
+   struct json* request = NULL;
+
+   if (pgexporter_management_create_header(MANAGEMENT_TRACE, compression, encryption, output_format, &j))
+   {
+      goto error;
+   }
+
+   if (pgexporter_management_create_request(j, &request))
+   {
+      goto error;
+   }
+
+   if (pgexporter_management_write_json(ssl, socket, compression, encryption, j))
+   {
+      goto error;
+   }
+
+   pgexporter_json_destroy(j);
+
+   return 0;
+
+error:
+
+   pgexporter_json_destroy(j);
+
+   return 1;
+}
+
 int
 pgexporter_management_request_ping(SSL* ssl, int socket, uint8_t compression, uint8_t encryption, int32_t output_format)
 {
@@ -374,8 +437,8 @@ pgexporter_management_create_response(struct json* json, int server, struct json
 
    if (server >= 0)
    {
-      pgexporter_json_put(r, MANAGEMENT_ARGUMENT_MAJOR_VERSION, (uintptr_t)config->servers[server].version, ValueInt32);
-      pgexporter_json_put(r, MANAGEMENT_ARGUMENT_MINOR_VERSION, (uintptr_t)config->servers[server].minor_version, ValueInt32);
+      pgexporter_json_put(r, MANAGEMENT_ARGUMENT_MAJOR_VERSION, (uintptr_t)config->server_states[server].version, ValueInt32);
+      pgexporter_json_put(r, MANAGEMENT_ARGUMENT_MINOR_VERSION, (uintptr_t)config->server_states[server].minor_version, ValueInt32);
       pgexporter_json_put(r, MANAGEMENT_ARGUMENT_SERVER, (uintptr_t)config->servers[server].name, ValueString);
    }
 
@@ -473,14 +536,12 @@ pgexporter_management_read_json(SSL* ssl, int socket, uint8_t* compression, uint
    uint8_t encrypt_method = MANAGEMENT_ENCRYPTION_NONE;
    char* s = NULL;
    struct json* r = NULL;
-
-   unsigned char* transfer_buffer = NULL;
-   unsigned char* decoded_buffer = NULL;
-   unsigned char* decrypted_buffer = NULL;
    char* decompressed = NULL;
-   size_t transfer_size = 0;
-   size_t decoded_size = 0;
-   size_t decrypted_size = 0;
+   struct builder str;
+   struct transfer transfer;
+
+   memset(&transfer, 0, sizeof(struct transfer));
+   memset(&str, 0, sizeof(struct builder));
 
    if (read_uint8("pgexporter-cli", ssl, socket, &compress_method))
    {
@@ -509,116 +570,55 @@ pgexporter_management_read_json(SSL* ssl, int socket, uint8_t* compression, uint
 
    if (compress_method || encrypt_method)
    {
-      // First, perform decode
-      if (pgexporter_base64_decode(s, strlen(s), (void**)&decoded_buffer, &decoded_size) != 0)
+      // Decode, decrypt and decompress in one pass over bounded buffers
+      if (pgexporter_builder_init(&str, strlen(s)) ||
+          transfer_create(false, compress_method, encrypt_method, &str, &transfer))
       {
-         pgexporter_log_error("pgexporter_management_read_json: Decoding failedg");
          goto error;
       }
-      free(s);
-      s = NULL;
-      transfer_buffer = decoded_buffer;
-      transfer_size = decoded_size;
-      decoded_buffer = NULL;
 
-      // Second, perform dencrypt
-      switch (encrypt_method)
+      if (transfer_update(&transfer, s, strlen(s), true))
       {
-         case MANAGEMENT_ENCRYPTION_AES256:
-            if (pgexporter_decrypt_buffer(transfer_buffer, transfer_size, &decrypted_buffer, &decrypted_size, MANAGEMENT_ENCRYPTION_AES256))
-            {
-               pgexporter_log_error("pgexporter_management_read_json: Failed to aes256 dencrypt the string");
-               goto error;
-            }
-            free(transfer_buffer);
-            transfer_buffer = decrypted_buffer;
-            transfer_size = decrypted_size;
-            decrypted_buffer = NULL;
+         pgexporter_log_error("pgexporter_management_read_json: Decoding failed");
+         goto error;
+      }
 
-            break;
-         case MANAGEMENT_ENCRYPTION_AES192:
-            if (pgexporter_decrypt_buffer(transfer_buffer, transfer_size, &decrypted_buffer, &decrypted_size, MANAGEMENT_ENCRYPTION_AES192))
-            {
-               pgexporter_log_error("pgexporter_management_read_json: Failed to aes192 dencrypt the string");
-               goto error;
-            }
-            free(transfer_buffer);
-            transfer_buffer = decrypted_buffer;
-            transfer_size = decrypted_size;
-            decrypted_buffer = NULL;
+      transfer_destroy(&transfer);
 
-            break;
-         case MANAGEMENT_ENCRYPTION_AES128:
-            if (pgexporter_decrypt_buffer(transfer_buffer, transfer_size, &decrypted_buffer, &decrypted_size, MANAGEMENT_ENCRYPTION_AES128))
-            {
-               pgexporter_log_error("pgexporter_management_read_json: Failed to aes128 dencrypt the string");
-               goto error;
-            }
-            free(transfer_buffer);
-            transfer_buffer = decrypted_buffer;
-            transfer_size = decrypted_size;
-            decrypted_buffer = NULL;
-
-            break;
-         default:
-            break;
-      }
+      free(s);
+      s = NULL;
 
-      // Third, perform decompress
+      // ZSTD and LZ4 need the whole buffer
       switch (compress_method)
       {
-         case MANAGEMENT_COMPRESSION_GZIP:
-            if (pgexporter_gunzip_string(transfer_buffer, transfer_size, &decompressed))
-            {
-               pgexporter_log_error("pgexporter_management_read_json: GZIP decompress failed");
-               goto error;
-            }
-            free(transfer_buffer);
-            transfer_buffer = NULL;
-            s = decompressed;
-            decompressed = NULL;
-            break;
          case MANAGEMENT_COMPRESSION_ZSTD:
-            if (pgexporter_zstdd_string(transfer_buffer, transfer_size, &decompressed))
+            if (pgexporter_zstdd_string((unsigned char*)str.data, str.length, &decompressed))
             {
                pgexporter_log_error("pgexporter_management_read_json: ZSTD decompress failed");
                goto error;
             }
-            free(transfer_buffer);
-            transfer_buffer = NULL;
+            pgexporter_builder_destroy(&str);
             s = decompressed;
             decompressed = NULL;
             break;
          case MANAGEMENT_COMPRESSION_LZ4:
-            if (pgexporter_lz4d_string(transfer_buffer, transfer_size, &decompressed))
+            if (pgexporter_lz4d_string((unsigned char*)str.data, str.length, &decompressed))
             {
                pgexporter_log_error("pgexporter_management_read_json: LZ4 decompress failed");
                goto error;
             }
-            free(transfer_buffer);
-            transfer_buffer = NULL;
-            s = decompressed;
-            decompressed = NULL;
-            break;
-         case MANAGEMENT_COMPRESSION_BZIP2:
-            if (pgexporter_bunzip2_string(transfer_buffer, transfer_size, &decompressed))
-            {
-               pgexporter_log_error("pgexporter_management_read_json: bzip2 decompress failed");
-               goto error;
-            }
-            free(transfer_buffer);
-            transfer_buffer = NULL;
+            pgexporter_builder_destroy(&str);
             s = decompressed;
             decompressed = NULL;
             break;
          default:
-            s = (char*) transfer_buffer;
-            transfer_buffer = NULL;
+            s = pgexporter_builder_detach(&str);
             break;
       }
    }
 
-   if (pgexporter_json_parse_string(s, &r))
+   // The response buffer is owned here, so it is parsed without copying
+   if (s == NULL || pgexporter_json_parse_in_place(s, strlen(s), &r))
    {
       goto error;
    }
@@ -633,26 +633,11 @@ error:
 
    pgexporter_json_destroy(r);
 
-   if (s != NULL)
-   {
-      free(s);
-   }
-   if (transfer_buffer != NULL)
-   {
-      free(transfer_buffer);
-   }
-   if (decoded_buffer != NULL)
-   {
-      free(decoded_buffer);
-   }
-   if (decrypted_buffer != NULL)
-   {
-      free(decrypted_buffer);
-   }
-   if (decompressed != NULL)
-   {
-      free(decompressed);
-   }
+   transfer_destroy(&transfer);
+   pgexporter_builder_destroy(&str);
+
+   free(s);
+   free(decompressed);
 
    return 1;
 }
@@ -661,145 +646,101 @@ int
 pgexporter_management_write_json(SSL* ssl, int socket, uint8_t compression, uint8_t encryption, struct json* json)
 {
    char* s = NULL;
-
-   unsigned char* transfer_buffer = NULL;
    unsigned char* compressed_buffer = NULL;
-   unsigned char* encrypted_buffer = NULL;
-   char* encoded = NULL;
-   size_t transfer_size = 0;
    size_t compressed_size = 0;
-   size_t encrypted_size = 0;
-   size_t encoded_size = 0;
+   struct builder str;
+   struct builder encoded;
+   struct json_writer writer;
+   struct transfer transfer;
 
-   s = pgexporter_json_to_string(json, FORMAT_JSON_COMPACT, NULL, 0);
+   memset(&transfer, 0, sizeof(struct transfer));
+   memset(&encoded, 0, sizeof(struct builder));
 
-   if (write_uint8("pgexporter-cli", ssl, socket, compression))
-   {
-      goto error;
-   }
+   pgexporter_builder_init(&str, 0);
 
-   if (write_uint8("pgexporter-cli", ssl, socket, encryption))
+   if (compression == MANAGEMENT_COMPRESSION_NONE && encryption == MANAGEMENT_ENCRYPTION_NONE)
    {
-      goto error;
-   }
+      if (pgexporter_json_writer_init(&writer, FORMAT_JSON_COMPACT, pgexporter_json_sink_builder, &str) ||
+          pgexporter_json_writer_json(&writer, NULL, json) ||
+          pgexporter_json_writer_flush(&writer))
+      {
+         goto error;
+      }
 
-   if (compression || encryption)
+      s = pgexporter_builder_detach(&str);
+   }
+   else
    {
-      // First, perform compress
-      switch (compression)
+      if (pgexporter_builder_init(&encoded, 0) ||
+          transfer_create(true, compression, encryption, &encoded, &transfer))
       {
-         case MANAGEMENT_COMPRESSION_GZIP:
-            if (pgexporter_gzip_string(s, &compressed_buffer, &compressed_size))
-            {
-               pgexporter_log_error("pgexporter_management_write_json: Failed to gzip the string");
-               goto error;
-            }
-            transfer_buffer = compressed_buffer;
-            transfer_size = compressed_size;
+         goto error;
+      }
 
-            free(s);
-            compressed_buffer = NULL;
-            s = NULL;
-            break;
-         case MANAGEMENT_COMPRESSION_ZSTD:
-            if (pgexporter_zstdc_string(s, &compressed_buffer, &compressed_size))
+      if (compression == MANAGEMENT_COMPRESSION_ZSTD || compression == MANAGEMENT_COMPRESSION_LZ4)
+      {
+         // ZSTD and LZ4 compress the whole document, and the result is streamed
+         if (pgexporter_json_writer_init(&writer, FORMAT_JSON_COMPACT, pgexporter_json_sink_builder, &str) ||
+             pgexporter_json_writer_json(&writer, NULL, json) ||
+             pgexporter_json_writer_flush(&writer))
+         {
+            goto error;
+         }
+
+         if (compression == MANAGEMENT_COMPRESSION_ZSTD)
+         {
+            if (pgexporter_zstdc_string(str.data, &compressed_buffer, &compressed_size))
             {
                pgexporter_log_error("pgexporter_management_write_json: Failed to zstd the string");
                goto error;
             }
-            transfer_buffer = compressed_buffer;
-            transfer_size = compressed_size;
-
-            free(s);
-            compressed_buffer = NULL;
-            s = NULL;
-            break;
-         case MANAGEMENT_COMPRESSION_LZ4:
-            if (pgexporter_lz4c_string(s, &compressed_buffer, &compressed_size))
+         }
+         else
+         {
+            if (pgexporter_lz4c_string(str.data, &compressed_buffer, &compressed_size))
             {
                pgexporter_log_error("pgexporter_management_write_json: Failed to lz4 the string");
                goto error;
             }
-            transfer_buffer = compressed_buffer;
-            transfer_size = compressed_size;
+         }
 
-            free(s);
-            compressed_buffer = NULL;
-            s = NULL;
-            break;
-         case MANAGEMENT_COMPRESSION_BZIP2:
-            if (pgexporter_bzip2_string(s, &compressed_buffer, &compressed_size))
-            {
-               pgexporter_log_error("pgexporter_management_write_json: Failed to bzip2 the string");
-               goto error;
-            }
-            transfer_buffer = compressed_buffer;
-            transfer_size = compressed_size;
+         pgexporter_builder_destroy(&str);
 
-            free(s);
-            compressed_buffer = NULL;
-            s = NULL;
-            break;
-         default:
-            transfer_buffer = (unsigned char*)s;
-            transfer_size = strlen(s);
-            s = NULL;
-            break;
-      }
+         if (transfer_update(&transfer, compressed_buffer, compressed_size, true))
+         {
+            pgexporter_log_error("pgexporter_management_write_json: Encoding failed");
+            goto error;
+         }
 
-      // Second, perform encrypt
-      switch (encryption)
+         free(compressed_buffer);
+         compressed_buffer = NULL;
+      }
+      else
       {
-         case MANAGEMENT_ENCRYPTION_AES256:
-            if (pgexporter_encrypt_buffer(transfer_buffer, transfer_size, &encrypted_buffer, &encrypted_size, MANAGEMENT_ENCRYPTION_AES256))
-            {
-               pgexporter_log_error("pgexporter_management_write_json: Failed to aes256 encrypt the string");
-               goto error;
-            }
-            free(transfer_buffer);
-            transfer_buffer = encrypted_buffer;
-            transfer_size = encrypted_size;
-            encrypted_buffer = NULL;
+         // The document is compressed, encrypted and encoded while it is written
+         if (pgexporter_json_writer_init(&writer, FORMAT_JSON_COMPACT, transfer_sink, &transfer) ||
+             pgexporter_json_writer_json(&writer, NULL, json) ||
+             pgexporter_json_writer_flush(&writer) ||
+             transfer_update(&transfer, NULL, 0, true))
+         {
+            pgexporter_log_error("pgexporter_management_write_json: Encoding failed");
+            goto error;
+         }
+      }
 
-            break;
-         case MANAGEMENT_ENCRYPTION_AES192:
-            if (pgexporter_encrypt_buffer(transfer_buffer, transfer_size, &encrypted_buffer, &encrypted_size, MANAGEMENT_ENCRYPTION_AES192))
-            {
-               pgexporter_log_error("pgexporter_management_write_json: Failed to aes192 encrypt the string");
-               goto error;
-            }
-            free(transfer_buffer);
-            transfer_buffer = encrypted_buffer;
-            transfer_size = encrypted_size;
-            encrypted_buffer = NULL;
+      transfer_destroy(&transfer);
 
-            break;
-         case MANAGEMENT_ENCRYPTION_AES128:
-            if (pgexporter_encrypt_buffer(transfer_buffer, transfer_size, &encrypted_buffer, &encrypted_size, MANAGEMENT_ENCRYPTION_AES128))
-            {
-               pgexporter_log_error("pgexporter_management_write_json: Failed to aes128 encrypt the string");
-               goto error;
-            }
-            free(transfer_buffer);
-            transfer_buffer = encrypted_buffer;
-            transfer_size = encrypted_size;
-            encrypted_buffer = NULL;
-
-            break;
-         default:
-            break;
-      }
+      s = pgexporter_builder_detach(&encoded);
+   }
 
-      // Third, perform base64 encode
-      if (pgexporter_base64_encode(transfer_buffer, transfer_size, &encoded, &encoded_size) != 0)
-      {
-         pgexporter_log_error("pgexporter_management_write_json: Encoding failed");
-         goto error;
-      }
+   if (write_uint8("pgexporter-cli", ssl, socket, compression))
+   {
+      goto error;
+   }
 
-      free(transfer_buffer);
-      s = encoded;
-      encoded = NULL;
+   if (write_uint8("pgexporter-cli", ssl, socket, encryption))
+   {
+      goto error;
    }
 
    if (write_string("pgexporter-cli", ssl, socket, s))
@@ -807,31 +748,20 @@ pgexporter_management_write_json(SSL* ssl, int socket, uint8_t compression, uint
       goto error;
    }
 
+   pgexporter_builder_destroy(&str);
+
    free(s);
 
    return 0;
 
 error:
-   if (s != NULL)
-   {
-      free(s);
-   }
-   if (transfer_buffer != NULL)
-   {
-      free(transfer_buffer);
-   }
-   if (compressed_buffer != NULL)
-   {
-      free(compressed_buffer);
-   }
-   if (encrypted_buffer != NULL)
-   {
-      free(encrypted_buffer);
-   }
-   if (encoded != NULL)
-   {
-      free(encoded);
-   }
+
+   transfer_destroy(&transfer);
+   pgexporter_builder_destroy(&str);
+   pgexporter_builder_destroy(&encoded);
+
+   free(compressed_buffer);
+   free(s);
 
    return 1;
 }
@@ -1299,3 +1229,153 @@ write_ssl(SSL* ssl, void* buf, size_t size)
 
    return 1;
 }
+
+static int
+transfer_stage(struct transfer* transfer, void* stream,
+               int (*update)(void* stream, void* data, size_t length, bool finish, struct builder* output),
+               void (*destroy)(void* stream))
+{
+   struct transfer_stage* stage = &transfer->stages[transfer->number_of_stages];
+
+   stage->stream = stream;
+   stage->update = update;
+   stage->destroy = destroy;
+
+   transfer->number_of_stages++;
+
+   return pgexporter_builder_init(&stage->buffer, 0);
+}
+
+static int
+transfer_create(bool encode, uint8_t compression, uint8_t encryption, struct builder* output, struct transfer* transfer)
+{
+   void* stream = NULL;
+   bool cipher;
+
+   memset(transfer, 0, sizeof(struct transfer));
+
+   transfer->output = output;
+
+   cipher = encryption == MANAGEMENT_ENCRYPTION_AES256 ||
+            encryption == MANAGEMENT_ENCRYPTION_AES192 ||
+            encryption == MANAGEMENT_ENCRYPTION_AES128;
+
+   if (!encode)
+   {
+      if (pgexporter_base64_stream_create(false, &stream) ||
+          transfer_stage(transfer, stream, pgexporter_base64_stream_update, pgexporter_base64_stream_destroy))
+      {
+         goto error;
+      }
+   }
+
+   if (encode && compression == MANAGEMENT_COMPRESSION_GZIP)
+   {
+      if (pgexporter_gzip_stream_create(true, &stream) ||
+          transfer_stage(transfer, stream, pgexporter_gzip_stream_update, pgexporter_gzip_stream_destroy))
+      {
+         goto error;
+      }
+   }
+   else if (encode && compression == MANAGEMENT_COMPRESSION_BZIP2)
+   {
+      if (pgexporter_bzip2_stream_create(true, &stream) ||
+          transfer_stage(transfer, stream, pgexporter_bzip2_stream_update, pgexporter_bzip2_stream_destroy))
+      {
+         goto error;
+      }
+   }
+
+   if (cipher)
+   {
+      if (pgexporter_cipher_stream_create(encode, encryption, &stream) ||
+          transfer_stage(transfer, stream, pgexporter_cipher_stream_update, pgexporter_cipher_stream_destroy))
+      {
+         goto error;
+      }
+   }
+
+   if (!encode && compression == MANAGEMENT_COMPRESSION_GZIP)
+   {
+      if (pgexporter_gzip_stream_create(false, &stream) ||
+          transfer_stage(transfer, stream, pgexporter_gzip_stream_update, pgexporter_gzip_stream_destroy))
+      {
+         goto error;
+      }
+   }
+   else if (!encode && compression == MANAGEMENT_COMPRESSION_BZIP2)
+   {
+      if (pgexporter_bzip2_stream_create(false, &stream) ||
+          transfer_stage(transfer, stream, pgexporter_bzip2_stream_update, pgexporter_bzip2_stream_destroy))
+      {
+         goto error;
+      }
+   }
+
+   if (encode)
+   {
+      if (pgexporter_base64_stream_create(true, &stream) ||
+          transfer_stage(transfer, stream, pgexporter_base64_stream_update, pgexporter_base64_stream_destroy))
+      {
+         goto error;
+      }
+   }
+
+   return 0;
+
+error:
+
+   transfer_destroy(transfer);
+
+   return 1;
+}
+
+static int
+transfer_update(struct transfer* transfer, void* data, size_t length, bool finish)
+{
+   struct transfer_stage* stage = NULL;
+   struct builder* output = NULL;
+
+   for (int i = 0; i < transfer->number_of_stages; i++)
+   {
+      stage = &transfer->stages[i];
+
+      if (i == transfer->number_of_stages - 1)
+      {
+         output = transfer->output;
+      }
+      else
+      {
+         output = &stage->buffer;
+         output->length = 0;
+      }
+
+      if (stage->update(stage->stream, data, length, finish, output))
+      {
+         return 1;
+      }
+
+      data = output->data;
+      length = output->length;
+   }
+
+   return 0;
+}
+
+static int
+transfer_sink(void* arg, char* data, size_t length)
+{
+   return transfer_update((struct transfer*)arg, data, length, false);
+}
+
+static void
+transfer_destroy(struct transfer* transfer)
+{
+   for (int i = 0; i < transfer->number_of_stages; i++)
+   {
+      transfer->stages[i].destroy(transfer->stages[i].stream);
+      pgexporter_builder_destroy(&transfer->stages[i].buffer);
+   }
+
+   transfer->number_of_stages = 0;
+}
@@ -30,20 +30,56 @@
 #include <pgexporter.h>
 #include <memory.h>
 #include <message.h>
+#include <stats.h>
+#include <uring.h>
 
 /* system */
 #ifdef DEBUG
 #include <assert.h>
 #endif
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(HAVE_LINUX)
+#include <malloc.h>
+#elif defined(HAVE_FREEBSD)
+#include <malloc_np.h>
+#elif defined(HAVE_DARWIN) || defined(HAVE_OSX)
+#include <malloc/malloc.h>
+#endif
+
+/* The number of accounted operations of a thread between flushes */
+#define MEMORY_FLUSH_OPERATIONS 64
 
-static struct message* message = NULL;
-static void* data = NULL;
+/** @struct memory_pending
+ * Defines the accounting of a subsystem not yet flushed by a thread
+ */
+struct memory_pending
+{
+   int64_t allocations; /**< The number of allocations */
+   int64_t frees;       /**< The number of frees */
+   int64_t allocated;   /**< The number of bytes allocated */
+   int64_t freed;       /**< The number of bytes freed */
+};
+
+static __thread struct message* message = NULL;
+static __thread void* data = NULL;
+static __thread struct memory_pending pending[NUMBER_OF_MEMORY_SUBSYSTEMS];
+static __thread int operations = 0;
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+
+static bool accounting(int subsystem);
+static size_t usable_size(void* ptr);
+static void account(int subsystem, int64_t allocations, int64_t frees, int64_t allocated, int64_t freed);
+static void fork_register(void);
+static void fork_child(void);
 
 void
 pgexporter_memory_init(void)
 {
+   pthread_once(&fork_once, fork_register);
+
    if (message == NULL)
    {
       message = (struct message*)malloc(sizeof(struct message));
@@ -61,6 +97,9 @@ pgexporter_memory_init(void)
       }
    }
 
+   /* A forked process creates its own ring for the inherited buffer */
+   pgexporter_uring_init(data, DEFAULT_BUFFER_SIZE);
+
 #ifdef DEBUG
    assert(message != NULL);
    assert(data != NULL);
@@ -110,6 +149,10 @@ pgexporter_memory_free(void)
 void
 pgexporter_memory_destroy(void)
 {
+   pgexporter_memory_flush();
+
+   pgexporter_uring_destroy();
+
    free(data);
    free(message);
 
@@ -153,3 +196,176 @@ pgexporter_memory_dynamic_destroy(void* data)
 {
    free(data);
 }
+
+void*
+pgexporter_memory_alloc(int subsystem, size_t size)
+{
+   void* ptr = malloc(size);
+
+   if (ptr != NULL && accounting(subsystem))
+   {
+      account(subsystem, 1, 0, (int64_t)usable_size(ptr), 0);
+   }
+
+   return ptr;
+}
+
+void*
+pgexporter_memory_calloc(int subsystem, size_t number, size_t size)
+{
+   void* ptr = calloc(number, size);
+
+   if (ptr != NULL && accounting(subsystem))
+   {
+      account(subsystem, 1, 0, (int64_t)usable_size(ptr), 0);
+   }
+
+   return ptr;
+}
+
+void*
+pgexporter_memory_realloc(int subsystem, void* ptr, size_t size)
+{
+   size_t old = 0;
+   void* p = NULL;
+
+   if (!accounting(subsystem))
+   {
+      return realloc(ptr, size);
+   }
+
+   old = ptr != NULL ? usable_size(ptr) : 0;
+
+   p = realloc(ptr, size);
+
+   if (p == NULL)
+   {
+      return NULL;
+   }
+
+   // A resize keeps the object, only a new one is an allocation
+   account(subsystem, ptr == NULL ? 1 : 0, 0, (int64_t)usable_size(p), (int64_t)old);
+
+   return p;
+}
+
+void*
+pgexporter_memory_aligned(int subsystem, size_t alignment, size_t size)
+{
+   void* ptr = aligned_alloc(alignment, size);
+
+   if (ptr != NULL && accounting(subsystem))
+   {
+      account(subsystem, 1, 0, (int64_t)usable_size(ptr), 0);
+   }
+
+   return ptr;
+}
+
+void
+pgexporter_memory_release(int subsystem, void* ptr)
+{
+   if (ptr == NULL)
+   {
+      return;
+   }
+
+   if (accounting(subsystem))
+   {
+      account(subsystem, 0, 1, 0, (int64_t)usable_size(ptr));
+   }
+
+   free(ptr);
+}
+
+void
+pgexporter_memory_account(int subsystem, int64_t bytes, int64_t objects)
+{
+   if (!accounting(subsystem) || (bytes == 0 && objects == 0))
+   {
+      return;
+   }
+
+   account(subsystem, objects > 0 ? objects : 0, objects < 0 ? -objects : 0,
+           bytes > 0 ? bytes : 0, bytes < 0 ? -bytes : 0);
+}
+
+void
+pgexporter_memory_flush(void)
+{
+   if (operations == 0)
+   {
+      return;
+   }
+
+   for (int i = 0; i < NUMBER_OF_MEMORY_SUBSYSTEMS; i++)
+   {
+      struct memory_pending* p = &pending[i];
+
+      if (p->allocations != 0 || p->frees != 0 || p->allocated != 0 || p->freed != 0)
+      {
+         pgexporter_stats_memory(i, p->allocations, p->frees, p->allocated, p->freed);
+         memset(p, 0, sizeof(struct memory_pending));
+      }
+   }
+
+   operations = 0;
+}
+
+static bool
+accounting(int subsystem)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   return config != NULL && config->memory_accounting && stats_shmem != NULL &&
+          subsystem >= 0 && subsystem < NUMBER_OF_MEMORY_SUBSYSTEMS;
+}
+
+static size_t
+usable_size(void* ptr)
+{
+#if defined(HAVE_LINUX) || defined(HAVE_FREEBSD)
+   return malloc_usable_size(ptr);
+#elif defined(HAVE_DARWIN) || defined(HAVE_OSX)
+   return malloc_size(ptr);
+#else
+   // Only the objects are accounted
+   (void)ptr;
+   return 0;
+#endif
+}
+
+static void
+account(int subsystem, int64_t allocations, int64_t frees, int64_t allocated, int64_t freed)
+{
+   struct memory_pending* p = &pending[subsystem];
+
+   p->allocations += allocations;
+   p->frees += frees;
+   p->allocated += allocated;
+   p->freed += freed;
+
+   if (++operations >= MEMORY_FLUSH_OPERATIONS)
+   {
+      pgexporter_memory_flush();
+   }
+}
+
+static void
+fork_register(void)
+{
+   pthread_atfork(NULL, NULL, fork_child);
+}
+
+static void
+fork_child(void)
+{
+   // The pending accounting belongs to the parent, which flushes it itself
+   memset(&pending[0], 0, sizeof(pending));
+   operations = 0;
+
+   // The ring is shared with the parent, so the child never submits to it
+   pgexporter_uring_destroy();
+}
@@ -32,21 +32,31 @@
 #include <memory.h>
 #include <message.h>
 #include <network.h>
+#include <uring.h>
 #include <utils.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 static int read_message(int socket, bool block, int timeout, struct message** msg);
 static int write_message(int socket, struct message* msg);
 
 static int ssl_read_message(SSL* ssl, int timeout, struct message** msg);
+static int read_buffer(int socket, void* buffer, size_t size, size_t* length);
+static int ssl_read_buffer(SSL* ssl, void* buffer, size_t size, size_t* length);
 static int ssl_write_message(SSL* ssl, struct message* msg);
+static int write_vector(int socket, struct iovec* iov, int iovcnt);
+static int ssl_write_chunk(SSL* ssl, char* header, size_t header_length, char* data, size_t length);
+
+#define CHUNK_HEADER_SIZE 20
+#define CHUNK_RECORD_SIZE 16384
 
 int
 pgexporter_read_block_message(SSL* ssl, int socket, struct message** msg)
@@ -70,6 +80,19 @@ pgexporter_read_timeout_message(SSL* ssl, int socket, int timeout, struct messag
    return ssl_read_message(ssl, timeout, msg);
 }
 
+int
+pgexporter_read_block_buffer(SSL* ssl, int socket, void* buffer, size_t size, size_t* length)
+{
+   *length = 0;
+
+   if (ssl == NULL)
+   {
+      return read_buffer(socket, buffer, size, length);
+   }
+
+   return ssl_read_buffer(ssl, buffer, size, length);
+}
+
 int
 pgexporter_write_message(SSL* ssl, int socket, struct message* msg)
 {
@@ -81,6 +104,30 @@ pgexporter_write_message(SSL* ssl, int socket, struct message* msg)
    return ssl_write_message(ssl, msg);
 }
 
+int
+pgexporter_write_chunk(SSL* ssl, int socket, char* data, size_t length)
+{
+   char header[CHUNK_HEADER_SIZE];
+   int header_length;
+   struct iovec iov[3];
+
+   header_length = snprintf(&header[0], sizeof(header), "%zX\r\n", length);
+
+   if (ssl == NULL)
+   {
+      iov[0].iov_base = &header[0];
+      iov[0].iov_len = header_length;
+      iov[1].iov_base = data;
+      iov[1].iov_len = length;
+      iov[2].iov_base = "\r\n";
+      iov[2].iov_len = 2;
+
+      return write_vector(socket, &iov[0], 3);
+   }
+
+   return ssl_write_chunk(ssl, &header[0], header_length, data, length);
+}
+
 void
 pgexporter_clear_message(void)
 {
@@ -622,15 +669,45 @@ pgexporter_create_startup_message(char* username, char* database, struct message
    return MESSAGE_STATUS_OK;
 }
 
+int
+pgexporter_create_cancel_request_message(int pid, int secret, struct message** msg)
+{
+   struct message* m = NULL;
+   size_t size;
+
+   size = 16;
+
+   m = (struct message*)malloc(sizeof(struct message));
+   m->data = malloc(size);
+
+   memset(m->data, 0, size);
+
+   m->kind = 0;
+   m->length = size;
+
+   pgexporter_write_int32(m->data, size);
+   pgexporter_write_int32(m->data + 4, 80877102);
+   pgexporter_write_int32(m->data + 8, pid);
+   pgexporter_write_int32(m->data + 12, secret);
+
+   *msg = m;
+
+   return MESSAGE_STATUS_OK;
+}
+
 static int
 read_message(int socket, bool block, int timeout, struct message** msg)
 {
    bool keep_read = false;
+   bool uring = false;
    ssize_t numbytes;
    struct timeval tv;
    struct message* m = NULL;
 
-   if (unlikely(timeout > 0))
+   /* A read with a linked timeout replaces the socket option calls */
+   uring = timeout > 0 && pgexporter_uring_available();
+
+   if (unlikely(timeout > 0 && !uring))
    {
       tv.tv_sec = timeout;
       tv.tv_usec = 0;
@@ -641,7 +718,14 @@ read_message(int socket, bool block, int timeout, struct message** msg)
    {
       m = pgexporter_memory_message();
 
-      numbytes = read(socket, m->data, DEFAULT_BUFFER_SIZE);
+      if (uring)
+      {
+         numbytes = pgexporter_uring_read(socket, m->data, DEFAULT_BUFFER_SIZE, timeout);
+      }
+      else
+      {
+         numbytes = read(socket, m->data, DEFAULT_BUFFER_SIZE);
+      }
 
       if (likely(numbytes > 0))
       {
@@ -649,7 +733,7 @@ read_message(int socket, bool block, int timeout, struct message** msg)
          m->length = numbytes;
          *msg = m;
 
-         if (unlikely(timeout > 0))
+         if (unlikely(timeout > 0 && !uring))
          {
             tv.tv_sec = 0;
             tv.tv_usec = 0;
@@ -669,7 +753,7 @@ read_message(int socket, bool block, int timeout, struct message** msg)
          }
          else
          {
-            if (unlikely(timeout > 0))
+            if (unlikely(timeout > 0 && !uring))
             {
                tv.tv_sec = 0;
                tv.tv_usec = 0;
@@ -696,7 +780,7 @@ read_message(int socket, bool block, int timeout, struct message** msg)
    }
    while (keep_read);
 
-   if (unlikely(timeout > 0))
+   if (unlikely(timeout > 0 && !uring))
    {
       tv.tv_sec = 0;
       tv.tv_usec = 0;
@@ -717,6 +801,8 @@ write_message(int socket, struct message* msg)
    ssize_t totalbytes;
    ssize_t remaining;
    ssize_t write_size;
+   struct iovec iov[URING_ENTRIES];
+   int iovcnt;
 
 #ifdef DEBUG
    assert(msg != NULL);
@@ -731,9 +817,28 @@ write_message(int socket, struct message* msg)
    {
       keep_write = false;
 
-      write_size = MIN(remaining, DEFAULT_BUFFER_SIZE);
+      if (remaining > DEFAULT_BUFFER_SIZE && pgexporter_uring_available())
+      {
+         /* Submit the segments as linked writes in one call */
+         iovcnt = 0;
+         write_size = 0;
 
-      numbytes = write(socket, msg->data + offset, write_size);
+         while (iovcnt < URING_ENTRIES && write_size < remaining)
+         {
+            iov[iovcnt].iov_base = msg->data + offset + write_size;
+            iov[iovcnt].iov_len = MIN(remaining - write_size, DEFAULT_BUFFER_SIZE);
+            write_size += iov[iovcnt].iov_len;
+            iovcnt++;
+         }
+
+         numbytes = pgexporter_uring_write(socket, &iov[0], iovcnt);
+      }
+      else
+      {
+         write_size = MIN(remaining, DEFAULT_BUFFER_SIZE);
+
+         numbytes = write(socket, msg->data + offset, write_size);
+      }
 
       if (numbytes >= 0)
       {
@@ -862,6 +967,86 @@ ssl_read_message(SSL* ssl, int timeout, struct message** msg)
    return MESSAGE_STATUS_ERROR;
 }
 
+static int
+read_buffer(int socket, void* buffer, size_t size, size_t* length)
+{
+   ssize_t numbytes;
+
+   while (true)
+   {
+      numbytes = read(socket, buffer, size);
+
+      if (likely(numbytes > 0))
+      {
+         *length = (size_t)numbytes;
+         return MESSAGE_STATUS_OK;
+      }
+      else if (numbytes == 0)
+      {
+         return MESSAGE_STATUS_ZERO;
+      }
+      else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+         return MESSAGE_STATUS_ERROR;
+      }
+
+      errno = 0;
+   }
+}
+
+static int
+ssl_read_buffer(SSL* ssl, void* buffer, size_t size, size_t* length)
+{
+   int numbytes;
+   unsigned long err;
+
+   size = MIN(size, (size_t)INT_MAX);
+
+   while (true)
+   {
+      numbytes = SSL_read(ssl, buffer, (int)size);
+
+      if (likely(numbytes > 0))
+      {
+         *length = (size_t)numbytes;
+         return MESSAGE_STATUS_OK;
+      }
+
+      err = SSL_get_error(ssl, numbytes);
+      switch (err)
+      {
+         case SSL_ERROR_ZERO_RETURN:
+            ERR_clear_error();
+            return MESSAGE_STATUS_ZERO;
+         case SSL_ERROR_WANT_READ:
+         case SSL_ERROR_WANT_WRITE:
+         case SSL_ERROR_WANT_CONNECT:
+         case SSL_ERROR_WANT_ACCEPT:
+         case SSL_ERROR_WANT_X509_LOOKUP:
+#ifndef HAVE_OPENBSD
+         case SSL_ERROR_WANT_ASYNC:
+         case SSL_ERROR_WANT_ASYNC_JOB:
+         case SSL_ERROR_WANT_CLIENT_HELLO_CB:
+#endif
+            break;
+         case SSL_ERROR_SYSCALL:
+            err = ERR_get_error();
+            pgexporter_log_error("SSL_ERROR_SYSCALL: %s (%d)", strerror(errno), SSL_get_fd(ssl));
+            pgexporter_log_error("Reason: %s", ERR_reason_error_string(err));
+            errno = 0;
+            ERR_clear_error();
+            return MESSAGE_STATUS_ERROR;
+         default:
+            err = ERR_get_error();
+            pgexporter_log_error("SSL_ERROR_SSL: %s (%d)", strerror(errno), SSL_get_fd(ssl));
+            pgexporter_log_error("Reason: %s", ERR_reason_error_string(err));
+            ERR_clear_error();
+            return MESSAGE_STATUS_ERROR;
+      }
+      ERR_clear_error();
+   }
+}
+
 static int
 ssl_write_message(SSL* ssl, struct message* msg)
 {
@@ -951,3 +1136,116 @@ ssl_write_message(SSL* ssl, struct message* msg)
 
    return MESSAGE_STATUS_ERROR;
 }
+
+static int
+write_vector(int socket, struct iovec* iov, int iovcnt)
+{
+   ssize_t numbytes;
+
+   while (iovcnt > 0)
+   {
+      if (pgexporter_uring_available())
+      {
+         /* The chunk header, data and trailer are linked writes in one call */
+         numbytes = pgexporter_uring_write(socket, iov, iovcnt);
+      }
+      else
+      {
+         numbytes = writev(socket, iov, iovcnt);
+      }
+
+      if (numbytes == -1)
+      {
+         if (errno == EAGAIN || errno == EINTR)
+         {
+            errno = 0;
+            continue;
+         }
+
+         pgexporter_log_debug("Error %d - %d/%s", socket, errno, strerror(errno));
+         errno = 0;
+
+         return MESSAGE_STATUS_ERROR;
+      }
+
+      while (iovcnt > 0 && (size_t)numbytes >= iov->iov_len)
+      {
+         numbytes -= iov->iov_len;
+         iov++;
+         iovcnt--;
+      }
+
+      if (iovcnt > 0)
+      {
+         iov->iov_base = (char*)iov->iov_base + numbytes;
+         iov->iov_len -= numbytes;
+      }
+   }
+
+   return MESSAGE_STATUS_OK;
+}
+
+static int
+ssl_write_chunk(SSL* ssl, char* header, size_t header_length, char* data, size_t length)
+{
+   char record[CHUNK_RECORD_SIZE + 2];
+   size_t first;
+   size_t last;
+   struct message msg;
+
+   memset(&msg, 0, sizeof(struct message));
+
+   /* The framing shares a TLS record with the start and the end of the data, */
+   /* so only those parts are copied and the rest is written directly */
+   if (header_length + length + 2 <= CHUNK_RECORD_SIZE)
+   {
+      first = length;
+      last = 0;
+   }
+   else
+   {
+      first = MIN(length, CHUNK_RECORD_SIZE - header_length);
+      last = MIN(length - first, CHUNK_RECORD_SIZE - 2);
+   }
+
+   memcpy(&record[0], header, header_length);
+   memcpy(&record[header_length], data, first);
+   msg.length = header_length + first;
+
+   if (last == 0)
+   {
+      memcpy(&record[msg.length], "\r\n", 2);
+      msg.length += 2;
+   }
+
+   msg.data = &record[0];
+
+   if (ssl_write_message(ssl, &msg) != MESSAGE_STATUS_OK)
+   {
+      return MESSAGE_STATUS_ERROR;
+   }
+
+   if (last == 0)
+   {
+      return MESSAGE_STATUS_OK;
+   }
+
+   if (length - first - last > 0)
+   {
+      msg.data = data + first;
+      msg.length = length - first - last;
+
+      if (ssl_write_message(ssl, &msg) != MESSAGE_STATUS_OK)
+      {
+         return MESSAGE_STATUS_ERROR;
+      }
+   }
+
+   memcpy(&record[0], data + length - last, last);
+   memcpy(&record[last], "\r\n", 2);
+
+   msg.data = &record[0];
+   msg.length = last + 2;
+
+   return ssl_write_message(ssl, &msg);
+}
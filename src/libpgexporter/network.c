@@ -36,6 +36,7 @@
 #include <fcntl.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,6 +45,7 @@
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/wait.h>
@@ -229,6 +231,16 @@ pgexporter_remove_unix_socket(const char* directory, const char* file)
 int
 pgexporter_connect(const char* hostname, int port, int* fd)
 {
+   return pgexporter_connect_timeout(hostname, port, 0, fd);
+}
+
+/**
+ *
+ */
+int
+pgexporter_connect_timeout(const char* hostname, int port, int timeout, int* fd)
+{
+   struct timeval tv;
    struct addrinfo hints = {0};
    struct addrinfo* servinfo = NULL;
    struct addrinfo* p = NULL;
@@ -238,6 +250,11 @@ pgexporter_connect(const char* hostname, int port, int* fd)
    char sport[6];
    int error = 0;
    int default_buffer_size = DEFAULT_BUFFER_SIZE;
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+   int keep_idle = 60;
+   int keep_interval = 10;
+   int keep_count = 6;
+#endif
    struct configuration* config;
 
    config = (struct configuration*)shmem;
@@ -283,6 +300,15 @@ pgexporter_connect(const char* hostname, int port, int* fd)
                *fd = -1;
                continue;
             }
+
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+            /* A peer gone silently is found within two minutes instead of two hours,
+               such that the connection is closed before a scrape uses it */
+            setsockopt(*fd, IPPROTO_TCP, TCP_KEEPIDLE, &keep_idle, optlen);
+            setsockopt(*fd, IPPROTO_TCP, TCP_KEEPINTVL, &keep_interval, optlen);
+            setsockopt(*fd, IPPROTO_TCP, TCP_KEEPCNT, &keep_count, optlen);
+            errno = 0;
+#endif
          }
 
          if (config != NULL && config->nodelay)
@@ -318,6 +344,22 @@ pgexporter_connect(const char* hostname, int port, int* fd)
             }
          }
 
+         // A blocking connect gives up once the send timeout expires
+         if (timeout > 0)
+         {
+            tv.tv_sec = timeout;
+            tv.tv_usec = 0;
+
+            if (setsockopt(*fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+            {
+               error = errno;
+               pgexporter_disconnect(*fd);
+               errno = 0;
+               *fd = -1;
+               continue;
+            }
+         }
+
          if (connect(*fd, p->ai_addr, p->ai_addrlen) == -1)
          {
             error = errno;
@@ -326,6 +368,13 @@ pgexporter_connect(const char* hostname, int port, int* fd)
             *fd = -1;
             continue;
          }
+
+         if (timeout > 0)
+         {
+            tv.tv_sec = 0;
+            tv.tv_usec = 0;
+            setsockopt(*fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+         }
       }
    }
 
@@ -417,6 +466,40 @@ pgexporter_socket_isvalid(int fd)
    return true;
 }
 
+bool
+pgexporter_socket_alive(int fd)
+{
+   int r;
+   struct pollfd pfd;
+
+   if (!pgexporter_socket_isvalid(fd))
+   {
+      return false;
+   }
+
+   pfd.fd = fd;
+   pfd.events = POLLIN;
+#ifdef POLLRDHUP
+   pfd.events |= POLLRDHUP;
+#endif
+   pfd.revents = 0;
+
+   do
+   {
+      r = poll(&pfd, 1, 0);
+   }
+   while (r == -1 && errno == EINTR);
+
+   if (r == -1)
+   {
+      errno = 0;
+      return false;
+   }
+
+   /* Nothing is pending on an idle connection */
+   return r == 0;
+}
+
 /**
  *
  */
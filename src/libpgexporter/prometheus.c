@@ -29,20 +29,33 @@
 /* pgexporter */
 #include <openssl/crypto.h>
 #include <pgexporter.h>
+#include <arena.h>
 #include <art.h>
+#include <cache.h>
+#include <catalog.h>
+#include <cluster.h>
+#include <filter.h>
 #include <logging.h>
 #include <memory.h>
 #include <message.h>
 #include <network.h>
 #include <prometheus.h>
+#include <protobuf.h>
 #include <queries.h>
-#include <query_alts.h>
+#include <remote_write.h>
 #include <security.h>
 #include <shmem.h>
+#include <stats.h>
+#include <trace.h>
 #include <utils.h>
 
 /* system */
+#ifdef DEBUG
+#include <assert.h>
+#endif
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -51,18 +64,41 @@
 
 #define CHUNK_SIZE 32768
 
+#define OUTPUT_CHUNK_SIZE   65536
+#define OUTPUT_CHUNK_HEADER 10
+
+#define PROMETHEUS_CONTENT_TYPE  "text/plain; version=0.0.1; charset=utf-8"
+#define OPENMETRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+#define PROTOBUF_CONTENT_TYPE    "application/vnd.google.protobuf; proto=io.prometheus.client.MetricFamily; encoding=delimited"
+
+#define OUTPUT_FORMAT_TEXT        0
+#define OUTPUT_FORMAT_OPENMETRICS 1
+#define OUTPUT_FORMAT_PROTOBUF    2
+
+/* The types of io.prometheus.client.MetricType */
+#define PROTOBUF_TYPE_COUNTER 0
+#define PROTOBUF_TYPE_GAUGE   1
+#define PROTOBUF_TYPE_UNTYPED 3
+
 #define PAGE_UNKNOWN 0
 #define PAGE_HOME    1
 #define PAGE_METRICS 2
+#define PAGE_CLUSTER 3
 #define BAD_REQUEST  3
 
 #define MAX_ARR_LENGTH 256
 #define NUMBER_OF_HISTOGRAM_COLUMNS 4
 
+#define FINGERPRINT_BASIS 14695981039346656037ULL
+
 #define INPUT_NO   0
 #define INPUT_DATA 1
 #define INPUT_WAL  2
 
+#define DISK_SPACE_USED  0
+#define DISK_SPACE_FREE  1
+#define DISK_SPACE_TOTAL 2
+
 /**
  * ART-based metric value with timestamp
  */
@@ -90,8 +126,44 @@ typedef struct prometheus_metrics_container
    struct art* extension_list_metrics;
    struct art* settings_metrics;
    struct art* custom_metrics;
+   struct arena* arena;                 /**< The memory of the metric values */
+   struct arena* custom_arena;          /**< The memory of the custom metric values, or NULL to allocate them */
+   struct arena* static_arena;          /**< The memory of the version, extension list and settings values, or NULL to allocate them */
+   uint64_t version_fingerprint;        /**< The fingerprint of the version metrics, 0 if none */
+   uint64_t extension_list_fingerprint; /**< The fingerprint of the extension list metrics, 0 if none */
+   uint64_t settings_fingerprint;       /**< The fingerprint of the settings metrics, 0 if none */
 } prometheus_metrics_container_t;
 
+/**
+ * The state of a custom metric in the background collector
+ */
+typedef struct custom_state
+{
+   time_t collected;     /* The time of the last collection */
+   uint64_t fingerprint; /* The fingerprint of the last results, 0 if none */
+   bool unchanged;       /* Were the last results the same as the ones before */
+   struct art** rows;    /* The fingerprint of the values of each row by its labels, per server, for an incremental metric */
+} custom_state_t;
+
+/**
+ * The metrics being output, sent as HTTP chunks of about
+ * OUTPUT_CHUNK_SIZE bytes. The data starts with room for
+ * the size of the chunk, such that a chunk is a single write
+ */
+typedef struct output_buffer
+{
+   SSL* client_ssl;
+   int client_fd;
+   struct builder data;
+   int status;
+   uint64_t send;
+   int format;            /* The format of the output */
+   int type;              /* The type of the current family */
+   struct builder name;   /* The name of the current family */
+   struct builder family; /* The current MetricFamily of the protobuf format */
+   struct builder metric; /* The current Metric of the protobuf format */
+} output_buffer_t;
+
 /**
  * This is a linked list of queries with the data received from the server
  * as well as the query sent to the server and other meta data.
@@ -102,10 +174,83 @@ typedef struct query_list
    struct query_list* next;
    struct query_alts* query_alt;
    char tag[MISC_LENGTH];
+   char database[MISC_LENGTH]; /* The database of the result, empty for the postgres database */
    int sort_type;
    bool error;
 } query_list_t;
 
+/**
+ * The buckets of the histograms of a scrape. The array of upper bounds
+ * is decoded once into the le labels, which are reused for all the rows
+ * with the same bounds
+ **/
+typedef struct histogram_buckets
+{
+   struct builder bounds;  /* The array of upper bounds of the labels */
+   struct builder labels;  /* The le labels, each one zero terminated */
+   size_t* offsets;        /* The offset of the label of each bucket */
+   int number_of_buckets;  /* The number of buckets */
+   int capacity;           /* The capacity of the offsets */
+   bool infinity;          /* Is the last upper bound +Inf */
+   struct builder common;  /* The labels of the row */
+   struct builder key;     /* The key of the sample */
+   struct builder value;   /* The value of the sample */
+} histogram_buckets_t;
+
+/**
+ * A database of a server with metrics collected from it
+ **/
+typedef struct custom_metrics_database
+{
+   int server;
+   char database[MISC_LENGTH];
+   bool all; /* Does the database allow connections, so the metrics of all databases apply */
+} custom_metrics_database_t;
+
+/**
+ * The shared state of the threads collecting custom metrics.
+ * Servers are handed out one at a time, and each server owns the
+ * slots [metric * number_of_servers + server] of the results.
+ * The results of a metric collected per database follow the slot
+ * as a list, ordered by database
+ **/
+typedef struct custom_metrics_task
+{
+   atomic_int next;
+   atomic_int next_database;
+   int number_of_servers;
+   int number_of_metrics;
+   struct catalog* catalog;
+   uint64_t* selected;
+   query_list_t* results;
+   int lanes[NUMBER_OF_SERVERS];        /* The number of connections of each server */
+   int replica;                         /* The replica of the metrics of any replica, or -1 */
+   bool multiplexed[NUMBER_OF_SERVERS]; /* Is the server queried together with the others by one thread */
+   custom_metrics_database_t* databases; /* The databases queried after the servers */
+   int number_of_databases;
+   pthread_mutex_t lock;                 /* Protects the lists of the results of the databases */
+} custom_metrics_task_t;
+
+/**
+ * The queries of a server run on one of its connections
+ **/
+typedef struct custom_metrics_lane
+{
+   int server;
+   int lane;
+   struct query_request* requests;
+   int number_of_requests;
+} custom_metrics_lane_t;
+
+/**
+ * The estimated duration of a query, to spread the queries over the connections
+ **/
+typedef struct custom_metrics_weight
+{
+   int request;
+   uint64_t duration;
+} custom_metrics_weight_t;
+
 /**
  * This is one of the nodes of a linked list of a column entry.
  *
@@ -138,61 +283,173 @@ typedef struct column_store
    int sort_type;
 } column_store_t;
 
-static int resolve_page(struct message* msg);
+/**
+ * A built-in collector
+ **/
+typedef struct builtin_collector
+{
+   char* name;
+   void (*collect)(prometheus_metrics_container_t* container);
+} builtin_collector_t;
+
+static int resolve_page(struct message* msg, struct metrics_filter* filter);
+static int output_format(struct message* msg);
 static int badrequest_page(SSL* client_ssl, int client_fd);
 static int unknown_page(SSL* client_ssl, int client_fd);
 static int home_page(SSL* client_ssl, int client_fd);
-static int metrics_page(SSL* client_ssl, int client_fd);
+static int cluster_page(SSL* client_ssl, int client_fd);
+static int metrics_page(SSL* client_ssl, int client_fd, int encoding, int format, struct metrics_filter* filter);
+static int metrics_collect(SSL* client_ssl, int client_fd, int format);
+static int uncached_page(SSL* client_ssl, int client_fd, int format, struct metrics_filter* filter);
+static int snapshot_page(SSL* client_ssl, int client_fd, int encoding);
 static int bad_request(SSL* client_ssl, int client_fd);
 static int redirect_page(SSL* client_ssl, int client_fd, char* path);
 
 static bool collector_pass(const char* collector);
+static bool request_pass(const char* collector, const char* prefix);
 
 // ART-based metric handling functions
 static int create_metrics_container(prometheus_metrics_container_t** container);
 static void destroy_metrics_container(prometheus_metrics_container_t* container);
-static int add_metric_to_art(struct art* art_tree, char* key, char* value, char* help, char* type, time_t timestamp, int sort_type);
-static void output_art_metrics(SSL* client_ssl, int client_fd, struct art* art_tree, char* category_name);
-static void output_all_metrics(SSL* client_ssl, int client_fd, prometheus_metrics_container_t* container);
+static int add_metric_to_art(struct arena* arena, struct art* art_tree, char* key, char* value, char* help, char* type, time_t timestamp, int sort_type);
+static void output_art_metrics(output_buffer_t* out, struct art* art_tree, char* category_name);
+static uint64_t fingerprint_mix(uint64_t fingerprint, void* data, size_t length);
+static bool static_metrics_unchanged(struct art** art, uint64_t* last, uint64_t fingerprint, time_t timestamp);
+static void static_metrics_keep(struct art** to, struct art** from);
+static void refresh_metrics(struct art* art, time_t timestamp);
+static void output_all_metrics(SSL* client_ssl, int client_fd, prometheus_metrics_container_t* container, int format);
+static void output_family(output_buffer_t* out, char* key, size_t name_length, prometheus_metric_value_t* metric);
+static void output_protobuf(output_buffer_t* out, char* key, size_t name_length, prometheus_metric_value_t* metric);
+static void output_protobuf_labels(struct builder* builder, char* labels);
+static void output_protobuf_end(output_buffer_t* out);
 static void prometheus_metric_value_destroy_cb(uintptr_t data);
 static char* prometheus_metric_value_string_cb(uintptr_t data, int32_t format, char* tag, int indent);
 
+static void builtin_metrics(prometheus_metrics_container_t* container);
 static void general_information(prometheus_metrics_container_t* container);
+static void cache_overflows(prometheus_metrics_container_t* container, char* name, void* cache, time_t current_time);
+static void cluster_information(prometheus_metrics_container_t* container, time_t current_time);
 static void core_information(prometheus_metrics_container_t* container);
 static void extension_information(prometheus_metrics_container_t* container);
 static void extension_list_information(prometheus_metrics_container_t* container);
 static void extension_function(char* function, int input, char* description, char* type, prometheus_metrics_container_t* container);
+static void disk_space_information(struct tuple* functions[], prometheus_metrics_container_t* container);
+static bool local_directory(int server, char* directory);
 static void server_information(prometheus_metrics_container_t* container);
 static void version_information(prometheus_metrics_container_t* container);
 static void uptime_information(prometheus_metrics_container_t* container);
 static void primary_information(prometheus_metrics_container_t* container);
+static void server_role(int server);
 static void settings_information(prometheus_metrics_container_t* container);
-static void custom_metrics(prometheus_metrics_container_t* container);
+static void custom_metrics(prometheus_metrics_container_t* container, bool* due, custom_state_t* state);
+static void custom_metrics_samples(struct art* art, struct catalog* catalog, int metric, bool remove, time_t timestamp);
+static void* custom_metrics_worker(void* arg);
+static void custom_metrics_run(custom_metrics_task_t* task);
+static void custom_metrics_server(int server, custom_metrics_task_t* task);
+static int custom_metrics_requests(int server, custom_metrics_database_t* database, custom_metrics_task_t* task,
+                                   struct query_request* requests, query_list_t** slots);
+static bool custom_metrics_role(custom_metrics_task_t* task, struct prometheus* prom, int server);
+static void custom_metrics_databases(custom_metrics_task_t* task);
+static int custom_metrics_database_add(custom_metrics_task_t* task, int server, char* database, size_t length, bool all);
+static void* custom_metrics_database_worker(void* arg);
+static void custom_metrics_database_run(custom_metrics_task_t* task);
+static query_list_t* custom_metrics_database_slot(custom_metrics_task_t* task, int metric, int server, char* database);
+static char* database_element(char** p, size_t* length);
+static bool database_match(char* databases, custom_metrics_database_t* database);
+static void custom_metrics_results(int server, struct query_request* requests, query_list_t** slots, int number_of_requests);
+static void custom_metrics_multiplex(custom_metrics_task_t* task);
+static void custom_metrics_lanes(int server, struct query_request* requests, query_list_t** slots,
+                                 int number_of_requests, int number_of_lanes);
+static void* custom_metrics_lane_worker(void* arg);
+static void custom_metrics_query(int server, int lane, struct query_request* requests, int number_of_requests);
+static int custom_metrics_weight_compare(const void* a, const void* b);
+static void collector_stats(int server, int collector, uint64_t start, int ret, struct query* query);
+static void sample_metrics(prometheus_metrics_container_t* container, histogram_buckets_t* buckets, char* pool,
+                           query_list_t* temp, int server, time_t timestamp, struct art** rows);
+static bool custom_metrics_incremental(custom_metrics_task_t* task, int metric, custom_state_t* state);
+static void custom_metrics_rows_destroy(custom_state_t* state, int number_of_servers);
+static void histogram_metrics(prometheus_metrics_container_t* container, histogram_buckets_t* buckets, char* pool,
+                              query_list_t* temp, int server, time_t timestamp);
+static int histogram_bounds(histogram_buckets_t* buckets, char* bounds);
+static char* histogram_element(char** p, size_t* length);
+static void histogram_buckets_destroy(histogram_buckets_t* buckets);
+static void append_label_value(struct builder* builder, char* value);
 
 static int send_chunk(SSL* client_ssl, int client_fd, char* data);
 
+static void output_append(output_buffer_t* out, char* data, size_t length);
+static void output_flush(output_buffer_t* out);
+
 static int safe_prometheus_key_additional_length(char* key);
 static char* safe_prometheus_key(char* key);
 static void safe_prometheus_key_free(char* key);
 
 static bool is_metrics_cache_configured(void);
-static bool is_metrics_cache_valid(void);
-static bool metrics_cache_append(char* data);
+static bool metrics_cache_append(char* data, size_t length);
 static bool metrics_cache_finalize(void);
 static size_t metrics_cache_size_to_alloc(void);
-static void metrics_cache_invalidate(void);
+
+static void snapshot_publish(prometheus_metrics_container_t* container);
+static void remote_write_publish(prometheus_metrics_container_t* container, time_t since);
+static void remote_write_art(struct art* art_tree, time_t since);
+static void snapshot_append(char* data, size_t length);
+
+/* The state of the background collector, only used by its process */
+static prometheus_metrics_container_t* collector_container = NULL;
+static time_t collector_builtin = 0;
+static custom_state_t* collector_custom = NULL;
+static int collector_number_of_metrics = 0;
+
+/* The extension functions of the disk space, in the order of the columns of pgexporter_query_disk_space() */
+static char* disk_space_functions[] = {"pgexporter_used_space", "pgexporter_free_space", "pgexporter_total_space"};
+
+/* The built-in collectors, in the order they are run */
+static builtin_collector_t builtin_collectors[] = {
+   {"general_information", general_information},
+   {"core_information", core_information},
+   {"server_information", server_information},
+   {"version_information", version_information},
+   {"uptime_information", uptime_information},
+   {"primary_information", primary_information},
+   {"settings_information", settings_information},
+   {"extension_information", extension_information},
+   {"extension_list_information", extension_list_information},
+};
+
+/* The replica the metrics of any replica were last collected from, kept by a process while it is connected */
+static int any_replica = -1;
+
+/* The filter of the request being served, only used by its process */
+static struct metrics_filter* request_filter = NULL;
 
 void
 pgexporter_prometheus(SSL* client_ssl, int client_fd)
 {
    int status;
-   int page;
-   struct message* msg = NULL;
-   struct configuration* config;
 
    pgexporter_start_logging();
    pgexporter_memory_init();
 
+   status = pgexporter_prometheus_serve(client_ssl, client_fd);
+
+   pgexporter_close_ssl(client_ssl);
+   pgexporter_disconnect(client_fd);
+
+   pgexporter_memory_destroy();
+   pgexporter_stop_logging();
+
+   exit(status);
+}
+
+int
+pgexporter_prometheus_serve(SSL* client_ssl, int client_fd)
+{
+   int status;
+   int page;
+   struct message* msg = NULL;
+   struct metrics_filter filter;
+   struct configuration* config;
+
    config = (struct configuration*)shmem;
    if (client_ssl)
    {
@@ -240,15 +497,9 @@ pgexporter_prometheus(SSL* client_ssl, int client_fd)
             goto error;
          }
 
-         pgexporter_close_ssl(client_ssl);
-         pgexporter_disconnect(client_fd);
-
-         pgexporter_memory_destroy();
-         pgexporter_stop_logging();
-
          free(base_url);
 
-         exit(0);
+         return 0;
       }
    }
    status = pgexporter_read_timeout_message(client_ssl, client_fd, config->authentication_timeout, &msg);
@@ -258,7 +509,7 @@ pgexporter_prometheus(SSL* client_ssl, int client_fd)
       goto error;
    }
 
-   page = resolve_page(msg);
+   page = resolve_page(msg, &filter);
 
    if (page == PAGE_HOME)
    {
@@ -266,7 +517,11 @@ pgexporter_prometheus(SSL* client_ssl, int client_fd)
    }
    else if (page == PAGE_METRICS)
    {
-      metrics_page(client_ssl, client_fd);
+      metrics_page(client_ssl, client_fd, pgexporter_cache_encoding(msg), output_format(msg), &filter);
+   }
+   else if (page == PAGE_CLUSTER)
+   {
+      cluster_page(client_ssl, client_fd);
    }
    else if (page == PAGE_UNKNOWN)
    {
@@ -277,55 +532,30 @@ pgexporter_prometheus(SSL* client_ssl, int client_fd)
       bad_request(client_ssl, client_fd);
    }
 
-   pgexporter_close_ssl(client_ssl);
-   pgexporter_disconnect(client_fd);
-
-   pgexporter_memory_destroy();
-   pgexporter_stop_logging();
-
-   exit(0);
+   return 0;
 
 error:
 
    badrequest_page(client_ssl, client_fd);
 
-   pgexporter_close_ssl(client_ssl);
-   pgexporter_disconnect(client_fd);
-
-   pgexporter_memory_destroy();
-   pgexporter_stop_logging();
-
-   exit(1);
+   return 1;
 }
 
 void
 pgexporter_prometheus_reset(void)
 {
-   signed char cache_is_free;
    struct configuration* config;
    struct prometheus_cache* cache;
 
    config = (struct configuration*)shmem;
    cache = (struct prometheus_cache*)prometheus_cache_shmem;
 
-retry_cache_locking:
-   cache_is_free = STATE_FREE;
-   if (atomic_compare_exchange_strong(&cache->lock, &cache_is_free, STATE_IN_USE))
-   {
-      metrics_cache_invalidate();
+   pgexporter_cache_invalidate(cache);
 
-      atomic_store(&config->logging_info, 0);
-      atomic_store(&config->logging_warn, 0);
-      atomic_store(&config->logging_error, 0);
-      atomic_store(&config->logging_fatal, 0);
-
-      atomic_store(&cache->lock, STATE_FREE);
-   }
-   else
-   {
-      /* Sleep for 1ms */
-      SLEEP_AND_GOTO(1000000L, retry_cache_locking);
-   }
+   atomic_store(&config->logging_info, 0);
+   atomic_store(&config->logging_warn, 0);
+   atomic_store(&config->logging_error, 0);
+   atomic_store(&config->logging_fatal, 0);
 }
 
 void
@@ -354,6 +584,175 @@ pgexporter_prometheus_logging(int type)
    }
 }
 
+int
+pgexporter_prometheus_collect(void)
+{
+   int interval;
+   int next;
+   time_t now;
+   uint64_t start;
+   bool builtin = false;
+   bool custom = false;
+   bool traced = false;
+   bool* due = NULL;
+   prometheus_metrics_container_t* container = NULL;
+   struct catalog* catalog = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+   catalog = pgexporter_catalog_get(config);
+
+   now = time(NULL);
+   next = config->collection_interval;
+
+   // The collector is started over by a reload, so the metrics don't change
+   if (collector_custom == NULL)
+   {
+      collector_custom = (custom_state_t*)calloc(MAX(catalog->number_of_metrics, 1), sizeof(custom_state_t));
+      collector_number_of_metrics = collector_custom != NULL ? catalog->number_of_metrics : 0;
+   }
+
+   due = (bool*)calloc(MAX(catalog->number_of_metrics, 1), sizeof(bool));
+
+   if (collector_custom == NULL || due == NULL)
+   {
+      pgexporter_log_error("Unable to allocate the state of the collector");
+      free(due);
+      return MAX(next, 1);
+   }
+
+   if (collector_container == NULL || now - collector_builtin >= config->collection_interval)
+   {
+      builtin = true;
+      collector_builtin = now;
+   }
+   else
+   {
+      next = config->collection_interval - (int)(now - collector_builtin);
+   }
+
+   for (int i = 0; i < catalog->number_of_metrics; i++)
+   {
+      interval = catalog->prometheus[i].interval > 0 ? catalog->prometheus[i].interval : config->collection_interval;
+
+      // A result that didn't change is queried less often
+      if (collector_custom[i].unchanged && catalog->prometheus[i].refresh_interval > interval)
+      {
+         interval = catalog->prometheus[i].refresh_interval;
+      }
+
+      if (collector_container == NULL || now - collector_custom[i].collected >= interval)
+      {
+         due[i] = true;
+         custom = true;
+         collector_custom[i].collected = now;
+         next = MIN(next, interval);
+      }
+      else
+      {
+         next = MIN(next, interval - (int)(now - collector_custom[i].collected));
+      }
+   }
+
+   if (!builtin && !custom)
+   {
+      free(due);
+      return MAX(next, 1);
+   }
+
+   if (builtin)
+   {
+      // The built-in metrics are collected as a whole, so start over with new trees
+      if (create_metrics_container(&container))
+      {
+         pgexporter_log_error("Unable to allocate the metrics of the collector");
+         free(due);
+         return MAX(next, 1);
+      }
+
+      // The custom metrics outlive a collection of the built-in metrics,
+      // and their values are replaced one by one, so they can't use the arena.
+      // Neither can the static metrics, which are kept while their results are the same
+      container->custom_arena = NULL;
+      container->static_arena = NULL;
+
+      if (collector_container != NULL)
+      {
+         static_metrics_keep(&container->custom_metrics, &collector_container->custom_metrics);
+         static_metrics_keep(&container->version_metrics, &collector_container->version_metrics);
+         static_metrics_keep(&container->extension_list_metrics, &collector_container->extension_list_metrics);
+         static_metrics_keep(&container->settings_metrics, &collector_container->settings_metrics);
+
+         container->version_fingerprint = collector_container->version_fingerprint;
+         container->extension_list_fingerprint = collector_container->extension_list_fingerprint;
+         container->settings_fingerprint = collector_container->settings_fingerprint;
+
+         destroy_metrics_container(collector_container);
+      }
+
+      collector_container = container;
+   }
+
+   traced = pgexporter_trace_start(TRACE_KIND_COLLECTOR);
+
+   start = pgexporter_stats_now();
+
+   pgexporter_open_connections();
+
+   if (builtin)
+   {
+      builtin_metrics(collector_container);
+   }
+
+   if (custom)
+   {
+      uint64_t span = pgexporter_trace_begin();
+
+      custom_metrics(collector_container, due, collector_custom);
+
+      pgexporter_trace_end("custom_metrics", -1, span);
+   }
+
+   free(due);
+
+   pgexporter_close_connections();
+
+   pgexporter_stats_phase(STATS_PHASE_COLLECT, start);
+
+   if (traced)
+   {
+      pgexporter_trace_finish();
+   }
+
+   snapshot_publish(collector_container);
+
+   if (pgexporter_remote_write_active())
+   {
+      remote_write_publish(collector_container, now);
+   }
+
+   return MAX(next, 1);
+}
+
+void
+pgexporter_prometheus_collect_destroy(void)
+{
+   destroy_metrics_container(collector_container);
+   collector_container = NULL;
+
+   for (int i = 0; collector_custom != NULL && i < collector_number_of_metrics; i++)
+   {
+      custom_metrics_rows_destroy(&collector_custom[i], NUMBER_OF_SERVERS);
+      free(collector_custom[i].rows);
+   }
+   free(collector_custom);
+   collector_custom = NULL;
+   collector_number_of_metrics = 0;
+
+   pgexporter_close_lanes();
+   pgexporter_close_databases();
+}
+
 static int
 redirect_page(SSL* client_ssl, int client_fd, char* path)
 {
@@ -395,11 +794,14 @@ redirect_page(SSL* client_ssl, int client_fd, char* path)
 }
 
 static int
-resolve_page(struct message* msg)
+resolve_page(struct message* msg, struct metrics_filter* filter)
 {
    char* from = NULL;
+   char* query = NULL;
    int index;
 
+   memset(filter, 0, sizeof(struct metrics_filter));
+
    if (msg->length < 3 || strncmp((char*)msg->data, "GET", 3) != 0)
    {
       pgexporter_log_debug("Prometheus: Not a GET request");
@@ -416,18 +818,101 @@ resolve_page(struct message* msg)
 
    pgexporter_write_byte(msg->data + index, '\0');
 
+   query = strchr(from, '?');
+   if (query != NULL)
+   {
+      *query = '\0';
+      query++;
+   }
+
    if (strcmp(from, "/") == 0 || strcmp(from, "/index.html") == 0)
    {
       return PAGE_HOME;
    }
    else if (strcmp(from, "/metrics") == 0)
    {
+      if (pgexporter_filter_parse(query, filter))
+      {
+         return BAD_REQUEST;
+      }
+
       return PAGE_METRICS;
    }
+   else if (strcmp(from, "/cluster") == 0 && ((struct configuration*)shmem)->cluster_member != -1)
+   {
+      return PAGE_CLUSTER;
+   }
 
    return PAGE_UNKNOWN;
 }
 
+/**
+ * Select the format of the response from the Accept header of the request,
+ * when metrics_negotiation is enabled
+ * @param msg The request
+ * @return The format
+ */
+static int
+output_format(struct message* msg)
+{
+   char* data = (char*)msg->data;
+   size_t length = (size_t)msg->length;
+   size_t start = 0;
+   size_t end;
+   size_t n;
+   int format = OUTPUT_FORMAT_TEXT;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (!config->metrics_negotiation)
+   {
+      return OUTPUT_FORMAT_TEXT;
+   }
+
+   while (start < length)
+   {
+      end = start;
+      while (end < length && data[end] != '\n')
+      {
+         end++;
+      }
+
+      n = end - start;
+      if (n > 0 && data[start + n - 1] == '\r')
+      {
+         n--;
+      }
+
+      if (n == 0)
+      {
+         /* The end of the headers */
+         break;
+      }
+
+      if (n > 7 && strncasecmp(data + start, "Accept:", 7) == 0)
+      {
+         // A scraper lists the formats it supports, with the one it prefers first
+         for (size_t i = start + 7; i < start + n; i++)
+         {
+            if (start + n - i >= 33 && strncasecmp(data + i, "io.prometheus.client.MetricFamily", 33) == 0)
+            {
+               return OUTPUT_FORMAT_PROTOBUF;
+            }
+
+            if (start + n - i >= 28 && strncasecmp(data + i, "application/openmetrics-text", 28) == 0)
+            {
+               format = OUTPUT_FORMAT_OPENMETRICS;
+            }
+         }
+      }
+
+      start = end + 1;
+   }
+
+   return format;
+}
+
 static int
 badrequest_page(SSL* client_ssl, int client_fd)
 {
@@ -500,6 +985,58 @@ unknown_page(SSL* client_ssl, int client_fd)
    return status;
 }
 
+static int
+cluster_page(SSL* client_ssl, int client_fd)
+{
+   char* data = NULL;
+   time_t now;
+   char time_buf[32];
+   char length[32];
+   int status;
+   struct builder body;
+   struct message msg;
+
+   memset(&msg, 0, sizeof(struct message));
+
+   if (pgexporter_builder_init(&body, 1024) || pgexporter_cluster_status(&body))
+   {
+      pgexporter_builder_destroy(&body);
+      return unknown_page(client_ssl, client_fd);
+   }
+
+   now = time(NULL);
+
+   memset(&time_buf, 0, sizeof(time_buf));
+   ctime_r(&now, &time_buf[0]);
+   time_buf[strlen(time_buf) - 1] = 0;
+
+   snprintf(&length[0], sizeof(length), "%zu", body.length);
+
+   data = pgexporter_vappend(data, 9,
+                             "HTTP/1.1 200 OK\r\n",
+                             "Content-Type: text/plain; charset=utf-8\r\n",
+                             "Date: ",
+                             &time_buf[0],
+                             "\r\n",
+                             "Content-Length: ",
+                             &length[0],
+                             "\r\n",
+                             "\r\n"
+                             );
+   data = pgexporter_append(data, body.data);
+
+   msg.kind = 0;
+   msg.length = strlen(data);
+   msg.data = data;
+
+   status = pgexporter_write_message(client_ssl, client_fd, &msg);
+
+   free(data);
+   pgexporter_builder_destroy(&body);
+
+   return status;
+}
+
 static int
 home_page(SSL* client_ssl, int client_fd)
 {
@@ -508,9 +1045,11 @@ home_page(SSL* client_ssl, int client_fd)
    time_t now;
    char time_buf[32];
    struct message msg;
+   struct catalog* catalog = NULL;
    struct configuration* config;
 
    config = (struct configuration*) shmem;
+   catalog = pgexporter_catalog_get(config);
 
    now = time(NULL);
 
@@ -571,7 +1110,7 @@ home_page(SSL* client_ssl, int client_fd)
    free(data);
    data = NULL;
 
-   if (config->number_of_metrics == 0)
+   if (catalog == NULL || catalog->number_of_metrics == 0)
    {
       data = pgexporter_vappend(data, 7,
                                 "  <li>pg_database</li>\n",
@@ -585,11 +1124,11 @@ home_page(SSL* client_ssl, int client_fd)
    }
    else
    {
-      for (int i = 0; i < config->number_of_metrics; i++)
+      for (int i = 0; i < catalog->number_of_metrics; i++)
       {
          data = pgexporter_vappend(data, 3,
                                    "  <li>",
-                                   config->prometheus[i].tag,
+                                   catalog->prometheus[i].tag,
                                    "</li>\n"
                                    );
       }
@@ -624,121 +1163,68 @@ error:
 }
 
 static int
-metrics_page(SSL* client_ssl, int client_fd)
+metrics_page(SSL* client_ssl, int client_fd, int encoding, int format, struct metrics_filter* filter)
 {
    char* data = NULL;
+   size_t length = 0;
+   bool locked = false;
    time_t start_time;
    int dt;
-   time_t now;
-   char time_buf[32];
    int status;
-   struct message msg;
    struct prometheus_cache* cache;
-   signed char cache_is_free;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
    cache = (struct prometheus_cache*)prometheus_cache_shmem;
 
-   memset(&msg, 0, sizeof(struct message));
-
+   // A filtered response is neither served from nor added to the cache and the snapshot,
+   // and they hold the text format, which a scraper asking for another format also accepts
+   if (pgexporter_filter_active(filter) ||
+       (format != OUTPUT_FORMAT_TEXT && !is_metrics_cache_configured() && config->collection_interval == 0))
+   {
+      return uncached_page(client_ssl, client_fd, format, filter);
+   }
+
+   if (config->collection_interval > 0 && prometheus_snapshot_shmem != NULL &&
+       pgexporter_cache_available((struct prometheus_cache*)prometheus_snapshot_shmem, false))
+   {
+      return snapshot_page(client_ssl, client_fd, encoding);
+   }
+
    start_time = time(NULL);
 
-retry_cache_locking:
-   cache_is_free = STATE_FREE;
-   if (atomic_compare_exchange_strong(&cache->lock, &cache_is_free, STATE_IN_USE))
+   // can serve the message out of cache?
+   if (is_metrics_cache_configured())
    {
-      // can serve the message out of cache?
-      if (is_metrics_cache_configured() && is_metrics_cache_valid())
+      status = pgexporter_cache_write(cache, true, encoding, PROMETHEUS_CONTENT_TYPE, client_ssl, client_fd, &length);
+      if (status != MESSAGE_STATUS_ZERO)
       {
-         // serve the message directly out of the cache
-         pgexporter_log_debug("Serving metrics out of cache (%d/%d bytes valid until %lld)",
-                              strlen(cache->data),
-                              cache->size,
-                              cache->valid_until);
+         goto cached;
+      }
+   }
 
-         msg.kind = 0;
-         msg.length = strlen(cache->data);
-         msg.data = cache->data;
+retry_cache_locking:
+   if (pgexporter_cache_lock(cache))
+   {
+      locked = true;
 
-         status = pgexporter_write_message(client_ssl, client_fd, &msg);
-         if (status != MESSAGE_STATUS_OK)
-         {
-            goto error;
-         }
+      // another scrape may have rebuilt the cache in the meantime
+      if (is_metrics_cache_configured() &&
+          (status = pgexporter_cache_write(cache, true, encoding, PROMETHEUS_CONTENT_TYPE, client_ssl, client_fd, &length)) != MESSAGE_STATUS_ZERO)
+      {
+         pgexporter_cache_unlock(cache);
+         locked = false;
+         goto cached;
       }
       else
       {
-         // build the message without the cache
-         metrics_cache_invalidate();
-
-         now = time(NULL);
-
-         memset(&time_buf, 0, sizeof(time_buf));
-         ctime_r(&now, &time_buf[0]);
-         time_buf[strlen(time_buf) - 1] = 0;
-
-         data = pgexporter_vappend(data, 5,
-                                   "HTTP/1.1 200 OK\r\n",
-                                   "Content-Type: text/plain; version=0.0.1; charset=utf-8\r\n",
-                                   "Date: ",
-                                   &time_buf[0],
-                                   "\r\n"
-                                   );
-         metrics_cache_append(data);  // cache here to avoid the chunking for the cache
-         data = pgexporter_vappend(data, 2,
-                                   "Transfer-Encoding: chunked\r\n",
-                                   "\r\n"
-                                   );
-
-         msg.kind = 0;
-         msg.length = strlen(data);
-         msg.data = data;
-
-         status = pgexporter_write_message(client_ssl, client_fd, &msg);
-         if (status != MESSAGE_STATUS_OK)
-         {
-            goto error;
-         }
-
-         free(data);
-         data = NULL;
-
-         pgexporter_open_connections();
-
-         /* ART-based Metric Collection */
-         prometheus_metrics_container_t* container = NULL;
-
-         if (create_metrics_container(&container) == 0)
+         // build the message, and the cache in the slot not being served
+         if (is_metrics_cache_configured())
          {
-            /* General Metric Collector */
-            general_information(container);
-            core_information(container);
-            server_information(container);
-            version_information(container);
-            uptime_information(container);
-            primary_information(container);
-            settings_information(container);
-            extension_information(container);
-            extension_list_information(container);
-
-            custom_metrics(container);
-
-            output_all_metrics(client_ssl, client_fd, container);
-            destroy_metrics_container(container);
+            pgexporter_cache_begin(cache);
          }
 
-         pgexporter_close_connections();
-
-         /* Footer */
-         data = pgexporter_append(data, "0\r\n\r\n");
-
-         msg.kind = 0;
-         msg.length = strlen(data);
-         msg.data = data;
-
-         status = pgexporter_write_message(client_ssl, client_fd, &msg);
-         if (status != MESSAGE_STATUS_OK)
+         if (metrics_collect(client_ssl, client_fd, OUTPUT_FORMAT_TEXT))
          {
             goto error;
          }
@@ -747,7 +1233,19 @@ retry_cache_locking:
       }
 
       // free the cache
-      atomic_store(&cache->lock, STATE_FREE);
+      pgexporter_cache_unlock(cache);
+   }
+   else if (is_metrics_cache_configured() &&
+            (status = pgexporter_cache_follow(cache, PROMETHEUS_CONTENT_TYPE, client_ssl, client_fd, &length)) != MESSAGE_STATUS_ZERO)
+   {
+      // the payload of the rebuild is sent as it is produced, so the rebuild is shared
+      goto coalesced;
+   }
+   else if (is_metrics_cache_configured() &&
+            (status = pgexporter_cache_write(cache, false, encoding, PROMETHEUS_CONTENT_TYPE, client_ssl, client_fd, &length)) != MESSAGE_STATUS_ZERO)
+   {
+      // serve the last complete payload rather than waiting for the rebuild
+      goto cached;
    }
    else
    {
@@ -761,6 +1259,147 @@ retry_cache_locking:
       SLEEP_AND_GOTO(10000000L, retry_cache_locking);
    }
 
+   free(data);
+
+   return 0;
+
+cached:
+
+   pgexporter_stats_cache(true);
+
+   // the message was served directly out of the cache
+   pgexporter_log_debug("Served metrics out of cache (%zu/%zu bytes, generation %lu)",
+                        length,
+                        cache->size,
+                        atomic_load(&cache->generation));
+
+   return status == MESSAGE_STATUS_OK ? 0 : 1;
+
+coalesced:
+
+   pgexporter_stats_cache(true);
+
+   pgexporter_log_debug("Served metrics while they were collected (%zu bytes, generation %lu)",
+                        length,
+                        atomic_load(&cache->generation));
+
+   return status == MESSAGE_STATUS_OK ? 0 : 1;
+
+error:
+
+   if (locked)
+   {
+      pgexporter_cache_unlock(cache);
+   }
+
+   free(data);
+
+   return 1;
+}
+
+/**
+ * Collect the metrics, and send them to the client as a chunked response
+ * @param client_ssl The client SSL
+ * @param client_fd The client descriptor
+ * @param format The format
+ * @return 0 upon success, otherwise 1
+ */
+static int
+metrics_collect(SSL* client_ssl, int client_fd, int format)
+{
+   char* data = NULL;
+   time_t now;
+   char time_buf[32];
+   int status;
+   bool traced = false;
+   struct message msg;
+   prometheus_metrics_container_t* container = NULL;
+
+   memset(&msg, 0, sizeof(struct message));
+
+   now = time(NULL);
+
+   memset(&time_buf, 0, sizeof(time_buf));
+   ctime_r(&now, &time_buf[0]);
+   time_buf[strlen(time_buf) - 1] = 0;
+
+   data = pgexporter_vappend(data, 7,
+                             "HTTP/1.1 200 OK\r\n",
+                             "Content-Type: ",
+                             format == OUTPUT_FORMAT_PROTOBUF ? PROTOBUF_CONTENT_TYPE :
+                             format == OUTPUT_FORMAT_OPENMETRICS ? OPENMETRICS_CONTENT_TYPE : PROMETHEUS_CONTENT_TYPE,
+                             "\r\n",
+                             "Date: ",
+                             &time_buf[0],
+                             "\r\n"
+                             );
+   data = pgexporter_vappend(data, 2,
+                             "Transfer-Encoding: chunked\r\n",
+                             "\r\n"
+                             );
+
+   msg.kind = 0;
+   msg.length = strlen(data);
+   msg.data = data;
+
+   status = pgexporter_write_message(client_ssl, client_fd, &msg);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      goto error;
+   }
+
+   free(data);
+   data = NULL;
+
+   traced = pgexporter_trace_start(TRACE_KIND_METRICS);
+
+   pgexporter_open_connections();
+
+   /* ART-based Metric Collection */
+   pgexporter_stats_cache(false);
+
+   if (create_metrics_container(&container) == 0)
+   {
+      uint64_t start = pgexporter_stats_now();
+      uint64_t span;
+
+      /* General Metric Collector */
+      builtin_metrics(container);
+
+      span = pgexporter_trace_begin();
+      custom_metrics(container, NULL, NULL);
+      pgexporter_trace_end("custom_metrics", -1, span);
+
+      pgexporter_stats_phase(STATS_PHASE_COLLECT, start);
+
+      span = pgexporter_trace_begin();
+      output_all_metrics(client_ssl, client_fd, container, format);
+      pgexporter_trace_end("output_all_metrics", -1, span);
+
+      destroy_metrics_container(container);
+   }
+
+   pgexporter_close_connections();
+
+   if (traced)
+   {
+      pgexporter_trace_finish();
+   }
+
+   /* Footer */
+   data = pgexporter_append(data, "0\r\n\r\n");
+
+   msg.kind = 0;
+   msg.length = strlen(data);
+   msg.data = data;
+
+   status = pgexporter_write_message(client_ssl, client_fd, &msg);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      goto error;
+   }
+
+
    free(data);
 
    return 0;
@@ -772,6 +1411,58 @@ error:
    return 1;
 }
 
+/**
+ * Collect and send the metrics for the request only. The collectors, and the
+ * custom metrics, without a metric selected by the filter aren't run
+ * @param client_ssl The client SSL
+ * @param client_fd The client descriptor
+ * @param format The format
+ * @param filter The filter
+ * @return 0 upon success, otherwise 1
+ */
+static int
+uncached_page(SSL* client_ssl, int client_fd, int format, struct metrics_filter* filter)
+{
+   int ret;
+
+   request_filter = filter;
+
+   ret = metrics_collect(client_ssl, client_fd, format);
+
+   request_filter = NULL;
+
+   return ret;
+}
+
+static int
+snapshot_page(SSL* client_ssl, int client_fd, int encoding)
+{
+   uint64_t start;
+   size_t length = 0;
+   int status;
+   struct prometheus_cache* snapshot;
+
+   snapshot = (struct prometheus_cache*)prometheus_snapshot_shmem;
+
+   pgexporter_stats_cache(true);
+
+   start = pgexporter_stats_now();
+   status = pgexporter_cache_write(snapshot, false, encoding, PROMETHEUS_CONTENT_TYPE, client_ssl, client_fd, &length);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      return 1;
+   }
+
+   pgexporter_stats_phase(STATS_PHASE_SEND, start);
+
+   pgexporter_log_debug("Served metrics out of snapshot (%zu/%zu bytes, generation %lu)",
+                        length,
+                        snapshot->size,
+                        atomic_load(&snapshot->generation));
+
+   return 0;
+}
+
 static int
 bad_request(SSL* client_ssl, int client_fd)
 {
@@ -831,6 +1522,40 @@ collector_pass(const char* collector)
    return false;
 }
 
+/**
+ * Does the filter of the request select a collector, and any metric
+ * with a name starting with a prefix
+ * @param collector The collector
+ * @param prefix The prefix of the names of its metrics
+ * @return True if the collector should run, otherwise false
+ */
+static bool
+request_pass(const char* collector, const char* prefix)
+{
+   if (request_filter == NULL)
+   {
+      return true;
+   }
+
+   return pgexporter_filter_collector(request_filter, collector) &&
+          pgexporter_filter_prefix(request_filter, prefix);
+}
+
+static void
+builtin_metrics(prometheus_metrics_container_t* container)
+{
+   uint64_t span;
+
+   for (size_t i = 0; i < sizeof(builtin_collectors) / sizeof(builtin_collectors[0]); i++)
+   {
+      span = pgexporter_trace_begin();
+
+      builtin_collectors[i].collect(container);
+
+      pgexporter_trace_end(builtin_collectors[i].name, -1, span);
+   }
+}
+
 static void
 general_information(prometheus_metrics_container_t* container)
 {
@@ -843,7 +1568,12 @@ general_information(prometheus_metrics_container_t* container)
       return;
    }
 
-   add_metric_to_art(container->general_metrics,
+   if (!request_pass("general", "pgexporter_"))
+   {
+      return;
+   }
+
+   add_metric_to_art(container->arena, container->general_metrics,
                      "pgexporter_state",
                      "1",
                      "The state of pgexporter",
@@ -852,7 +1582,7 @@ general_information(prometheus_metrics_container_t* container)
                      SORT_NAME);
 
    snprintf(value_buffer, sizeof(value_buffer), "%lu", atomic_load(&config->logging_info));
-   add_metric_to_art(container->general_metrics,
+   add_metric_to_art(container->arena, container->general_metrics,
                      "pgexporter_logging_info",
                      value_buffer,
                      "The number of INFO logging statements",
@@ -861,7 +1591,7 @@ general_information(prometheus_metrics_container_t* container)
                      SORT_NAME);
 
    snprintf(value_buffer, sizeof(value_buffer), "%lu", atomic_load(&config->logging_warn));
-   add_metric_to_art(container->general_metrics,
+   add_metric_to_art(container->arena, container->general_metrics,
                      "pgexporter_logging_warn",
                      value_buffer,
                      "The number of WARN logging statements",
@@ -870,7 +1600,7 @@ general_information(prometheus_metrics_container_t* container)
                      SORT_NAME);
 
    snprintf(value_buffer, sizeof(value_buffer), "%lu", atomic_load(&config->logging_error));
-   add_metric_to_art(container->general_metrics,
+   add_metric_to_art(container->arena, container->general_metrics,
                      "pgexporter_logging_error",
                      value_buffer,
                      "The number of ERROR logging statements",
@@ -879,13 +1609,109 @@ general_information(prometheus_metrics_container_t* container)
                      SORT_NAME);
 
    snprintf(value_buffer, sizeof(value_buffer), "%lu", atomic_load(&config->logging_fatal));
-   add_metric_to_art(container->general_metrics,
+   add_metric_to_art(container->arena, container->general_metrics,
                      "pgexporter_logging_fatal",
                      value_buffer,
                      "The number of FATAL logging statements",
                      "gauge",
                      current_time,
                      SORT_NAME);
+
+   cache_overflows(container, "metrics", prometheus_cache_shmem, current_time);
+   cache_overflows(container, "snapshot", prometheus_snapshot_shmem, current_time);
+   cache_overflows(container, "bridge", bridge_cache_shmem, current_time);
+   cache_overflows(container, "bridge_snapshot", bridge_snapshot_shmem, current_time);
+   cache_overflows(container, "bridge_json", bridge_json_cache_shmem, current_time);
+
+   if (prometheus_cache_shmem != NULL)
+   {
+      snprintf(value_buffer, sizeof(value_buffer), "%lu", atomic_load(&((struct prometheus_cache*)prometheus_cache_shmem)->coalesced));
+      add_metric_to_art(container->arena, container->general_metrics,
+                        "pgexporter_cache_coalesced{cache=\"metrics\"}",
+                        value_buffer,
+                        "The number of scrapes sent the metrics of a collection already running",
+                        "counter",
+                        current_time,
+                        SORT_NAME);
+   }
+
+   cluster_information(container, current_time);
+}
+
+static void
+cluster_information(prometheus_metrics_container_t* container, time_t current_time)
+{
+   int owner;
+   int servers[NUMBER_OF_MEMBERS];
+   bool alive;
+   char metric_name[MISC_LENGTH * 2];
+   char value_buffer[32];
+   struct configuration* config = (struct configuration*)shmem;
+
+   if (config->cluster_member == -1)
+   {
+      return;
+   }
+
+   memset(servers, 0, sizeof(servers));
+
+   for (int server = 0; server < config->number_of_servers; server++)
+   {
+      owner = pgexporter_cluster_owner(server);
+
+      if (owner >= 0)
+      {
+         servers[owner]++;
+      }
+   }
+
+   for (int m = 0; m < config->number_of_members; m++)
+   {
+      alive = m == config->cluster_member || atomic_load(&config->members[m].alive);
+
+      snprintf(metric_name, sizeof(metric_name), "pgexporter_cluster_member_up{member=\"%s:%d\"}",
+               config->members[m].host, config->members[m].port);
+      add_metric_to_art(container->arena, container->general_metrics,
+                        metric_name,
+                        alive ? "1" : "0",
+                        "Is a member of the cluster alive, as seen by this instance",
+                        "gauge",
+                        current_time,
+                        SORT_NAME);
+
+      snprintf(metric_name, sizeof(metric_name), "pgexporter_cluster_servers{member=\"%s:%d\"}",
+               config->members[m].host, config->members[m].port);
+      snprintf(value_buffer, sizeof(value_buffer), "%d", servers[m]);
+      add_metric_to_art(container->arena, container->general_metrics,
+                        metric_name,
+                        value_buffer,
+                        "The number of servers collected by a member of the cluster, as seen by this instance",
+                        "gauge",
+                        current_time,
+                        SORT_NAME);
+   }
+}
+
+static void
+cache_overflows(prometheus_metrics_container_t* container, char* name, void* cache, time_t current_time)
+{
+   char metric_name[MISC_LENGTH];
+   char value_buffer[256];
+
+   if (cache == NULL)
+   {
+      return;
+   }
+
+   snprintf(metric_name, sizeof(metric_name), "pgexporter_cache_overflows{cache=\"%s\"}", name);
+   snprintf(value_buffer, sizeof(value_buffer), "%lu", atomic_load(&((struct prometheus_cache*)cache)->overflows));
+   add_metric_to_art(container->arena, container->general_metrics,
+                     metric_name,
+                     value_buffer,
+                     "The number of responses that didn't fit in a cache",
+                     "counter",
+                     current_time,
+                     SORT_NAME);
 }
 
 static void
@@ -901,11 +1727,22 @@ server_information(prometheus_metrics_container_t* container)
       return;
    }
 
+   if (!request_pass("server", "pgexporter_postgresql_active"))
+   {
+      return;
+   }
+
    for (int server = 0; server < config->number_of_servers; server++)
    {
+      // The other members of a cluster report their own servers
+      if (!pgexporter_cluster_owns(server))
+      {
+         continue;
+      }
+
       snprintf(metric_name, sizeof(metric_name), "pgexporter_postgresql_active{server=\"%s\"}", config->servers[server].name);
 
-      if (config->servers[server].fd != -1)
+      if (pgexporter_connection_active(server))
       {
          strcpy(value_buffer, "1");
       }
@@ -914,7 +1751,7 @@ server_information(prometheus_metrics_container_t* container)
          strcpy(value_buffer, "0");
       }
 
-      add_metric_to_art(container->server_metrics,
+      add_metric_to_art(container->arena, container->server_metrics,
                         metric_name,
                         value_buffer,
                         "The state of PostgreSQL",
@@ -930,12 +1767,14 @@ version_information(prometheus_metrics_container_t* container)
    int ret;
    int server;
    time_t current_time = time(NULL);
+   uint64_t fingerprint = FINGERPRINT_BASIS;
    char* safe_key1 = NULL;
    char* safe_key2 = NULL;
    char metric_name[512];
    struct query* all = NULL;
    struct query* query = NULL;
    struct tuple* current = NULL;
+   uint64_t start;
    struct configuration* config;
 
    if (container == NULL || container->version_metrics == NULL)
@@ -943,21 +1782,36 @@ version_information(prometheus_metrics_container_t* container)
       return;
    }
 
+   if (!request_pass("version", "pgexporter_postgresql_version"))
+   {
+      return;
+   }
+
    config = (struct configuration*)shmem;
 
    for (server = 0; server < config->number_of_servers; server++)
    {
-      if (config->servers[server].fd != -1)
+      if (pgexporter_connection_active(server))
       {
+         start = pgexporter_stats_now();
          ret = pgexporter_query_version(server, &query);
+         collector_stats(server, STATS_COLLECTOR_VERSION, start, ret, query);
          if (ret == 0)
          {
+            fingerprint = fingerprint_mix(fingerprint, &server, sizeof(server));
+            fingerprint = fingerprint_mix(fingerprint, &query->fingerprint, sizeof(uint64_t));
             all = pgexporter_merge_queries(all, query, SORT_NAME);
          }
          query = NULL;
       }
    }
 
+   if (static_metrics_unchanged(&container->version_metrics, &container->version_fingerprint, fingerprint, current_time))
+   {
+      pgexporter_free_query(all);
+      return;
+   }
+
    if (all != NULL)
    {
       current = all->tuples;
@@ -974,7 +1828,7 @@ version_information(prometheus_metrics_container_t* container)
                      "pgexporter_postgresql_version{server=\"%s\",version=\"%s\",minor_version=\"%s\"}",
                      config->servers[server].name, safe_key1, safe_key2);
 
-            add_metric_to_art(container->version_metrics,
+            add_metric_to_art(container->static_arena, container->version_metrics,
                               metric_name,
                               "1",
                               "The PostgreSQL version",
@@ -1005,6 +1859,7 @@ uptime_information(prometheus_metrics_container_t* container)
    struct query* all = NULL;
    struct query* query = NULL;
    struct tuple* current = NULL;
+   uint64_t start;
    struct configuration* config;
 
    if (container == NULL || container->uptime_metrics == NULL)
@@ -1012,13 +1867,20 @@ uptime_information(prometheus_metrics_container_t* container)
       return;
    }
 
+   if (!request_pass("uptime", "pgexporter_postgresql_uptime"))
+   {
+      return;
+   }
+
    config = (struct configuration*)shmem;
 
    for (server = 0; server < config->number_of_servers; server++)
    {
-      if (config->servers[server].fd != -1)
+      if (pgexporter_connection_active(server))
       {
+         start = pgexporter_stats_now();
          ret = pgexporter_query_uptime(server, &query);
+         collector_stats(server, STATS_COLLECTOR_UPTIME, start, ret, query);
          if (ret == 0)
          {
             all = pgexporter_merge_queries(all, query, SORT_NAME);
@@ -1042,7 +1904,7 @@ uptime_information(prometheus_metrics_container_t* container)
                      "pgexporter_postgresql_uptime{server=\"%s\"}",
                      config->servers[server].name);
 
-            add_metric_to_art(container->uptime_metrics,
+            add_metric_to_art(container->arena, container->uptime_metrics,
                               metric_name,
                               safe_key,
                               "The PostgreSQL uptime in seconds",
@@ -1064,13 +1926,8 @@ uptime_information(prometheus_metrics_container_t* container)
 static void
 primary_information(prometheus_metrics_container_t* container)
 {
-   int ret;
-   int server;
    time_t current_time = time(NULL);
    char metric_name[512];
-   struct query* all = NULL;
-   struct query* query = NULL;
-   struct tuple* current = NULL;
    struct configuration* config;
 
    if (container == NULL || container->primary_metrics == NULL)
@@ -1078,55 +1935,72 @@ primary_information(prometheus_metrics_container_t* container)
       return;
    }
 
+   if (!request_pass("primary", "pgexporter_postgresql_primary"))
+   {
+      return;
+   }
+
    config = (struct configuration*)shmem;
 
-   for (server = 0; server < config->number_of_servers; server++)
+   for (int server = 0; server < config->number_of_servers; server++)
    {
-      if (config->servers[server].fd != -1)
+      if (pgexporter_connection_active(server))
       {
-         ret = pgexporter_query_primary(server, &query);
-         if (ret == 0)
+         server_role(server);
+
+         if (config->server_states[server].state == SERVER_UNKNOWN)
          {
-            all = pgexporter_merge_queries(all, query, SORT_NAME);
+            continue;
          }
-         query = NULL;
+
+         snprintf(metric_name, sizeof(metric_name),
+                  "pgexporter_postgresql_primary{server=\"%s\"}",
+                  config->servers[server].name);
+
+         add_metric_to_art(container->arena, container->primary_metrics,
+                           metric_name,
+                           config->server_states[server].state == SERVER_PRIMARY ? "1" : "0",
+                           "Is the PostgreSQL instance the primary",
+                           "gauge",
+                           current_time,
+                           SORT_NAME);
       }
    }
+}
 
-   if (all != NULL)
-   {
-      current = all->tuples;
-      if (current != NULL)
-      {
-         server = 0;
+/**
+ * Check the role of a server, unless it was checked less than role_interval
+ * seconds ago on the same connection
+ * @param server The server
+ */
+static void
+server_role(int server)
+{
+   int ret;
+   time_t now = time(NULL);
+   uint64_t start;
+   struct query* query = NULL;
+   struct configuration* config;
 
-         while (current != NULL)
-         {
-            snprintf(metric_name, sizeof(metric_name),
-                     "pgexporter_postgresql_primary{server=\"%s\"}",
-                     config->servers[server].name);
+   config = (struct configuration*)shmem;
 
-            const char* value = "0";
-            if (!strcmp("t", pgexporter_get_column(0, current)))
-            {
-               value = "1";
-            }
+   if (config->server_states[server].state != SERVER_UNKNOWN && config->server_states[server].role_checked != 0 &&
+       now - config->server_states[server].role_checked < config->role_interval)
+   {
+      return;
+   }
 
-            add_metric_to_art(container->primary_metrics,
-                              metric_name,
-                              (char*)value,
-                              "Is the PostgreSQL instance the primary",
-                              "gauge",
-                              current_time,
-                              SORT_NAME);
+   start = pgexporter_stats_now();
+   ret = pgexporter_query_primary(server, &query);
+   collector_stats(server, STATS_COLLECTOR_PRIMARY, start, ret, query);
 
-            server++;
-            current = current->next;
-         }
-      }
+   if (ret == 0 && query != NULL && query->tuples != NULL)
+   {
+      config->server_states[server].state = !strcmp("t", pgexporter_get_column(0, query->tuples)) ? SERVER_PRIMARY : SERVER_REPLICA;
+      config->server_states[server].role_checked = now;
    }
 
-   pgexporter_free_query(all);
+   pgexporter_free_query(query);
 }
 
 static void
@@ -1140,9 +2014,14 @@ core_information(prometheus_metrics_container_t* container)
       return;
    }
 
+   if (!request_pass("core", "pgexporter_version"))
+   {
+      return;
+   }
+
    snprintf(metric_name, sizeof(metric_name), "pgexporter_version{pgexporter_version=\"%s\"}", VERSION);
 
-   add_metric_to_art(container->core_metrics,
+   add_metric_to_art(container->arena, container->core_metrics,
                      metric_name,
                      "1",
                      "The pgexporter version",
@@ -1155,8 +2034,11 @@ static void
 extension_information(prometheus_metrics_container_t* container)
 {
    bool cont = true;
+   bool disk_space;
    struct query* query = NULL;
    struct tuple* tuple = NULL;
+   struct tuple* disk_space_tuples[3];
+   uint64_t start;
    struct configuration* config;
 
    if (container == NULL || container->extension_metrics == NULL)
@@ -1167,7 +2049,7 @@ extension_information(prometheus_metrics_container_t* container)
    config = (struct configuration*)shmem;
 
    /* Expose only if default or specified */
-   if (!collector_pass("extension"))
+   if (!collector_pass("extension") || !request_pass("extension", ""))
    {
       pgexporter_log_debug("extension_information disabled");
       return;
@@ -1175,12 +2057,15 @@ extension_information(prometheus_metrics_container_t* container)
 
    for (int server = 0; cont && server < config->number_of_servers; server++)
    {
-      if (config->servers[server].extension && config->servers[server].fd != -1)
+      if (config->server_states[server].extension && pgexporter_connection_active(server))
       {
+         start = pgexporter_stats_now();
          pgexporter_query_get_functions(server, &query);
+         collector_stats(server, STATS_COLLECTOR_EXTENSION, start, query == NULL, query);
 
          if (query != NULL)
          {
+            memset(disk_space_tuples, 0, sizeof(disk_space_tuples));
             tuple = query->tuples;
 
             while (tuple != NULL)
@@ -1194,7 +2079,18 @@ extension_information(prometheus_metrics_container_t* container)
                }
                else
                {
-                  if (strcmp(tuple->data[0], "pgexporter_is_supported"))
+                  disk_space = false;
+
+                  for (int i = 0; i < 3; i++)
+                  {
+                     if (!strcmp(tuple->data[0], disk_space_functions[i]))
+                     {
+                        disk_space_tuples[i] = tuple;
+                        disk_space = true;
+                     }
+                  }
+
+                  if (!disk_space && strcmp(tuple->data[0], "pgexporter_is_supported"))
                   {
                      extension_function(tuple->data[0], INPUT_DATA, tuple->data[2], tuple->data[3], container);
                      extension_function(tuple->data[0], INPUT_WAL, tuple->data[2], tuple->data[3], container);
@@ -1204,11 +2100,29 @@ extension_information(prometheus_metrics_container_t* container)
                tuple = tuple->next;
             }
 
+            // The disk space is collected in one statement when the extension has all of its functions
+            if (disk_space_tuples[DISK_SPACE_USED] != NULL && disk_space_tuples[DISK_SPACE_FREE] != NULL &&
+                disk_space_tuples[DISK_SPACE_TOTAL] != NULL)
+            {
+               disk_space_information(disk_space_tuples, container);
+            }
+            else
+            {
+               for (int i = 0; i < 3; i++)
+               {
+                  if (disk_space_tuples[i] != NULL)
+                  {
+                     extension_function(disk_space_tuples[i]->data[0], INPUT_DATA, disk_space_tuples[i]->data[2], disk_space_tuples[i]->data[3], container);
+                     extension_function(disk_space_tuples[i]->data[0], INPUT_WAL, disk_space_tuples[i]->data[2], disk_space_tuples[i]->data[3], container);
+                  }
+               }
+            }
+
             cont = false;
          }
          else
          {
-            config->servers[server].extension = false;
+            config->server_states[server].extension = false;
             pgexporter_log_trace("extension_information disabled for server %d", server);
          }
 
@@ -1222,10 +2136,12 @@ static void
 extension_list_information(prometheus_metrics_container_t* container)
 {
    time_t current_time = time(NULL);
+   uint64_t fingerprint = FINGERPRINT_BASIS;
    char* safe_key1 = NULL;
    char* safe_key2 = NULL;
    char* safe_key3 = NULL;
    char metric_name[512];
+   struct extension_info* extension = NULL;
    struct configuration* config;
 
    if (container == NULL || container->extension_list_metrics == NULL)
@@ -1235,14 +2151,38 @@ extension_list_information(prometheus_metrics_container_t* container)
 
    config = (struct configuration*)shmem;
 
-   if (!collector_pass("extensions_list"))
+   if (!collector_pass("extensions_list") || !request_pass("extensions_list", "pgexporter_postgresql_extension_info"))
+   {
+      return;
+   }
+
+   // The extensions are read when a server is connected, so they are the same most of the time
+   for (int server = 0; server < config->number_of_servers; server++)
+   {
+      if (pgexporter_connection_active(server))
+      {
+         fingerprint = fingerprint_mix(fingerprint, &server, sizeof(server));
+
+         for (int i = 0; i < config->servers[server].number_of_extensions; i++)
+         {
+            extension = &config->servers[server].extensions[i];
+
+            fingerprint = fingerprint_mix(fingerprint, extension->name, strlen(extension->name) + 1);
+            fingerprint = fingerprint_mix(fingerprint, extension->installed_version, strlen(extension->installed_version) + 1);
+            fingerprint = fingerprint_mix(fingerprint, extension->comment, strlen(extension->comment) + 1);
+         }
+      }
+   }
+
+   if (static_metrics_unchanged(&container->extension_list_metrics, &container->extension_list_fingerprint,
+                                fingerprint, current_time))
    {
       return;
    }
 
    for (int server = 0; server < config->number_of_servers; server++)
    {
-      if (config->servers[server].fd != -1)
+      if (pgexporter_connection_active(server))
       {
          for (int i = 0; i < config->servers[server].number_of_extensions; i++)
          {
@@ -1254,7 +2194,7 @@ extension_list_information(prometheus_metrics_container_t* container)
                      "pgexporter_postgresql_extension_info{server=\"%s\",extension=\"%s\",version=\"%s\",comment=\"%s\"}",
                      config->servers[server].name, safe_key1, safe_key2, safe_key3);
 
-            add_metric_to_art(container->extension_list_metrics,
+            add_metric_to_art(container->static_arena, container->extension_list_metrics,
                               metric_name,
                               "1",
                               "Information about installed PostgreSQL extensions",
@@ -1278,6 +2218,7 @@ extension_function(char* function, int input, char* description, char* type, pro
    char* sql = NULL;
    struct query* query = NULL;
    struct tuple* tuple = NULL;
+   uint64_t start;
    struct configuration* config;
 
    if (container == NULL || container->extension_metrics == NULL)
@@ -1285,11 +2226,17 @@ extension_function(char* function, int input, char* description, char* type, pro
       return;
    }
 
+   // The names of the metrics of a function start with the name of the function
+   if (!request_pass("extension", function))
+   {
+      return;
+   }
+
    config = (struct configuration*)shmem;
 
    for (int server = 0; server < config->number_of_servers; server++)
    {
-      if (config->servers[server].extension && config->servers[server].fd != -1)
+      if (config->server_states[server].extension && pgexporter_connection_active(server))
       {
          bool execute = true;
 
@@ -1320,12 +2267,14 @@ extension_function(char* function, int input, char* description, char* type, pro
 
          if (execute)
          {
+            start = pgexporter_stats_now();
             pgexporter_query_execute(server, sql, "pgexporter_ext", &query);
+            collector_stats(server, STATS_COLLECTOR_EXTENSION, start, query == NULL, query);
          }
 
          if (query == NULL)
          {
-            config->servers[server].extension = false;
+            config->server_states[server].extension = false;
 
             free(sql);
             sql = NULL;
@@ -1333,7 +2282,7 @@ extension_function(char* function, int input, char* description, char* type, pro
             continue;
          }
 
-         config->servers[server].extension = true;
+         config->server_states[server].extension = true;
 
          tuple = query->tuples;
 
@@ -1356,7 +2305,7 @@ extension_function(char* function, int input, char* description, char* type, pro
                snprintf(metric_name, sizeof(metric_name), "%s{server=\"%s\"}",
                         base_metric_name, config->servers[server].name);
 
-               add_metric_to_art(container->extension_metrics,
+               add_metric_to_art(container->arena, container->extension_metrics,
                                  metric_name,
                                  "1",
                                  description,
@@ -1379,7 +2328,7 @@ extension_function(char* function, int input, char* description, char* type, pro
                snprintf(metric_name, sizeof(metric_name), "%s{server=\"%s\",location=\"%s\"}",
                         base_metric_name, config->servers[server].name, location);
 
-               add_metric_to_art(container->extension_metrics,
+               add_metric_to_art(container->arena, container->extension_metrics,
                                  metric_name,
                                  tuple->data[0],
                                  description,
@@ -1400,16 +2349,160 @@ extension_function(char* function, int input, char* description, char* type, pro
    }
 }
 
+static void
+disk_space_information(struct tuple* functions[], prometheus_metrics_container_t* container)
+{
+   time_t current_time = time(NULL);
+   bool wanted = false;
+   bool configured[2];
+   bool remote[2];
+   int column;
+   char* directory = NULL;
+   char* value = NULL;
+   char local[32];
+   char metric_name[512];
+   unsigned long size;
+   uint64_t start;
+   struct query* query = NULL;
+   struct configuration* config;
+
+   for (int i = 0; i < 3; i++)
+   {
+      wanted = wanted || request_pass("extension", functions[i]->data[0]);
+   }
+
+   if (!wanted)
+   {
+      return;
+   }
+
+   config = (struct configuration*)shmem;
+
+   for (int server = 0; server < config->number_of_servers; server++)
+   {
+      if (!config->server_states[server].extension || !pgexporter_connection_active(server))
+      {
+         continue;
+      }
+
+      for (int i = 0; i < 2; i++)
+      {
+         directory = i == 0 ? config->servers[server].data : config->servers[server].wal;
+         configured[i] = strlen(directory) > 0;
+         remote[i] = configured[i] && !local_directory(server, directory);
+      }
+
+      if (remote[0] || remote[1])
+      {
+         start = pgexporter_stats_now();
+         pgexporter_query_disk_space(server, remote[0], remote[1], &query);
+         collector_stats(server, STATS_COLLECTOR_EXTENSION, start, query == NULL, query);
+
+         if (query == NULL)
+         {
+            config->server_states[server].extension = false;
+            continue;
+         }
+      }
+
+      column = 0;
+
+      for (int i = 0; i < 2; i++)
+      {
+         if (!configured[i])
+         {
+            continue;
+         }
+
+         directory = i == 0 ? config->servers[server].data : config->servers[server].wal;
+
+         for (int f = 0; f < 3; f++)
+         {
+            if (remote[i])
+            {
+               value = query->tuples != NULL ? pgexporter_get_column(column, query->tuples) : NULL;
+               column++;
+            }
+            else
+            {
+               if (f == DISK_SPACE_USED)
+               {
+                  size = pgexporter_directory_size(directory);
+               }
+               else if (f == DISK_SPACE_FREE)
+               {
+                  size = pgexporter_free_space(directory);
+               }
+               else
+               {
+                  size = pgexporter_total_space(directory);
+               }
+
+               snprintf(local, sizeof(local), "%lu", size);
+               value = local;
+            }
+
+            if (value == NULL || !request_pass("extension", functions[f]->data[0]))
+            {
+               continue;
+            }
+
+            snprintf(metric_name, sizeof(metric_name), "%s_%s{server=\"%s\",location=\"%s\"}",
+                     functions[f]->data[0], i == 0 ? "data" : "wal", config->servers[server].name, directory);
+
+            add_metric_to_art(container->arena, container->extension_metrics,
+                              metric_name,
+                              value,
+                              functions[f]->data[2],
+                              functions[f]->data[3],
+                              current_time,
+                              SORT_NAME);
+         }
+      }
+
+      pgexporter_free_query(query);
+      query = NULL;
+   }
+}
+
+/**
+ * Is a directory of a server readable by pgexporter on the same host
+ * @param server The server
+ * @param directory The directory
+ * @return True if the directory can be read directly, otherwise false
+ */
+static bool
+local_directory(int server, char* directory)
+{
+   char* host = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   host = config->servers[server].host;
+
+   if (strcmp(host, "localhost") && strcmp(host, "127.0.0.1") && strcmp(host, "::1"))
+   {
+      return false;
+   }
+
+   return access(directory, R_OK | X_OK) == 0;
+}
+
 static void
 settings_information(prometheus_metrics_container_t* container)
 {
    int ret;
    time_t current_time = time(NULL);
+   uint64_t fingerprint = FINGERPRINT_BASIS;
    char* safe_key = NULL;
    char metric_name[512];
+   int number_of_queries = 0;
+   struct query* queries[NUMBER_OF_SERVERS];
    struct query* all = NULL;
    struct query* query = NULL;
    struct tuple* current = NULL;
+   uint64_t start;
    struct configuration* config;
 
    if (container == NULL || container->settings_metrics == NULL)
@@ -1420,24 +2513,41 @@ settings_information(prometheus_metrics_container_t* container)
    config = (struct configuration*)shmem;
 
    /* Expose only if default or specified */
-   if (!collector_pass("settings"))
+   if (!collector_pass("settings") || !request_pass("settings", "pgexporter_"))
    {
       return;
    }
 
    for (int server = 0; server < config->number_of_servers; server++)
    {
-      if (config->servers[server].fd != -1)
+      if (pgexporter_connection_active(server))
       {
+         start = pgexporter_stats_now();
          ret = pgexporter_query_settings(server, &query);
+         collector_stats(server, STATS_COLLECTOR_SETTINGS, start, ret, query);
          if (ret == 0)
          {
-            all = pgexporter_merge_queries(all, query, SORT_DATA0);
+            fingerprint = fingerprint_mix(fingerprint, &server, sizeof(server));
+            fingerprint = fingerprint_mix(fingerprint, &query->fingerprint, sizeof(uint64_t));
+            queries[number_of_queries++] = query;
          }
          query = NULL;
       }
    }
 
+   // The settings rarely change, so the samples are rendered again only when they did
+   if (static_metrics_unchanged(&container->settings_metrics, &container->settings_fingerprint, fingerprint, current_time))
+   {
+      for (int i = 0; i < number_of_queries; i++)
+      {
+         pgexporter_free_query(queries[i]);
+      }
+      return;
+   }
+
+   // Group the settings of all servers at once
+   all = pgexporter_merge_all_queries(&queries[0], number_of_queries, SORT_DATA0);
+
    if (all != NULL)
    {
       current = all->tuples;
@@ -1447,7 +2557,7 @@ settings_information(prometheus_metrics_container_t* container)
 
          snprintf(metric_name, sizeof(metric_name), "pgexporter_%s_%s", all->tag, safe_key);
 
-         add_metric_to_art(container->settings_metrics,
+         add_metric_to_art(container->static_arena, container->settings_metrics,
                            metric_name,
                            pgexporter_get_column(1, current),
                            pgexporter_get_column(2, current),
@@ -1465,8 +2575,18 @@ settings_information(prometheus_metrics_container_t* container)
 }
 
 static void
-custom_metrics(prometheus_metrics_container_t* container)
+custom_metrics(prometheus_metrics_container_t* container, bool* due, custom_state_t* state)
 {
+   int number_of_threads = 0;
+   int number_of_workers;
+   int number_of_multiplexed = 0;
+   uint64_t fingerprint;
+   char prefix[MISC_LENGTH];
+   char* pool = NULL;
+   pthread_t threads[NUMBER_OF_SERVERS];
+   custom_metrics_task_t task;
+   histogram_buckets_t buckets;
+   struct catalog* catalog = NULL;
    struct configuration* config = NULL;
    time_t current_time = time(NULL);
 
@@ -1477,174 +2597,1621 @@ custom_metrics(prometheus_metrics_container_t* container)
 
    config = (struct configuration*)shmem;
 
-   query_list_t* q_list = NULL;
-   query_list_t* temp = q_list;
+   // A scrape keeps to the generation of the metrics it was started with
+   catalog = pgexporter_catalog_get(config);
+
+   if (catalog == NULL || catalog->number_of_metrics == 0 || config->number_of_servers == 0)
+   {
+      return;
+   }
+
+   memset(&task, 0, sizeof(custom_metrics_task_t));
+   atomic_init(&task.next, 0);
+   atomic_init(&task.next_database, 0);
+   pthread_mutex_init(&task.lock, NULL);
+   task.number_of_servers = MIN(config->number_of_servers, catalog->number_of_servers);
+   task.number_of_metrics = catalog->number_of_metrics;
+   task.catalog = catalog;
+   task.selected = calloc((task.number_of_metrics + 63) / 64, sizeof(uint64_t));
+   task.results = calloc(task.number_of_metrics * task.number_of_servers, sizeof(query_list_t));
+
+   if (task.selected == NULL || task.results == NULL)
+   {
+      pgexporter_log_error("Unable to allocate custom metrics results");
+      free(task.selected);
+      free(task.results);
+      pthread_mutex_destroy(&task.lock);
+      return;
+   }
 
-   // Iterate through each metric to send its query to PostgreSQL server
-   for (int i = 0; i < config->number_of_metrics; i++)
+   // The metrics selected don't depend on the server, so they are decided once
+   pool = pgexporter_catalog_pool(config);
+   for (int i = 0; i < task.number_of_metrics; i++)
    {
-      struct prometheus* prom = &config->prometheus[i];
+      struct prometheus* prom = &catalog->prometheus[i];
 
-      /* Expose only if default or specified */
-      if (!collector_pass(prom->collector))
+      if (due != NULL && !due[i])
       {
+         /* Keep the last values */
          continue;
       }
 
-      // Iterate through each server and send appropriate query to PostgreSQL server
-      for (int server = 0; server < config->number_of_servers; server++)
+      /* Expose only if default or specified */
+      if (!collector_pass(pool + prom->collector))
       {
-         if (config->servers[server].fd == -1)
-         {
-            /* Skip */
-            continue;
-         }
-
-         if ((prom->server_query_type == SERVER_QUERY_PRIMARY && config->servers[server].state != SERVER_PRIMARY) ||
-             (prom->server_query_type == SERVER_QUERY_REPLICA && config->servers[server].state != SERVER_REPLICA))
-         {
-            /* Skip */
-            continue;
-         }
-
-         struct query_alts* query_alt = pgexporter_get_query_alt(prom->root, server);
-
-         if (!query_alt)
-         {
-            /* Skip */
-            continue;
-         }
+         continue;
+      }
 
-         // Setting Temp's value
-         query_list_t* next = malloc(sizeof(query_list_t));
-         memset(next, 0, sizeof(query_list_t));
+      snprintf(&prefix[0], sizeof(prefix), "pgexporter_%s", prom->tag);
+      if (!request_pass(pool + prom->collector, &prefix[0]))
+      {
+         continue;
+      }
 
-         if (!q_list)
-         {
-            q_list = next;
-            temp = q_list;
-         }
-         else if (temp && temp->query)
-         {
-            temp->next = next;
-            temp = next;
-         }
-         else if (temp && !temp->query)
-         {
-            free(next);
-            next = NULL;
-            memset(temp, 0, sizeof(query_list_t));
-         }
+      task.selected[i / 64] |= 1ULL << (i % 64);
+   }
 
-         /* Names */
-         char** names = malloc(query_alt->n_columns * sizeof(char*));
-         for (int j = 0; j < query_alt->n_columns; j++)
-         {
-            names[j] = query_alt->columns[j].name;
-         }
-         memcpy(temp->tag, prom->tag, MISC_LENGTH);
-         temp->query_alt = query_alt;
+   // The metrics of any replica are collected from the same replica while it is one
+   task.replica = -1;
+   for (int server = 0; server < task.number_of_servers; server++)
+   {
+      if (pgexporter_connection_active(server))
+      {
+         server_role(server);
 
-         // Gather all the queries in a linked list, with each query's result (linked list of tuples in it) as a node.
-         if (query_alt->is_histogram)
+         if (config->server_states[server].state == SERVER_REPLICA && (task.replica == -1 || server == any_replica))
          {
-            temp->error = pgexporter_custom_query(server, query_alt->query, prom->tag, -1, NULL, &temp->query);
-            temp->sort_type = prom->sort_type;
+            task.replica = server;
          }
-         else
-         {
-            temp->error = pgexporter_custom_query(server, query_alt->query, prom->tag, query_alt->n_columns, names, &temp->query);
-            temp->sort_type = prom->sort_type;
-         }
-
-         free(names);
-         names = NULL;
       }
    }
+   any_replica = task.replica;
 
-   /* Process queries and add to ART */
-   temp = q_list;
-   while (temp)
+   // The connections authenticate one after the other, before any query runs
+   for (int server = 0; server < task.number_of_servers; server++)
    {
-      if (!temp->error && temp->query != NULL && temp->query->tuples != NULL)
-      {
-         struct tuple* current_tuple = temp->query->tuples;
-         while (current_tuple != NULL)
-         {
-            char metric_name[512];
+      task.lanes[server] = 1;
 
-            if (temp->query->number_of_columns > 0)
-            {
-               // For custom metrics, use the tag as the base metric name
-               snprintf(metric_name, sizeof(metric_name), "pgexporter_%s", temp->tag);
+      if (config->servers[server].max_parallel_queries > 1 && pgexporter_connection_active(server))
+      {
+         task.lanes[server] = pgexporter_open_lanes(server);
+      }
+   }
 
-               // Use the first column as the value
-               add_metric_to_art(container->custom_metrics,
-                                 metric_name,
-                                 pgexporter_get_column(0, current_tuple),
-                                 "Custom metric",
-                                 "gauge",
-                                 current_time,
-                                 temp->sort_type);
-            }
+   // With a pipeline, the servers with a single connection are queried together by
+   // the current thread, which writes and reads their connections as they are ready
+   for (int server = 0; server < task.number_of_servers; server++)
+   {
+      task.multiplexed[server] = config->metrics_pipeline && task.lanes[server] <= 1 &&
+                                 pgexporter_connection_active(server);
 
-            current_tuple = current_tuple->next;
-         }
+      if (task.multiplexed[server])
+      {
+         number_of_multiplexed++;
       }
-      temp = temp->next;
    }
 
-   // Clean up
-   temp = q_list;
-   query_list_t* last = NULL;
-   while (temp)
+   // Each other server is a unit of work, so with metrics_parallel > 1 the round trips
+   // to the servers overlap. The current thread always takes part, so the queries
+   // complete even if no additional thread could be started.
+   number_of_workers = MIN(config->metrics_parallel, task.number_of_servers - number_of_multiplexed);
+   if (number_of_multiplexed == 0 || number_of_workers == config->metrics_parallel)
    {
-      pgexporter_free_query(temp->query);
-      last = temp;
-      temp = temp->next;
-      free(last);
+      number_of_workers--;
    }
-   q_list = NULL;
-}
 
-static int
-send_chunk(SSL* client_ssl, int client_fd, char* data)
-{
-   int status;
-   char* m = NULL;
-   struct message msg;
+   for (int i = 0; i < number_of_workers; i++)
+   {
+      if (pgexporter_thread_create(&threads[number_of_threads], custom_metrics_worker, &task, "custom metrics worker"))
+      {
+         break;
+      }
+      number_of_threads++;
+   }
 
-   memset(&msg, 0, sizeof(struct message));
+   if (number_of_multiplexed > 0)
+   {
+      custom_metrics_multiplex(&task);
+   }
 
-   m = malloc(20);
+   custom_metrics_run(&task);
 
-   if (m == NULL)
+   for (int i = 0; i < number_of_threads; i++)
    {
-      goto error;
+      pthread_join(threads[i], NULL);
    }
 
-   memset(m, 0, 20);
+   // The metrics of the other databases, once the pooled connections are free again
+   custom_metrics_databases(&task);
 
-   sprintf(m, "%zX\r\n", strlen(data));
-
-   m = pgexporter_vappend(m, 2,
-                          data,
-                          "\r\n"
-                          );
+   // The collector keeps its connections, and a scrape doesn't
+   if (state == NULL)
+   {
+      pgexporter_close_lanes();
+      pgexporter_close_databases();
+   }
 
-   msg.kind = 0;
-   msg.length = strlen(m);
-   msg.data = m;
+   /* Process queries and add to ART in metric, then server order */
+   memset(&buckets, 0, sizeof(histogram_buckets_t));
+   for (int i = 0; i < task.number_of_metrics; i++)
+   {
+      if (state != NULL && due != NULL && due[i])
+      {
+         fingerprint = FINGERPRINT_BASIS;
+         for (int server = 0; server < task.number_of_servers; server++)
+         {
+            for (query_list_t* temp = &task.results[i * task.number_of_servers + server]; temp != NULL; temp = temp->next)
+            {
+               if (!temp->error && temp->query != NULL)
+               {
+                  fingerprint = fingerprint_mix(fingerprint, &server, sizeof(server));
+                  fingerprint = fingerprint_mix(fingerprint, temp->database, strlen(temp->database) + 1);
+                  fingerprint = fingerprint_mix(fingerprint, &temp->query->fingerprint, sizeof(uint64_t));
+               }
+            }
+         }
+
+         state[i].unchanged = fingerprint == state[i].fingerprint;
+         state[i].fingerprint = fingerprint;
+
+         if (state[i].unchanged)
+         {
+            // The samples are the same, only newer
+            custom_metrics_samples(container->custom_metrics, catalog, i, false, current_time);
+            continue;
+         }
+
+         if (custom_metrics_incremental(&task, i, &state[i]))
+         {
+            // The rows that didn't change keep their samples, only newer, and the
+            // samples of a row that is gone are deleted when its server is rendered
+            custom_metrics_samples(container->custom_metrics, catalog, i, false, current_time);
+
+            if (catalog->prometheus[i].other)
+            {
+               snprintf(&prefix[0], sizeof(prefix), "pgexporter_%s_other", catalog->prometheus[i].tag);
+               pgexporter_art_delete(container->custom_metrics, &prefix[0]);
+            }
+         }
+         else
+         {
+            // A series without a row anymore shouldn't keep its old value
+            custom_metrics_samples(container->custom_metrics, catalog, i, true, 0);
+         }
+      }
+
+      for (int server = 0; server < task.number_of_servers; server++)
+      {
+         for (query_list_t* temp = &task.results[i * task.number_of_servers + server]; temp != NULL; temp = temp->next)
+         {
+            if (!temp->error && temp->query != NULL && temp->query->columns != NULL &&
+                temp->query->number_of_columns > 0 && temp->query_alt->is_histogram)
+            {
+               histogram_metrics(container, &buckets, pool, temp, server, current_time);
+            }
+            else if (!temp->error && temp->query != NULL && temp->query->columns != NULL &&
+                     temp->query->number_of_columns > 0)
+            {
+               char metric_name[512];
+
+               sample_metrics(container, &buckets, pool, temp, server, current_time,
+                              state != NULL && state[i].rows != NULL ? &state[i].rows[server] : NULL);
+
+               if (temp->query->columns->omitted > 0)
+               {
+                  pgexporter_log_debug("%s: %d rows left out on server %s", temp->tag, temp->query->columns->omitted,
+                                       config->servers[server].name);
+
+                  if (catalog->prometheus[i].other)
+                  {
+                     char value[64];
+
+                     snprintf(metric_name, sizeof(metric_name), "pgexporter_%s_other", temp->tag);
+                     snprintf(value, sizeof(value), "%.17g", temp->query->columns->other);
+
+                     add_metric_to_art(container->custom_arena, container->custom_metrics,
+                                       metric_name,
+                                       value,
+                                       "The sum of the values of the rows left out by the series limit",
+                                       "gauge",
+                                       current_time,
+                                       temp->sort_type);
+                  }
+               }
+            }
+         }
+      }
+   }
+
+   // Clean up
+   histogram_buckets_destroy(&buckets);
+   for (int i = 0; i < task.number_of_metrics * task.number_of_servers; i++)
+   {
+      query_list_t* next = task.results[i].next;
+
+      pgexporter_free_query(task.results[i].query);
+
+      while (next != NULL)
+      {
+         query_list_t* temp = next;
+
+         next = temp->next;
+         pgexporter_free_query(temp->query);
+         free(temp);
+      }
+   }
+   free(task.results);
+   free(task.selected);
+   pthread_mutex_destroy(&task.lock);
+}
+
+/**
+ * Decide if the results of an incremental metric can be rendered row by row.
+ * That is the case when each server that had rows before has a result that
+ * isn't a histogram, so the rows that are gone are known. Otherwise the rows
+ * are rendered again, and their state is built anew
+ * @param task The task
+ * @param metric The metric
+ * @param state The state of the metric
+ * @return True if only the rows that changed are rendered
+ */
+static bool
+custom_metrics_incremental(custom_metrics_task_t* task, int metric, custom_state_t* state)
+{
+   bool incremental = true;
+
+   // The rows are known by server, so the results of several databases are rendered again
+   if (!task->catalog->prometheus[metric].incremental || task->catalog->prometheus[metric].databases != 0)
+   {
+      return false;
+   }
+
+   if (state->rows == NULL)
+   {
+      state->rows = (struct art**)calloc(NUMBER_OF_SERVERS, sizeof(struct art*));
+      if (state->rows == NULL)
+      {
+         return false;
+      }
+   }
+
+   for (int server = 0; server < task->number_of_servers; server++)
+   {
+      query_list_t* temp = &task->results[metric * task->number_of_servers + server];
+
+      if (temp->query != NULL && !temp->error && temp->query_alt != NULL && temp->query_alt->is_histogram)
+      {
+         incremental = false;
+      }
+      else if ((temp->query == NULL || temp->error) && state->rows[server] != NULL)
+      {
+         incremental = false;
+      }
+   }
+
+   if (!incremental)
+   {
+      custom_metrics_rows_destroy(state, NUMBER_OF_SERVERS);
+   }
+
+   return incremental;
+}
+
+/**
+ * Destroy the state of the rows of an incremental metric
+ * @param state The state of the metric
+ * @param number_of_servers The number of servers
+ */
+static void
+custom_metrics_rows_destroy(custom_state_t* state, int number_of_servers)
+{
+   if (state->rows == NULL)
+   {
+      return;
+   }
+
+   for (int server = 0; server < number_of_servers; server++)
+   {
+      pgexporter_art_destroy(state->rows[server]);
+      state->rows[server] = NULL;
+   }
+}
+
+/**
+ * Delete or refresh the samples of a custom metric, which are named after its
+ * tag, and not those of another metric with a tag starting with the same text
+ * @param art The samples
+ * @param catalog The catalog
+ * @param metric The metric
+ * @param remove Delete the samples, or else set their timestamp
+ * @param timestamp The timestamp
+ */
+static void
+custom_metrics_samples(struct art* art, struct catalog* catalog, int metric, bool remove, time_t timestamp)
+{
+   bool owned;
+   char prefix[MISC_LENGTH + 16];
+   char* key = NULL;
+   size_t length;
+   size_t other;
+   struct art_iterator* iter = NULL;
+
+   if (art == NULL)
+   {
+      return;
+   }
+
+   length = snprintf(prefix, sizeof(prefix), "pgexporter_%s", catalog->prometheus[metric].tag);
+
+   if (pgexporter_art_iterator_create_prefix(art, prefix, &iter))
+   {
+      return;
+   }
+
+   while (pgexporter_art_iterator_next(iter))
+   {
+      key = iter->key;
+
+      if (key[length] != '{' && key[length] != '_')
+      {
+         continue;
+      }
+
+      owned = true;
+      for (int i = 0; owned && key[length] == '_' && i < catalog->number_of_metrics; i++)
+      {
+         other = strlen(catalog->prometheus[i].tag);
+
+         if (i != metric && other + 11 > length && !strncmp(key + 11, catalog->prometheus[i].tag, other) &&
+             (key[11 + other] == '{' || key[11 + other] == '_'))
+         {
+            owned = false;
+         }
+      }
+
+      if (owned && remove)
+      {
+         pgexporter_art_iterator_remove(iter);
+      }
+      else if (owned)
+      {
+         ((prometheus_metric_value_t*)iter->value->data)->timestamp = timestamp;
+      }
+   }
+
+   pgexporter_art_iterator_destroy(iter);
+}
+
+static void*
+custom_metrics_worker(void* arg)
+{
+   pgexporter_memory_init();
+
+   custom_metrics_run((custom_metrics_task_t*)arg);
+
+   pgexporter_memory_destroy();
+
+   return NULL;
+}
+
+static void
+custom_metrics_run(custom_metrics_task_t* task)
+{
+   int server;
+
+   while ((server = atomic_fetch_add(&task->next, 1)) < task->number_of_servers)
+   {
+      if (!task->multiplexed[server])
+      {
+         custom_metrics_server(server, task);
+      }
+   }
+}
+
+/**
+ * Query the servers with a single connection together, from the current thread
+ * @param task The task
+ */
+static void
+custom_metrics_multiplex(custom_metrics_task_t* task)
+{
+   int number_of_batches = 0;
+   struct query_batch batches[NUMBER_OF_SERVERS];
+   struct query_request* requests[NUMBER_OF_SERVERS];
+   query_list_t** slots[NUMBER_OF_SERVERS];
+
+   for (int server = 0; server < task->number_of_servers; server++)
+   {
+      if (!task->multiplexed[server])
+      {
+         continue;
+      }
+
+      requests[number_of_batches] = calloc(task->number_of_metrics, sizeof(struct query_request));
+      slots[number_of_batches] = calloc(task->number_of_metrics, sizeof(query_list_t*));
+
+      if (requests[number_of_batches] == NULL || slots[number_of_batches] == NULL)
+      {
+         free(requests[number_of_batches]);
+         free(slots[number_of_batches]);
+         continue;
+      }
+
+      batches[number_of_batches].server = server;
+      batches[number_of_batches].requests = requests[number_of_batches];
+      batches[number_of_batches].number_of_requests = custom_metrics_requests(server, NULL, task, requests[number_of_batches],
+                                                                              slots[number_of_batches]);
+      number_of_batches++;
+   }
+
+   if (number_of_batches > 0)
+   {
+      pgexporter_custom_query_servers(&batches[0], number_of_batches);
+   }
+
+   for (int i = 0; i < number_of_batches; i++)
+   {
+      custom_metrics_results(batches[i].server, requests[i], slots[i], batches[i].number_of_requests);
+
+      free(requests[i]);
+      free(slots[i]);
+   }
+}
+
+static void
+custom_metrics_server(int server, custom_metrics_task_t* task)
+{
+   int number_of_requests = 0;
+   struct query_request* requests = NULL;
+   query_list_t** slots = NULL;
+
+   if (!pgexporter_connection_active(server))
+   {
+      /* Skip */
+      return;
+   }
+
+   requests = calloc(task->number_of_metrics, sizeof(struct query_request));
+   slots = calloc(task->number_of_metrics, sizeof(query_list_t*));
+
+   if (requests == NULL || slots == NULL)
+   {
+      goto done;
+   }
+
+   number_of_requests = custom_metrics_requests(server, NULL, task, requests, slots);
+
+   if (MIN(task->lanes[server], number_of_requests) > 1)
+   {
+      custom_metrics_lanes(server, requests, slots, number_of_requests, MIN(task->lanes[server], number_of_requests));
+   }
+   else
+   {
+      custom_metrics_query(server, 0, requests, number_of_requests);
+   }
+
+   custom_metrics_results(server, requests, slots, number_of_requests);
+
+done:
+
+   free(requests);
+   free(slots);
+}
+
+/**
+ * Create the requests of the metrics selected for a server, or for one of
+ * its databases
+ * @param server The server
+ * @param database The database, or NULL for the metrics of the postgres database
+ * @param task The task
+ * @param requests The requests, room for each metric
+ * @param slots The result slots of the requests, room for each metric
+ * @return The number of requests
+ */
+static int
+custom_metrics_requests(int server, custom_metrics_database_t* database, custom_metrics_task_t* task,
+                        struct query_request* requests, query_list_t** slots)
+{
+   int number_of_requests = 0;
+   char* pool = NULL;
+   struct query_plan* plan = NULL;
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+   pool = pgexporter_catalog_pool(config);
+
+   // Iterate through each metric and prepare the appropriate query for the PostgreSQL server
+   for (int i = 0; i < task->number_of_metrics; i++)
+   {
+      struct prometheus* prom = &task->catalog->prometheus[i];
+      query_list_t* temp = NULL;
+      struct query_request* request = &requests[number_of_requests];
+
+      if (!(task->selected[i / 64] & (1ULL << (i % 64))))
+      {
+         continue;
+      }
+
+      if (database == NULL ? prom->databases != 0 : prom->databases == 0 || !database_match(pool + prom->databases, database))
+      {
+         /* Skip */
+         continue;
+      }
+
+      if (!custom_metrics_role(task, prom, server))
+      {
+         /* Skip */
+         continue;
+      }
+
+      plan = pgexporter_catalog_plan(config, server, i);
+
+      if (plan == NULL || plan->query_alt == NULL)
+      {
+         /* Skip */
+         continue;
+      }
+
+      struct query_alts* query_alt = plan->query_alt;
+
+      if (database == NULL)
+      {
+         temp = &task->results[i * task->number_of_servers + server];
+      }
+      else if ((temp = custom_metrics_database_slot(task, i, server, database->database)) == NULL)
+      {
+         continue;
+      }
+
+      memcpy(temp->tag, prom->tag, MISC_LENGTH);
+      temp->query_alt = query_alt;
+      temp->sort_type = prom->sort_type;
+
+      request->query = pool + query_alt->query;
+      request->tag = prom->tag;
+      request->columnar = true;
+      request->statement = i;
+      request->version = query_alt->version;
+      request->timeout = prom->timeout > 0 ? prom->timeout : config->query_timeout;
+      request->size = pgexporter_stats_metric_size(server, i);
+
+      // The first value column is the one the rows are ranked by
+      request->limit.column = 0;
+      if (!query_alt->is_histogram && query_alt->sample != 0)
+      {
+         request->limit.column = ((struct metric_template*)(pool + query_alt->sample))->values[0];
+      }
+      request->limit.top = prom->top_k > 0;
+      request->limit.max_rows = prom->top_k > 0 ? prom->top_k : prom->max_series;
+      if (prom->top_k > 0 && prom->max_series > 0)
+      {
+         request->limit.max_rows = MIN(prom->top_k, prom->max_series);
+      }
+
+      /* Names */
+      request->columns = query_alt->is_histogram ? -1 : query_alt->n_columns;
+      request->names = plan->names;
+
+      slots[number_of_requests] = temp;
+      number_of_requests++;
+   }
+
+   return number_of_requests;
+}
+
+/**
+ * Is a metric collected from a server in its role
+ * @param task The task
+ * @param prom The metric
+ * @param server The server
+ * @return True if the metric is collected
+ */
+static bool
+custom_metrics_role(custom_metrics_task_t* task, struct prometheus* prom, int server)
+{
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+
+   if ((prom->server_query_type == SERVER_QUERY_PRIMARY && config->server_states[server].state != SERVER_PRIMARY) ||
+       (prom->server_query_type == SERVER_QUERY_REPLICA && config->server_states[server].state != SERVER_REPLICA) ||
+       (prom->server_query_type == SERVER_QUERY_ANY_REPLICA && server != task->replica))
+   {
+      return false;
+   }
+
+   return true;
+}
+
+/**
+ * Collect the metrics of the other databases of the servers. The databases
+ * are those listed by the selected metrics, and with "*" those that allow
+ * connections. The databases are handed out to database_parallel threads,
+ * the current one included, and each server bounds its own connections
+ * @param task The task
+ */
+static void
+custom_metrics_databases(custom_metrics_task_t* task)
+{
+   int number_of_threads = 0;
+   int number_of_workers;
+   char* pool = NULL;
+   char* p = NULL;
+   char* element = NULL;
+   size_t length;
+   bool all;
+   pthread_t threads[MAX_DATABASE_PARALLEL];
+   struct query* query = NULL;
+   struct tuple* tuple = NULL;
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+   pool = pgexporter_catalog_pool(config);
+
+   for (int server = 0; server < task->number_of_servers; server++)
+   {
+      if (!pgexporter_connection_active(server))
+      {
+         continue;
+      }
+
+      all = false;
+      for (int i = 0; i < task->number_of_metrics; i++)
+      {
+         struct prometheus* prom = &task->catalog->prometheus[i];
+
+         if (!(task->selected[i / 64] & (1ULL << (i % 64))) || prom->databases == 0 ||
+             !custom_metrics_role(task, prom, server))
+         {
+            continue;
+         }
+
+         p = pool + prom->databases;
+         while ((element = database_element(&p, &length)) != NULL)
+         {
+            if (length == 1 && *element == '*')
+            {
+               all = true;
+            }
+            else
+            {
+               custom_metrics_database_add(task, server, element, length, false);
+            }
+         }
+      }
+
+      if (all && pgexporter_query_databases(server, &query) == 0 && query != NULL)
+      {
+         for (tuple = query->tuples; tuple != NULL; tuple = tuple->next)
+         {
+            element = pgexporter_get_column(0, tuple);
+
+            if (element != NULL)
+            {
+               custom_metrics_database_add(task, server, element, strlen(element), true);
+            }
+         }
+      }
+
+      pgexporter_free_query(query);
+      query = NULL;
+   }
+
+   if (task->number_of_databases == 0)
+   {
+      return;
+   }
+
+   number_of_workers = MIN(config->database_parallel, task->number_of_databases) - 1;
+
+   for (int i = 0; i < number_of_workers; i++)
+   {
+      if (pgexporter_thread_create(&threads[number_of_threads], custom_metrics_database_worker, task, "database metrics worker"))
+      {
+         break;
+      }
+      number_of_threads++;
+   }
+
+   custom_metrics_database_run(task);
+
+   for (int i = 0; i < number_of_threads; i++)
+   {
+      pthread_join(threads[i], NULL);
+   }
+
+   free(task->databases);
+   task->databases = NULL;
+   task->number_of_databases = 0;
+}
+
+/**
+ * Add a database of a server, once
+ * @param task The task
+ * @param server The server
+ * @param database The name of the database
+ * @param length The length of the name
+ * @param all Does the database allow connections
+ * @return 0 upon success, otherwise 1
+ */
+static int
+custom_metrics_database_add(custom_metrics_task_t* task, int server, char* database, size_t length, bool all)
+{
+   custom_metrics_database_t* databases = NULL;
+
+   if (length == 0 || length >= MISC_LENGTH)
+   {
+      return 1;
+   }
+
+   for (int i = 0; i < task->number_of_databases; i++)
+   {
+      if (task->databases[i].server == server && strlen(task->databases[i].database) == length &&
+          !strncmp(task->databases[i].database, database, length))
+      {
+         task->databases[i].all |= all;
+         return 0;
+      }
+   }
+
+   databases = realloc(task->databases, (task->number_of_databases + 1) * sizeof(custom_metrics_database_t));
+   if (databases == NULL)
+   {
+      return 1;
+   }
+   task->databases = databases;
+
+   memset(&task->databases[task->number_of_databases], 0, sizeof(custom_metrics_database_t));
+   task->databases[task->number_of_databases].server = server;
+   memcpy(task->databases[task->number_of_databases].database, database, length);
+   task->databases[task->number_of_databases].all = all;
+   task->number_of_databases++;
+
+   return 0;
+}
+
+static void*
+custom_metrics_database_worker(void* arg)
+{
+   pgexporter_memory_init();
+
+   custom_metrics_database_run((custom_metrics_task_t*)arg);
+
+   pgexporter_memory_destroy();
+
+   return NULL;
+}
+
+static void
+custom_metrics_database_run(custom_metrics_task_t* task)
+{
+   int d;
+   int number_of_requests;
+   struct query_request* requests = NULL;
+   query_list_t** slots = NULL;
+
+   requests = calloc(task->number_of_metrics, sizeof(struct query_request));
+   slots = calloc(task->number_of_metrics, sizeof(query_list_t*));
+
+   if (requests == NULL || slots == NULL)
+   {
+      goto done;
+   }
+
+   while ((d = atomic_fetch_add(&task->next_database, 1)) < task->number_of_databases)
+   {
+      custom_metrics_database_t* database = &task->databases[d];
+
+      memset(requests, 0, task->number_of_metrics * sizeof(struct query_request));
+      number_of_requests = custom_metrics_requests(database->server, database, task, requests, slots);
+
+      if (number_of_requests == 0)
+      {
+         continue;
+      }
+
+      if (pgexporter_database_query(database->server, database->database, requests, number_of_requests))
+      {
+         for (int i = 0; i < number_of_requests; i++)
+         {
+            slots[i]->error = true;
+         }
+         continue;
+      }
+
+      custom_metrics_results(database->server, requests, slots, number_of_requests);
+   }
+
+done:
+
+   free(requests);
+   free(slots);
+}
+
+/**
+ * Create the result slot of a metric for a database of a server, in the
+ * list of the server ordered by database
+ * @param task The task
+ * @param metric The metric
+ * @param server The server
+ * @param database The database
+ * @return The slot, or NULL if it couldn't be allocated
+ */
+static query_list_t*
+custom_metrics_database_slot(custom_metrics_task_t* task, int metric, int server, char* database)
+{
+   query_list_t* slot = NULL;
+   query_list_t* previous = NULL;
+
+   slot = (query_list_t*)calloc(1, sizeof(query_list_t));
+   if (slot == NULL)
+   {
+      return NULL;
+   }
+   snprintf(slot->database, sizeof(slot->database), "%s", database);
+
+   pthread_mutex_lock(&task->lock);
+
+   previous = &task->results[metric * task->number_of_servers + server];
+   while (previous->next != NULL && strcmp(previous->next->database, database) < 0)
+   {
+      previous = previous->next;
+   }
+   slot->next = previous->next;
+   previous->next = slot;
+
+   pthread_mutex_unlock(&task->lock);
+
+   return slot;
+}
+
+/**
+ * Get the next database of a comma separated list
+ * @param p The position in the list, which is moved past the database
+ * @param length The length of the database
+ * @return The database, or NULL at the end of the list
+ */
+static char*
+database_element(char** p, size_t* length)
+{
+   char* s = *p;
+   char* element = NULL;
+
+   while (*s == ',' || *s == ' ')
+   {
+      s++;
+   }
+
+   if (*s == '\0')
+   {
+      *p = s;
+      return NULL;
+   }
+
+   element = s;
+   while (*s != '\0' && *s != ',')
+   {
+      s++;
+   }
+
+   *length = s - element;
+   while (*length > 0 && element[*length - 1] == ' ')
+   {
+      (*length)--;
+   }
+   *p = s;
+
+   return element;
+}
+
+/**
+ * Is a database one of the databases of a metric
+ * @param databases The databases of the metric, "*" or a comma separated list
+ * @param database The database
+ * @return True if the metric is collected from the database
+ */
+static bool
+database_match(char* databases, custom_metrics_database_t* database)
+{
+   char* p = databases;
+   char* element = NULL;
+   size_t length;
+
+   while ((element = database_element(&p, &length)) != NULL)
+   {
+      if ((length == 1 && *element == '*' && database->all) ||
+          (strlen(database->database) == length && !strncmp(element, database->database, length)))
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+/**
+ * Hand the results of the requests of a server to their slots
+ * @param server The server
+ * @param requests The requests
+ * @param slots The result slots of the requests
+ * @param number_of_requests The number of requests
+ */
+static void
+custom_metrics_results(int server, struct query_request* requests, query_list_t** slots, int number_of_requests)
+{
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+
+   for (int i = 0; i < number_of_requests; i++)
+   {
+      struct query* result = requests[i].result;
+
+      pgexporter_stats_metric(server, requests[i].statement, requests[i].duration,
+                              result != NULL ? result->number_of_rows : 0,
+                              result != NULL ? result->bytes : 0,
+                              requests[i].error != 0);
+
+      slots[i]->error = requests[i].error;
+      slots[i]->query = requests[i].result;
+   }
+
+   // A failing query may mean a failover, so the role is checked again at the next collection
+   for (int i = 0; i < number_of_requests; i++)
+   {
+      if (requests[i].error != 0)
+      {
+         config->server_states[server].role_checked = 0;
+         break;
+      }
+   }
+}
+
+/**
+ * Run the queries of a server on several connections. The longest queries of
+ * the last scrape are handed out first, each one to the connection with the
+ * shortest queries so far, and the requests are grouped by connection
+ * @param server The server
+ * @param requests The requests
+ * @param slots The result slots of the requests
+ * @param number_of_requests The number of requests
+ * @param number_of_lanes The number of connections
+ */
+static void
+custom_metrics_lanes(int server, struct query_request* requests, query_list_t** slots,
+                     int number_of_requests, int number_of_lanes)
+{
+   int number_of_threads = 0;
+   int lane;
+   int offset;
+   int* assigned = NULL;
+   uint64_t loads[MAX_PARALLEL_QUERIES];
+   pthread_t threads[MAX_PARALLEL_QUERIES];
+   custom_metrics_lane_t lanes[MAX_PARALLEL_QUERIES];
+   custom_metrics_weight_t* weights = NULL;
+   struct query_request* grouped = NULL;
+   query_list_t** grouped_slots = NULL;
+
+   weights = calloc(number_of_requests, sizeof(custom_metrics_weight_t));
+   assigned = calloc(number_of_requests, sizeof(int));
+   grouped = calloc(number_of_requests, sizeof(struct query_request));
+   grouped_slots = calloc(number_of_requests, sizeof(query_list_t*));
+
+   if (weights == NULL || assigned == NULL || grouped == NULL || grouped_slots == NULL)
+   {
+      custom_metrics_query(server, 0, requests, number_of_requests);
+      goto done;
+   }
+
+   // A query without a duration yet still counts, so they are spread as well
+   for (int i = 0; i < number_of_requests; i++)
+   {
+      weights[i].request = i;
+      weights[i].duration = pgexporter_stats_metric_duration(server, requests[i].statement) + 1;
+   }
+
+   qsort(weights, number_of_requests, sizeof(custom_metrics_weight_t), custom_metrics_weight_compare);
+
+   memset(&loads[0], 0, sizeof(loads));
+   for (int i = 0; i < number_of_requests; i++)
+   {
+      lane = 0;
+      for (int l = 1; l < number_of_lanes; l++)
+      {
+         if (loads[l] < loads[lane])
+         {
+            lane = l;
+         }
+      }
+
+      loads[lane] += weights[i].duration;
+      assigned[weights[i].request] = lane;
+   }
+
+   // The requests keep their order within a connection
+   offset = 0;
+   for (int l = 0; l < number_of_lanes; l++)
+   {
+      lanes[l].server = server;
+      lanes[l].lane = l;
+      lanes[l].requests = &requests[offset];
+      lanes[l].number_of_requests = 0;
+
+      for (int i = 0; i < number_of_requests; i++)
+      {
+         if (assigned[i] == l)
+         {
+            grouped[offset] = requests[i];
+            grouped_slots[offset] = slots[i];
+            offset++;
+            lanes[l].number_of_requests++;
+         }
+      }
+   }
+
+   memcpy(requests, grouped, number_of_requests * sizeof(struct query_request));
+   memcpy(slots, grouped_slots, number_of_requests * sizeof(query_list_t*));
+
+   // The pooled connection is used by the current thread
+   for (int l = 1; l < number_of_lanes; l++)
+   {
+      if (lanes[l].number_of_requests == 0)
+      {
+         continue;
+      }
+
+      if (pgexporter_thread_create(&threads[number_of_threads], custom_metrics_lane_worker, &lanes[l], "query thread"))
+      {
+         custom_metrics_query(server, l, lanes[l].requests, lanes[l].number_of_requests);
+         continue;
+      }
+      number_of_threads++;
+   }
+
+   custom_metrics_query(server, 0, lanes[0].requests, lanes[0].number_of_requests);
+
+   for (int i = 0; i < number_of_threads; i++)
+   {
+      pthread_join(threads[i], NULL);
+   }
+
+done:
+
+   free(weights);
+   free(assigned);
+   free(grouped);
+   free(grouped_slots);
+}
+
+static void*
+custom_metrics_lane_worker(void* arg)
+{
+   custom_metrics_lane_t* lane = (custom_metrics_lane_t*)arg;
+
+   pgexporter_memory_init();
+
+   custom_metrics_query(lane->server, lane->lane, lane->requests, lane->number_of_requests);
+
+   pgexporter_memory_destroy();
+
+   return NULL;
+}
+
+/**
+ * Run queries of a server on one of its connections
+ * @param server The server
+ * @param lane The connection, 0 for the pooled connection
+ * @param requests The requests
+ * @param number_of_requests The number of requests
+ */
+static void
+custom_metrics_query(int server, int lane, struct query_request* requests, int number_of_requests)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   pgexporter_select_lane(server, lane);
+
+   if (config->metrics_pipeline)
+   {
+      pgexporter_custom_query_pipeline(server, requests, number_of_requests);
+   }
+   else
+   {
+      for (int i = 0; i < number_of_requests; i++)
+      {
+         uint64_t start = pgexporter_stats_now();
+
+         pgexporter_custom_query(server, &requests[i]);
+         requests[i].duration = pgexporter_stats_now() - start;
+      }
+   }
+
+   pgexporter_select_lane(server, 0);
+}
+
+static int
+custom_metrics_weight_compare(const void* a, const void* b)
+{
+   uint64_t x = ((custom_metrics_weight_t*)a)->duration;
+   uint64_t y = ((custom_metrics_weight_t*)b)->duration;
+
+   // The longest first
+   return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/**
+ * Add the samples of a result from the template of its query alternative.
+ * The columns of the result are those of the definition, so the labels of
+ * a row are built once and shared by the samples of its value columns.
+ * With the rows of an incremental metric, a row whose values have the same
+ * fingerprint as at the last collection keeps its samples, and the samples
+ * of a row that is gone are deleted
+ * @param container The container
+ * @param buckets The buckets of the scrape, used for their buffers
+ * @param pool The pool of the catalog
+ * @param temp The result
+ * @param server The server
+ * @param timestamp The timestamp
+ * @param rows The fingerprints of the rows of the server, or NULL to render all rows
+ */
+static void
+sample_metrics(prometheus_metrics_container_t* container, histogram_buckets_t* buckets, char* pool,
+               query_list_t* temp, int server, time_t timestamp, struct art** rows)
+{
+   int column;
+   size_t labels;
+   uint64_t fingerprint;
+   bool changed;
+   struct art* previous = NULL;
+   struct art* current = NULL;
+   struct art_iterator* iter = NULL;
+   char* help = NULL;
+   char* type = NULL;
+   char* value = NULL;
+   struct column* columns = NULL;
+   struct query* query = temp->query;
+   struct metric_template* template = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (temp->query_alt->sample == 0)
+   {
+      return;
+   }
+
+   template = (struct metric_template*)(pool + temp->query_alt->sample);
+   columns = (struct column*)(pool + temp->query_alt->columns);
+
+   // The database and the server close the labels of all the samples of the result
+   buckets->common.length = 0;
+   if (temp->database[0] != '\0')
+   {
+      pgexporter_builder_append_length(&buckets->common, "database=\"", 10);
+      append_label_value(&buckets->common, temp->database);
+      pgexporter_builder_append_length(&buckets->common, "\",", 2);
+   }
+   pgexporter_builder_append_length(&buckets->common, "server=\"", 8);
+   append_label_value(&buckets->common, config->servers[server].name);
+   pgexporter_builder_append_length(&buckets->common, "\"}", 2);
+
+   // A row is known by its labels, so a metric without labels is rendered as a whole
+   if (rows != NULL && template->number_of_labels > 0 && !pgexporter_art_create(&current))
+   {
+      previous = *rows;
+   }
+
+   for (int row = 0; row < query->columns->number_of_rows; row++)
+   {
+      buckets->value.length = 0;
+      for (int l = 0; l < template->number_of_labels; l++)
+      {
+         pgexporter_builder_append_length(&buckets->value, pool + template->label_names[l], template->label_lengths[l]);
+         append_label_value(&buckets->value, pgexporter_get_value(template->labels[l], row, query));
+         pgexporter_builder_append_length(&buckets->value, "\",", 2);
+      }
+      labels = buckets->value.length;
+
+      if (current != NULL)
+      {
+         fingerprint = FINGERPRINT_BASIS;
+         for (int v = 0; v < template->number_of_values; v++)
+         {
+            value = pgexporter_get_value(template->values[v], row, query);
+            fingerprint = fingerprint_mix(fingerprint, value != NULL ? value : "", value != NULL ? strlen(value) + 1 : 0);
+         }
+
+         // A row with the labels of another row replaces its samples, so it is always rendered
+         changed = pgexporter_art_contains_key(current, buckets->value.data) ||
+                   previous == NULL || !pgexporter_art_contains_key(previous, buckets->value.data) ||
+                   (uint64_t)pgexporter_art_search(previous, buckets->value.data) != fingerprint;
+
+         pgexporter_art_insert(current, buckets->value.data, (uintptr_t)fingerprint, ValueUInt64);
+
+         if (!changed)
+         {
+            continue;
+         }
+      }
+
+      for (int v = 0; v < template->number_of_values; v++)
+      {
+         column = template->values[v];
+         value = pgexporter_get_value(column, row, query);
+
+         if (value == NULL)
+         {
+            continue;
+         }
+
+         buckets->key.length = 0;
+         pgexporter_builder_append_length(&buckets->key, pool + template->prefixes[v], template->prefix_lengths[v]);
+         if (labels > 0)
+         {
+            pgexporter_builder_append_length(&buckets->key, buckets->value.data, labels);
+         }
+         pgexporter_builder_append_length(&buckets->key, buckets->common.data, buckets->common.length);
+
+         help = columns[column].description != 0 ? pool + columns[column].description : "Custom metric";
+         type = columns[column].type == COUNTER_TYPE ? "counter" : "gauge";
+
+         add_metric_to_art(container->custom_arena, container->custom_metrics, buckets->key.data, value,
+                           help, type, timestamp, temp->sort_type);
+      }
+   }
+
+   if (current == NULL)
+   {
+      return;
+   }
+
+   // The samples of the rows that are gone
+   if (previous != NULL && !pgexporter_art_iterator_create(previous, &iter))
+   {
+      while (pgexporter_art_iterator_next(iter))
+      {
+         if (pgexporter_art_contains_key(current, iter->key))
+         {
+            continue;
+         }
+
+         for (int v = 0; v < template->number_of_values; v++)
+         {
+            buckets->key.length = 0;
+            pgexporter_builder_append_length(&buckets->key, pool + template->prefixes[v], template->prefix_lengths[v]);
+            pgexporter_builder_append(&buckets->key, iter->key);
+            pgexporter_builder_append_length(&buckets->key, buckets->common.data, buckets->common.length);
+
+            pgexporter_art_delete(container->custom_metrics, buckets->key.data);
+         }
+      }
+      pgexporter_art_iterator_destroy(iter);
+   }
+
+   pgexporter_art_destroy(previous);
+   *rows = current;
+}
 
-   status = pgexporter_write_message(client_ssl, client_fd, &msg);
+/**
+ * Add the samples of a histogram result. The result has the label columns
+ * of the query, and for the histogram column X the columns X with the array
+ * of upper bounds, X_bucket with the array of counts, X_sum and X_count.
+ * The columns are looked up by name once per result
+ * @param container The container
+ * @param buckets The buckets of the scrape
+ * @param pool The pool of the catalog
+ * @param temp The result
+ * @param server The server
+ * @param timestamp The timestamp
+ */
+static void
+histogram_metrics(prometheus_metrics_container_t* container, histogram_buckets_t* buckets, char* pool,
+                  query_list_t* temp, int server, time_t timestamp)
+{
+   int histogram[NUMBER_OF_HISTOGRAM_COLUMNS] = {-1, -1, -1, -1};
+   int number_of_labels = 0;
+   int labels[MAX_NUMBER_OF_COLUMNS];
+   char* names[MAX_NUMBER_OF_COLUMNS];
+   char name[MISC_LENGTH];
+   static const char* suffixes[NUMBER_OF_HISTOGRAM_COLUMNS] = {"", "_bucket", "_sum", "_count"};
+   char* help = "Custom metric";
+   char* bounds = NULL;
+   char* counts = NULL;
+   char* element = NULL;
+   char* p = NULL;
+   char* sum = NULL;
+   char* count = NULL;
+   size_t length;
+   size_t prefix;
+   struct column* columns = NULL;
+   struct query* query = temp->query;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
 
-   free(m);
+   columns = (struct column*)(pool + temp->query_alt->columns);
+   for (int k = 0; k < temp->query_alt->n_columns; k++)
+   {
+      if (columns[k].type == HISTOGRAM_TYPE && histogram[0] == -1)
+      {
+         for (int h = 0; h < NUMBER_OF_HISTOGRAM_COLUMNS; h++)
+         {
+            snprintf(&name[0], sizeof(name), "%s%s", pool + columns[k].name, suffixes[h]);
+            histogram[h] = pgexporter_get_column_index(&name[0], query);
+         }
 
-   return status;
+         if (columns[k].description != 0)
+         {
+            help = pool + columns[k].description;
+         }
+      }
+      else if (columns[k].type == LABEL_TYPE && columns[k].name != 0)
+      {
+         labels[number_of_labels] = pgexporter_get_column_index(pool + columns[k].name, query);
+         names[number_of_labels] = pool + columns[k].name;
+         if (labels[number_of_labels] != -1)
+         {
+            number_of_labels++;
+         }
+      }
+   }
+
+   if (histogram[0] == -1 || histogram[1] == -1)
+   {
+      pgexporter_log_debug("%s: the result doesn't have the columns of the histogram", temp->tag);
+      return;
+   }
+
+   for (int row = 0; row < query->columns->number_of_rows; row++)
+   {
+      bounds = pgexporter_get_value(histogram[0], row, query);
+      counts = pgexporter_get_value(histogram[1], row, query);
+      sum = pgexporter_get_value(histogram[2], row, query);
+      count = pgexporter_get_value(histogram[3], row, query);
+
+      if (bounds == NULL || counts == NULL || histogram_bounds(buckets, bounds))
+      {
+         continue;
+      }
+
+      // The labels of the row are shared by its samples
+      buckets->common.length = 0;
+      for (int l = 0; l < number_of_labels; l++)
+      {
+         pgexporter_builder_append(&buckets->common, names[l]);
+         pgexporter_builder_append_length(&buckets->common, "=\"", 2);
+         append_label_value(&buckets->common, pgexporter_get_value(labels[l], row, query));
+         pgexporter_builder_append_length(&buckets->common, "\",", 2);
+      }
+      if (temp->database[0] != '\0')
+      {
+         pgexporter_builder_append_length(&buckets->common, "database=\"", 10);
+         append_label_value(&buckets->common, temp->database);
+         pgexporter_builder_append_length(&buckets->common, "\",", 2);
+      }
+      pgexporter_builder_append_length(&buckets->common, "server=\"", 8);
+      append_label_value(&buckets->common, config->servers[server].name);
+      pgexporter_builder_append_length(&buckets->common, "\"}", 2);
+
+      buckets->key.length = 0;
+      pgexporter_builder_append_length(&buckets->key, "pgexporter_", 11);
+      pgexporter_builder_append(&buckets->key, temp->tag);
+      prefix = buckets->key.length;
+
+      p = counts;
+      for (int b = 0; b < buckets->number_of_buckets && (element = histogram_element(&p, &length)) != NULL; b++)
+      {
+         buckets->key.length = prefix;
+         pgexporter_builder_append_length(&buckets->key, "_bucket{", 8);
+         pgexporter_builder_append(&buckets->key, buckets->labels.data + buckets->offsets[b]);
+         pgexporter_builder_append_char(&buckets->key, ',');
+         pgexporter_builder_append_length(&buckets->key, buckets->common.data, buckets->common.length);
+
+         buckets->value.length = 0;
+         pgexporter_builder_append_length(&buckets->value, element, length);
+
+         add_metric_to_art(container->custom_arena, container->custom_metrics, buckets->key.data, buckets->value.data,
+                           help, "gauge", timestamp, temp->sort_type);
+      }
+
+      // The +Inf bucket has all the observations
+      if (!buckets->infinity && count != NULL)
+      {
+         buckets->key.length = prefix;
+         pgexporter_builder_append_length(&buckets->key, "_bucket{le=\"+Inf\",", 18);
+         pgexporter_builder_append_length(&buckets->key, buckets->common.data, buckets->common.length);
+
+         add_metric_to_art(container->custom_arena, container->custom_metrics, buckets->key.data, count,
+                           help, "gauge", timestamp, temp->sort_type);
+      }
+
+      if (sum != NULL)
+      {
+         buckets->key.length = prefix;
+         pgexporter_builder_append_length(&buckets->key, "_sum{", 5);
+         pgexporter_builder_append_length(&buckets->key, buckets->common.data, buckets->common.length);
+
+         add_metric_to_art(container->custom_arena, container->custom_metrics, buckets->key.data, sum,
+                           help, "gauge", timestamp, temp->sort_type);
+      }
+
+      if (count != NULL)
+      {
+         buckets->key.length = prefix;
+         pgexporter_builder_append_length(&buckets->key, "_count{", 7);
+         pgexporter_builder_append_length(&buckets->key, buckets->common.data, buckets->common.length);
+
+         add_metric_to_art(container->custom_arena, container->custom_metrics, buckets->key.data, count,
+                           help, "gauge", timestamp, temp->sort_type);
+      }
+   }
+}
+
+/**
+ * Decode the le labels of an array of upper bounds, unless
+ * they were decoded for the previous row
+ * @param buckets The buckets
+ * @param bounds The array of upper bounds, like {1,2,5}
+ * @return 0 upon success, otherwise 1
+ */
+static int
+histogram_bounds(histogram_buckets_t* buckets, char* bounds)
+{
+   char* p = bounds;
+   char* element = NULL;
+   size_t length;
+
+   if (buckets->bounds.data != NULL && !strcmp(buckets->bounds.data, bounds))
+   {
+      return 0;
+   }
+
+   buckets->bounds.length = 0;
+   buckets->labels.length = 0;
+   buckets->number_of_buckets = 0;
+   buckets->infinity = false;
+
+   while ((element = histogram_element(&p, &length)) != NULL)
+   {
+      if (buckets->number_of_buckets == buckets->capacity)
+      {
+         int capacity = buckets->capacity > 0 ? buckets->capacity * 2 : 32;
+         size_t* offsets = (size_t*)realloc(buckets->offsets, capacity * sizeof(size_t));
+
+         if (offsets == NULL)
+         {
+            goto error;
+         }
+
+         buckets->offsets = offsets;
+         buckets->capacity = capacity;
+      }
+
+      buckets->offsets[buckets->number_of_buckets++] = buckets->labels.length;
+
+      if ((length == 8 && !strncmp(element, "Infinity", 8)) || (length == 4 && !strncmp(element, "+Inf", 4)))
+      {
+         buckets->infinity = true;
+         element = "+Inf";
+         length = 4;
+      }
+
+      if (pgexporter_builder_append_length(&buckets->labels, "le=\"", 4) ||
+          pgexporter_builder_append_length(&buckets->labels, element, length) ||
+          pgexporter_builder_append_char(&buckets->labels, '"') ||
+          pgexporter_builder_append_char(&buckets->labels, '\0'))
+      {
+         goto error;
+      }
+   }
+
+   if (pgexporter_builder_append(&buckets->bounds, bounds))
+   {
+      goto error;
+   }
+
+   return 0;
 
 error:
 
-   return MESSAGE_STATUS_ERROR;
+   buckets->bounds.length = 0;
+   if (buckets->bounds.data != NULL)
+   {
+      buckets->bounds.data[0] = '\0';
+   }
+   buckets->number_of_buckets = 0;
+
+   return 1;
+}
+
+/**
+ * Get the next element of an array in the text format
+ * @param p The position in the array, which is moved past the element
+ * @param length The length of the element
+ * @return The element, or NULL at the end of the array
+ */
+static char*
+histogram_element(char** p, size_t* length)
+{
+   char* s = *p;
+   char* element = NULL;
+
+   while (*s == '{' || *s == ',' || *s == ' ' || *s == '"')
+   {
+      s++;
+   }
+
+   if (*s == '\0' || *s == '}')
+   {
+      *p = s;
+      return NULL;
+   }
+
+   element = s;
+   while (*s != '\0' && *s != ',' && *s != '}' && *s != '"')
+   {
+      s++;
+   }
+
+   *length = s - element;
+   *p = s;
+
+   return element;
+}
+
+static void
+histogram_buckets_destroy(histogram_buckets_t* buckets)
+{
+   pgexporter_builder_destroy(&buckets->bounds);
+   pgexporter_builder_destroy(&buckets->labels);
+   pgexporter_builder_destroy(&buckets->common);
+   pgexporter_builder_destroy(&buckets->key);
+   pgexporter_builder_destroy(&buckets->value);
+   free(buckets->offsets);
+   buckets->offsets = NULL;
+}
+
+/**
+ * Append a label value, escaped as in the text format
+ * @param builder The builder
+ * @param value The value, or NULL for an empty value
+ */
+static void
+append_label_value(struct builder* builder, char* value)
+{
+   for (char* c = value; c != NULL && *c != '\0'; c++)
+   {
+      if (*c == '\\' || *c == '"')
+      {
+         pgexporter_builder_append_char(builder, '\\');
+         pgexporter_builder_append_char(builder, *c);
+      }
+      else if (*c == '\n')
+      {
+         pgexporter_builder_append_length(builder, "\\n", 2);
+      }
+      else
+      {
+         pgexporter_builder_append_char(builder, *c);
+      }
+   }
+}
+
+static void
+collector_stats(int server, int collector, uint64_t start, int ret, struct query* query)
+{
+   pgexporter_stats_collector(server, collector, pgexporter_stats_now() - start,
+                              query != NULL ? query->number_of_rows : 0,
+                              query != NULL ? query->bytes : 0,
+                              ret != 0);
+}
+
+static int
+send_chunk(SSL* client_ssl, int client_fd, char* data)
+{
+   return pgexporter_write_chunk(client_ssl, client_fd, data, strlen(data));
 }
 
 static int
@@ -1742,65 +4309,51 @@ is_metrics_cache_configured(void)
    return config->metrics_cache_max_age != PGEXPORTER_PROMETHEUS_CACHE_DISABLED;
 }
 
-/**
- * Checks if the cache is still valid, and therefore can be
- * used to serve as a response.
- * A cache is considred valid if it has non-empty payload and
- * a timestamp in the future.
- *
- * @return true if the cache is still valid
- */
-static bool
-is_metrics_cache_valid(void)
+int
+pgexporter_init_prometheus_cache(size_t* p_size, void** p_shmem)
 {
-   time_t now;
-
-   struct prometheus_cache* cache;
+   struct configuration* config;
 
-   cache = (struct prometheus_cache*)prometheus_cache_shmem;
+   config = (struct configuration*)shmem;
 
-   if (cache->valid_until == 0 || strlen(cache->data) == 0)
+   if (pgexporter_cache_create(metrics_cache_size_to_alloc(), config->hugepage, p_size, p_shmem))
    {
-      return false;
+      goto error;
    }
 
-   now = time(NULL);
-   return now <= cache->valid_until;
+   return 0;
+
+error:
+   // disable caching
+   config->metrics_cache_max_age = config->metrics_cache_max_size = PGEXPORTER_PROMETHEUS_CACHE_DISABLED;
+   pgexporter_log_error("Cannot allocate shared memory for the Prometheus cache!");
+   *p_size = 0;
+   *p_shmem = NULL;
+
+   return 1;
 }
 
 int
-pgexporter_init_prometheus_cache(size_t* p_size, void** p_shmem)
+pgexporter_init_prometheus_snapshot(size_t* p_size, void** p_shmem)
 {
-   struct prometheus_cache* cache;
    struct configuration* config;
-   size_t cache_size = 0;
-   size_t struct_size = 0;
+   size_t slot_size = 0;
 
    config = (struct configuration*)shmem;
 
-   // first of all, allocate the overall cache structure
-   cache_size = metrics_cache_size_to_alloc();
-   struct_size = sizeof(struct prometheus_cache);
+   slot_size = config->metrics_cache_max_size > 0
+         ? MIN(config->metrics_cache_max_size, PROMETHEUS_MAX_CACHE_SIZE)
+         : PROMETHEUS_DEFAULT_CACHE_SIZE;
 
-   if (pgexporter_create_shared_memory(struct_size + cache_size, config->hugepage, (void*) &cache))
+   if (pgexporter_cache_create(slot_size, config->hugepage, p_size, p_shmem))
    {
       goto error;
    }
 
-   memset(cache, 0, struct_size + cache_size);
-   cache->valid_until = 0;
-   cache->size = cache_size;
-   atomic_init(&cache->lock, STATE_FREE);
-
-   // success! do the memory swap
-   *p_shmem = cache;
-   *p_size = cache_size + struct_size;
    return 0;
 
 error:
-   // disable caching
-   config->metrics_cache_max_age = config->metrics_cache_max_size = PGEXPORTER_PROMETHEUS_CACHE_DISABLED;
-   pgexporter_log_error("Cannot allocate shared memory for the Prometheus cache!");
+   pgexporter_log_error("Cannot allocate shared memory for the Prometheus snapshot!");
    *p_size = 0;
    *p_shmem = NULL;
 
@@ -1839,103 +4392,183 @@ metrics_cache_size_to_alloc(void)
 }
 
 /**
- * Invalidates the cache.
+ * Appends data to the cache.
  *
  * Requires the caller to hold the lock on the cache!
  *
- * Invalidating the cache means that the payload is zero-filled
- * and that the valid_until field is set to zero too.
+ * The data is appended only if the cache does not overflows, that
+ * means the current size of the cache plus the size of the data
+ * to append does not exceed the current cache size.
+ * If the cache overflows, the rebuild won't be served.
+ * This makes safe to call this method along the workflow of
+ * building the Prometheus response.
+ *
+ * @param data the data to append to the cache
+ * @param length the length of the data
+ * @return true on success
  */
-static void
-metrics_cache_invalidate(void)
+static bool
+metrics_cache_append(char* data, size_t length)
 {
    struct prometheus_cache* cache;
 
    cache = (struct prometheus_cache*)prometheus_cache_shmem;
 
-   memset(cache->data, 0, cache->size);
-   cache->valid_until = 0;
+   if (!is_metrics_cache_configured() || request_filter != NULL)
+   {
+      return false;
+   }
+
+   return pgexporter_cache_append(cache, data, length);
 }
 
 /**
- * Appends data to the cache.
+ * Finalizes the cache.
  *
  * Requires the caller to hold the lock on the cache!
  *
- * If the input data is empty, nothing happens.
- * The data is appended only if the cache does not overflows, that
- * means the current size of the cache plus the size of the data
- * to append does not exceed the current cache size.
- * If the cache overflows, the cache is flushed and marked
- * as invalid.
- * This makes safe to call this method along the workflow of
- * building the Prometheus response.
+ * This method should be invoked when the cache is complete
+ * and therefore can be served.
  *
- * @param data the string to append to the cache
- * @return true on success
+ * @return true if the cache has a validity
  */
 static bool
-metrics_cache_append(char* data)
+metrics_cache_finalize(void)
 {
-   size_t origin_length = 0;
-   size_t append_length = 0;
+   struct configuration* config;
    struct prometheus_cache* cache;
+   time_t now;
 
    cache = (struct prometheus_cache*)prometheus_cache_shmem;
+   config = (struct configuration*)shmem;
 
    if (!is_metrics_cache_configured())
    {
       return false;
    }
 
-   origin_length = strlen(cache->data);
-   append_length = strlen(data);
-   // need to append the data to the cache
-   if (origin_length + append_length >= cache->size)
+   now = time(NULL);
+
+   if (!pgexporter_cache_publish(cache, now + config->metrics_cache_max_age))
    {
-      // cannot append new data, so invalidate cache
-      pgexporter_log_debug("Cannot append %d bytes to the Prometheus cache because it will overflow the size of %d bytes (currently at %d bytes). HINT: try adjusting `metrics_cache_max_size`",
-                           append_length,
-                           cache->size,
-                           origin_length);
-      metrics_cache_invalidate();
+      if (cache->built > cache->size)
+      {
+         pgexporter_log_debug("Cannot cache %zu bytes because it will overflow the size of %zu bytes. The cache will grow for the next responses",
+                              cache->built,
+                              cache->size);
+      }
       return false;
    }
 
-   // append the data to the data field
-   memcpy(cache->data + origin_length, data, append_length);
-   cache->data[origin_length + append_length + 1] = '\0';
-   return true;
+   return config->metrics_cache_max_age > 0;
+}
+
+/**
+ * Renders the metrics into the slot of the snapshot that isn't
+ * served, and serves it from now on.
+ *
+ * Only the collector process publishes, so the lock is never contended.
+ *
+ * If the metrics don't fit, the previous snapshot is still served.
+ *
+ * @param container The collected metrics
+ */
+static void
+snapshot_publish(prometheus_metrics_container_t* container)
+{
+   struct prometheus_cache* snapshot;
+
+   snapshot = (struct prometheus_cache*)prometheus_snapshot_shmem;
+
+   if (snapshot == NULL || container == NULL || !pgexporter_cache_lock(snapshot))
+   {
+      return;
+   }
+
+   pgexporter_cache_begin(snapshot);
+
+   output_all_metrics(NULL, -1, container, OUTPUT_FORMAT_TEXT);
+
+   if (!pgexporter_cache_publish(snapshot, 0) && snapshot->built > snapshot->size)
+   {
+      pgexporter_log_warn("Cannot publish %zu bytes in the Prometheus snapshot of %zu bytes. HINT: try adjusting `metrics_cache_max_size`",
+                          snapshot->built,
+                          snapshot->size);
+   }
+
+   pgexporter_cache_unlock(snapshot);
+}
+
+/**
+ * Push the metrics of a collection to the remote write receiver.
+ *
+ * The custom metrics which weren't due keep their old timestamps,
+ * and are left out, so a sample is only sent once.
+ *
+ * @param container The collected metrics
+ * @param since The time of the collection
+ */
+static void
+remote_write_publish(prometheus_metrics_container_t* container, time_t since)
+{
+   if (container == NULL)
+   {
+      return;
+   }
+
+   remote_write_art(container->general_metrics, since);
+   remote_write_art(container->server_metrics, since);
+   remote_write_art(container->version_metrics, since);
+   remote_write_art(container->uptime_metrics, since);
+   remote_write_art(container->primary_metrics, since);
+   remote_write_art(container->core_metrics, since);
+   remote_write_art(container->extension_metrics, since);
+   remote_write_art(container->extension_list_metrics, since);
+   remote_write_art(container->settings_metrics, since);
+   remote_write_art(container->custom_metrics, since);
+
+   pgexporter_remote_write_flush();
+}
+
+/**
+ * Add the metrics of an ART to the remote write requests.
+ *
+ * @param art_tree The ART
+ * @param since The oldest timestamp to send
+ */
+static void
+remote_write_art(struct art* art_tree, time_t since)
+{
+   struct art_iterator* iter = NULL;
+
+   if (art_tree == NULL || pgexporter_art_iterator_create(art_tree, &iter))
+   {
+      return;
+   }
+
+   while (pgexporter_art_iterator_next(iter))
+   {
+      prometheus_metric_value_t* metric = (prometheus_metric_value_t*)iter->value->data;
+
+      if (metric->timestamp >= since)
+      {
+         pgexporter_remote_write_add(iter->key, metric->value, metric->timestamp);
+      }
+   }
+
+   pgexporter_art_iterator_destroy(iter);
 }
 
 /**
- * Finalizes the cache.
- *
- * Requires the caller to hold the lock on the cache!
+ * Appends data to the snapshot being published.
  *
- * This method should be invoked when the cache is complete
- * and therefore can be served.
- *
- * @return true if the cache has a validity
+ * @param data the data to append to the snapshot
+ * @param length the length of the data
  */
-static bool
-metrics_cache_finalize(void)
+static void
+snapshot_append(char* data, size_t length)
 {
-   struct configuration* config;
-   struct prometheus_cache* cache;
-   time_t now;
-
-   cache = (struct prometheus_cache*)prometheus_cache_shmem;
-   config = (struct configuration*)shmem;
-
-   if (!is_metrics_cache_configured())
-   {
-      return false;
-   }
-
-   now = time(NULL);
-   cache->valid_until = now + config->metrics_cache_max_age;
-   return cache->valid_until > now;
+   pgexporter_cache_append((struct prometheus_cache*)prometheus_snapshot_shmem, data, length);
 }
 
 /**
@@ -2006,12 +4639,16 @@ create_metrics_container(prometheus_metrics_container_t** container)
        pgexporter_art_create(&c->extension_metrics) ||
        pgexporter_art_create(&c->extension_list_metrics) ||
        pgexporter_art_create(&c->settings_metrics) ||
-       pgexporter_art_create(&c->custom_metrics))
+       pgexporter_art_create(&c->custom_metrics) ||
+       pgexporter_arena_create(65536, &c->arena))
    {
       destroy_metrics_container(c);
       return 1;
    }
 
+   c->custom_arena = c->arena;
+   c->static_arena = c->arena;
+
    *container = c;
    return 0;
 }
@@ -2038,14 +4675,105 @@ destroy_metrics_container(prometheus_metrics_container_t* container)
    pgexporter_art_destroy(container->settings_metrics);
    pgexporter_art_destroy(container->custom_metrics);
 
+   // The trees are gone, so the values can be released in one go
+   pgexporter_arena_destroy(container->arena);
+
    free(container);
 }
 
 /**
- * Add metric to ART with timestamp
+ * Add data to an FNV-1a hash
+ * @param fingerprint The hash so far
+ * @param data The data
+ * @param length The length of the data
+ * @return The hash
+ */
+static uint64_t
+fingerprint_mix(uint64_t fingerprint, void* data, size_t length)
+{
+   unsigned char* d = (unsigned char*)data;
+
+   for (size_t i = 0; i < length; i++)
+   {
+      fingerprint ^= d[i];
+      fingerprint *= 1099511628211ULL;
+   }
+
+   return fingerprint;
+}
+
+/**
+ * Keep the samples of a static collector when its results didn't change,
+ * with a newer timestamp, or else start over with an empty tree
+ * @param art The samples
+ * @param last The fingerprint of the samples
+ * @param fingerprint The fingerprint of the results
+ * @param timestamp The timestamp
+ * @return true if the samples were kept, otherwise false
+ */
+static bool
+static_metrics_unchanged(struct art** art, uint64_t* last, uint64_t fingerprint, time_t timestamp)
+{
+   if (*art != NULL && *last == fingerprint)
+   {
+      refresh_metrics(*art, timestamp);
+      return true;
+   }
+
+   if (*art != NULL && (*art)->size > 0)
+   {
+      pgexporter_art_destroy(*art);
+      *art = NULL;
+      pgexporter_art_create(art);
+   }
+
+   *last = fingerprint;
+
+   return false;
+}
+
+/**
+ * Move the samples of a container to the next one
+ * @param to The tree of the next container
+ * @param from The tree of the container
+ */
+static void
+static_metrics_keep(struct art** to, struct art** from)
+{
+   pgexporter_art_destroy(*to);
+   *to = *from;
+   *from = NULL;
+}
+
+/**
+ * Set the timestamp of all the samples of a tree
+ * @param art The samples
+ * @param timestamp The timestamp
+ */
+static void
+refresh_metrics(struct art* art, time_t timestamp)
+{
+   struct art_iterator* iter = NULL;
+
+   if (pgexporter_art_iterator_create(art, &iter))
+   {
+      return;
+   }
+
+   while (pgexporter_art_iterator_next(iter))
+   {
+      ((prometheus_metric_value_t*)iter->value->data)->timestamp = timestamp;
+   }
+
+   pgexporter_art_iterator_destroy(iter);
+}
+
+/**
+ * Add metric to ART with timestamp. The value is allocated from the arena,
+ * or with malloc() when the arena is NULL
  */
 static int
-add_metric_to_art(struct art* art_tree, char* key, char* value, char* help, char* type, time_t timestamp, int sort_type)
+add_metric_to_art(struct arena* arena, struct art* art_tree, char* key, char* value, char* help, char* type, time_t timestamp, int sort_type)
 {
    prometheus_metric_value_t* metric_value = NULL;
    struct value_config vc = {.destroy_data = &prometheus_metric_value_destroy_cb,
@@ -2056,6 +4784,32 @@ add_metric_to_art(struct art* art_tree, char* key, char* value, char* help, char
       return 1;
    }
 
+   if (arena != NULL)
+   {
+      // Released together with the arena
+      vc.destroy_data = NULL;
+
+      metric_value = (prometheus_metric_value_t*)pgexporter_arena_alloc(arena, sizeof(prometheus_metric_value_t),
+                                                                        _Alignof(prometheus_metric_value_t));
+      if (metric_value == NULL)
+      {
+         return 1;
+      }
+
+      metric_value->timestamp = timestamp;
+      metric_value->value = pgexporter_arena_strdup(arena, value);
+      metric_value->help = help ? pgexporter_arena_strdup(arena, help) : NULL;
+      metric_value->type = pgexporter_arena_strdup(arena, type ? type : "gauge");
+      metric_value->sort_type = sort_type;
+
+      if (metric_value->value == NULL || metric_value->type == NULL || (help != NULL && metric_value->help == NULL))
+      {
+         return 1;
+      }
+
+      return pgexporter_art_insert_with_config(art_tree, key, (uintptr_t)metric_value, &vc);
+   }
+
    // Create metric value with timestamp
    metric_value = malloc(sizeof(prometheus_metric_value_t));
    if (metric_value == NULL)
@@ -2086,83 +4840,425 @@ add_metric_to_art(struct art* art_tree, char* key, char* value, char* help, char
  * Output metrics from ART in sorted order
  */
 static void
-output_art_metrics(SSL* client_ssl, int client_fd, struct art* art_tree, char* category_name)
+output_art_metrics(output_buffer_t* out, struct art* art_tree, char* category_name)
 {
+   int walks = 1;
+   int number_of_prefixes = 0;
+   char* prefixes[MAX_NUMBER_OF_FILTERS];
    struct art_iterator* iter = NULL;
-   char* data = NULL;
+   size_t key_length;
+   size_t name_length;
 
    (void)category_name;
 
-   if (art_tree == NULL || pgexporter_art_iterator_create(art_tree, &iter))
+   if (art_tree == NULL)
    {
       return;
    }
 
-   while (pgexporter_art_iterator_next(iter))
+   // A filter by name only walks the parts of the tree with the names it can select
+   number_of_prefixes = pgexporter_filter_prefixes(request_filter, prefixes);
+   if (number_of_prefixes > 0)
    {
-      prometheus_metric_value_t* metric = (prometheus_metric_value_t*)iter->value->data;
-      char* metric_key = iter->key;
+      walks = number_of_prefixes;
+   }
+
+   for (int w = 0; w < walks; w++)
+   {
+      if (number_of_prefixes > 0)
+      {
+         if (pgexporter_art_iterator_create_prefix(art_tree, prefixes[w], &iter))
+         {
+            return;
+         }
+      }
+      else if (pgexporter_art_iterator_create(art_tree, &iter))
+      {
+         return;
+      }
+
+      while (pgexporter_art_iterator_next(iter))
+      {
+         prometheus_metric_value_t* metric = (prometheus_metric_value_t*)iter->value->data;
+         char* metric_key = iter->key;
+
+         if (!pgexporter_filter_metric(request_filter, metric_key, 0))
+         {
+            continue;
+         }
+
+         key_length = strlen(metric_key);
+         name_length = strcspn(metric_key, "{");
+
+         if (out->format == OUTPUT_FORMAT_PROTOBUF)
+         {
+            output_protobuf(out, metric_key, name_length, metric);
+         }
+         else if (out->format == OUTPUT_FORMAT_OPENMETRICS)
+         {
+            // A family is described once, before all of its samples
+            output_family(out, metric_key, name_length, metric);
+
+            output_append(out, metric_key, key_length);
+            output_append(out, " ", 1);
+            output_append(out, metric->value, strlen(metric->value));
+
+            // The timestamp is in seconds
+            output_append(out, " ", 1);
+            pgexporter_builder_append_int(&out->data, (int64_t)metric->timestamp);
+            output_append(out, "\n", 1);
+         }
+         else
+         {
+            // Output HELP line
+            if (metric->help != NULL)
+            {
+               output_append(out, "# HELP ", 7);
+               output_append(out, metric_key, key_length);
+               output_append(out, " ", 1);
+               output_append(out, metric->help, strlen(metric->help));
+               output_append(out, "\n", 1);
+            }
+
+            // Output TYPE line
+            output_append(out, "# TYPE ", 7);
+            output_append(out, metric_key, key_length);
+            output_append(out, " ", 1);
+            output_append(out, metric->type, strlen(metric->type));
+            output_append(out, "\n", 1);
+
+            // Output metric value with timestamp in milliseconds
+            output_append(out, metric_key, key_length);
+            output_append(out, " ", 1);
+            output_append(out, metric->value, strlen(metric->value));
+
+            output_append(out, " ", 1);
+            pgexporter_builder_append_int(&out->data, (int64_t)metric->timestamp);
+            output_append(out, "000\n", 4);
+         }
+
+         if (out->data.length >= OUTPUT_CHUNK_HEADER + OUTPUT_CHUNK_SIZE)
+         {
+            output_flush(out);
+         }
+      }
+
+      pgexporter_art_iterator_destroy(iter);
+      iter = NULL;
+   }
+}
 
-      // Output HELP line
+static void
+output_all_metrics(SSL* client_ssl, int client_fd, prometheus_metrics_container_t* container, int format)
+{
+   uint64_t start;
+   output_buffer_t out;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (container == NULL)
+   {
+      return;
+   }
+
+   start = pgexporter_stats_now();
+
+   memset(&out, 0, sizeof(output_buffer_t));
+   out.client_ssl = client_ssl;
+   out.client_fd = client_fd;
+   out.status = MESSAGE_STATUS_OK;
+   out.format = format;
+
+   pgexporter_builder_init(&out.data, OUTPUT_CHUNK_HEADER + OUTPUT_CHUNK_SIZE + 1024);
+   out.data.length = OUTPUT_CHUNK_HEADER;
+   pgexporter_builder_init(&out.name, 0);
+   pgexporter_builder_init(&out.family, 0);
+   pgexporter_builder_init(&out.metric, 0);
+
+   // Output metrics from each category ART in sorted order
+   output_art_metrics(&out, container->general_metrics, "general");
+   output_art_metrics(&out, container->server_metrics, "server");
+   output_art_metrics(&out, container->version_metrics, "version");
+   output_art_metrics(&out, container->uptime_metrics, "uptime");
+   output_art_metrics(&out, container->primary_metrics, "primary");
+   output_art_metrics(&out, container->core_metrics, "core");
+   output_art_metrics(&out, container->extension_metrics, "extension");
+   output_art_metrics(&out, container->extension_list_metrics, "extension_list");
+   output_art_metrics(&out, container->settings_metrics, "settings");
+   output_art_metrics(&out, container->custom_metrics, "custom");
+
+   if (format == OUTPUT_FORMAT_PROTOBUF)
+   {
+      output_protobuf_end(&out);
+   }
+   else
+   {
+      // The self-instrumentation is only rendered as text
+      if (config->metrics_self && request_pass("self", "pgexporter_self_"))
+      {
+         pgexporter_stats_output(&out.data);
+      }
+
+      if (config->metrics_self && config->memory_accounting && request_pass("self", "pgexporter_memory_"))
+      {
+         pgexporter_stats_memory_output(&out.data);
+      }
+   }
+
+   if (format == OUTPUT_FORMAT_OPENMETRICS)
+   {
+      output_append(&out, "# EOF\n", 6);
+   }
+
+   output_flush(&out);
+
+   pgexporter_builder_destroy(&out.data);
+   pgexporter_builder_destroy(&out.name);
+   pgexporter_builder_destroy(&out.family);
+   pgexporter_builder_destroy(&out.metric);
+
+   // The writes to the client are the send phase, and the rest is rendering
+   pgexporter_stats_phase(STATS_PHASE_SEND, pgexporter_stats_now() - out.send);
+   pgexporter_stats_phase(STATS_PHASE_RENDER, start + out.send);
+}
+
+/**
+ * Describe the family of a metric in the OpenMetrics format, unless it is
+ * the family of the previous metric
+ * @param out The output buffer
+ * @param key The key of the metric
+ * @param name_length The length of the name in the key
+ * @param metric The metric
+ */
+static void
+output_family(output_buffer_t* out, char* key, size_t name_length, prometheus_metric_value_t* metric)
+{
+   char* type = metric->type;
+
+   if (out->name.length == name_length && !strncmp(out->name.data, key, name_length))
+   {
+      return;
+   }
+
+   out->name.length = 0;
+   pgexporter_builder_append_length(&out->name, key, name_length);
+
+   if (strcmp(type, "counter") && strcmp(type, "gauge"))
+   {
+      type = "unknown";
+   }
+
+   if (metric->help != NULL)
+   {
+      output_append(out, "# HELP ", 7);
+      output_append(out, key, name_length);
+      output_append(out, " ", 1);
+      output_append(out, metric->help, strlen(metric->help));
+      output_append(out, "\n", 1);
+   }
+
+   output_append(out, "# TYPE ", 7);
+   output_append(out, key, name_length);
+   output_append(out, " ", 1);
+   output_append(out, type, strlen(type));
+   output_append(out, "\n", 1);
+}
+
+/**
+ * Encode a metric as a Metric of the protobuf format, in the MetricFamily
+ * of its name. The families are delimited by their length, so a family is
+ * added to the output buffer once all of its metrics have been encoded
+ * @param out The output buffer
+ * @param key The key of the metric
+ * @param name_length The length of the name in the key
+ * @param metric The metric
+ */
+static void
+output_protobuf(output_buffer_t* out, char* key, size_t name_length, prometheus_metric_value_t* metric)
+{
+   int field;
+
+   if (out->name.length != name_length || strncmp(out->name.data, key, name_length))
+   {
+      output_protobuf_end(out);
+
+      out->name.length = 0;
+      pgexporter_builder_append_length(&out->name, key, name_length);
+
+      if (!strcmp(metric->type, "counter"))
+      {
+         out->type = PROTOBUF_TYPE_COUNTER;
+      }
+      else if (!strcmp(metric->type, "gauge"))
+      {
+         out->type = PROTOBUF_TYPE_GAUGE;
+      }
+      else
+      {
+         out->type = PROTOBUF_TYPE_UNTYPED;
+      }
+
+      // MetricFamily: name = 1, help = 2, type = 3
+      pgexporter_protobuf_bytes(&out->family, 1, key, name_length);
       if (metric->help != NULL)
       {
-         data = pgexporter_append(data, "# HELP ");
-         data = pgexporter_append(data, metric_key);
-         data = pgexporter_append_char(data, ' ');
-         data = pgexporter_append(data, metric->help);
-         data = pgexporter_append_char(data, '\n');
+         pgexporter_protobuf_bytes(&out->family, 2, metric->help, strlen(metric->help));
       }
+      pgexporter_protobuf_uint64(&out->family, 3, out->type);
+   }
 
-      // Output TYPE line
-      data = pgexporter_append(data, "# TYPE ");
-      data = pgexporter_append(data, metric_key);
-      data = pgexporter_append_char(data, ' ');
-      data = pgexporter_append(data, metric->type);
-      data = pgexporter_append_char(data, '\n');
+   // Metric: label = 1, gauge = 2, counter = 3, untyped = 5, timestamp_ms = 6
+   out->metric.length = 0;
+   output_protobuf_labels(&out->metric, key + name_length);
 
-      // Output metric value with timestamp
-      data = pgexporter_append(data, metric_key);
-      data = pgexporter_append_char(data, ' ');
-      data = pgexporter_append(data, metric->value);
-      data = pgexporter_append_char(data, ' ');
+   field = out->type == PROTOBUF_TYPE_COUNTER ? 3 : out->type == PROTOBUF_TYPE_GAUGE ? 2 : 5;
+   pgexporter_protobuf_tag(&out->metric, field, PROTOBUF_WIRE_LENGTH);
+   pgexporter_protobuf_varint(&out->metric, 9);
+   pgexporter_protobuf_double(&out->metric, 1, strtod(metric->value, NULL));
 
-      // Add timestamp in milliseconds
-      char timestamp_str[32];
-      snprintf(timestamp_str, sizeof(timestamp_str), "%ld000", metric->timestamp);
-      data = pgexporter_append(data, timestamp_str);
-      data = pgexporter_append_char(data, '\n');
+   pgexporter_protobuf_uint64(&out->metric, 6, (uint64_t)metric->timestamp * 1000);
 
-      // Send chunk and cache
-      send_chunk(client_ssl, client_fd, data);
-      metrics_cache_append(data);
+   // MetricFamily: metric = 4
+   pgexporter_protobuf_bytes(&out->family, 4, out->metric.data, out->metric.length);
+}
+
+/**
+ * Encode the labels of a key, like {a="b",c="d"}, as the LabelPair of a Metric
+ * @param builder The Metric
+ * @param labels The labels, or an empty string
+ */
+static void
+output_protobuf_labels(struct builder* builder, char* labels)
+{
+   char* p = labels;
+   char* name = NULL;
+   char* value = NULL;
+   size_t name_length;
 
-      free(data);
-      data = NULL;
+   if (*p != '{')
+   {
+      return;
    }
+   p++;
 
-   pgexporter_art_iterator_destroy(iter);
+   while (*p != '\0' && *p != '}')
+   {
+      name = p;
+      while (*p != '\0' && *p != '=')
+      {
+         p++;
+      }
+
+      name_length = p - name;
+
+      if (*p != '=' || *(p + 1) != '"')
+      {
+         return;
+      }
+      p += 2;
+
+      value = p;
+      while (*p != '\0' && *p != '"')
+      {
+         p += (*p == '\\' && *(p + 1) != '\0') ? 2 : 1;
+      }
+
+      if (*p != '"')
+      {
+         return;
+      }
+
+      pgexporter_protobuf_label(builder, 1, name, name_length, value, p - value);
+      p++;
+
+      if (*p == ',')
+      {
+         p++;
+      }
+   }
 }
 
 /**
- * Output all metrics from container in category order
+ * Add the current MetricFamily to the output buffer, delimited by its length
+ * @param out The output buffer
  */
 static void
-output_all_metrics(SSL* client_ssl, int client_fd, prometheus_metrics_container_t* container)
+output_protobuf_end(output_buffer_t* out)
 {
-   if (container == NULL)
+   if (out->family.length == 0)
    {
       return;
    }
 
-   // Output metrics from each category ART in sorted order
-   output_art_metrics(client_ssl, client_fd, container->general_metrics, "general");
-   output_art_metrics(client_ssl, client_fd, container->server_metrics, "server");
-   output_art_metrics(client_ssl, client_fd, container->version_metrics, "version");
-   output_art_metrics(client_ssl, client_fd, container->uptime_metrics, "uptime");
-   output_art_metrics(client_ssl, client_fd, container->primary_metrics, "primary");
-   output_art_metrics(client_ssl, client_fd, container->core_metrics, "core");
-   output_art_metrics(client_ssl, client_fd, container->extension_metrics, "extension");
-   output_art_metrics(client_ssl, client_fd, container->extension_list_metrics, "extension_list");
-   output_art_metrics(client_ssl, client_fd, container->settings_metrics, "settings");
-   output_art_metrics(client_ssl, client_fd, container->custom_metrics, "custom");
+   pgexporter_protobuf_varint(&out->data, out->family.length);
+   pgexporter_builder_append_length(&out->data, out->family.data, out->family.length);
+
+   out->family.length = 0;
+}
+
+/**
+ * Append data to the output buffer
+ * @param out The output buffer
+ * @param data The data
+ * @param length The length of the data
+ */
+static void
+output_append(output_buffer_t* out, char* data, size_t length)
+{
+   pgexporter_builder_append_length(&out->data, data, length);
+}
+
+/**
+ * Send the output buffer as a HTTP chunk, and add it to the cache.
+ * For the snapshot it is only added to the snapshot
+ * @param out The output buffer
+ */
+static void
+output_flush(output_buffer_t* out)
+{
+   uint64_t start;
+   size_t length;
+   char size[2 * sizeof(size_t) + 3];
+   struct message msg;
+
+   if (out->data.data == NULL || out->data.length <= OUTPUT_CHUNK_HEADER)
+   {
+      return;
+   }
+
+   length = out->data.length - OUTPUT_CHUNK_HEADER;
+
+   if (out->client_fd == -1)
+   {
+      // Rendering the snapshot of the collector
+      snapshot_append(out->data.data + OUTPUT_CHUNK_HEADER, length);
+   }
+   else
+   {
+      metrics_cache_append(out->data.data + OUTPUT_CHUNK_HEADER, length);
+
+      if (out->status == MESSAGE_STATUS_OK)
+      {
+         // A chunk size may have leading zeros, so the header has a fixed length.
+         // A chunk is flushed once it holds OUTPUT_CHUNK_SIZE bytes, so 8 digits are enough
+#ifdef DEBUG
+         assert(length <= 0xFFFFFFFF);
+#endif
+         snprintf(&size[0], sizeof(size), "%08zX\r\n", length);
+         memcpy(out->data.data, &size[0], OUTPUT_CHUNK_HEADER);
+         pgexporter_builder_append_length(&out->data, "\r\n", 2);
+
+         memset(&msg, 0, sizeof(struct message));
+         msg.kind = 0;
+         msg.length = out->data.length;
+         msg.data = out->data.data;
+
+         start = pgexporter_stats_now();
+         out->status = pgexporter_write_message(out->client_ssl, out->client_fd, &msg);
+         out->send += pgexporter_stats_now() - start;
+      }
+   }
+
+   out->data.length = OUTPUT_CHUNK_HEADER;
 }
@@ -27,43 +27,116 @@
  */
 
 #include <pgexporter.h>
+#include <arena.h>
 #include <art.h>
-#include <deque.h>
+#include <connection.h>
+#include <filter.h>
 #include <http.h>
-#include <json.h>
 #include <logging.h>
+#include <network.h>
 #include <prometheus_client.h>
 #include <utils.h>
 #include <value.h>
 
 #include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
-static int parse_body_to_bridge(int endpoint, time_t timestamp, char* body, struct prometheus_bridge* bridge);
+static int endpoint_connection(int endpoint, bool* leased);
+static void endpoint_release(int endpoint, bool leased, struct http* http);
+#define BRIDGE_MAX_LABELS 64
+
+/** @struct bridge_token
+ * A part of a line, which isn't terminated
+ */
+struct bridge_token
+{
+   char* data;    /**< The start of the token */
+   size_t length; /**< The length of the token */
+};
+
+/** @struct bridge_label
+ * A label of a sample
+ */
+struct bridge_label
+{
+   struct bridge_token key;   /**< The key */
+   struct bridge_token value; /**< The value, as escaped in the line */
+};
+
+/** @struct bridge_parser
+ * The state of the metrics of an endpoint while its lines arrive
+ */
+struct bridge_parser
+{
+   int endpoint;                      /**< The endpoint */
+   time_t timestamp;                  /**< The time of the response */
+   struct prometheus_bridge* bridge;  /**< The bridge */
+   struct prometheus_metric* metric;  /**< The current metric */
+   struct prometheus_attribute label; /**< The endpoint label, interned */
+};
+
+/** @struct bridge_aggregate
+ * The samples of a series aggregated over the endpoints
+ */
+struct bridge_aggregate
+{
+   struct prometheus_attributes* definition; /**< A definition with the name and the labels of the series */
+   double value;                             /**< The aggregated value */
+   uint64_t count;                           /**< The number of samples */
+   time_t timestamp;                         /**< The latest timestamp */
+};
+
+static int parse_line_to_bridge(char* line, size_t length, void* data);
+static bool lex_space(char** p, char* end);
+static bool lex_name(char** p, char* end, struct bridge_token* token);
+static bool lex_label_value(char** p, char* end, struct bridge_token* token);
+static bool lex_value(char** p, char* end, struct bridge_token* token);
+static int lex_comment(char* line, size_t length, struct bridge_token* keyword, struct bridge_token* name, struct bridge_token* text);
+static int lex_sample(char* line, size_t length, struct bridge_token* name, struct bridge_label* labels, int* number_of_labels, struct bridge_token* value);
+static bool token_equals(struct bridge_token* token, char* s);
+static uint64_t intern_hash(void* data, size_t length);
+static int intern_grow(struct prometheus_intern_table* table);
+static struct prometheus_intern* intern_entry(struct prometheus_bridge* bridge, struct prometheus_intern_table* table, void* data, size_t length);
+static void* intern(struct prometheus_bridge* bridge, struct prometheus_intern_table* table, void* data, size_t length);
+static char* intern_string(struct prometheus_bridge* bridge, struct bridge_token* token);
 static int metric_find_create(struct prometheus_bridge* bridge, char* name, struct prometheus_metric** metric);
-static int metric_set_name(struct prometheus_metric* metric, char* name);
-static int metric_set_help(struct prometheus_metric* metric, char* help);
-static int metric_set_type(struct prometheus_metric* metric, char* type);
-static bool attributes_contains(struct deque* attributes, struct prometheus_attribute* attribute);
-static int attributes_find_create(struct deque* definitions, struct deque* input, struct prometheus_attributes** attributes, bool* new);
-static int add_attribute(struct deque* attributes, char* key, char* value);
-static int add_value(struct deque* values, time_t timestamp, char* value);
-static int add_line(struct prometheus_metric* metric, char* line, int endpoint, time_t timestamp);
-
-static void  prometheus_metric_destroy_cb(uintptr_t data);
-static char* deque_string_cb(uintptr_t data, int32_t format, char* tag, int indent);
-static char* prometheus_metric_string_cb(uintptr_t data, int32_t format, char* tag, int indent);
-static void  prometheus_attributes_destroy_cb(uintptr_t data);
-static char* prometheus_attributes_string_cb(uintptr_t data, int32_t format, char* tag, int indent);
-static void  prometheus_value_destroy_cb(uintptr_t data);
-static char* prometheus_value_string_cb(uintptr_t data, int32_t format, char* tag, int indent);
-static void  prometheus_attribute_destroy_cb(uintptr_t data);
-static char* prometheus_attribute_string_cb(uintptr_t data, int32_t format, char* tag, int indent);
+static void attributes_sort(struct prometheus_attribute* attributes, int number_of_attributes);
+static int definitions_grow(struct prometheus_bridge* bridge, struct prometheus_metric* metric);
+static int attributes_find_create(struct prometheus_bridge* bridge, struct prometheus_metric* metric, char* name,
+                                  struct prometheus_attribute* attributes, int number_of_attributes, uint64_t hash,
+                                  struct prometheus_attributes** definition);
+
+static int metric_render(struct prometheus_bridge* bridge, struct prometheus_metric* metric);
+static int metric_render_json(struct prometheus_bridge* bridge, struct prometheus_metric* metric);
+static void definition_render(struct builder* text, struct prometheus_attributes* d, char* value);
+static void definition_render_json(struct builder* json, struct prometheus_attributes* d, char* value, time_t timestamp);
+static struct bridge_rule* rule_get(struct prometheus_metric* metric);
+static int rule_find(char* name);
+static bool rule_keeps(struct bridge_rule* rule, char* label, size_t length);
+static void aggregate_add(int aggregation, double* value, uint64_t* count, double v, uint64_t n);
+static char* aggregate_format(int aggregation, double value, uint64_t count, char* buffer, size_t size);
+static char* definition_value(struct prometheus_metric* metric, struct prometheus_attributes* d, char* buffer, size_t size);
+static int aggregate_merge(struct art* merged, struct prometheus_metric* metric);
+static void aggregate_render(struct art* merged, struct prometheus_metric* metric, struct builder* text, struct builder* json,
+                             bool* definitions);
+static void json_append_string(struct builder* builder, char* s);
+static int bridge_names(struct prometheus_bridge** bridges, int number_of_bridges, struct metrics_filter* filter, struct art** names);
+static int bridge_names_compare(const void* a, const void* b);
+
+/* The pooled endpoint connections of the owner process, inherited by its children */
+static int pool[NUMBER_OF_ENDPOINTS] = {[0 ... NUMBER_OF_ENDPOINTS - 1] = -1};
+/* The process keeping its own endpoint connections in the pool */
+static pid_t pool_owner = 0;
 
 int
 pgexporter_prometheus_client_create_bridge(struct prometheus_bridge** bridge)
@@ -88,12 +161,24 @@ pgexporter_prometheus_client_create_bridge(struct prometheus_bridge** bridge)
       goto error;
    }
 
+   if (pgexporter_arena_create(65536, &b->arena))
+   {
+      pgexporter_log_error("Failed to create arena");
+      goto error;
+   }
+
    *bridge = b;
 
    return 0;
 
 error:
 
+   if (b != NULL)
+   {
+      pgexporter_art_destroy(b->metrics);
+   }
+   free(b);
+
    return 1;
 }
 
@@ -103,6 +188,9 @@ pgexporter_prometheus_client_destroy_bridge(struct prometheus_bridge* bridge)
    if (bridge != NULL)
    {
       pgexporter_art_destroy(bridge->metrics);
+      pgexporter_arena_destroy(bridge->arena);
+      free(bridge->strings.entries);
+      free(bridge->labels.entries);
    }
 
    free(bridge);
@@ -113,7 +201,9 @@ pgexporter_prometheus_client_destroy_bridge(struct prometheus_bridge* bridge)
 int
 pgexporter_prometheus_client_get(int endpoint, struct prometheus_bridge* bridge)
 {
-   time_t timestamp;
+   int fd;
+   bool leased = false;
+   struct bridge_parser parser;
    struct http* http = NULL;
    struct configuration* config = NULL;
 
@@ -121,7 +211,18 @@ pgexporter_prometheus_client_get(int endpoint, struct prometheus_bridge* bridge)
 
    pgexporter_log_debug("Endpoint http://%s:%d/metrics", config->endpoints[endpoint].host, config->endpoints[endpoint].port);
 
-   if (pgexporter_http_connect(config->endpoints[endpoint].host, config->endpoints[endpoint].port, false, &http))
+   fd = endpoint_connection(endpoint, &leased);
+
+connect:
+   if (fd != -1)
+   {
+      if (pgexporter_http_create(fd, config->bridge_timeout, &http))
+      {
+         goto error;
+      }
+   }
+   else if (pgexporter_http_connect(config->endpoints[endpoint].host, config->endpoints[endpoint].port, false,
+                                    config->bridge_timeout, &http))
    {
       pgexporter_log_error("Failed to connect to HTTP endpoint %d (%s:%d)",
                            endpoint,
@@ -131,23 +232,42 @@ pgexporter_prometheus_client_get(int endpoint, struct prometheus_bridge* bridge)
    }
 
    http->endpoint = endpoint;
+   http->keep_alive = config->bridge_keep_alive;
 
-   if (pgexporter_http_get(http, config->endpoints[endpoint].host, "/metrics"))
+   memset(&parser, 0, sizeof(struct bridge_parser));
+   parser.endpoint = endpoint;
+   parser.timestamp = time(NULL);
+   parser.bridge = bridge;
+
+   // The metrics are added as the response arrives, so the body is never held as a whole
+   if (pgexporter_http_get_lines(http, config->endpoints[endpoint].host, "/metrics", parse_line_to_bridge, &parser))
    {
+      // The endpoint may have closed the pooled connection since it was checked
+      if (fd != -1)
+      {
+         pgexporter_log_debug("Reconnecting to HTTP endpoint %d (%s:%d)",
+                              endpoint,
+                              config->endpoints[endpoint].host,
+                              config->endpoints[endpoint].port);
+
+         if (pool[endpoint] == fd)
+         {
+            pool[endpoint] = -1;
+         }
+         pgexporter_http_disconnect(http);
+         http = NULL;
+         fd = -1;
+
+         goto connect;
+      }
+
       pgexporter_log_error("Failed to execute HTTP/GET interaction with http://%s:%d/metrics",
                            config->endpoints[endpoint].host,
                            config->endpoints[endpoint].port);
       goto error;
    }
 
-   timestamp = time(NULL);
-
-   if (parse_body_to_bridge(endpoint, timestamp, http->body, bridge))
-   {
-      goto error;
-   }
-
-   pgexporter_http_disconnect(http);
+   endpoint_release(endpoint, leased, http);
 
    return 0;
 
@@ -155,342 +275,600 @@ error:
 
    if (http != NULL)
    {
-      pgexporter_http_disconnect(http);
+      http->keep_alive = false;
    }
 
+   endpoint_release(endpoint, leased, http);
+
    return 1;
 }
 
-static void
-prometheus_metric_destroy_cb(uintptr_t data)
+int
+pgexporter_prometheus_client_parse(int endpoint, char* data, size_t length, struct prometheus_bridge* bridge)
 {
-   struct prometheus_metric* m = NULL;
+   char* line = data;
+   char* end = data + length;
+   char* eol = NULL;
+   size_t size;
+   struct bridge_parser parser;
+
+   memset(&parser, 0, sizeof(struct bridge_parser));
+   parser.endpoint = endpoint;
+   parser.timestamp = time(NULL);
+   parser.bridge = bridge;
+
+   while (line < end)
+   {
+      eol = memchr(line, '\n', end - line);
+      size = eol != NULL ? (size_t)(eol - line) : (size_t)(end - line);
+
+      if (size > 0 && line[size - 1] == '\r')
+      {
+         size--;
+      }
 
-   m = (struct prometheus_metric*)data;
+      // The line is handed out in place of its line feed, like the lines from the endpoint
+      line[size] = '\0';
 
-   if (m != NULL)
-   {
-      free(m->name);
-      free(m->help);
-      free(m->type);
+      if (parse_line_to_bridge(line, size, &parser))
+      {
+         return 1;
+      }
 
-      pgexporter_deque_destroy(m->definitions);
+      line = eol != NULL ? eol + 1 : end;
    }
 
-   free(m);
+   return 0;
 }
 
-static char*
-deque_string_cb(uintptr_t data, int32_t format, char* tag, int indent)
+void
+pgexporter_prometheus_client_pool_connections(void)
+{
+   pool_owner = getpid();
+
+   /* The inherited connections belong to the main process */
+   for (int endpoint = 0; endpoint < NUMBER_OF_ENDPOINTS; endpoint++)
+   {
+      if (pool[endpoint] != -1)
+      {
+         pgexporter_disconnect(pool[endpoint]);
+         pool[endpoint] = -1;
+      }
+   }
+}
+
+void
+pgexporter_prometheus_client_pool_add(int endpoint, int fd)
 {
-   struct deque* d = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (pool[endpoint] != -1 && pool[endpoint] != fd)
+   {
+      pgexporter_disconnect(pool[endpoint]);
+   }
 
-   d = (struct deque*)data;
+   pool[endpoint] = fd;
 
-   return pgexporter_deque_to_string(d, format, tag, indent);
+   atomic_store(&config->endpoints[endpoint].lease, STATE_FREE);
 }
 
-static char*
-prometheus_metric_string_cb(uintptr_t data, int32_t format, char* tag, int indent)
+void
+pgexporter_prometheus_client_pool_destroy(void)
+{
+   for (int endpoint = 0; endpoint < NUMBER_OF_ENDPOINTS; endpoint++)
+   {
+      if (pool[endpoint] != -1)
+      {
+         pgexporter_disconnect(pool[endpoint]);
+         pool[endpoint] = -1;
+      }
+   }
+}
+
+int
+pgexporter_prometheus_client_render(struct prometheus_bridge** bridges, int number_of_bridges,
+                                    prometheus_render_cb text_callback, void* text_arg,
+                                    prometheus_render_cb json_callback, void* json_arg,
+                                    struct metrics_filter* filter)
 {
-   char* s = NULL;
-   struct art* a = NULL;
-   struct value_config vc = {.destroy_data = NULL,
-                             .to_string = &deque_string_cb};
+   bool first;
+   bool definitions;
+   bool merge;
+   int count = 0;
+   struct builder text;
+   struct builder json;
+   struct bridge_rule* rule = NULL;
+   struct art* merged = NULL;
+   struct art* names = NULL;
+   struct art_iterator* names_iterator = NULL;
    struct prometheus_metric* m = NULL;
+   struct prometheus_metric* metric = NULL;
 
-   m = (struct prometheus_metric*)data;
+   pgexporter_builder_init(&text, 0);
+   pgexporter_builder_init(&json, 0);
 
-   if (pgexporter_art_create(&a))
+   if (bridge_names(bridges, number_of_bridges, filter, &names))
    {
       goto error;
    }
 
-   if (m != NULL)
+   if (pgexporter_art_iterator_create(names, &names_iterator))
    {
-      pgexporter_art_insert(a, (char*)"Name", (uintptr_t)m->name, ValueString);
-      pgexporter_art_insert(a, (char*)"Help", (uintptr_t)m->help, ValueString);
-      pgexporter_art_insert(a, (char*)"Type", (uintptr_t)m->type, ValueString);
-      pgexporter_art_insert_with_config(a, (char*)"Definitions", (uintptr_t)m->definitions, &vc);
+      goto error;
+   }
 
-      s = pgexporter_art_to_string(a, format, tag, indent);
+   if (json_callback != NULL && json_callback("{\n", 2, json_arg))
+   {
+      goto error;
    }
 
-   pgexporter_art_destroy(a);
+   // Both formats are rendered from the same walk, a metric at a time
+   while (pgexporter_art_iterator_next(names_iterator))
+   {
+      if (!pgexporter_filter_metric(filter, names_iterator->key, 0))
+      {
+         continue;
+      }
 
-   return s;
+      first = true;
+      definitions = false;
+      merge = false;
+      metric = NULL;
+      text.length = 0;
+      json.length = 0;
 
-error:
+      for (int i = 0; i < number_of_bridges; i++)
+      {
+         if (bridges[i] == NULL ||
+             (m = (struct prometheus_metric*)pgexporter_art_search(bridges[i]->metrics, names_iterator->key)) == NULL)
+         {
+            continue;
+         }
 
-   pgexporter_art_destroy(a);
+         if (first)
+         {
+            metric = m;
 
-   return "Error";
-}
+            if (text_callback != NULL)
+            {
+               pgexporter_builder_append(&text, "#HELP ");
+               pgexporter_builder_append(&text, m->name);
+               pgexporter_builder_append_char(&text, ' ');
+               pgexporter_builder_append(&text, m->help);
+               pgexporter_builder_append_char(&text, '\n');
+
+               pgexporter_builder_append(&text, "#TYPE ");
+               pgexporter_builder_append(&text, m->name);
+               pgexporter_builder_append_char(&text, ' ');
+               pgexporter_builder_append(&text, m->type);
+               pgexporter_builder_append_char(&text, '\n');
+            }
 
-static int
-metric_find_create(struct prometheus_bridge* bridge, char* name,
-                   struct prometheus_metric** metric)
-{
-   struct prometheus_metric* m = NULL;
-   struct value_config vc = {.destroy_data = &prometheus_metric_destroy_cb,
-                             .to_string = &prometheus_metric_string_cb};
+            if (json_callback != NULL)
+            {
+               if (count > 0)
+               {
+                  pgexporter_builder_append(&json, ",\n");
+               }
+
+               pgexporter_builder_indent(&json, NULL, INDENT_PER_LEVEL);
+               json_append_string(&json, m->name);
+               pgexporter_builder_append(&json, ": {\n");
+               pgexporter_builder_indent(&json, "\"Definitions\": [", 2 * INDENT_PER_LEVEL);
+            }
 
-   *metric = NULL;
+            // Without the endpoint label the series of the endpoints are the same ones
+            rule = rule_get(m);
+            merge = rule != NULL && !rule_keeps(rule, "endpoint", strlen("endpoint"));
 
-   m = (struct prometheus_metric*)pgexporter_art_search(bridge->metrics, (char*)name);
+            first = false;
+         }
 
-   if (m == NULL)
-   {
-      struct deque* defs = NULL;
+         if (merge)
+         {
+            if ((merged == NULL && pgexporter_art_create(&merged)) || aggregate_merge(merged, m))
+            {
+               goto error;
+            }
 
-      m = (struct prometheus_metric*)malloc(sizeof(struct prometheus_metric));
-      memset(m, 0, sizeof(struct prometheus_metric));
+            continue;
+         }
+
+         // The samples of an endpoint are rendered once, and kept for as long as its bridge
+         if (text_callback != NULL)
+         {
+            if (metric_render(bridges[i], m))
+            {
+               goto error;
+            }
+
+            pgexporter_builder_append_length(&text, m->text, m->length);
+         }
+
+         if (json_callback != NULL)
+         {
+            if (metric_render_json(bridges[i], m))
+            {
+               goto error;
+            }
+
+            if (m->json_length > 0)
+            {
+               pgexporter_builder_append(&json, definitions ? ",\n" : "\n");
+               pgexporter_builder_append_length(&json, m->json, m->json_length);
+               definitions = true;
+            }
+         }
+      }
 
-      if (pgexporter_deque_create(true, &defs))
+      if (merged != NULL)
       {
-         goto error;
+         aggregate_render(merged, metric, text_callback != NULL ? &text : NULL, json_callback != NULL ? &json : NULL,
+                          &definitions);
+
+         pgexporter_art_destroy(merged);
+         merged = NULL;
       }
 
-      m->name = strdup(name);
-      m->definitions = defs;
+      if (text_callback != NULL)
+      {
+         pgexporter_builder_append_char(&text, '\n');
+
+         if (text_callback(text.data, text.length, text_arg))
+         {
+            goto error;
+         }
+      }
 
-      if (pgexporter_art_insert_with_config(bridge->metrics, (char*)name,
-                                            (uintptr_t)m, &vc))
+      if (json_callback != NULL)
       {
-         goto error;
+         if (definitions)
+         {
+            pgexporter_builder_append_char(&json, '\n');
+            pgexporter_builder_indent(&json, NULL, 2 * INDENT_PER_LEVEL);
+         }
+         pgexporter_builder_append(&json, "],\n");
+
+         pgexporter_builder_indent(&json, "\"Help\": ", 2 * INDENT_PER_LEVEL);
+         json_append_string(&json, metric->help);
+         pgexporter_builder_append(&json, ",\n");
+         pgexporter_builder_indent(&json, "\"Name\": ", 2 * INDENT_PER_LEVEL);
+         json_append_string(&json, metric->name);
+         pgexporter_builder_append(&json, ",\n");
+         pgexporter_builder_indent(&json, "\"Type\": ", 2 * INDENT_PER_LEVEL);
+         json_append_string(&json, metric->type);
+         pgexporter_builder_append_char(&json, '\n');
+         pgexporter_builder_indent(&json, "}", INDENT_PER_LEVEL);
+
+         if (json_callback(json.data, json.length, json_arg))
+         {
+            goto error;
+         }
       }
+
+      count++;
    }
 
-   *metric = m;
+   if (json_callback != NULL && json_callback(count > 0 ? "\n}\n" : "}\n", count > 0 ? 3 : 2, json_arg))
+   {
+      goto error;
+   }
+
+   pgexporter_art_iterator_destroy(names_iterator);
+   pgexporter_art_destroy(names);
+   pgexporter_builder_destroy(&text);
+   pgexporter_builder_destroy(&json);
 
    return 0;
 
 error:
 
+   pgexporter_art_destroy(merged);
+   pgexporter_art_iterator_destroy(names_iterator);
+   pgexporter_art_destroy(names);
+   pgexporter_builder_destroy(&text);
+   pgexporter_builder_destroy(&json);
+
    return 1;
 }
 
 static int
-metric_set_name(struct prometheus_metric* metric, char* name)
+endpoint_connection(int endpoint, bool* leased)
 {
-   if (metric->name != NULL)
-   {
-      /* Assumes information is already present. */
-      return 0;
-   }
+   int fd;
+   signed char free_state = STATE_FREE;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
 
-   metric->name = strdup(name);
-   if (metric->name == NULL)
+   *leased = false;
+
+   if (!config->bridge_keep_alive)
    {
-      errno = 0;
-      return 1;
+      return -1;
    }
 
-   return 0;
-}
-
-static int
-metric_set_help(struct prometheus_metric* metric, char* help)
-{
-   if (metric->help != NULL)
+   /* The connection inherited from the main process is shared with the other bridge processes */
+   if (pool_owner != getpid())
    {
-      free(metric->help);
-      metric->help = NULL;
+      if (!atomic_compare_exchange_strong(&config->endpoints[endpoint].lease, &free_state, STATE_IN_USE))
+      {
+         return -1;
+      }
+
+      *leased = true;
    }
 
-   metric->help = strdup(help);
+   fd = pool[endpoint];
 
-   if (metric->help == NULL)
+   if (fd != -1 && !pgexporter_http_idle(fd))
    {
-      errno = 0;
-      return 1;
+      pgexporter_log_debug("Stale connection to HTTP endpoint %d (%s:%d)",
+                           endpoint,
+                           config->endpoints[endpoint].host,
+                           config->endpoints[endpoint].port);
+      pgexporter_disconnect(fd);
+      pool[endpoint] = -1;
+      fd = -1;
    }
 
-   return 0;
+   return fd;
 }
 
-static int
-metric_set_type(struct prometheus_metric* metric, char* type)
+static void
+endpoint_release(int endpoint, bool leased, struct http* http)
 {
-   if (metric->type != NULL)
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (http != NULL)
+   {
+      if (http->keep_alive && config->bridge_keep_alive)
+      {
+         if (pool_owner == getpid())
+         {
+            pool[endpoint] = http->socket;
+            http->socket = -1;
+         }
+         else if (leased && http->socket != pool[endpoint])
+         {
+            /* The main process releases the lease once it owns the connection */
+            if (!pgexporter_transfer_endpoint_write(endpoint, http->socket))
+            {
+               leased = false;
+            }
+         }
+      }
+      else if (http->socket == pool[endpoint])
+      {
+         pool[endpoint] = -1;
+      }
+
+      pgexporter_http_disconnect(http);
+   }
+
+   if (leased)
    {
-      free(metric->type);
-      metric->type = NULL;
+      atomic_store(&config->endpoints[endpoint].lease, STATE_FREE);
    }
+}
 
-   metric->type = strdup(type);
+static bool
+lex_space(char** p, char* end)
+{
+   char* start = *p;
 
-   if (metric->type == NULL)
+   while (*p < end && (**p == ' ' || **p == '\t'))
    {
-      errno = 0;
-      return 1;
+      (*p)++;
    }
 
-   return 0;
+   return *p > start;
 }
 
 static bool
-attributes_contains(struct deque* attributes, struct prometheus_attribute* attribute)
+lex_name(char** p, char* end, struct bridge_token* token)
 {
-   bool found = false;
-   struct deque_iterator* attributes_iterator = NULL;
+   char c;
+
+   token->data = *p;
 
-   if (!pgexporter_deque_empty(attributes))
+   while (*p < end)
    {
-      if (pgexporter_deque_iterator_create(attributes, &attributes_iterator))
+      c = **p;
+
+      if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == ':' ||
+            (*p > token->data && c >= '0' && c <= '9')))
       {
-         goto done;
+         break;
       }
 
-      while (!found && pgexporter_deque_iterator_next(attributes_iterator))
+      (*p)++;
+   }
+
+   token->length = *p - token->data;
+
+   return token->length > 0;
+}
+
+static bool
+lex_label_value(char** p, char* end, struct bridge_token* token)
+{
+   if (*p >= end || **p != '"')
+   {
+      return false;
+   }
+
+   (*p)++;
+   token->data = *p;
+
+   while (*p < end && **p != '"')
+   {
+      // The escapes are kept, such that the value is written back as it was read
+      if (**p == '\\')
       {
-         struct prometheus_attribute* a = (struct prometheus_attribute*)attributes_iterator->value->data;
+         (*p)++;
 
-         if (!strcmp(a->key, attribute->key) && !strcmp(a->value, attribute->value))
+         if (*p >= end)
          {
-            found = true;
+            return false;
          }
       }
+
+      (*p)++;
    }
 
-done:
+   if (*p >= end)
+   {
+      return false;
+   }
 
-   pgexporter_deque_iterator_destroy(attributes_iterator);
+   token->length = *p - token->data;
+   (*p)++;
 
-   return found;
+   return true;
 }
 
-static void
-prometheus_attributes_destroy_cb(uintptr_t data)
+static bool
+lex_value(char** p, char* end, struct bridge_token* token)
 {
-   struct prometheus_attributes* m = NULL;
+   token->data = *p;
 
-   m = (struct prometheus_attributes*)data;
-
-   if (m != NULL)
+   while (*p < end && **p != ' ' && **p != '\t')
    {
-      pgexporter_deque_destroy(m->attributes);
-      pgexporter_deque_destroy(m->values);
+      (*p)++;
    }
 
-   free(m);
+   token->length = *p - token->data;
+
+   return token->length > 0;
 }
 
-static char*
-prometheus_attributes_string_cb(uintptr_t data, int32_t format, char* tag, int indent)
+static int
+lex_comment(char* line, size_t length, struct bridge_token* keyword, struct bridge_token* name, struct bridge_token* text)
 {
-   char* s = NULL;
-   struct art* a = NULL;
-   struct value_config vc = {.destroy_data = NULL,
-                             .to_string = &deque_string_cb};
-   struct prometheus_attributes* m = NULL;
+   char* p = line + 1;
+   char* end = line + length;
 
-   m = (struct prometheus_attributes*)data;
+   /* Lines of the form:
+    *
+    * # HELP name text
+    * # TYPE name type
+    *
+    * where the space after the # is optional
+    */
+   lex_space(&p, end);
 
-   if (pgexporter_art_create(&a))
+   if (!lex_name(&p, end, keyword) || !lex_space(&p, end) || !lex_name(&p, end, name))
    {
       goto error;
    }
 
-   if (m != NULL)
-   {
-      pgexporter_art_insert_with_config(a, (char*)"Attributes", (uintptr_t)m->attributes, &vc);
-      pgexporter_art_insert_with_config(a, (char*)"Values", (uintptr_t)m->values, &vc);
+   lex_space(&p, end);
 
-      s = pgexporter_art_to_string(a, format, tag, indent);
-   }
+   text->data = p;
+   text->length = end - p;
 
-   pgexporter_art_destroy(a);
+   while (text->length > 0 && (text->data[text->length - 1] == ' ' || text->data[text->length - 1] == '\t'))
+   {
+      text->length--;
+   }
 
-   return s;
+   return 0;
 
 error:
 
-   pgexporter_art_destroy(a);
-
-   return "Error";
+   return 1;
 }
 
 static int
-attributes_find_create(struct deque* definitions, struct deque* input,
-                       struct prometheus_attributes** attributes, bool* new)
+lex_sample(char* line, size_t length, struct bridge_token* name, struct bridge_label* labels, int* number_of_labels,
+           struct bridge_token* value)
 {
-   bool found = false;
-   struct prometheus_attributes* m = NULL;
-   struct deque_iterator* definition_iterator = NULL;
-   struct deque_iterator* input_iterator = NULL;
-   struct value_config vc = {.destroy_data = &prometheus_attributes_destroy_cb,
-                             .to_string = &prometheus_attributes_string_cb};
+   char* p = line;
+   char* end = line + length;
+   struct bridge_label* label = NULL;
 
-   *attributes = NULL;
-   *new = false;
+   *number_of_labels = 0;
 
-   /* We have to search for an existing definition */
-   if (!pgexporter_deque_empty(definitions))
+   /* Lines of the form:
+    *
+    * name{key1="value1",key2="value2",...} value [timestamp]
+    *
+    * where a label value may contain any character, escaped by a \
+    */
+   if (!lex_name(&p, end, name))
    {
-      if (pgexporter_deque_iterator_create(definitions, &definition_iterator))
-      {
-         goto error;
-      }
+      goto error;
+   }
 
-      while (!found && pgexporter_deque_iterator_next(definition_iterator))
-      {
-         bool match = true;
-         struct prometheus_attributes* a =
-            (struct prometheus_attributes*)definition_iterator->value->data;
+   lex_space(&p, end);
+
+   if (p < end && *p == '{')
+   {
+      p++;
+      lex_space(&p, end);
 
-         if (pgexporter_deque_iterator_create(input, &input_iterator))
+      while (p < end && *p != '}')
+      {
+         if (*number_of_labels >= BRIDGE_MAX_LABELS)
          {
             goto error;
          }
 
-         while (match && pgexporter_deque_iterator_next(input_iterator))
+         label = &labels[*number_of_labels];
+
+         if (!lex_name(&p, end, &label->key))
          {
-            struct prometheus_attribute* i = (struct prometheus_attribute*)input_iterator->value->data;
+            goto error;
+         }
 
-            if (!attributes_contains(a->attributes, i))
-            {
-               match = false;
-            }
+         lex_space(&p, end);
+
+         if (p >= end || *p != '=')
+         {
+            goto error;
          }
 
-         if (match)
+         p++;
+         lex_space(&p, end);
+
+         if (!lex_label_value(&p, end, &label->value))
          {
-            *attributes = a;
-            found = true;
+            goto error;
          }
 
-         pgexporter_deque_iterator_destroy(input_iterator);
-         input_iterator = NULL;
-      }
-   }
+         (*number_of_labels)++;
 
-   /* Ok, create a new one */
-   if (!found)
-   {
-      m = (struct prometheus_attributes*)malloc(sizeof (struct prometheus_attributes));
-      if (m == NULL)
-      {
-         goto error;
-      }
+         lex_space(&p, end);
 
-      if (pgexporter_deque_create(false, &m->values))
-      {
-         goto error;
+         if (p < end && *p == ',')
+         {
+            p++;
+            lex_space(&p, end);
+         }
+         else if (p >= end || *p != '}')
+         {
+            goto error;
+         }
       }
 
-      m->attributes = input;
-
-      if (pgexporter_deque_add_with_config(definitions, NULL, (uintptr_t)m, &vc))
+      if (p >= end)
       {
          goto error;
       }
 
-      *attributes = m;
-      *new = true;
+      p++;
+      lex_space(&p, end);
    }
 
-   pgexporter_deque_iterator_destroy(definition_iterator);
+   if (!lex_value(&p, end, value))
+   {
+      goto error;
+   }
 
    return 0;
 
@@ -499,371 +877,989 @@ error:
    return 1;
 }
 
-static void
-prometheus_value_destroy_cb(uintptr_t data)
+static bool
+token_equals(struct bridge_token* token, char* s)
 {
-   struct prometheus_value* m = NULL;
+   return strlen(s) == token->length && !strncmp(token->data, s, token->length);
+}
 
-   m = (struct prometheus_value*)data;
+static uint64_t
+intern_hash(void* data, size_t length)
+{
+   uint64_t hash = 14695981039346656037ULL;
+   unsigned char* d = (unsigned char*)data;
 
-   if (m != NULL)
+   // FNV-1a
+   for (size_t i = 0; i < length; i++)
    {
-      free(m->value);
+      hash ^= d[i];
+      hash *= 1099511628211ULL;
    }
 
-   free(m);
+   return hash;
 }
 
-static char*
-prometheus_value_string_cb(uintptr_t data, int32_t format, char* tag, int indent)
+static int
+intern_grow(struct prometheus_intern_table* table)
 {
-   char* s = NULL;
-   struct art* a = NULL;
-   struct prometheus_value* m = NULL;
+   size_t capacity;
+   size_t slot;
+   struct prometheus_intern* entries = NULL;
 
-   m = (struct prometheus_value*)data;
+   capacity = table->capacity > 0 ? table->capacity * 2 : 256;
 
-   if (pgexporter_art_create(&a))
+   entries = (struct prometheus_intern*)calloc(capacity, sizeof(struct prometheus_intern));
+   if (entries == NULL)
    {
       goto error;
    }
 
-   if (m != NULL)
+   for (size_t i = 0; i < table->capacity; i++)
    {
-      pgexporter_art_insert(a, (char*)"Timestamp", (uintptr_t)m->timestamp, ValueInt64);
-      pgexporter_art_insert(a, (char*)"Value", (uintptr_t)m->value, ValueString);
+      if (table->entries[i].data != NULL)
+      {
+         slot = table->entries[i].hash & (capacity - 1);
+
+         while (entries[slot].data != NULL)
+         {
+            slot = (slot + 1) & (capacity - 1);
+         }
 
-      s = pgexporter_art_to_string(a, format, tag, indent);
+         entries[slot] = table->entries[i];
+      }
    }
 
-   pgexporter_art_destroy(a);
+   free(table->entries);
 
-   return s;
+   table->entries = entries;
+   table->capacity = capacity;
 
-error:
+   return 0;
 
-   pgexporter_art_destroy(a);
+error:
 
-   return "Error";
+   return 1;
 }
 
-static int
-add_value(struct deque* values, time_t timestamp, char* value)
+static struct prometheus_intern*
+intern_entry(struct prometheus_bridge* bridge, struct prometheus_intern_table* table, void* data, size_t length)
 {
-   struct value_config vc = {.destroy_data = &prometheus_value_destroy_cb,
-                             .to_string = &prometheus_value_string_cb};
-   struct prometheus_value* val = NULL;
+   uint64_t hash;
+   size_t slot;
+   char* copy = NULL;
+   struct prometheus_intern* entry = NULL;
+
+   hash = intern_hash(data, length);
 
-   val = (struct prometheus_value*)malloc(sizeof(struct prometheus_value));
-   if (val == NULL)
+   if ((table->size + 1) * 4 > table->capacity * 3)
    {
-      goto error;
+      if (intern_grow(table))
+      {
+         goto error;
+      }
    }
 
-   val->timestamp = timestamp;
-   val->value = strdup(value);
+   slot = hash & (table->capacity - 1);
+
+   while (table->entries[slot].data != NULL)
+   {
+      entry = &table->entries[slot];
+
+      if (entry->hash == hash && entry->length == length && !memcmp(entry->data, data, length))
+      {
+         return entry;
+      }
+
+      slot = (slot + 1) & (table->capacity - 1);
+   }
 
-   if (val->value == NULL)
+   // Terminated, such that an interned string can be used as is
+   copy = (char*)pgexporter_arena_alloc(bridge->arena, length + 1, sizeof(void*));
+   if (copy == NULL)
    {
       goto error;
    }
 
-   if (pgexporter_deque_size(values) >= 100)
+   memcpy(copy, data, length);
+   copy[length] = '\0';
+
+   table->entries[slot].hash = hash;
+   table->entries[slot].length = length;
+   table->entries[slot].data = copy;
+   table->size++;
+
+   return &table->entries[slot];
+
+error:
+
+   return NULL;
+}
+
+static void*
+intern(struct prometheus_bridge* bridge, struct prometheus_intern_table* table, void* data, size_t length)
+{
+   struct prometheus_intern* entry = NULL;
+
+   entry = intern_entry(bridge, table, data, length);
+
+   return entry != NULL ? entry->data : NULL;
+}
+
+static char*
+intern_string(struct prometheus_bridge* bridge, struct bridge_token* token)
+{
+   return (char*)intern(bridge, &bridge->strings, token->data, token->length);
+}
+
+static int
+metric_find_create(struct prometheus_bridge* bridge, char* name,
+                   struct prometheus_metric** metric)
+{
+   struct prometheus_metric* m = NULL;
+   *metric = NULL;
+
+   m = (struct prometheus_metric*)pgexporter_art_search(bridge->metrics, (char*)name);
+
+   if (m == NULL)
    {
-      struct prometheus_value* v = NULL;
+      m = (struct prometheus_metric*)pgexporter_arena_alloc(bridge->arena, sizeof(struct prometheus_metric),
+                                                            sizeof(void*));
+      if (m == NULL)
+      {
+         goto error;
+      }
+
+      memset(m, 0, sizeof(struct prometheus_metric));
 
-      v = (struct prometheus_value*)pgexporter_deque_poll(values, NULL);
+      m->name = name;
+      m->help = (char*)"";
+      m->type = (char*)"untyped";
+      m->rule = rule_find(name);
 
-      free(v->value);
-      free(v);
+      if (pgexporter_art_insert(bridge->metrics, (char*)name, (uintptr_t)m, ValueRef))
+      {
+         goto error;
+      }
    }
 
-   pgexporter_deque_add_with_config(values, NULL, (uintptr_t)val, &vc);
+   *metric = m;
 
    return 0;
 
 error:
 
-   if (val != NULL)
-   {
-      free(val->value);
-   }
-   free(val);
-
    return 1;
 }
 
 static void
-prometheus_attribute_destroy_cb(uintptr_t data)
+attributes_sort(struct prometheus_attribute* attributes, int number_of_attributes)
 {
-   struct prometheus_attribute* m = NULL;
+   struct prometheus_attribute a;
+   int j;
 
-   m = (struct prometheus_attribute*)data;
-
-   if (m != NULL)
+   // A label set is small, so an insertion sort on the keys will do
+   for (int i = 1; i < number_of_attributes; i++)
    {
-      free(m->key);
-      free(m->value);
-   }
+      a = attributes[i];
+      j = i - 1;
+
+      while (j >= 0 && strcmp(attributes[j].key, a.key) > 0)
+      {
+         attributes[j + 1] = attributes[j];
+         j--;
+      }
 
-   free(m);
+      attributes[j + 1] = a;
+   }
 }
 
-static char*
-prometheus_attribute_string_cb(uintptr_t data, int32_t format, char* tag, int indent)
+static int
+definitions_grow(struct prometheus_bridge* bridge, struct prometheus_metric* metric)
 {
-   char* s = NULL;
-   struct art* a = NULL;
-   struct prometheus_attribute* m = NULL;
+   size_t capacity;
+   size_t slot;
+   struct prometheus_attributes** table = NULL;
 
-   m = (struct prometheus_attribute*)data;
+   capacity = metric->capacity > 0 ? metric->capacity * 2 : 16;
 
-   if (pgexporter_art_create(&a))
+   // The old table stays in the arena, which is at most the size of the new one
+   table = (struct prometheus_attributes**)pgexporter_arena_alloc(bridge->arena,
+                                                                 capacity * sizeof(struct prometheus_attributes*),
+                                                                 sizeof(void*));
+   if (table == NULL)
    {
       goto error;
    }
 
-   if (m != NULL)
+   memset(table, 0, capacity * sizeof(struct prometheus_attributes*));
+
+   for (struct prometheus_attributes* d = metric->first; d != NULL; d = d->next)
    {
-      pgexporter_art_insert(a, (char*)"Key", (uintptr_t)m->key, ValueString);
-      pgexporter_art_insert(a, (char*)"Value", (uintptr_t)m->value, ValueString);
+      slot = d->hash & (capacity - 1);
 
-      s = pgexporter_art_to_string(a, format, tag, indent);
+      while (table[slot] != NULL)
+      {
+         slot = (slot + 1) & (capacity - 1);
+      }
+
+      table[slot] = d;
    }
 
-   pgexporter_art_destroy(a);
+   metric->definitions = table;
+   metric->capacity = capacity;
 
-   return s;
+   return 0;
 
 error:
 
-   pgexporter_art_destroy(a);
-
-   return "Error";
+   return 1;
 }
 
 static int
-add_attribute(struct deque* attributes, char* key, char* value)
+attributes_find_create(struct prometheus_bridge* bridge, struct prometheus_metric* metric, char* name,
+                       struct prometheus_attribute* attributes, int number_of_attributes, uint64_t hash,
+                       struct prometheus_attributes** definition)
 {
-   struct prometheus_attribute* attr = NULL;
-   struct value_config vc = {.destroy_data = &prometheus_attribute_destroy_cb,
-                             .to_string = &prometheus_attribute_string_cb};
+   size_t slot;
+   struct prometheus_attributes* d = NULL;
+
+   *definition = NULL;
+
+   // The samples of a histogram share the label sets, so the name is part of the hash
+   hash ^= (uint64_t)(uintptr_t)name * 0x9E3779B97F4A7C15ULL;
 
-   attr = (struct prometheus_attribute*)malloc(sizeof(struct prometheus_attribute));
-   if (attr == NULL)
+   if (((size_t)metric->number_of_definitions + 1) * 4 > metric->capacity * 3)
    {
-      goto error;
+      if (definitions_grow(bridge, metric))
+      {
+         goto error;
+      }
    }
-   memset(attr, 0, sizeof(struct prometheus_attribute));
 
-   attr->key = strdup(key);
-   if (attr->key == NULL)
+   // The names and the label sets are interned, so a definition is found by its pointers
+   slot = hash & (metric->capacity - 1);
+
+   while ((d = metric->definitions[slot]) != NULL)
    {
-      goto error;
+      if (d->hash == hash && d->name == name && d->attributes == attributes)
+      {
+         *definition = d;
+         return 0;
+      }
+
+      slot = (slot + 1) & (metric->capacity - 1);
    }
 
-   attr->value = strdup(value);
-   if (attr->value == NULL)
+   d = (struct prometheus_attributes*)pgexporter_arena_alloc(bridge->arena, sizeof(struct prometheus_attributes),
+                                                             sizeof(void*));
+   if (d == NULL)
    {
       goto error;
    }
 
-   pgexporter_deque_add_with_config(attributes, NULL, (uintptr_t) attr, &vc);
+   memset(d, 0, sizeof(struct prometheus_attributes));
+
+   d->hash = hash;
+   d->name = name;
+   d->number_of_attributes = number_of_attributes;
+   d->attributes = attributes;
+
+   if (metric->last != NULL)
+   {
+      metric->last->next = d;
+   }
+   else
+   {
+      metric->first = d;
+   }
+   metric->last = d;
+   metric->number_of_definitions++;
+
+   metric->definitions[slot] = d;
+
+   *definition = d;
 
    return 0;
 
 error:
 
-   if (attr != NULL)
+   return 1;
+}
+
+static int
+metric_render(struct prometheus_bridge* bridge, struct prometheus_metric* metric)
+{
+   char value[MISC_LENGTH];
+   struct builder text;
+
+   if (metric->text != NULL)
    {
-      free(attr->key);
-      free(attr->value);
+      return 0;
    }
-   free(attr);
 
-   return 1;
+   pgexporter_builder_init(&text, 0);
+
+   for (struct prometheus_attributes* d = metric->first; d != NULL; d = d->next)
+   {
+      definition_render(&text, d, definition_value(metric, d, value, sizeof(value)));
+   }
+
+   metric->text = pgexporter_arena_strndup(bridge->arena, text.data, text.length);
+   metric->length = text.length;
+
+   pgexporter_builder_destroy(&text);
+
+   return metric->text != NULL ? 0 : 1;
 }
 
 static int
-add_line(struct prometheus_metric* metric, char* line, int endpoint, time_t timestamp)
-{
-   char* e = NULL;
-   char key[MISC_LENGTH] = {0};
-   char value[MISC_LENGTH] = {0};
-   char* token = NULL;
-   char* saveptr = NULL;
-   char* line_cpy = NULL;
-   bool new = false;
-   char* line_value = NULL;
-   struct deque* line_attrs = NULL;
-   struct prometheus_attributes* attributes = NULL;
+metric_render_json(struct prometheus_bridge* bridge, struct prometheus_metric* metric)
+{
+   char value[MISC_LENGTH];
+   struct builder json;
+
+   if (metric->json != NULL)
+   {
+      return 0;
+   }
+
+   pgexporter_builder_init(&json, 0);
+
+   // The definitions are the elements of an array at the third level, such
+   // that the definitions of the endpoints are joined by a comma
+   for (struct prometheus_attributes* d = metric->first; d != NULL; d = d->next)
+   {
+      if (d != metric->first)
+      {
+         pgexporter_builder_append(&json, ",\n");
+      }
+
+      definition_render_json(&json, d, definition_value(metric, d, value, sizeof(value)), d->value.timestamp);
+   }
+
+   metric->json = pgexporter_arena_strndup(bridge->arena, json.data, json.length);
+   metric->json_length = json.length;
+
+   pgexporter_builder_destroy(&json);
+
+   return metric->json != NULL ? 0 : 1;
+}
+
+static void
+definition_render(struct builder* text, struct prometheus_attributes* d, char* value)
+{
+   pgexporter_builder_append(text, d->name);
+   pgexporter_builder_append_char(text, '{');
+
+   for (int i = 0; i < d->number_of_attributes; i++)
+   {
+      if (i > 0)
+      {
+         pgexporter_builder_append(text, ", ");
+      }
+
+      pgexporter_builder_append(text, d->attributes[i].key);
+      pgexporter_builder_append(text, "=\"");
+      pgexporter_builder_append(text, d->attributes[i].value);
+      pgexporter_builder_append_char(text, '\"');
+   }
+
+   pgexporter_builder_append(text, "} ");
+   pgexporter_builder_append(text, value);
+   pgexporter_builder_append_char(text, '\n');
+}
+
+static void
+definition_render_json(struct builder* json, struct prometheus_attributes* d, char* value, time_t timestamp)
+{
+   char number[MISC_LENGTH];
+
+   pgexporter_builder_indent(json, "{\n", 3 * INDENT_PER_LEVEL);
+   pgexporter_builder_indent(json, "\"Attributes\": [\n", 4 * INDENT_PER_LEVEL);
+
+   for (int i = 0; i < d->number_of_attributes; i++)
+   {
+      pgexporter_builder_indent(json, "{\n", 5 * INDENT_PER_LEVEL);
+      pgexporter_builder_indent(json, "\"Key\": ", 6 * INDENT_PER_LEVEL);
+      json_append_string(json, d->attributes[i].key);
+      pgexporter_builder_append(json, ",\n");
+      pgexporter_builder_indent(json, "\"Value\": ", 6 * INDENT_PER_LEVEL);
+      json_append_string(json, d->attributes[i].value);
+      pgexporter_builder_append_char(json, '\n');
+      pgexporter_builder_indent(json, i + 1 < d->number_of_attributes ? "},\n" : "}\n", 5 * INDENT_PER_LEVEL);
+   }
+
+   pgexporter_builder_indent(json, "],\n", 4 * INDENT_PER_LEVEL);
+   pgexporter_builder_indent(json, "\"Name\": ", 4 * INDENT_PER_LEVEL);
+   json_append_string(json, d->name);
+   pgexporter_builder_append(json, ",\n");
+   pgexporter_builder_indent(json, "\"Values\": [\n", 4 * INDENT_PER_LEVEL);
+   pgexporter_builder_indent(json, "{\n", 5 * INDENT_PER_LEVEL);
+   pgexporter_builder_indent(json, "\"Timestamp\": ", 6 * INDENT_PER_LEVEL);
+   snprintf(number, sizeof(number), "%" PRId64, (int64_t)timestamp);
+   pgexporter_builder_append(json, number);
+   pgexporter_builder_append(json, ",\n");
+   pgexporter_builder_indent(json, "\"Value\": ", 6 * INDENT_PER_LEVEL);
+   json_append_string(json, value);
+   pgexporter_builder_append_char(json, '\n');
+   pgexporter_builder_indent(json, "}\n", 5 * INDENT_PER_LEVEL);
+   pgexporter_builder_indent(json, "]\n", 4 * INDENT_PER_LEVEL);
+   pgexporter_builder_indent(json, "}", 3 * INDENT_PER_LEVEL);
+}
+
+static struct bridge_rule*
+rule_get(struct prometheus_metric* metric)
+{
    struct configuration* config = NULL;
 
    config = (struct configuration*)shmem;
 
-   if (line == NULL)
+   if (metric->rule <= 0 || metric->rule > config->number_of_bridge_rules)
    {
-      goto error;
+      return NULL;
    }
 
-   line_cpy = strdup(line);  /* strtok modifies the string. */
-   if (line_cpy == NULL)
+   return &config->bridge_rules[metric->rule - 1];
+}
+
+/**
+ * Find the first aggregation rule of a metric
+ * @param name The name of the metric
+ * @return The index of the rule + 1, or 0 if none
+ */
+static int
+rule_find(char* name)
+{
+   struct bridge_rule* rule = NULL;
+   struct configuration* config = NULL;
+
+   config = (struct configuration*)shmem;
+
+   for (int i = 0; i < config->number_of_bridge_rules; i++)
    {
-      goto error;
+      rule = &config->bridge_rules[i];
+
+      if (rule->prefix ? !strncmp(name, rule->metric, strlen(rule->metric)) : !strcmp(name, rule->metric))
+      {
+         return i + 1;
+      }
    }
 
-   if (pgexporter_deque_create(false, &line_attrs))
+   return 0;
+}
+
+/**
+ * Does an aggregation rule keep a label
+ * @param rule The rule
+ * @param label The label, which isn't terminated
+ * @param length The length of the label
+ * @return True if the label is kept, otherwise false
+ */
+static bool
+rule_keeps(struct bridge_rule* rule, char* label, size_t length)
+{
+   bool listed = false;
+
+   for (int i = 0; !listed && i < rule->number_of_labels; i++)
    {
-      goto error;
+      listed = strlen(rule->labels[i]) == length && !strncmp(rule->labels[i], label, length);
    }
 
-   e = pgexporter_append(e, config->endpoints[endpoint].host);
-   e = pgexporter_append_char(e, ':');
-   e = pgexporter_append_int(e, config->endpoints[endpoint].port);
+   return rule->without ? !listed : listed;
+}
 
-   if (add_attribute(line_attrs, "endpoint", e))
+/**
+ * Add samples to an aggregated value. The sum is kept for an average,
+ * which is divided by the count once rendered
+ * @param aggregation The aggregation
+ * @param value The aggregated value
+ * @param count The number of samples of the aggregated value
+ * @param v The value of the samples
+ * @param n The number of samples
+ */
+static void
+aggregate_add(int aggregation, double* value, uint64_t* count, double v, uint64_t n)
+{
+   if (*count == 0)
    {
-      goto error;
+      *value = v;
+   }
+   else if (aggregation == BRIDGE_AGGREGATE_SUM || aggregation == BRIDGE_AGGREGATE_AVG)
+   {
+      *value += v;
+   }
+   else if (aggregation == BRIDGE_AGGREGATE_MIN && v < *value)
+   {
+      *value = v;
+   }
+   else if (aggregation == BRIDGE_AGGREGATE_MAX && v > *value)
+   {
+      *value = v;
    }
 
-   /* Lines of the form:
-    *
-    * type{key1="value1",key2="value2",...} value
-    *
-    * Tokenizing on a " " will give the value on second call.
-    * The first token can be further tokenized on "{,}".
-    */
+   *count += n;
+}
+
+static char*
+aggregate_format(int aggregation, double value, uint64_t count, char* buffer, size_t size)
+{
+   if (aggregation == BRIDGE_AGGREGATE_COUNT)
+   {
+      snprintf(buffer, size, "%" PRIu64, count);
+      return buffer;
+   }
+
+   if (aggregation == BRIDGE_AGGREGATE_AVG && count > 0)
+   {
+      value /= (double)count;
+   }
+
+   if (isnan(value))
+   {
+      snprintf(buffer, size, "NaN");
+   }
+   else if (isinf(value))
+   {
+      snprintf(buffer, size, "%s", value > 0 ? "+Inf" : "-Inf");
+   }
+   else
+   {
+      snprintf(buffer, size, "%.17g", value);
+   }
+
+   return buffer;
+}
+
+static char*
+definition_value(struct prometheus_metric* metric, struct prometheus_attributes* d, char* buffer, size_t size)
+{
+   struct bridge_rule* rule = NULL;
+
+   if (d->count == 0 || (rule = rule_get(metric)) == NULL)
+   {
+      return d->value.value != NULL ? d->value.value : "NaN";
+   }
 
-   token = strtok_r(line_cpy, "{,} ", &saveptr);
+   return aggregate_format(rule->aggregation, d->aggregate, d->count, buffer, size);
+}
 
-   while (token != NULL)
+/**
+ * Aggregate the series of a metric of an endpoint with those of the other
+ * endpoints. A series is known by its name and labels
+ * @param merged The series of the endpoints so far
+ * @param metric The metric of the endpoint
+ * @return 0 if success, otherwise 1
+ */
+static int
+aggregate_merge(struct art* merged, struct prometheus_metric* metric)
+{
+   struct builder key;
+   struct bridge_rule* rule = NULL;
+   struct bridge_aggregate* a = NULL;
+
+   if ((rule = rule_get(metric)) == NULL)
    {
-      if (token == line_cpy)
+      return 1;
+   }
+
+   pgexporter_builder_init(&key, 0);
+
+   for (struct prometheus_attributes* d = metric->first; d != NULL; d = d->next)
+   {
+      key.length = 0;
+      pgexporter_builder_append(&key, d->name);
+      pgexporter_builder_append_char(&key, '{');
+      for (int i = 0; i < d->number_of_attributes; i++)
       {
-         /* First token is the name of the metric. So just a sanity check. */
-         if (strncmp(token, metric->name, strlen(metric->name)))
+         pgexporter_builder_append(&key, d->attributes[i].key);
+         pgexporter_builder_append(&key, "=\"");
+         pgexporter_builder_append(&key, d->attributes[i].value);
+         pgexporter_builder_append(&key, "\",");
+      }
+      pgexporter_builder_append_char(&key, '}');
+
+      a = (struct bridge_aggregate*)pgexporter_art_search(merged, key.data);
+
+      if (a == NULL)
+      {
+         a = (struct bridge_aggregate*)calloc(1, sizeof(struct bridge_aggregate));
+         if (a == NULL || pgexporter_art_insert(merged, key.data, (uintptr_t)a, ValueMem))
          {
+            free(a);
             goto error;
          }
+
+         a->definition = d;
       }
-      else if (*saveptr == '\0')
+
+      aggregate_add(rule->aggregation, &a->value, &a->count, d->aggregate, d->count);
+      a->timestamp = MAX(a->timestamp, d->value.timestamp);
+   }
+
+   pgexporter_builder_destroy(&key);
+
+   return 0;
+
+error:
+
+   pgexporter_builder_destroy(&key);
+
+   return 1;
+}
+
+/**
+ * Render the series of a metric aggregated over the endpoints
+ * @param merged The series
+ * @param metric The metric
+ * @param text The text, or NULL
+ * @param json The JSON, or NULL
+ * @param definitions Are there definitions in the JSON already
+ */
+static void
+aggregate_render(struct art* merged, struct prometheus_metric* metric, struct builder* text, struct builder* json,
+                 bool* definitions)
+{
+   char value[MISC_LENGTH];
+   struct bridge_rule* rule = NULL;
+   struct bridge_aggregate* a = NULL;
+   struct art_iterator* iter = NULL;
+
+   if ((rule = rule_get(metric)) == NULL || pgexporter_art_iterator_create(merged, &iter))
+   {
+      return;
+   }
+
+   while (pgexporter_art_iterator_next(iter))
+   {
+      a = (struct bridge_aggregate*)iter->value->data;
+
+      aggregate_format(rule->aggregation, a->value, a->count, value, sizeof(value));
+
+      if (text != NULL)
       {
-         /* Final token. */
-         line_value = strdup(token);
+         definition_render(text, a->definition, value);
       }
-      else if (strlen(token) > 0)
+
+      if (json != NULL)
+      {
+         pgexporter_builder_append(json, *definitions ? ",\n" : "\n");
+         definition_render_json(json, a->definition, value, a->timestamp);
+         *definitions = true;
+      }
+   }
+
+   pgexporter_art_iterator_destroy(iter);
+}
+
+static void
+json_append_string(struct builder* builder, char* s)
+{
+   char* start = s;
+
+   pgexporter_builder_append_char(builder, '"');
+
+   // The runs without a character to escape are appended as a whole
+   for (; *s != '\0'; s++)
+   {
+      if (*s == '"' || *s == '\\' || *s == '\n' || *s == '\t' || *s == '\r')
+      {
+         pgexporter_builder_append_length(builder, start, s - start);
+         pgexporter_builder_append_char(builder, '\\');
+         pgexporter_builder_append_char(builder, *s == '\n' ? 'n' : *s == '\t' ? 't' : *s == '\r' ? 'r' : *s);
+         start = s + 1;
+      }
+   }
+
+   pgexporter_builder_append_length(builder, start, s - start);
+   pgexporter_builder_append_char(builder, '"');
+}
+
+static int
+bridge_names(struct prometheus_bridge** bridges, int number_of_bridges, struct metrics_filter* filter, struct art** names)
+{
+   int walks = 1;
+   int number_of_prefixes = 0;
+   int number_of_entries = 0;
+   int unique = 0;
+   char* prefixes[MAX_NUMBER_OF_FILTERS];
+   uint64_t total = 0;
+   struct art* n = NULL;
+   struct art_entry* entries = NULL;
+   struct art_iterator* metrics_iterator = NULL;
+
+   *names = NULL;
+
+   if (pgexporter_art_create(&n))
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < number_of_bridges; i++)
+   {
+      if (bridges[i] != NULL)
+      {
+         total += bridges[i]->metrics->size;
+      }
+   }
+
+   if (total == 0)
+   {
+      *names = n;
+      return 0;
+   }
+
+   entries = (struct art_entry*)malloc(total * sizeof(struct art_entry));
+   if (entries == NULL)
+   {
+      goto error;
+   }
+
+   // A filter by name only walks the parts of the trees with the names it can select
+   number_of_prefixes = pgexporter_filter_prefixes(filter, prefixes);
+   if (number_of_prefixes > 0)
+   {
+      walks = number_of_prefixes;
+   }
+
+   // The names of the metrics of all the endpoints, which are sorted once such that
+   // the tree is built in one pass instead of a name at a time
+   for (int i = 0; i < number_of_bridges; i++)
+   {
+      if (bridges[i] == NULL)
       {
-         /* Assuming of the form key="value" */
-         sscanf(token, "%127[^=]", key);
-         sscanf(token + strlen(key) + 2, "%127[^\"]", value);
+         continue;
+      }
 
-         if (strlen(key) == 0 || strlen(value) == 0)
+      for (int w = 0; w < walks; w++)
+      {
+         if (number_of_prefixes > 0)
+         {
+            if (pgexporter_art_iterator_create_prefix(bridges[i]->metrics, prefixes[w], &metrics_iterator))
+            {
+               goto error;
+            }
+         }
+         else if (pgexporter_art_iterator_create(bridges[i]->metrics, &metrics_iterator))
          {
             goto error;
          }
 
-         if (add_attribute(line_attrs, key, value))
+         while (pgexporter_art_iterator_next(metrics_iterator) && number_of_entries < (int)total)
          {
-            goto error;
+            if (!pgexporter_filter_metric(filter, metrics_iterator->key, 0))
+            {
+               continue;
+            }
+
+            entries[number_of_entries].key = metrics_iterator->key;
+            entries[number_of_entries].value = (uintptr_t)true;
+            number_of_entries++;
          }
-      }
 
-      token = strtok_r(NULL, "{,} ", &saveptr);
+         pgexporter_art_iterator_destroy(metrics_iterator);
+         metrics_iterator = NULL;
+      }
    }
 
-   if (attributes_find_create(metric->definitions, line_attrs, &attributes, &new))
+   qsort(entries, number_of_entries, sizeof(struct art_entry), bridge_names_compare);
+
+   // A metric exported by several endpoints is only named once
+   for (int i = 0; i < number_of_entries; i++)
    {
-      goto error;
+      if (unique == 0 || strcmp(entries[unique - 1].key, entries[i].key))
+      {
+         entries[unique++] = entries[i];
+      }
    }
 
-   pgexporter_log_info("Attributes: %p %p", attributes, attributes != NULL ? attributes->attributes : 0);
-
-   if (add_value(attributes->values, timestamp, line_value))
+   if (pgexporter_art_bulk_insert(n, entries, unique, ValueBool))
    {
       goto error;
    }
 
-   if (!new)
-   {
-      pgexporter_deque_destroy(line_attrs);
-   }
+   free(entries);
 
-   free(e);
-   free(line_cpy);
-   free(line_value);
+   *names = n;
 
    return 0;
 
 error:
 
-   pgexporter_deque_destroy(line_attrs);
-
-   free(e);
-   free(line_cpy);
-   free(line_value);
+   free(entries);
+   pgexporter_art_iterator_destroy(metrics_iterator);
+   pgexporter_art_destroy(n);
 
    return 1;
 }
 
 static int
-parse_body_to_bridge(int endpoint, time_t timestamp, char* body, struct prometheus_bridge* bridge)
-{
-   char* line = NULL;
-   char* saveptr = NULL;
-   char name[MISC_LENGTH] = {0};
-   char help[MAX_PATH] = {0};
-   char type[MISC_LENGTH] = {0};
-   struct value_config vc = {.destroy_data = &prometheus_metric_destroy_cb,
-                             .to_string = &prometheus_metric_string_cb};
-   struct prometheus_metric* metric = NULL;
+bridge_names_compare(const void* a, const void* b)
+{
+   return strcmp(((struct art_entry*)a)->key, ((struct art_entry*)b)->key);
+}
+
+static int
+parse_line_to_bridge(char* line, size_t length, void* data)
+{
+   int number_of_labels = 0;
+   int number_of_attributes = 0;
+   char number[MISC_LENGTH];
+   char* p = line;
+   char* end = line + length;
+   char* name = NULL;
+   char endpoint[MISC_LENGTH];
+   struct bridge_token keyword;
+   struct bridge_token token;
+   struct bridge_token text;
+   struct bridge_label labels[BRIDGE_MAX_LABELS];
+   struct prometheus_attribute attributes[BRIDGE_MAX_LABELS + 1];
+   struct prometheus_intern* set = NULL;
+   struct prometheus_attributes* definition = NULL;
+   struct bridge_rule* rule = NULL;
+   struct bridge_parser* parser = (struct bridge_parser*)data;
+   struct prometheus_bridge* bridge = parser->bridge;
+   struct configuration* config = NULL;
 
-   line = strtok_r(body, "\n", &saveptr);  /* We ideally should not care if body is modified. */
+   config = (struct configuration*)shmem;
+
+   lex_space(&p, end);
+
+   if (p == end)
+   {
+      /* Previous metric is over. */
+      parser->metric = NULL;
+      return 0;
+   }
 
-   while (line != NULL)
+   if (*p == '#')
    {
-      if ((!strcmp(line, "") || !strcmp(line, "\r")) &&
-          metric != NULL && metric->definitions->size > 0)  /* Basically empty strings, empty lines, or empty Windows lines. */
+      if (lex_comment(p, end - p, &keyword, &token, &text))
       {
-         /* Previous metric is over. */
-         pgexporter_art_insert_with_config(bridge->metrics, (char*) metric->name, (uintptr_t) metric, &vc);
+         goto done;
+      }
 
-         metric = NULL;
-         continue;
+      if (token_equals(&keyword, "HELP"))
+      {
+         if ((name = intern_string(bridge, &token)) == NULL ||
+             metric_find_create(bridge, name, &parser->metric))
+         {
+            goto error;
+         }
+
+         parser->metric->help = pgexporter_arena_strndup(bridge->arena, text.data, text.length);
       }
-      else if (line[0] == '#')
+      else if (token_equals(&keyword, "TYPE"))
       {
-         if (!strncmp(&line[1], "HELP", 4))
+         if ((name = intern_string(bridge, &token)) == NULL ||
+             metric_find_create(bridge, name, &parser->metric))
          {
-            sscanf(line + 6, "%127s %1021[^\n]", name, help);
+            goto error;
+         }
 
-            metric_find_create(bridge, name, &metric);
+         parser->metric->type = intern_string(bridge, &text);
+      }
+   }
+   else
+   {
+      if (lex_sample(p, end - p, &token, labels, &number_of_labels, &text))
+      {
+         pgexporter_log_debug("Invalid line from endpoint %d: %.*s", parser->endpoint, (int)(end - p), p);
+         goto done;
+      }
 
-            metric_set_name(metric, name);
-            metric_set_help(metric, help);
+      if ((name = intern_string(bridge, &token)) == NULL)
+      {
+         goto error;
+      }
+
+      // The samples of a histogram or a summary have a suffix on the name of the metric
+      if (parser->metric == NULL || strncmp(name, parser->metric->name, strlen(parser->metric->name)))
+      {
+         if (metric_find_create(bridge, name, &parser->metric))
+         {
+            goto error;
          }
-         else if (!strncmp(&line[1], "TYPE", 4))
+      }
+
+      if (parser->label.key == NULL)
+      {
+         snprintf(endpoint, sizeof(endpoint), "%s:%d",
+                  config->endpoints[parser->endpoint].host, config->endpoints[parser->endpoint].port);
+
+         parser->label.key = (char*)intern(bridge, &bridge->strings, "endpoint", strlen("endpoint"));
+         parser->label.value = (char*)intern(bridge, &bridge->strings, endpoint, strlen(endpoint));
+
+         if (parser->label.key == NULL || parser->label.value == NULL)
          {
-            sscanf(line + 6, "%127s %127[^\n]", name, type);
-            metric_set_type(metric, type);
+            goto error;
          }
-         else
+      }
+
+      // With an aggregation rule the labels that are removed are never kept, and the
+      // samples with the same labels left are aggregated into a single series
+      rule = rule_get(parser->metric);
+
+      if (rule == NULL || rule_keeps(rule, "endpoint", strlen("endpoint")))
+      {
+         attributes[number_of_attributes++] = parser->label;
+      }
+
+      for (int i = 0; i < number_of_labels; i++)
+      {
+         if (rule != NULL && !rule_keeps(rule, labels[i].key.data, labels[i].key.length))
+         {
+            continue;
+         }
+
+         attributes[number_of_attributes].key = intern_string(bridge, &labels[i].key);
+         attributes[number_of_attributes].value = intern_string(bridge, &labels[i].value);
+
+         if (attributes[number_of_attributes].key == NULL || attributes[number_of_attributes].value == NULL)
          {
             goto error;
          }
+         number_of_attributes++;
       }
-      else
+
+      // A label set is the same whatever the order of its labels
+      attributes_sort(attributes, number_of_attributes);
+
+      set = intern_entry(bridge, &bridge->labels, attributes,
+                         number_of_attributes * sizeof(struct prometheus_attribute));
+      if (set == NULL)
+      {
+         goto error;
+      }
+
+      if (attributes_find_create(bridge, parser->metric, name, (struct prometheus_attribute*)set->data,
+                                 number_of_attributes, set->hash, &definition))
+      {
+         goto error;
+      }
+
+      definition->value.timestamp = parser->timestamp;
+
+      if (rule != NULL)
       {
-         add_line(metric, line, endpoint, timestamp);
+         snprintf(number, sizeof(number), "%.*s", (int)text.length, text.data);
+         aggregate_add(rule->aggregation, &definition->aggregate, &definition->count, strtod(number, NULL), 1);
       }
+      else
+      {
+         definition->value.value = pgexporter_arena_strndup(bridge->arena, text.data, text.length);
 
-      line = strtok_r(NULL, "\n", &saveptr);
+         if (definition->value.value == NULL)
+         {
+            goto error;
+         }
+      }
    }
 
+done:
+
    return 0;
 
 error:
-   pgexporter_art_destroy(bridge->metrics);
-   bridge->metrics = NULL;
 
    return 1;
-}
\ No newline at end of file
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <protobuf.h>
+#include <utils.h>
+
+/* system */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t
+pgexporter_protobuf_varint_size(uint64_t value)
+{
+   size_t size = 1;
+
+   while (value >= 0x80)
+   {
+      value >>= 7;
+      size++;
+   }
+
+   return size;
+}
+
+int
+pgexporter_protobuf_varint(struct builder* builder, uint64_t value)
+{
+   if (pgexporter_builder_reserve(builder, 10))
+   {
+      return 1;
+   }
+
+   while (value >= 0x80)
+   {
+      builder->data[builder->length++] = (char)((value & 0x7F) | 0x80);
+      value >>= 7;
+   }
+
+   builder->data[builder->length++] = (char)value;
+   builder->data[builder->length] = '\0';
+
+   return 0;
+}
+
+int
+pgexporter_protobuf_tag(struct builder* builder, int field, int wire)
+{
+   return pgexporter_protobuf_varint(builder, ((uint64_t)field << 3) | (uint64_t)wire);
+}
+
+int
+pgexporter_protobuf_bytes(struct builder* builder, int field, char* data, size_t length)
+{
+   if (pgexporter_protobuf_tag(builder, field, PROTOBUF_WIRE_LENGTH) ||
+       pgexporter_protobuf_varint(builder, length))
+   {
+      return 1;
+   }
+
+   return pgexporter_builder_append_length(builder, data, length);
+}
+
+int
+pgexporter_protobuf_uint64(struct builder* builder, int field, uint64_t value)
+{
+   if (pgexporter_protobuf_tag(builder, field, PROTOBUF_WIRE_VARINT))
+   {
+      return 1;
+   }
+
+   return pgexporter_protobuf_varint(builder, value);
+}
+
+int
+pgexporter_protobuf_label(struct builder* builder, int field, char* name, size_t name_length, char* value, size_t value_length)
+{
+   size_t length = 0;
+   char* end = value + value_length;
+
+   // The length of the value without its escapes
+   for (char* c = value; c < end; c++)
+   {
+      if (*c == '\\' && c + 1 < end)
+      {
+         c++;
+      }
+      length++;
+   }
+
+   if (pgexporter_protobuf_tag(builder, field, PROTOBUF_WIRE_LENGTH) ||
+       pgexporter_protobuf_varint(builder,
+                                  1 + pgexporter_protobuf_varint_size(name_length) + name_length +
+                                  1 + pgexporter_protobuf_varint_size(length) + length) ||
+       pgexporter_protobuf_bytes(builder, 1, name, name_length) ||
+       pgexporter_protobuf_tag(builder, 2, PROTOBUF_WIRE_LENGTH) ||
+       pgexporter_protobuf_varint(builder, length) ||
+       pgexporter_builder_reserve(builder, length))
+   {
+      return 1;
+   }
+
+   for (char* c = value; c < end; c++)
+   {
+      if (*c == '\\' && c + 1 < end)
+      {
+         c++;
+         builder->data[builder->length++] = *c == 'n' ? '\n' : *c;
+      }
+      else
+      {
+         builder->data[builder->length++] = *c;
+      }
+   }
+   builder->data[builder->length] = '\0';
+
+   return 0;
+}
+
+int
+pgexporter_protobuf_double(struct builder* builder, int field, double value)
+{
+   uint64_t bits;
+
+   if (pgexporter_protobuf_tag(builder, field, PROTOBUF_WIRE_64BIT) ||
+       pgexporter_builder_reserve(builder, 8))
+   {
+      return 1;
+   }
+
+   // The wire format is little endian
+   memcpy(&bits, &value, sizeof(bits));
+   for (int i = 0; i < 8; i++)
+   {
+      builder->data[builder->length++] = (char)(bits >> (8 * i));
+   }
+   builder->data[builder->length] = '\0';
+
+   return 0;
+}
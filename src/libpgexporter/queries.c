@@ -28,133 +28,652 @@
 
 /* pgexporter */
 #include <pgexporter.h>
+#include <arena.h>
+#include <art.h>
+#include <catalog.h>
+#include <cluster.h>
 #include <connection.h>
 #include <deque.h>
 #include <logging.h>
+#include <memory.h>
 #include <message.h>
 #include <network.h>
 #include <queries.h>
 #include <security.h>
 #include <server.h>
+#include <stats.h>
+#include <trace.h>
 #include <utils.h>
 
 /* system */
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+
+#define PIPELINE_MAX_SIZE       32768
+#define PIPELINE_QUERY_OVERHEAD 48
+
+#define INT8OID    20
+#define INT2OID    21
+#define INT4OID    23
+#define OIDOID     26
+#define FLOAT4OID  700
+#define FLOAT8OID  701
+#define NUMERICOID 1700
+
+#define RESULT_FORMAT_BINARY 1
+
+#define QUERY_CANCEL_TIMEOUT 5
+
+#define READ_BUFFER_MIN_SIZE 16384
+#define READ_BUFFER_MAX_SIZE (16 * 1024 * 1024)
+
+/**
+ * A group of tuples with the same data[0], in server order
+ */
+struct tuple_group
+{
+   struct tuple* head;       /**< The first tuple */
+   struct tuple* tail;       /**< The last tuple */
+   struct tuple_group* next; /**< The next group, in order of appearance */
+};
+
+/**
+ * A result stream that is parsed as it is read from the server.
+ * The server is read directly into `buffer`, where the messages are parsed,
+ * and only a message split between two reads is moved to the start of it.
+ * Each DataRow is handed to `row`
+ */
+struct result_parser
+{
+   int server;                /**< The server */
+   char* tag;                 /**< The tag of the query */
+   int columns;               /**< The number of columns, or 0 to use the RowDescription */
+   char** names;              /**< The names of the columns, or NULL to use the RowDescription */
+   bool columnar;             /**< Store the result by column */
+   int number_of_columns;     /**< The number of columns of the RowDescription */
+   int32_t types[MAX_NUMBER_OF_COLUMNS];  /**< The type of each column */
+   int16_t formats[MAX_NUMBER_OF_COLUMNS]; /**< The format of each column */
+   uint32_t binary;           /**< The columns that can be received in the binary format */
+   struct builder scratch;    /**< The text of a binary value */
+   int rows;                  /**< The number of DataRows */
+   size_t bytes;              /**< The number of bytes of the messages */
+   uint64_t fingerprint;      /**< The FNV-1a hash of the DataRows */
+   int (*row)(struct result_parser* parser, struct message* msg); /**< The callback of a DataRow */
+   struct query* query;       /**< The result, created by the RowDescription */
+   struct tuple* last;        /**< The last tuple of the result */
+   char* buffer;              /**< The data read from the server */
+   size_t buffer_size;        /**< The size of the buffer */
+   size_t buffer_start;       /**< The start of the messages not parsed yet */
+   size_t buffer_end;         /**< The end of the data read */
+   struct row_limit limit;    /**< The bound on the rows kept of a result stored by column */
+   int* heap;                 /**< The rows kept, as a heap with the smallest value first */
+   double* ranks;             /**< The value of each row kept */
+   int heap_capacity;         /**< The number of rows with room in the heap */
+   size_t live;               /**< The number of payload bytes of the rows kept */
+   bool error;                /**< An ErrorResponse was received */
+   bool ready;                /**< ReadyForQuery was received */
+};
+
+/**
+ * The requests of a server in flight in pgexporter_custom_query_servers()
+ */
+struct query_flight
+{
+   struct query_batch* batch;   /**< The requests */
+   SSL* ssl;                    /**< The SSL structure of the connection */
+   int fd;                      /**< The descriptor of the connection */
+   bool blocking;               /**< Was the descriptor blocking */
+   char* content;               /**< The messages of the requests */
+   size_t size;                 /**< The size of the messages */
+   size_t written;              /**< The bytes of the messages written */
+   int current;                 /**< The request of the result being read */
+   bool canceled;               /**< Was the running query canceled */
+   uint64_t deadline;           /**< The deadline of the running query, or 0 */
+   uint64_t last;               /**< When the previous result was received */
+   bool done;                   /**< Are all the results read, or did the connection fail */
+   bool failed;                 /**< Did the connection fail */
+   bool lost;                   /**< Was the connection lost, rather than timed out */
+   struct result_parser parser; /**< The parser of the results */
+};
 
 static int query_execute(int server, char* qs, char* tag, int columns, char* names[], struct query** query);
-static void* data_append(void* orig, size_t orig_size, void* n, size_t n_size);
-static int create_D_tuple(int server, int number_of_columns, struct message* msg, struct tuple** tuple);
+static int query_execute_request(int server, struct query_request* request);
+static int query_execute_once(int server, struct query_request* request);
+static int query_execute_pipeline(int server, struct query_request* requests, int number_of_requests);
+static int pipeline_content(int server, struct query_request* requests, int number_of_requests, char** content, size_t* size);
+static void pipeline_result(int server, struct result_parser* parser, struct query_request* request);
+static int flight_start(struct query_flight* flight, struct query_batch* batch);
+static void flight_write(struct query_flight* flight);
+static void flight_read(struct query_flight* flight);
+static void flight_parse(struct query_flight* flight);
+static void flight_fail(struct query_flight* flight, bool lost);
+static void flight_end(struct query_flight* flight);
+static uint64_t query_deadline(int timeout);
+static int query_read(int server, uint64_t deadline, char* buffer, size_t size, size_t* length);
+static int query_timeout(int server, struct result_parser* parser, bool* canceled, uint64_t* deadline);
+static size_t write_close(char* content, char* name);
+static size_t write_parse(char* content, char* name, char* query);
+static size_t write_bind(char* content, char* name, struct prepared_statement* statement);
+static size_t write_execute(char* content);
+static void statement_name(int statement, int version, char* name, size_t size);
+static void parser_init(struct result_parser* parser, int server, size_t size);
+static void parser_reset(struct result_parser* parser, struct query_request* request);
+static int parser_parse(struct result_parser* parser);
+static int parser_read(struct result_parser* parser, uint64_t deadline);
+static int parser_space(struct result_parser* parser);
+static int parser_message(struct result_parser* parser, char* data, size_t length);
+static int parser_result(struct result_parser* parser, struct query** query);
+static void parser_destroy(struct result_parser* parser);
+static int append_tuple(struct result_parser* parser, struct message* msg);
+static int append_columns(struct result_parser* parser, struct message* msg);
+static void free_columns(struct columns* columns, int number_of_columns);
+static int limit_row(struct result_parser* parser, int row);
+static double limit_value(struct columns* columns, int column, int row);
+static size_t limit_row_size(struct columns* columns, int number_of_columns, int row);
+static int limit_compact(struct result_parser* parser);
+static void limit_sift_up(struct result_parser* parser, int i);
+static void limit_sift_down(struct result_parser* parser, int i);
+static int create_D_tuple(struct result_parser* parser, struct message* msg, struct tuple** tuple);
+static int read_value(struct result_parser* parser, int column, char* data, int length);
+static int read_numeric(struct builder* builder, char* data, int length);
+static int read_row_description(struct result_parser* parser, struct message* msg);
 static int get_number_of_columns(struct message* msg);
 static int get_column_name(struct message* msg, int index, char** name);
 static int process_server_parameters(int server, struct deque* server_parameters);
 static int pgexporter_detect_extensions(int server);
+static bool lease_connection(int server);
+static void terminate_connection(int server);
+static int connect_server(int server);
+static void connection_lost(int server);
+static bool reconnect(int server);
+static SSL* connection_ssl(int server);
+static int connection_fd(int server);
+static struct prepared_statement* connection_prepared(int server, int metric);
+static void forget_prepared(int server);
+static void close_lane(struct query_lane* l);
+static int open_lane(int server, char* database, struct query_lane* l);
+
+/* The pooled connections of the owner process, inherited by its children */
+static int pool[NUMBER_OF_SERVERS] = {[0 ... NUMBER_OF_SERVERS - 1] = -1};
+/* The connections of this process to the servers, valid while it holds their lease */
+static struct query_lane connections[NUMBER_OF_SERVERS] =
+{[0 ... NUMBER_OF_SERVERS - 1] = {.ssl = NULL, .fd = -1}};
+/* The connections this process holds the lease for */
+static bool leased[NUMBER_OF_SERVERS];
+/* The connections made again after a failed query, once per server and collection */
+static bool reconnected[NUMBER_OF_SERVERS];
+/* The process keeping its own connections in the pool */
+static pid_t pool_owner = 0;
+/* Does the process use connections of its own, instead of the ones lent by the main process */
+static bool private_pool = false;
+/* The statements prepared on the connections of a private pool, by metric */
+static struct prepared_statement* prepared[NUMBER_OF_SERVERS];
+/* The catalog the prepared statements of a private pool are for */
+static struct catalog* prepared_catalog[NUMBER_OF_SERVERS];
+/* The additional connections of this process, the first one of a server is its pooled connection */
+static struct query_lane lanes[NUMBER_OF_SERVERS][MAX_PARALLEL_QUERIES] =
+{[0 ... NUMBER_OF_SERVERS - 1] = {[0 ... MAX_PARALLEL_QUERIES - 1] = {.ssl = NULL, .fd = -1}}};
+/* The lane of the queries of this thread, or NULL for the pooled connection */
+static __thread struct query_lane* current_lane = NULL;
+/* The connections of this process to the databases of the servers */
+static struct database_connection databases[NUMBER_OF_SERVERS][MAX_DATABASE_CONNECTIONS] =
+{[0 ... NUMBER_OF_SERVERS - 1] = {[0 ... MAX_DATABASE_CONNECTIONS - 1] = {.lane = {.ssl = NULL, .fd = -1}}}};
+static pthread_mutex_t databases_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t databases_free = PTHREAD_COND_INITIALIZER;
+/* The authentication keeps its messages in the security module, so one thread authenticates at a time */
+static pthread_mutex_t authenticate_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void
 pgexporter_open_connections(void)
 {
-   int ret;
-   int user;
+   uint64_t span;
    struct configuration* config;
-   struct deque* server_parameters;
 
    config = (struct configuration*)shmem;
 
+   span = pgexporter_trace_begin();
+
    for (int server = 0; server < config->number_of_servers; server++)
    {
-      if (config->servers[server].fd != -1)
+      reconnected[server] = false;
+
+      /* The servers of the other members of a cluster are left alone */
+      if (!pgexporter_cluster_owns(server))
       {
-         if (!pgexporter_connection_isvalid(config->servers[server].ssl, config->servers[server].fd))
+         leased[server] = false;
+         continue;
+      }
+
+      leased[server] = lease_connection(server);
+
+      if (!leased[server])
+      {
+         pgexporter_log_warn("Connection to server '%s' is in use", &config->servers[server].name);
+         continue;
+      }
+
+      /* Only a pooled descriptor of this process is valid here */
+      connections[server].ssl = NULL;
+      connections[server].fd = pool[server];
+      if (!private_pool)
+      {
+         connections[server].backend_pid = config->servers[server].backend_pid;
+         connections[server].backend_secret = config->servers[server].backend_secret;
+      }
+
+      config->server_states[server].new = false;
+
+      /* A closed or failed socket is found without a round trip, and a connection
+         lost otherwise is made again by its first query */
+      if (connections[server].fd != -1)
+      {
+         if (!pgexporter_socket_alive(connections[server].fd))
          {
-            pgexporter_disconnect(config->servers[server].fd);
-            config->servers[server].fd = -1;
+            pgexporter_disconnect(connections[server].fd);
+            connections[server].fd = -1;
+            pool[server] = -1;
          }
       }
 
-      if (config->servers[server].fd == -1)
+      if (connections[server].fd == -1)
+      {
+         connect_server(server);
+      }
+   }
+
+   pgexporter_trace_end("open_connections", -1, span);
+}
+
+void
+pgexporter_close_connections(void)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   for (int server = 0; server < config->number_of_servers; server++)
+   {
+      if (!leased[server])
+      {
+         continue;
+      }
+
+      leased[server] = false;
+
+      if (connections[server].fd != -1)
       {
-         user = -1;
-         for (int usr = 0; user == -1 && usr < config->number_of_users; usr++)
+         /* The TLS state can't be shared between processes */
+         if (config->cache && connections[server].ssl == NULL)
          {
-            if (!strcmp(&config->users[usr].username[0], &config->servers[server].username[0]))
+            if (pool_owner == getpid())
             {
-               user = usr;
+               pool[server] = connections[server].fd;
+               connections[server].fd = -1;
+               config->server_states[server].new = false;
+               atomic_store(&config->server_states[server].lease, STATE_FREE);
+               continue;
             }
-         }
 
-         config->servers[server].new = false;
+            if (!config->server_states[server].new)
+            {
+               /* Back to the pool */
+               connections[server].fd = -1;
+               atomic_store(&config->server_states[server].lease, STATE_FREE);
+               continue;
+            }
 
-         ret = pgexporter_server_authenticate(server, "postgres",
-                                              &config->users[user].username[0], &config->users[user].password[0],
-                                              &config->servers[server].ssl,
-                                              &config->servers[server].fd);
-         if (ret == AUTH_SUCCESS)
-         {
-            config->servers[server].new = true;
-            pgexporter_server_info(server);
-            if (!pgexporter_extract_server_parameters(&server_parameters))
+            if (!pgexporter_transfer_connection_write(server, connections[server].fd))
             {
-               process_server_parameters(server, server_parameters);
-               pgexporter_deque_destroy(server_parameters);
+               /* The main process releases the lease once it owns the connection */
+               pgexporter_disconnect(connections[server].fd);
+               connections[server].fd = -1;
+               continue;
             }
-            pgexporter_detect_extensions(server);
+         }
+
+         terminate_connection(server);
+      }
+
+      atomic_store(&config->server_states[server].lease, STATE_FREE);
+   }
+}
+
+void
+pgexporter_pool_connections(void)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   /* The inherited connections belong to the parent process, so a child
+      of the owner makes connections of its own */
+   if (pool_owner != 0 && pool_owner != getpid())
+   {
+      private_pool = true;
+
+      for (int server = 0; server < NUMBER_OF_SERVERS; server++)
+      {
+         pgexporter_disconnect(pool[server]);
+         pool[server] = -1;
+      }
+   }
+
+   pool_owner = getpid();
+
+   for (int server = 0; server < config->number_of_servers; server++)
+   {
+      if (!leased[server])
+      {
+         continue;
+      }
+
+      leased[server] = false;
+
+      if (connections[server].fd != -1)
+      {
+         if (config->cache && connections[server].ssl == NULL)
+         {
+            pool[server] = connections[server].fd;
+            connections[server].fd = -1;
+            config->server_states[server].new = false;
          }
          else
          {
-            pgexporter_log_error("Failed login for '%s' on server '%s'", &config->users[user].username, &config->servers[server].name);
+            terminate_connection(server);
          }
       }
+
+      atomic_store(&config->server_states[server].lease, STATE_FREE);
    }
 }
 
 void
-pgexporter_close_connections(void)
+pgexporter_pool_add(int server, int fd)
 {
-   int ret;
-   bool nuke;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (pool[server] != -1 && pool[server] != fd)
+   {
+      pgexporter_disconnect(pool[server]);
+   }
+
+   pool[server] = fd;
+
+   config->server_states[server].new = false;
+   config->server_states[server].connected = true;
+
+   atomic_store(&config->server_states[server].lease, STATE_FREE);
+}
+
+void
+pgexporter_pool_destroy(void)
+{
+   for (int server = 0; server < NUMBER_OF_SERVERS; server++)
+   {
+      pgexporter_pool_remove(server);
+   }
+}
+
+void
+pgexporter_pool_reclaim(pid_t pid)
+{
+   int holder;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
 
    for (int server = 0; server < config->number_of_servers; server++)
    {
-      if (config->servers[server].fd != -1)
+      holder = (int)pid;
+      if (atomic_load(&config->server_states[server].lease) != holder)
+      {
+         continue;
+      }
+
+      /* The process used a connection of its own, so the pooled connection is left alone */
+      pgexporter_log_warn("Connection to server '%s' released for process %d", &config->servers[server].name, holder);
+
+      atomic_compare_exchange_strong(&config->server_states[server].lease, &holder, STATE_FREE);
+   }
+}
+
+void
+pgexporter_pool_remove(int server)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (server < 0 || server >= NUMBER_OF_SERVERS || pool[server] == -1)
+   {
+      return;
+   }
+
+   /* Don't pull a lent connection away from a scrape in progress */
+   if (private_pool ||
+       (server < config->number_of_servers && atomic_load(&config->server_states[server].lease) == STATE_FREE))
+   {
+      pgexporter_write_terminate(NULL, pool[server]);
+   }
+   pgexporter_disconnect(pool[server]);
+
+   if (!private_pool && server < config->number_of_servers)
+   {
+      config->server_states[server].connected = false;
+   }
+
+   forget_prepared(server);
+
+   pool[server] = -1;
+}
+
+bool
+pgexporter_pool_connected(int server)
+{
+   return server >= 0 && server < NUMBER_OF_SERVERS && pool[server] != -1;
+}
+
+bool
+pgexporter_connection_active(int server)
+{
+   return leased[server] && connections[server].fd != -1;
+}
+
+int
+pgexporter_open_lanes(int server)
+{
+   int user = -1;
+   int number_of_lanes = 1;
+   struct query_lane* l = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   for (int usr = 0; user == -1 && usr < config->number_of_users; usr++)
+   {
+      if (!strcmp(&config->users[usr].username[0], &config->servers[server].username[0]))
+      {
+         user = usr;
+      }
+   }
+
+   for (int i = 1; user != -1 && i < MIN(config->servers[server].max_parallel_queries, MAX_PARALLEL_QUERIES); i++)
+   {
+      l = &lanes[server][i];
+
+      if (l->fd != -1 && !pgexporter_socket_alive(l->fd))
       {
-         nuke = true;
+         close_lane(l);
+      }
+
+      if (l->fd == -1 && open_lane(server, "postgres", l))
+      {
+         pgexporter_log_warn("Unable to open connection %d to server '%s'", i, &config->servers[server].name);
+         break;
+      }
 
-         if (config->cache)
+      number_of_lanes++;
+   }
+
+   return number_of_lanes;
+}
+
+void
+pgexporter_close_lanes(void)
+{
+   for (int server = 0; server < NUMBER_OF_SERVERS; server++)
+   {
+      for (int i = 1; i < MAX_PARALLEL_QUERIES; i++)
+      {
+         if (lanes[server][i].fd != -1)
          {
-            if (config->servers[server].new)
-            {
-               ret = pgexporter_transfer_connection_write(server);
+            close_lane(&lanes[server][i]);
+         }
+      }
+   }
+}
 
-               if (ret == 0)
-               {
-                  config->servers[server].new = false;
-               }
-            }
+void
+pgexporter_select_lane(int server, int lane)
+{
+   current_lane = lane > 0 && lane < MAX_PARALLEL_QUERIES ? &lanes[server][lane] : NULL;
+}
 
-            if (!config->servers[server].new)
-            {
-               nuke = false;
-            }
+int
+pgexporter_database_query(int server, char* database, struct query_request* requests, int number_of_requests)
+{
+   int slot;
+   int number_of_connections;
+   struct database_connection* c = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   number_of_connections = MAX(1, MIN(config->servers[server].database_connections, MAX_DATABASE_CONNECTIONS));
+
+   pthread_mutex_lock(&databases_lock);
+
+   for (;;)
+   {
+      slot = -1;
+
+      // The open connection to the database, then a closed one, then the least recently used one
+      for (int i = 0; i < number_of_connections; i++)
+      {
+         c = &databases[server][i];
+
+         if (c->used)
+         {
+            continue;
          }
 
-         if (nuke)
+         if (c->lane.fd != -1 && !strcmp(c->database, database))
          {
-            pgexporter_write_terminate(config->servers[server].ssl, config->servers[server].fd);
-            if (config->servers[server].ssl != NULL)
-            {
-               pgexporter_close_ssl(config->servers[server].ssl);
-            }
-            else
-            {
-               pgexporter_disconnect(config->servers[server].fd);
-            }
-            config->servers[server].ssl = NULL;
-            config->servers[server].fd = -1;
-            config->servers[server].new = false;
-            config->servers[server].state = SERVER_UNKNOWN;
+            slot = i;
+            break;
+         }
+
+         if (slot == -1 ||
+             (databases[server][slot].lane.fd != -1 && (c->lane.fd == -1 || c->last < databases[server][slot].last)))
+         {
+            slot = i;
+         }
+      }
+
+      if (slot != -1)
+      {
+         break;
+      }
+
+      pthread_cond_wait(&databases_free, &databases_lock);
+   }
+
+   c = &databases[server][slot];
+   c->used = true;
+
+   pthread_mutex_unlock(&databases_lock);
+
+   if (c->lane.fd != -1 && (strcmp(c->database, database) || !pgexporter_socket_alive(c->lane.fd)))
+   {
+      close_lane(&c->lane);
+   }
+
+   if (c->lane.fd == -1)
+   {
+      memset(c->database, 0, sizeof(c->database));
+
+      if (open_lane(server, database, &c->lane))
+      {
+         pgexporter_log_warn("Unable to connect to database '%s' on server '%s'", database, &config->servers[server].name);
+         goto error;
+      }
+
+      snprintf(c->database, sizeof(c->database), "%s", database);
+   }
+
+   current_lane = &c->lane;
+
+   if (config->metrics_pipeline)
+   {
+      pgexporter_custom_query_pipeline(server, requests, number_of_requests);
+   }
+   else
+   {
+      for (int i = 0; i < number_of_requests; i++)
+      {
+         uint64_t start = pgexporter_stats_now();
+
+         pgexporter_custom_query(server, &requests[i]);
+         requests[i].duration = pgexporter_stats_now() - start;
+      }
+   }
+
+   current_lane = NULL;
+
+   pthread_mutex_lock(&databases_lock);
+   c->used = false;
+   c->last = pgexporter_stats_now();
+   pthread_cond_broadcast(&databases_free);
+   pthread_mutex_unlock(&databases_lock);
+
+   return 0;
+
+error:
+
+   pthread_mutex_lock(&databases_lock);
+   c->used = false;
+   c->last = 0;
+   pthread_cond_broadcast(&databases_free);
+   pthread_mutex_unlock(&databases_lock);
+
+   return 1;
+}
+
+void
+pgexporter_close_databases(void)
+{
+   for (int server = 0; server < NUMBER_OF_SERVERS; server++)
+   {
+      for (int i = 0; i < MAX_DATABASE_CONNECTIONS; i++)
+      {
+         if (databases[server][i].lane.fd != -1)
+         {
+            close_lane(&databases[server][i].lane);
          }
+         memset(databases[server][i].database, 0, sizeof(databases[server][i].database));
       }
    }
 }
@@ -262,22 +781,63 @@ pgexporter_query_total_disk_space(int server, bool data, struct query** query)
 }
 
 int
-pgexporter_query_version(int server, struct query** query)
+pgexporter_query_disk_space(int server, bool data, bool wal, struct query** query)
 {
-   return query_execute(server, "SELECT split_part(split_part(version(), ' ', 2), '.', 1) AS major, "
-                        "split_part(split_part(version(), ' ', 2), '.', 2) AS minor;", "pg_version",
-                        2, NULL, query);
-}
+   char qs[8 * MISC_LENGTH];
+   int offset;
+   int columns = 0;
+   char* directory = NULL;
+   static char* names[] = {"data_used", "data_free", "data_total", "wal_used", "wal_free", "wal_total"};
+   struct configuration* config;
 
-int
-pgexporter_query_uptime(int server, struct query** query)
-{
-   return query_execute(server, "SELECT FLOOR(EXTRACT(EPOCH FROM now() - pg_postmaster_start_time)) FROM pg_postmaster_start_time();",
-                        "pg_uptime", 1, NULL, query);
-}
+   config = (struct configuration*)shmem;
 
-int
-pgexporter_query_primary(int server, struct query** query)
+   *query = NULL;
+
+   if (!data && !wal)
+   {
+      return 1;
+   }
+
+   offset = snprintf(qs, sizeof(qs), "SELECT ");
+
+   for (int i = 0; i < 2; i++)
+   {
+      if ((i == 0 && !data) || (i == 1 && !wal))
+      {
+         continue;
+      }
+
+      directory = i == 0 ? config->servers[server].data : config->servers[server].wal;
+
+      offset += snprintf(qs + offset, sizeof(qs) - offset,
+                         "%spgexporter_used_space('%s'), pgexporter_free_space('%s'), pgexporter_total_space('%s')",
+                         columns > 0 ? ", " : "", directory, directory, directory);
+      columns += 3;
+   }
+
+   snprintf(qs + offset, sizeof(qs) - offset, ";");
+
+   return query_execute(server, qs, "pgexporter_ext", columns, data ? &names[0] : &names[3], query);
+}
+
+int
+pgexporter_query_version(int server, struct query** query)
+{
+   return query_execute(server, "SELECT split_part(split_part(version(), ' ', 2), '.', 1) AS major, "
+                        "split_part(split_part(version(), ' ', 2), '.', 2) AS minor;", "pg_version",
+                        2, NULL, query);
+}
+
+int
+pgexporter_query_uptime(int server, struct query** query)
+{
+   return query_execute(server, "SELECT FLOOR(EXTRACT(EPOCH FROM now() - pg_postmaster_start_time)) FROM pg_postmaster_start_time();",
+                        "pg_uptime", 1, NULL, query);
+}
+
+int
+pgexporter_query_primary(int server, struct query** query)
 {
    return query_execute(server, "SELECT (CASE pg_is_in_recovery() WHEN 'f' THEN 't' ELSE 'f' END);",
                         "pg_primary", 1, NULL, query);
@@ -290,6 +850,13 @@ pgexporter_query_database_size(int server, struct query** query)
                         "pg_database", 2, NULL, query);
 }
 
+int
+pgexporter_query_databases(int server, struct query** query)
+{
+   return query_execute(server, "SELECT datname FROM pg_database WHERE datallowconn AND NOT datistemplate ORDER BY datname;",
+                        "pg_database", 1, NULL, query);
+}
+
 int
 pgexporter_query_extensions_list(int server, struct query** query)
 {
@@ -420,122 +987,400 @@ pgexporter_query_settings(int server, struct query** query)
 }
 
 int
-pgexporter_custom_query(int server, char* qs, char* tag, int columns, char** names, struct query** query)
+pgexporter_custom_query(int server, struct query_request* request)
 {
-   return query_execute(server, qs, tag, columns, names, query);
+   return query_execute_request(server, request);
 }
 
-struct query*
-pgexporter_merge_queries(struct query* q1, struct query* q2, int sort)
+int
+pgexporter_custom_query_pipeline(int server, struct query_request* requests, int number_of_requests)
 {
-   struct tuple* last = NULL;
-   struct tuple* ct1 = NULL;
-   struct tuple* ct2 = NULL;
-   struct tuple* tmp1 = NULL;
-   struct tuple* tmp2 = NULL;
+   int start = 0;
+   bool retry;
+   size_t size = 0;
 
-   if (q1 == NULL)
+   // Keep each round trip well below the socket buffers, otherwise the server
+   // can block writing results while we are still writing queries
+   for (int i = 0; i < number_of_requests; i++)
    {
-      return q2;
-   }
+      size += strlen(requests[i].query) + PIPELINE_QUERY_OVERHEAD;
 
-   if (q2 == NULL)
-   {
-      return q1;
+      if (size >= PIPELINE_MAX_SIZE || i == number_of_requests - 1)
+      {
+         if (query_execute_pipeline(server, &requests[start], i - start + 1))
+         {
+            // The queries are sent again on a new connection when none of them got a result
+            retry = true;
+            for (int j = start; j <= i; j++)
+            {
+               retry = retry && requests[j].result == NULL;
+            }
+
+            if (!retry || !reconnect(server) || query_execute_pipeline(server, &requests[start], i - start + 1))
+            {
+               return 1;
+            }
+         }
+
+         start = i + 1;
+         size = 0;
+      }
    }
 
-   ct1 = q1->tuples;
-   ct2 = q2->tuples;
+   return 0;
+}
 
-   if (sort == SORT_NAME)
+int
+pgexporter_custom_query_servers(struct query_batch* batches, int number_of_batches)
+{
+   int ret = 0;
+   int r;
+   int nfds;
+   int timeout;
+   bool lost;
+   uint64_t now;
+   uint64_t wake;
+   int* indexes = NULL;
+   struct pollfd* pfds = NULL;
+   struct query_flight* flights = NULL;
+
+   flights = calloc(number_of_batches, sizeof(struct query_flight));
+   pfds = calloc(number_of_batches, sizeof(struct pollfd));
+   indexes = calloc(number_of_batches, sizeof(int));
+
+   if (flights == NULL || pfds == NULL || indexes == NULL)
    {
-      while (ct1 != NULL)
+      // The servers are then queried one after the other
+      for (int i = 0; i < number_of_batches; i++)
       {
-         last = ct1;
-         ct1 = ct1->next;
+         ret |= pgexporter_custom_query_pipeline(batches[i].server, batches[i].requests, batches[i].number_of_requests);
       }
+      goto done;
+   }
 
-      last->next = ct2;
+   for (int i = 0; i < number_of_batches; i++)
+   {
+      if (flight_start(&flights[i], &batches[i]))
+      {
+         flight_fail(&flights[i], false);
+      }
    }
-   else
+
+   while (true)
    {
+      nfds = 0;
+      wake = 0;
+      timeout = -1;
+      now = pgexporter_stats_now();
 
-      if (ct1 != NULL)
+      for (int i = 0; i < number_of_batches; i++)
       {
-         while (ct1 != NULL && ct2 != NULL)
-         {
+         struct query_flight* flight = &flights[i];
 
-            tmp1 = ct1;
-
-            if (strcmp(tmp1->data[0], ct2->data[0]))
-            {
-               while (tmp1 != NULL && tmp1->next != NULL && strcmp(tmp1->next->data[0], ct2->data[0]))
-               {
-                  tmp1 = tmp1->next;
-               }
-            }
-            while (tmp1 != NULL && tmp1->next != NULL && !strcmp(tmp1->next->data[0], ct2->data[0]))
-            {
-               tmp1 = tmp1->next;
-            }
+         if (flight->done)
+         {
+            continue;
+         }
 
-            if (tmp1 == NULL)
+         // Only the running query of a server is canceled, as each query has its own Sync
+         if (flight->deadline > 0 && now >= flight->deadline)
+         {
+            if (query_timeout(flight->batch->server, &flight->parser, &flight->canceled, &flight->deadline))
             {
+               flight_fail(flight, false);
                continue;
             }
+         }
+
+         pfds[nfds].fd = flight->fd;
+         pfds[nfds].events = flight->written < flight->size ? POLLIN | POLLOUT : POLLIN;
+         pfds[nfds].revents = 0;
+         indexes[nfds] = i;
+         nfds++;
 
-            tmp2 = ct2->next;
+         if (flight->deadline > 0 && (wake == 0 || flight->deadline < wake))
+         {
+            wake = flight->deadline;
+         }
 
-            ct2->next = tmp1->next;
-            tmp1->next = ct2;
-            ct2 = tmp2;
+         // Data already decrypted by the TLS layer doesn't show up on the socket
+         if (flight->ssl != NULL && SSL_pending(flight->ssl) > 0)
+         {
+            timeout = 0;
          }
       }
-      else
+
+      if (nfds == 0)
       {
-         ct1 = ct2;
-         ct2 = NULL;
+         break;
       }
-   }
 
-   q2->tuples = NULL;
-   pgexporter_free_query(q2);
+      if (timeout != 0 && wake > 0)
+      {
+         timeout = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+      }
 
-   return q1;
-}
+      r = poll(pfds, nfds, timeout);
 
-int
-pgexporter_free_query(struct query* query)
-{
+      if (r == -1)
+      {
+         if (errno == EINTR)
+         {
+            errno = 0;
+            continue;
+         }
 
-   if (query != NULL)
+         pgexporter_log_error("Unable to poll the servers: %s", strerror(errno));
+         errno = 0;
+
+         for (int k = 0; k < nfds; k++)
+         {
+            flight_fail(&flights[indexes[k]], true);
+         }
+         break;
+      }
+
+      for (int k = 0; k < nfds; k++)
+      {
+         struct query_flight* flight = &flights[indexes[k]];
+
+         if (!flight->done && (pfds[k].revents & POLLOUT))
+         {
+            flight_write(flight);
+         }
+
+         if (!flight->done && ((pfds[k].revents & (POLLIN | POLLERR | POLLHUP)) ||
+                               (flight->ssl != NULL && SSL_pending(flight->ssl) > 0)))
+         {
+            flight_read(flight);
+         }
+      }
+   }
+
+   for (int i = 0; i < number_of_batches; i++)
    {
-      pgexporter_free_tuples(&query->tuples, query->number_of_columns);
-      free(query);
+      flight_end(&flights[i]);
    }
 
-   return 0;
+   // A pooled connection found closed by its first query is made again once
+   for (int i = 0; i < number_of_batches; i++)
+   {
+      if (!flights[i].failed)
+      {
+         continue;
+      }
+
+      if (!flights[i].lost)
+      {
+         ret = 1;
+         continue;
+      }
+
+      lost = true;
+      for (int j = 0; j < batches[i].number_of_requests; j++)
+      {
+         lost = lost && batches[i].requests[j].result == NULL;
+      }
+
+      if (!lost || !reconnect(batches[i].server) ||
+          pgexporter_custom_query_pipeline(batches[i].server, batches[i].requests, batches[i].number_of_requests))
+      {
+         ret = 1;
+      }
+   }
+
+done:
+
+   free(flights);
+   free(pfds);
+   free(indexes);
+
+   return ret;
 }
 
-int
-pgexporter_free_tuples(struct tuple** tuples, int n_columns)
+struct query*
+pgexporter_merge_queries(struct query* q1, struct query* q2, int sort)
 {
-   struct tuple* next = NULL;
+   struct query* queries[2] = {q1, q2};
+
+   return pgexporter_merge_all_queries(&queries[0], 2, sort);
+}
+
+struct query*
+pgexporter_merge_all_queries(struct query** queries, int number_of_queries, int sort)
+{
+   char* key = NULL;
+   struct query* result = NULL;
+   struct query* q = NULL;
    struct tuple* current = NULL;
-   current = *tuples;
+   struct tuple* next = NULL;
+   struct tuple* last = NULL;
+   struct tuple_group* group = NULL;
+   struct tuple_group* first_group = NULL;
+   struct tuple_group* last_group = NULL;
+   struct art* index = NULL;
 
-   while (current != NULL)
+   for (int i = 0; i < number_of_queries; i++)
+   {
+      if (queries[i] == NULL)
+      {
+         continue;
+      }
+
+      if (result == NULL)
+      {
+         result = queries[i];
+      }
+      else
+      {
+         if (result->arena == NULL)
+         {
+            result->arena = queries[i]->arena;
+         }
+         else
+         {
+            pgexporter_arena_merge(result->arena, queries[i]->arena);
+         }
+         queries[i]->arena = NULL;
+      }
+   }
+
+   if (result == NULL)
+   {
+      return NULL;
+   }
+
+   // Group the tuples on data[0] in a single pass, with the groups in order of
+   // their first appearance. Without an index the tuples are just concatenated
+   if (sort == SORT_DATA0 && (result->arena == NULL || pgexporter_art_create(&index)))
+   {
+      index = NULL;
+   }
+
+   for (int i = 0; i < number_of_queries; i++)
    {
-      next = current->next;
+      q = queries[i];
+
+      if (q == NULL)
+      {
+         continue;
+      }
+
+      current = q->tuples;
+      q->tuples = NULL;
+
+      while (current != NULL)
+      {
+         next = current->next;
+         current->next = NULL;
+
+         if (index == NULL)
+         {
+            if (last == NULL)
+            {
+               result->tuples = current;
+            }
+            else
+            {
+               last->next = current;
+            }
+            last = current;
+         }
+         else
+         {
+            key = current->data[0] != NULL ? current->data[0] : "";
+            group = (struct tuple_group*)pgexporter_art_search(index, key);
+
+            if (group == NULL)
+            {
+               group = (struct tuple_group*)pgexporter_arena_alloc(result->arena, sizeof(struct tuple_group),
+                                                                   _Alignof(struct tuple_group));
+               if (group != NULL)
+               {
+                  group->head = NULL;
+                  group->tail = NULL;
+                  group->next = NULL;
+
+                  if (pgexporter_art_insert(index, key, (uintptr_t)group, ValueRef))
+                  {
+                     group = NULL;
+                  }
+               }
+
+               if (group == NULL)
+               {
+                  // Out of memory, keep the tuple in the last group
+                  group = last_group;
+               }
+               else
+               {
+                  if (last_group == NULL)
+                  {
+                     first_group = group;
+                  }
+                  else
+                  {
+                     last_group->next = group;
+                  }
+                  last_group = group;
+               }
+            }
+
+            if (group != NULL)
+            {
+               if (group->tail == NULL)
+               {
+                  group->head = current;
+               }
+               else
+               {
+                  group->tail->next = current;
+               }
+               group->tail = current;
+            }
+         }
+
+         current = next;
+      }
+
+      if (q != result)
+      {
+         pgexporter_free_query(q);
+      }
+
+      queries[i] = NULL;
+   }
 
-      for (int i = 0; i < n_columns; i++)
+   if (index != NULL)
+   {
+      for (group = first_group; group != NULL; group = group->next)
       {
-         free(current->data[i]);
+         if (last == NULL)
+         {
+            result->tuples = group->head;
+         }
+         else
+         {
+            last->next = group->head;
+         }
+         last = group->tail;
       }
-      free(current->data);
-      free(current);
 
-      current = next;
+      pgexporter_art_destroy(index);
+   }
+
+   return result;
+}
+
+int
+pgexporter_free_query(struct query* query)
+{
+
+   if (query != NULL)
+   {
+      free_columns(query->columns, query->number_of_columns);
+      pgexporter_arena_destroy(query->arena);
+      pgexporter_memory_release(MEMORY_QUERY, query);
    }
 
    return 0;
@@ -579,225 +1424,1784 @@ pgexporter_query_debug(struct query* query)
 
 char*
 pgexporter_get_column_by_name(char* name, struct query* query, struct tuple* tuple)
+{
+   int col = pgexporter_get_column_index(name, query);
+
+   if (col == -1)
+   {
+      return NULL;
+   }
+
+   return pgexporter_get_column(col, tuple);
+}
+
+int
+pgexporter_get_column_index(char* name, struct query* query)
 {
    for (int i = 0; i < query->number_of_columns; i++)
    {
       if (!strcmp(query->names[i], name))
       {
-         return pgexporter_get_column(i, tuple);
+         return i;
       }
    }
 
-   return NULL;
+   return -1;
+}
+
+char*
+pgexporter_get_value(int col, int row, struct query* query)
+{
+   struct columns* columns = query->columns;
+
+   if (columns == NULL || col < 0 || col >= query->number_of_columns || row < 0 || row >= columns->number_of_rows)
+   {
+      return NULL;
+   }
+
+   if (columns->nulls[col][row / 8] & (1 << (row % 8)))
+   {
+      return NULL;
+   }
+
+   return columns->payload.data + columns->offsets[col][row];
 }
 
 static int
 query_execute(int server, char* qs, char* tag, int columns, char* names[], struct query** query)
 {
-   int status;
-   bool cont;
-   int cols;
-   char* name = NULL;
-   struct message qmsg = {0};
-   struct message* tmsg = NULL;
-   size_t size = 0;
-   char* content = NULL;
-   struct message* msg = NULL;
-   struct query* q = NULL;
-   struct tuple* current = NULL;
-   void* data = NULL;
-   size_t data_size = 0;
-   size_t offset = 0;
+   int ret;
+   struct query_request request;
    struct configuration* config;
 
    config = (struct configuration*)shmem;
 
-   *query = NULL;
+   memset(&request, 0, sizeof(struct query_request));
+   request.query = qs;
+   request.tag = tag;
+   request.columns = columns;
+   request.names = names;
+   request.statement = -1;
+   request.timeout = config->query_timeout;
 
-   memset(&qmsg, 0, sizeof(struct message));
+   ret = query_execute_request(server, &request);
 
-   size = 1 + 4 + strlen(qs) + 1;
-   content = (char*)malloc(size);
-   memset(content, 0, size);
+   *query = request.result;
 
-   pgexporter_write_byte(content, 'Q');
-   pgexporter_write_int32(content + 1, size - 1);
-   pgexporter_write_string(content + 5, qs);
+   return ret;
+}
+
+static int
+query_execute_request(int server, struct query_request* request)
+{
+   int ret;
+   uint64_t span;
+
+   span = pgexporter_trace_begin();
+
+   ret = query_execute_once(server, request);
+
+   if (ret != 0)
+   {
+      ret = reconnect(server) ? query_execute_once(server, request) : 1;
+   }
+
+   pgexporter_trace_end(request->tag != NULL ? request->tag : "query", server, span);
+
+   return ret;
+}
+
+static int
+query_execute_once(int server, struct query_request* request)
+{
+   int status;
+   bool canceled = false;
+   uint64_t deadline;
+   struct message qmsg = {0};
+   size_t size = 0;
+   char* qs = request->query;
+   char* content = NULL;
+   struct result_parser parser;
+
+   request->result = NULL;
+   request->error = true;
+
+   parser_init(&parser, server, request->size);
+   parser_reset(&parser, request);
+
+   memset(&qmsg, 0, sizeof(struct message));
+
+   size = 1 + 4 + strlen(qs) + 1;
+   content = (char*)malloc(size);
+   memset(content, 0, size);
+
+   pgexporter_write_byte(content, 'Q');
+   pgexporter_write_int32(content + 1, size - 1);
+   pgexporter_write_string(content + 5, qs);
 
    qmsg.kind = 'Q';
    qmsg.length = size;
    qmsg.data = content;
 
-   status = pgexporter_write_message(config->servers[server].ssl, config->servers[server].fd, &qmsg);
+   status = pgexporter_write_message(connection_ssl(server), connection_fd(server), &qmsg);
+   if (status != MESSAGE_STATUS_OK)
+   {
+      connection_lost(server);
+      goto error;
+   }
+
+   deadline = query_deadline(request->timeout);
+
+   while (true)
+   {
+      if (parser_parse(&parser))
+      {
+         goto error;
+      }
+
+      if (parser.ready)
+      {
+         break;
+      }
+
+      status = parser_read(&parser, deadline);
+
+      if (status == MESSAGE_STATUS_ZERO)
+      {
+         if (query_timeout(server, &parser, &canceled, &deadline))
+         {
+            goto error;
+         }
+      }
+      else if (status != MESSAGE_STATUS_OK)
+      {
+         connection_lost(server);
+         goto error;
+      }
+   }
+
+   if (parser_result(&parser, &request->result))
+   {
+      goto error;
+   }
+
+   request->error = false;
+
+   parser_destroy(&parser);
+   free(content);
+
+   return 0;
+
+error:
+
+   parser_destroy(&parser);
+   free(content);
+
+   return 1;
+}
+
+static int
+query_execute_pipeline(int server, struct query_request* requests, int number_of_requests)
+{
+   int status;
+   int current;
+   char* content = NULL;
+   size_t size = 0;
+   size_t expected = 0;
+   bool canceled = false;
+   uint64_t deadline;
+   uint64_t last;
+   uint64_t now;
+   struct message qmsg = {0};
+   struct result_parser parser;
+
+   // The results of all the queries go through the same buffer
+   for (int i = 0; i < number_of_requests; i++)
+   {
+      expected += requests[i].size;
+   }
+
+   parser_init(&parser, server, expected);
+
+   if (pipeline_content(server, requests, number_of_requests, &content, &size))
+   {
+      goto error;
+   }
+
+   qmsg.kind = 'P';
+   qmsg.length = size;
+   qmsg.data = content;
+
+   last = pgexporter_stats_now();
+
+   status = pgexporter_write_message(connection_ssl(server), connection_fd(server), &qmsg);
    if (status != MESSAGE_STATUS_OK)
    {
+      connection_lost(server);
       goto error;
    }
 
-   cont = true;
-   while (cont)
-   {
-      status = pgexporter_read_block_message(config->servers[server].ssl, config->servers[server].fd, &msg);
+   current = 0;
+   parser_reset(&parser, &requests[current]);
+   deadline = query_deadline(requests[current].timeout);
+
+   while (current < number_of_requests)
+   {
+      // Demultiplex on ReadyForQuery, the rest of the buffer belongs to the next query
+      if (parser_parse(&parser))
+      {
+         goto error;
+      }
+
+      if (!parser.ready)
+      {
+         status = parser_read(&parser, deadline);
+
+         if (status == MESSAGE_STATUS_ZERO)
+         {
+            // Only the running query is canceled, as each query has its own Sync
+            if (query_timeout(server, &parser, &canceled, &deadline))
+            {
+               goto error;
+            }
+         }
+         else if (status != MESSAGE_STATUS_OK)
+         {
+            connection_lost(server);
+            goto error;
+         }
+      }
+      else
+      {
+         // The results arrive in order, so a query takes the time since the previous result
+         now = pgexporter_stats_now();
+         requests[current].duration = now - last;
+         last = now;
+
+         pipeline_result(server, &parser, &requests[current]);
+         current++;
+
+         if (current < number_of_requests)
+         {
+            parser_reset(&parser, &requests[current]);
+            canceled = false;
+            deadline = query_deadline(requests[current].timeout);
+         }
+      }
+   }
+
+   parser_destroy(&parser);
+   free(content);
+
+   return 0;
+
+error:
+
+   parser_destroy(&parser);
+   free(content);
+
+   return 1;
+}
+
+static int
+pipeline_content(int server, struct query_request* requests, int number_of_requests, char** content, size_t* size)
+{
+   bool parse = false;
+   size_t offset = 0;
+   char* c = NULL;
+   char name[MISC_LENGTH];
+   char old[MISC_LENGTH];
+   struct server* srv = NULL;
+   struct prepared_statement* statement = NULL;
+   struct catalog* catalog = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+   catalog = pgexporter_catalog_get(config);
+   srv = &config->servers[server];
+
+   *content = NULL;
+   *size = 0;
+
+   // The statements prepared on a lent connection before a reload are for other metrics
+   if (current_lane == NULL && !private_pool && srv->prepared_generation != config->metrics_generation)
+   {
+      for (int i = 0; catalog != NULL && i < catalog->number_of_metrics; i++)
+      {
+         statement = pgexporter_catalog_prepared(config, server, i);
+         if (statement != NULL)
+         {
+            statement->version = -1;
+            statement->number_of_columns = 0;
+            statement->binary = 0;
+         }
+      }
+      srv->prepared_generation = config->metrics_generation;
+   }
+
+   // Size the messages first, and then write them
+   for (int pass = 0; pass < 2; pass++)
+   {
+      offset = 0;
+
+      for (int i = 0; i < number_of_requests; i++)
+      {
+         struct query_request* request = &requests[i];
+
+         if (pass == 0)
+         {
+            request->result = NULL;
+            request->error = true;
+         }
+
+         statement = connection_prepared(server, request->statement);
+
+         if (statement == NULL)
+         {
+            offset += write_parse(c != NULL ? c + offset : NULL, "", request->query);
+            offset += write_bind(c != NULL ? c + offset : NULL, "", NULL);
+         }
+         else
+         {
+            statement_name(request->statement, request->version, &name[0], sizeof(name));
+            parse = statement->version != request->version;
+
+            if (parse)
+            {
+               // A statement for another version of the server is closed,
+               // and so is a statement left over from a failed query
+               if (statement->version != -1)
+               {
+                  statement_name(request->statement, statement->version, &old[0], sizeof(old));
+                  offset += write_close(c != NULL ? c + offset : NULL, &old[0]);
+               }
+               offset += write_close(c != NULL ? c + offset : NULL, &name[0]);
+               offset += write_parse(c != NULL ? c + offset : NULL, &name[0], request->query);
+            }
+
+            // The result columns are known once the statement has been executed
+            offset += write_bind(c != NULL ? c + offset : NULL, &name[0],
+                                 !parse && config->metrics_binary ? statement : NULL);
+         }
+
+         offset += write_execute(c != NULL ? c + offset : NULL);
+      }
+
+      if (pass == 0)
+      {
+         c = (char*)malloc(offset);
+         if (c == NULL)
+         {
+            return 1;
+         }
+         memset(c, 0, offset);
+      }
+   }
+
+   *content = c;
+   *size = offset;
+
+   return 0;
+}
+
+static void
+pipeline_result(int server, struct result_parser* parser, struct query_request* request)
+{
+   struct prepared_statement* statement = NULL;
+
+   request->error = parser_result(parser, &request->result) != 0;
+
+   statement = connection_prepared(server, request->statement);
+
+   if (statement != NULL)
+   {
+      // After an error it is unknown if the statement exists, so it is
+      // closed and prepared again by the next execution
+      statement->version = request->error ? -1 : request->version;
+      statement->number_of_columns = parser->number_of_columns;
+      statement->binary = parser->binary;
+   }
+}
+
+static int
+flight_start(struct query_flight* flight, struct query_batch* batch)
+{
+   int server = batch->server;
+   size_t expected = 0;
+
+   flight->batch = batch;
+   flight->fd = -1;
+   flight->blocking = false;
+
+   for (int i = 0; i < batch->number_of_requests; i++)
+   {
+      expected += batch->requests[i].size;
+   }
+
+   parser_init(&flight->parser, server, expected);
+
+   if (pipeline_content(server, batch->requests, batch->number_of_requests, &flight->content, &flight->size))
+   {
+      return 1;
+   }
+
+   if (batch->number_of_requests == 0)
+   {
+      flight->done = true;
+      return 0;
+   }
+
+   flight->ssl = connection_ssl(server);
+   flight->fd = connection_fd(server);
+
+   if (flight->fd == -1)
+   {
+      return 1;
+   }
+
+   flight->blocking = !pgexporter_socket_is_nonblocking(flight->fd);
+   if (flight->blocking)
+   {
+      pgexporter_socket_nonblocking(flight->fd, true);
+   }
+
+   flight->current = 0;
+   flight->last = pgexporter_stats_now();
+   parser_reset(&flight->parser, &batch->requests[0]);
+   flight->deadline = query_deadline(batch->requests[0].timeout);
+
+   return 0;
+}
+
+static void
+flight_write(struct query_flight* flight)
+{
+   int n;
+   ssize_t numbytes;
+   unsigned long err;
+
+   if (flight->ssl != NULL)
+   {
+      // A TLS write is retried with the same arguments until it is complete
+      n = SSL_write(flight->ssl, flight->content + flight->written,
+                    (int)MIN(flight->size - flight->written, (size_t)INT_MAX));
+
+      if (n > 0)
+      {
+         flight->written += (size_t)n;
+         return;
+      }
+
+      err = SSL_get_error(flight->ssl, n);
+      ERR_clear_error();
+
+      if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+      {
+         flight_fail(flight, true);
+      }
+
+      errno = 0;
+      return;
+   }
+
+   numbytes = write(flight->fd, flight->content + flight->written, flight->size - flight->written);
+
+   if (numbytes > 0)
+   {
+      flight->written += (size_t)numbytes;
+   }
+   else if (numbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+   {
+      errno = 0;
+   }
+   else
+   {
+      errno = 0;
+      flight_fail(flight, true);
+   }
+}
+
+static void
+flight_read(struct query_flight* flight)
+{
+   int n;
+   ssize_t numbytes;
+   unsigned long err;
+   struct result_parser* parser = &flight->parser;
+
+   if (parser_space(parser))
+   {
+      flight_fail(flight, true);
+      return;
+   }
+
+   if (flight->ssl != NULL)
+   {
+      n = SSL_read(flight->ssl, parser->buffer + parser->buffer_end,
+                   (int)MIN(parser->buffer_size - parser->buffer_end, (size_t)INT_MAX));
+
+      if (n <= 0)
+      {
+         err = SSL_get_error(flight->ssl, n);
+         ERR_clear_error();
+         errno = 0;
+
+         if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+         {
+            flight_fail(flight, true);
+         }
+         return;
+      }
+
+      numbytes = n;
+   }
+   else
+   {
+      numbytes = read(flight->fd, parser->buffer + parser->buffer_end, parser->buffer_size - parser->buffer_end);
+
+      if (numbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      {
+         errno = 0;
+         return;
+      }
+
+      if (numbytes <= 0)
+      {
+         // A closed connection isn't a timeout
+         errno = 0;
+         flight_fail(flight, true);
+         return;
+      }
+   }
+
+   parser->buffer_end += (size_t)numbytes;
+
+   flight_parse(flight);
+}
+
+static void
+flight_parse(struct query_flight* flight)
+{
+   uint64_t now;
+   struct query_batch* batch = flight->batch;
+
+   while (!flight->done)
+   {
+      // Demultiplex on ReadyForQuery, the rest of the buffer belongs to the next query
+      if (parser_parse(&flight->parser))
+      {
+         flight_fail(flight, true);
+         return;
+      }
+
+      if (!flight->parser.ready)
+      {
+         return;
+      }
+
+      // The results arrive in order, so a query takes the time since the previous result
+      now = pgexporter_stats_now();
+      batch->requests[flight->current].duration = now - flight->last;
+      flight->last = now;
+
+      pipeline_result(batch->server, &flight->parser, &batch->requests[flight->current]);
+      flight->current++;
+
+      if (flight->current < batch->number_of_requests)
+      {
+         parser_reset(&flight->parser, &batch->requests[flight->current]);
+         flight->canceled = false;
+         flight->deadline = query_deadline(batch->requests[flight->current].timeout);
+      }
+      else
+      {
+         flight->done = true;
+      }
+   }
+}
+
+static void
+flight_fail(struct query_flight* flight, bool lost)
+{
+   if (lost && flight->fd != -1 && flight->fd == connections[flight->batch->server].fd)
+   {
+      connection_lost(flight->batch->server);
+   }
+
+   flight->done = true;
+   flight->failed = true;
+   flight->lost = lost;
+}
+
+static void
+flight_end(struct query_flight* flight)
+{
+   // The connection is blocking again unless it was closed
+   if (flight->batch != NULL && flight->blocking && flight->fd != -1 &&
+       flight->fd == connections[flight->batch->server].fd)
+   {
+      pgexporter_socket_nonblocking(flight->fd, false);
+   }
+
+   parser_destroy(&flight->parser);
+   free(flight->content);
+   flight->content = NULL;
+}
+
+static uint64_t
+query_deadline(int timeout)
+{
+   if (timeout <= 0)
+   {
+      return 0;
+   }
+
+   return pgexporter_stats_now() + (uint64_t)timeout * 1000000000ULL;
+}
+
+static int
+query_read(int server, uint64_t deadline, char* buffer, size_t size, size_t* length)
+{
+   int ret;
+   uint64_t now;
+   struct pollfd pfd;
+
+   // Data already decrypted by the TLS layer doesn't show up on the socket
+   if (deadline > 0 && (connection_ssl(server) == NULL || SSL_pending(connection_ssl(server)) == 0))
+   {
+      do
+      {
+         now = pgexporter_stats_now();
+         if (now >= deadline)
+         {
+            return MESSAGE_STATUS_ZERO;
+         }
+
+         pfd.fd = connection_fd(server);
+         pfd.events = POLLIN;
+         pfd.revents = 0;
+
+         ret = poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+      }
+      while (ret == 0 || (ret == -1 && errno == EINTR));
+
+      if (ret == -1)
+      {
+         errno = 0;
+         return MESSAGE_STATUS_ERROR;
+      }
+   }
+
+   ret = pgexporter_read_block_buffer(connection_ssl(server), connection_fd(server), buffer, size, length);
+
+   // A closed connection isn't a timeout
+   return ret == MESSAGE_STATUS_ZERO ? MESSAGE_STATUS_ERROR : ret;
+}
+
+static int
+query_timeout(int server, struct result_parser* parser, bool* canceled, uint64_t* deadline)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (*canceled)
+   {
+      // The state of the connection is unknown, so it can't be used anymore
+      pgexporter_log_error("No reply to the cancel request of %s on server '%s'",
+                           parser->tag, &config->servers[server].name);
+      if (current_lane != NULL)
+      {
+         close_lane(current_lane);
+      }
+      else
+      {
+         terminate_connection(server);
+      }
+      return 1;
+   }
+
+   pgexporter_log_warn("Canceling %s on server '%s' after its timeout", parser->tag, &config->servers[server].name);
+
+   if (current_lane != NULL ?
+       pgexporter_server_cancel(server, current_lane->backend_pid, current_lane->backend_secret) :
+       pgexporter_server_cancel(server, connections[server].backend_pid, connections[server].backend_secret))
+   {
+      pgexporter_log_error("Unable to cancel %s on server '%s'", parser->tag, &config->servers[server].name);
+      if (current_lane != NULL)
+      {
+         close_lane(current_lane);
+      }
+      else
+      {
+         terminate_connection(server);
+      }
+      return 1;
+   }
+
+   // The query fails even if its result arrives in the meantime, and the
+   // connection is usable again once the server is ready for the next query
+   parser->error = true;
+   *canceled = true;
+   *deadline = query_deadline(QUERY_CANCEL_TIMEOUT);
+
+   return 0;
+}
+
+static size_t
+write_close(char* content, char* name)
+{
+   size_t length = strlen(name);
+
+   if (content != NULL)
+   {
+      pgexporter_write_byte(content, 'C');
+      pgexporter_write_int32(content + 1, 4 + 1 + length + 1);
+      pgexporter_write_byte(content + 5, 'S');
+      pgexporter_write_string(content + 6, name);
+   }
+
+   return 1 + 4 + 1 + length + 1;
+}
+
+static size_t
+write_parse(char* content, char* name, char* query)
+{
+   size_t name_length = strlen(name);
+   size_t length = strlen(query);
+
+   if (content != NULL)
+   {
+      pgexporter_write_byte(content, 'P');
+      pgexporter_write_int32(content + 1, 4 + name_length + 1 + length + 1 + 2);
+      pgexporter_write_string(content + 5, name);
+      pgexporter_write_string(content + 5 + name_length + 1, query);
+   }
+
+   return 1 + 4 + name_length + 1 + length + 1 + 2;
+}
+
+static size_t
+write_bind(char* content, char* name, struct prepared_statement* statement)
+{
+   int formats = 0;
+   size_t name_length = strlen(name);
+   size_t offset;
+
+   // A format for each result column, as the binary ones are a subset
+   if (statement != NULL && statement->binary != 0)
+   {
+      formats = statement->number_of_columns;
+   }
+
+   if (content != NULL)
+   {
+      pgexporter_write_byte(content, 'B');
+      pgexporter_write_int32(content + 1, 4 + 1 + name_length + 1 + 2 + 2 + 2 + 2 * formats);
+      pgexporter_write_string(content + 6, name);
+
+      offset = 6 + name_length + 1 + 2 + 2;
+      pgexporter_write_int16(content + offset, formats);
+      offset += 2;
+
+      for (int i = 0; i < formats; i++)
+      {
+         if (i < MAX_NUMBER_OF_COLUMNS && (statement->binary & (1U << i)))
+         {
+            pgexporter_write_int16(content + offset, RESULT_FORMAT_BINARY);
+         }
+         offset += 2;
+      }
+   }
+
+   return 1 + 4 + 1 + name_length + 1 + 2 + 2 + 2 + 2 * formats;
+}
+
+static size_t
+write_execute(char* content)
+{
+   // Describe, Execute and Sync of the unnamed portal
+   if (content != NULL)
+   {
+      pgexporter_write_byte(content, 'D');
+      pgexporter_write_int32(content + 1, 4 + 1 + 1);
+      pgexporter_write_byte(content + 5, 'P');
+
+      pgexporter_write_byte(content + 7, 'E');
+      pgexporter_write_int32(content + 8, 4 + 1 + 4);
+
+      pgexporter_write_byte(content + 17, 'S');
+      pgexporter_write_int32(content + 18, 4);
+   }
+
+   return (1 + 4 + 1 + 1) + (1 + 4 + 1 + 4) + (1 + 4);
+}
+
+static void
+statement_name(int statement, int version, char* name, size_t size)
+{
+   snprintf(name, size, "pgexporter_%d_%d", statement, version);
+}
+
+static void
+parser_init(struct result_parser* parser, int server, size_t size)
+{
+   memset(parser, 0, sizeof(struct result_parser));
+
+   parser->server = server;
+
+   // Sized for the last result, such that it takes few reads and no growing
+   if (size > 0)
+   {
+      parser->buffer_size = MIN(MAX(size + size / 4, READ_BUFFER_MIN_SIZE), READ_BUFFER_MAX_SIZE);
+   }
+   else
+   {
+      parser->buffer_size = DEFAULT_BUFFER_SIZE;
+   }
+}
+
+static void
+parser_reset(struct result_parser* parser, struct query_request* request)
+{
+   pgexporter_free_query(parser->query);
+
+   parser->tag = request->tag;
+   parser->columns = request->columns;
+   parser->names = request->names;
+   parser->columnar = request->columnar;
+   parser->row = request->columnar ? append_columns : append_tuple;
+   parser->limit = request->limit;
+   parser->live = 0;
+   parser->number_of_columns = 0;
+   parser->binary = 0;
+   parser->rows = 0;
+   parser->bytes = 0;
+   parser->fingerprint = 14695981039346656037ULL;
+   memset(&parser->formats[0], 0, sizeof(parser->formats));
+   parser->query = NULL;
+   parser->last = NULL;
+   parser->error = false;
+   parser->ready = false;
+}
+
+static int
+parser_parse(struct result_parser* parser)
+{
+   size_t length;
+   char* data = parser->buffer + parser->buffer_start;
+   size_t size = parser->buffer_end - parser->buffer_start;
+   size_t offset = 0;
+
+   // Complete messages are parsed in place
+   while (!parser->ready && size - offset >= 5)
+   {
+      length = 1 + (size_t)(uint32_t)pgexporter_read_int32(data + offset + 1);
+
+      if (size - offset < length)
+      {
+         break;
+      }
+
+      if (parser_message(parser, data + offset, length))
+      {
+         return 1;
+      }
+
+      offset += length;
+   }
+
+   parser->buffer_start += offset;
+
+   return 0;
+}
+
+static int
+parser_read(struct result_parser* parser, uint64_t deadline)
+{
+   int status;
+   size_t length;
+
+   if (parser_space(parser))
+   {
+      return MESSAGE_STATUS_ERROR;
+   }
+
+   status = query_read(parser->server, deadline, parser->buffer + parser->buffer_end,
+                       parser->buffer_size - parser->buffer_end, &length);
+
+   if (status == MESSAGE_STATUS_OK)
+   {
+      parser->buffer_end += length;
+   }
+
+   return status;
+}
+
+static int
+parser_space(struct result_parser* parser)
+{
+   size_t length;
+   size_t need;
+   size_t size;
+   char* buffer = NULL;
+
+   length = parser->buffer_end - parser->buffer_start;
+
+   // Only the start of a message split between reads is moved
+   if (parser->buffer_start > 0)
+   {
+      memmove(parser->buffer, parser->buffer + parser->buffer_start, length);
+      parser->buffer_start = 0;
+      parser->buffer_end = length;
+   }
+
+   // Room for the rest of the message, and then some
+   need = length >= 5 ? 1 + (size_t)(uint32_t)pgexporter_read_int32(parser->buffer + 1) : 5;
+   need = MAX(need, length + READ_BUFFER_MIN_SIZE);
+
+   if (parser->buffer == NULL || need > parser->buffer_size)
+   {
+      size = parser->buffer_size;
+
+      while (size < need)
+      {
+         size *= 2;
+      }
+
+      buffer = realloc(parser->buffer, size);
+      if (buffer == NULL)
+      {
+         pgexporter_log_error("Out of memory for the result of server %d", parser->server);
+         return 1;
+      }
+
+      parser->buffer = buffer;
+      parser->buffer_size = size;
+   }
+
+   return 0;
+}
+
+static int
+parser_message(struct result_parser* parser, char* data, size_t length)
+{
+   int cols;
+   char* name = NULL;
+   struct message msg;
+
+   if (length < 5)
+   {
+      pgexporter_log_error("Invalid message from server %d", parser->server);
+      return 1;
+   }
+
+   memset(&msg, 0, sizeof(struct message));
+   msg.kind = (signed char)pgexporter_read_byte(data);
+   msg.length = length;
+   msg.data = data;
+
+   parser->bytes += length;
+
+   switch (msg.kind)
+   {
+      case 'T':
+         if (parser->query != NULL)
+         {
+            break;
+         }
+
+         cols = parser->columns > 0 ? parser->columns : get_number_of_columns(&msg);
+
+         if (read_row_description(parser, &msg))
+         {
+            // The same as a failed query
+            parser->error = true;
+         }
+
+         parser->query = (struct query*)pgexporter_memory_alloc(MEMORY_QUERY, sizeof(struct query));
+         if (parser->query == NULL)
+         {
+            return 1;
+         }
+         memset(parser->query, 0, sizeof(struct query));
+
+         if (parser->columnar)
+         {
+            parser->query->columns = (struct columns*)pgexporter_memory_calloc(MEMORY_QUERY, 1, sizeof(struct columns));
+            if (parser->query->columns == NULL ||
+                pgexporter_builder_init(&parser->query->columns->payload, 8192))
+            {
+               pgexporter_memory_release(MEMORY_QUERY, parser->query->columns);
+               pgexporter_memory_release(MEMORY_QUERY, parser->query);
+               parser->query = NULL;
+               return 1;
+            }
+         }
+         else
+         {
+            // The tuples of a query are released together, so they share an arena
+            if (pgexporter_arena_create(0, &parser->query->arena))
+            {
+               pgexporter_memory_release(MEMORY_QUERY, parser->query);
+               parser->query = NULL;
+               return 1;
+            }
+         }
+
+         parser->query->number_of_columns = cols;
+         memcpy(&parser->query->tag[0], parser->tag, strlen(parser->tag));
+
+         for (int i = 0; i < cols; i++)
+         {
+            if (parser->names != NULL)
+            {
+               memcpy(&parser->query->names[i][0], parser->names[i], strlen(parser->names[i]));
+            }
+            else
+            {
+               if (get_column_name(&msg, i, &name))
+               {
+                  // The same as a failed query
+                  parser->error = true;
+                  break;
+               }
+
+               memcpy(&parser->query->names[i][0], name, strlen(name));
+
+               free(name);
+               name = NULL;
+            }
+         }
+         break;
+      case 'D':
+         if (parser->query != NULL && !parser->error)
+         {
+            parser->rows++;
+
+            // A result is the same as the previous one when the rows are, whatever is kept of them
+            for (size_t i = 0; i < length; i++)
+            {
+               parser->fingerprint ^= (unsigned char)data[i];
+               parser->fingerprint *= 1099511628211ULL;
+            }
+
+            return parser->row(parser, &msg);
+         }
+         break;
+      case 'E':
+         parser->error = true;
+         break;
+      case 'Z':
+         parser->ready = true;
+         break;
+      default:
+         break;
+   }
+
+   return 0;
+}
+
+static int
+parser_result(struct result_parser* parser, struct query** query)
+{
+   *query = NULL;
+
+   if (parser->error || parser->query == NULL)
+   {
+      pgexporter_free_query(parser->query);
+      parser->query = NULL;
+      parser->last = NULL;
+      return 1;
+   }
+
+   *query = parser->query;
+   (*query)->number_of_rows = parser->rows;
+   (*query)->bytes = parser->bytes;
+   (*query)->fingerprint = parser->fingerprint;
+
+   parser->query = NULL;
+   parser->last = NULL;
+
+   return 0;
+}
+
+static void
+parser_destroy(struct result_parser* parser)
+{
+   pgexporter_free_query(parser->query);
+   free(parser->buffer);
+   free(parser->heap);
+   free(parser->ranks);
+   pgexporter_builder_destroy(&parser->scratch);
+
+   memset(parser, 0, sizeof(struct result_parser));
+}
+
+static int
+append_tuple(struct result_parser* parser, struct message* msg)
+{
+   struct tuple* dtuple = NULL;
+
+   if (create_D_tuple(parser, msg, &dtuple))
+   {
+      return 1;
+   }
+
+   if (parser->last == NULL)
+   {
+      parser->query->tuples = dtuple;
+   }
+   else
+   {
+      parser->last->next = dtuple;
+   }
+
+   parser->last = dtuple;
+
+   return 0;
+}
+
+static int
+append_columns(struct result_parser* parser, struct message* msg)
+{
+   int offset;
+   int length;
+   int row;
+   int capacity;
+   int number_of_columns = parser->query->number_of_columns;
+   struct columns* columns = parser->query->columns;
+
+   // With a limit the rows stop at max_rows, and a row after that takes the next
+   // slot until it is known if it is kept
+   row = columns->number_of_rows;
+
+   if (row == columns->capacity)
+   {
+      capacity = columns->capacity > 0 ? columns->capacity * 2 : 64;
+
+      for (int i = 0; i < number_of_columns; i++)
+      {
+         size_t* offsets = NULL;
+         uint8_t* nulls = NULL;
+
+         offsets = (size_t*)pgexporter_memory_realloc(MEMORY_QUERY, columns->offsets[i], capacity * sizeof(size_t));
+         if (offsets == NULL)
+         {
+            return 1;
+         }
+         columns->offsets[i] = offsets;
+
+         nulls = (uint8_t*)pgexporter_memory_realloc(MEMORY_QUERY, columns->nulls[i], capacity / 8);
+         if (nulls == NULL)
+         {
+            return 1;
+         }
+         memset(nulls + columns->capacity / 8, 0, (capacity - columns->capacity) / 8);
+         columns->nulls[i] = nulls;
+      }
+
+      columns->capacity = capacity;
+   }
+
+   offset = 7;
+
+   for (int i = 0; i < number_of_columns; i++)
+   {
+      length = pgexporter_read_int32(msg->data + offset);
+      offset += 4;
+
+      columns->offsets[i][row] = columns->payload.length;
+      columns->nulls[i][row / 8] &= ~(1 << (row % 8));
+
+      if (length > 0)
+      {
+         if (i < MAX_NUMBER_OF_COLUMNS && parser->formats[i] == RESULT_FORMAT_BINARY)
+         {
+            if (read_value(parser, i, msg->data + offset, length) ||
+                pgexporter_builder_append_length(&columns->payload, parser->scratch.data, parser->scratch.length))
+            {
+               return 1;
+            }
+         }
+         else if (pgexporter_builder_append_length(&columns->payload, msg->data + offset, length))
+         {
+            return 1;
+         }
+         offset += length;
+      }
+      else
+      {
+         columns->nulls[i][row / 8] |= 1 << (row % 8);
+      }
+
+      if (pgexporter_builder_append_char(&columns->payload, '\0'))
+      {
+         return 1;
+      }
+   }
+
+   // The payload grows in place, so only the change of its size is accounted
+   if (columns->payload.capacity != columns->accounted)
+   {
+      pgexporter_memory_account(MEMORY_QUERY, (int64_t)columns->payload.capacity - (int64_t)columns->accounted, 0);
+      columns->accounted = columns->payload.capacity;
+   }
+
+   if (parser->limit.max_rows > 0 && number_of_columns > 0)
+   {
+      return limit_row(parser, row);
+   }
+
+   columns->number_of_rows++;
+
+   return 0;
+}
+
+static int
+limit_row(struct result_parser* parser, int row)
+{
+   int evicted;
+   int* heap = NULL;
+   double* ranks = NULL;
+   double value;
+   size_t start;
+   int number_of_columns = parser->query->number_of_columns;
+   struct columns* columns = parser->query->columns;
+   struct row_limit* limit = &parser->limit;
+
+   start = columns->offsets[0][row];
+   value = limit_value(columns, limit->column, row);
+
+   if (columns->number_of_rows < limit->max_rows)
+   {
+      if (limit->top)
+      {
+         if (parser->heap_capacity < limit->max_rows)
+         {
+            heap = (int*)realloc(parser->heap, limit->max_rows * sizeof(int));
+            if (heap == NULL)
+            {
+               return 1;
+            }
+            parser->heap = heap;
+
+            ranks = (double*)realloc(parser->ranks, limit->max_rows * sizeof(double));
+            if (ranks == NULL)
+            {
+               return 1;
+            }
+            parser->ranks = ranks;
+
+            parser->heap_capacity = limit->max_rows;
+         }
+
+         parser->heap[row] = row;
+         parser->ranks[row] = value;
+         limit_sift_up(parser, row);
+      }
+
+      parser->live += columns->payload.length - start;
+      columns->number_of_rows++;
+
+      return 0;
+   }
+
+   columns->omitted++;
+
+   if (!limit->top || value <= parser->ranks[parser->heap[0]])
+   {
+      // The row is left out, and its values are the last ones of the payload
+      if (isfinite(value))
+      {
+         columns->other += value;
+      }
+      columns->payload.length = start;
+
+      return 0;
+   }
+
+   // The row takes the place of the row with the smallest value
+   evicted = parser->heap[0];
+
+   if (isfinite(parser->ranks[evicted]))
+   {
+      columns->other += parser->ranks[evicted];
+   }
+
+   parser->live -= limit_row_size(columns, number_of_columns, evicted);
+   parser->live += columns->payload.length - start;
+
+   for (int i = 0; i < number_of_columns; i++)
+   {
+      columns->offsets[i][evicted] = columns->offsets[i][row];
+
+      if (columns->nulls[i][row / 8] & (1 << (row % 8)))
+      {
+         columns->nulls[i][evicted / 8] |= 1 << (evicted % 8);
+      }
+      else
+      {
+         columns->nulls[i][evicted / 8] &= ~(1 << (evicted % 8));
+      }
+   }
+
+   parser->ranks[evicted] = value;
+   limit_sift_down(parser, 0);
+
+   // The values of the evicted rows stay in the payload, until they take up most of it
+   if (columns->payload.length > 2 * parser->live + READ_BUFFER_MIN_SIZE)
+   {
+      return limit_compact(parser);
+   }
+
+   return 0;
+}
+
+static double
+limit_value(struct columns* columns, int column, int row)
+{
+   double value;
+
+   if (column < 0 || column >= MAX_NUMBER_OF_COLUMNS || columns->offsets[column] == NULL ||
+       (columns->nulls[column][row / 8] & (1 << (row % 8))))
+   {
+      // A missing value ranks below all others
+      return -HUGE_VAL;
+   }
+
+   value = strtod(columns->payload.data + columns->offsets[column][row], NULL);
+
+   return isnan(value) ? -HUGE_VAL : value;
+}
+
+static size_t
+limit_row_size(struct columns* columns, int number_of_columns, int row)
+{
+   size_t start = columns->offsets[0][row];
+   size_t last = columns->offsets[number_of_columns - 1][row];
+
+   // The values of a row are next to each other in the payload
+   return last - start + strlen(columns->payload.data + last) + 1;
+}
+
+static int
+limit_compact(struct result_parser* parser)
+{
+   size_t start;
+   size_t size;
+   struct builder payload;
+   int number_of_columns = parser->query->number_of_columns;
+   struct columns* columns = parser->query->columns;
+
+   if (pgexporter_builder_init(&payload, parser->live + READ_BUFFER_MIN_SIZE))
+   {
+      return 1;
+   }
+
+   for (int row = 0; row < columns->number_of_rows; row++)
+   {
+      start = columns->offsets[0][row];
+      size = limit_row_size(columns, number_of_columns, row);
+
+      for (int i = 0; i < number_of_columns; i++)
+      {
+         columns->offsets[i][row] = payload.length + (columns->offsets[i][row] - start);
+      }
+
+      if (pgexporter_builder_append_length(&payload, columns->payload.data + start, size))
+      {
+         pgexporter_builder_destroy(&payload);
+         return 1;
+      }
+   }
+
+   pgexporter_builder_destroy(&columns->payload);
+   columns->payload = payload;
+
+   pgexporter_memory_account(MEMORY_QUERY, (int64_t)payload.capacity - (int64_t)columns->accounted, 0);
+   columns->accounted = payload.capacity;
+
+   return 0;
+}
+
+static void
+limit_sift_up(struct result_parser* parser, int i)
+{
+   int parent;
+   int row;
+
+   while (i > 0)
+   {
+      parent = (i - 1) / 2;
+
+      if (parser->ranks[parser->heap[parent]] <= parser->ranks[parser->heap[i]])
+      {
+         break;
+      }
+
+      row = parser->heap[parent];
+      parser->heap[parent] = parser->heap[i];
+      parser->heap[i] = row;
+      i = parent;
+   }
+}
+
+static void
+limit_sift_down(struct result_parser* parser, int i)
+{
+   int smallest;
+   int row;
+   int n = parser->query->columns->number_of_rows;
+
+   while (true)
+   {
+      smallest = i;
+
+      if (2 * i + 1 < n && parser->ranks[parser->heap[2 * i + 1]] < parser->ranks[parser->heap[smallest]])
+      {
+         smallest = 2 * i + 1;
+      }
+
+      if (2 * i + 2 < n && parser->ranks[parser->heap[2 * i + 2]] < parser->ranks[parser->heap[smallest]])
+      {
+         smallest = 2 * i + 2;
+      }
+
+      if (smallest == i)
+      {
+         break;
+      }
+
+      row = parser->heap[smallest];
+      parser->heap[smallest] = parser->heap[i];
+      parser->heap[i] = row;
+      i = smallest;
+   }
+}
+
+static void
+free_columns(struct columns* columns, int number_of_columns)
+{
+   if (columns == NULL)
+   {
+      return;
+   }
+
+   for (int i = 0; i < number_of_columns; i++)
+   {
+      pgexporter_memory_release(MEMORY_QUERY, columns->offsets[i]);
+      pgexporter_memory_release(MEMORY_QUERY, columns->nulls[i]);
+   }
+
+   pgexporter_memory_account(MEMORY_QUERY, -(int64_t)columns->accounted, 0);
+   pgexporter_builder_destroy(&columns->payload);
+   pgexporter_memory_release(MEMORY_QUERY, columns);
+}
+
+static int
+create_D_tuple(struct result_parser* parser, struct message* msg, struct tuple** tuple)
+{
+   int offset;
+   int length;
+   int number_of_columns = parser->query->number_of_columns;
+   struct arena* arena = parser->query->arena;
+   struct tuple* result = NULL;
+
+   *tuple = NULL;
+
+   result = (struct tuple*)pgexporter_arena_alloc(arena, sizeof(struct tuple), _Alignof(struct tuple));
+   if (result == NULL)
+   {
+      return 1;
+   }
+
+   result->server = parser->server;
+   result->data = (char**)pgexporter_arena_alloc(arena, number_of_columns * sizeof(char*), _Alignof(char*));
+   result->next = NULL;
+
+   if (number_of_columns > 0 && result->data == NULL)
+   {
+      return 1;
+   }
+
+   offset = 7;
+
+   for (int i = 0; i < number_of_columns; i++)
+   {
+      length = pgexporter_read_int32(msg->data + offset);
+      offset += 4;
+
+      if (length > 0)
+      {
+         if (i < MAX_NUMBER_OF_COLUMNS && parser->formats[i] == RESULT_FORMAT_BINARY)
+         {
+            if (read_value(parser, i, msg->data + offset, length))
+            {
+               return 1;
+            }
+            result->data[i] = pgexporter_arena_strndup(arena, parser->scratch.data, parser->scratch.length);
+         }
+         else
+         {
+            result->data[i] = pgexporter_arena_strndup(arena, msg->data + offset, length);
+         }
+
+         if (result->data[i] == NULL)
+         {
+            return 1;
+         }
+         offset += length;
+      }
+      else
+      {
+         result->data[i] = NULL;
+      }
+   }
+
+   *tuple = result;
+
+   return 0;
+}
+
+static int
+read_value(struct result_parser* parser, int column, char* data, int length)
+{
+   int n;
+   double d;
+   char buffer[32];
+   struct builder* builder = &parser->scratch;
+
+   if (pgexporter_builder_reserve(builder, 32))
+   {
+      return 1;
+   }
+
+   builder->length = 0;
+   builder->data[0] = '\0';
+
+   switch (parser->types[column])
+   {
+      case INT2OID:
+         return length != 2 || pgexporter_builder_append_int(builder, pgexporter_read_int16(data));
+      case INT4OID:
+         return length != 4 || pgexporter_builder_append_int(builder, pgexporter_read_int32(data));
+      case INT8OID:
+         return length != 8 || pgexporter_builder_append_int(builder, pgexporter_read_int64(data));
+      case OIDOID:
+         return length != 4 || pgexporter_builder_append_ulong(builder, pgexporter_read_uint32(data));
+      case FLOAT4OID:
+      case FLOAT8OID:
+         if (parser->types[column] == FLOAT4OID)
+         {
+            uint32_t bits;
+            float f;
+
+            if (length != 4)
+            {
+               return 1;
+            }
+            bits = pgexporter_read_uint32(data);
+            memcpy(&f, &bits, sizeof(f));
+            d = f;
+         }
+         else
+         {
+            int64_t bits;
+
+            if (length != 8)
+            {
+               return 1;
+            }
+            bits = pgexporter_read_int64(data);
+            memcpy(&d, &bits, sizeof(d));
+         }
+
+         if (isnan(d))
+         {
+            return pgexporter_builder_append(builder, "NaN");
+         }
 
-      if (status == MESSAGE_STATUS_OK)
-      {
-         data = data_append(data, data_size, msg->data, msg->length);
-         data_size += msg->length;
+         if (isinf(d))
+         {
+            return pgexporter_builder_append(builder, d > 0 ? "Infinity" : "-Infinity");
+         }
 
-         if (pgexporter_has_message('Z', data, data_size))
+         if (d == (double)(int64_t)d && d > -1e15 && d < 1e15)
          {
-            cont = false;
+            return pgexporter_builder_append_int(builder, (int64_t)d);
          }
-      }
-      else
-      {
-         goto error;
-      }
 
-      pgexporter_clear_message();
-      msg = NULL;
-   }
+         // The shortest of the two precisions that reads back as the same value
+         n = snprintf(&buffer[0], sizeof(buffer), "%.15g", d);
+         if (strtod(&buffer[0], NULL) != d)
+         {
+            n = snprintf(&buffer[0], sizeof(buffer), "%.17g", d);
+         }
 
-   if (pgexporter_has_message('E', data, data_size))
-   {
-      goto error;
+         return pgexporter_builder_append_length(builder, &buffer[0], n);
+      case NUMERICOID:
+         return read_numeric(builder, data, length);
+      default:
+         break;
    }
 
-   if (pgexporter_extract_message_from_data('T', data, data_size, &tmsg))
+   return 1;
+}
+
+static int
+read_numeric(struct builder* builder, char* data, int length)
+{
+   int16_t ndigits;
+   int16_t weight;
+   int16_t dscale;
+   uint16_t sign;
+   int digit;
+   char digits[4];
+
+   if (length < 8)
    {
-      goto error;
+      return 1;
    }
 
-   if (columns <= 0)
+   ndigits = pgexporter_read_int16(data);
+   weight = pgexporter_read_int16(data + 2);
+   sign = (uint16_t)pgexporter_read_int16(data + 4);
+   dscale = pgexporter_read_int16(data + 6);
+
+   if (ndigits < 0 || length < 8 + 2 * ndigits)
    {
-      cols = get_number_of_columns(tmsg);
+      return 1;
    }
-   else
+
+   switch (sign)
    {
-      cols = columns;
+      case 0xC000:
+         return pgexporter_builder_append(builder, "NaN");
+      case 0xD000:
+         return pgexporter_builder_append(builder, "Infinity");
+      case 0xF000:
+         return pgexporter_builder_append(builder, "-Infinity");
+      case 0x4000:
+         if (pgexporter_builder_append_char(builder, '-'))
+         {
+            return 1;
+         }
+         break;
+      default:
+         break;
    }
 
-   q = (struct query*)malloc(sizeof(struct query));
-   memset(q, 0, sizeof(struct query));
-
-   q->number_of_columns = cols;
-   memcpy(&q->tag[0], tag, strlen(tag));
-
-   for (int i = 0; i < cols; i++)
+   // Each digit holds four decimal digits
+   if (weight < 0)
    {
-      if (names != NULL)
+      if (pgexporter_builder_append_char(builder, '0'))
       {
-         memcpy(&q->names[i][0], names[i], strlen(names[i]));
+         return 1;
       }
-      else
+   }
+
+   for (int i = 0; i <= weight; i++)
+   {
+      digit = i < ndigits ? pgexporter_read_int16(data + 8 + 2 * i) : 0;
+
+      if (i == 0)
       {
-         if (get_column_name(tmsg, i, &name))
+         if (pgexporter_builder_append_int(builder, digit))
          {
-            goto error;
+            return 1;
          }
+         continue;
+      }
 
-         memcpy(&q->names[i][0], name, strlen(name));
+      digits[0] = '0' + digit / 1000;
+      digits[1] = '0' + digit / 100 % 10;
+      digits[2] = '0' + digit / 10 % 10;
+      digits[3] = '0' + digit % 10;
 
-         free(name);
-         name = NULL;
+      if (pgexporter_builder_append_length(builder, &digits[0], 4))
+      {
+         return 1;
       }
    }
 
-   while (offset < data_size)
+   if (dscale > 0)
    {
-      offset = pgexporter_extract_message_offset(offset, data, &msg);
+      if (pgexporter_builder_append_char(builder, '.'))
+      {
+         return 1;
+      }
 
-      if (msg != NULL && msg->kind == 'D')
+      for (int i = weight + 1, scale = 0; scale < dscale; i++, scale += 4)
       {
-         struct tuple* dtuple = NULL;
+         digit = i >= 0 && i < ndigits ? pgexporter_read_int16(data + 8 + 2 * i) : 0;
 
-         create_D_tuple(server, cols, msg, &dtuple);
+         digits[0] = '0' + digit / 1000;
+         digits[1] = '0' + digit / 100 % 10;
+         digits[2] = '0' + digit / 10 % 10;
+         digits[3] = '0' + digit % 10;
 
-         if (q->tuples == NULL)
-         {
-            q->tuples = dtuple;
-         }
-         else
+         if (pgexporter_builder_append_length(builder, &digits[0], MIN(4, dscale - scale)))
          {
-            current->next = dtuple;
+            return 1;
          }
-
-         current = dtuple;
       }
-
-      pgexporter_free_message(msg);
-      msg = NULL;
    }
 
-   *query = q;
-
-   pgexporter_free_message(tmsg);
-
-   free(content);
-   free(data);
-
    return 0;
-
-error:
-
-   pgexporter_clear_message();
-   pgexporter_free_message(tmsg);
-   free(content);
-   free(data);
-
-   return 1;
-}
-
-static void*
-data_append(void* orig, size_t orig_size, void* n, size_t n_size)
-{
-   void* d = NULL;
-
-   if (n != NULL)
-   {
-      d = realloc(orig, orig_size + n_size);
-      memcpy(d + orig_size, n, n_size);
-   }
-
-   return d;
 }
 
 static int
-create_D_tuple(int server, int number_of_columns, struct message* msg, struct tuple** tuple)
+read_row_description(struct result_parser* parser, struct message* msg)
 {
    int offset;
-   int length;
-   struct tuple* result = NULL;
-
-   result = (struct tuple*)malloc(sizeof(struct tuple));
-   memset(result, 0, sizeof(struct tuple));
-
-   result->server = server;
-   result->data = (char**)malloc(number_of_columns * sizeof(char*));
-   result->next = NULL;
+   int16_t cols;
+   int32_t type;
+   int16_t format;
+   char* name = NULL;
 
+   cols = pgexporter_read_int16(msg->data + 5);
    offset = 7;
 
-   for (int i = 0; i < number_of_columns; i++)
+   parser->number_of_columns = cols;
+   parser->binary = 0;
+
+   for (int i = 0; i < cols; i++)
    {
-      length = pgexporter_read_int32(msg->data + offset);
-      offset += 4;
+      name = pgexporter_read_string(msg->data + offset);
+      offset += strlen(name) + 1;
 
-      if (length > 0)
+      if (offset + 18 > msg->length)
       {
-         result->data[i] = (char*)malloc(length + 1);
-         memset(result->data[i], 0, length + 1);
-         memcpy(result->data[i], msg->data + offset, length);
-         offset += length;
+         return 1;
       }
-      else
+
+      type = pgexporter_read_int32(msg->data + offset + 6);
+      format = pgexporter_read_int16(msg->data + offset + 16);
+      offset += 18;
+
+      if (i < MAX_NUMBER_OF_COLUMNS)
       {
-         result->data[i] = NULL;
+         parser->types[i] = type;
+         parser->formats[i] = format;
+
+         switch (type)
+         {
+            case INT2OID:
+            case INT4OID:
+            case INT8OID:
+            case OIDOID:
+            case FLOAT4OID:
+            case FLOAT8OID:
+            case NUMERICOID:
+               parser->binary |= 1U << i;
+               break;
+            default:
+               break;
+         }
       }
    }
 
-   *tuple = result;
-
    return 0;
 }
 
@@ -867,8 +3271,8 @@ process_server_parameters(int server, struct deque* server_parameters)
 
    config = (struct configuration*)shmem;
 
-   config->servers[server].version = 0;
-   config->servers[server].minor_version = 0;
+   config->server_states[server].version = 0;
+   config->server_states[server].minor_version = 0;
 
    pgexporter_deque_iterator_create(server_parameters, &iter);
    while (pgexporter_deque_iterator_next(iter))
@@ -879,8 +3283,8 @@ process_server_parameters(int server, struct deque* server_parameters)
          char* server_version = pgexporter_value_to_string(iter->value, FORMAT_TEXT, NULL, 0);
          if (sscanf(server_version, "%d.%d", &major, &minor) == 2)
          {
-            config->servers[server].version = major;
-            config->servers[server].minor_version = minor;
+            config->server_states[server].version = major;
+            config->server_states[server].minor_version = minor;
          }
          else
          {
@@ -961,4 +3365,315 @@ pgexporter_detect_extensions(int server)
 
    pgexporter_free_query(query);
    return 0;
-}
\ No newline at end of file
+}
+
+static bool
+lease_connection(int server)
+{
+   int dt;
+   time_t start_time;
+   int free_state;
+   int holder;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   start_time = time(NULL);
+
+retry:
+   free_state = STATE_FREE;
+   if (atomic_compare_exchange_strong(&config->server_states[server].lease, &free_state, (int)getpid()))
+   {
+      return true;
+   }
+
+   /* A process that died with the lease doesn't release it */
+   holder = free_state;
+   if (kill(holder, 0) == -1 && errno == ESRCH)
+   {
+      errno = 0;
+
+      if (atomic_compare_exchange_strong(&config->server_states[server].lease, &holder, (int)getpid()))
+      {
+         pgexporter_log_warn("Connection to server '%s' taken over from process %d", &config->servers[server].name, free_state);
+
+         /* The process may have left a query in flight on the lent connection */
+         if (!private_pool)
+         {
+            pgexporter_disconnect(pool[server]);
+            pool[server] = -1;
+         }
+
+         return true;
+      }
+   }
+
+   dt = (int)difftime(time(NULL), start_time);
+   if (dt >= (config->blocking_timeout > 0 ? config->blocking_timeout : 30))
+   {
+      return false;
+   }
+
+   /* Sleep for 10ms */
+   SLEEP_AND_GOTO(10000000L, retry);
+}
+
+static SSL*
+connection_ssl(int server)
+{
+   return current_lane != NULL ? current_lane->ssl : connections[server].ssl;
+}
+
+static int
+connection_fd(int server)
+{
+   return current_lane != NULL ? current_lane->fd : connections[server].fd;
+}
+
+/**
+ * Get the prepared statement of a metric on the pooled connection of a server.
+ * The statements of a connection lent by the main process are shared with the
+ * processes it is lent to, and the ones of a connection of its own are kept here
+ * @param server The server
+ * @param metric The metric
+ * @return The prepared statement, or NULL if the query isn't prepared
+ */
+static struct prepared_statement*
+connection_prepared(int server, int metric)
+{
+   struct catalog* catalog = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   // The statements are only prepared on the pooled connection
+   if (current_lane != NULL)
+   {
+      return NULL;
+   }
+
+   if (!private_pool)
+   {
+      return pgexporter_catalog_prepared(config, server, metric);
+   }
+
+   catalog = pgexporter_catalog_get(config);
+
+   if (catalog == NULL || metric < 0 || metric >= catalog->number_of_metrics)
+   {
+      return NULL;
+   }
+
+   if (prepared_catalog[server] != catalog)
+   {
+      forget_prepared(server);
+
+      prepared[server] = (struct prepared_statement*)calloc(catalog->number_of_metrics, sizeof(struct prepared_statement));
+      if (prepared[server] == NULL)
+      {
+         return NULL;
+      }
+
+      for (int i = 0; i < catalog->number_of_metrics; i++)
+      {
+         prepared[server][i].version = -1;
+      }
+      prepared_catalog[server] = catalog;
+   }
+
+   return &prepared[server][metric];
+}
+
+static void
+forget_prepared(int server)
+{
+   free(prepared[server]);
+   prepared[server] = NULL;
+   prepared_catalog[server] = NULL;
+}
+
+static void
+close_lane(struct query_lane* l)
+{
+   pgexporter_write_terminate(l->ssl, l->fd);
+   if (l->ssl != NULL)
+   {
+      pgexporter_close_ssl(l->ssl);
+   }
+   else
+   {
+      pgexporter_disconnect(l->fd);
+   }
+   l->ssl = NULL;
+   l->fd = -1;
+   l->backend_pid = 0;
+   l->backend_secret = 0;
+}
+
+static int
+open_lane(int server, char* database, struct query_lane* l)
+{
+   int user = -1;
+   int ret;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   for (int usr = 0; user == -1 && usr < config->number_of_users; usr++)
+   {
+      if (!strcmp(&config->users[usr].username[0], &config->servers[server].username[0]))
+      {
+         user = usr;
+      }
+   }
+
+   if (user == -1)
+   {
+      return 1;
+   }
+
+   pthread_mutex_lock(&authenticate_lock);
+
+   ret = pgexporter_server_authenticate(server, database,
+                                        &config->users[user].username[0], &config->users[user].password[0],
+                                        &l->ssl, &l->fd);
+
+   if (ret == AUTH_SUCCESS && pgexporter_extract_backend_key_data(&l->backend_pid, &l->backend_secret))
+   {
+      pgexporter_log_debug("No backend key data for a connection to server '%s'", &config->servers[server].name);
+   }
+
+   pthread_mutex_unlock(&authenticate_lock);
+
+   if (ret != AUTH_SUCCESS)
+   {
+      l->ssl = NULL;
+      l->fd = -1;
+      return 1;
+   }
+
+   return 0;
+}
+
+static void
+terminate_connection(int server)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   close_lane(&connections[server]);
+   config->server_states[server].new = false;
+   config->server_states[server].connected = false;
+   config->server_states[server].state = SERVER_UNKNOWN;
+   config->server_states[server].role_checked = 0;
+}
+
+static int
+connect_server(int server)
+{
+   int ret;
+   int user = -1;
+   struct deque* server_parameters = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   for (int usr = 0; user == -1 && usr < config->number_of_users; usr++)
+   {
+      if (!strcmp(&config->users[usr].username[0], &config->servers[server].username[0]))
+      {
+         user = usr;
+      }
+   }
+
+   ret = pgexporter_server_authenticate(server, "postgres",
+                                        &config->users[user].username[0], &config->users[user].password[0],
+                                        &connections[server].ssl,
+                                        &connections[server].fd);
+   if (ret != AUTH_SUCCESS)
+   {
+      connections[server].ssl = NULL;
+      connections[server].fd = -1;
+      pgexporter_log_error("Failed login for '%s' on server '%s'", &config->users[user].username, &config->servers[server].name);
+      return 1;
+   }
+
+   config->server_states[server].new = true;
+   config->server_states[server].connected = true;
+   pgexporter_server_info(server, connections[server].ssl, connections[server].fd);
+   /* Nothing is prepared on a new connection */
+   if (private_pool)
+   {
+      forget_prepared(server);
+   }
+   else
+   {
+      config->servers[server].prepared_generation = 0;
+   }
+   if (pgexporter_extract_backend_key_data(&connections[server].backend_pid,
+                                           &connections[server].backend_secret))
+   {
+      pgexporter_log_debug("No backend key data for server '%s', so queries can't be canceled",
+                           &config->servers[server].name);
+   }
+   /* The connection may be lent to another process by the main process */
+   if (!private_pool)
+   {
+      config->servers[server].backend_pid = connections[server].backend_pid;
+      config->servers[server].backend_secret = connections[server].backend_secret;
+   }
+   if (!pgexporter_extract_server_parameters(&server_parameters))
+   {
+      process_server_parameters(server, server_parameters);
+      pgexporter_deque_destroy(server_parameters);
+   }
+   pgexporter_detect_extensions(server);
+
+   return 0;
+}
+
+static void
+connection_lost(int server)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (current_lane != NULL)
+   {
+      close_lane(current_lane);
+      return;
+   }
+
+   pgexporter_log_debug("Lost the connection to server '%s'", &config->servers[server].name);
+
+   if (pool[server] == connections[server].fd)
+   {
+      pool[server] = -1;
+   }
+
+   terminate_connection(server);
+}
+
+static bool
+reconnect(int server)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   // Only a lost pooled connection is made again, and only once, such that
+   // a server that is down costs a single attempt
+   if (current_lane != NULL || !leased[server] || reconnected[server] ||
+       connections[server].fd != -1)
+   {
+      return false;
+   }
+
+   reconnected[server] = true;
+
+   pgexporter_log_debug("Reconnecting to server '%s'", &config->servers[server].name);
+
+   return connect_server(server) == 0;
+}
@@ -28,147 +28,124 @@
 
 #include <pgexporter.h>
 #include <query_alts.h>
-#include <shmem.h>
+
+#define NODE(pool, offset) ((offset) != 0 ? (struct query_alts*)((pool) + (offset)) : NULL)
 
 // Get height of AVL Tree Node
-static int height(struct query_alts* A);
+static int height(char* pool, size_t A);
 
 // Get balance of AVL Tree Node
-static int get_node_balance(struct query_alts* A);
+static int get_node_balance(char* pool, size_t A);
 
 // Right rotate a node, and left child, such that left child is new root, and root is new right child
-static struct query_alts* node_right_rotate(struct query_alts* root);
+static size_t node_right_rotate(char* pool, size_t root);
 
 // Right rotate a node, and right child, such that right child is new root, and root is new left child
-static struct query_alts* node_left_rotate(struct query_alts* root);
-
-void
-pgexporter_copy_query_alts(struct query_alts** dst, struct query_alts* src)
-{
-
-   if (!src)
-   {
-      return;
-   }
-
-   void* new_query_alt = NULL;
-
-   pgexporter_create_shared_memory(sizeof(struct query_alts), HUGEPAGE_OFF, &new_query_alt);
-   *dst = (struct query_alts*) new_query_alt;
-
-   (*dst)->height = src->height;
-   (*dst)->is_histogram = src->is_histogram;
-   (*dst)->n_columns = src->n_columns;
-   (*dst)->version = src->version;
-
-   memcpy((*dst)->query, src->query, MAX_QUERY_LENGTH);
-   memcpy((*dst)->columns, src->columns, MAX_NUMBER_OF_COLUMNS * sizeof(struct column));
-
-   pgexporter_copy_query_alts(&(*dst)->left, src->left);
-   pgexporter_copy_query_alts(&(*dst)->right, src->right);
-}
+static size_t node_left_rotate(char* pool, size_t root);
 
 static int
-height(struct query_alts* A)
+height(char* pool, size_t A)
 {
-   return A ? A->height : 0;
+   return A ? NODE(pool, A)->height : 0;
 }
 
 static int
-get_node_balance(struct query_alts* A)
+get_node_balance(char* pool, size_t A)
 {
-   return A ? height(A->left) - height(A->right) : 0;
+   return A ? height(pool, NODE(pool, A)->left) - height(pool, NODE(pool, A)->right) : 0;
 }
 
-static struct query_alts*
-node_right_rotate(struct query_alts* root)
+static size_t
+node_right_rotate(char* pool, size_t root)
 {
+   struct query_alts* A, * B;
+   size_t b;
 
-   if (!root || !root->left)
+   if (!root || !NODE(pool, root)->left)
    {
       return root;
    }
 
-   struct query_alts* A, * B;
-
-   A = root, B = root->left;
+   A = NODE(pool, root), b = A->left, B = NODE(pool, b);
 
    A->left = B->right;
-   B->right = A;
+   B->right = root;
 
-   A->height = MAX(height(A->left), height(A->right)) + 1;
-   B->height = MAX(height(B->left), height(B->right)) + 1;
+   A->height = MAX(height(pool, A->left), height(pool, A->right)) + 1;
+   B->height = MAX(height(pool, B->left), height(pool, B->right)) + 1;
 
-   return B;
+   return b;
 }
 
-static struct query_alts*
-node_left_rotate(struct query_alts* root)
+static size_t
+node_left_rotate(char* pool, size_t root)
 {
+   struct query_alts* A, * B;
+   size_t b;
 
-   if (!root || !root->right)
+   if (!root || !NODE(pool, root)->right)
    {
       return root;
    }
 
-   struct query_alts* A, * B;
-
-   A = root, B = root->right;
+   A = NODE(pool, root), b = A->right, B = NODE(pool, b);
 
    A->right = B->left;
-   B->left = A;
+   B->left = root;
 
-   A->height = MAX(height(A->left), height(A->right)) + 1;
-   B->height = MAX(height(B->left), height(B->right)) + 1;
+   A->height = MAX(height(pool, A->left), height(pool, A->right)) + 1;
+   B->height = MAX(height(pool, B->left), height(pool, B->right)) + 1;
 
-   return B;
+   return b;
 }
 
-struct query_alts*
-pgexporter_insert_node_avl(struct query_alts* root, struct query_alts** new_node)
+size_t
+pgexporter_insert_node_avl(char* pool, size_t root, size_t new_node)
 {
-   if (!root)
+   struct query_alts* r = NODE(pool, root);
+   struct query_alts* n = NODE(pool, new_node);
+
+   if (!r)
    {
-      return (*new_node);
+      return new_node;
    }
-   else if (root->version == (*new_node)->version)
+   else if (r->version == n->version)
    {
-      // Free New Node, as no need to insert it
-      pgexporter_free_node_avl(new_node);
+      // No need to insert the new node, it stays unused in the pool
       return root;
    }
-   else if (root->version > (*new_node)->version)
+   else if (r->version > n->version)
    {
-      root->left = pgexporter_insert_node_avl(root->left, new_node);
+      r->left = pgexporter_insert_node_avl(pool, r->left, new_node);
    }
    else
    {
-      root->right = pgexporter_insert_node_avl(root->right, new_node);
+      r->right = pgexporter_insert_node_avl(pool, r->right, new_node);
    }
 
-   root->height = MAX(height(root->left), height(root->right)) + 1;
+   r->height = MAX(height(pool, r->left), height(pool, r->right)) + 1;
 
    /* AVL Rotations */
-   if (get_node_balance(root) > 1)
+   if (get_node_balance(pool, root) > 1)
    {
-      if (get_node_balance(root->left) == -1) // L
+      if (get_node_balance(pool, r->left) == -1) // L
       {
-         root->left = node_left_rotate(root->left);
+         r->left = node_left_rotate(pool, r->left);
       }
 
-      return node_right_rotate(root);
+      return node_right_rotate(pool, root);
    }
-   else if (get_node_balance(root) < -1)
+   else if (get_node_balance(pool, root) < -1)
    {
 
-      if (get_node_balance(root->right) == 1) //R
+      if (get_node_balance(pool, r->right) == 1) //R
       {
-         root->right = node_right_rotate(root->right);
+         r->right = node_right_rotate(pool, r->right);
       }
 
-      if (get_node_balance(root) != 0)
+      if (get_node_balance(pool, root) != 0)
       {
-         return node_left_rotate(root);
+         return node_left_rotate(pool, root);
       }
    }
 
@@ -176,15 +153,15 @@ pgexporter_insert_node_avl(struct query_alts* root, struct query_alts** new_node
 }
 
 struct query_alts*
-pgexporter_get_query_alt(struct query_alts* root, int server)
+pgexporter_get_query_alt(char* pool, size_t root, int server)
 {
    struct configuration* config = NULL;
-   struct query_alts* temp = root;
+   struct query_alts* temp = NODE(pool, root);
    struct query_alts* last = NULL;
    int ver;
 
    config = (struct configuration*)shmem;
-   ver = config->servers[server].version;
+   ver = config->server_states[server].version;
 
    // Traversing the AVL tree
    while (temp)
@@ -197,11 +174,11 @@ pgexporter_get_query_alt(struct query_alts* root, int server)
 
       if (temp->version > ver)
       {
-         temp = temp->left;
+         temp = NODE(pool, temp->left);
       }
       else
       {
-         temp = temp->right;
+         temp = NODE(pool, temp->right);
       }
    }
 
@@ -213,29 +190,4 @@ pgexporter_get_query_alt(struct query_alts* root, int server)
    {
       return last;
    }
-
-}
-
-void
-pgexporter_free_query_alts(struct configuration* config)
-{
-   for (int i = 0; i < config->number_of_metrics; i++)
-   {
-      pgexporter_free_node_avl(&config->prometheus[i].root);
-   }
-}
-
-void
-pgexporter_free_node_avl(struct query_alts** root)
-{
-
-   if (!root || !(*root))
-   {
-      return;
-   }
-
-   pgexporter_free_node_avl(&(*root)->left);
-   pgexporter_free_node_avl(&(*root)->right);
-
-   pgexporter_destroy_shared_memory(&root, sizeof(struct query_alts*));
 }
@@ -0,0 +1,602 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <http.h>
+#include <logging.h>
+#include <protobuf.h>
+#include <remote_write.h>
+#include <snappy_compression.h>
+#include <utils.h>
+
+/* system */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define REMOTE_WRITE_CONTENT_TYPE "application/x-protobuf"
+#define REMOTE_WRITE_VERSION      "0.1.0"
+#define REMOTE_WRITE_MAX_LABELS   64
+#define REMOTE_WRITE_MAX_BACKOFF  60
+
+/** @struct remote_write_request
+ * Defines a compressed WriteRequest waiting to be sent
+ */
+struct remote_write_request
+{
+   unsigned char* data; /**< The data */
+   size_t length;       /**< The length of the data */
+};
+
+/** @struct remote_write_label
+ * Defines a label of a sample, pointing into its key
+ */
+struct remote_write_label
+{
+   char* name;          /**< The name */
+   size_t name_length;  /**< The length of the name */
+   char* value;         /**< The escaped value */
+   size_t value_length; /**< The length of the escaped value */
+};
+
+/* The state of the remote write, only used by the collector process */
+static bool running = false;
+static pthread_t sender;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct remote_write_request* queue = NULL;
+static int queue_capacity = 0;
+static int queue_head = 0;
+static int queue_count = 0;
+static struct builder request;
+static struct builder series;
+static int samples = 0;
+static struct http* connection = NULL;
+static bool secure = false;
+static int port = 0;
+static char host[MISC_LENGTH];
+static char path[MAX_PATH];
+
+static int remote_write_url(char* url);
+static int remote_write_labels(char* key, size_t name_length, struct remote_write_label* labels);
+static void remote_write_enqueue(unsigned char* data, size_t length);
+static void* remote_write_sender(void* arg);
+static int remote_write_send(struct remote_write_request* r);
+
+int
+pgexporter_remote_write_start(void)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (strlen(config->remote_write) == 0 || running)
+   {
+      return 0;
+   }
+
+   if (remote_write_url(config->remote_write))
+   {
+      pgexporter_log_error("Invalid remote_write: %s", config->remote_write);
+      goto error;
+   }
+
+   queue_capacity = config->remote_write_queue;
+   queue_head = 0;
+   queue_count = 0;
+   queue = calloc(queue_capacity, sizeof(struct remote_write_request));
+
+   if (queue == NULL)
+   {
+      pgexporter_log_error("Unable to allocate the remote write queue");
+      goto error;
+   }
+
+   pgexporter_builder_init(&request, 0);
+   pgexporter_builder_init(&series, 0);
+   samples = 0;
+
+   running = true;
+
+   if (pgexporter_thread_create(&sender, remote_write_sender, NULL, "remote write sender"))
+   {
+      running = false;
+      goto error;
+   }
+
+   pgexporter_log_debug("Remote write to %s:%d%s", host, port, path);
+
+   return 0;
+
+error:
+
+   free(queue);
+   queue = NULL;
+   pgexporter_builder_destroy(&request);
+   pgexporter_builder_destroy(&series);
+
+   return 1;
+}
+
+bool
+pgexporter_remote_write_active(void)
+{
+   return running;
+}
+
+int
+pgexporter_remote_write_add(char* key, char* value, time_t timestamp)
+{
+   int n;
+   uint64_t ms;
+   size_t name_length;
+   struct remote_write_label labels[REMOTE_WRITE_MAX_LABELS + 1];
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (!running)
+   {
+      return 0;
+   }
+
+   name_length = strcspn(key, "{");
+
+   n = remote_write_labels(key, name_length, &labels[0]);
+   if (n < 0)
+   {
+      pgexporter_log_debug("Remote write: Unable to encode %s", key);
+      return 1;
+   }
+
+   // TimeSeries: labels = 1, samples = 2
+   series.length = 0;
+   for (int i = 0; i < n; i++)
+   {
+      if (pgexporter_protobuf_label(&series, 1, labels[i].name, labels[i].name_length,
+                                    labels[i].value, labels[i].value_length))
+      {
+         return 1;
+      }
+   }
+
+   // Sample: value = 1, timestamp = 2
+   ms = (uint64_t)timestamp * 1000;
+   if (pgexporter_protobuf_tag(&series, 2, PROTOBUF_WIRE_LENGTH) ||
+       pgexporter_protobuf_varint(&series, 9 + 1 + pgexporter_protobuf_varint_size(ms)) ||
+       pgexporter_protobuf_double(&series, 1, strtod(value, NULL)) ||
+       pgexporter_protobuf_uint64(&series, 2, ms))
+   {
+      return 1;
+   }
+
+   // WriteRequest: timeseries = 1
+   if (pgexporter_protobuf_bytes(&request, 1, series.data, series.length))
+   {
+      return 1;
+   }
+
+   samples++;
+
+   if (samples >= config->remote_write_batch)
+   {
+      return pgexporter_remote_write_flush();
+   }
+
+   return 0;
+}
+
+int
+pgexporter_remote_write_flush(void)
+{
+   size_t length = 0;
+   unsigned char* data = NULL;
+
+   if (!running || samples == 0)
+   {
+      return 0;
+   }
+
+   if (pgexporter_snappyc_buffer(request.data, request.length, &data, &length))
+   {
+      goto error;
+   }
+
+   remote_write_enqueue(data, length);
+
+   request.length = 0;
+   samples = 0;
+
+   return 0;
+
+error:
+
+   request.length = 0;
+   samples = 0;
+
+   return 1;
+}
+
+void
+pgexporter_remote_write_stop(void)
+{
+   if (!running)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&lock);
+   running = false;
+   pthread_cond_broadcast(&cond);
+   pthread_mutex_unlock(&lock);
+
+   pthread_join(sender, NULL);
+
+   if (queue_count > 0)
+   {
+      pgexporter_log_debug("Remote write: Dropped %d queued requests", queue_count);
+   }
+
+   for (int i = 0; i < queue_count; i++)
+   {
+      free(queue[(queue_head + i) % queue_capacity].data);
+   }
+
+   free(queue);
+   queue = NULL;
+   queue_count = 0;
+
+   pgexporter_builder_destroy(&request);
+   pgexporter_builder_destroy(&series);
+
+   if (connection != NULL)
+   {
+      pgexporter_http_disconnect(connection);
+      connection = NULL;
+   }
+}
+
+/**
+ * Split the URL of the receiver into its parts
+ * @param url The URL
+ * @return 0 upon success, otherwise 1
+ */
+static int
+remote_write_url(char* url)
+{
+   char* p = url;
+   size_t length;
+
+   secure = false;
+
+   if (pgexporter_starts_with(p, "https://"))
+   {
+      secure = true;
+      p += 8;
+   }
+   else if (pgexporter_starts_with(p, "http://"))
+   {
+      p += 7;
+   }
+
+   length = strcspn(p, ":/");
+   if (length == 0 || length >= MISC_LENGTH)
+   {
+      return 1;
+   }
+
+   memset(host, 0, sizeof(host));
+   memcpy(host, p, length);
+   p += length;
+
+   port = secure ? 443 : 80;
+   if (*p == ':')
+   {
+      p++;
+      port = atoi(p);
+      p += strspn(p, "0123456789");
+   }
+
+   if (port <= 0 || port > 65535)
+   {
+      return 1;
+   }
+
+   memset(path, 0, sizeof(path));
+   if (*p == '\0')
+   {
+      strcpy(path, "/api/v1/write");
+   }
+   else if (*p == '/' && strlen(p) < MAX_PATH)
+   {
+      strcpy(path, p);
+   }
+   else
+   {
+      return 1;
+   }
+
+   return 0;
+}
+
+/**
+ * Find the labels of a key, with the name as __name__, sorted by their names
+ * as required by the remote write protocol
+ * @param key The key
+ * @param name_length The length of the name in the key
+ * @param labels The labels
+ * @return The number of labels, or -1 for a key that can't be parsed
+ */
+static int
+remote_write_labels(char* key, size_t name_length, struct remote_write_label* labels)
+{
+   int n = 0;
+   int j;
+   char* p = key + name_length;
+   struct remote_write_label label;
+
+   labels[n].name = "__name__";
+   labels[n].name_length = 8;
+   labels[n].value = key;
+   labels[n].value_length = name_length;
+   n++;
+
+   if (*p == '{')
+   {
+      p++;
+
+      while (*p != '\0' && *p != '}')
+      {
+         if (n > REMOTE_WRITE_MAX_LABELS)
+         {
+            return -1;
+         }
+
+         labels[n].name = p;
+         while (*p != '\0' && *p != '=')
+         {
+            p++;
+         }
+         labels[n].name_length = p - labels[n].name;
+
+         if (*p != '=' || *(p + 1) != '"')
+         {
+            return -1;
+         }
+         p += 2;
+
+         labels[n].value = p;
+         while (*p != '\0' && *p != '"')
+         {
+            p += (*p == '\\' && *(p + 1) != '\0') ? 2 : 1;
+         }
+
+         if (*p != '"')
+         {
+            return -1;
+         }
+
+         labels[n].value_length = p - labels[n].value;
+         n++;
+         p++;
+
+         if (*p == ',')
+         {
+            p++;
+         }
+      }
+   }
+
+   // The labels are few, so an insertion sort is enough
+   for (int i = 1; i < n; i++)
+   {
+      label = labels[i];
+      j = i - 1;
+
+      while (j >= 0)
+      {
+         size_t length = MIN(labels[j].name_length, label.name_length);
+         int c = strncmp(labels[j].name, label.name, length);
+
+         if (c < 0 || (c == 0 && labels[j].name_length <= label.name_length))
+         {
+            break;
+         }
+
+         labels[j + 1] = labels[j];
+         j--;
+      }
+
+      labels[j + 1] = label;
+   }
+
+   return n;
+}
+
+/**
+ * Add a request to the queue. When the queue is full the oldest request is dropped
+ * @param data The data
+ * @param length The length of the data
+ */
+static void
+remote_write_enqueue(unsigned char* data, size_t length)
+{
+   pthread_mutex_lock(&lock);
+
+   if (queue_count == queue_capacity)
+   {
+      pgexporter_log_warn("Remote write: The queue is full, so the oldest request is dropped");
+
+      free(queue[queue_head].data);
+      queue_head = (queue_head + 1) % queue_capacity;
+      queue_count--;
+   }
+
+   queue[(queue_head + queue_count) % queue_capacity].data = data;
+   queue[(queue_head + queue_count) % queue_capacity].length = length;
+   queue_count++;
+
+   pthread_cond_signal(&cond);
+   pthread_mutex_unlock(&lock);
+}
+
+static void*
+remote_write_sender(void* arg)
+{
+   int backoff = 0;
+   struct timespec deadline;
+   struct remote_write_request r;
+
+   (void)arg;
+
+   pthread_mutex_lock(&lock);
+
+   while (running)
+   {
+      if (queue_count == 0)
+      {
+         pthread_cond_wait(&cond, &lock);
+         continue;
+      }
+
+      // The request is taken out while it is sent, so it can't be dropped meanwhile
+      r = queue[queue_head];
+      queue_head = (queue_head + 1) % queue_capacity;
+      queue_count--;
+
+      pthread_mutex_unlock(&lock);
+
+      if (!remote_write_send(&r))
+      {
+         free(r.data);
+         backoff = 0;
+         pthread_mutex_lock(&lock);
+         continue;
+      }
+
+      pthread_mutex_lock(&lock);
+
+      // A failed request is retried first, unless newer requests have filled the queue
+      if (queue_count < queue_capacity)
+      {
+         queue_head = (queue_head + queue_capacity - 1) % queue_capacity;
+         queue[queue_head] = r;
+         queue_count++;
+      }
+      else
+      {
+         pgexporter_log_warn("Remote write: The queue is full, so a failed request is dropped");
+         free(r.data);
+      }
+
+      backoff = backoff == 0 ? 1 : MIN(backoff * 2, REMOTE_WRITE_MAX_BACKOFF);
+
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += backoff;
+
+      while (running && pthread_cond_timedwait(&cond, &lock, &deadline) != ETIMEDOUT)
+      {
+         /* A new request doesn't end the backoff */
+      }
+   }
+
+   pthread_mutex_unlock(&lock);
+
+   return NULL;
+}
+
+/**
+ * Send a request to the receiver. The connection is kept open between requests
+ * @param r The request
+ * @return 0 if the request is done with, otherwise 1 if it should be retried
+ */
+static int
+remote_write_send(struct remote_write_request* r)
+{
+   int status;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (connection != NULL && !pgexporter_http_idle(connection->socket))
+   {
+      pgexporter_http_disconnect(connection);
+      connection = NULL;
+   }
+
+   if (connection == NULL)
+   {
+      if (pgexporter_http_connect(host, port, secure, config->remote_write_timeout, &connection))
+      {
+         pgexporter_log_warn("Remote write: Unable to connect to %s:%d", host, port);
+         connection = NULL;
+         return 1;
+      }
+
+      connection->keep_alive = true;
+   }
+
+   pgexporter_http_add_header(connection, "Content-Encoding", "snappy");
+   pgexporter_http_add_header(connection, "X-Prometheus-Remote-Write-Version", REMOTE_WRITE_VERSION);
+
+   if (pgexporter_http_post_data(connection, host, path, REMOTE_WRITE_CONTENT_TYPE, r->data, r->length))
+   {
+      pgexporter_log_warn("Remote write: Unable to send to %s:%d", host, port);
+      pgexporter_http_disconnect(connection);
+      connection = NULL;
+      return 1;
+   }
+
+   status = connection->status;
+
+   if (!connection->keep_alive)
+   {
+      pgexporter_http_disconnect(connection);
+      connection = NULL;
+   }
+
+   if (status >= 200 && status < 300)
+   {
+      return 0;
+   }
+
+   if (status == 429 || status >= 500)
+   {
+      pgexporter_log_warn("Remote write: The receiver responded %d, so the request is retried", status);
+      return 1;
+   }
+
+   // The receiver won't accept the request if it is sent again
+   pgexporter_log_warn("Remote write: The receiver responded %d, so the request is dropped", status);
+
+   return 0;
+}
@@ -35,6 +35,7 @@
 #include <network.h>
 #include <prometheus.h>
 #include <security.h>
+#include <stats.h>
 #include <utils.h>
 
 /* system */
@@ -78,10 +79,11 @@ static int generate_md5(char* str, int length, char** md5);
 
 static int client_scram256(SSL* c_ssl, int client_fd, char* username, char* password, int slot);
 
+static int server_connect(int server, int* fd);
 static int server_trust(void);
 static int server_password(char* username, char* password, SSL* ssl, int server_fd);
 static int server_md5(char* username, char* password, SSL* ssl, int server_fd);
-static int server_scram256(char* username, char* password, SSL* ssl, int server_fd);
+static int server_scram256(int server, char* username, char* password, SSL* ssl, int server_fd);
 
 static char* get_admin_password(char* username);
 
@@ -89,10 +91,13 @@ static int sasl_prep(char* password, char** password_prep);
 static int generate_nounce(char** nounce);
 static int get_scram_attribute(char attribute, char* input, size_t size, char** value);
 static int client_proof(char* password, char* salt, int salt_length, int iterations,
+                        unsigned char* client_key, int client_key_length,
                         char* client_first_message_bare, size_t client_first_message_bare_length,
                         char* server_first_message, size_t server_first_message_length,
                         char* client_final_message_wo_proof, size_t client_final_message_wo_proof_length,
                         unsigned char** result, size_t* result_length);
+static int  scram_server_keys(int server, char* username, char* password, char* salt, int salt_length, int iterations,
+                               unsigned char* client_key, unsigned char* server_key);
 static int  salted_password(char* password, char* salt, int salt_length, int iterations, unsigned char** result, int* result_length);
 static int  salted_password_key(unsigned char* salted_password, int salted_password_length, char* key,
                                 unsigned char** result, int* result_length);
@@ -106,6 +111,8 @@ static int  server_signature(char* password, char* salt, int salt_length, int it
                              unsigned char** result, size_t* result_length);
 
 static int  create_ssl_client(SSL_CTX* ctx, char* key, char* cert, char* root, int socket, SSL** ssl);
+static void ssl_session_resume(int server, SSL_CTX* ctx, SSL* ssl);
+static int  ssl_session_new(SSL* ssl, SSL_SESSION* session);
 
 int
 pgexporter_remote_management_auth(int client_fd, char* address, SSL** client_ssl)
@@ -510,6 +517,7 @@ pgexporter_remote_management_scram_sha256(char* username, char* password, int se
    server_first_message = sasl_continue->data + 9;
 
    if (client_proof(password_prep, salt, salt_length, iteration,
+                    NULL, 0,
                     client_first_message_bare, sasl_response->length - 26,
                     server_first_message, sasl_continue->length - 9,
                     &wo_proof[0], strlen(wo_proof),
@@ -901,6 +909,7 @@ retry:
    sasl_prep(password, &password_prep);
 
    if (client_proof(password_prep, salt, salt_length, 4096,
+                    NULL, 0,
                     client_first_message_bare, strlen(client_first_message_bare),
                     server_first_message, strlen(server_first_message),
                     client_final_message_without_proof, strlen(client_final_message_without_proof),
@@ -1014,6 +1023,8 @@ pgexporter_server_authenticate(int server, char* database, char* username, char*
    int ret;
    int status = AUTH_ERROR;
    int connect;
+   uint64_t start;
+   bool connected = false;
    SSL* c_ssl = NULL;
    struct message* ssl_msg = NULL;
    struct message* startup_msg = NULL;
@@ -1023,6 +1034,8 @@ pgexporter_server_authenticate(int server, char* database, char* username, char*
    *ssl = NULL;
    *fd = -1;
 
+   start = pgexporter_stats_now();
+
    auth_type = SECURITY_INVALID;
    server_fd = -1;
    config = (struct configuration*)shmem;
@@ -1032,19 +1045,7 @@ pgexporter_server_authenticate(int server, char* database, char* username, char*
       memset(&security_messages[i], 0, SECURITY_BUFFER_SIZE);
    }
 
-   if (config->servers[server].host[0] == '/')
-   {
-      char pgsql[MISC_LENGTH];
-
-      memset(&pgsql, 0, sizeof(pgsql));
-      snprintf(&pgsql[0], sizeof(pgsql), ".s.PGSQL.%d", config->servers[server].port);
-      ret = pgexporter_connect_unix_socket(config->servers[server].host, &pgsql[0], &server_fd);
-   }
-   else
-   {
-      ret = pgexporter_connect(config->servers[server].host, config->servers[server].port, &server_fd);
-   }
-
+   ret = server_connect(server, &server_fd);
    if (ret != 0)
    {
       goto error;
@@ -1086,6 +1087,8 @@ pgexporter_server_authenticate(int server, char* database, char* username, char*
          goto error;
       }
 
+      ssl_session_resume(server, ctx, c_ssl);
+
       do
       {
          connect = SSL_connect(c_ssl);
@@ -1125,8 +1128,18 @@ pgexporter_server_authenticate(int server, char* database, char* username, char*
          }
       }
       while (connect != 1);
+
+      if (SSL_session_reused(c_ssl))
+      {
+         pgexporter_log_trace("%s: Resumed the TLS session", config->servers[server].name);
+      }
    }
 
+   // The connect phase includes the TLS handshake
+   pgexporter_stats_phase(STATS_PHASE_CONNECT, start);
+   start = pgexporter_stats_now();
+   connected = true;
+
    ret = pgexporter_create_startup_message(username, database, &startup_msg);
    if (ret != MESSAGE_STATUS_OK)
    {
@@ -1173,7 +1186,7 @@ pgexporter_server_authenticate(int server, char* database, char* username, char*
    }
    else if (auth_type == SECURITY_SCRAM256)
    {
-      status = server_scram256(username, password, c_ssl, server_fd);
+      status = server_scram256(server, username, password, c_ssl, server_fd);
    }
 
    if (status == AUTH_BAD_PASSWORD)
@@ -1188,6 +1201,8 @@ pgexporter_server_authenticate(int server, char* database, char* username, char*
    *ssl = c_ssl;
    *fd = server_fd;
 
+   pgexporter_stats_phase(STATS_PHASE_AUTH, start);
+
    pgexporter_free_message(ssl_msg);
    pgexporter_free_message(startup_msg);
    pgexporter_clear_message();
@@ -1196,6 +1211,8 @@ pgexporter_server_authenticate(int server, char* database, char* username, char*
 
 bad_password:
 
+   pgexporter_stats_phase(STATS_PHASE_AUTH, start);
+
    pgexporter_free_message(ssl_msg);
    pgexporter_free_message(startup_msg);
    pgexporter_clear_message();
@@ -1210,6 +1227,11 @@ bad_password:
 
 error:
 
+   if (connected)
+   {
+      pgexporter_stats_phase(STATS_PHASE_AUTH, start);
+   }
+
    pgexporter_free_message(ssl_msg);
    pgexporter_free_message(startup_msg);
    pgexporter_clear_message();
@@ -1223,6 +1245,53 @@ error:
    return AUTH_ERROR;
 }
 
+int
+pgexporter_server_cancel(int server, int pid, int secret)
+{
+   int ret;
+   int server_fd = -1;
+   struct message* cancel_msg = NULL;
+
+   if (pid == 0)
+   {
+      goto error;
+   }
+
+   ret = server_connect(server, &server_fd);
+   if (ret != 0)
+   {
+      goto error;
+   }
+
+   ret = pgexporter_create_cancel_request_message(pid, secret, &cancel_msg);
+   if (ret != MESSAGE_STATUS_OK)
+   {
+      goto error;
+   }
+
+   // The server closes the connection without a reply
+   ret = pgexporter_write_message(NULL, server_fd, cancel_msg);
+   if (ret != MESSAGE_STATUS_OK)
+   {
+      goto error;
+   }
+
+   pgexporter_free_message(cancel_msg);
+   pgexporter_disconnect(server_fd);
+
+   return 0;
+
+error:
+
+   pgexporter_free_message(cancel_msg);
+   if (server_fd != -1)
+   {
+      pgexporter_disconnect(server_fd);
+   }
+
+   return 1;
+}
+
 void
 pgexporter_close_ssl(SSL* ssl)
 {
@@ -1242,6 +1311,25 @@ pgexporter_close_ssl(SSL* ssl)
    }
 }
 
+static int
+server_connect(int server, int* fd)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->servers[server].host[0] == '/')
+   {
+      char pgsql[MISC_LENGTH];
+
+      memset(&pgsql, 0, sizeof(pgsql));
+      snprintf(&pgsql[0], sizeof(pgsql), ".s.PGSQL.%d", config->servers[server].port);
+      return pgexporter_connect_unix_socket(config->servers[server].host, &pgsql[0], fd);
+   }
+
+   return pgexporter_connect(config->servers[server].host, config->servers[server].port, fd);
+}
+
 static int
 server_trust(void)
 {
@@ -1465,7 +1553,7 @@ error:
 }
 
 static int
-server_scram256(char* username, char* password, SSL* ssl, int server_fd)
+server_scram256(int server, char* username, char* password, SSL* ssl, int server_fd)
 {
    int status = MESSAGE_STATUS_ERROR;
    int auth_index = 1;
@@ -1490,6 +1578,8 @@ server_scram256(char* username, char* password, SSL* ssl, int server_fd)
    size_t server_signature_received_length;
    unsigned char* server_signature_calc = NULL;
    size_t server_signature_calc_length;
+   unsigned char client_key[SCRAM_KEY_LENGTH];
+   unsigned char server_key[SCRAM_KEY_LENGTH];
    struct message* sasl_response = NULL;
    struct message* sasl_continue = NULL;
    struct message* sasl_continue_response = NULL;
@@ -1560,7 +1650,13 @@ server_scram256(char* username, char* password, SSL* ssl, int server_fd)
    /* r=...,s=...,i=4096 */
    server_first_message = security_messages[2] + 9;
 
-   if (client_proof(password_prep, salt, salt_length, iteration,
+   if (scram_server_keys(server, username, password_prep, salt, salt_length, iteration, &client_key[0], &server_key[0]))
+   {
+      goto error;
+   }
+
+   if (client_proof(NULL, NULL, 0, 0,
+                    &client_key[0], SCRAM_KEY_LENGTH,
                     client_first_message_bare, security_lengths[1] - 26,
                     server_first_message, security_lengths[2] - 9,
                     &wo_proof[0], strlen(wo_proof),
@@ -1609,8 +1705,8 @@ server_scram256(char* username, char* password, SSL* ssl, int server_fd)
    pgexporter_base64_decode(base64_server_signature, sasl_final->length - 11,
                             (void**)&server_signature_received, &server_signature_received_length);
 
-   if (server_signature(password_prep, salt, salt_length, iteration,
-                        NULL, 0,
+   if (server_signature(NULL, NULL, 0, 0,
+                        (char*)&server_key[0], SCRAM_KEY_LENGTH,
                         client_first_message_bare, security_lengths[1] - 26,
                         server_first_message, security_lengths[2] - 9,
                         &wo_proof[0], strlen(wo_proof),
@@ -2026,6 +2122,7 @@ error:
 
 static int
 client_proof(char* password, char* salt, int salt_length, int iterations,
+             unsigned char* client_key, int client_key_length,
              char* client_first_message_bare, size_t client_first_message_bare_length,
              char* server_first_message, size_t server_first_message_length,
              char* client_final_message_wo_proof, size_t client_final_message_wo_proof_length,
@@ -2043,14 +2140,27 @@ client_proof(char* password, char* salt, int salt_length, int iterations,
    unsigned char* r = NULL;
    HMAC_CTX* ctx = HMAC_CTX_new();
 
-   if (salted_password(password, salt, salt_length, iterations, &s_p, &s_p_length))
+   if (password != NULL)
    {
-      goto error;
-   }
+      if (salted_password(password, salt, salt_length, iterations, &s_p, &s_p_length))
+      {
+         goto error;
+      }
 
-   if (salted_password_key(s_p, s_p_length, "Client Key", &c_k, &c_k_length))
+      if (salted_password_key(s_p, s_p_length, "Client Key", &c_k, &c_k_length))
+      {
+         goto error;
+      }
+   }
+   else
    {
-      goto error;
+      c_k = malloc(size);
+      if (c_k == NULL)
+      {
+         goto error;
+      }
+      memcpy(c_k, client_key, client_key_length);
+      c_k_length = client_key_length;
    }
 
    if (stored_key(c_k, c_k_length, &s_k, &s_k_length))
@@ -2136,6 +2246,115 @@ error:
    return 1;
 }
 
+static int
+scram_server_keys(int server, char* username, char* password, char* salt, int salt_length, int iterations,
+                  unsigned char* client_key, unsigned char* server_key)
+{
+   signed char free_state;
+   bool cached = false;
+   unsigned char* digest = NULL;
+   int digest_length;
+   unsigned char* s_p = NULL;
+   int s_p_length;
+   unsigned char* c_k = NULL;
+   int c_k_length;
+   unsigned char* s_k = NULL;
+   int s_k_length;
+   struct scram_keys* keys = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (server >= 0 && server < NUMBER_OF_SERVERS && salt_length <= MAX_SCRAM_SALT_LENGTH)
+   {
+      keys = &config->scram_keys[server];
+   }
+
+   /* The password is only kept as its SHA-256 */
+   if (keys != NULL && stored_key((unsigned char*)password, strlen(password), &digest, &digest_length))
+   {
+      keys = NULL;
+   }
+
+   /* An entry in use by another process is skipped rather than waited for */
+   free_state = STATE_FREE;
+   if (keys != NULL && !atomic_compare_exchange_strong(&keys->lock, &free_state, STATE_IN_USE))
+   {
+      keys = NULL;
+   }
+
+   if (keys != NULL)
+   {
+      if (keys->valid && keys->iterations == iterations && keys->salt_length == salt_length &&
+          !strcmp(keys->username, username) &&
+          !memcmp(keys->password, digest, SCRAM_KEY_LENGTH) &&
+          !memcmp(keys->salt, salt, salt_length))
+      {
+         memcpy(client_key, keys->client_key, SCRAM_KEY_LENGTH);
+         memcpy(server_key, keys->server_key, SCRAM_KEY_LENGTH);
+         cached = true;
+      }
+
+      atomic_store(&keys->lock, STATE_FREE);
+   }
+
+   if (cached)
+   {
+      free(digest);
+      return 0;
+   }
+
+   if (salted_password(password, salt, salt_length, iterations, &s_p, &s_p_length))
+   {
+      goto error;
+   }
+
+   if (salted_password_key(s_p, s_p_length, "Client Key", &c_k, &c_k_length))
+   {
+      goto error;
+   }
+
+   if (salted_password_key(s_p, s_p_length, "Server Key", &s_k, &s_k_length))
+   {
+      goto error;
+   }
+
+   memcpy(client_key, c_k, SCRAM_KEY_LENGTH);
+   memcpy(server_key, s_k, SCRAM_KEY_LENGTH);
+
+   free_state = STATE_FREE;
+   if (keys != NULL && atomic_compare_exchange_strong(&keys->lock, &free_state, STATE_IN_USE))
+   {
+      memset(keys->username, 0, sizeof(keys->username));
+      memcpy(keys->username, username, MIN(strlen(username), sizeof(keys->username) - 1));
+      memcpy(keys->password, digest, SCRAM_KEY_LENGTH);
+      memcpy(keys->salt, salt, salt_length);
+      keys->salt_length = salt_length;
+      keys->iterations = iterations;
+      memcpy(keys->client_key, c_k, SCRAM_KEY_LENGTH);
+      memcpy(keys->server_key, s_k, SCRAM_KEY_LENGTH);
+      keys->valid = true;
+
+      atomic_store(&keys->lock, STATE_FREE);
+   }
+
+   free(digest);
+   free(s_p);
+   free(c_k);
+   free(s_k);
+
+   return 0;
+
+error:
+
+   free(digest);
+   free(s_p);
+   free(c_k);
+   free(s_k);
+
+   return 1;
+}
+
 static int
 salted_password(char* password, char* salt, int salt_length, int iterations, unsigned char** result, int* result_length)
 {
@@ -2628,7 +2847,76 @@ int
 pgexporter_create_ssl_server(SSL_CTX* ctx, char* key, char* cert, char* root, int socket, SSL** ssl)
 {
    SSL* s = NULL;
+
+   if (pgexporter_init_ssl_server_ctx(ctx, key, cert, root))
+   {
+      goto error;
+   }
+
+   s = SSL_new(ctx);
+
+   if (s == NULL)
+   {
+      goto error;
+   }
+
+   if (SSL_set_fd(s, socket) == 0)
+   {
+      goto error;
+   }
+
+   *ssl = s;
+
+   return 0;
+
+error:
+
+   pgexporter_close_ssl(s);
+
+   return 1;
+}
+
+int
+pgexporter_create_ssl_server_from_ctx(SSL_CTX* ctx, int socket, SSL** ssl)
+{
+   SSL* s = NULL;
+
+   /* pgexporter_close_ssl() releases a reference to the context */
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L)
+   CRYPTO_add(&ctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+#else
+   SSL_CTX_up_ref(ctx);
+#endif
+
+   s = SSL_new(ctx);
+
+   if (s == NULL)
+   {
+      SSL_CTX_free(ctx);
+      goto error;
+   }
+
+   if (SSL_set_fd(s, socket) == 0)
+   {
+      goto error;
+   }
+
+   *ssl = s;
+
+   return 0;
+
+error:
+
+   pgexporter_close_ssl(s);
+
+   return 1;
+}
+
+int
+pgexporter_init_ssl_server_ctx(SSL_CTX* ctx, char* key, char* cert, char* root)
+{
    STACK_OF(X509_NAME) * root_cert_list = NULL;
+   struct configuration* config;
 
    if (strlen(cert) == 0)
    {
@@ -2699,27 +2987,120 @@ pgexporter_create_ssl_server(SSL_CTX* ctx, char* key, char* cert, char* root, in
       SSL_CTX_set_client_CA_list(ctx, root_cert_list);
    }
 
-   s = SSL_new(ctx);
+#ifdef SSL_OP_ENABLE_KTLS
+   /* Lets the cached responses be sent with SSL_sendfile() */
+   SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
 
-   if (s == NULL)
+   /* The ticket keys are the same in every process, so a client resumes its
+      session on the next connection whichever process accepts it */
+   config = (struct configuration*)shmem;
+
+   if (config != NULL && SSL_CTX_set_tlsext_ticket_keys(ctx, config->tls_ticket_keys, TLS_TICKET_KEYS_LENGTH) == 1)
    {
-      goto error;
+      SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+      SSL_CTX_set_session_id_context(ctx, (unsigned char*)"pgexporter", strlen("pgexporter"));
    }
 
-   if (SSL_set_fd(s, socket) == 0)
+   return 0;
+
+error:
+
+   return 1;
+}
+
+int
+pgexporter_create_ssl_ticket_keys(void)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (RAND_bytes(config->tls_ticket_keys, TLS_TICKET_KEYS_LENGTH) != 1)
    {
-      goto error;
+      memset(config->tls_ticket_keys, 0, TLS_TICKET_KEYS_LENGTH);
+      return 1;
    }
 
-   *ssl = s;
-
    return 0;
+}
 
-error:
+static void
+ssl_session_resume(int server, SSL_CTX* ctx, SSL* ssl)
+{
+   signed char free_state;
+   const unsigned char* p = NULL;
+   SSL_SESSION* session = NULL;
+   struct tls_session* entry = NULL;
+   struct configuration* config;
 
-   pgexporter_close_ssl(s);
+   config = (struct configuration*)shmem;
 
-   return 1;
+   entry = &config->tls_sessions[server];
+
+   /* The sessions are kept in shared memory instead of by the context */
+   SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+   SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+   SSL_CTX_sess_set_new_cb(ctx, ssl_session_new);
+   SSL_set_app_data(ssl, entry);
+
+   free_state = STATE_FREE;
+   if (!atomic_compare_exchange_strong(&entry->lock, &free_state, STATE_IN_USE))
+   {
+      return;
+   }
+
+   if (entry->length > 0)
+   {
+      p = entry->data;
+      session = d2i_SSL_SESSION(NULL, &p, entry->length);
+   }
+
+   atomic_store(&entry->lock, STATE_FREE);
+
+   if (session != NULL)
+   {
+      /* A session the server doesn't know anymore falls back to a full handshake */
+      SSL_set_session(ssl, session);
+      SSL_SESSION_free(session);
+   }
+}
+
+static int
+ssl_session_new(SSL* ssl, SSL_SESSION* session)
+{
+   int length;
+   signed char free_state;
+   unsigned char* p = NULL;
+   struct tls_session* entry = NULL;
+
+   entry = (struct tls_session*)SSL_get_app_data(ssl);
+
+   if (entry == NULL || !SSL_SESSION_is_resumable(session))
+   {
+      return 0;
+   }
+
+   length = i2d_SSL_SESSION(session, NULL);
+
+   if (length <= 0 || length > MAX_TLS_SESSION_LENGTH)
+   {
+      return 0;
+   }
+
+   free_state = STATE_FREE;
+   if (!atomic_compare_exchange_strong(&entry->lock, &free_state, STATE_IN_USE))
+   {
+      return 0;
+   }
+
+   p = entry->data;
+   entry->length = i2d_SSL_SESSION(session, &p) == length ? length : 0;
+
+   atomic_store(&entry->lock, STATE_FREE);
+
+   /* The session isn't kept, only its copy */
+   return 0;
 }
 
 int
@@ -2764,3 +3145,39 @@ pgexporter_extract_server_parameters(struct deque** server_parameters)
    *server_parameters = sp;
    return 0;
 }
+
+int
+pgexporter_extract_backend_key_data(int* pid, int* secret)
+{
+   char* data = NULL;
+   ssize_t data_length;
+   size_t offset;
+   bool found = false;
+   struct message* msg = NULL;
+
+   *pid = 0;
+   *secret = 0;
+
+   for (int i = 0; !found && i < NUMBER_OF_SECURITY_MESSAGES; ++i)
+   {
+      if ((data_length = security_lengths[i]) > 0)
+      {
+         data = &security_messages[i][0];
+         offset = 0;
+
+         while (!found && offset < (size_t) data_length)
+         {
+            offset = pgexporter_extract_message_offset(offset, data, &msg);
+            if (msg->kind == 'K' && msg->length >= 13)
+            {
+               *pid = pgexporter_read_int32(msg->data + 5);
+               *secret = pgexporter_read_int32(msg->data + 9);
+               found = true;
+            }
+            pgexporter_free_message(msg);
+         }
+      }
+   }
+
+   return found ? 0 : 1;
+}
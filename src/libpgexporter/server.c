@@ -43,11 +43,9 @@
 #include <sys/types.h>
 
 int
-pgexporter_server_info(int srv)
+pgexporter_server_info(int srv, SSL* ssl, int socket)
 {
    int status;
-   SSL* ssl;
-   int socket;
    size_t size = 40;
    char is_recovery[size];
    signed char state;
@@ -56,8 +54,6 @@ pgexporter_server_info(int srv)
    struct configuration* config;
 
    config = (struct configuration*)shmem;
-   ssl = config->servers[srv].ssl;
-   socket = config->servers[srv].fd;
 
    memset(&qmsg, 0, sizeof(struct message));
    memset(&is_recovery, 0, size);
@@ -89,12 +85,13 @@ pgexporter_server_info(int srv)
 
    if (state == 'f')
    {
-      config->servers[srv].state = SERVER_PRIMARY;
+      config->server_states[srv].state = SERVER_PRIMARY;
    }
    else
    {
-      config->servers[srv].state = SERVER_REPLICA;
+      config->server_states[srv].state = SERVER_REPLICA;
    }
+   config->server_states[srv].role_checked = time(NULL);
 
    pgexporter_clear_message();
 
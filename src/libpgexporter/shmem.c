@@ -28,17 +28,34 @@
 
 /* pgexporter */
 #include <pgexporter.h>
+#include <logging.h>
 #include <shmem.h>
 
 /* system */
 #include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#ifdef HAVE_LINUX
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
 
 void* shmem = NULL;
 void* prometheus_cache_shmem = NULL;
+void* prometheus_snapshot_shmem = NULL;
 void* bridge_cache_shmem = NULL;
+void* bridge_snapshot_shmem = NULL;
 void* bridge_json_cache_shmem = NULL;
+void* stats_shmem = NULL;
+void* trace_shmem = NULL;
+void* log_shmem = NULL;
+
+#ifdef HAVE_LINUX
+static bool hugepage_reported = false;
+#endif
 
 int
 pgexporter_create_shared_memory(size_t size, unsigned char hp, void** shmem)
@@ -52,37 +69,127 @@ pgexporter_create_shared_memory(size_t size, unsigned char hp, void** shmem)
 #ifdef HAVE_LINUX
    if (hp == HUGEPAGE_TRY || hp == HUGEPAGE_ON)
    {
-      visibility = visibility | MAP_HUGETLB;
+      s = mmap(NULL, size, protection, visibility | MAP_HUGETLB, -1, 0);
+
+      if (s == MAP_FAILED)
+      {
+         s = NULL;
+
+         if (hp == HUGEPAGE_ON)
+         {
+            pgexporter_log_error("Shared memory: No huge pages for %zu bytes: %s", size, strerror(errno));
+            errno = 0;
+            return 1;
+         }
+
+         if (!hugepage_reported)
+         {
+            pgexporter_log_info("Shared memory: No huge pages (%s), using normal pages", strerror(errno));
+            hugepage_reported = true;
+         }
+
+         errno = 0;
+      }
    }
 #endif
 
-   s = mmap(NULL, size, protection, visibility, -1, 0);
-   if (s == (void*)-1)
+   if (s == NULL)
    {
-      errno = 0;
-      s = NULL;
+      s = mmap(NULL, size, protection, visibility, -1, 0);
 
-      if (hp == HUGEPAGE_OFF || hp == HUGEPAGE_ON)
+      if (s == MAP_FAILED)
       {
+         errno = 0;
          return 1;
       }
    }
 
-   if (s == NULL)
+   /* An anonymous mapping is zero filled, so the pages are only touched on first use */
+   /* which lets a NUMA policy set after the creation decide their placement */
+
+   *shmem = s;
+
+   return 0;
+}
+
+int
+pgexporter_numa_shared_memory(void* shmem, size_t size, int numa)
+{
+#ifdef HAVE_LINUX
+   unsigned long mask[16];
+   unsigned long max_node = sizeof(mask) * 8;
+   int mode;
+   long page_size;
+   uintptr_t start;
+   size_t length;
+
+   if (numa == NUMA_OFF || shmem == NULL || size == 0)
    {
-      visibility = MAP_ANONYMOUS | MAP_SHARED;
-      s = mmap(NULL, size, protection, visibility, 0, 0);
+      return 0;
+   }
+
+   memset(&mask[0], 0, sizeof(mask));
+
+   if (numa == NUMA_INTERLEAVE)
+   {
+      /* The nodes the process is allowed to use */
+      mode = MPOL_INTERLEAVE;
 
-      if (s == (void*)-1)
+      if (syscall(SYS_get_mempolicy, NULL, &mask[0], max_node, NULL, MPOL_F_MEMS_ALLOWED) != 0)
       {
+         pgexporter_log_warn("Shared memory: No NUMA nodes: %s", strerror(errno));
          errno = 0;
          return 1;
       }
    }
+   else if (numa >= 0 && (unsigned long)numa < max_node)
+   {
+      mode = MPOL_BIND;
+      mask[numa / (sizeof(unsigned long) * 8)] = 1UL << (numa % (sizeof(unsigned long) * 8));
+   }
+   else
+   {
+      return 1;
+   }
 
-   memset(s, 0, size);
+   page_size = sysconf(_SC_PAGESIZE);
+   start = (uintptr_t)shmem & ~((uintptr_t)page_size - 1);
+   length = size + ((uintptr_t)shmem - start);
 
-   *shmem = s;
+   /* Pages touched already are moved */
+   if (syscall(SYS_mbind, start, length, mode, &mask[0], max_node, MPOL_MF_MOVE) != 0)
+   {
+      pgexporter_log_warn("Shared memory: NUMA placement failed: %s", strerror(errno));
+      errno = 0;
+      return 1;
+   }
+#else
+   (void)shmem;
+   (void)size;
+   (void)numa;
+#endif
+
+   return 0;
+}
+
+int
+pgexporter_resize_shared_memory(size_t size, void* shm, size_t* new_size, void** new_shmem)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (pgexporter_create_shared_memory(*new_size, config->hugepage, new_shmem))
+   {
+      return 1;
+   }
+
+   pgexporter_numa_shared_memory(*new_shmem, *new_size, config->numa);
+
+   memcpy(*new_shmem, shm, MIN(size, *new_size));
+
+   /* The processes attached keep their mapping of the segment */
+   pgexporter_destroy_shared_memory(shm, size);
 
    return 0;
 }
@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <logging.h>
+#include <snappy_compression.h>
+
+/* system */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A copy refers back at most 64kB, so the data is compressed a block at a time */
+#define SNAPPY_BLOCK_SIZE 65536
+#define SNAPPY_HASH_BITS  14
+
+#define SNAPPY_TAG_LITERAL 0
+#define SNAPPY_TAG_COPY_2  2
+
+static size_t snappy_literal(unsigned char* out, unsigned char* literal, size_t length);
+static size_t snappy_copy(unsigned char* out, size_t offset, size_t length);
+static uint32_t snappy_load(unsigned char* p);
+
+int
+pgexporter_snappyc_buffer(void* source, size_t source_size, unsigned char** buffer, size_t* buffer_size)
+{
+   size_t n = 0;
+   size_t length;
+   size_t ip;
+   size_t literal;
+   size_t match;
+   uint32_t hash;
+   int32_t candidate;
+   uint64_t remaining;
+   int32_t* table = NULL;
+   unsigned char* in = (unsigned char*)source;
+   unsigned char* block = NULL;
+   unsigned char* out = NULL;
+
+   *buffer = NULL;
+   *buffer_size = 0;
+
+   // The worst case is all literals, with the length of the data as a varint
+   out = malloc(32 + source_size + source_size / 6);
+   table = malloc(sizeof(int32_t) * (1 << SNAPPY_HASH_BITS));
+
+   if (out == NULL || table == NULL)
+   {
+      pgexporter_log_error("Snappy: Unable to allocate the buffers");
+      goto error;
+   }
+
+   remaining = source_size;
+   while (remaining >= 0x80)
+   {
+      out[n++] = (unsigned char)((remaining & 0x7F) | 0x80);
+      remaining >>= 7;
+   }
+   out[n++] = (unsigned char)remaining;
+
+   for (size_t offset = 0; offset < source_size; offset += SNAPPY_BLOCK_SIZE)
+   {
+      block = in + offset;
+      length = source_size - offset < SNAPPY_BLOCK_SIZE ? source_size - offset : SNAPPY_BLOCK_SIZE;
+
+      memset(table, 0xFF, sizeof(int32_t) * (1 << SNAPPY_HASH_BITS));
+
+      ip = 0;
+      literal = 0;
+
+      // A position is found again through the hash of its next four bytes
+      while (ip + 4 <= length)
+      {
+         hash = (snappy_load(block + ip) * 0x1E35A7BD) >> (32 - SNAPPY_HASH_BITS);
+         candidate = table[hash];
+         table[hash] = (int32_t)ip;
+
+         if (candidate >= 0 && snappy_load(block + candidate) == snappy_load(block + ip))
+         {
+            match = (size_t)candidate;
+            size_t copy = 4;
+
+            while (ip + copy < length && block[match + copy] == block[ip + copy])
+            {
+               copy++;
+            }
+
+            n += snappy_literal(out + n, block + literal, ip - literal);
+            n += snappy_copy(out + n, ip - match, copy);
+
+            ip += copy;
+            literal = ip;
+         }
+         else
+         {
+            ip++;
+         }
+      }
+
+      n += snappy_literal(out + n, block + literal, length - literal);
+   }
+
+   free(table);
+
+   *buffer = out;
+   *buffer_size = n;
+
+   return 0;
+
+error:
+
+   free(out);
+   free(table);
+
+   return 1;
+}
+
+/**
+ * Write a literal
+ * @param out The output
+ * @param literal The literal
+ * @param length The length of the literal, at most a block
+ * @return The number of bytes written
+ */
+static size_t
+snappy_literal(unsigned char* out, unsigned char* literal, size_t length)
+{
+   size_t n = 0;
+
+   if (length == 0)
+   {
+      return 0;
+   }
+
+   if (length - 1 < 60)
+   {
+      out[n++] = (unsigned char)(((length - 1) << 2) | SNAPPY_TAG_LITERAL);
+   }
+   else if (length - 1 < 256)
+   {
+      out[n++] = (unsigned char)((60 << 2) | SNAPPY_TAG_LITERAL);
+      out[n++] = (unsigned char)(length - 1);
+   }
+   else
+   {
+      out[n++] = (unsigned char)((61 << 2) | SNAPPY_TAG_LITERAL);
+      out[n++] = (unsigned char)((length - 1) & 0xFF);
+      out[n++] = (unsigned char)((length - 1) >> 8);
+   }
+
+   memcpy(out + n, literal, length);
+
+   return n + length;
+}
+
+/**
+ * Write a copy, as copies of at most 64 bytes with a 2 byte offset
+ * @param out The output
+ * @param offset The offset back to the data
+ * @param length The length of the data
+ * @return The number of bytes written
+ */
+static size_t
+snappy_copy(unsigned char* out, size_t offset, size_t length)
+{
+   size_t n = 0;
+   size_t part;
+
+   while (length > 0)
+   {
+      part = length > 64 ? 64 : length;
+
+      out[n++] = (unsigned char)(((part - 1) << 2) | SNAPPY_TAG_COPY_2);
+      out[n++] = (unsigned char)(offset & 0xFF);
+      out[n++] = (unsigned char)(offset >> 8);
+
+      length -= part;
+   }
+
+   return n;
+}
+
+static uint32_t
+snappy_load(unsigned char* p)
+{
+   return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
@@ -0,0 +1,592 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <catalog.h>
+#include <json.h>
+#include <management.h>
+#include <memory.h>
+#include <shmem.h>
+#include <stats.h>
+#include <utils.h>
+
+/* system */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define OUTPUT_DURATION 0
+#define OUTPUT_ROWS     1
+#define OUTPUT_BYTES    2
+#define OUTPUT_ERRORS   3
+
+#define MEMORY_VALUE_BYTES       0
+#define MEMORY_VALUE_OBJECTS     1
+#define MEMORY_VALUE_PEAK        2
+#define MEMORY_VALUE_ALLOCATIONS 3
+#define MEMORY_VALUE_ALLOCATED   4
+
+/* The upper bounds of the buckets in nanoseconds, the last one is +Inf */
+static const uint64_t bucket_bounds[NUMBER_OF_STATS_BUCKETS - 1] = {
+   1000000ULL, 5000000ULL, 10000000ULL, 25000000ULL, 50000000ULL, 100000000ULL,
+   250000000ULL, 500000000ULL, 1000000000ULL, 2500000000ULL, 5000000000ULL, 10000000000ULL
+};
+
+static const char* bucket_labels[NUMBER_OF_STATS_BUCKETS] = {
+   "0.001", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1", "2.5", "5", "10", "+Inf"
+};
+
+static const char* phase_labels[NUMBER_OF_STATS_PHASES] = {
+   "connect", "auth", "collect", "render", "send"
+};
+
+static const char* collector_labels[NUMBER_OF_STATS_COLLECTORS] = {
+   "version", "uptime", "primary", "settings", "extension"
+};
+
+static const char* memory_labels[NUMBER_OF_MEMORY_SUBSYSTEMS] = {
+   "art", "deque", "json", "query", "http", "cache", "arena"
+};
+
+static void observe(struct stats_histogram* histogram, uint64_t duration);
+static void record(int server, int query, uint64_t duration, int rows, size_t bytes, bool error);
+static int output_histogram(struct builder* builder, char* name, char* labels, struct stats_histogram* histogram);
+static int output_queries(struct builder* builder, int type);
+static int output_memory(struct builder* builder, char* name, char* help, char* type, int value);
+static long long memory_value(struct stats_memory* memory, int value);
+
+int
+pgexporter_stats_init(size_t* size, void** segment)
+{
+   size_t s;
+   int number_of_queries;
+   struct stats* stats = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *size = 0;
+   *segment = NULL;
+
+   number_of_queries = NUMBER_OF_STATS_COLLECTORS + config->number_of_metrics;
+
+   s = sizeof(struct stats) + (size_t)config->number_of_servers * number_of_queries * sizeof(struct stats_query);
+
+   if (pgexporter_create_shared_memory(s, config->hugepage, (void**)&stats))
+   {
+      return 1;
+   }
+
+   pgexporter_numa_shared_memory(stats, s, config->numa);
+
+   stats->number_of_servers = config->number_of_servers;
+   stats->number_of_queries = number_of_queries;
+
+   *size = s;
+   *segment = stats;
+
+   return 0;
+}
+
+uint64_t
+pgexporter_stats_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void
+pgexporter_stats_phase(int phase, uint64_t start)
+{
+   struct stats* stats = (struct stats*)stats_shmem;
+
+   if (stats == NULL || phase < 0 || phase >= NUMBER_OF_STATS_PHASES)
+   {
+      return;
+   }
+
+   observe(&stats->phases[phase], pgexporter_stats_now() - start);
+}
+
+void
+pgexporter_stats_collector(int server, int collector, uint64_t duration, int rows, size_t bytes, bool error)
+{
+   if (collector < 0 || collector >= NUMBER_OF_STATS_COLLECTORS)
+   {
+      return;
+   }
+
+   record(server, collector, duration, rows, bytes, error);
+}
+
+void
+pgexporter_stats_metric(int server, int metric, uint64_t duration, int rows, size_t bytes, bool error)
+{
+   if (metric < 0)
+   {
+      return;
+   }
+
+   record(server, NUMBER_OF_STATS_COLLECTORS + metric, duration, rows, bytes, error);
+}
+
+size_t
+pgexporter_stats_metric_size(int server, int metric)
+{
+   int query = NUMBER_OF_STATS_COLLECTORS + metric;
+   struct stats* stats = (struct stats*)stats_shmem;
+
+   if (stats == NULL || server < 0 || server >= stats->number_of_servers || metric < 0 || query >= stats->number_of_queries)
+   {
+      return 0;
+   }
+
+   return (size_t)atomic_load_explicit(&stats->queries[server * stats->number_of_queries + query].size, memory_order_relaxed);
+}
+
+uint64_t
+pgexporter_stats_metric_duration(int server, int metric)
+{
+   int query = NUMBER_OF_STATS_COLLECTORS + metric;
+   struct stats* stats = (struct stats*)stats_shmem;
+
+   if (stats == NULL || server < 0 || server >= stats->number_of_servers || metric < 0 || query >= stats->number_of_queries)
+   {
+      return 0;
+   }
+
+   return (uint64_t)atomic_load_explicit(&stats->queries[server * stats->number_of_queries + query].last, memory_order_relaxed);
+}
+
+void
+pgexporter_stats_cache(bool hit)
+{
+   struct stats* stats = (struct stats*)stats_shmem;
+
+   if (stats == NULL)
+   {
+      return;
+   }
+
+   atomic_fetch_add_explicit(hit ? &stats->cache_hits : &stats->cache_misses, 1, memory_order_relaxed);
+}
+
+int
+pgexporter_stats_output(struct builder* builder)
+{
+   char labels[MISC_LENGTH * 2];
+   struct stats* stats = (struct stats*)stats_shmem;
+
+   if (stats == NULL)
+   {
+      return 0;
+   }
+
+   if (pgexporter_builder_append(builder,
+                                 "# HELP pgexporter_self_scrape_phase_seconds The duration of the phases of a scrape\n"
+                                 "# TYPE pgexporter_self_scrape_phase_seconds histogram\n"))
+   {
+      return 1;
+   }
+
+   for (int i = 0; i < NUMBER_OF_STATS_PHASES; i++)
+   {
+      snprintf(&labels[0], sizeof(labels), "phase=\"%s\"", phase_labels[i]);
+
+      if (output_histogram(builder, "pgexporter_self_scrape_phase_seconds", &labels[0], &stats->phases[i]))
+      {
+         return 1;
+      }
+   }
+
+   if (pgexporter_builder_append(builder,
+                                 "# HELP pgexporter_self_query_duration_seconds The duration of the queries of a collector\n"
+                                 "# TYPE pgexporter_self_query_duration_seconds histogram\n") ||
+       output_queries(builder, OUTPUT_DURATION) ||
+       pgexporter_builder_append(builder,
+                                 "# HELP pgexporter_self_query_rows_total The number of rows returned by the queries of a collector\n"
+                                 "# TYPE pgexporter_self_query_rows_total counter\n") ||
+       output_queries(builder, OUTPUT_ROWS) ||
+       pgexporter_builder_append(builder,
+                                 "# HELP pgexporter_self_query_bytes_total The number of bytes received by the queries of a collector\n"
+                                 "# TYPE pgexporter_self_query_bytes_total counter\n") ||
+       output_queries(builder, OUTPUT_BYTES) ||
+       pgexporter_builder_append(builder,
+                                 "# HELP pgexporter_self_query_errors_total The number of failed queries of a collector\n"
+                                 "# TYPE pgexporter_self_query_errors_total counter\n") ||
+       output_queries(builder, OUTPUT_ERRORS))
+   {
+      return 1;
+   }
+
+   if (pgexporter_builder_append(builder,
+                                 "# HELP pgexporter_self_cache_hits_total The number of responses served from a cache\n"
+                                 "# TYPE pgexporter_self_cache_hits_total counter\n"
+                                 "pgexporter_self_cache_hits_total ") ||
+       pgexporter_builder_append_ulong(builder, atomic_load_explicit(&stats->cache_hits, memory_order_relaxed)) ||
+       pgexporter_builder_append(builder,
+                                 "\n"
+                                 "# HELP pgexporter_self_cache_misses_total The number of responses built by a scrape\n"
+                                 "# TYPE pgexporter_self_cache_misses_total counter\n"
+                                 "pgexporter_self_cache_misses_total ") ||
+       pgexporter_builder_append_ulong(builder, atomic_load_explicit(&stats->cache_misses, memory_order_relaxed)) ||
+       pgexporter_builder_append_char(builder, '\n'))
+   {
+      return 1;
+   }
+
+   return 0;
+}
+
+void
+pgexporter_stats_memory(int subsystem, int64_t allocations, int64_t frees, int64_t allocated, int64_t freed)
+{
+   long long used;
+   long long peak;
+   struct stats_memory* m = NULL;
+   struct stats* stats = (struct stats*)stats_shmem;
+
+   if (stats == NULL || subsystem < 0 || subsystem >= NUMBER_OF_MEMORY_SUBSYSTEMS)
+   {
+      return;
+   }
+
+   m = &stats->memory[subsystem];
+
+   atomic_fetch_add_explicit(&m->allocations, allocations, memory_order_relaxed);
+   atomic_fetch_add_explicit(&m->frees, frees, memory_order_relaxed);
+   used = atomic_fetch_add_explicit(&m->allocated_bytes, allocated, memory_order_relaxed) + allocated;
+   used -= atomic_fetch_add_explicit(&m->freed_bytes, freed, memory_order_relaxed) + freed;
+
+   peak = atomic_load_explicit(&m->peak, memory_order_relaxed);
+   while (used > peak &&
+          !atomic_compare_exchange_weak_explicit(&m->peak, &peak, used, memory_order_relaxed, memory_order_relaxed))
+   {
+   }
+}
+
+int
+pgexporter_stats_memory_output(struct builder* builder)
+{
+   if (stats_shmem == NULL)
+   {
+      return 0;
+   }
+
+   // Include the accounting of the thread building the response
+   pgexporter_memory_flush();
+
+   if (output_memory(builder, "pgexporter_memory_bytes", "The number of bytes in use by a subsystem", "gauge", MEMORY_VALUE_BYTES) ||
+       output_memory(builder, "pgexporter_memory_objects", "The number of objects in use by a subsystem", "gauge", MEMORY_VALUE_OBJECTS) ||
+       output_memory(builder, "pgexporter_memory_peak_bytes", "The highest number of bytes in use by a subsystem", "gauge", MEMORY_VALUE_PEAK) ||
+       output_memory(builder, "pgexporter_memory_allocations_total", "The number of allocations of a subsystem", "counter", MEMORY_VALUE_ALLOCATIONS) ||
+       output_memory(builder, "pgexporter_memory_allocated_bytes_total", "The number of bytes allocated by a subsystem", "counter", MEMORY_VALUE_ALLOCATED))
+   {
+      return 1;
+   }
+
+   return 0;
+}
+
+int
+pgexporter_stats_memory_json(struct json* json)
+{
+   struct json* subsystems = NULL;
+   struct stats* stats = (struct stats*)stats_shmem;
+
+   if (stats == NULL)
+   {
+      return 0;
+   }
+
+   pgexporter_memory_flush();
+
+   if (pgexporter_json_create(&subsystems))
+   {
+      goto error;
+   }
+
+   for (int i = 0; i < NUMBER_OF_MEMORY_SUBSYSTEMS; i++)
+   {
+      struct json* js = NULL;
+
+      if (pgexporter_json_create(&js))
+      {
+         goto error;
+      }
+
+      pgexporter_json_put(js, MANAGEMENT_ARGUMENT_SUBSYSTEM, (uintptr_t)memory_labels[i], ValueString);
+      pgexporter_json_put(js, MANAGEMENT_ARGUMENT_BYTES, (uintptr_t)memory_value(&stats->memory[i], MEMORY_VALUE_BYTES), ValueInt64);
+      pgexporter_json_put(js, MANAGEMENT_ARGUMENT_OBJECTS, (uintptr_t)memory_value(&stats->memory[i], MEMORY_VALUE_OBJECTS), ValueInt64);
+      pgexporter_json_put(js, MANAGEMENT_ARGUMENT_PEAK, (uintptr_t)memory_value(&stats->memory[i], MEMORY_VALUE_PEAK), ValueInt64);
+      pgexporter_json_put(js, MANAGEMENT_ARGUMENT_ALLOCATIONS, (uintptr_t)memory_value(&stats->memory[i], MEMORY_VALUE_ALLOCATIONS), ValueInt64);
+      pgexporter_json_put(js, MANAGEMENT_ARGUMENT_ALLOCATED, (uintptr_t)memory_value(&stats->memory[i], MEMORY_VALUE_ALLOCATED), ValueInt64);
+
+      pgexporter_json_append(subsystems, (uintptr_t)js, ValueJSON);
+   }
+
+   pgexporter_json_put(json, MANAGEMENT_ARGUMENT_MEMORY, (uintptr_t)subsystems, ValueJSON);
+
+   return 0;
+
+error:
+
+   pgexporter_json_destroy(subsystems);
+
+   return 1;
+}
+
+static void
+observe(struct stats_histogram* histogram, uint64_t duration)
+{
+   int bucket = 0;
+
+   while (bucket < NUMBER_OF_STATS_BUCKETS - 1 && duration > bucket_bounds[bucket])
+   {
+      bucket++;
+   }
+
+   atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+   atomic_fetch_add_explicit(&histogram->sum, duration, memory_order_relaxed);
+   atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+}
+
+static void
+record(int server, int query, uint64_t duration, int rows, size_t bytes, bool error)
+{
+   struct stats_query* q = NULL;
+   struct stats* stats = (struct stats*)stats_shmem;
+
+   // A reload may add servers or metrics, which aren't tracked until a restart
+   if (stats == NULL || server < 0 || server >= stats->number_of_servers || query >= stats->number_of_queries)
+   {
+      return;
+   }
+
+   q = &stats->queries[server * stats->number_of_queries + query];
+
+   if (error)
+   {
+      atomic_fetch_add_explicit(&q->errors, 1, memory_order_relaxed);
+      return;
+   }
+
+   observe(&q->duration, duration);
+   atomic_fetch_add_explicit(&q->rows, rows > 0 ? (unsigned long long)rows : 0, memory_order_relaxed);
+   atomic_fetch_add_explicit(&q->bytes, bytes, memory_order_relaxed);
+   atomic_store_explicit(&q->size, bytes, memory_order_relaxed);
+   atomic_store_explicit(&q->last, duration, memory_order_relaxed);
+}
+
+static int
+output_histogram(struct builder* builder, char* name, char* labels, struct stats_histogram* histogram)
+{
+   uint64_t count = 0;
+
+   if (atomic_load_explicit(&histogram->count, memory_order_relaxed) == 0)
+   {
+      return 0;
+   }
+
+   for (int i = 0; i < NUMBER_OF_STATS_BUCKETS; i++)
+   {
+      count += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+
+      if (pgexporter_builder_append(builder, name) ||
+          pgexporter_builder_append(builder, "_bucket{") ||
+          pgexporter_builder_append(builder, labels) ||
+          pgexporter_builder_append(builder, ",le=\"") ||
+          pgexporter_builder_append(builder, (char*)bucket_labels[i]) ||
+          pgexporter_builder_append(builder, "\"} ") ||
+          pgexporter_builder_append_ulong(builder, count) ||
+          pgexporter_builder_append_char(builder, '\n'))
+      {
+         return 1;
+      }
+   }
+
+   // The count is the one of the +Inf bucket, so the two always agree
+   if (pgexporter_builder_append(builder, name) ||
+       pgexporter_builder_append(builder, "_sum{") ||
+       pgexporter_builder_append(builder, labels) ||
+       pgexporter_builder_append(builder, "} ") ||
+       pgexporter_builder_append_double(builder, atomic_load_explicit(&histogram->sum, memory_order_relaxed) / 1e9) ||
+       pgexporter_builder_append_char(builder, '\n') ||
+       pgexporter_builder_append(builder, name) ||
+       pgexporter_builder_append(builder, "_count{") ||
+       pgexporter_builder_append(builder, labels) ||
+       pgexporter_builder_append(builder, "} ") ||
+       pgexporter_builder_append_ulong(builder, count) ||
+       pgexporter_builder_append_char(builder, '\n'))
+   {
+      return 1;
+   }
+
+   return 0;
+}
+
+static int
+output_queries(struct builder* builder, int type)
+{
+   char* collector = NULL;
+   char labels[MISC_LENGTH * 3];
+   unsigned long long value = 0;
+   struct stats_query* q = NULL;
+   struct stats* stats = (struct stats*)stats_shmem;
+   struct catalog* catalog = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+   catalog = pgexporter_catalog_get(config);
+
+   for (int server = 0; server < MIN(stats->number_of_servers, config->number_of_servers); server++)
+   {
+      for (int query = 0; query < stats->number_of_queries; query++)
+      {
+         if (query < NUMBER_OF_STATS_COLLECTORS)
+         {
+            collector = (char*)collector_labels[query];
+         }
+         else if (catalog != NULL && query - NUMBER_OF_STATS_COLLECTORS < catalog->number_of_metrics)
+         {
+            collector = catalog->prometheus[query - NUMBER_OF_STATS_COLLECTORS].tag;
+         }
+         else
+         {
+            continue;
+         }
+
+         q = &stats->queries[server * stats->number_of_queries + query];
+
+         // Only the queries that have run
+         if (atomic_load_explicit(&q->duration.count, memory_order_relaxed) == 0 &&
+             atomic_load_explicit(&q->errors, memory_order_relaxed) == 0)
+         {
+            continue;
+         }
+
+         snprintf(&labels[0], sizeof(labels), "collector=\"%s\",server=\"%s\"", collector, config->servers[server].name);
+
+         if (type == OUTPUT_DURATION)
+         {
+            if (output_histogram(builder, "pgexporter_self_query_duration_seconds", &labels[0], &q->duration))
+            {
+               return 1;
+            }
+            continue;
+         }
+
+         switch (type)
+         {
+            case OUTPUT_ROWS:
+               value = atomic_load_explicit(&q->rows, memory_order_relaxed);
+               break;
+            case OUTPUT_BYTES:
+               value = atomic_load_explicit(&q->bytes, memory_order_relaxed);
+               break;
+            default:
+               value = atomic_load_explicit(&q->errors, memory_order_relaxed);
+               break;
+         }
+
+         if (pgexporter_builder_append(builder, type == OUTPUT_ROWS ? "pgexporter_self_query_rows_total{" :
+                                       type == OUTPUT_BYTES ? "pgexporter_self_query_bytes_total{" :
+                                       "pgexporter_self_query_errors_total{") ||
+             pgexporter_builder_append(builder, &labels[0]) ||
+             pgexporter_builder_append(builder, "} ") ||
+             pgexporter_builder_append_ulong(builder, value) ||
+             pgexporter_builder_append_char(builder, '\n'))
+         {
+            return 1;
+         }
+      }
+   }
+
+   return 0;
+}
+
+static int
+output_memory(struct builder* builder, char* name, char* help, char* type, int value)
+{
+   struct stats* stats = (struct stats*)stats_shmem;
+
+   if (pgexporter_builder_append(builder, "# HELP ") ||
+       pgexporter_builder_append(builder, name) ||
+       pgexporter_builder_append_char(builder, ' ') ||
+       pgexporter_builder_append(builder, help) ||
+       pgexporter_builder_append(builder, "\n# TYPE ") ||
+       pgexporter_builder_append(builder, name) ||
+       pgexporter_builder_append_char(builder, ' ') ||
+       pgexporter_builder_append(builder, type) ||
+       pgexporter_builder_append_char(builder, '\n'))
+   {
+      return 1;
+   }
+
+   for (int i = 0; i < NUMBER_OF_MEMORY_SUBSYSTEMS; i++)
+   {
+      long long v = memory_value(&stats->memory[i], value);
+
+      if (pgexporter_builder_append(builder, name) ||
+          pgexporter_builder_append(builder, "{subsystem=\"") ||
+          pgexporter_builder_append(builder, (char*)memory_labels[i]) ||
+          pgexporter_builder_append(builder, "\"} ") ||
+          pgexporter_builder_append_ulong(builder, v > 0 ? (unsigned long long)v : 0) ||
+          pgexporter_builder_append_char(builder, '\n'))
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+static long long
+memory_value(struct stats_memory* memory, int value)
+{
+   switch (value)
+   {
+      case MEMORY_VALUE_BYTES:
+         return atomic_load_explicit(&memory->allocated_bytes, memory_order_relaxed) -
+                atomic_load_explicit(&memory->freed_bytes, memory_order_relaxed);
+      case MEMORY_VALUE_OBJECTS:
+         return atomic_load_explicit(&memory->allocations, memory_order_relaxed) -
+                atomic_load_explicit(&memory->frees, memory_order_relaxed);
+      case MEMORY_VALUE_PEAK:
+         return atomic_load_explicit(&memory->peak, memory_order_relaxed);
+      case MEMORY_VALUE_ALLOCATIONS:
+         return atomic_load_explicit(&memory->allocations, memory_order_relaxed);
+      default:
+         return atomic_load_explicit(&memory->allocated_bytes, memory_order_relaxed);
+   }
+}
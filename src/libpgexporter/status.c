@@ -33,10 +33,11 @@
 #include <management.h>
 #include <memory.h>
 #include <network.h>
+#include <stats.h>
 #include <status.h>
 #include <utils.h>
 
-void
+int
 pgexporter_status(SSL* ssl __attribute__((unused)), int client_fd, uint8_t compression, uint8_t encryption, struct json* payload)
 {
    char* elapsed = NULL;
@@ -47,9 +48,6 @@ pgexporter_status(SSL* ssl __attribute__((unused)), int client_fd, uint8_t compr
    struct json* servers = NULL;
    struct configuration* config;
 
-   pgexporter_memory_init();
-   pgexporter_start_logging();
-
    config = (struct configuration*)shmem;
 
    start_time = time(NULL);
@@ -69,7 +67,7 @@ pgexporter_status(SSL* ssl __attribute__((unused)), int client_fd, uint8_t compr
 
       pgexporter_json_create(&js);
 
-      pgexporter_json_put(js, MANAGEMENT_ARGUMENT_ACTIVE, (uintptr_t)config->servers[i].fd != -1 ? true : false, ValueBool);
+      pgexporter_json_put(js, MANAGEMENT_ARGUMENT_ACTIVE, (uintptr_t)config->server_states[i].connected, ValueBool);
       pgexporter_json_put(js, MANAGEMENT_ARGUMENT_SERVER, (uintptr_t)config->servers[i].name, ValueString);
 
       pgexporter_json_append(servers, (uintptr_t)js, ValueJSON);
@@ -91,28 +89,16 @@ pgexporter_status(SSL* ssl __attribute__((unused)), int client_fd, uint8_t compr
 
    pgexporter_log_info("Status (Elapsed: %s)", elapsed);
 
-   pgexporter_json_destroy(payload);
-
-   pgexporter_disconnect(client_fd);
-
-   pgexporter_stop_logging();
-   pgexporter_memory_destroy();
+   free(elapsed);
 
-   exit(0);
+   return 0;
 
 error:
 
-   pgexporter_json_destroy(payload);
-
-   pgexporter_disconnect(client_fd);
-
-   pgexporter_stop_logging();
-   pgexporter_memory_destroy();
-
-   exit(1);
+   return 1;
 }
 
-void
+int
 pgexporter_status_details(SSL* ssl __attribute__((unused)), int client_fd, uint8_t compression, uint8_t encryption, struct json* payload)
 {
    char* elapsed = NULL;
@@ -123,9 +109,6 @@ pgexporter_status_details(SSL* ssl __attribute__((unused)), int client_fd, uint8
    struct json* servers = NULL;
    struct configuration* config;
 
-   pgexporter_memory_init();
-   pgexporter_start_logging();
-
    config = (struct configuration*)shmem;
 
    start_time = time(NULL);
@@ -145,7 +128,7 @@ pgexporter_status_details(SSL* ssl __attribute__((unused)), int client_fd, uint8
 
       pgexporter_json_create(&js);
 
-      pgexporter_json_put(js, MANAGEMENT_ARGUMENT_ACTIVE, (uintptr_t)config->servers[i].fd != -1 ? true : false, ValueBool);
+      pgexporter_json_put(js, MANAGEMENT_ARGUMENT_ACTIVE, (uintptr_t)config->server_states[i].connected, ValueBool);
       pgexporter_json_put(js, MANAGEMENT_ARGUMENT_SERVER, (uintptr_t)config->servers[i].name, ValueString);
 
       pgexporter_json_append(servers, (uintptr_t)js, ValueJSON);
@@ -153,6 +136,14 @@ pgexporter_status_details(SSL* ssl __attribute__((unused)), int client_fd, uint8
 
    pgexporter_json_put(response, MANAGEMENT_ARGUMENT_SERVERS, (uintptr_t)servers, ValueJSON);
 
+   if (config->memory_accounting && pgexporter_stats_memory_json(response))
+   {
+      pgexporter_management_response_error(NULL, client_fd, NULL, MANAGEMENT_ERROR_ALLOCATION, compression, encryption, payload);
+      pgexporter_log_error("Status details: Error adding the memory accounting");
+
+      goto error;
+   }
+
    end_time = time(NULL);
 
    if (pgexporter_management_response_ok(NULL, client_fd, start_time, end_time, compression, encryption, payload))
@@ -167,23 +158,11 @@ pgexporter_status_details(SSL* ssl __attribute__((unused)), int client_fd, uint8
 
    pgexporter_log_info("Status details (Elapsed: %s)", elapsed);
 
-   pgexporter_json_destroy(payload);
-
-   pgexporter_disconnect(client_fd);
+   free(elapsed);
 
-   pgexporter_stop_logging();
-   pgexporter_memory_destroy();
-
-   exit(0);
+   return 0;
 
 error:
 
-   pgexporter_json_destroy(payload);
-
-   pgexporter_disconnect(client_fd);
-
-   pgexporter_stop_logging();
-   pgexporter_memory_destroy();
-
-   exit(1);
+   return 1;
 }
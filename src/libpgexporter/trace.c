@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <json.h>
+#include <logging.h>
+#include <management.h>
+#include <shmem.h>
+#include <stats.h>
+#include <trace.h>
+#include <utils.h>
+
+/* system */
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* kind_labels[NUMBER_OF_TRACE_KINDS] = {
+   "metrics", "collector", "bridge"
+};
+
+/* The trace of the process, only touched by the process that runs the scrape */
+static struct trace current;
+static atomic_bool running = false;
+static uint64_t origin = 0;
+static atomic_uint number_of_spans = 0;
+static atomic_int number_of_threads = 0;
+static atomic_uint generation = 0;
+
+/* The threads are numbered in the order they record their first span of a trace */
+static _Thread_local int thread = -1;
+static _Thread_local unsigned int thread_generation = 0;
+
+static int span_compare(const void* a, const void* b);
+static int trace_json(struct trace* trace, struct json** result);
+
+int
+pgexporter_trace_init(size_t* size, void** segment)
+{
+   size_t s;
+   struct traces* traces = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *size = 0;
+   *segment = NULL;
+
+   if (config->traces <= 0)
+   {
+      return 0;
+   }
+
+   s = sizeof(struct traces) + (size_t)config->traces * sizeof(struct trace);
+
+   if (pgexporter_create_shared_memory(s, config->hugepage, (void**)&traces))
+   {
+      return 1;
+   }
+
+   pgexporter_numa_shared_memory(traces, s, config->numa);
+
+   traces->number_of_traces = config->traces;
+   atomic_init(&traces->next, 0);
+
+   for (int i = 0; i < traces->number_of_traces; i++)
+   {
+      atomic_init(&traces->traces[i].sequence, 0);
+   }
+
+   *size = s;
+   *segment = traces;
+
+   return 0;
+}
+
+bool
+pgexporter_trace_start(int kind)
+{
+   if (trace_shmem == NULL || atomic_load_explicit(&running, memory_order_relaxed))
+   {
+      return false;
+   }
+
+   current.kind = kind;
+   current.pid = getpid();
+   current.timestamp = time(NULL);
+
+   origin = pgexporter_stats_now();
+   atomic_store(&number_of_spans, 0);
+   atomic_store(&number_of_threads, 0);
+   atomic_fetch_add(&generation, 1);
+   atomic_store(&running, true);
+
+   return true;
+}
+
+uint64_t
+pgexporter_trace_begin(void)
+{
+   if (!atomic_load_explicit(&running, memory_order_relaxed))
+   {
+      return 0;
+   }
+
+   return pgexporter_stats_now();
+}
+
+void
+pgexporter_trace_end(char* name, int server, uint64_t start)
+{
+   unsigned int index;
+   uint64_t now;
+   struct trace_span* span = NULL;
+
+   if (start == 0 || !atomic_load_explicit(&running, memory_order_relaxed))
+   {
+      return;
+   }
+
+   now = pgexporter_stats_now();
+
+   if (thread_generation != atomic_load_explicit(&generation, memory_order_relaxed))
+   {
+      thread_generation = atomic_load(&generation);
+      thread = atomic_fetch_add(&number_of_threads, 1);
+   }
+
+   index = atomic_fetch_add_explicit(&number_of_spans, 1, memory_order_relaxed);
+   span = &current.spans[index % TRACE_MAX_SPANS];
+
+   snprintf(&span->name[0], sizeof(span->name), "%s", name);
+   span->server = (int16_t)server;
+   span->thread = (int16_t)thread;
+   span->start = start > origin ? start - origin : 0;
+   span->duration = now - start;
+}
+
+void
+pgexporter_trace_finish(void)
+{
+   unsigned long id;
+   unsigned int n;
+   unsigned int first;
+   struct trace* trace = NULL;
+   struct traces* traces = (struct traces*)trace_shmem;
+
+   if (traces == NULL || !atomic_load(&running))
+   {
+      return;
+   }
+
+   atomic_store(&running, false);
+
+   n = atomic_load(&number_of_spans);
+
+   current.duration = pgexporter_stats_now() - origin;
+   current.number_of_spans = (int)MIN(n, TRACE_MAX_SPANS);
+   current.dropped = (int)(n - current.number_of_spans);
+
+   id = atomic_fetch_add(&traces->next, 1);
+   trace = &traces->traces[id % traces->number_of_traces];
+
+   /* Readers skip the trace while it is written */
+   atomic_store(&trace->sequence, 0);
+
+   trace->kind = current.kind;
+   trace->pid = current.pid;
+   trace->timestamp = current.timestamp;
+   trace->duration = current.duration;
+   trace->number_of_spans = current.number_of_spans;
+   trace->dropped = current.dropped;
+
+   /* The ring of the process wrapped around, so the oldest span is the next one */
+   first = n > TRACE_MAX_SPANS ? n % TRACE_MAX_SPANS : 0;
+
+   memcpy(&trace->spans[0], &current.spans[first], (current.number_of_spans - first) * sizeof(struct trace_span));
+   memcpy(&trace->spans[current.number_of_spans - first], &current.spans[0], first * sizeof(struct trace_span));
+
+   atomic_store(&trace->sequence, id + 1);
+}
+
+int
+pgexporter_trace(SSL* ssl __attribute__((unused)), int client_fd, uint8_t compression, uint8_t encryption, struct json* payload)
+{
+   char* elapsed = NULL;
+   time_t start_time;
+   time_t end_time;
+   int total_seconds;
+   unsigned long next;
+   unsigned long id;
+   struct trace* copy = NULL;
+   struct trace* trace = NULL;
+   struct json* response = NULL;
+   struct json* list = NULL;
+   struct json* js = NULL;
+   struct traces* traces = (struct traces*)trace_shmem;
+
+   start_time = time(NULL);
+
+   if (pgexporter_management_create_response(payload, -1, &response))
+   {
+      goto error;
+   }
+
+   if (pgexporter_json_create(&list))
+   {
+      goto error;
+   }
+
+   copy = (struct trace*)malloc(sizeof(struct trace));
+   if (copy == NULL)
+   {
+      goto error;
+   }
+
+   next = traces != NULL ? atomic_load(&traces->next) : 0;
+
+   for (unsigned long i = 0; traces != NULL && i < MIN(next, (unsigned long)traces->number_of_traces); i++)
+   {
+      id = next - 1 - i;
+      trace = &traces->traces[id % traces->number_of_traces];
+
+      if (atomic_load(&trace->sequence) != id + 1)
+      {
+         continue;
+      }
+
+      memcpy(copy, trace, offsetof(struct trace, spans) + MIN(trace->number_of_spans, TRACE_MAX_SPANS) * sizeof(struct trace_span));
+
+      /* Overwritten while it was copied */
+      if (atomic_load(&trace->sequence) != id + 1)
+      {
+         continue;
+      }
+
+      if (trace_json(copy, &js))
+      {
+         goto error;
+      }
+
+      pgexporter_json_append(list, (uintptr_t)js, ValueJSON);
+      js = NULL;
+   }
+
+   pgexporter_json_put(response, MANAGEMENT_ARGUMENT_TRACES, (uintptr_t)list, ValueJSON);
+   list = NULL;
+
+   end_time = time(NULL);
+
+   if (pgexporter_management_response_ok(NULL, client_fd, start_time, end_time, compression, encryption, payload))
+   {
+      pgexporter_management_response_error(NULL, client_fd, NULL, MANAGEMENT_ERROR_TRACE_NETWORK, compression, encryption, payload);
+      pgexporter_log_error("Trace: Error sending response");
+
+      goto error;
+   }
+
+   elapsed = pgexporter_get_timestamp_string(start_time, end_time, &total_seconds);
+
+   pgexporter_log_info("Trace (Elapsed: %s)", elapsed);
+
+   free(elapsed);
+   free(copy);
+
+   return 0;
+
+error:
+
+   pgexporter_json_destroy(list);
+   free(copy);
+
+   return 1;
+}
+
+static int
+span_compare(const void* a, const void* b)
+{
+   const struct trace_span* x = (const struct trace_span*)a;
+   const struct trace_span* y = (const struct trace_span*)b;
+
+   if (x->start != y->start)
+   {
+      return x->start < y->start ? -1 : 1;
+   }
+
+   // The enclosing span first
+   return x->duration > y->duration ? -1 : (x->duration < y->duration ? 1 : 0);
+}
+
+static int
+trace_json(struct trace* trace, struct json** result)
+{
+   char timestamp[64];
+   struct tm tm;
+   struct json* js = NULL;
+   struct json* spans = NULL;
+   struct json* span = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   *result = NULL;
+
+   if (pgexporter_json_create(&js) || pgexporter_json_create(&spans))
+   {
+      goto error;
+   }
+
+   localtime_r(&trace->timestamp, &tm);
+   strftime(&timestamp[0], sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+   pgexporter_json_put(js, MANAGEMENT_ARGUMENT_KIND, (uintptr_t)kind_labels[trace->kind], ValueString);
+   pgexporter_json_put(js, MANAGEMENT_ARGUMENT_PID, (uintptr_t)trace->pid, ValueInt32);
+   pgexporter_json_put(js, MANAGEMENT_ARGUMENT_TIMESTAMP, (uintptr_t)&timestamp[0], ValueString);
+   pgexporter_json_put(js, MANAGEMENT_ARGUMENT_DURATION, (uintptr_t)(trace->duration / 1000), ValueUInt64);
+   pgexporter_json_put(js, MANAGEMENT_ARGUMENT_DROPPED, (uintptr_t)trace->dropped, ValueInt32);
+
+   qsort(&trace->spans[0], trace->number_of_spans, sizeof(struct trace_span), span_compare);
+
+   for (int i = 0; i < trace->number_of_spans; i++)
+   {
+      struct trace_span* s = &trace->spans[i];
+
+      if (pgexporter_json_create(&span))
+      {
+         goto error;
+      }
+
+      s->name[TRACE_NAME_LENGTH - 1] = '\0';
+
+      pgexporter_json_put(span, MANAGEMENT_ARGUMENT_NAME, (uintptr_t)&s->name[0], ValueString);
+      pgexporter_json_put(span, MANAGEMENT_ARGUMENT_SERVER,
+                          (uintptr_t)(s->server >= 0 && s->server < config->number_of_servers ? config->servers[s->server].name : ""),
+                          ValueString);
+      pgexporter_json_put(span, MANAGEMENT_ARGUMENT_THREAD, (uintptr_t)s->thread, ValueInt32);
+      pgexporter_json_put(span, MANAGEMENT_ARGUMENT_START, (uintptr_t)(s->start / 1000), ValueUInt64);
+      pgexporter_json_put(span, MANAGEMENT_ARGUMENT_DURATION, (uintptr_t)(s->duration / 1000), ValueUInt64);
+
+      pgexporter_json_append(spans, (uintptr_t)span, ValueJSON);
+      span = NULL;
+   }
+
+   pgexporter_json_put(js, MANAGEMENT_ARGUMENT_SPANS, (uintptr_t)spans, ValueJSON);
+
+   *result = js;
+
+   return 0;
+
+error:
+
+   pgexporter_json_destroy(span);
+   pgexporter_json_destroy(spans);
+   pgexporter_json_destroy(js);
+
+   return 1;
+}
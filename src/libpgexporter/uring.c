@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2025 The pgexporter community
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ * of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or other
+ * materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* pgexporter */
+#include <pgexporter.h>
+#include <logging.h>
+#include <uring.h>
+
+/* system */
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(HAVE_LINUX) && defined(HAVE_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+static bool enabled = false;
+
+#if defined(HAVE_LINUX) && defined(HAVE_IO_URING)
+
+struct uring
+{
+   int fd;                     /**< The ring descriptor */
+   unsigned int entries;       /**< The number of submission entries */
+   atomic_uint* sq_head;       /**< The submission head */
+   atomic_uint* sq_tail;       /**< The submission tail */
+   unsigned int* sq_mask;      /**< The submission mask */
+   unsigned int* sq_array;     /**< The submission index array */
+   atomic_uint* cq_head;       /**< The completion head */
+   atomic_uint* cq_tail;       /**< The completion tail */
+   unsigned int* cq_mask;      /**< The completion mask */
+   struct io_uring_sqe* sqes;  /**< The submission entries */
+   struct io_uring_cqe* cqes;  /**< The completion entries */
+   void* sq_ring;              /**< The submission ring mapping */
+   size_t sq_ring_size;        /**< The size of the submission ring mapping */
+   void* cq_ring;              /**< The completion ring mapping */
+   size_t cq_ring_size;        /**< The size of the completion ring mapping */
+   size_t sqes_size;           /**< The size of the submission entries mapping */
+   void* buffer;               /**< The registered buffer */
+   size_t buffer_size;         /**< The size of the registered buffer */
+};
+
+static __thread struct uring* ring = NULL;
+
+static int uring_create(struct uring** r);
+static void uring_free(struct uring* r);
+static struct io_uring_sqe* uring_sqe(struct uring* r, unsigned int index);
+static int uring_submit(struct uring* r, unsigned int number, int* results);
+static void uring_drop(void);
+static bool uring_fixed(struct uring* r, void* buffer, size_t size);
+
+#endif
+
+bool
+pgexporter_uring_enable(char* engine)
+{
+#if defined(HAVE_LINUX) && defined(HAVE_IO_URING)
+   struct uring* r = NULL;
+
+   enabled = false;
+
+   if (engine == NULL || strcmp("iouring", engine))
+   {
+      return false;
+   }
+
+   if (uring_create(&r))
+   {
+      pgexporter_log_warn("io_uring not available: %s", strerror(errno));
+      return false;
+   }
+
+   uring_free(r);
+
+   enabled = true;
+#else
+   (void)engine;
+   enabled = false;
+#endif
+
+   return enabled;
+}
+
+void
+pgexporter_uring_init(void* buffer, size_t size)
+{
+#if defined(HAVE_LINUX) && defined(HAVE_IO_URING)
+   struct iovec iov;
+
+   if (!enabled || ring != NULL)
+   {
+      return;
+   }
+
+   if (uring_create(&ring))
+   {
+      ring = NULL;
+      return;
+   }
+
+   if (buffer != NULL && size > 0)
+   {
+      iov.iov_base = buffer;
+      iov.iov_len = size;
+
+      if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0)
+      {
+         ring->buffer = buffer;
+         ring->buffer_size = size;
+      }
+   }
+#else
+   (void)buffer;
+   (void)size;
+#endif
+}
+
+bool
+pgexporter_uring_available(void)
+{
+#if defined(HAVE_LINUX) && defined(HAVE_IO_URING)
+   return ring != NULL;
+#else
+   return false;
+#endif
+}
+
+ssize_t
+pgexporter_uring_read(int fd, void* buffer, size_t size, int timeout)
+{
+#if defined(HAVE_LINUX) && defined(HAVE_IO_URING)
+   struct io_uring_sqe* sqe = NULL;
+   struct __kernel_timespec ts;
+   struct iovec iov;
+   int results[2];
+
+   if (ring == NULL)
+   {
+      errno = ENOSYS;
+      return -1;
+   }
+
+   sqe = uring_sqe(ring, 0);
+   sqe->fd = fd;
+   sqe->len = (unsigned int)size;
+   sqe->addr = (unsigned long)buffer;
+   sqe->user_data = 0;
+
+   if (uring_fixed(ring, buffer, size))
+   {
+      sqe->opcode = IORING_OP_READ_FIXED;
+      sqe->buf_index = 0;
+   }
+   else
+   {
+      iov.iov_base = buffer;
+      iov.iov_len = size;
+
+      sqe->opcode = IORING_OP_READV;
+      sqe->addr = (unsigned long)&iov;
+      sqe->len = 1;
+   }
+
+   if (timeout > 0)
+   {
+      sqe->flags = IOSQE_IO_LINK;
+
+      ts.tv_sec = timeout;
+      ts.tv_nsec = 0;
+
+      sqe = uring_sqe(ring, 1);
+      sqe->opcode = IORING_OP_LINK_TIMEOUT;
+      sqe->fd = -1;
+      sqe->addr = (unsigned long)&ts;
+      sqe->len = 1;
+      sqe->user_data = 1;
+   }
+
+   if (uring_submit(ring, timeout > 0 ? 2 : 1, &results[0]))
+   {
+      uring_drop();
+      return -1;
+   }
+
+   if (results[0] >= 0)
+   {
+      return results[0];
+   }
+
+   errno = results[0] == -ECANCELED ? EAGAIN : -results[0];
+
+   return -1;
+#else
+   (void)fd;
+   (void)buffer;
+   (void)size;
+   (void)timeout;
+
+   errno = ENOSYS;
+   return -1;
+#endif
+}
+
+ssize_t
+pgexporter_uring_write(int fd, struct iovec* iov, int iovcnt)
+{
+#if defined(HAVE_LINUX) && defined(HAVE_IO_URING)
+   struct io_uring_sqe* sqe = NULL;
+   int number;
+   int results[URING_ENTRIES];
+   ssize_t total = 0;
+
+   if (ring == NULL)
+   {
+      errno = ENOSYS;
+      return -1;
+   }
+
+   number = iovcnt < (int)ring->entries ? iovcnt : (int)ring->entries;
+
+   if (number <= 0)
+   {
+      return 0;
+   }
+
+   for (int i = 0; i < number; i++)
+   {
+      sqe = uring_sqe(ring, i);
+      sqe->fd = fd;
+      sqe->user_data = i;
+
+      if (uring_fixed(ring, iov[i].iov_base, iov[i].iov_len))
+      {
+         sqe->opcode = IORING_OP_WRITE_FIXED;
+         sqe->addr = (unsigned long)iov[i].iov_base;
+         sqe->len = (unsigned int)iov[i].iov_len;
+         sqe->buf_index = 0;
+      }
+      else
+      {
+         sqe->opcode = IORING_OP_WRITEV;
+         sqe->addr = (unsigned long)&iov[i];
+         sqe->len = 1;
+      }
+
+      /* A short write breaks the link, so the stream stays in order */
+      if (i < number - 1)
+      {
+         sqe->flags = IOSQE_IO_LINK;
+      }
+   }
+
+   if (uring_submit(ring, number, &results[0]))
+   {
+      uring_drop();
+      return -1;
+   }
+
+   for (int i = 0; i < number; i++)
+   {
+      if (results[i] < 0)
+      {
+         if (total == 0)
+         {
+            errno = -results[i];
+            return -1;
+         }
+         break;
+      }
+
+      total += results[i];
+
+      if ((size_t)results[i] < iov[i].iov_len)
+      {
+         break;
+      }
+   }
+
+   return total;
+#else
+   (void)fd;
+   (void)iov;
+   (void)iovcnt;
+
+   errno = ENOSYS;
+   return -1;
+#endif
+}
+
+void
+pgexporter_uring_destroy(void)
+{
+#if defined(HAVE_LINUX) && defined(HAVE_IO_URING)
+   uring_free(ring);
+   ring = NULL;
+#endif
+}
+
+#if defined(HAVE_LINUX) && defined(HAVE_IO_URING)
+
+static int
+uring_create(struct uring** r)
+{
+   struct io_uring_params params;
+   struct uring* u = NULL;
+   int fd = -1;
+
+   *r = NULL;
+
+   memset(&params, 0, sizeof(struct io_uring_params));
+
+   fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+   if (fd < 0)
+   {
+      goto error;
+   }
+
+   /* Linked timeouts and stable submissions */
+   if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_SUBMIT_STABLE))
+   {
+      errno = ENOSYS;
+      goto error;
+   }
+
+   u = (struct uring*)calloc(1, sizeof(struct uring));
+   if (u == NULL)
+   {
+      goto error;
+   }
+
+   u->fd = fd;
+   u->entries = params.sq_entries;
+   u->sq_ring = MAP_FAILED;
+   u->cq_ring = MAP_FAILED;
+   u->sqes = MAP_FAILED;
+
+   u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+   u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+   u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+   if (u->sq_ring == MAP_FAILED)
+   {
+      goto error;
+   }
+
+   u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+   if (u->cq_ring == MAP_FAILED)
+   {
+      goto error;
+   }
+
+   u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+   if (u->sqes == MAP_FAILED)
+   {
+      goto error;
+   }
+
+   u->sq_head = (atomic_uint*)((char*)u->sq_ring + params.sq_off.head);
+   u->sq_tail = (atomic_uint*)((char*)u->sq_ring + params.sq_off.tail);
+   u->sq_mask = (unsigned int*)((char*)u->sq_ring + params.sq_off.ring_mask);
+   u->sq_array = (unsigned int*)((char*)u->sq_ring + params.sq_off.array);
+   u->cq_head = (atomic_uint*)((char*)u->cq_ring + params.cq_off.head);
+   u->cq_tail = (atomic_uint*)((char*)u->cq_ring + params.cq_off.tail);
+   u->cq_mask = (unsigned int*)((char*)u->cq_ring + params.cq_off.ring_mask);
+   u->cqes = (struct io_uring_cqe*)((char*)u->cq_ring + params.cq_off.cqes);
+
+   *r = u;
+
+   return 0;
+
+error:
+
+   if (u != NULL)
+   {
+      uring_free(u);
+   }
+   else if (fd != -1)
+   {
+      close(fd);
+   }
+
+   return 1;
+}
+
+static void
+uring_free(struct uring* r)
+{
+   if (r == NULL)
+   {
+      return;
+   }
+
+   if (r->sqes != MAP_FAILED)
+   {
+      munmap(r->sqes, r->sqes_size);
+   }
+
+   if (r->cq_ring != MAP_FAILED)
+   {
+      munmap(r->cq_ring, r->cq_ring_size);
+   }
+
+   if (r->sq_ring != MAP_FAILED)
+   {
+      munmap(r->sq_ring, r->sq_ring_size);
+   }
+
+   if (r->fd != -1)
+   {
+      close(r->fd);
+   }
+
+   free(r);
+}
+
+static struct io_uring_sqe*
+uring_sqe(struct uring* r, unsigned int index)
+{
+   unsigned int tail;
+   unsigned int slot;
+   struct io_uring_sqe* sqe = NULL;
+
+   tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed) + index;
+   slot = tail & *r->sq_mask;
+
+   sqe = &r->sqes[slot];
+   memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+   r->sq_array[slot] = slot;
+
+   return sqe;
+}
+
+static int
+uring_submit(struct uring* r, unsigned int number, int* results)
+{
+   unsigned int tail;
+   unsigned int head;
+   unsigned int completed = 0;
+   unsigned int submit = number;
+   struct io_uring_cqe* cqe = NULL;
+   long ret;
+
+   tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+   atomic_store_explicit(r->sq_tail, tail + number, memory_order_release);
+
+   while (completed < number)
+   {
+      ret = syscall(__NR_io_uring_enter, r->fd, submit, number - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+
+      /* The submission is consumed by the call, even if the wait is interrupted */
+      if (atomic_load_explicit(r->sq_head, memory_order_acquire) == tail + number)
+      {
+         submit = 0;
+      }
+
+      if (ret < 0 && errno != EINTR)
+      {
+         if (atomic_load_explicit(r->sq_head, memory_order_acquire) == tail)
+         {
+            atomic_store_explicit(r->sq_tail, tail, memory_order_release);
+         }
+
+         return 1;
+      }
+
+      head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+
+      while (head != atomic_load_explicit(r->cq_tail, memory_order_acquire))
+      {
+         cqe = &r->cqes[head & *r->cq_mask];
+
+         if (cqe->user_data < number)
+         {
+            results[cqe->user_data] = cqe->res;
+            completed++;
+         }
+
+         head++;
+      }
+
+      atomic_store_explicit(r->cq_head, head, memory_order_release);
+   }
+
+   return 0;
+}
+
+static void
+uring_drop(void)
+{
+   int error = errno;
+
+   /* Submitted requests may still complete, so the ring isn't used again */
+   uring_free(ring);
+   ring = NULL;
+
+   errno = error;
+}
+
+static bool
+uring_fixed(struct uring* r, void* buffer, size_t size)
+{
+   char* start = (char*)r->buffer;
+   char* b = (char*)buffer;
+
+   return start != NULL && b >= start && b + size <= start + r->buffer_size;
+}
+
+#endif
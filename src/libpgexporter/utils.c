@@ -30,6 +30,7 @@
 #include <pgexporter.h>
 #include <logging.h>
 #include <utils.h>
+#include <value.h>
 
 /* system */
 #include <dirent.h>
@@ -38,6 +39,7 @@
 #include <ev.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <math.h>
 #include <pwd.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -46,6 +48,7 @@
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
+#include <openssl/evp.h>
 #include <openssl/pem.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
@@ -73,6 +76,9 @@ static int string_compare(const void* a, const void* b);
 
 static bool is_wal_file(char* file);
 
+struct base64_stream;
+static int base64_stream_code(struct base64_stream* s, unsigned char* data, size_t length, struct builder* output);
+
 int32_t
 pgexporter_get_request(struct message* msg)
 {
@@ -407,6 +413,16 @@ pgexporter_write_uint8(void* data, uint8_t b)
    *((uint8_t*)(data)) = b;
 }
 
+void
+pgexporter_write_int16(void* data, int16_t i)
+{
+   char* ptr = (char*)&i;
+
+   *((char*)(data + 1)) = *ptr;
+   ptr++;
+   *((char*)(data)) = *ptr;
+}
+
 void
 pgexporter_write_int32(void* data, int32_t i)
 {
@@ -800,6 +816,146 @@ error:
    return 1;
 }
 
+struct base64_stream
+{
+   bool encode;             /**< Encode or decode */
+   unsigned char rest[4];   /**< The data left from the previous update */
+   size_t rest_length;      /**< The length of the data left */
+};
+
+int
+pgexporter_base64_stream_create(bool encode, void** stream)
+{
+   struct base64_stream* s = NULL;
+
+   *stream = NULL;
+
+   s = (struct base64_stream*)calloc(1, sizeof(struct base64_stream));
+   if (s == NULL)
+   {
+      return 1;
+   }
+
+   s->encode = encode;
+
+   *stream = s;
+
+   return 0;
+}
+
+int
+pgexporter_base64_stream_update(void* stream, void* data, size_t length, bool finish, struct builder* output)
+{
+   size_t group;
+   size_t size;
+   unsigned char* in = (unsigned char*)data;
+   struct base64_stream* s = (struct base64_stream*)stream;
+
+   // Whole groups are coded directly from the input, the rest is kept for the next update
+   group = s->encode ? 3 : 4;
+
+   while (s->rest_length > 0 && s->rest_length < group && length > 0)
+   {
+      s->rest[s->rest_length++] = *in++;
+      length--;
+   }
+
+   if (s->rest_length == group || (finish && s->rest_length > 0 && s->encode))
+   {
+      if (base64_stream_code(s, s->rest, s->rest_length, output))
+      {
+         goto error;
+      }
+      s->rest_length = 0;
+   }
+
+   while (length >= group)
+   {
+      size = MIN(length - (length % group), group * 16384);
+
+      if (base64_stream_code(s, in, size, output))
+      {
+         goto error;
+      }
+
+      in += size;
+      length -= size;
+   }
+
+   if (length > 0)
+   {
+      if (finish && s->encode)
+      {
+         if (base64_stream_code(s, in, length, output))
+         {
+            goto error;
+         }
+      }
+      else
+      {
+         memcpy(&s->rest[0], in, length);
+         s->rest_length = length;
+      }
+   }
+
+   if (finish && s->rest_length > 0)
+   {
+      // An encoded stream is always a number of whole groups
+      goto error;
+   }
+
+   return 0;
+
+error:
+
+   return 1;
+}
+
+void
+pgexporter_base64_stream_destroy(void* stream)
+{
+   free(stream);
+}
+
+static int
+base64_stream_code(struct base64_stream* s, unsigned char* data, size_t length, struct builder* output)
+{
+   int n;
+
+   if (pgexporter_builder_reserve(output, ((length + 3) / 3) * 4))
+   {
+      return 1;
+   }
+
+   if (s->encode)
+   {
+      n = EVP_EncodeBlock((unsigned char*)output->data + output->length, data, (int)length);
+   }
+   else
+   {
+      n = EVP_DecodeBlock((unsigned char*)output->data + output->length, data, (int)length);
+
+      if (n >= 0 && length > 0 && data[length - 1] == '=')
+      {
+         n--;
+      }
+      if (n >= 0 && length > 1 && data[length - 2] == '=')
+      {
+         n--;
+      }
+   }
+
+   if (n < 0)
+   {
+      return 1;
+   }
+
+   output->length += n;
+   output->data[output->length] = '\0';
+
+   return 0;
+}
+
 void
 pgexporter_set_proc_title(int argc, char** argv, char* s1, char* s2)
 {
@@ -1087,6 +1243,226 @@ pgexporter_append_char(char* orig, char c)
    return orig;
 }
 
+int
+pgexporter_builder_init(struct builder* builder, size_t capacity)
+{
+   builder->data = NULL;
+   builder->length = 0;
+   builder->capacity = 0;
+
+   return pgexporter_builder_reserve(builder, capacity);
+}
+
+int
+pgexporter_builder_reserve(struct builder* builder, size_t length)
+{
+   size_t capacity;
+   char* data = NULL;
+
+   // room for the zero termination
+   if (builder->data != NULL && builder->length + length + 1 <= builder->capacity)
+   {
+      return 0;
+   }
+
+   capacity = builder->capacity > 0 ? builder->capacity : 64;
+
+   while (capacity < builder->length + length + 1)
+   {
+      capacity *= 2;
+   }
+
+   data = (char*)realloc(builder->data, capacity);
+   if (data == NULL)
+   {
+      pgexporter_log_error("realloc failed for string builder");
+      return 1;
+   }
+
+   data[builder->length] = '\0';
+
+   builder->data = data;
+   builder->capacity = capacity;
+
+   return 0;
+}
+
+int
+pgexporter_builder_append(struct builder* builder, char* s)
+{
+   if (s == NULL)
+   {
+      return 0;
+   }
+
+   return pgexporter_builder_append_length(builder, s, strlen(s));
+}
+
+int
+pgexporter_builder_append_length(struct builder* builder, char* s, size_t length)
+{
+   if (pgexporter_builder_reserve(builder, length))
+   {
+      return 1;
+   }
+
+   memcpy(builder->data + builder->length, s, length);
+   builder->length += length;
+   builder->data[builder->length] = '\0';
+
+   return 0;
+}
+
+int
+pgexporter_builder_append_char(struct builder* builder, char c)
+{
+   if (pgexporter_builder_reserve(builder, 1))
+   {
+      return 1;
+   }
+
+   builder->data[builder->length++] = c;
+   builder->data[builder->length] = '\0';
+
+   return 0;
+}
+
+int
+pgexporter_builder_append_int(struct builder* builder, int64_t i)
+{
+   if (i < 0)
+   {
+      if (pgexporter_builder_append_char(builder, '-'))
+      {
+         return 1;
+      }
+
+      // negate as unsigned, so INT64_MIN works
+      return pgexporter_builder_append_ulong(builder, (uint64_t)0 - (uint64_t)i);
+   }
+
+   return pgexporter_builder_append_ulong(builder, (uint64_t)i);
+}
+
+int
+pgexporter_builder_append_ulong(struct builder* builder, uint64_t l)
+{
+   char digits[20];
+   int n = 0;
+
+   do
+   {
+      digits[n++] = (char)('0' + (l % 10));
+      l /= 10;
+   }
+   while (l > 0);
+
+   if (pgexporter_builder_reserve(builder, n))
+   {
+      return 1;
+   }
+
+   while (n > 0)
+   {
+      builder->data[builder->length++] = digits[--n];
+   }
+   builder->data[builder->length] = '\0';
+
+   return 0;
+}
+
+int
+pgexporter_builder_append_double(struct builder* builder, double d)
+{
+   int n;
+
+   // Whole numbers, like counters, don't need to be formatted
+   if (d >= -9007199254740992.0 && d <= 9007199254740992.0 && d == (double)(int64_t)d && (d != 0.0 || !signbit(d)))
+   {
+      if (pgexporter_builder_append_int(builder, (int64_t)d))
+      {
+         return 1;
+      }
+
+      return pgexporter_builder_append_length(builder, ".000000", 7);
+   }
+
+   if (pgexporter_builder_reserve(builder, VALUE_FORMAT_SIZE))
+   {
+      return 1;
+   }
+
+   n = pgexporter_value_format_double(d, builder->data + builder->length);
+   if (n > 0)
+   {
+      builder->length += n;
+      return 0;
+   }
+
+   n = snprintf(builder->data + builder->length, builder->capacity - builder->length, "%f", d);
+
+   if (n < 0)
+   {
+      builder->data[builder->length] = '\0';
+      return 1;
+   }
+
+   if ((size_t)n >= builder->capacity - builder->length)
+   {
+      // a very large value, so format it again with enough room
+      if (pgexporter_builder_reserve(builder, n))
+      {
+         return 1;
+      }
+
+      snprintf(builder->data + builder->length, builder->capacity - builder->length, "%f", d);
+   }
+
+   builder->length += n;
+
+   return 0;
+}
+
+int
+pgexporter_builder_indent(struct builder* builder, char* tag, int indent)
+{
+   if (indent > 0)
+   {
+      if (pgexporter_builder_reserve(builder, indent))
+      {
+         return 1;
+      }
+
+      memset(builder->data + builder->length, ' ', indent);
+      builder->length += indent;
+      builder->data[builder->length] = '\0';
+   }
+
+   return pgexporter_builder_append(builder, tag);
+}
+
+char*
+pgexporter_builder_detach(struct builder* builder)
+{
+   char* data = builder->data;
+
+   builder->data = NULL;
+   builder->length = 0;
+   builder->capacity = 0;
+
+   return data;
+}
+
+void
+pgexporter_builder_destroy(struct builder* builder)
+{
+   free(builder->data);
+
+   builder->data = NULL;
+   builder->length = 0;
+   builder->capacity = 0;
+}
+
 char*
 pgexporter_indent(char* str, char* tag, int indent)
 {
@@ -2727,3 +3103,18 @@ error:
    return 1;
 #endif
 }
+
+int
+pgexporter_thread_create(pthread_t* thread, void* (*routine)(void*), void* arg, char* name)
+{
+   int ret;
+
+   /* pthread_create() returns the error instead of setting errno */
+   ret = pthread_create(thread, NULL, routine, arg);
+   if (ret != 0)
+   {
+      pgexporter_log_warn("Unable to create %s: %s", name, strerror(ret));
+   }
+
+   return ret;
+}
@@ -61,6 +61,49 @@ static char* deque_to_string_cb(uintptr_t data, int32_t format, char* tag, int i
 static char* art_to_string_cb(uintptr_t data, int32_t format, char* tag, int indent);
 static char* json_to_string_cb(uintptr_t data, int32_t format, char* tag, int indent);
 static char* mem_to_string_cb(uintptr_t data, int32_t format, char* tag, int indent);
+static char* scalar_to_string(enum value_type type, uintptr_t data, char* tag, int indent);
+static size_t format_uint(uint64_t v, char* buf);
+static size_t format_int(int64_t v, char* buf);
+static size_t format_double(double d, char* buf);
+
+static const char digit_pairs[] =
+   "00010203040506070809"
+   "10111213141516171819"
+   "20212223242526272829"
+   "30313233343536373839"
+   "40414243444546474849"
+   "50515253545556575859"
+   "60616263646566676869"
+   "70717273747576777879"
+   "80818283848586878889"
+   "90919293949596979899";
+
+static const data_to_string_cb to_string_callbacks[] = {
+   [ValueInt8] = int8_to_string_cb,
+   [ValueUInt8] = uint8_to_string_cb,
+   [ValueInt16] = int16_to_string_cb,
+   [ValueUInt16] = uint16_to_string_cb,
+   [ValueInt32] = int32_to_string_cb,
+   [ValueUInt32] = uint32_to_string_cb,
+   [ValueInt64] = int64_to_string_cb,
+   [ValueUInt64] = uint64_to_string_cb,
+   [ValueChar] = char_to_string_cb,
+   [ValueBool] = bool_to_string_cb,
+   [ValueString] = string_to_string_cb,
+   [ValueStringRef] = string_to_string_cb,
+   [ValueFloat] = float_to_string_cb,
+   [ValueDouble] = double_to_string_cb,
+   [ValueBASE64] = string_to_string_cb,
+   [ValueBASE64Ref] = string_to_string_cb,
+   [ValueJSON] = json_to_string_cb,
+   [ValueJSONRef] = json_to_string_cb,
+   [ValueDeque] = deque_to_string_cb,
+   [ValueDequeRef] = deque_to_string_cb,
+   [ValueART] = art_to_string_cb,
+   [ValueARTRef] = art_to_string_cb,
+   [ValueRef] = mem_to_string_cb,
+   [ValueMem] = mem_to_string_cb,
+};
 
 int
 pgexporter_value_create(enum value_type type, uintptr_t data, struct value** value)
@@ -71,83 +114,38 @@ pgexporter_value_create(enum value_type type, uintptr_t data, struct value** val
    {
       goto error;
    }
+   pgexporter_value_init(type, data, val);
+   *value = val;
+   return 0;
+
+error:
+   return 1;
+}
+
+void
+pgexporter_value_init(enum value_type type, uintptr_t data, struct value* val)
+{
    val->data = 0;
    val->type = type;
-   switch (type)
+   if ((size_t)type < sizeof(to_string_callbacks) / sizeof(to_string_callbacks[0]))
    {
-      case ValueInt8:
-         val->to_string = int8_to_string_cb;
-         break;
-      case ValueUInt8:
-         val->to_string = uint8_to_string_cb;
-         break;
-      case ValueInt16:
-         val->to_string = int16_to_string_cb;
-         break;
-      case ValueUInt16:
-         val->to_string = uint16_to_string_cb;
-         break;
-      case ValueInt32:
-         val->to_string = int32_to_string_cb;
-         break;
-      case ValueUInt32:
-         val->to_string = uint32_to_string_cb;
-         break;
-      case ValueInt64:
-         val->to_string = int64_to_string_cb;
-         break;
-      case ValueUInt64:
-         val->to_string = uint64_to_string_cb;
-         break;
-      case ValueFloat:
-         val->to_string = float_to_string_cb;
-         break;
-      case ValueDouble:
-         val->to_string = double_to_string_cb;
-         break;
-      case ValueBool:
-         val->to_string = bool_to_string_cb;
-         break;
-      case ValueChar:
-         val->to_string = char_to_string_cb;
-         break;
-      case ValueString:
-      case ValueBASE64:
-      case ValueStringRef:
-      case ValueBASE64Ref:
-         val->to_string = string_to_string_cb;
-         break;
-      case ValueJSON:
-      case ValueJSONRef:
-         val->to_string = json_to_string_cb;
-         break;
-      case ValueDeque:
-      case ValueDequeRef:
-         val->to_string = deque_to_string_cb;
-         break;
-      case ValueART:
-      case ValueARTRef:
-         val->to_string = art_to_string_cb;
-         break;
-      case ValueMem:
-      case ValueRef:
-         val->to_string = mem_to_string_cb;
-         break;
-      default:
-         val->to_string = noop_to_string_cb;
-         break;
+      val->to_string = to_string_callbacks[type];
+   }
+   else
+   {
+      val->to_string = noop_to_string_cb;
    }
    switch (type)
    {
       case ValueString:
       {
-         val->data = (uintptr_t)pgexporter_append(NULL, (char*)data);
+         val->data = data != 0 ? (uintptr_t)pgexporter_append(NULL, (char*)data) : 0;
          val->destroy_data = free_destroy_cb;
          break;
       }
       case ValueBASE64:
       {
-         val->data = (uintptr_t)pgexporter_append(NULL, (char*)data);
+         val->data = data != 0 ? (uintptr_t)pgexporter_append(NULL, (char*)data) : 0;
          val->destroy_data = free_destroy_cb;
          break;
       }
@@ -172,11 +170,6 @@ pgexporter_value_create(enum value_type type, uintptr_t data, struct value** val
          val->destroy_data = noop_destroy_cb;
          break;
    }
-   *value = val;
-   return 0;
-
-error:
-   return 1;
 }
 
 int
@@ -200,6 +193,16 @@ pgexporter_value_create_with_config(uintptr_t data, struct value_config* config,
    return 0;
 }
 
+void
+pgexporter_value_release(struct value* value)
+{
+   if (value == NULL)
+   {
+      return;
+   }
+   value->destroy_data(value->data);
+}
+
 int
 pgexporter_value_destroy(struct value* value)
 {
@@ -225,7 +228,87 @@ pgexporter_value_data(struct value* value)
 char*
 pgexporter_value_to_string(struct value* value, int32_t format, char* tag, int indent)
 {
-   return value->to_string(value->data, format, tag, indent);
+   // Only a ValueRef can have a custom callback, so the scalars are formatted directly
+   switch (value->type)
+   {
+      case ValueInt8:
+      case ValueUInt8:
+      case ValueInt16:
+      case ValueUInt16:
+      case ValueInt32:
+      case ValueUInt32:
+      case ValueInt64:
+      case ValueUInt64:
+      case ValueChar:
+      case ValueBool:
+      case ValueFloat:
+      case ValueDouble:
+         return scalar_to_string(value->type, value->data, tag, indent);
+      default:
+         return value->to_string(value->data, format, tag, indent);
+   }
+}
+
+size_t
+pgexporter_value_format(enum value_type type, uintptr_t data, char* buf)
+{
+   size_t n = 0;
+
+   switch (type)
+   {
+      case ValueInt8:
+         return format_int((int8_t)data, buf);
+      case ValueUInt8:
+         return format_uint((uint8_t)data, buf);
+      case ValueInt16:
+         return format_int((int16_t)data, buf);
+      case ValueUInt16:
+         return format_uint((uint16_t)data, buf);
+      case ValueInt32:
+         return format_int((int32_t)data, buf);
+      case ValueUInt32:
+         return format_uint((uint32_t)data, buf);
+      case ValueInt64:
+         return format_int((int64_t)data, buf);
+      case ValueUInt64:
+         return format_uint((uint64_t)data, buf);
+      case ValueChar:
+         buf[0] = '\'';
+         buf[1] = (char)data;
+         buf[2] = '\'';
+         buf[3] = '\0';
+         return 3;
+      case ValueBool:
+         if ((bool)data)
+         {
+            memcpy(buf, "true", 5);
+            return 4;
+         }
+         memcpy(buf, "false", 6);
+         return 5;
+      case ValueFloat:
+         n = format_double(pgexporter_value_to_float(data), buf);
+         if (n == 0)
+         {
+            n = snprintf(buf, VALUE_FORMAT_SIZE, "%f", pgexporter_value_to_float(data));
+         }
+         return n < VALUE_FORMAT_SIZE ? n : 0;
+      case ValueDouble:
+         n = format_double(pgexporter_value_to_double(data), buf);
+         if (n == 0)
+         {
+            n = snprintf(buf, VALUE_FORMAT_SIZE, "%f", pgexporter_value_to_double(data));
+         }
+         return n < VALUE_FORMAT_SIZE ? n : 0;
+      default:
+         return 0;
+   }
+}
+
+size_t
+pgexporter_value_format_double(double d, char* buf)
+{
+   return format_double(d, buf);
 }
 
 uintptr_t
@@ -405,131 +488,61 @@ noop_to_string_cb(uintptr_t data, int32_t format, char* tag, int indent)
 static char*
 int8_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char* tag, int indent)
 {
-   char* ret = NULL;
-   char buf[MISC_LENGTH];
-
-   ret = pgexporter_indent(ret, tag, indent);
-   memset(buf, 0, MISC_LENGTH);
-   snprintf(buf, MISC_LENGTH, "%" PRId8, (int8_t)data);
-   ret = pgexporter_append(ret, buf);
-   return ret;
+   return scalar_to_string(ValueInt8, data, tag, indent);
 }
 
 static char*
 uint8_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char* tag, int indent)
 {
-   char* ret = NULL;
-   char buf[MISC_LENGTH];
-   ret = pgexporter_indent(ret, tag, indent);
-   memset(buf, 0, MISC_LENGTH);
-   snprintf(buf, MISC_LENGTH, "%" PRIu8, (uint8_t)data);
-   ret = pgexporter_append(ret, buf);
-   return ret;
+   return scalar_to_string(ValueUInt8, data, tag, indent);
 }
 
 static char*
 int16_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char* tag, int indent)
 {
-   char* ret = NULL;
-   char buf[MISC_LENGTH];
-
-   ret = pgexporter_indent(ret, tag, indent);
-   memset(buf, 0, MISC_LENGTH);
-   snprintf(buf, MISC_LENGTH, "%" PRId16, (int16_t)data);
-   ret = pgexporter_append(ret, buf);
-   return ret;
+   return scalar_to_string(ValueInt16, data, tag, indent);
 }
 
 static char*
 uint16_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char* tag, int indent)
 {
-   char* ret = NULL;
-   char buf[MISC_LENGTH];
-
-   ret = pgexporter_indent(ret, tag, indent);
-   memset(buf, 0, MISC_LENGTH);
-   snprintf(buf, MISC_LENGTH, "%" PRIu16, (uint16_t)data);
-   ret = pgexporter_append(ret, buf);
-   return ret;
+   return scalar_to_string(ValueUInt16, data, tag, indent);
 }
 
 static char*
 int32_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char* tag, int indent)
 {
-   char* ret = NULL;
-   char buf[MISC_LENGTH];
-
-   ret = pgexporter_indent(ret, tag, indent);
-   memset(buf, 0, MISC_LENGTH);
-   snprintf(buf, MISC_LENGTH, "%" PRId32, (int32_t)data);
-   ret = pgexporter_append(ret, buf);
-   return ret;
+   return scalar_to_string(ValueInt32, data, tag, indent);
 }
 
 static char*
 uint32_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char* tag, int indent)
 {
-   char* ret = NULL;
-   char buf[MISC_LENGTH];
-
-   ret = pgexporter_indent(ret, tag, indent);
-   memset(buf, 0, MISC_LENGTH);
-   snprintf(buf, MISC_LENGTH, "%" PRIu32, (uint32_t)data);
-   ret = pgexporter_append(ret, buf);
-   return ret;
+   return scalar_to_string(ValueUInt32, data, tag, indent);
 }
 
 static char*
 int64_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char* tag, int indent)
 {
-   char* ret = NULL;
-   char buf[MISC_LENGTH];
-
-   ret = pgexporter_indent(ret, tag, indent);
-   memset(buf, 0, MISC_LENGTH);
-   snprintf(buf, MISC_LENGTH, "%" PRId64, (int64_t)data);
-   ret = pgexporter_append(ret, buf);
-   return ret;
+   return scalar_to_string(ValueInt64, data, tag, indent);
 }
 
 static char*
 uint64_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char* tag, int indent)
 {
-   char* ret = NULL;
-   char buf[MISC_LENGTH];
-
-   ret = pgexporter_indent(ret, tag, indent);
-   memset(buf, 0, MISC_LENGTH);
-   snprintf(buf, MISC_LENGTH, "%" PRIu64, (uint64_t)data);
-   ret = pgexporter_append(ret, buf);
-   return ret;
+   return scalar_to_string(ValueUInt64, data, tag, indent);
 }
 
 static char*
 float_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char* tag, int indent)
 {
-   char* ret = NULL;
-   char buf[MISC_LENGTH];
-
-   ret = pgexporter_indent(ret, tag, indent);
-   memset(buf, 0, MISC_LENGTH);
-   snprintf(buf, MISC_LENGTH, "%f", pgexporter_value_to_float(data));
-   ret = pgexporter_append(ret, buf);
-   return ret;
+   return scalar_to_string(ValueFloat, data, tag, indent);
 }
 
 static char*
 double_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char* tag, int indent)
 {
-   char* ret = NULL;
-   char buf[MISC_LENGTH];
-
-   ret = pgexporter_indent(ret, tag, indent);
-   memset(buf, 0, MISC_LENGTH);
-   snprintf(buf, MISC_LENGTH, "%f", pgexporter_value_to_double(data));
-   ret = pgexporter_append(ret, buf);
-
-   return ret;
+   return scalar_to_string(ValueDouble, data, tag, indent);
 }
 
 static char*
@@ -580,25 +593,13 @@ string_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char
 static char*
 bool_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char* tag, int indent)
 {
-   char* ret = NULL;
-   bool val = (bool) data;
-   ret = pgexporter_indent(ret, tag, indent);
-   ret = pgexporter_append(ret, val?"true":"false");
-   return ret;
+   return scalar_to_string(ValueBool, data, tag, indent);
 }
 
 static char*
 char_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char* tag, int indent)
 {
-   char* ret = NULL;
-   char buf[MISC_LENGTH];
-
-   ret = pgexporter_indent(ret, tag, indent);
-   memset(buf, 0, MISC_LENGTH);
-   snprintf(buf, MISC_LENGTH, "'%c'", (char)data);
-   ret = pgexporter_append(ret, buf);
-
-   return ret;
+   return scalar_to_string(ValueChar, data, tag, indent);
 }
 
 static char*
@@ -631,4 +632,209 @@ mem_to_string_cb(uintptr_t data, int32_t format __attribute__((unused)), char* t
    ret = pgexporter_append(ret, buf);
 
    return ret;
-}
\ No newline at end of file
+}
+
+static char*
+scalar_to_string(enum value_type type, uintptr_t data, char* tag, int indent)
+{
+   char buf[VALUE_FORMAT_SIZE];
+   char* large = NULL;
+   char* str = buf;
+   char* ret = NULL;
+   size_t tag_length = tag != NULL ? strlen(tag) : 0;
+   size_t length = 0;
+   size_t prefix = 0;
+
+   length = pgexporter_value_format(type, data, buf);
+
+   if (length == 0)
+   {
+      // A float or a double too large for the buffer
+      large = pgexporter_append(NULL, "");
+      large = pgexporter_format_and_append(large, "%f", type == ValueFloat ? (double)pgexporter_value_to_float(data) : pgexporter_value_to_double(data));
+      if (large == NULL)
+      {
+         return NULL;
+      }
+      str = large;
+      length = strlen(large);
+   }
+
+   prefix = (indent > 0 ? (size_t)indent : 0) + tag_length;
+
+   // The indent, the tag and the value are put into the string at once
+   ret = malloc(prefix + length + 1);
+   if (ret != NULL)
+   {
+      memset(ret, ' ', prefix - tag_length);
+      if (tag_length > 0)
+      {
+         memcpy(ret + prefix - tag_length, tag, tag_length);
+      }
+      memcpy(ret + prefix, str, length);
+      ret[prefix + length] = '\0';
+   }
+
+   free(large);
+
+   return ret;
+}
+
+static size_t
+format_uint(uint64_t v, char* buf)
+{
+   size_t n = 1;
+   uint64_t t = v;
+   char* p = NULL;
+
+   // Four digits are counted per division
+   for (;;)
+   {
+      if (t < 10)
+      {
+         break;
+      }
+      if (t < 100)
+      {
+         n += 1;
+         break;
+      }
+      if (t < 1000)
+      {
+         n += 2;
+         break;
+      }
+      if (t < 10000)
+      {
+         n += 3;
+         break;
+      }
+      t /= 10000;
+      n += 4;
+   }
+
+   p = buf + n;
+   *p = '\0';
+
+   // Two digits are written per division
+   while (v >= 100)
+   {
+      size_t i = (v % 100) * 2;
+      v /= 100;
+      *--p = digit_pairs[i + 1];
+      *--p = digit_pairs[i];
+   }
+
+   if (v < 10)
+   {
+      *--p = (char)('0' + v);
+   }
+   else
+   {
+      *--p = digit_pairs[v * 2 + 1];
+      *--p = digit_pairs[v * 2];
+   }
+
+   return n;
+}
+
+static size_t
+format_int(int64_t v, char* buf)
+{
+   if (v < 0)
+   {
+      buf[0] = '-';
+      // negate as unsigned, so INT64_MIN works
+      return 1 + format_uint((uint64_t)0 - (uint64_t)v, buf + 1);
+   }
+
+   return format_uint((uint64_t)v, buf);
+}
+
+static size_t
+format_double(double d, char* buf)
+{
+#ifdef __SIZEOF_INT128__
+   uint64_t bits;
+   uint64_t mantissa;
+   uint64_t whole;
+   uint64_t fraction;
+   int exponent;
+   int shift;
+   bool negative;
+   unsigned __int128 scaled;
+   unsigned __int128 rest;
+   unsigned __int128 half;
+   size_t n = 0;
+
+   memcpy(&bits, &d, sizeof(bits));
+
+   negative = (bits >> 63) != 0;
+   exponent = (int)((bits >> 52) & 0x7FF);
+   mantissa = bits & 0xFFFFFFFFFFFFFULL;
+
+   // Infinity, NaN and values from 2^53 are formatted by snprintf
+   if (exponent == 0x7FF || exponent >= 1023 + 53)
+   {
+      return 0;
+   }
+
+   if (exponent == 0)
+   {
+      exponent = 1;
+   }
+   else
+   {
+      mantissa |= 1ULL << 52;
+   }
+
+   // The value is mantissa / 2^shift, and mantissa * 10^6 fits in 73 bits
+   shift = 1075 - exponent;
+   scaled = (unsigned __int128)mantissa * 1000000;
+
+   if (shift <= 0)
+   {
+      scaled <<= -shift;
+   }
+   else if (shift >= 75)
+   {
+      scaled = 0;
+   }
+   else
+   {
+      // Round the exact value to six decimals, half to even like printf
+      rest = scaled & (((unsigned __int128)1 << shift) - 1);
+      half = (unsigned __int128)1 << (shift - 1);
+      scaled >>= shift;
+      if (rest > half || (rest == half && (scaled & 1)))
+      {
+         scaled++;
+      }
+   }
+
+   whole = (uint64_t)(scaled / 1000000);
+   fraction = (uint64_t)(scaled % 1000000);
+
+   if (negative)
+   {
+      buf[n++] = '-';
+   }
+
+   n += format_uint(whole, buf + n);
+   buf[n++] = '.';
+
+   for (int i = 5; i >= 0; i--)
+   {
+      buf[n + i] = (char)('0' + fraction % 10);
+      fraction /= 10;
+   }
+   n += 6;
+   buf[n] = '\0';
+
+   return n;
+#else
+   (void)d;
+   (void)buf;
+   return 0;
+#endif
+}
@@ -28,6 +28,7 @@
 
 /* pgexporter */
 #include <pgexporter.h>
+#include <catalog.h>
 #include <internal.h>
 #include <logging.h>
 #include <query_alts.h>
@@ -39,7 +40,7 @@
 #include <yaml.h>
 #include <errno.h>
 
-static int pgexporter_read_yaml(struct prometheus* prometheus, int prometheus_idx, char* filename, int* number_of_metrics);
+static int pgexporter_read_yaml(struct configuration* config, int prometheus_idx, char* filename, int* number_of_metrics);
 
 static int get_yaml_files(char* base, int* number_of_yaml_files, char*** files);
 static bool is_yaml_file(char* filename);
@@ -75,6 +76,14 @@ typedef struct yaml_metric
    char* sort;
    char* collector;
    char* server;
+   int interval;
+   int refresh_interval;
+   int timeout;
+   int max_series;
+   int top_k;
+   char* other;
+   char* incremental;
+   char* database;
 } __attribute__ ((aligned (64))) yaml_metric_t;
 
 // Config's Structure
@@ -136,8 +145,8 @@ static void free_yaml_queries(yaml_query_t** queries, size_t n_queries);
 // Free allocated memory for YAML columns
 static void free_yaml_columns(yaml_column_t** columns, size_t n_columns);
 
-// Extract the meaning of the `yaml_config` and load the metrics into `prometheus`
-static int semantics_yaml(struct prometheus* prometheus, int prometheus_idx, yaml_config_t* yaml_config);
+// Extract the meaning of the `yaml_config` and load the metrics into the catalog of `config`
+static int semantics_yaml(struct configuration* config, int prometheus_idx, yaml_config_t* yaml_config);
 
 int
 pgexporter_read_metrics_configuration(void* shmem)
@@ -155,7 +164,7 @@ pgexporter_read_metrics_configuration(void* shmem)
    if (pgexporter_is_file(config->metrics_path))
    {
       number_of_metrics = 0;
-      if (pgexporter_read_yaml(config->prometheus, idx_metrics, config->metrics_path, &number_of_metrics))
+      if (pgexporter_read_yaml(config, idx_metrics, config->metrics_path, &number_of_metrics))
       {
          return 1;
       }
@@ -174,7 +183,7 @@ pgexporter_read_metrics_configuration(void* shmem)
                                         yaml_files[i]
                                         );
 
-         if (pgexporter_read_yaml(config->prometheus, idx_metrics, yaml_path, &number_of_metrics))
+         if (pgexporter_read_yaml(config, idx_metrics, yaml_path, &number_of_metrics))
          {
             free(yaml_path);
             yaml_path = NULL;
@@ -207,9 +216,16 @@ pgexporter_read_internal_yaml_metrics(struct configuration* config, bool start)
 {
    int number_of_metrics = 0;
    int ret;
-   FILE* internal_yaml_ptr = fmemopen(INTERNAL_YAML, strlen(INTERNAL_YAML), "r");
+   FILE* internal_yaml_ptr = NULL;
 
-   ret = pgexporter_read_yaml_from_file_pointer(config->prometheus, 0, &number_of_metrics, internal_yaml_ptr);
+   if (start && pgexporter_catalog_begin(config))
+   {
+      return 1;
+   }
+
+   internal_yaml_ptr = fmemopen(INTERNAL_YAML, strlen(INTERNAL_YAML), "r");
+
+   ret = pgexporter_read_yaml_from_file_pointer(config, start ? 0 : config->number_of_metrics, &number_of_metrics, internal_yaml_ptr);
    fclose(internal_yaml_ptr);
 
    if (ret)
@@ -228,7 +244,7 @@ pgexporter_read_internal_yaml_metrics(struct configuration* config, bool start)
 }
 
 static int
-pgexporter_read_yaml(struct prometheus* prometheus, int prometheus_idx, char* filename, int* number_of_metrics)
+pgexporter_read_yaml(struct configuration* config, int prometheus_idx, char* filename, int* number_of_metrics)
 {
    FILE* file;
 
@@ -239,7 +255,7 @@ pgexporter_read_yaml(struct prometheus* prometheus, int prometheus_idx, char* fi
       return 1;
    }
 
-   int ret = pgexporter_read_yaml_from_file_pointer(prometheus, prometheus_idx, number_of_metrics, file);
+   int ret = pgexporter_read_yaml_from_file_pointer(config, prometheus_idx, number_of_metrics, file);
 
    fclose(file);
 
@@ -247,7 +263,7 @@ pgexporter_read_yaml(struct prometheus* prometheus, int prometheus_idx, char* fi
 }
 
 int
-pgexporter_read_yaml_from_file_pointer(struct prometheus* prometheus, int prometheus_idx, int* number_of_metrics, FILE* file)
+pgexporter_read_yaml_from_file_pointer(struct configuration* config, int prometheus_idx, int* number_of_metrics, FILE* file)
 {
    int ret = 0;
    yaml_config_t yaml_config;
@@ -262,7 +278,7 @@ pgexporter_read_yaml_from_file_pointer(struct prometheus* prometheus, int promet
 
    *number_of_metrics += yaml_config.n_metrics;
 
-   if (semantics_yaml(prometheus, prometheus_idx, &yaml_config))
+   if (semantics_yaml(config, prometheus_idx, &yaml_config))
    {
       ret = 1;
       goto end;
@@ -586,6 +602,62 @@ parse_metrics(yaml_parser_t* parser_ptr, yaml_event_t* event_ptr, parser_state_t
                   goto error;
                }
             }
+            else if (!strcmp(buf, "interval"))
+            {
+               if (parse_int(parser_ptr, event_ptr, state_ptr, &(*metrics)[*n_metrics].interval))
+               {
+                  goto error;
+               }
+            }
+            else if (!strcmp(buf, "refresh_interval"))
+            {
+               if (parse_int(parser_ptr, event_ptr, state_ptr, &(*metrics)[*n_metrics].refresh_interval))
+               {
+                  goto error;
+               }
+            }
+            else if (!strcmp(buf, "timeout"))
+            {
+               if (parse_int(parser_ptr, event_ptr, state_ptr, &(*metrics)[*n_metrics].timeout))
+               {
+                  goto error;
+               }
+            }
+            else if (!strcmp(buf, "max_series"))
+            {
+               if (parse_int(parser_ptr, event_ptr, state_ptr, &(*metrics)[*n_metrics].max_series))
+               {
+                  goto error;
+               }
+            }
+            else if (!strcmp(buf, "top_k"))
+            {
+               if (parse_int(parser_ptr, event_ptr, state_ptr, &(*metrics)[*n_metrics].top_k))
+               {
+                  goto error;
+               }
+            }
+            else if (!strcmp(buf, "other"))
+            {
+               if (parse_string(parser_ptr, event_ptr, state_ptr, &(*metrics)[*n_metrics].other))
+               {
+                  goto error;
+               }
+            }
+            else if (!strcmp(buf, "incremental"))
+            {
+               if (parse_string(parser_ptr, event_ptr, state_ptr, &(*metrics)[*n_metrics].incremental))
+               {
+                  goto error;
+               }
+            }
+            else if (!strcmp(buf, "database"))
+            {
+               if (parse_string(parser_ptr, event_ptr, state_ptr, &(*metrics)[*n_metrics].database))
+               {
+                  goto error;
+               }
+            }
             else if (!strcmp(buf, "queries"))
             {
                if (parse_queries(parser_ptr, event_ptr, state_ptr, yaml_config, &(*metrics)[*n_metrics].queries, &(*metrics)[*n_metrics].n_queries))
@@ -1015,6 +1087,18 @@ free_yaml_metrics(yaml_metric_t** metrics, size_t n_metrics)
       {
          free((*metrics)[i].server);
       }
+      if ((*metrics)[i].other)
+      {
+         free((*metrics)[i].other);
+      }
+      if ((*metrics)[i].incremental)
+      {
+         free((*metrics)[i].incremental);
+      }
+      if ((*metrics)[i].database)
+      {
+         free((*metrics)[i].database);
+      }
       if ((*metrics)[i].queries)
       {
          free_yaml_queries(&(*metrics)[i].queries, (*metrics)[i].n_queries);
@@ -1068,18 +1152,12 @@ free_yaml_columns(yaml_column_t** columns, size_t n_columns)
 }
 
 static int
-semantics_yaml(struct prometheus* prometheus, int prometheus_idx, yaml_config_t* yaml_config)
+semantics_yaml(struct configuration* config, int prometheus_idx, yaml_config_t* yaml_config)
 {
    struct prometheus* prom = NULL;
 
    for (int i = 0; i < yaml_config->n_metrics; i++)
    {
-      if (prometheus_idx + i >= NUMBER_OF_METRICS)
-      {
-         pgexporter_log_error("The number of metrics exceed the maximum limit of %d.", NUMBER_OF_METRICS);
-         return 1;
-      }
-
       if (yaml_config->metrics[i].tag == NULL)
       {
          pgexporter_log_error("No tag defined for '%s' (%d)",
@@ -1096,10 +1174,56 @@ semantics_yaml(struct prometheus* prometheus, int prometheus_idx, yaml_config_t*
          return 1;
       }
 
-      prom = &prometheus[prometheus_idx + i];
+      prom = pgexporter_catalog_metric(config, prometheus_idx + i);
+      if (prom == NULL)
+      {
+         pgexporter_log_error("Unable to allocate the metric '%s'", yaml_config->metrics[i].tag);
+         return 1;
+      }
 
       memcpy(prom->tag, yaml_config->metrics[i].tag, MIN(MISC_LENGTH - 1, strlen(yaml_config->metrics[i].tag)));
-      memcpy(prom->collector, yaml_config->metrics[i].collector, MIN(MAX_COLLECTOR_LENGTH - 1, strlen(yaml_config->metrics[i].collector)));
+      prom->collector = pgexporter_catalog_strdup(config, yaml_config->metrics[i].collector);
+      prom->databases = pgexporter_catalog_strdup(config, yaml_config->metrics[i].database);
+
+      // Interval
+      if (yaml_config->metrics[i].interval < 0)
+      {
+         pgexporter_log_error("pgexporter: unexpected interval %d", yaml_config->metrics[i].interval);
+         return 1;
+      }
+      prom->interval = yaml_config->metrics[i].interval;
+
+      // Refresh interval
+      if (yaml_config->metrics[i].refresh_interval < 0)
+      {
+         pgexporter_log_error("pgexporter: unexpected refresh_interval %d", yaml_config->metrics[i].refresh_interval);
+         return 1;
+      }
+      prom->refresh_interval = yaml_config->metrics[i].refresh_interval;
+
+      // Timeout
+      if (yaml_config->metrics[i].timeout < 0)
+      {
+         pgexporter_log_error("pgexporter: unexpected timeout %d", yaml_config->metrics[i].timeout);
+         return 1;
+      }
+      prom->timeout = yaml_config->metrics[i].timeout;
+
+      // Series limit
+      if (yaml_config->metrics[i].max_series < 0 || yaml_config->metrics[i].top_k < 0)
+      {
+         pgexporter_log_error("pgexporter: unexpected max_series %d or top_k %d",
+                              yaml_config->metrics[i].max_series, yaml_config->metrics[i].top_k);
+         return 1;
+      }
+      prom->max_series = yaml_config->metrics[i].max_series;
+      prom->top_k = yaml_config->metrics[i].top_k;
+      prom->other = yaml_config->metrics[i].other != NULL &&
+                    (!strcmp(yaml_config->metrics[i].other, "true") || !strcmp(yaml_config->metrics[i].other, "on") ||
+                     !strcmp(yaml_config->metrics[i].other, "yes"));
+      prom->incremental = yaml_config->metrics[i].incremental != NULL &&
+                          (!strcmp(yaml_config->metrics[i].incremental, "true") || !strcmp(yaml_config->metrics[i].incremental, "on") ||
+                           !strcmp(yaml_config->metrics[i].incremental, "yes"));
 
       // Sort Type
       if (!yaml_config->metrics[i].sort || !strcmp(yaml_config->metrics[i].sort, "name"))
@@ -1129,6 +1253,10 @@ semantics_yaml(struct prometheus* prometheus, int prometheus_idx, yaml_config_t*
       {
          prom->server_query_type = SERVER_QUERY_REPLICA;
       }
+      else if (!strcmp(yaml_config->metrics[i].server, "any_replica"))
+      {
+         prom->server_query_type = SERVER_QUERY_ANY_REPLICA;
+      }
       else
       {
          pgexporter_log_error("pgexporter: unexpected server %s", yaml_config->metrics[i].server);
@@ -1138,51 +1266,59 @@ semantics_yaml(struct prometheus* prometheus, int prometheus_idx, yaml_config_t*
       // Queries
       for (int j = 0; j < yaml_config->metrics[i].n_queries; j++)
       {
-
+         int n_columns;
+         int type;
+         bool is_histogram = false;
+         size_t node;
+         size_t columns;
+         size_t names;
+         size_t query;
          struct query_alts* new_query = NULL;
-         void* new_query_shmem = NULL;
+         struct column* column = NULL;
 
-         pgexporter_create_shared_memory(sizeof(struct query_alts), HUGEPAGE_OFF, &new_query_shmem);
-         new_query = (struct query_alts*) new_query_shmem;
+         n_columns = MIN(yaml_config->metrics[i].queries[j].n_columns, MAX_NUMBER_OF_COLUMNS);
 
-         new_query->n_columns = MIN(yaml_config->metrics[i].queries[j].n_columns, MAX_NUMBER_OF_COLUMNS);
+         // The pool moves as it grows, so the node is filled in at the end
+         node = pgexporter_catalog_alloc(config, sizeof(struct query_alts));
+         columns = pgexporter_catalog_alloc(config, n_columns * sizeof(struct column));
+         names = pgexporter_catalog_alloc(config, n_columns * sizeof(char*));
+         query = pgexporter_catalog_strdup(config, yaml_config->metrics[i].queries[j].query);
 
-         memcpy(new_query->query, yaml_config->metrics[i].queries[j].query, MIN(MAX_QUERY_LENGTH - 1, strlen(yaml_config->metrics[i].queries[j].query)));
-         new_query->version = yaml_config->metrics[i].queries[j].version;
+         if (node == 0 || columns == 0 || names == 0)
+         {
+            pgexporter_log_error("Unable to allocate the queries of the metric '%s'", yaml_config->metrics[i].tag);
+            return 1;
+         }
 
          // Columns
-         for (int k = 0; k < new_query->n_columns; k++)
+         for (int k = 0; k < n_columns; k++)
          {
+            size_t name;
+            size_t description;
 
             // Name
-            if (yaml_config->metrics[i].queries[j].columns[k].name)
-            {
-               memcpy(new_query->columns[k].name, yaml_config->metrics[i].queries[j].columns[k].name, MIN(MISC_LENGTH - 1, strlen(yaml_config->metrics[i].queries[j].columns[k].name)));
-            }
+            name = pgexporter_catalog_strdup(config, yaml_config->metrics[i].queries[j].columns[k].name);
 
             // Description
-            if (yaml_config->metrics[i].queries[j].columns[k].description)
-            {
-               memcpy(new_query->columns[k].description, yaml_config->metrics[i].queries[j].columns[k].description, MIN(MISC_LENGTH - 1, strlen(yaml_config->metrics[i].queries[j].columns[k].description)));
-            }
+            description = pgexporter_catalog_strdup(config, yaml_config->metrics[i].queries[j].columns[k].description);
 
             // Type
             if (!strcmp(yaml_config->metrics[i].queries[j].columns[k].type, "label"))
             {
-               new_query->columns[k].type = LABEL_TYPE;
+               type = LABEL_TYPE;
             }
             else if (!strcmp(yaml_config->metrics[i].queries[j].columns[k].type, "counter"))
             {
-               new_query->columns[k].type = COUNTER_TYPE;
+               type = COUNTER_TYPE;
             }
             else if (!strcmp(yaml_config->metrics[i].queries[j].columns[k].type, "gauge"))
             {
-               new_query->columns[k].type = GAUGE_TYPE;
+               type = GAUGE_TYPE;
             }
             else if (!strcmp(yaml_config->metrics[i].queries[j].columns[k].type, "histogram"))
             {
-               new_query->columns[k].type = HISTOGRAM_TYPE;
-               new_query->is_histogram = true;
+               type = HISTOGRAM_TYPE;
+               is_histogram = true;
             }
             else
             {
@@ -1191,14 +1327,26 @@ semantics_yaml(struct prometheus* prometheus, int prometheus_idx, yaml_config_t*
                return 1;
             }
 
+            column = (struct column*)(pgexporter_catalog_pool(config) + columns) + k;
+            column->type = type;
+            column->name = name;
+            column->description = description;
          }
 
+         new_query = (struct query_alts*)(pgexporter_catalog_pool(config) + node);
+         new_query->n_columns = n_columns;
+         new_query->columns = columns;
+         new_query->names = names;
+         new_query->query = query;
+         new_query->is_histogram = is_histogram;
+         new_query->version = yaml_config->metrics[i].queries[j].version;
+
          if (yaml_config->metrics[i].queries[j].version == 0)
          {
             new_query->version = yaml_config->default_version;
          }
 
-         prom->root = pgexporter_insert_node_avl(prom->root, &new_query);
+         prom->root = pgexporter_insert_node_avl(pgexporter_catalog_pool(config), prom->root, node);
       }
    }
 
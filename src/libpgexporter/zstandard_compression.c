@@ -74,6 +74,25 @@ pgexporter_zstdc_string(char* s, unsigned char** buffer, size_t* buffer_size)
    return 0;
 }
 
+int
+pgexporter_zstdc_buffer(void* source, size_t source_size, void* destination, size_t capacity, size_t* size)
+{
+   size_t compressed_size;
+
+   *size = 0;
+
+   compressed_size = ZSTD_compress(destination, capacity, source, source_size, 1);
+   if (ZSTD_isError(compressed_size))
+   {
+      /* The destination is too small */
+      return 1;
+   }
+
+   *size = compressed_size;
+
+   return 0;
+}
+
 int
 pgexporter_zstdd_string(unsigned char* compressed_buffer, size_t compressed_size, char** output_string)
 {
@@ -29,6 +29,9 @@
 /* pgexporter */
 #include <pgexporter.h>
 #include <bridge.h>
+#include <catalog.h>
+#include <cache.h>
+#include <cluster.h>
 #include <cmd.h>
 #include <configuration.h>
 #include <connection.h>
@@ -39,13 +42,17 @@
 #include <memory.h>
 #include <network.h>
 #include <prometheus.h>
+#include <prometheus_client.h>
 #include <queries.h>
-#include <query_alts.h>
 #include <remote.h>
+#include <remote_write.h>
 #include <security.h>
 #include <server.h>
 #include <shmem.h>
+#include <stats.h>
 #include <status.h>
+#include <trace.h>
+#include <uring.h>
 #include <utils.h>
 #include <yaml_configuration.h>
 #include <json_configuration.h>
@@ -62,6 +69,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/resource.h>
@@ -69,6 +77,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #include <openssl/crypto.h>
 #ifdef HAVE_SYSTEMD
@@ -77,6 +86,10 @@
 
 #define MAX_FDS 64
 
+#define WORKER_METRICS     0
+#define WORKER_BRIDGE      1
+#define WORKER_BRIDGE_JSON 2
+
 static void accept_mgt_cb(struct ev_loop* loop, struct ev_io* watcher, int revents);
 static void accept_transfer_cb(struct ev_loop* loop, struct ev_io* watcher, int revents);
 static void accept_metrics_cb(struct ev_loop* loop, struct ev_io* watcher, int revents);
@@ -93,6 +106,25 @@ static void remove_pidfile(void);
 static int  create_lockfile(int port);
 static void remove_lockfile(int port);
 static void shutdown_ports(void);
+static void start_workers(void);
+static void start_worker(int slot);
+static void shutdown_workers(void);
+static void worker_cb(struct ev_loop* loop, struct ev_child* watcher, int revents);
+static void worker_main(void);
+static void worker_stop(int sig);
+static void start_collector(void);
+static void shutdown_collector(void);
+static void collector_cb(struct ev_loop* loop, struct ev_child* watcher, int revents);
+static void collector_main(void);
+static void start_refresher(void);
+static void shutdown_refresher(void);
+static void refresher_cb(struct ev_loop* loop, struct ev_child* watcher, int revents);
+static void refresher_main(void);
+static void start_heartbeat(void);
+static void shutdown_heartbeat(void);
+static void heartbeat_cb(struct ev_loop* loop, struct ev_child* watcher, int revents);
+static void heartbeat_main(void);
+static void release_process(pid_t pid);
 
 struct accept_io
 {
@@ -121,6 +153,19 @@ static struct accept_io io_management[MAX_FDS];
 static int* management_fds = NULL;
 static int management_fds_length = -1;
 static struct accept_io io_transfer;
+static pid_t workers[NUMBER_OF_WORKERS];
+static struct ev_child io_workers[NUMBER_OF_WORKERS];
+static volatile sig_atomic_t worker_running = 1;
+static pid_t collector = 0;
+static struct ev_child io_collector;
+static pid_t refresher = 0;
+static struct ev_child io_refresher;
+static pid_t heartbeat = 0;
+static struct ev_child io_heartbeat;
+
+static size_t prometheus_cache_shmem_size = 0;
+static size_t bridge_cache_shmem_size = 0;
+static size_t bridge_json_cache_shmem_size = 0;
 
 static void
 start_mgt(void)
@@ -207,7 +252,10 @@ start_metrics(void)
          ev_io_init((struct ev_io*)&io_metrics[i], accept_metrics_cb, sockfd, EV_READ);
          io_metrics[i].socket = sockfd;
          io_metrics[i].argv = argv_ptr;
-         ev_io_start(main_loop, (struct ev_io*)&io_metrics[i]);
+         if (config->workers == 0)
+         {
+            ev_io_start(main_loop, (struct ev_io*)&io_metrics[i]);
+         }
       }
    }
 }
@@ -247,7 +295,10 @@ start_bridge(void)
          ev_io_init((struct ev_io*)&io_bridge[i], accept_bridge_cb, sockfd, EV_READ);
          io_bridge[i].socket = sockfd;
          io_bridge[i].argv = argv_ptr;
-         ev_io_start(main_loop, (struct ev_io*)&io_bridge[i]);
+         if (config->workers == 0)
+         {
+            ev_io_start(main_loop, (struct ev_io*)&io_bridge[i]);
+         }
       }
    }
 }
@@ -287,7 +338,10 @@ start_bridge_json(void)
          ev_io_init((struct ev_io*)&io_bridge_json[i], accept_bridge_json_cb, sockfd, EV_READ);
          io_bridge_json[i].socket = sockfd;
          io_bridge_json[i].argv = argv_ptr;
-         ev_io_start(main_loop, (struct ev_io*)&io_bridge_json[i]);
+         if (config->workers == 0)
+         {
+            ev_io_start(main_loop, (struct ev_io*)&io_bridge_json[i]);
+         }
       }
    }
 }
@@ -376,15 +430,17 @@ main(int argc, char** argv)
    char* admins_path = NULL;
    char* yaml_path = NULL;
    char* json_path = NULL;
+   unsigned char catalog_key[CATALOG_KEY_LENGTH];
    char* collector = NULL;
    char collectors[NUMBER_OF_COLLECTORS][MAX_COLLECTOR_LENGTH];
    bool daemon = false;
    pid_t pid, sid;
    struct signal_info signal_watcher[5];
    size_t shmem_size;
-   size_t prometheus_cache_shmem_size = 0;
-   size_t bridge_cache_shmem_size = 0;
-   size_t bridge_json_cache_shmem_size = 0;
+   size_t prometheus_snapshot_shmem_size = 0;
+   size_t stats_shmem_size = 0;
+   size_t trace_shmem_size = 0;
+   size_t bridge_snapshot_shmem_size = 0;
    struct configuration* config = NULL;
    int ret;
    int collector_idx = 0;
@@ -657,9 +713,6 @@ main(int argc, char** argv)
       exit(1);
    }
 
-   /* Internal Metrics Collectors YAML File */
-   pgexporter_read_internal_yaml_metrics(config, true);
-
    if (pgexporter_validate_configuration(shmem))
    {
 #ifdef HAVE_SYSTEMD
@@ -684,6 +737,17 @@ main(int argc, char** argv)
 
    config = (struct configuration*)shmem;
 
+   pgexporter_numa_shared_memory(shmem, shmem_size, config->numa);
+
+   if (pgexporter_create_ssl_ticket_keys())
+   {
+      warnx("pgexporter: Unable to create the TLS ticket keys");
+#ifdef HAVE_SYSTEMD
+      sd_notify(0, "STATUS=Unable to create the TLS ticket keys");
+#endif
+      exit(1);
+   }
+
    if (create_pidfile())
    {
       exit(1);
@@ -725,32 +789,54 @@ main(int argc, char** argv)
    if (yaml_path != NULL)
    {
       memcpy(config->metrics_path, yaml_path, MIN(strlen(yaml_path), MAX_PATH - 1));
-
-      if (pgexporter_read_metrics_configuration(shmem))
-      {
-#ifdef HAVE_SYSTEMD
-         sd_notify(0, "STATUS=Invalid metrics YAML");
-#endif
-         exit(1);
-      }
    }
    else if (json_path != NULL)
    {
       memcpy(config->metrics_path, json_path, MIN(strlen(json_path), MAX_PATH - 1));
+   }
+
+   if (pgexporter_catalog_read_cache(config, yaml_path != NULL || json_path != NULL ? config->metrics_path : NULL,
+                                     json_path != NULL, catalog_key))
+   {
+      /* Internal Metrics Collectors YAML File */
+      pgexporter_read_internal_yaml_metrics(config, true);
 
-      if (pgexporter_read_json_metrics_configuration(shmem))
+      if (yaml_path != NULL)
       {
+         if (pgexporter_read_metrics_configuration(shmem))
+         {
 #ifdef HAVE_SYSTEMD
-         sd_notify(0, "STATUS=Invalid metrics JSON");
+            sd_notify(0, "STATUS=Invalid metrics YAML");
 #endif
-         exit(1);
+            exit(1);
+         }
+      }
+      else if (json_path != NULL)
+      {
+         if (pgexporter_read_json_metrics_configuration(shmem))
+         {
+#ifdef HAVE_SYSTEMD
+            sd_notify(0, "STATUS=Invalid metrics JSON");
+#endif
+            exit(1);
+         }
       }
+
+      pgexporter_catalog_write_cache(config, catalog_key);
    }
    if (yaml_path != NULL || json_path != NULL)
    {
       pgexporter_log_debug("Reading : %d metrics from path", config->number_of_metrics);
    }
 
+   if (pgexporter_catalog_publish(config))
+   {
+#ifdef HAVE_SYSTEMD
+      sd_notify(0, "STATUS=Unable to allocate the metrics");
+#endif
+      exit(1);
+   }
+
    if (daemon)
    {
       if (config->log_type == PGEXPORTER_LOGGING_TYPE_CONSOLE)
@@ -790,6 +876,20 @@ main(int argc, char** argv)
 
    pgexporter_set_proc_title(argc, argv, "main", NULL);
 
+   if (pgexporter_start_log_writer())
+   {
+      pgexporter_log_warn("Lines are logged directly, since the log writer could not be started");
+   }
+
+   /* Before the caches, so their memory is accounted */
+   if (pgexporter_stats_init(&stats_shmem_size, &stats_shmem))
+   {
+#ifdef HAVE_SYSTEMD
+      sd_notifyf(0, "STATUS=Error in creating and initializing statistics shared memory");
+#endif
+      errx(1, "Error in creating and initializing statistics shared memory");
+   }
+
    if (pgexporter_init_prometheus_cache(&prometheus_cache_shmem_size, &prometheus_cache_shmem))
    {
 #ifdef HAVE_SYSTEMD
@@ -798,6 +898,25 @@ main(int argc, char** argv)
       errx(1, "Error in creating and initializing prometheus cache shared memory");
    }
 
+   if (pgexporter_trace_init(&trace_shmem_size, &trace_shmem))
+   {
+#ifdef HAVE_SYSTEMD
+      sd_notifyf(0, "STATUS=Error in creating and initializing trace shared memory");
+#endif
+      errx(1, "Error in creating and initializing trace shared memory");
+   }
+
+   if (config->metrics > 0 && config->collection_interval > 0)
+   {
+      if (pgexporter_init_prometheus_snapshot(&prometheus_snapshot_shmem_size, &prometheus_snapshot_shmem))
+      {
+#ifdef HAVE_SYSTEMD
+         sd_notifyf(0, "STATUS=Error in creating and initializing prometheus snapshot shared memory");
+#endif
+         errx(1, "Error in creating and initializing prometheus snapshot shared memory");
+      }
+   }
+
    if (config->bridge > 0 && config->bridge_cache_max_age > 0 && config->bridge_cache_max_size > 0)
    {
       if (pgexporter_bridge_init_cache(&bridge_cache_shmem_size, &bridge_cache_shmem))
@@ -809,6 +928,17 @@ main(int argc, char** argv)
       }
    }
 
+   if (config->bridge > 0 && config->bridge_interval > 0)
+   {
+      if (pgexporter_bridge_init_snapshot(&bridge_snapshot_shmem_size, &bridge_snapshot_shmem))
+      {
+#ifdef HAVE_SYSTEMD
+         sd_notifyf(0, "STATUS=Error in creating and initializing bridge snapshot shared memory");
+#endif
+         errx(1, "Error in creating and initializing bridge snapshot shared memory");
+      }
+   }
+
    if (config->bridge_json > 0)
    {
       if (pgexporter_bridge_json_init_cache(&bridge_json_cache_shmem_size, &bridge_json_cache_shmem))
@@ -852,6 +982,11 @@ main(int argc, char** argv)
       exit(1);
    }
 
+   if (pgexporter_uring_enable(config->libev))
+   {
+      pgexporter_log_debug("io_uring: Enabled");
+   }
+
    ev_signal_init((struct ev_signal*)&signal_watcher[0], shutdown_cb, SIGTERM);
    ev_signal_init((struct ev_signal*)&signal_watcher[1], reload_cb, SIGHUP);
    ev_signal_init((struct ev_signal*)&signal_watcher[2], shutdown_cb, SIGINT);
@@ -1017,10 +1152,10 @@ main(int argc, char** argv)
    for (int i = 0; i < config->number_of_servers; i++)
    {
       pgexporter_log_trace("Server: %s/%d.%d -> %s", config->servers[i].name,
-                           config->servers[i].version, config->servers[i].minor_version,
-                           config->servers[i].fd != -1 ? "true" : "false");
+                           config->server_states[i].version, config->server_states[i].minor_version,
+                           pgexporter_connection_active(i) ? "true" : "false");
 
-      if (config->servers[i].fd != -1)
+      if (pgexporter_connection_active(i))
       {
          struct query* query = NULL;
 
@@ -1029,17 +1164,23 @@ main(int argc, char** argv)
 
          if (query != NULL)
          {
-            config->servers[i].extension = true;
+            config->server_states[i].extension = true;
          }
          else
          {
-            config->servers[i].extension = false;
+            config->server_states[i].extension = false;
          }
 
          pgexporter_free_query(query);
          query = NULL;
       }
    }
+   pgexporter_pool_connections();
+
+   start_workers();
+   start_collector();
+   start_refresher();
+   start_heartbeat();
 
    while (keep_running)
    {
@@ -1051,7 +1192,12 @@ main(int argc, char** argv)
    sd_notify(0, "STOPPING=1");
 #endif
 
-   pgexporter_close_connections();
+   shutdown_collector();
+   shutdown_refresher();
+   shutdown_heartbeat();
+   shutdown_workers();
+   pgexporter_pool_destroy();
+   pgexporter_prometheus_client_pool_destroy();
 
    shutdown_management();
    if (config->metrics != -1)
@@ -1088,13 +1234,27 @@ main(int argc, char** argv)
    remove_lockfile(config->bridge);
    remove_lockfile(config->bridge_json);
 
+   pgexporter_stop_log_writer();
    pgexporter_stop_logging();
 
-   pgexporter_free_query_alts(config);
+   pgexporter_catalog_destroy(config);
 
    pgexporter_destroy_shared_memory(shmem, shmem_size);
-   pgexporter_destroy_shared_memory(prometheus_cache_shmem,
-                                    prometheus_cache_shmem_size);
+   pgexporter_cache_destroy(prometheus_cache_shmem,
+                            prometheus_cache_shmem_size);
+   pgexporter_cache_destroy(prometheus_snapshot_shmem,
+                            prometheus_snapshot_shmem_size);
+   pgexporter_cache_destroy(bridge_snapshot_shmem,
+                            bridge_snapshot_shmem_size);
+   pgexporter_cache_destroy(bridge_cache_shmem,
+                            bridge_cache_shmem_size);
+   pgexporter_cache_destroy(bridge_json_cache_shmem,
+                            bridge_json_cache_shmem_size);
+   pgexporter_destroy_shared_memory(stats_shmem, stats_shmem_size);
+   if (trace_shmem != NULL)
+   {
+      pgexporter_destroy_shared_memory(trace_shmem, trace_shmem_size);
+   }
 
    pgexporter_memory_destroy();
 
@@ -1113,12 +1273,9 @@ accept_mgt_cb(struct ev_loop* loop, struct ev_io* watcher, int revents)
    socklen_t client_addr_length;
    int client_fd;
    int32_t id;
-   char* server = NULL;
-   pid_t pid;
    char* str = NULL;
    time_t start_time;
    time_t end_time;
-   struct accept_io* ai;
    struct json* payload = NULL;
    struct json* header = NULL;
    struct configuration* config;
@@ -1132,7 +1289,6 @@ accept_mgt_cb(struct ev_loop* loop, struct ev_io* watcher, int revents)
    }
 
    config = (struct configuration*)shmem;
-   ai = (struct accept_io*)watcher;
 
    errno = 0;
 
@@ -1231,45 +1387,15 @@ accept_mgt_cb(struct ev_loop* loop, struct ev_io* watcher, int revents)
    }
    else if (id == MANAGEMENT_STATUS)
    {
-      pid = fork();
-      if (pid == -1)
-      {
-         pgexporter_management_response_error(NULL, client_fd, server, MANAGEMENT_ERROR_STATUS_NOFORK, compression, encryption, payload);
-         pgexporter_log_error("Status: No fork %s (%d)", server, MANAGEMENT_ERROR_STATUS_NOFORK);
-         goto error;
-      }
-      else if (pid == 0)
-      {
-         struct json* pyl = NULL;
-
-         shutdown_ports();
-
-         pgexporter_json_clone(payload, &pyl);
-
-         pgexporter_set_proc_title(1, ai->argv, "status", NULL);
-         pgexporter_status(NULL, client_fd, compression, encryption, pyl);
-      }
+      pgexporter_status(NULL, client_fd, compression, encryption, payload);
    }
    else if (id == MANAGEMENT_STATUS_DETAILS)
    {
-      pid = fork();
-      if (pid == -1)
-      {
-         pgexporter_management_response_error(NULL, client_fd, server, MANAGEMENT_ERROR_STATUS_DETAILS_NOFORK, compression, encryption, payload);
-         pgexporter_log_error("Details: No fork %s (%d)", server, MANAGEMENT_ERROR_STATUS_DETAILS_NOFORK);
-         goto error;
-      }
-      else if (pid == 0)
-      {
-         struct json* pyl = NULL;
-
-         shutdown_ports();
-
-         pgexporter_json_clone(payload, &pyl);
-
-         pgexporter_set_proc_title(1, ai->argv, "details", NULL);
-         pgexporter_status_details(NULL, client_fd, compression, encryption, pyl);
-      }
+      pgexporter_status_details(NULL, client_fd, compression, encryption, payload);
+   }
+   else if (id == MANAGEMENT_TRACE)
+   {
+      pgexporter_trace(NULL, client_fd, compression, encryption, payload);
    }
    else if (id == MANAGEMENT_CONF_LS)
    {
@@ -1289,45 +1415,11 @@ accept_mgt_cb(struct ev_loop* loop, struct ev_io* watcher, int revents)
    }
    else if (id == MANAGEMENT_CONF_GET)
    {
-      pid = fork();
-      if (pid == -1)
-      {
-         pgexporter_management_response_error(NULL, client_fd, server, MANAGEMENT_ERROR_CONF_GET_NOFORK, compression, encryption, payload);
-         pgexporter_log_error("Conf Get: No fork %s (%d)", server, MANAGEMENT_ERROR_CONF_GET_NOFORK);
-         goto error;
-      }
-      else if (pid == 0)
-      {
-         struct json* pyl = NULL;
-
-         shutdown_ports();
-
-         pgexporter_json_clone(payload, &pyl);
-
-         pgexporter_set_proc_title(1, ai->argv, "conf get", NULL);
-         pgexporter_conf_get(NULL, client_fd, compression, encryption, pyl);
-      }
+      pgexporter_conf_get(NULL, client_fd, compression, encryption, payload);
    }
    else if (id == MANAGEMENT_CONF_SET)
    {
-      pid = fork();
-      if (pid == -1)
-      {
-         pgexporter_management_response_error(NULL, client_fd, server, MANAGEMENT_ERROR_CONF_SET_NOFORK, compression, encryption, payload);
-         pgexporter_log_error("Conf Set: No fork %s (%d)", server, MANAGEMENT_ERROR_CONF_SET_NOFORK);
-         goto error;
-      }
-      else if (pid == 0)
-      {
-         struct json* pyl = NULL;
-
-         shutdown_ports();
-
-         pgexporter_json_clone(payload, &pyl);
-
-         pgexporter_set_proc_title(1, ai->argv, "conf set", NULL);
-         pgexporter_conf_set(NULL, client_fd, compression, encryption, pyl);
-      }
+      pgexporter_conf_set(NULL, client_fd, compression, encryption, payload);
    }
    else
    {
@@ -1407,7 +1499,20 @@ accept_transfer_cb(struct ev_loop* loop __attribute__((unused)), struct ev_io* w
    }
 
    pgexporter_log_debug("pgexporter: Transfer connection: Server %d FD %d", srv, fd);
-   config->servers[srv].fd = fd;
+
+   if (srv >= TRANSFER_ENDPOINT && srv < TRANSFER_ENDPOINT + config->number_of_endpoints)
+   {
+      pgexporter_prometheus_client_pool_add(srv - TRANSFER_ENDPOINT, fd);
+   }
+   else if (srv < 0 || srv >= config->number_of_servers)
+   {
+      pgexporter_disconnect(fd);
+      goto error;
+   }
+   else
+   {
+      pgexporter_pool_add(srv, fd);
+   }
 
    pgexporter_disconnect(client_fd);
 
@@ -1483,6 +1588,9 @@ accept_metrics_cb(struct ev_loop* loop, struct ev_io* watcher, int revents)
       return;
    }
 
+   /* A response that didn't fit is cached by the next clients in a larger cache */
+   pgexporter_cache_grow(PROMETHEUS_MAX_GROWN_CACHE_SIZE, &prometheus_cache_shmem_size, &prometheus_cache_shmem);
+
    pid = fork();
    if (pid == -1)
    {
@@ -1587,6 +1695,9 @@ accept_bridge_cb(struct ev_loop* loop, struct ev_io* watcher, int revents)
       return;
    }
 
+   /* A response that didn't fit is cached by the next clients in a larger cache */
+   pgexporter_cache_grow(PROMETHEUS_MAX_BRIDGE_CACHE_SIZE, &bridge_cache_shmem_size, &bridge_cache_shmem);
+
    pid = fork();
    if (pid == -1)
    {
@@ -1676,6 +1787,13 @@ accept_bridge_json_cb(struct ev_loop* loop, struct ev_io* watcher, int revents)
       return;
    }
 
+   /* A response that didn't fit is cached by the next clients in a larger cache, */
+   /* unless the refresher is the one publishing it */
+   if (config->bridge_interval <= 0)
+   {
+      pgexporter_cache_grow(PROMETHEUS_MAX_BRIDGE_JSON_CACHE_SIZE, &bridge_json_cache_shmem_size, &bridge_json_cache_shmem);
+   }
+
    pid = fork();
    if (pid == -1)
    {
@@ -1842,6 +1960,14 @@ reload_configuration(void)
    old_metrics = config->metrics;
    old_management = config->management;
 
+   /* The processes are started over with the new definitions, and only */
+   /* the pooled connections of the servers that changed are closed */
+   shutdown_collector();
+   shutdown_refresher();
+   shutdown_heartbeat();
+   shutdown_workers();
+   pgexporter_prometheus_client_pool_destroy();
+
    pgexporter_reload_configuration(&restart);
 
    if (old_metrics != config->metrics)
@@ -1908,6 +2034,11 @@ reload_configuration(void)
       }
    }
 
+   start_workers();
+   start_collector();
+   start_refresher();
+   start_heartbeat();
+
    return restart;
 }
 
@@ -2032,3 +2163,546 @@ shutdown_ports(void)
       shutdown_management();
    }
 }
+
+static void
+start_workers(void)
+{
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   for (int i = 0; i < config->workers; i++)
+   {
+      start_worker(i);
+   }
+}
+
+static void
+start_worker(int slot)
+{
+   pid_t pid;
+
+   pid = fork();
+   if (pid == -1)
+   {
+      pgexporter_log_error("Worker: No fork (%d)", slot);
+      workers[slot] = 0;
+      return;
+   }
+   else if (pid == 0)
+   {
+      worker_main();
+   }
+
+   workers[slot] = pid;
+
+   ev_child_init(&io_workers[slot], worker_cb, pid, 0);
+   ev_child_start(main_loop, &io_workers[slot]);
+
+   pgexporter_log_debug("Worker: %d (%d)", slot, pid);
+}
+
+static void
+shutdown_workers(void)
+{
+   for (int i = 0; i < NUMBER_OF_WORKERS; i++)
+   {
+      if (workers[i] > 0)
+      {
+         ev_child_stop(main_loop, &io_workers[i]);
+         kill(workers[i], SIGTERM);
+         waitpid(workers[i], NULL, 0);
+         workers[i] = 0;
+      }
+   }
+}
+
+static void
+worker_cb(struct ev_loop* loop, struct ev_child* watcher, int revents __attribute__((unused)))
+{
+   for (int i = 0; i < NUMBER_OF_WORKERS; i++)
+   {
+      if (workers[i] == watcher->rpid)
+      {
+         ev_child_stop(loop, watcher);
+         workers[i] = 0;
+         release_process(watcher->rpid);
+
+         if (WIFEXITED(watcher->rstatus) && WEXITSTATUS(watcher->rstatus) == 1)
+         {
+            /* The worker failed to start, so don't retry */
+            pgexporter_log_error("Worker: %d (%d) failed", i, watcher->rpid);
+         }
+         else
+         {
+            pgexporter_log_warn("Worker: %d (%d) exited with status %d", i, watcher->rpid, watcher->rstatus);
+
+            if (keep_running)
+            {
+               start_worker(i);
+            }
+         }
+
+         return;
+      }
+   }
+}
+
+static void
+release_process(pid_t pid)
+{
+   /* The leases of the connections held by the process are free again */
+   pgexporter_pool_reclaim(pid);
+
+   /* The slots of the caches read by the process are free again */
+   pgexporter_cache_release_readers((struct prometheus_cache*)prometheus_cache_shmem, pid);
+   pgexporter_cache_release_readers((struct prometheus_cache*)prometheus_snapshot_shmem, pid);
+   pgexporter_cache_release_readers((struct prometheus_cache*)bridge_cache_shmem, pid);
+   pgexporter_cache_release_readers((struct prometheus_cache*)bridge_snapshot_shmem, pid);
+   pgexporter_cache_release_readers((struct prometheus_cache*)bridge_json_cache_shmem, pid);
+}
+
+static void
+worker_main(void)
+{
+   int nfds = 0;
+   int client_fd;
+   struct pollfd fds[3 * MAX_FDS];
+   int types[3 * MAX_FDS];
+   struct sigaction sa;
+   SSL_CTX* ctx = NULL;
+   SSL* client_ssl = NULL;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   memset(&sa, 0, sizeof(struct sigaction));
+   sa.sa_handler = worker_stop;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGTERM, &sa, NULL);
+   sigaction(SIGINT, &sa, NULL);
+   sa.sa_handler = SIG_IGN;
+   sigaction(SIGHUP, &sa, NULL);
+   sigaction(SIGALRM, &sa, NULL);
+
+   /* The main process handles management, and the listening sockets are shared between the workers */
+   shutdown_management();
+
+   pgexporter_start_logging();
+   pgexporter_memory_init();
+   pgexporter_pool_connections();
+   pgexporter_prometheus_client_pool_connections();
+
+   pgexporter_set_proc_title(1, argv_ptr, "worker", NULL);
+
+   if (strlen(config->metrics_cert_file) > 0 && strlen(config->metrics_key_file) > 0)
+   {
+      if (pgexporter_create_ssl_ctx(false, &ctx) ||
+          pgexporter_init_ssl_server_ctx(ctx, config->metrics_key_file, config->metrics_cert_file, config->metrics_ca_file))
+      {
+         pgexporter_log_error("Could not create metrics SSL context");
+         goto error;
+      }
+   }
+
+   for (int i = 0; config->metrics > 0 && i < metrics_fds_length; i++)
+   {
+      types[nfds] = WORKER_METRICS;
+      fds[nfds++].fd = *(metrics_fds + i);
+   }
+   for (int i = 0; config->bridge > 0 && i < bridge_fds_length; i++)
+   {
+      types[nfds] = WORKER_BRIDGE;
+      fds[nfds++].fd = *(bridge_fds + i);
+   }
+   for (int i = 0; config->bridge > 0 && config->bridge_json > 0 && i < bridge_json_fds_length; i++)
+   {
+      types[nfds] = WORKER_BRIDGE_JSON;
+      fds[nfds++].fd = *(bridge_json_fds + i);
+   }
+
+   for (int i = 0; i < nfds; i++)
+   {
+      /* Only one of the workers gets the connection */
+      pgexporter_socket_nonblocking(fds[i].fd, true);
+      fds[i].events = POLLIN;
+   }
+
+   while (worker_running)
+   {
+      if (poll(fds, nfds, -1) == -1)
+      {
+         if (errno == EINTR)
+         {
+            errno = 0;
+            continue;
+         }
+
+         pgexporter_log_error("Worker: poll: %s", strerror(errno));
+         goto error;
+      }
+
+      for (int i = 0; worker_running && i < nfds; i++)
+      {
+         if (!(fds[i].revents & POLLIN))
+         {
+            continue;
+         }
+
+         client_fd = accept(fds[i].fd, NULL, NULL);
+         if (client_fd == -1)
+         {
+            errno = 0;
+            continue;
+         }
+
+         if (types[i] == WORKER_METRICS)
+         {
+            client_ssl = NULL;
+
+            if (ctx == NULL || !pgexporter_create_ssl_server_from_ctx(ctx, client_fd, &client_ssl))
+            {
+               pgexporter_prometheus_serve(client_ssl, client_fd);
+            }
+            else
+            {
+               pgexporter_log_error("Could not create metrics SSL server");
+            }
+
+            pgexporter_close_ssl(client_ssl);
+         }
+         else if (types[i] == WORKER_BRIDGE)
+         {
+            pgexporter_bridge_serve(client_fd);
+         }
+         else
+         {
+            pgexporter_bridge_json_serve(client_fd);
+         }
+
+         pgexporter_disconnect(client_fd);
+         pgexporter_memory_free();
+      }
+   }
+
+   SSL_CTX_free(ctx);
+   pgexporter_pool_destroy();
+   pgexporter_prometheus_client_pool_destroy();
+   pgexporter_memory_destroy();
+   pgexporter_stop_logging();
+
+   exit(0);
+
+error:
+
+   SSL_CTX_free(ctx);
+   pgexporter_pool_destroy();
+   pgexporter_prometheus_client_pool_destroy();
+   pgexporter_memory_destroy();
+   pgexporter_stop_logging();
+
+   exit(1);
+}
+
+static void
+worker_stop(int sig __attribute__((unused)))
+{
+   worker_running = 0;
+}
+
+static void
+start_collector(void)
+{
+   pid_t pid;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->metrics <= 0 || config->collection_interval <= 0 || prometheus_snapshot_shmem == NULL)
+   {
+      return;
+   }
+
+   pid = fork();
+   if (pid == -1)
+   {
+      pgexporter_log_error("Collector: No fork");
+      collector = 0;
+      return;
+   }
+   else if (pid == 0)
+   {
+      collector_main();
+   }
+
+   collector = pid;
+
+   ev_child_init(&io_collector, collector_cb, pid, 0);
+   ev_child_start(main_loop, &io_collector);
+
+   pgexporter_log_debug("Collector: %d", pid);
+}
+
+static void
+shutdown_collector(void)
+{
+   if (collector > 0)
+   {
+      ev_child_stop(main_loop, &io_collector);
+      kill(collector, SIGTERM);
+      waitpid(collector, NULL, 0);
+      collector = 0;
+   }
+}
+
+static void
+collector_cb(struct ev_loop* loop, struct ev_child* watcher, int revents __attribute__((unused)))
+{
+   ev_child_stop(loop, watcher);
+   collector = 0;
+   release_process(watcher->rpid);
+
+   pgexporter_log_warn("Collector: %d exited with status %d", watcher->rpid, watcher->rstatus);
+
+   if (keep_running)
+   {
+      start_collector();
+   }
+}
+
+static void
+collector_main(void)
+{
+   int next;
+   struct sigaction sa;
+
+   memset(&sa, 0, sizeof(struct sigaction));
+   sa.sa_handler = worker_stop;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGTERM, &sa, NULL);
+   sigaction(SIGINT, &sa, NULL);
+   sa.sa_handler = SIG_IGN;
+   sigaction(SIGHUP, &sa, NULL);
+   sigaction(SIGALRM, &sa, NULL);
+
+   shutdown_management();
+
+   pgexporter_start_logging();
+   pgexporter_memory_init();
+   pgexporter_pool_connections();
+   pgexporter_remote_write_start();
+
+   pgexporter_set_proc_title(1, argv_ptr, "collector", NULL);
+
+   while (worker_running)
+   {
+      next = pgexporter_prometheus_collect();
+
+      /* SIGTERM interrupts the sleep */
+      sleep(next);
+   }
+
+   pgexporter_remote_write_stop();
+   pgexporter_prometheus_collect_destroy();
+   pgexporter_pool_destroy();
+   pgexporter_memory_destroy();
+   pgexporter_stop_logging();
+
+   exit(0);
+}
+
+static void
+start_refresher(void)
+{
+   pid_t pid;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->bridge <= 0 || config->bridge_interval <= 0 || bridge_snapshot_shmem == NULL)
+   {
+      return;
+   }
+
+   pid = fork();
+   if (pid == -1)
+   {
+      pgexporter_log_error("Refresher: No fork");
+      refresher = 0;
+      return;
+   }
+   else if (pid == 0)
+   {
+      refresher_main();
+   }
+
+   refresher = pid;
+
+   ev_child_init(&io_refresher, refresher_cb, pid, 0);
+   ev_child_start(main_loop, &io_refresher);
+
+   pgexporter_log_debug("Refresher: %d", pid);
+}
+
+static void
+shutdown_refresher(void)
+{
+   if (refresher > 0)
+   {
+      ev_child_stop(main_loop, &io_refresher);
+      kill(refresher, SIGTERM);
+      waitpid(refresher, NULL, 0);
+      refresher = 0;
+   }
+}
+
+static void
+refresher_cb(struct ev_loop* loop, struct ev_child* watcher, int revents __attribute__((unused)))
+{
+   ev_child_stop(loop, watcher);
+   refresher = 0;
+   release_process(watcher->rpid);
+
+   pgexporter_log_warn("Refresher: %d exited with status %d", watcher->rpid, watcher->rstatus);
+
+   if (keep_running)
+   {
+      start_refresher();
+   }
+}
+
+static void
+refresher_main(void)
+{
+   int next;
+   struct sigaction sa;
+
+   memset(&sa, 0, sizeof(struct sigaction));
+   sa.sa_handler = worker_stop;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGTERM, &sa, NULL);
+   sigaction(SIGINT, &sa, NULL);
+   sa.sa_handler = SIG_IGN;
+   sigaction(SIGHUP, &sa, NULL);
+   sigaction(SIGALRM, &sa, NULL);
+
+   shutdown_management();
+
+   pgexporter_start_logging();
+   pgexporter_memory_init();
+   pgexporter_prometheus_client_pool_connections();
+
+   pgexporter_set_proc_title(1, argv_ptr, "refresher", NULL);
+
+   while (worker_running)
+   {
+      next = pgexporter_bridge_refresh();
+
+      /* SIGTERM interrupts the sleep */
+      sleep(next);
+   }
+
+   pgexporter_bridge_refresh_destroy();
+   pgexporter_prometheus_client_pool_destroy();
+   pgexporter_memory_destroy();
+   pgexporter_stop_logging();
+
+   exit(0);
+}
+
+static void
+start_heartbeat(void)
+{
+   pid_t pid;
+   struct configuration* config;
+
+   config = (struct configuration*)shmem;
+
+   if (config->cluster_member == -1)
+   {
+      return;
+   }
+
+   pid = fork();
+   if (pid == -1)
+   {
+      pgexporter_log_error("Heartbeat: No fork");
+      heartbeat = 0;
+      return;
+   }
+   else if (pid == 0)
+   {
+      heartbeat_main();
+   }
+
+   heartbeat = pid;
+
+   ev_child_init(&io_heartbeat, heartbeat_cb, pid, 0);
+   ev_child_start(main_loop, &io_heartbeat);
+
+   pgexporter_log_debug("Heartbeat: %d", pid);
+}
+
+static void
+shutdown_heartbeat(void)
+{
+   if (heartbeat > 0)
+   {
+      ev_child_stop(main_loop, &io_heartbeat);
+      kill(heartbeat, SIGTERM);
+      waitpid(heartbeat, NULL, 0);
+      heartbeat = 0;
+   }
+}
+
+static void
+heartbeat_cb(struct ev_loop* loop, struct ev_child* watcher, int revents __attribute__((unused)))
+{
+   ev_child_stop(loop, watcher);
+   heartbeat = 0;
+   release_process(watcher->rpid);
+
+   pgexporter_log_warn("Heartbeat: %d exited with status %d", watcher->rpid, watcher->rstatus);
+
+   if (keep_running)
+   {
+      start_heartbeat();
+   }
+}
+
+static void
+heartbeat_main(void)
+{
+   int next;
+   struct sigaction sa;
+
+   memset(&sa, 0, sizeof(struct sigaction));
+   sa.sa_handler = worker_stop;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGTERM, &sa, NULL);
+   sigaction(SIGINT, &sa, NULL);
+   sa.sa_handler = SIG_IGN;
+   sigaction(SIGHUP, &sa, NULL);
+   sigaction(SIGALRM, &sa, NULL);
+   sigaction(SIGPIPE, &sa, NULL);
+
+   shutdown_management();
+
+   pgexporter_start_logging();
+   pgexporter_memory_init();
+
+   pgexporter_set_proc_title(1, argv_ptr, "heartbeat", NULL);
+
+   while (worker_running)
+   {
+      next = pgexporter_cluster_heartbeat();
+
+      /* SIGTERM interrupts the sleep */
+      sleep(next);
+   }
+
+   pgexporter_memory_destroy();
+   pgexporter_stop_logging();
+
+   exit(0);
+}